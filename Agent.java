@@ -18,13 +18,22 @@ import android.content.pm.ApplicationInfo;
 import android.content.pm.PackageInfo;
 import android.content.pm.PackageManager;
 import android.content.pm.ResolveInfo;
+import android.net.LocalServerSocket;
+import android.net.LocalSocket;
 import android.os.Build;
 import android.os.Handler;
 import android.os.Process;
+import android.os.SystemClock;
 import android.util.JsonWriter;
 
+import java.io.BufferedOutputStream;
 import java.io.BufferedWriter;
+import java.io.ByteArrayOutputStream;
+import java.io.DataOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
 import java.io.OutputStreamWriter;
+import java.io.PrintStream;
 import java.lang.reflect.Constructor;
 import java.lang.reflect.Method;
 import java.util.ArrayList;
@@ -40,6 +49,12 @@ public class Agent {
 
   private static final int USER_OWNER = 0;
 
+  private static final String SERVE_COMMAND = "--serve";
+
+  private static final Object serverLock = new Object();
+  private static boolean serverBusy = false;
+  private static long lastRequestMillis;
+
   private static Object cachedPm = null;
 
   private static ActivityManager getAm() throws Exception {
@@ -405,21 +420,22 @@ public class Agent {
     }
   }
 
-  private static void usage() throws Exception {
-    System.out.println(
+  private static void usage(PrintStream out) throws Exception {
+    out.println(
         String.format(
             "%s THING...: write JSON-format system information", PROGNAME));
-    System.out.println("Each THING is either \"process-dump\" or \"package-dump\"");
-    System.out.println("");
-    System.out.println(
+    out.println("Each THING is either \"process-dump\" or \"package-dump\"");
+    out.println("");
+    out.println(
         String.format(
             "%s help: this usage information", PROGNAME));
   }
 
-  public static void doMain(String[] args) throws Exception {
+  public static int doMain(String[] args, PrintStream out, PrintStream err)
+      throws Exception {
     if (args.length < 1) {
-      System.err.println(String.format("%s: run -h for help", PROGNAME));
-      System.exit(1);
+      err.println(String.format("%s: run -h for help", PROGNAME));
+      return 1;
     }
 
     int flags = 0;
@@ -429,7 +445,7 @@ public class Agent {
 
     for (String arg : args) {
       if (arg.equals("-h") || arg.equals("--help") || arg.equals("help")) {
-        usage();
+        usage(out);
       } else if (arg.startsWith(FIND_DEBUG_LAUNCHER_PREFIX)) {
         findDebugLauncherPackages.add(
             arg.substring(FIND_DEBUG_LAUNCHER_PREFIX.length()));
@@ -440,15 +456,15 @@ public class Agent {
       } else if (arg.equals("get-activities")) {
         flags |= GET_ACTIVITIES;
       } else {
-        System.err.println(String.format("%s: unknown command %s", PROGNAME, arg));
-        System.exit(1);
+        err.println(String.format("%s: unknown command %s", PROGNAME, arg));
+        return 1;
       }
     }
 
     JsonWriter writer = new JsonWriter(
         new BufferedWriter(
             new OutputStreamWriter(
-                System.out, "UTF-8")));
+                out, "UTF-8")));
 
     writer.setIndent("  ");
     writer.beginObject();
@@ -465,16 +481,134 @@ public class Agent {
 
     writer.endObject();
     writer.flush();
+    return 0;
   }
 
-  public static void main(String[] args) {
+  private static int runMain(String[] args, PrintStream out, PrintStream err) {
     // Need to explicitly catch at top-level: if we allow the exception to propagate, the VM will
     // abort and print the exception only to logcat, not stderr, where we want it.
     try {
-      doMain(args);
+      return doMain(args, out, err);
     } catch (Throwable ex) {
-      ex.printStackTrace(System.err);
-      System.exit(2);
+      ex.printStackTrace(err);
+      return 2;
+    }
+  }
+
+  private static void handleRequest(LocalSocket client) throws Exception {
+    // The socket name is public, so anyone can connect; serve only our own user.
+    if (client.getPeerCredentials().getUid() != Process.myUid()) {
+      return;
+    }
+
+    InputStream in = client.getInputStream();
+    ByteArrayOutputStream request = new ByteArrayOutputStream();
+    byte[] buf = new byte[4096];
+    int nr;
+    while ((nr = in.read(buf)) > 0) {
+      request.write(buf, 0, nr);
+    }
+
+    byte[] requestBytes = request.toByteArray();
+    ArrayList<String> args = new ArrayList<>();
+    int argStart = 0;
+    for (int i = 0; i < requestBytes.length; ++i) {
+      if (requestBytes[i] == 0) {
+        args.add(new String(requestBytes, argStart, i - argStart, "UTF-8"));
+        argStart = i + 1;
+      }
+    }
+
+    ByteArrayOutputStream outBytes = new ByteArrayOutputStream();
+    ByteArrayOutputStream errBytes = new ByteArrayOutputStream();
+    PrintStream out = new PrintStream(outBytes, false, "UTF-8");
+    PrintStream err = new PrintStream(errBytes, false, "UTF-8");
+    int status = runMain(args.toArray(new String[args.size()]), out, err);
+    out.flush();
+    err.flush();
+
+    DataOutputStream reply = new DataOutputStream(
+        new BufferedOutputStream(client.getOutputStream()));
+    reply.writeInt(status);
+    reply.writeInt(errBytes.size());
+    errBytes.writeTo(reply);
+    outBytes.writeTo(reply);
+    reply.flush();
+  }
+
+  /**
+   * Answer agent requests on the abstract socket {@code socketName} until {@code idleMs}
+   * milliseconds pass without one.  A connection carries one request: the agent arguments,
+   * each followed by a NUL byte, up to EOF.  The reply is the exit status and the length of
+   * the standard error text, as big-endian 32-bit integers, then that text, then the
+   * standard output of the request.
+   */
+  private static void serve(String socketName, final long idleMs) throws Exception {
+    LocalServerSocket server = new LocalServerSocket(socketName);
+
+    // Whoever started us waits for EOF on our standard output before connecting.
+    System.out.println("ready");
+    System.out.close();
+
+    lastRequestMillis = SystemClock.uptimeMillis();
+    Thread idleWatchdog = new Thread() {
+      @Override
+      public void run() {
+        synchronized (serverLock) {
+          for (;;) {
+            long idleFor = SystemClock.uptimeMillis() - lastRequestMillis;
+            if (!serverBusy && idleFor >= idleMs) {
+              System.exit(0);
+            }
+            try {
+              serverLock.wait(serverBusy ? idleMs : idleMs - idleFor);
+            } catch (InterruptedException ex) {
+              // Just check again
+            }
+          }
+        }
+      }
+    };
+    idleWatchdog.setDaemon(true);
+    idleWatchdog.start();
+
+    for (;;) {
+      LocalSocket client = server.accept();
+      synchronized (serverLock) {
+        serverBusy = true;
+      }
+      try {
+        handleRequest(client);
+      } catch (Throwable ex) {
+        // Only this client suffers; keep serving the others.
+      } finally {
+        try {
+          client.close();
+        } catch (IOException ex) {
+          // Nothing we can do
+        }
+        synchronized (serverLock) {
+          serverBusy = false;
+          lastRequestMillis = SystemClock.uptimeMillis();
+        }
+      }
+    }
+  }
+
+  public static void main(String[] args) {
+    if (args.length == 3 && args[0].equals(SERVE_COMMAND)) {
+      try {
+        serve(args[1], Long.parseLong(args[2]));
+      } catch (Throwable ex) {
+        ex.printStackTrace(System.err);
+        System.exit(2);
+      }
+      return;
+    }
+
+    int status = runMain(args, System.out, System.err);
+    if (status != 0) {
+      System.exit(status);
     }
   }
 }
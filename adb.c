@@ -16,22 +16,55 @@
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "adb.h"
 #include "child.h"
 #include "util.h"
 #include "argv.h"
 #include "strutil.h"
 #include "fs.h"
+#include "elfid.h"
+#include "timing.h"
+#include "adbserver.h"
 
 struct adb_communication {
     char* output;
-    int status;
+    bool success;
 };
 
+// Like adb(1), join shell arguments with spaces and let the device
+// shell split them again.
+static bool
+run_adb_shell_via_server(const char* const* adb_args,
+                         const char* const* args,
+                         struct adb_communication* com)
+{
+    char* command = xstrdup("");
+    for (const char* const* argp = args; *argp != NULL; ++argp)
+        command = xaprintf("%s%s%s", command, *command ? " " : "", *argp);
+
+    char* output;
+    int exit_status;
+    if (!adb_server_shell(adb_args, command, &output, &exit_status))
+        return false;
+
+    com->output = massage_output(output, strlen(output));
+    com->success = (exit_status == 0);
+    return true;
+}
+
 static struct adb_communication
 run_adb(const char* const* adb_args,
         const char* args[])
 {
+    struct adb_communication com;
+    if (args != NULL && args[0] != NULL && !strcmp(args[0], "shell") &&
+        run_adb_shell_via_server(adb_args, args + 1, &com))
+    {
+        return com;
+    }
+
     struct child_start_info csi = {
         .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
         .io[STDOUT_FILENO] = CHILD_IO_PIPE,
@@ -42,11 +75,12 @@ run_adb(const char* const* adb_args,
                             args ?: empty_argv)
     };
 
+    double start = timing_span_begin();
     struct child* adb = child_start(&csi);
-    return (struct adb_communication) {
-        .output = massage_output_buf(slurp_fd_buf(adb->fd[1]->fd)),
-        .status = child_wait(adb),
-    };
+    com.output = massage_output_buf(slurp_fd_buf(adb->fd[1]->fd));
+    com.success = child_status_success_p(child_wait(adb));
+    timing_span_end(start, "adb", args ? args[0] : NULL);
+    return com;
 }
 
 void
@@ -56,10 +90,46 @@ adb_send_file(const char* local,
 {
     SCOPED_RESLIST(rl);
 
+    int fd = xopen(local, O_RDONLY, 0);
+    size_t datasz;
+    char* data = slurp_fd(fd, &datasz);
+    if (adb_server_push(adb_args, data, datasz, remote,
+                        xfstat(fd).st_mode))
+        return;
+
     struct adb_communication com =
         run_adb(adb_args, ARGV("push", local, remote));
 
-    if (!child_status_success_p(com.status))
+    if (!com.success)
+        die(ECOMM, "adb error: %s", com.output);
+}
+
+void
+adb_send_data(const void* data,
+              size_t datasz,
+              mode_t mode,
+              const char* remote,
+              const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl);
+
+    if (adb_server_push(adb_args, data, datasz, remote, mode))
+        return;
+
+    // N.B. The device-side adb server helpfully copies the user
+    // permission bits to group and world, so if we were to make this
+    // file writable for us locally, we'd actually be making it
+    // world-writable on device!
+    const char* tmpfilename;
+    int tmpfile = xnamed_tempfile(&tmpfilename);
+    write_all(tmpfile, data, datasz);
+    if (fchmod(tmpfile, mode) == -1)
+        die_errno("fchmod");
+
+    struct adb_communication com =
+        run_adb(adb_args, ARGV("push", tmpfilename, remote));
+
+    if (!com.success)
         die(ECOMM, "adb error: %s", com.output);
 }
 
@@ -108,7 +178,7 @@ adb_rename_file(const char* old_name,
                        "yes"));
 
     const char* output = com.output;
-    if (!child_status_success_p(com.status) || strcmp(output, "yes") != 0) {
+    if (!com.success || strcmp(output, "yes") != 0) {
         if (string_ends_with_p(output, ": Permission denied") &&
             (rename_flags & ADB_RENAME_FALL_BACK_TO_CAT))
         {
@@ -119,7 +189,7 @@ adb_rename_file(const char* old_name,
                                  new_name,
                                  old_name);
             struct adb_communication catcom = run_adb(adb_args, ARGV("shell", cmd));
-            if (child_status_success_p(catcom.status)) {
+            if (catcom.success) {
                 return;
             }
         }
@@ -132,10 +202,17 @@ adb_add_forward(const char* local,
                 const char* remote,
                 const char* const* adb_args)
 {
+    SCOPED_RESLIST(rl);
+
+    if (adb_server_device_command(
+            adb_args,
+            xaprintf("forward:%s;%s", local, remote)))
+        return;
+
     struct adb_communication com =
         run_adb(adb_args, ARGV("forward", local, remote));
 
-    if (!child_status_success_p(com.status))
+    if (!com.success)
         die(ECOMM, "adb_add_forward failed: %s", com.output);
 }
 
@@ -143,10 +220,17 @@ void
 adb_remove_forward(const char* local,
                    const char* const* adb_args)
 {
+    SCOPED_RESLIST(rl);
+
+    if (adb_server_device_command(
+            adb_args,
+            xaprintf("killforward:%s", local)))
+        return;
+
     struct adb_communication com =
         run_adb(adb_args, ARGV("forward", "--remove", local));
 
-    if (!child_status_success_p(com.status))
+    if (!com.success)
         die(ECOMM, "adb_remove_forward failed: %s", com.output);
 }
 
@@ -197,7 +281,7 @@ adb_getprop(const char* property, const char* const* adb_args)
         adb_args,
         ARGV("shell", "getprop", property));
     char* output = com.output;
-    if (!child_status_success_p(com.status))
+    if (!com.success)
         die(ECOMM, "adb error: %s", com.output);
 
     const char* ws = " \t\r\n";
@@ -218,6 +302,17 @@ adb_getprop(const char* property, const char* const* adb_args)
     return value;
 }
 
+char*
+adb_shell_output(const char* command, const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl);
+    struct adb_communication com = run_adb(adb_args, ARGV("shell", command));
+    if (!com.success)
+        die(ECOMM, "adb error: %s", com.output);
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xstrdup(com.output);
+}
+
 unsigned
 adb_api_level(const char* const* adb_args)
 {
@@ -233,3 +328,120 @@ adb_api_level(const char* const* adb_args)
 
     return (unsigned) api_level;
 }
+
+struct adb_device_probe {
+    struct reslist* rl;
+    struct child* adb; // NULL if talking to the adb server directly
+    int sock;
+};
+
+struct adb_device_probe*
+adb_device_probe_start(const char* const* adb_args)
+{
+    struct adb_device_probe* probe = xcalloc(sizeof (*probe));
+    probe->rl = reslist_create();
+    WITH_CURRENT_RESLIST(probe->rl);
+
+    // One round trip for everything.  Tag each value so that empty
+    // properties don't confuse us, and use backticks because they
+    // work in every shell Android has ever shipped.
+    const char* cmd =
+        "echo sdk=`getprop ro.build.version.sdk`;"
+        "echo abilist=`getprop ro.product.cpu.abilist`;"
+        "echo abi=`getprop ro.product.cpu.abi`;"
+        "echo abi2=`getprop ro.product.cpu.abi2`";
+
+    probe->sock = adb_server_open_service(adb_args,
+                                          xaprintf("shell:%s", cmd));
+    if (probe->sock != -1) {
+        timing_mark("adb-server-open", "device-probe");
+        return probe;
+    }
+
+    struct child_start_info csi = {
+        .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+        .io[STDERR_FILENO] = CHILD_IO_DEV_NULL,
+        .exename = "adb",
+        .argv = ARGV_CONCAT(ARGV("adb"),
+                            adb_args ?: empty_argv,
+                            ARGV("shell", cmd)),
+    };
+
+    probe->adb = child_start(&csi);
+    timing_mark("adb-spawn", "device-probe");
+    return probe;
+}
+
+static unsigned
+abi_list_to_abi_mask(char* abi_list)
+{
+    unsigned abi_mask = 0;
+    char* saveptr = NULL;
+    for (char* abi = strtok_r(abi_list, ",", &saveptr);
+         abi != NULL;
+         abi = strtok_r(NULL, ",", &saveptr))
+    {
+        abi_mask |= abi_to_abi_bit(abi);
+    }
+    return abi_mask;
+}
+
+bool
+adb_device_probe_finish(struct adb_device_probe* probe,
+                        struct adb_device_props* props)
+{
+    SCOPED_RESLIST(rl);
+    reslist_reparent(probe->rl);
+    struct growable_buffer buf =
+        slurp_fd_buf(probe->adb
+                     ? probe->adb->fd[STDOUT_FILENO]->fd
+                     : probe->sock);
+    char* output = xstrndup((char*) buf.buf, buf.bufsz);
+    if (probe->adb && !child_status_success_p(child_wait(probe->adb))) {
+        dbg("device probe failed: %s", massage_output(buf.buf, buf.bufsz));
+        return false;
+    }
+
+    unsigned long api_level = 0;
+    unsigned new_abi_mask = 0;
+    unsigned old_abi_mask = 0;
+    char* saveptr = NULL;
+    for (char* line = strtok_r(output, "\r\n", &saveptr);
+         line != NULL;
+         line = strtok_r(NULL, "\r\n", &saveptr))
+    {
+        char* value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        if (!strcmp(line, "sdk")) {
+            char* endptr;
+            errno = 0;
+            api_level = strtoul(value, &endptr, 10);
+            if (*endptr != '\0' || errno != 0 || api_level > UINT_MAX)
+                api_level = 0;
+        } else if (!strcmp(line, "abilist")) {
+            new_abi_mask |= abi_list_to_abi_mask(value);
+        } else if (!strcmp(line, "abi") || !strcmp(line, "abi2")) {
+            old_abi_mask |= abi_to_abi_bit(value);
+        }
+    }
+
+    if (api_level == 0) {
+        dbg("device probe found no API level");
+        return false;
+    }
+
+    props->api_level = (unsigned) api_level;
+    props->abi_mask = new_abi_mask ?: old_abi_mask;
+    dbg("device probe: API level %u ABI mask 0x%x",
+        props->api_level, props->abi_mask);
+    return true;
+}
+
+void
+adb_device_probe_cancel(struct adb_device_probe* probe)
+{
+    reslist_destroy(probe->rl);
+}
@@ -15,6 +15,16 @@ void adb_send_file(const char* local,
                    const char* remote,
                    const char* const* adb_args);
 
+// Write DATASZ bytes at DATA to the device file REMOTE with
+// permissions MODE, without going through a file on the host if we
+// can help it.  Only the user permission bits of MODE are reliable:
+// some devices copy them to group and world.
+void adb_send_data(const void* data,
+                   size_t datasz,
+                   mode_t mode,
+                   const char* remote,
+                   const char* const* adb_args);
+
 // On at least one device, the LGLS770, rename somehow fails.
 // On these devices, implement rename as cat and delete.  Yes, that's
 // racy, but these devices deserve to lose.  What was the author of
@@ -43,4 +53,30 @@ struct remove_forward_cleanup* remove_forward_cleanup_allocate(
 void remove_forward_cleanup_commit(struct remove_forward_cleanup* rfc);
 
 char* adb_getprop(const char* property, const char* const* adb_args);
+
+// Run the shell command line COMMAND on the device and return the
+// first non-empty line it prints.  Die if it fails.
+char* adb_shell_output(const char* command, const char* const* adb_args);
+
 unsigned adb_api_level(const char* const* adb_args);
+
+struct adb_device_props {
+    unsigned api_level;
+    unsigned abi_mask; // FB_ADB_ARCH_* bits; zero if unknown
+};
+
+// Start reading the properties in adb_device_props from the device in
+// the background so that other adb round trips can proceed while we
+// wait.  The probe is owned by the current reslist.  Either finish
+// or cancel it exactly once.
+struct adb_device_probe;
+struct adb_device_probe* adb_device_probe_start(
+    const char* const* adb_args);
+
+// Wait for PROBE and fill PROPS.  Return false if the device didn't
+// tell us what we need to know.
+bool adb_device_probe_finish(struct adb_device_probe* probe,
+                             struct adb_device_props* props);
+
+// Kill PROBE without waiting for its answer.
+void adb_device_probe_cancel(struct adb_device_probe* probe);
@@ -10,6 +10,12 @@
  */
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 #include "adbenc.h"
 #include "util.h"
 #include "fs.h"
@@ -24,6 +30,47 @@ static const char adb_forbidden = '~';
 static const char adb_escape1 = '!';
 static const char adb_escape2 = '@';
 
+// Return the length of the longest prefix of [IN, INEND) that
+// adb_encode can copy verbatim, i.e., that contains neither
+// adb_forbidden nor adb_escape1.  Most data has no escape bytes at
+// all, so check a vector's worth of bytes at a time where we can.
+static size_t
+adb_encode_clean_run(const char* in, const char* inend)
+{
+    const char* p = in;
+
+#if defined(__SSE2__)
+    const __m128i forbidden = _mm_set1_epi8(adb_forbidden);
+    const __m128i escape1 = _mm_set1_epi8(adb_escape1);
+    while (inend - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        int mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, forbidden),
+                         _mm_cmpeq_epi8(v, escape1)));
+        if (mask != 0)
+            return (p - in) + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t forbidden = vdupq_n_u8(adb_forbidden);
+    const uint8x16_t escape1 = vdupq_n_u8(adb_escape1);
+    while (inend - p >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*) p);
+        uint8x16_t hits = vorrq_u8(vceqq_u8(v, forbidden),
+                                   vceqq_u8(v, escape1));
+        uint64x2_t hits64 = vreinterpretq_u64_u8(hits);
+        if ((vgetq_lane_u64(hits64, 0) | vgetq_lane_u64(hits64, 1)) != 0)
+            break; // The scalar loop below finds the exact byte
+        p += 16;
+    }
+#endif
+
+    while (p < inend && *p != adb_forbidden && *p != adb_escape1)
+        p++;
+
+    return p - in;
+}
+
 void
 adb_encode(uint8_t* inout_state,
            char** inout_enc,
@@ -37,14 +84,21 @@ adb_encode(uint8_t* inout_state,
 
     while (in < inend && enc < encend) {
         if (state == 0) {
-             if (*in == adb_escape1) {
+            size_t run = XMIN(adb_encode_clean_run(in, inend),
+                              (size_t) (encend - enc));
+            if (run > 0) {
+                memcpy(enc, in, run);
+                enc += run;
+                in += run;
+                continue;
+            }
+
+            if (*in == adb_escape1) {
                 *enc++ = adb_escape1;
                 state = 1;
-            } else if (*in == adb_forbidden) {
+            } else {
                 *enc++ = adb_escape1;
                 state = 2;
-            } else {
-                *enc++ = *in++;
             }
         } else if (state == 1) {
             *enc++ = adb_escape1;
@@ -74,6 +128,20 @@ adb_decode(uint8_t* inout_state,
     const char* in = *inout_in;
 
     while (in < inend && dec < decend) {
+        if (state == 0) {
+            // Copy everything up to the next escape in one go.  DEC
+            // may alias IN (see channel_read_adb_hack), so memmove.
+            size_t avail = XMIN(inend - in, decend - dec);
+            const char* escape = memchr(in, adb_escape1, avail);
+            size_t run = escape ? (size_t) (escape - in) : avail;
+            if (run > 0) {
+                memmove(dec, in, run);
+                dec += run;
+                in += run;
+                continue;
+            }
+        }
+
         char c = *in++;
         if (state == 0) {
             if (c == adb_escape1)
@@ -17,6 +17,8 @@ void adb_encode(uint8_t* inout_state,
                 const char** inout_in,
                 const char* inend);
 
+// *INOUT_DEC may equal *INOUT_IN, since decoding never writes
+// ahead of what it has read.
 void adb_decode(uint8_t* inout_state,
                 char** inout_dec,
                 char* decend,
@@ -0,0 +1,336 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include "adbenc.h"
+#include "fs.h"
+
+// Check adb_encode and adb_decode, which look for escape bytes a
+// vector at a time where the CPU lets them, against the
+// byte-at-a-time coder they replaced.  Each call into the real coder
+// is mirrored by a call into the reference with the same input and
+// the same output room, and the two have to consume, produce, and
+// leave behind exactly the same thing.  "make check" runs this.
+
+static const char adb_forbidden = '~';
+static const char adb_escape1 = '!';
+static const char adb_escape2 = '@';
+
+typedef void (*adb_coder)(uint8_t* inout_state,
+                          char** inout_out,
+                          char* outend,
+                          const char** inout_in,
+                          const char* inend);
+
+static void
+ref_adb_encode(uint8_t* inout_state,
+               char** inout_enc,
+               char* encend,
+               const char** inout_in,
+               const char* inend)
+{
+    uint8_t state = *inout_state;
+    char* enc = *inout_enc;
+    const char* in = *inout_in;
+
+    while (in < inend && enc < encend) {
+        if (state == 0) {
+            if (*in == adb_escape1) {
+                *enc++ = adb_escape1;
+                state = 1;
+            } else if (*in == adb_forbidden) {
+                *enc++ = adb_escape1;
+                state = 2;
+            } else {
+                *enc++ = *in++;
+            }
+        } else if (state == 1) {
+            *enc++ = adb_escape1;
+            in++;
+            state = 0;
+        } else if (state == 2) {
+            *enc++ = adb_escape2;
+            in++;
+            state = 0;
+        }
+    }
+
+    *inout_state = state;
+    *inout_enc = enc;
+    *inout_in = in;
+}
+
+static void
+ref_adb_decode(uint8_t* inout_state,
+               char** inout_dec,
+               char* decend,
+               const char** inout_in,
+               const char* inend)
+{
+    uint8_t state = *inout_state;
+    char* dec = *inout_dec;
+    const char* in = *inout_in;
+
+    while (in < inend && dec < decend) {
+        char c = *in++;
+        if (state == 0) {
+            if (c == adb_escape1)
+                state = 1;
+            else
+                *dec++ = c;
+        } else if (state == 1) {
+            if (c == adb_escape1)
+                *dec++ = adb_escape1;
+            else
+                *dec++ = adb_forbidden;
+
+            state = 0;
+        }
+    }
+
+    *inout_state = state;
+    *inout_dec = dec;
+    *inout_in = in;
+}
+
+// Deterministic, so failures reproduce
+static uint32_t
+check_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// How much input and output room to hand each call.  Zero means
+// everything left; STEP_RANDOM means a fresh small amount each call.
+struct check_steps {
+    size_t in;
+    size_t out;
+};
+
+#define STEP_RANDOM ((size_t) -1)
+
+static const struct check_steps whole_buffer[] = {
+    { 0, 0 },
+};
+
+static const struct check_steps split_buffers[] = {
+    { 0, 0 },
+    { 1, 0 },
+    { 0, 1 },
+    { 7, 0 },
+    { 0, 5 },
+    { 16, 16 },
+    { 17, 13 },
+    { 31, 33 },
+    { STEP_RANDOM, STEP_RANDOM },
+};
+
+static size_t
+check_step(size_t step, size_t left, uint32_t* rnd)
+{
+    if (step == STEP_RANDOM)
+        step = 1 + check_random(rnd) % 40;
+    return step == 0 ? left : XMIN(step, left);
+}
+
+static unsigned long nr_calls_checked;
+
+// Run CODER and REF side by side over the INSZ bytes at IN, in pieces
+// sized by STEPS, with OUTSZ bytes of room in all.  If IN_PLACE,
+// CODER writes over a copy of its own input.  Die at the first
+// disagreement.  Return the output, whose size goes in *OUT_SIZE.
+static char*
+check_coder(const char* name,
+            adb_coder coder,
+            adb_coder ref,
+            const char* in,
+            size_t insz,
+            size_t outsz,
+            bool in_place,
+            const struct check_steps* steps,
+            const char* label,
+            size_t* out_size)
+{
+    uint32_t rnd = 0xdeadbeef;
+    char* ref_buf = xalloc(outsz + 1);
+    char* buf = xalloc(XMAX(outsz, insz) + 1);
+    const char* buf_in = in;
+    if (in_place) {
+        memcpy(buf, in, insz);
+        buf_in = buf;
+    }
+
+    uint8_t ref_state = 0;
+    char* ref_out = ref_buf;
+    const char* ref_in = in;
+    uint8_t state = 0;
+    char* out = buf;
+    const char* cur_in = buf_in;
+
+    while (ref_in < in + insz) {
+        size_t inoff = ref_in - in;
+        size_t outoff = ref_out - ref_buf;
+        size_t inlen = check_step(steps->in, insz - inoff, &rnd);
+        size_t outlen = check_step(steps->out, outsz - outoff, &rnd);
+
+        ref(&ref_state, &ref_out, ref_out + outlen, &ref_in, ref_in + inlen);
+        coder(&state, &out, out + outlen, &cur_in, cur_in + inlen);
+        nr_calls_checked++;
+
+        if (state != ref_state ||
+            cur_in - buf_in != ref_in - in ||
+            out - buf != ref_out - ref_buf ||
+            memcmp(buf + outoff, ref_buf + outoff, out - buf - outoff))
+        {
+            die(EINVAL,
+                "%s%s disagrees with the reference on %s "
+                "(%zu bytes, steps %zd/%zd) at input offset %zu",
+                name, in_place ? " in place" : "", label,
+                insz, (ssize_t) steps->in, (ssize_t) steps->out, inoff);
+        }
+
+        if (ref_in - in == inoff && ref_out - ref_buf == outoff)
+            die(EINVAL, "%s made no progress on %s", name, label);
+    }
+
+    *out_size = ref_out - ref_buf;
+    return ref_buf;
+}
+
+// Encode and decode the SZ bytes at DATA every way STEPS allow,
+// check that the encoding is free of adb_forbidden and decodes back
+// to DATA, and decode DATA itself, which needn't be a valid encoding.
+static void
+check_case(const char* label,
+           const char* data,
+           size_t sz,
+           const struct check_steps* steps,
+           size_t nr_steps)
+{
+    SCOPED_RESLIST(rl);
+    for (size_t i = 0; i < nr_steps; ++i) {
+        size_t encsz;
+        char* enc = check_coder("adb_encode", adb_encode, ref_adb_encode,
+                                data, sz, 2 * sz, false,
+                                &steps[i], label, &encsz);
+        if (memchr(enc, adb_forbidden, encsz))
+            die(EINVAL, "adb_encode let '%c' through on %s",
+                adb_forbidden, label);
+
+        for (int in_place = 0; in_place < 2; ++in_place) {
+            size_t decsz;
+            char* dec = check_coder("adb_decode", adb_decode, ref_adb_decode,
+                                    enc, encsz, sz, in_place,
+                                    &steps[i], label, &decsz);
+            if (decsz != sz || memcmp(dec, data, sz))
+                die(EINVAL, "adb_decode didn't invert adb_encode on %s",
+                    label);
+
+            check_coder("adb_decode", adb_decode, ref_adb_decode,
+                        data, sz, sz, in_place,
+                        &steps[i], label, &decsz);
+        }
+    }
+}
+
+static char
+check_random_escape(uint32_t* rnd)
+{
+    return (check_random(rnd) & 1) ? adb_escape1 : adb_forbidden;
+}
+
+static void
+check_random_input(uint32_t* rnd)
+{
+    char buf[1024];
+    for (int iter = 0; iter < 500; ++iter) {
+        size_t sz = check_random(rnd) % sizeof (buf);
+        unsigned density = 1 + check_random(rnd) % 64;
+        for (size_t i = 0; i < sz; ++i)
+            buf[i] = (check_random(rnd) % density == 0)
+                ? check_random_escape(rnd)
+                : (char) check_random(rnd);
+        check_case("random input", buf, sz,
+                   split_buffers, ARRAYSIZE(split_buffers));
+    }
+}
+
+static void
+check_all_escapes(uint32_t* rnd)
+{
+    char buf[4096];
+    static const size_t sizes[] = { 1, 15, 16, 17, 100, sizeof (buf) };
+    for (size_t i = 0; i < ARRAYSIZE(sizes); ++i) {
+        memset(buf, adb_escape1, sizes[i]);
+        check_case("all escape1", buf, sizes[i],
+                   split_buffers, ARRAYSIZE(split_buffers));
+        memset(buf, adb_forbidden, sizes[i]);
+        check_case("all forbidden", buf, sizes[i],
+                   split_buffers, ARRAYSIZE(split_buffers));
+        for (size_t j = 0; j < sizes[i]; ++j)
+            buf[j] = check_random_escape(rnd);
+        check_case("mixed escapes", buf, sizes[i],
+                   split_buffers, ARRAYSIZE(split_buffers));
+    }
+}
+
+// Put an escape byte at every position of every short run, at every
+// alignment, so that some land just before, on, and just after each
+// vector boundary, and some runs end partway through a vector.
+static void
+check_vector_boundaries(void)
+{
+    static const char escapes[] = { '~', '!' };
+    char back[16 + 3 * 16];
+    for (size_t align = 0; align < 16; ++align) {
+        char* buf = back + align;
+        for (size_t sz = 1; sz <= 3 * 16; ++sz) {
+            for (size_t pos = 0; pos < sz; ++pos) {
+                for (size_t e = 0; e < ARRAYSIZE(escapes); ++e) {
+                    for (size_t i = 0; i < sz; ++i)
+                        buf[i] = 'a' + i % 26;
+                    buf[pos] = escapes[e];
+                    check_case("one escape", buf, sz,
+                               whole_buffer, ARRAYSIZE(whole_buffer));
+                }
+            }
+            memset(buf, 'x', sz);
+            check_case("no escapes", buf, sz,
+                       split_buffers, ARRAYSIZE(split_buffers));
+        }
+    }
+}
+
+int
+real_main(int argc, char** argv)
+{
+    uint32_t rnd = 0x12345678;
+    check_random_input(&rnd);
+    check_all_escapes(&rnd);
+    check_vector_boundaries();
+    xprintf(xstdout, "adbenc: %s coder matches the reference "
+            "over %lu calls\n",
+#if defined(__SSE2__)
+            "SSE2",
+#elif defined(__ARM_NEON)
+            "NEON",
+#else
+            "scalar",
+#endif
+            nr_calls_checked);
+    return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "adbserver.h"
+#include "util.h"
+#include "fs.h"
+#include "net.h"
+#include "constants.h"
+#include "timing.h"
+
+// The adb server speaks a simple request-response protocol on a TCP
+// socket.  Each request is four hex digits of length followed by
+// that many bytes of payload; each response starts with "OKAY" or
+// with "FAIL" and a length-prefixed message.  Once the server
+// accepts a device service request, the socket becomes a byte
+// stream to that service on the device.
+
+#define ADB_SERVER_DEFAULT_PORT "5037"
+#define ADB_SERVER_MAX_REQUEST 0xFFFF
+#define ADB_SYNC_DATA_MAX (64*1024)
+
+struct adb_target {
+    const char* host;        // NULL means loopback
+    const char* port;
+    const char* transport;   // Request that picks a device
+    const char* host_prefix; // Prefix for per-device host requests
+};
+
+static bool
+parse_adb_args(const char* const* adb_args, struct adb_target* t)
+{
+    const char* serial = NULL;
+    bool usb = false;
+    bool local = false;
+
+    memset(t, 0, sizeof (*t));
+    for (const char* const* argp = adb_args;
+         argp != NULL && *argp != NULL;
+         ++argp)
+    {
+        const char* arg = *argp;
+        if (!strcmp(arg, "-d")) {
+            usb = true;
+        } else if (!strcmp(arg, "-e")) {
+            local = true;
+        } else if (!strcmp(arg, "-s") && argp[1] != NULL) {
+            serial = *++argp;
+        } else if (!strcmp(arg, "-H") && argp[1] != NULL) {
+            t->host = *++argp;
+        } else if (!strcmp(arg, "-P") && argp[1] != NULL) {
+            t->port = *++argp;
+        } else {
+            dbg("not talking to adb server: unknown adb option %s", arg);
+            return false;
+        }
+    }
+
+    if (usb + local + (serial != NULL) > 1)
+        return false;
+
+    if (!usb && !local && serial == NULL) {
+        serial = getenv("ANDROID_SERIAL");
+        if (serial != NULL && serial[0] == '\0')
+            serial = NULL;
+    }
+
+    if (t->port == NULL)
+        t->port = getenv("ANDROID_ADB_SERVER_PORT") ?: "";
+    if (t->port[0] == '\0')
+        t->port = ADB_SERVER_DEFAULT_PORT;
+
+    if (usb) {
+        t->transport = "host:transport-usb";
+        t->host_prefix = "host-usb:";
+    } else if (local) {
+        t->transport = "host:transport-local";
+        t->host_prefix = "host-local:";
+    } else if (serial != NULL) {
+        t->transport = xaprintf("host:transport:%s", serial);
+        t->host_prefix = xaprintf("host-serial:%s:", serial);
+    } else {
+        t->transport = "host:transport-any";
+        t->host_prefix = "host:";
+    }
+
+    return true;
+}
+
+static int
+connect_adb_server(const struct adb_target* t)
+{
+    if (t->host == NULL) {
+        char* endptr;
+        errno = 0;
+        unsigned long port = strtoul(t->port, &endptr, 10);
+        if (*endptr != '\0' || errno != 0 || port == 0 || port > 0xFFFF)
+            die(EINVAL, "invalid adb server port [%s]", t->port);
+
+        int sock = xsocket(AF_INET, SOCK_STREAM, 0);
+        struct addr addr;
+        memset(&addr, 0, sizeof (addr));
+        addr.size = sizeof (addr.addr_in);
+        addr.addr_in.sin_family = AF_INET;
+        addr.addr_in.sin_port = htons((uint16_t) port);
+        addr.addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        xconnect(sock, &addr);
+        return sock;
+    }
+
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+
+    return xconnect_host(t->host, t->port, &hints);
+}
+
+static void
+send_request(int sock, const char* request)
+{
+    size_t length = strlen(request);
+    if (length > ADB_SERVER_MAX_REQUEST)
+        die(EINVAL, "adb server request too long");
+    char* framed = xaprintf("%04x%s", (unsigned) length, request);
+    write_all(sock, framed, strlen(framed));
+}
+
+static void
+read_exactly(int sock, void* buf, size_t sz)
+{
+    if (read_all(sock, buf, sz) != sz)
+        die(ECOMM, "adb server closed connection");
+}
+
+static size_t
+read_hex_length(int sock)
+{
+    char hex[5];
+    read_exactly(sock, hex, 4);
+    hex[4] = '\0';
+    char* endptr;
+    unsigned long length = strtoul(hex, &endptr, 16);
+    if (*endptr != '\0')
+        die(ECOMM, "bad length from adb server: [%s]", hex);
+    return length;
+}
+
+// Die unless the server says "OKAY".  If AT_EOF_OK, accept the
+// server hanging up instead.
+static void
+read_status(int sock, bool at_eof_ok)
+{
+    char status[4];
+    size_t nr_read = read_all(sock, status, sizeof (status));
+    if (nr_read == 0 && at_eof_ok)
+        return;
+    if (nr_read != sizeof (status))
+        die(ECOMM, "adb server closed connection");
+    if (!memcmp(status, "OKAY", 4))
+        return;
+    if (!memcmp(status, "FAIL", 4)) {
+        size_t length = read_hex_length(sock);
+        char* msg = xalloc(length + 1);
+        msg[read_all(sock, msg, length)] = '\0';
+        die(ECOMM, "adb server: %s", msg);
+    }
+
+    die(ECOMM, "bad status from adb server: [%.4s]", status);
+}
+
+static int
+open_service(const struct adb_target* t, const char* service)
+{
+    int sock = connect_adb_server(t);
+    send_request(sock, t->transport);
+    read_status(sock, false);
+    send_request(sock, service);
+    read_status(sock, false);
+    return sock;
+}
+
+static bool
+adb_server_disabled_p(void)
+{
+    // We don't know how to parse every ADB_SERVER_SOCKET adb accepts,
+    // so let adb interpret it.
+    return getenv("FB_ADB_EXEC_ADB") != NULL ||
+        getenv("ADB_SERVER_SOCKET") != NULL;
+}
+
+struct open_service_ctx {
+    const char* const* adb_args;
+    const char* service;
+    int sock;
+};
+
+static void
+adb_server_open_service_1(void* data)
+{
+    struct open_service_ctx* ctx = data;
+    struct adb_target t;
+    if (!parse_adb_args(ctx->adb_args, &t))
+        return;
+    ctx->sock = open_service(&t, ctx->service);
+}
+
+int
+adb_server_open_service(const char* const* adb_args,
+                        const char* service)
+{
+    if (adb_server_disabled_p())
+        return -1;
+
+    struct open_service_ctx ctx = {
+        .adb_args = adb_args,
+        .service = service,
+        .sock = -1,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(adb_server_open_service_1, &ctx, &ei)) {
+        dbg("could not open %s via adb server: %s", service, ei.msg);
+        return -1;
+    }
+
+    return ctx.sock;
+}
+
+// Legacy shell connections don't report the command's exit status,
+// so have the shell print it after the command's own output.
+#define SHELL_STATUS_MARKER "fb-adb-shell-status="
+
+struct shell_ctx {
+    const char* const* adb_args;
+    const char* command;
+    char* output;
+    int exit_status;
+};
+
+static void
+adb_server_shell_1(void* data)
+{
+    struct shell_ctx* ctx = data;
+    char* service = xaprintf("shell:%s;echo %s$?",
+                             ctx->command,
+                             SHELL_STATUS_MARKER);
+    int sock = adb_server_open_service(ctx->adb_args, service);
+    if (sock == -1)
+        die(ECOMM, "no adb server connection");
+
+    char* output = slurp_fd(sock, NULL);
+    char* marker = NULL;
+    for (char* p = output;
+         (p = strstr(p, SHELL_STATUS_MARKER)) != NULL;
+         ++p)
+    {
+        marker = p;
+    }
+
+    if (marker == NULL)
+        die(ECOMM, "shell exited without reporting status");
+
+    char* endptr;
+    errno = 0;
+    long exit_status = strtol(marker + strlen(SHELL_STATUS_MARKER),
+                              &endptr, 10);
+    if (errno != 0 || exit_status < 0 || exit_status > INT_MAX ||
+        strspn(endptr, "\r\n") != strlen(endptr))
+        die(ECOMM, "bad shell status");
+
+    *marker = '\0';
+    ctx->output = output;
+    ctx->exit_status = (int) exit_status;
+}
+
+bool
+adb_server_shell(const char* const* adb_args,
+                 const char* command,
+                 char** output,
+                 int* exit_status)
+{
+    if (adb_server_disabled_p())
+        return false;
+
+    double start = timing_span_begin();
+    struct shell_ctx ctx = {
+        .adb_args = adb_args,
+        .command = command,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(adb_server_shell_1, &ctx, &ei)) {
+        dbg("adb server shell failed: %s", ei.msg);
+        return false;
+    }
+
+    timing_span_end(start, "adb-server", "shell");
+    *output = ctx.output;
+    *exit_status = ctx.exit_status;
+    return true;
+}
+
+static void
+put_le32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t) (value >> 0);
+    p[1] = (uint8_t) (value >> 8);
+    p[2] = (uint8_t) (value >> 16);
+    p[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t
+get_le32(const uint8_t* p)
+{
+    return ((uint32_t) p[0] << 0) |
+        ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) |
+        ((uint32_t) p[3] << 24);
+}
+
+static void
+send_sync_request(int sock,
+                  const char id[4],
+                  uint32_t arg,
+                  const void* payload,
+                  size_t payloadsz)
+{
+    uint8_t hdr[8];
+    memcpy(hdr, id, 4);
+    put_le32(hdr + 4, arg);
+    struct iovec iov[2] = {
+        { hdr, sizeof (hdr) },
+        { (void*) payload, payloadsz },
+    };
+    write_all_v(sock, iov, payloadsz ? 2 : 1);
+}
+
+struct push_ctx {
+    const char* const* adb_args;
+    const void* data;
+    size_t datasz;
+    const char* remote;
+    mode_t mode;
+};
+
+static void
+adb_server_push_1(void* data)
+{
+    struct push_ctx* ctx = data;
+    int sock = adb_server_open_service(ctx->adb_args, "sync:");
+    if (sock == -1)
+        die(ECOMM, "no adb server connection");
+
+    char* spec = xaprintf("%s,%u",
+                          ctx->remote,
+                          (unsigned) (S_IFREG | (ctx->mode & 0777)));
+    send_sync_request(sock, "SEND", strlen(spec), spec, strlen(spec));
+
+    const uint8_t* pos = ctx->data;
+    size_t left = ctx->datasz;
+    while (left > 0) {
+        size_t chunksz = XMIN(left, (size_t) ADB_SYNC_DATA_MAX);
+        send_sync_request(sock, "DATA", chunksz, pos, chunksz);
+        pos += chunksz;
+        left -= chunksz;
+    }
+
+    send_sync_request(sock, "DONE", (uint32_t) time(NULL), NULL, 0);
+
+    uint8_t reply[8];
+    read_exactly(sock, reply, sizeof (reply));
+    if (!memcmp(reply, "FAIL", 4)) {
+        size_t length = get_le32(reply + 4);
+        char* msg = xalloc(length + 1);
+        msg[read_all(sock, msg, length)] = '\0';
+        die(ECOMM, "adb sync: %s", msg);
+    }
+
+    if (memcmp(reply, "OKAY", 4) != 0)
+        die(ECOMM, "bad reply from adb sync: [%.4s]", (char*) reply);
+
+    send_sync_request(sock, "QUIT", 0, NULL, 0);
+}
+
+bool
+adb_server_push(const char* const* adb_args,
+                const void* data,
+                size_t datasz,
+                const char* remote,
+                mode_t mode)
+{
+    if (adb_server_disabled_p())
+        return false;
+
+    SCOPED_RESLIST(rl);
+    double start = timing_span_begin();
+    struct push_ctx ctx = {
+        .adb_args = adb_args,
+        .data = data,
+        .datasz = datasz,
+        .remote = remote,
+        .mode = mode,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(adb_server_push_1, &ctx, &ei)) {
+        dbg("adb server push failed: %s", ei.msg);
+        return false;
+    }
+
+    timing_span_end(start, "adb-server", "push");
+    return true;
+}
+
+struct device_command_ctx {
+    const char* const* adb_args;
+    const char* command;
+    bool done;
+};
+
+static void
+adb_server_device_command_1(void* data)
+{
+    struct device_command_ctx* ctx = data;
+    struct adb_target t;
+    if (!parse_adb_args(ctx->adb_args, &t))
+        return;
+
+    int sock = connect_adb_server(&t);
+    send_request(sock, xaprintf("%s%s", t.host_prefix, ctx->command));
+    // The first status says whether the server found the device;
+    // the second, which very old servers don't send, says whether
+    // the command worked.
+    read_status(sock, false);
+    read_status(sock, true);
+    ctx->done = true;
+}
+
+bool
+adb_server_device_command(const char* const* adb_args,
+                          const char* command)
+{
+    if (adb_server_disabled_p())
+        return false;
+
+    SCOPED_RESLIST(rl);
+    double start = timing_span_begin();
+    struct device_command_ctx ctx = {
+        .adb_args = adb_args,
+        .command = command,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(adb_server_device_command_1, &ctx, &ei)) {
+        dbg("adb server command %s failed: %s", command, ei.msg);
+        return false;
+    }
+
+    if (ctx.done)
+        timing_span_end(start, "adb-server",
+                        xstrndup(command, strcspn(command, ":")));
+    return ctx.done;
+}
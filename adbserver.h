@@ -0,0 +1,50 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A client for the adb server's "smart socket" protocol, which lets
+// us do what the adb program does without starting one.  Nothing
+// here dies when it can't talk to the server the way we'd like ---
+// no server running, an adb option we don't understand, the server
+// refusing a request --- so that callers can fall back to running
+// adb, which starts servers and explains errors better than we do.
+// Set FB_ADB_EXEC_ADB to always run adb instead.
+
+// Open a connection to device service SERVICE (e.g., "shell:ls" or
+// "sync:") on the device ADB_ARGS selects.  Return a socket owned by
+// the current reslist, or -1.
+int adb_server_open_service(const char* const* adb_args,
+                            const char* service);
+
+// Run COMMAND in a device shell and collect its output, which
+// combines standard output and standard error, and its exit status.
+// On success, the output belongs to the current reslist.
+bool adb_server_shell(const char* const* adb_args,
+                      const char* command,
+                      char** output,
+                      int* exit_status);
+
+// Write DATASZ bytes at DATA to the device file REMOTE with
+// permissions MODE.  The device creates the file under a temporary
+// name and renames it into place once it has all the data.
+bool adb_server_push(const char* const* adb_args,
+                     const void* data,
+                     size_t datasz,
+                     const char* remote,
+                     mode_t mode);
+
+// Run the host service COMMAND (e.g., "forward:LOCAL;REMOTE") for
+// the device ADB_ARGS selects.
+bool adb_server_device_command(const char* const* adb_args,
+                               const char* command);
@@ -13,6 +13,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <stdlib.h>
 #include "channel.h"
 #include "util.h"
@@ -20,6 +21,7 @@
 #include "adbenc.h"
 #include "xmkraw.h"
 #include "fs.h"
+#include "stripe.h"
 
 static bool
 channel_nonblock_hack_p(struct channel* c)
@@ -43,6 +45,29 @@ channel_new(struct fdh* fdh,
     return ch;
 }
 
+#ifdef HAVE_SHM_TRANSPORT
+struct channel*
+channel_new_shm(struct shmring* sr,
+                struct fdh* bellfdh,
+                size_t rbsz,
+                enum channel_direction direction)
+{
+    struct channel* ch = channel_new(bellfdh, rbsz, direction);
+    ch->shm = sr;
+    return ch;
+}
+#endif
+
+struct channel*
+channel_new_striped(struct stripe_set* ss,
+                    size_t rbsz,
+                    enum channel_direction direction)
+{
+    struct channel* ch = channel_new(stripe_current_fdh(ss), rbsz, direction);
+    ch->stripes = ss;
+    return ch;
+}
+
 static size_t
 channel_wanted_readsz(struct channel* c)
 {
@@ -52,9 +77,33 @@ channel_wanted_readsz(struct channel* c)
     if (c->fdh == NULL)
         return 0;
 
+#ifdef HAVE_SPLICE
+    if (c->splice_avail > 0)
+        return 0;
+#endif
+
     return XMIN(ringbuf_room(c->rb), c->window);
 }
 
+// If C is a splice channel and its pipe has data, remember how much
+// and leave the bytes where they are for xmit_data_splice.  If the
+// pipe is empty, let the caller read normally so we notice EOF.
+static bool
+channel_note_splice_avail(struct channel* c)
+{
+#ifdef HAVE_SPLICE
+    int nr_avail;
+    if (c->splice &&
+        ioctl(c->fdh->fd, FIONREAD, &nr_avail) == 0 &&
+        nr_avail > 0)
+    {
+        c->splice_avail = nr_avail;
+        return true;
+    }
+#endif
+    return false;
+}
+
 static size_t
 channel_wanted_writesz(struct channel* c)
 {
@@ -70,10 +119,28 @@ channel_wanted_writesz(struct channel* c)
         + !!(c->adb_hack_state);
 }
 
+static void
+channel_note_buffered(struct channel* c)
+{
+    size_t size = ringbuf_size(c->rb);
+    if (size > c->stats.high_water)
+        c->stats.high_water = size;
+}
+
 static size_t
 channel_read_1(struct channel* c, size_t sz)
 {
-    size_t nr_read = ringbuf_read_in(c->rb, c->fdh->fd, sz);
+    size_t nr_read;
+#ifdef HAVE_SHM_TRANSPORT
+    if (c->shm != NULL)
+        nr_read = shmring_read_in(c->shm, c->fdh->fd, c->rb, sz);
+    else
+#endif
+    if (c->stripes != NULL) {
+        nr_read = stripe_read_in(c->stripes, c->rb, sz);
+        c->fdh = stripe_current_fdh(c->stripes);
+    } else
+        nr_read = ringbuf_read_in(c->rb, c->fdh->fd, sz);
     ringbuf_note_added(c->rb, nr_read);
     return nr_read;
 }
@@ -81,7 +148,17 @@ channel_read_1(struct channel* c, size_t sz)
 static size_t
 channel_write_1(struct channel* c, size_t sz)
 {
-    size_t nr_written = ringbuf_write_out(c->rb, c->fdh->fd, sz);
+    size_t nr_written;
+#ifdef HAVE_SHM_TRANSPORT
+    if (c->shm != NULL)
+        nr_written = shmring_write_out(c->shm, c->fdh->fd, c->rb, sz);
+    else
+#endif
+    if (c->stripes != NULL) {
+        nr_written = stripe_write_out(c->stripes, c->rb, sz);
+        c->fdh = stripe_current_fdh(c->stripes);
+    } else
+        nr_written = ringbuf_write_out(c->rb, c->fdh->fd, sz);
     ringbuf_note_removed(c->rb, nr_written);
     return nr_written;
 }
@@ -92,8 +169,23 @@ channel_read_adb_hack(struct channel* c, size_t sz)
     size_t nr_added = 0;
 
     while (nr_added < sz) {
-        char buf[4096];
-        size_t to_read = XMIN(sz - nr_added, sizeof (buf));
+        char stackbuf[4096];
+        struct iovec iov[2];
+        char* buf;
+        size_t to_read;
+        ringbuf_writable_iov(c->rb, iov, sz - nr_added);
+
+        // Decoding never makes data longer, so if the ring buffer can
+        // give us one contiguous region, read into it and decode in
+        // place instead of bouncing through the stack.
+        if (iov[1].iov_len == 0) {
+            buf = iov[0].iov_base;
+            to_read = iov[0].iov_len;
+        } else {
+            buf = stackbuf;
+            to_read = XMIN(sz - nr_added, sizeof (stackbuf));
+        }
+
         ssize_t chunksz;
 
         {
@@ -106,7 +198,6 @@ channel_read_adb_hack(struct channel* c, size_t sz)
         if (chunksz < 1)
             break;
 
-        struct iovec iov[2];
         ringbuf_writable_iov(c->rb, iov, chunksz);
         const char* in = buf;
         const char* inend = in + chunksz;
@@ -194,6 +285,15 @@ channel_write_adb_hack(struct channel* c, size_t sz)
 struct pollfd
 channel_request_poll(struct channel* c)
 {
+#ifdef HAVE_SHM_TRANSPORT
+    if (c->shm != NULL && (channel_wanted_readsz(c) ||
+                           channel_wanted_writesz(c)))
+    {
+        short events = shmring_poll_events(c->shm, c->fdh->fd);
+        return (struct pollfd){c->fdh->fd, events, 0};
+    }
+#endif
+
     if (channel_wanted_readsz(c))
         return (struct pollfd){c->fdh->fd, POLLIN, 0};
 
@@ -203,43 +303,92 @@ channel_request_poll(struct channel* c)
     return (struct pollfd){-1, 0, 0};
 }
 
-void
-channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
+// Whether to try writing TOTALSZ bytes straight to C's descriptor
+// instead of queueing them in C's ring buffer.
+static bool
+channel_try_direct_p(const struct channel* c, size_t totalsz)
 {
-    assert(c->dir == CHANNEL_TO_FD);
-
-    if (c->fdh == NULL)
-        return; // If the stream is closed, just discard
-
     bool try_direct = !c->always_buffer && ringbuf_size(c->rb) == 0;
-    size_t directwrsz = 0;
-    size_t totalsz;
 
     if (c->adb_encoding_hack)
         try_direct = false;
 
+#ifdef HAVE_SHM_TRANSPORT
+    if (c->shm != NULL)
+        try_direct = false;
+#endif
+
+    if (c->stripes != NULL)
+        try_direct = false;
+
     // If writing directly, would make us overflow the write counter,
     // fall back to buffered IO.
-    if (try_direct) {
-        totalsz = iovec_sum(iov, nio);
-        if (c->track_bytes_written &&
-            UINT32_MAX - c->bytes_written < totalsz)
-        {
-            try_direct = false;
-        }
+    if (try_direct &&
+        c->track_bytes_written &&
+        UINT32_MAX - c->bytes_written < totalsz)
+    {
+        try_direct = false;
     }
 
+    return try_direct;
+}
+
+// Write IOV straight to C's descriptor.  Return the number of bytes
+// written, which is zero if writev fails.
+static size_t
+channel_write_direct(struct channel* c, const struct iovec* iov, unsigned nio)
+{
+    // If writev fails, just fall back to buffering path
+    ssize_t res = writev(c->fdh->fd, iov, nio);
+    dbg("direct write dst:%p sz:%u result:%d %s",
+        c, (unsigned) iovec_sum(iov, nio), (int) res,
+        res == -1 ? strerror(errno) : "");
+    size_t directwrsz = XMAX(res, 0);
+    if (c->track_bytes_written)
+        c->bytes_written += directwrsz;
+    c->stats.bytes_out += directwrsz;
+    return directwrsz;
+}
+
+// The SZ bytes at the end of C's ring buffer are new.  If TRY_DIRECT,
+// nothing was queued ahead of them, so try writing them out now.
+static void
+channel_write_added(struct channel* c, size_t sz, bool try_direct)
+{
     if (try_direct) {
-        // If writev fails, just fall back to buffering path
-        ssize_t res = writev(c->fdh->fd, iov, nio);
-        dbg("direct write dst:%p sz:%u result:%d %s",
-            c, (unsigned) totalsz, (int) res,
-            res == -1 ? strerror(errno) : "");
-        directwrsz = XMAX(res, 0);
-        if (c->track_bytes_written)
-            c->bytes_written += directwrsz;
+        struct iovec iov[2];
+        ringbuf_readable_iov(c->rb, iov, sz);
+        ringbuf_note_removed(c->rb,
+                             channel_write_direct(c, iov, ARRAYSIZE(iov)));
+    }
+    channel_note_buffered(c);
+}
+
+void
+channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
+{
+    assert(c->dir == CHANNEL_TO_FD);
+
+    if (c->fdh == NULL)
+        return; // If the stream is closed, just discard
+
+    // When the ring doubles as the LZ4 history, every byte has to
+    // pass through it, even ones we can write directly.
+    if (c->lz4_in_ring) {
+        size_t totalsz = iovec_sum(iov, nio);
+        bool try_direct = channel_try_direct_p(c, totalsz);
+        for (unsigned i = 0; i < nio; ++i) {
+            ringbuf_copy_in(c->rb, iov[i].iov_base, iov[i].iov_len);
+            ringbuf_note_added(c->rb, iov[i].iov_len);
+        }
+        channel_write_added(c, totalsz, try_direct);
+        return;
     }
 
+    size_t directwrsz = 0;
+    if (channel_try_direct_p(c, iovec_sum(iov, nio)))
+        directwrsz = channel_write_direct(c, iov, nio);
+
     for (unsigned i = 0; i < nio; ++i) {
         size_t skip = XMIN(iov[i].iov_len, directwrsz);
         directwrsz -= skip;
@@ -248,6 +397,21 @@ channel_write(struct channel* c, const struct iovec* iov, unsigned nio)
         ringbuf_copy_in(c->rb, b, blen);
         ringbuf_note_added(c->rb, blen);
     }
+
+    channel_note_buffered(c);
+}
+
+void
+channel_write_in_place(struct channel* c, size_t sz)
+{
+    assert(c->dir == CHANNEL_TO_FD);
+
+    if (c->fdh == NULL)
+        return;
+
+    bool try_direct = channel_try_direct_p(c, sz);
+    ringbuf_note_added(c->rb, sz);
+    channel_write_added(c, sz, try_direct);
 }
 
 // Begin channel shutdown process.  Closure is not complete until
@@ -270,8 +434,14 @@ channel_close(struct channel* c)
             c->saved_term_state = NULL;
         }
 
-        fdh_destroy(c->fdh);
+        if (c->stripes != NULL)
+            stripe_set_close(c->stripes);
+        else
+            fdh_destroy(c->fdh);
         c->fdh = NULL;
+#ifdef HAVE_SPLICE
+        c->splice_avail = 0;
+#endif
     }
 }
 
@@ -281,7 +451,9 @@ poll_channel_2(void* arg)
     struct channel* c = arg;
     size_t sz;
 
-    if ((sz = channel_wanted_readsz(c)) > 0) {
+    if ((sz = channel_wanted_readsz(c)) > 0 &&
+        !channel_note_splice_avail(c))
+    {
         size_t nr_read;
         if (c->adb_encoding_hack)
             nr_read = channel_read_adb_hack(c, sz);
@@ -291,6 +463,8 @@ poll_channel_2(void* arg)
         assert(nr_read <= c->window);
         if (c->track_window)
             c->window -= nr_read;
+        c->stats.bytes_in += nr_read;
+        channel_note_buffered(c);
 
         if (nr_read == 0)
             channel_close(c);
@@ -306,6 +480,7 @@ poll_channel_2(void* arg)
         assert(nr_written <= UINT32_MAX - c->bytes_written);
         if (c->track_bytes_written)
             c->bytes_written += nr_written;
+        c->stats.bytes_out += nr_written;
 
         if (c->pending_close && ringbuf_size(c->rb) == 0)
             channel_close(c);
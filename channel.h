@@ -13,6 +13,8 @@
 #include <stdbool.h>
 #include <sys/uio.h>
 #include <sys/poll.h>
+#include "shmring.h"
+#include "proto.h"
 
 enum channel_direction {
     CHANNEL_TO_FD,
@@ -20,6 +22,57 @@ enum channel_direction {
 };
 
 struct ttysave;
+struct lz4_history;
+struct stripe_set;
+
+// Adaptive compression state: see compression_note_result in core.c
+struct channel_compression {
+    uint32_t probe_raw;   // Uncompressed cost of bytes in this probe
+    uint32_t probe_wire;  // What they actually cost
+    uint32_t backoff;     // Length of the last compression pause
+    uint32_t skip;        // Bytes left in the current pause
+    // Totals, for debugging and statistics
+    uint64_t total_raw;
+    uint64_t total_wire;
+    uint64_t total_skipped;
+    unsigned nr_backoffs;
+};
+
+// Counters for --stats.  Channels keep them all the time: they cost
+// an addition or two per IO.  The io loop maintains window_blocked
+// only if fb_adb_sh asks it to, since that needs the clock.
+struct channel_stats {
+    uint64_t bytes_in;      // Read from our descriptor
+    uint64_t bytes_out;     // Written to our descriptor
+    size_t high_water;      // Most bytes ever buffered in rb
+    double window_blocked;  // Seconds with room to read but no window
+    double window_blocked_since; // Start of the current stall, or zero
+    // Messages by type, less MSG_TYPE_PRE + 1.  Only FROM_PEER
+    // (messages received) and TO_PEER (messages sent) count them.
+    uint64_t msgs[NR_MSG_TYPES];
+};
+
+// How urgently io_loop_pump sends a channel's data to the peer.
+// Control messages always go first.
+enum channel_priority {
+    CHANNEL_PRIORITY_BULK,        // Default
+    CHANNEL_PRIORITY_STDERR,
+    CHANNEL_PRIORITY_INTERACTIVE, // Keystrokes and pty output
+    CHANNEL_PRIORITY_MAX = CHANNEL_PRIORITY_INTERACTIVE
+};
+
+// Receive window autotuning state: see window_note_received in core.c
+struct channel_window_tuning {
+    uint32_t target;      // Window we want the peer to have; 0 if untuned
+    uint32_t peer_window; // Credit the peer has left, as far as we know
+    uint32_t debt;        // Credit to withhold to shrink the window
+    uint32_t round_bytes; // Received since ROUND_START
+    double round_start;
+    double unstall_time;  // When we gave a stalled peer more credit
+    double rtt;           // Smoothed round trip time; 0 if unknown
+    bool stalled;         // Peer was waiting on us for credit
+    bool window_limited;  // ...at some point this round
+};
 
 struct channel {
     struct fdh* fdh;
@@ -30,6 +83,20 @@ struct channel {
     uint32_t bytes_written;
     uint32_t window;
     uint8_t adb_hack_state;
+    struct lz4_history* lz4h; // Set up by io_loop_init
+    uint16_t lz4_acceleration; // 0 or 1 means LZ4's default
+    struct channel_compression compression;
+    struct channel_window_tuning window_tuning;
+    struct channel_stats stats;
+    enum channel_priority priority;
+    uint32_t sched_deficit; // Bytes left in this round's quantum
+#ifdef HAVE_SPLICE
+    size_t splice_avail; // Bytes waiting in our pipe for xmit_data_splice
+#endif
+#ifdef HAVE_SHM_TRANSPORT
+    struct shmring* shm; // If set, fdh is only SHM's doorbell socket
+#endif
+    struct stripe_set* stripes; // If set, fdh is the current stripe's
     unsigned sent_eof : 1;
     unsigned pending_close : 1;
     unsigned always_buffer : 1;
@@ -37,15 +104,36 @@ struct channel {
     unsigned track_window : 1;
     unsigned adb_encoding_hack : 1;
     unsigned compress : 1;
+    unsigned compress_stream : 1;
+    unsigned compress_dict : 1; // With compress_stream, prime history
+    unsigned lz4_in_ring : 1; // RB, not LZ4H, holds the LZ4 history
 #ifdef FBADB_CHANNEL_NONBLOCK_HACK
     unsigned nonblock_hack : 1;
 #endif
+#ifdef HAVE_SPLICE
+    unsigned splice : 1;
+#endif
 };
 
 struct channel* channel_new(struct fdh* fdh,
                             size_t rbsz,
                             enum channel_direction direction);
 
+#ifdef HAVE_SHM_TRANSPORT
+// Make a channel that moves data through the shared memory ring SR,
+// whose doorbell socket is BELLFDH.
+struct channel* channel_new_shm(struct shmring* sr,
+                                struct fdh* bellfdh,
+                                size_t rbsz,
+                                enum channel_direction direction);
+#endif
+
+// Make a channel that moves data over the connections in the stripe
+// set SS.
+struct channel* channel_new_striped(struct stripe_set* ss,
+                                    size_t rbsz,
+                                    enum channel_direction direction);
+
 struct pollfd channel_request_poll(struct channel* c);
 void channel_poll(struct channel* c);
 
@@ -53,6 +141,11 @@ void channel_write(struct channel* c,
                    const struct iovec* iov,
                    unsigned nio);
 
+// Like channel_write, but for SZ bytes the caller has already put in
+// the writable part of C's ring buffer.  While a channel is closed,
+// the bytes are discarded.
+void channel_write_in_place(struct channel* c, size_t sz);
+
 void channel_close(struct channel* c);
 
 bool channel_dead_p(struct channel* c);
@@ -12,6 +12,8 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <assert.h>
+#include <unistd.h>
 #include "util.h"
 #include "chat.h"
 #include "fs.h"
@@ -28,14 +30,44 @@ chat_new(int to, int from)
 {
     struct chat* cc = xcalloc(sizeof (*cc));
     cc->to = xfdopen(to, "w");
-    cc->from = xfdopen(from, "r");
+    cc->from = from;
     return cc;
 }
 
+// Return the next byte from the peer, or EOF at end of file.
+static int
+chat_getc_maybe(struct chat* cc)
+{
+    if (cc->pos == cc->end) {
+        ssize_t ret;
+        do {
+            WITH_IO_SIGNALS_ALLOWED();
+            ret = read(cc->from, cc->buf, sizeof (cc->buf));
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret < 0)
+            die_errno("read(%d)", cc->from);
+
+        cc->pos = 0;
+        cc->end = ret;
+        if (ret == 0)
+            return EOF;
+    }
+
+    return (unsigned char) cc->buf[cc->pos++];
+}
+
+static void
+chat_ungetc(struct chat* cc)
+{
+    assert(cc->pos > 0);
+    cc->pos -= 1;
+}
+
 char
 chat_getc(struct chat* cc)
 {
-    int c = getc(cc->from);
+    int c = chat_getc_maybe(cc);
     if (c == EOF)
         chat_die();
 
@@ -61,7 +93,7 @@ chat_expect_maybe(struct chat* cc, char expected)
 {
     char c = chat_getc(cc);
     if (c != expected) {
-        ungetc(c, cc->from);
+        chat_ungetc(cc);
         return false;
     }
     return true;
@@ -78,7 +110,7 @@ chat_swallow_prompt(struct chat* cc)
     struct growable_string pre_prompt = {};
 
     for (;;) {
-        int char_read = getc(cc->from);
+        int char_read = chat_getc_maybe(cc);
         if (char_read == EOF) {
             growable_string_trim_trailing_whitespace(&pre_prompt);
             if (pre_prompt.strlen == 0)
@@ -187,10 +219,39 @@ chat_talk_at(struct chat* cc, const char* what, int flags)
 char*
 chat_read_line(struct chat* cc)
 {
-    size_t linesz;
-    char* line = slurp_line(cc->from, &linesz);
-    if (line == NULL)
-        die(ECOMM, "lost connection to child");
-    rtrim(line, &linesz, "\r\n");
-    return line;
+    struct growable_string line = {};
+    int c;
+
+    do {
+        c = chat_getc_maybe(cc);
+        if (c == EOF)
+            die(ECOMM, "lost connection to child");
+        growable_string_append_c(&line, c);
+    } while (c != '\n');
+
+    char* ret = (char*) growable_string_c_str(&line);
+    size_t linesz = line.strlen;
+    rtrim(ret, &linesz, "\r\n");
+    return ret;
+}
+
+size_t
+chat_read_all(struct chat* cc, void* buf, size_t sz)
+{
+    size_t nr_buffered = XMIN(sz, cc->end - cc->pos);
+    memcpy(buf, cc->buf + cc->pos, nr_buffered);
+    cc->pos += nr_buffered;
+    if (nr_buffered == sz)
+        return sz;
+    return nr_buffered +
+        read_all(cc->from, (char*) buf + nr_buffered, sz - nr_buffered);
+}
+
+size_t
+chat_take_pending(struct chat* cc, const void** buf)
+{
+    size_t nr_pending = cc->end - cc->pos;
+    *buf = cc->buf + cc->pos;
+    cc->pos = cc->end;
+    return nr_pending;
 }
@@ -12,10 +12,21 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include "constants.h"
+
+// We read from the peer in blocks, so a chat can end up holding bytes
+// that arrived after the last line it consumed.  When the peer
+// switches from lines to the framed protocol right after its hello,
+// those bytes are the start of the protocol stream: hand them over
+// with chat_read_all or chat_take_pending.
 
 struct chat {
     FILE* to;
-    FILE* from;
+    int from;
+    size_t pos; // Next unconsumed byte in buf
+    size_t end; // End of the bytes we've read into buf
+    char buf[CHAT_BUFFER_SIZE];
 };
 
 struct chat* chat_new(int to, int from);
@@ -24,4 +35,13 @@ void chat_expect(struct chat* cc, char expected);
 void chat_talk_at(struct chat* cc, const char* what, int flags);
 char* chat_read_line(struct chat* cc);
 
+// Read SZ bytes from the peer, starting with anything the chat has
+// buffered.  Return fewer only at end of file, like read_all.
+size_t chat_read_all(struct chat* cc, void* buf, size_t sz);
+
+// Return the number of bytes the chat has read but not consumed, and
+// set *BUF to point to them.  The chat then forgets them; *BUF stays
+// valid until the next read from the chat.
+size_t chat_take_pending(struct chat* cc, const void** buf);
+
 #define CHAT_SWALLOW_PROMPT 0x1
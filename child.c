@@ -23,6 +23,9 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <limits.h>
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
 #include "child.h"
 #include "net.h"
 #include "fs.h"
@@ -102,7 +105,9 @@ child_cleanup(void* arg)
 {
     struct child* child = arg;
     if (!child->dead) {
-        if (child->pty_master == NULL) {
+        if (child->reap_on_cleanup) {
+            dbg("waiting for child %u to finish", (unsigned) child->pid);
+        } else if (child->pty_master == NULL) {
             int sig = child->deathsig ?: SIGTERM;
             pid_t child_pid = child->pid;
             if (sig < 0) {
@@ -139,6 +144,160 @@ dummy_parent_fd(int for_fdno)
         : xopen("/dev/null", O_RDONLY, 0);
 }
 
+static pid_t
+child_fork(const struct child_start_info* csi,
+           int flags,
+           int pty_slave,
+           int* childfd)
+{
+    // We need to block all signals until the child calls signal(2) to
+    // reset its signal handlers to the default.  If we didn't, the
+    // child could run handlers we didn't expect.
+
+    sigset_t all_blocked;
+    sigset_t prev_blocked;
+
+    VERIFY(sigfillset(&all_blocked) == 0);
+    VERIFY(sigprocmask(SIG_SETMASK, &all_blocked, &prev_blocked) == 0);
+
+    pid_t child_pid = fork();
+    if (child_pid == 0) {
+        struct internal_child_info ci = {
+            .flags = flags,
+            .csi = csi,
+            .pty_slave = pty_slave,
+            .childfd = childfd,
+        };
+
+        if ((flags & CHILD_SETSID)) {
+            // If we own the child's session, we own its signal
+            // disposition too, so don't let inherit anything
+            // about signals.
+            sigemptyset(&ci.signals_to_ignore);
+            sigemptyset(&ci.signals_to_block);
+        } else {
+            memcpy(&ci.signals_to_ignore,
+                   &orig_sig_ignored,
+                   sizeof (sigset_t));
+            memcpy(&ci.signals_to_block,
+                   &orig_sigmask,
+                   sizeof (sigset_t));
+        }
+
+        child_child(&ci); // Never returns
+    }
+
+    VERIFY(sigprocmask(SIG_SETMASK, &prev_blocked, NULL) == 0);
+    if (child_pid == -1)
+        die_errno("fork");
+
+    return child_pid;
+}
+
+#ifdef HAVE_POSIX_SPAWN
+// Forking copies our page tables, which gets expensive when we're
+// holding big buffers, so we'd rather posix_spawn.  posix_spawn can't
+// run our code in the child, though, so use it only for children
+// that need nothing but their standard descriptors and our original
+// signal dispositions.
+static bool
+child_spawn_ok_p(const struct child_start_info* csi,
+                 int flags,
+                 const int* childfd)
+{
+    if ((flags & CHILD_SETSID) || csi->pre_exec || csi->child_chdir)
+        return false;
+
+    // posix_spawn's dup2 to the same descriptor wouldn't clear
+    // O_CLOEXEC everywhere, and a low CHILDFD could be clobbered by
+    // an earlier dup2.
+    for (int i = 0; i < 3; ++i)
+        if (childfd[i] < 3)
+            return false;
+
+    // posix_spawn can reset signals to the default, but not to
+    // ignored, so a signal ignored at startup that we now catch
+    // needs the fork path.
+    for (int signo = 1; signo < NSIG; ++signo) {
+        struct sigaction sa;
+        if (sigismember(&orig_sig_ignored, signo) &&
+            (sigaction(signo, NULL, &sa) != 0 ||
+             (sa.sa_flags & SA_SIGINFO) ||
+             sa.sa_handler != SIG_IGN))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Start the child with posix_spawn.  Return -1 if we couldn't, in
+// which case the caller falls back to child_fork, which reports
+// errors the usual way.
+static pid_t
+child_spawn(const struct child_start_info* csi, const int* childfd)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    pid_t child_pid = -1;
+    int ret;
+
+    // Like reset_orig_signal_context, but in the child.
+    sigemptyset(&sigdefault);
+    for (int signo = 1; signo < NSIG; ++signo) {
+        if (signo == SIGKILL || signo == SIGSTOP)
+            continue;
+#ifdef __linux__
+        if (signo > SIGSYS && signo < SIGRTMIN)
+            continue;
+#endif
+        if (!sigismember(&orig_sig_ignored, signo))
+            sigaddset(&sigdefault, signo);
+    }
+
+    if ((ret = posix_spawn_file_actions_init(&fa)) != 0)
+        goto out;
+
+    if ((ret = posix_spawnattr_init(&attr)) != 0)
+        goto out_fa;
+
+    for (int i = 0; i < 3 && ret == 0; ++i)
+        ret = posix_spawn_file_actions_adddup2(&fa, childfd[i], i);
+
+    if (ret == 0)
+        ret = posix_spawnattr_setflags(
+            &attr,
+            POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    if (ret == 0)
+        ret = posix_spawnattr_setsigmask(&attr, &orig_sigmask);
+    if (ret == 0)
+        ret = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    if (ret == 0)
+        ret = posix_spawnp(&child_pid,
+                           csi->exename,
+                           &fa,
+                           &attr,
+                           (char* const*) csi->argv,
+                           csi->environ
+                           ? (char* const*) csi->environ
+                           : environ);
+
+    posix_spawnattr_destroy(&attr);
+  out_fa:
+    posix_spawn_file_actions_destroy(&fa);
+  out:
+    if (ret != 0) {
+        dbg("posix_spawn(\"%s\") failed: %s: forking instead",
+            csi->exename, strerror(ret));
+        return -1;
+    }
+
+    return child_pid;
+}
+#endif
+
 struct child*
 child_start(const struct child_start_info* csi)
 {
@@ -229,6 +388,10 @@ child_start(const struct child_start_info* csi)
                 childfd[i] = xdup(childfd[1]);
                 parentfd[i] = dummy_parent_fd(i);
                 break;
+            case CHILD_IO_FD:
+                childfd[i] = xdup(csi->io_fd[i]);
+                parentfd[i] = dummy_parent_fd(i);
+                break;
         }
     }
 
@@ -242,46 +405,13 @@ child_start(const struct child_start_info* csi)
     child->fd[1] = fdh_dup(parentfd[1]);
     child->fd[2] = fdh_dup(parentfd[2]);
 
-    // We need to block all signals until the child calls signal(2) to
-    // reset its signal handlers to the default.  If we didn't, the
-    // child could run handlers we didn't expect.
-
-    sigset_t all_blocked;
-    sigset_t prev_blocked;
-
-    VERIFY(sigfillset(&all_blocked) == 0);
-    VERIFY(sigprocmask(SIG_SETMASK, &all_blocked, &prev_blocked) == 0);
-
-    pid_t child_pid = fork();
-    if (child_pid == 0) {
-        struct internal_child_info ci = {
-            .flags = flags,
-            .csi = csi,
-            .pty_slave = pty_slave,
-            .childfd = childfd,
-        };
-
-        if ((flags & CHILD_SETSID)) {
-            // If we own the child's session, we own its signal
-            // disposition too, so don't let inherit anything
-            // about signals.
-            sigemptyset(&ci.signals_to_ignore);
-            sigemptyset(&ci.signals_to_block);
-        } else {
-            memcpy(&ci.signals_to_ignore,
-                   &orig_sig_ignored,
-                   sizeof (sigset_t));
-            memcpy(&ci.signals_to_block,
-                   &orig_sigmask,
-                   sizeof (sigset_t));
-        }
-
-        child_child(&ci); // Never returns
-    }
-
-    VERIFY(sigprocmask(SIG_SETMASK, &prev_blocked, NULL) == 0);
+    pid_t child_pid = -1;
+#ifdef HAVE_POSIX_SPAWN
+    if (child_spawn_ok_p(csi, flags, childfd))
+        child_pid = child_spawn(csi, childfd);
+#endif
     if (child_pid == -1)
-        die_errno("fork");
+        child_pid = child_fork(csi, flags, pty_slave, childfd);
 
     child->pid = child_pid;
     cleanup_commit(cl_waiter, child_cleanup, child);
@@ -22,6 +22,7 @@ enum child_io_mode {
     CHILD_IO_INHERIT,
     CHILD_IO_RECORD,
     CHILD_IO_DUP_TO_STDOUT,
+    CHILD_IO_FD, // Give the child a copy of io_fd[N]
 };
 
 struct child_start_info {
@@ -30,6 +31,7 @@ struct child_start_info {
     const char* const* argv;
     const char* const* environ;
     enum child_io_mode io[3];
+    int io_fd[3];
     void (*pre_exec)(void* data);
     void* pre_exec_data;
     void (*pty_setup)(int master, int slave, void* data);
@@ -49,6 +51,7 @@ struct child {
     struct fdrecorder* recorder[3];
     unsigned dead : 1;
     unsigned skip_cleanup_wait : 1;
+    unsigned reap_on_cleanup : 1; // Let it finish instead of killing
 };
 
 struct child* child_start(const struct child_start_info* csi);
@@ -12,10 +12,18 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 #include "util.h"
 #include "autocmd.h"
 #include "fs.h"
 #include "strutil.h"
+#include "argv.h"
+#include "child.h"
+#include "constants.h"
+#include "devinfo.h"
+#include "peer.h"
+#include "sha2.h"
 
 #if FBADB_MAIN
 static const char bash_completion[] = {
@@ -39,4 +47,175 @@ bash_completion_main(const struct cmd_bash_completion_info* info)
     write_all(STDOUT_FILENO, bash_completion, sizeof (bash_completion));
     return 0;
 }
+
+// The completion functions ask the device the same few questions
+// over and over as the user presses TAB, so we remember the raw
+// replies for a few seconds in my_fb_adb_directory()/completion-cache.
+// Each record's body is the stub's output, unparsed: the shell side
+// already knows how to decode it.
+
+static const struct ttl_cache completion_cache = {
+    .subdir = "completion-cache",
+    .magic = "fbcomp1",
+    .max_bytes = COMPLETION_CACHE_MAX_BYTES,
+};
+
+struct completion_query {
+    const struct cmd_bash_completion_query_info* info;
+    const char* const* adb_args;
+    const char* ls_ops; // NULL for a property query
+    const char* const* paths;
+    int ttl_s;
+};
+
+struct completion_reply {
+    const char* output;
+    size_t size;
+};
+
+static const char*
+completion_cache_key(const struct completion_query* q)
+{
+    SCOPED_RESLIST(rl);
+    char* key = xaprintf("%s\n%s\n%d\n%s",
+                         device_cache_key(q->adb_args),
+                         q->info->user.user ?: "",
+                         (int) q->info->user.root,
+                         q->ls_ops ?: "getprop");
+    for (const char* const* path = q->paths; *path != NULL; ++path)
+        key = xaprintf("%s\n%s", key, *path);
+
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    SHA256_Data((const uint8_t*) key, strlen(key), digest);
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xstrdup(digest);
+}
+
+static void
+completion_cache_write_body(int fd, void* data)
+{
+    const struct completion_reply* reply = data;
+    write_all(fd, reply->output, reply->size);
+}
+
+// Return the cached reply to Q, or NULL if we don't have a fresh one.
+static const char*
+completion_cache_lookup(const struct completion_query* q, size_t* size)
+{
+    return ttl_cache_lookup(&completion_cache,
+                            completion_cache_key(q),
+                            size);
+}
+
+static const char*
+completion_fetch(const struct completion_query* q, size_t* size)
+{
+    struct strlist* args;
+    if (q->ls_ops != NULL) {
+        args = strlist_from_argv(
+            ARGV("finfo-json", "-i", xaprintf("ls:%s", q->ls_ops)));
+        strlist_append(args, "--");
+        strlist_extend_argv(args, q->paths);
+    } else {
+        args = strlist_from_argv(ARGV("getprop"));
+    }
+
+    struct start_peer_info spi = {
+        .adb = q->info->adb,
+        .transport = q->info->transport,
+        .user = q->info->user,
+        .specified_io = true,
+        .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+    };
+    struct child* peer = start_peer(&spi, args);
+    const char* output = slurp_fd(peer->fd[STDOUT_FILENO]->fd, size);
+    child_wait_die_on_error(peer);
+
+    struct completion_reply reply = {
+        .output = output,
+        .size = *size,
+    };
+    ttl_cache_store(&completion_cache,
+                    completion_cache_key(q),
+                    q->ttl_s,
+                    completion_cache_write_body,
+                    &reply);
+    return output;
+}
+
+static void
+completion_prefetch_setup(void* data)
+{}
+
+// Someone completing in directory D tends to back up and complete in
+// the directory next to it, so after answering them, warm the cache
+// with D's parent, which lists D's siblings.  We do that in the
+// background so that the shell gets its answer now.
+static void
+completion_prefetch_parent(const struct completion_query* q)
+{
+    const char* path = q->paths[0];
+    if (path == NULL || q->paths[1] != NULL)
+        return;
+
+    const char* parent = xdirname(path);
+    if (!strcmp(parent, path) ||
+        !strcmp(path, ".") ||
+        strspn(path, "/") == strlen(path))
+    {
+        return;
+    }
+
+    struct completion_query pq = *q;
+    pq.paths = ARGV(parent);
+    size_t size;
+    if (completion_cache_lookup(&pq, &size) != NULL)
+        return;
+
+    become_daemon(completion_prefetch_setup, NULL);
+    (void) completion_fetch(&pq, &size);
+}
+
+int
+bash_completion_query_main(
+    const struct cmd_bash_completion_query_info* info)
+{
+    struct strlist* adb_args = strlist_new();
+    emit_args_adb_opts(adb_args, &info->adb);
+    struct completion_query q = {
+        .info = info,
+        .adb_args = strlist_to_argv(adb_args),
+        .paths = info->paths,
+        .ttl_s = COMPLETION_CACHE_LS_TTL_S,
+    };
+
+    if (!strcmp(info->query, "ls")) {
+        q.ls_ops = "stat";
+    } else if (!strcmp(info->query, "ls-exec")) {
+        q.ls_ops = "stat+execp";
+    } else if (!strcmp(info->query, "properties")) {
+        if (info->paths[0] != NULL)
+            usage_error("property queries take no paths");
+        q.ttl_s = COMPLETION_CACHE_PROPERTIES_TTL_S;
+    } else {
+        usage_error("unknown completion query \"%s\"", info->query);
+    }
+
+    if (q.ls_ops != NULL && info->paths[0] == NULL)
+        usage_error("no paths to list");
+
+    size_t size;
+    const char* output = completion_cache_lookup(&q, &size);
+    if (output != NULL) {
+        write_all(STDOUT_FILENO, output, size);
+        return 0;
+    }
+
+    output = completion_fetch(&q, &size);
+    write_all(STDOUT_FILENO, output, size);
+    if (q.ls_ops != NULL)
+        completion_prefetch_parent(&q);
+    return 0;
+}
 #endif
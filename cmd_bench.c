@@ -0,0 +1,381 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+#include "autocmd.h"
+#include "child.h"
+#include "constants.h"
+#include "fs.h"
+#include "json.h"
+#include "peer.h"
+
+// Each measurement runs a real fb-adb child, so that what we time
+// is exactly what a user of fb-adb shell or fb-adb ping would see:
+// the transport, the stub, the io loops on both ends, and (for
+// session setup) everything fb-adb does before the command starts.
+
+static double
+bench_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return xclock_gettime(CLOCK_MONOTONIC);
+#else
+    return seconds_since_epoch();
+#endif
+}
+
+static unsigned long long
+parse_bench_number(const char* s, const char* what)
+{
+    char* endptr;
+    errno = 0;
+    unsigned long long n = strtoull(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        n == 0 || n > UINT_MAX)
+    {
+        die(EINVAL, "invalid %s %s", what, s);
+    }
+    return n;
+}
+
+static int
+compare_doubles(const void* a, const void* b)
+{
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return da < db ? -1 : da > db;
+}
+
+static uint64_t
+seconds_to_us(double seconds)
+{
+    return (uint64_t) (seconds * 1e6 + 0.5);
+}
+
+// Emit an object summarizing the NR durations in SAMPLES.
+static void
+bench_emit_stats(struct json_writer* writer,
+                 const char* name,
+                 double* samples,
+                 unsigned nr)
+{
+    qsort(samples, nr, sizeof (*samples), compare_doubles);
+    double total = 0;
+    for (unsigned i = 0; i < nr; ++i)
+        total += samples[i];
+
+    json_begin_field(writer, name);
+    json_begin_object(writer);
+    json_begin_field(writer, "rounds");
+    json_emit_u64(writer, nr);
+    json_begin_field(writer, "min_us");
+    json_emit_u64(writer, seconds_to_us(samples[0]));
+    json_begin_field(writer, "median_us");
+    json_emit_u64(writer, seconds_to_us(samples[nr / 2]));
+    json_begin_field(writer, "mean_us");
+    json_emit_u64(writer, seconds_to_us(total / nr));
+    json_begin_field(writer, "max_us");
+    json_emit_u64(writer, seconds_to_us(samples[nr - 1]));
+    json_end_object(writer);
+}
+
+// Start fb-adb shell running SCRIPT on the device.  COMPRESSION, if
+// not NULL, overrides the --compression-acceleration we were given.
+// If PTY, give the remote command a pseudoterminal; otherwise, give
+// it pipes.
+static struct child*
+bench_start_shell(const struct cmd_bench_info* info,
+                  const char* script,
+                  const char* compression,
+                  bool pty,
+                  enum child_io_mode io)
+{
+    struct strlist* termops = strlist_new();
+    if (pty) {
+        // Once for a pty at all and once more for one even though
+        // our own standard streams aren't terminals
+        strlist_append(termops, "force-tty");
+        strlist_append(termops, "force-tty");
+    } else {
+        strlist_append(termops, "disable-tty");
+    }
+
+    struct cmd_shell_info si = {
+        .adb = info->adb,
+        .transport = info->transport,
+        .user = info->user,
+        .shex.termops = termops,
+        .command = script,
+    };
+
+    si.transport.timing = NULL;
+    if (compression != NULL)
+        si.transport.compression_acceleration = compression;
+
+    struct strlist* args = strlist_new();
+    strlist_append(args, orig_argv0);
+    strlist_xfer(args, make_args_cmd_shell(CMD_ARG_ALL | CMD_ARG_NAME, &si));
+
+    struct child_start_info csi = {
+        .io[STDIN_FILENO] = io,
+        .io[STDOUT_FILENO] = io,
+        .io[STDERR_FILENO] = CHILD_IO_INHERIT,
+        .exename = my_exe(),
+        .argv = strlist_to_argv(args),
+    };
+
+    return child_start(&csi);
+}
+
+static void
+bench_finish(struct child* child, const char* what)
+{
+    if (!child_status_success_p(child_wait(child)))
+        die(ECOMM, "%s benchmark: fb-adb shell failed", what);
+}
+
+// Time how long it takes fb-adb shell to run a command that does
+// nothing, start to finish.
+static void
+bench_setup(struct json_writer* writer, const struct cmd_bench_info* info)
+{
+    SCOPED_RESLIST(rl);
+    double samples[BENCH_SETUP_ROUNDS];
+    for (unsigned i = 0; i < ARRAYSIZE(samples); ++i) {
+        double start = bench_now();
+        bench_finish(
+            bench_start_shell(info, ":", NULL, false, CHILD_IO_DEV_NULL),
+            "setup");
+        samples[i] = bench_now() - start;
+    }
+
+    bench_emit_stats(writer, "setup", samples, ARRAYSIZE(samples));
+}
+
+static void
+bench_emit_throughput(struct json_writer* writer,
+                      const char* direction,
+                      bool compressed,
+                      uint64_t bytes,
+                      double elapsed)
+{
+    json_begin_object(writer);
+    json_begin_field(writer, "direction");
+    json_emit_string(writer, direction);
+    json_begin_field(writer, "compression");
+    json_emit_bool(writer, compressed);
+    json_begin_field(writer, "bytes");
+    json_emit_u64(writer, bytes);
+    json_begin_field(writer, "usec");
+    json_emit_u64(writer, seconds_to_us(elapsed));
+    json_begin_field(writer, "bytes_per_second");
+    json_emit_u64(writer, elapsed > 0 ? (uint64_t) (bytes / elapsed) : 0);
+    json_end_object(writer);
+}
+
+// Send BLOCKS blocks of zeros to a device command that discards them.
+// The command writes a newline first, so that the clock starts only
+// once the session is up.
+static double
+bench_to_device(const struct cmd_bench_info* info,
+                const char* compression,
+                unsigned blocks)
+{
+    SCOPED_RESLIST(rl);
+    struct child* child = bench_start_shell(
+        info, "echo; exec cat >/dev/null", compression, false,
+        CHILD_IO_PIPE);
+
+    char c;
+    if (read_all(child->fd[STDOUT_FILENO]->fd, &c, 1) != 1)
+        die(ECOMM, "throughput benchmark: device command did not start");
+
+    char* buf = xcalloc(BENCH_BLOCK_SIZE);
+    double start = bench_now();
+    for (unsigned i = 0; i < blocks; ++i)
+        write_all(child->fd[STDIN_FILENO]->fd, buf, BENCH_BLOCK_SIZE);
+    fdh_destroy(child->fd[STDIN_FILENO]);
+    child->fd[STDIN_FILENO] = NULL;
+
+    // Standard output ends when cat exits, after it's read everything.
+    while (xread(child->fd[STDOUT_FILENO]->fd, buf, BENCH_BLOCK_SIZE) > 0)
+        continue;
+
+    double elapsed = bench_now() - start;
+    bench_finish(child, "throughput");
+    return elapsed;
+}
+
+// Read BLOCKS blocks of zeros that a device command generates,
+// timing from the first byte to the last.
+static double
+bench_from_device(const struct cmd_bench_info* info,
+                  const char* compression,
+                  unsigned blocks)
+{
+    SCOPED_RESLIST(rl);
+    char* script = xaprintf("exec dd if=/dev/zero bs=%u count=%u 2>/dev/null",
+                            (unsigned) BENCH_BLOCK_SIZE, blocks);
+    struct child* child = bench_start_shell(
+        info, script, compression, false, CHILD_IO_PIPE);
+    fdh_destroy(child->fd[STDIN_FILENO]);
+    child->fd[STDIN_FILENO] = NULL;
+
+    char* buf = xalloc(BENCH_BLOCK_SIZE);
+    uint64_t expected = (uint64_t) blocks * BENCH_BLOCK_SIZE;
+    uint64_t total = 0;
+    double start = 0;
+    size_t nr;
+    while ((nr = xread(child->fd[STDOUT_FILENO]->fd,
+                       buf, BENCH_BLOCK_SIZE)) > 0)
+    {
+        if (total == 0)
+            start = bench_now();
+        total += nr;
+    }
+
+    double elapsed = bench_now() - start;
+    bench_finish(child, "throughput");
+    if (total != expected)
+        die(ECOMM, "throughput benchmark: got %llu bytes, expected %llu",
+            (unsigned long long) total, (unsigned long long) expected);
+    return elapsed;
+}
+
+static void
+bench_throughput(struct json_writer* writer,
+                 const struct cmd_bench_info* info,
+                 unsigned blocks)
+{
+    // What --compression-acceleration says, or the default, against
+    // none
+    static const bool compressed[] = { true, false };
+    uint64_t bytes = (uint64_t) blocks * BENCH_BLOCK_SIZE;
+
+    json_begin_field(writer, "throughput");
+    json_begin_array(writer);
+    for (unsigned i = 0; i < ARRAYSIZE(compressed); ++i) {
+        const char* compression = compressed[i] ? NULL : "0";
+        bench_emit_throughput(writer, "to-device", compressed[i], bytes,
+                              bench_to_device(info, compression, blocks));
+        bench_emit_throughput(writer, "from-device", compressed[i], bytes,
+                              bench_from_device(info, compression, blocks));
+    }
+    json_end_array(writer);
+}
+
+// Send a byte to the peer CHILD and wait for it to come back.
+// Return how long that took.
+static double
+bench_round_trip(struct child* child, char csend, const char* what)
+{
+    double start = bench_now();
+    write_all(child->fd[STDIN_FILENO]->fd, &csend, 1);
+    char crecv;
+    if (!read_all(child->fd[STDOUT_FILENO]->fd, &crecv, 1))
+        die(ECOMM, "%s benchmark: remote did not echo", what);
+    if (crecv != csend)
+        die(ECOMM, "%s benchmark: remote echoed the wrong byte", what);
+    return bench_now() - start;
+}
+
+// Round trips through the stub's echo command, as fb-adb ping does
+static void
+bench_ping(struct json_writer* writer,
+           const struct cmd_bench_info* info,
+           unsigned rounds)
+{
+    SCOPED_RESLIST(rl);
+    struct start_peer_info spi = {
+        .adb = info->adb,
+        .transport = info->transport,
+        .user = info->user,
+        .specified_io = true,
+        .io[STDIN_FILENO] = CHILD_IO_PIPE,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+    };
+
+    struct child* peer = start_peer(&spi, strlist_from_argv(ARGV("_echo")));
+    bench_round_trip(peer, '.', "ping"); // Wait for the session
+    double* samples = xalloc(rounds * sizeof (*samples));
+    for (unsigned i = 0; i < rounds; ++i)
+        samples[i] = bench_round_trip(peer, '.', "ping");
+
+    fdh_destroy(peer->fd[STDIN_FILENO]);
+    peer->fd[STDIN_FILENO] = NULL;
+    bench_finish(peer, "ping");
+    bench_emit_stats(writer, "ping", samples, rounds);
+}
+
+// Type characters at a device pty and time how long the terminal
+// takes to echo each one back, as it would for someone typing into
+// fb-adb shell.  cat sees nothing until the line ends, so only the
+// pty echoes.
+static void
+bench_pty_echo(struct json_writer* writer,
+               const struct cmd_bench_info* info,
+               unsigned rounds)
+{
+    SCOPED_RESLIST(rl);
+    struct child* child = bench_start_shell(
+        info, "exec cat >/dev/null", NULL, true, CHILD_IO_PIPE);
+
+    bench_round_trip(child, 'x', "pty echo"); // Wait for the session
+    double* samples = xalloc(rounds * sizeof (*samples));
+    for (unsigned i = 0; i < rounds; ++i)
+        samples[i] = bench_round_trip(child, 'x', "pty echo");
+
+    // End the line, then end the file.
+    static const char eof[] = { '\n', 4 };
+    write_all(child->fd[STDIN_FILENO]->fd, eof, sizeof (eof));
+    fdh_destroy(child->fd[STDIN_FILENO]);
+    child->fd[STDIN_FILENO] = NULL;
+    char buf[256];
+    while (xread(child->fd[STDOUT_FILENO]->fd, buf, sizeof (buf)) > 0)
+        continue;
+    bench_finish(child, "pty echo");
+    bench_emit_stats(writer, "pty_echo", samples, rounds);
+}
+
+int
+bench_main(const struct cmd_bench_info* info)
+{
+    unsigned long long size = info->bench.size
+        ? parse_bench_number(info->bench.size, "size")
+        : BENCH_DEFAULT_SIZE;
+    unsigned blocks = XMAX(size / BENCH_BLOCK_SIZE, 1);
+    unsigned rounds = info->bench.rounds
+        ? parse_bench_number(info->bench.rounds, "round count")
+        : BENCH_DEFAULT_ROUNDS;
+
+    // The local stub can hand the device command our pipes directly,
+    // which would leave nothing of the protocol to measure.
+    if (setenv("FB_ADB_NO_FD_PASSING", "1", 1) == -1)
+        die_errno("setenv");
+
+    struct json_writer* writer = json_writer_create(xstdout);
+    json_begin_object(writer);
+    json_begin_field(writer, "transport");
+    json_emit_string(writer,
+                     info->transport.transport ?: "shell");
+    bench_setup(writer, info);
+    bench_throughput(writer, info, blocks);
+    bench_ping(writer, info, rounds);
+    bench_pty_echo(writer, info, rounds);
+    json_end_object(writer);
+    json_end_record(writer);
+    xflush(xstdout);
+    return 0;
+}
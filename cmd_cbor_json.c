@@ -0,0 +1,222 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "autocmd.h"
+#include "constants.h"
+#include "json.h"
+
+// Decoder for the CBOR that json_writer writes in JSON_FORMAT_CBOR
+// mode.  We accept any well-formed CBOR (RFC 8949) that has a JSON
+// equivalent, not just what we ourselves write.
+
+struct cbor_reader {
+    FILE* in;
+    struct growable_buffer buf;
+};
+
+static uint8_t
+cbor_read_byte(struct cbor_reader* rd)
+{
+    int c = getc(rd->in);
+    if (c == EOF) {
+        if (ferror(rd->in))
+            die_errno("read");
+        die(EINVAL, "truncated CBOR input");
+    }
+    return (uint8_t) c;
+}
+
+// Read the argument that follows initial byte IB.  Return false for
+// the indefinite-length marker.
+static bool
+cbor_read_argument(struct cbor_reader* rd, uint8_t ib, uint64_t* argument)
+{
+    uint8_t ai = ib & 0x1F;
+    if (ai < 24) {
+        *argument = ai;
+        return true;
+    }
+
+    if (ai == 31)
+        return false;
+
+    if (ai > 27)
+        die(EINVAL, "malformed CBOR item 0x%02x", ib);
+
+    unsigned nbytes = 1U << (ai - 24);
+    uint64_t value = 0;
+    for (unsigned i = 0; i < nbytes; ++i)
+        value = (value << 8) | cbor_read_byte(rd);
+    *argument = value;
+    return true;
+}
+
+// Read a definite-length string of SIZE bytes into our buffer and
+// return its contents, NUL-terminated.
+static const char*
+cbor_read_string_chunk(struct cbor_reader* rd, uint64_t size)
+{
+    if (size >= SIZE_MAX)
+        die_oom();
+    grow_buffer(&rd->buf, (size_t) size + 1);
+    if (size > 0 && fread(rd->buf.buf, (size_t) size, 1, rd->in) != 1) {
+        if (ferror(rd->in))
+            die_errno("read");
+        die(EINVAL, "truncated CBOR input");
+    }
+    rd->buf.buf[size] = '\0';
+    return (const char*) rd->buf.buf;
+}
+
+// Copy a text or byte string whose initial byte is IB to WRITER,
+// which must be in the middle of a string.
+static void
+cbor_copy_string(struct cbor_reader* rd,
+                 struct json_writer* writer,
+                 uint8_t ib)
+{
+    uint64_t size;
+    if (cbor_read_argument(rd, ib, &size)) {
+        const char* chunk = cbor_read_string_chunk(rd, size);
+        json_emit_string_part(writer, chunk, (size_t) size);
+        return;
+    }
+
+    // Indefinite length: definite-length chunks of the same major
+    // type, then a break.
+    for (;;) {
+        uint8_t chunk_ib = cbor_read_byte(rd);
+        if (chunk_ib == 0xFF)
+            break;
+        if ((chunk_ib >> 5) != (ib >> 5) ||
+            !cbor_read_argument(rd, chunk_ib, &size))
+            die(EINVAL, "malformed CBOR string chunk");
+        const char* chunk = cbor_read_string_chunk(rd, size);
+        json_emit_string_part(writer, chunk, (size_t) size);
+    }
+}
+
+// Read a map key, which must be a string, into our buffer.
+static const char*
+cbor_read_key(struct cbor_reader* rd, uint8_t ib)
+{
+    uint64_t size;
+    if ((ib >> 5) != 2 && (ib >> 5) != 3)
+        die(EINVAL, "unsupported non-string CBOR map key");
+    if (!cbor_read_argument(rd, ib, &size))
+        die(EINVAL, "unsupported indefinite-length CBOR map key");
+    return cbor_read_string_chunk(rd, size);
+}
+
+static void cbor_copy_item(struct cbor_reader* rd,
+                           struct json_writer* writer,
+                           uint8_t ib,
+                           unsigned depth);
+
+// Copy the members of an array or map whose initial byte is IB.
+static void
+cbor_copy_container(struct cbor_reader* rd,
+                    struct json_writer* writer,
+                    uint8_t ib,
+                    unsigned depth)
+{
+    if (depth >= CBOR_JSON_MAX_DEPTH)
+        die(EINVAL, "CBOR input nested too deeply");
+
+    bool map = (ib >> 5) == 5;
+    uint64_t count;
+    bool definite = cbor_read_argument(rd, ib, &count);
+    if (map)
+        json_begin_object(writer);
+    else
+        json_begin_array(writer);
+
+    for (uint64_t i = 0; !definite || i < count; ++i) {
+        uint8_t member_ib = cbor_read_byte(rd);
+        if (!definite && member_ib == 0xFF)
+            break;
+        if (map) {
+            json_begin_field(writer, cbor_read_key(rd, member_ib));
+            member_ib = cbor_read_byte(rd);
+        }
+        cbor_copy_item(rd, writer, member_ib, depth + 1);
+    }
+
+    if (map)
+        json_end_object(writer);
+    else
+        json_end_array(writer);
+}
+
+static void
+cbor_copy_item(struct cbor_reader* rd,
+               struct json_writer* writer,
+               uint8_t ib,
+               unsigned depth)
+{
+    uint64_t argument;
+    switch (ib >> 5) {
+        case 0:
+            cbor_read_argument(rd, ib, &argument);
+            json_emit_u64(writer, argument);
+            break;
+        case 1:
+            cbor_read_argument(rd, ib, &argument);
+            if (argument > INT64_MAX)
+                die(EINVAL, "CBOR negative integer out of range");
+            json_emit_i64(writer, -1 - (int64_t) argument);
+            break;
+        case 2:
+        case 3:
+            json_begin_string(writer);
+            cbor_copy_string(rd, writer, ib);
+            json_end_string(writer);
+            break;
+        case 4:
+        case 5:
+            cbor_copy_container(rd, writer, ib, depth);
+            break;
+        case 6:
+            // Tags add meaning we can't express in JSON; keep the
+            // tagged item.
+            cbor_read_argument(rd, ib, &argument);
+            cbor_copy_item(rd, writer, cbor_read_byte(rd), depth);
+            break;
+        default:
+            if (ib == 0xF4 || ib == 0xF5)
+                json_emit_bool(writer, ib == 0xF5);
+            else if (ib == 0xF6 || ib == 0xF7)
+                json_emit_null(writer);
+            else
+                die(EINVAL, "unsupported CBOR item 0x%02x", ib);
+            break;
+    }
+}
+
+int
+cbor_json_main(const struct cmd_cbor_json_info* info)
+{
+    struct cbor_reader rd = { .in = xstdin };
+    struct json_writer* writer = json_writer_create(xstdout);
+    int c;
+    while ((c = getc(rd.in)) != EOF) {
+        json_writer_reset(writer);
+        cbor_copy_item(&rd, writer, (uint8_t) c, 0);
+        json_end_record(writer);
+    }
+
+    if (ferror(rd.in))
+        die_errno("read");
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "util.h"
+#include "autocmd.h"
+#include "child.h"
+#include "constants.h"
+#include "fs.h"
+#include "strutil.h"
+
+// Each session is an fb-adb shell child process, so that one
+// session's failure can't take the others down (see util.h).  What
+// we share is everything else: one process decides what runs when
+// and relays all the output from one poll loop, and the children
+// find the same per-device daemons and caches.
+
+struct fanout_stream {
+    struct fdh* fdh;    // Child's end of the pipe: NULL after EOF
+    int out_fd;         // Where we relay what the child writes
+    struct growable_buffer partial; // Start of an unfinished line
+    size_t partial_size;
+};
+
+struct fanout_session {
+    const char* serial;
+    const char* prefix; // NULL if not prefixing lines
+    struct child* child;
+    struct fanout_stream stream[2]; // Child's stdout and stderr
+    int exit_code;
+};
+
+static unsigned
+parse_jobs(const char* s)
+{
+    char* endptr;
+    errno = 0;
+    unsigned long jobs = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        jobs == 0 || jobs > INT_MAX)
+    {
+        die(EINVAL, "invalid job count %s", s);
+    }
+    return jobs;
+}
+
+static int
+open_output_file(const char* output_dir,
+                 const char* serial,
+                 const char* suffix)
+{
+    if (strchr(serial, '/') != NULL)
+        die(EINVAL, "cannot name output file after serial %s", serial);
+    return xopen(xaprintf("%s/%s.%s", output_dir, serial, suffix),
+                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0666);
+}
+
+static void
+fanout_start(struct fanout_session* fs,
+             const struct cmd_fanout_info* info)
+{
+    struct cmd_shell_info si = {
+        .adb.serial = fs->serial,
+        .transport = info->transport,
+        .user = info->user,
+        .cwd = info->cwd,
+        .command = info->command,
+        .args = info->args,
+    };
+
+    struct strlist* args = strlist_new();
+    strlist_append(args, orig_argv0);
+    strlist_xfer(args, make_args_cmd_shell(CMD_ARG_ALL | CMD_ARG_NAME, &si));
+
+    struct child_start_info csi = {
+        .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+        .io[STDERR_FILENO] = CHILD_IO_PIPE,
+        .exename = my_exe(),
+        .argv = strlist_to_argv(args),
+    };
+
+    dbg("fanout: starting session on %s", fs->serial);
+    fs->child = child_start(&csi);
+    for (int i = 0; i < 2; ++i)
+        fs->stream[i].fdh = fs->child->fd[STDOUT_FILENO + i];
+}
+
+static void
+fanout_write_line(const struct fanout_session* fs,
+                  struct fanout_stream* st,
+                  const char* buf,
+                  size_t nr)
+{
+    struct iovec iov[4] = {
+        { (char*) fs->prefix, strlen(fs->prefix) },
+        { (char*) ": ", 2 },
+        { st->partial.buf, st->partial_size },
+        { (char*) buf, nr },
+    };
+    write_all_v(st->out_fd, iov, ARRAYSIZE(iov));
+    st->partial_size = 0;
+}
+
+static void
+fanout_relay(const struct fanout_session* fs,
+             struct fanout_stream* st,
+             const char* buf,
+             size_t nr)
+{
+    if (fs->prefix == NULL) {
+        write_all(st->out_fd, buf, nr);
+        return;
+    }
+
+    // Write only whole lines, so lines from different devices don't
+    // interleave.
+    while (nr > 0) {
+        const char* nl = memchr(buf, '\n', nr);
+        if (nl == NULL) {
+            grow_buffer(&st->partial, st->partial_size + nr);
+            memcpy(st->partial.buf + st->partial_size, buf, nr);
+            st->partial_size += nr;
+            return;
+        }
+
+        size_t linesz = nl - buf + 1;
+        fanout_write_line(fs, st, buf, linesz);
+        buf += linesz;
+        nr -= linesz;
+    }
+}
+
+// Relay what's waiting in stream STREAMNO of FS.  Return true if the
+// stream ended.
+static bool
+fanout_pump(struct fanout_session* fs, unsigned streamno)
+{
+    struct fanout_stream* st = &fs->stream[streamno];
+    char buf[32 * 1024];
+    size_t nr = xread(st->fdh->fd, buf, sizeof (buf));
+    if (nr > 0) {
+        fanout_relay(fs, st, buf, nr);
+        return false;
+    }
+
+    if (st->partial_size > 0)
+        fanout_write_line(fs, st, "\n", 1);
+    fdh_destroy(st->fdh);
+    st->fdh = NULL;
+    return true;
+}
+
+int
+fanout_main(const struct cmd_fanout_info* info)
+{
+    unsigned nr_sessions = 0;
+    const struct strlist* serial_args = info->fanout.serials;
+    for (const char* sarg = strlist_rewind(serial_args);
+         sarg != NULL;
+         sarg = strlist_next(serial_args))
+    {
+        nr_sessions += 1;
+    }
+
+    if (nr_sessions == 0)
+        usage_error("no devices given: use -s SERIAL for each");
+
+    unsigned jobs = info->fanout.jobs
+        ? parse_jobs(info->fanout.jobs)
+        : FANOUT_DEFAULT_JOBS;
+
+    const char* output_dir = info->fanout.output_dir;
+    if (output_dir != NULL &&
+        mkdir(output_dir, 0777) == -1 &&
+        errno != EEXIST)
+    {
+        die_errno("mkdir(\"%s\")", output_dir);
+    }
+
+    struct fanout_session* sessions =
+        xcalloc(nr_sessions * sizeof (*sessions));
+    unsigned n = 0;
+    for (const char* sarg = strlist_rewind(serial_args);
+         sarg != NULL;
+         sarg = strlist_next(serial_args))
+    {
+        const char* prefix = "serial=";
+        if (!string_starts_with_p(sarg, prefix))
+            die(EINVAL, "invalid serial option");
+        struct fanout_session* fs = &sessions[n++];
+        fs->serial = sarg + strlen(prefix);
+        if (output_dir != NULL) {
+            fs->stream[0].out_fd =
+                open_output_file(output_dir, fs->serial, "stdout");
+            fs->stream[1].out_fd =
+                open_output_file(output_dir, fs->serial, "stderr");
+        } else {
+            fs->prefix = fs->serial;
+            fs->stream[0].out_fd = STDOUT_FILENO;
+            fs->stream[1].out_fd = STDERR_FILENO;
+        }
+    }
+
+    // Two pollfds per running session, and each tells us which
+    // session and stream it's for.
+    struct pollfd* polls = xalloc(2 * nr_sessions * sizeof (*polls));
+    unsigned* poll_owner = xalloc(2 * nr_sessions * sizeof (*poll_owner));
+
+    unsigned next = 0;
+    unsigned running = 0;
+    unsigned finished = 0;
+    while (finished < nr_sessions) {
+        while (running < jobs && next < nr_sessions) {
+            fanout_start(&sessions[next++], info);
+            running += 1;
+        }
+
+        unsigned nr_polls = 0;
+        for (unsigned i = 0; i < next; ++i)
+            for (unsigned j = 0; j < 2; ++j)
+                if (sessions[i].stream[j].fdh != NULL) {
+                    polls[nr_polls].fd = sessions[i].stream[j].fdh->fd;
+                    polls[nr_polls].events = POLLIN;
+                    polls[nr_polls].revents = 0;
+                    poll_owner[nr_polls] = 2 * i + j;
+                    nr_polls += 1;
+                }
+
+        xpoll(polls, nr_polls, -1);
+
+        for (unsigned p = 0; p < nr_polls; ++p) {
+            if (polls[p].revents == 0)
+                continue;
+
+            struct fanout_session* fs = &sessions[poll_owner[p] / 2];
+            unsigned streamno = poll_owner[p] % 2;
+            if (!fanout_pump(fs, streamno) ||
+                fs->stream[1 - streamno].fdh != NULL)
+            {
+                continue;
+            }
+
+            // Both pipes closed, so the child is exiting.
+            fs->exit_code = child_status_to_exit_code(child_wait(fs->child));
+            dbg("fanout: session on %s exited with status %d",
+                fs->serial, fs->exit_code);
+            running -= 1;
+            finished += 1;
+        }
+    }
+
+    int ret = 0;
+    for (unsigned i = 0; i < nr_sessions; ++i)
+        if (sessions[i].exit_code != 0) {
+            xprintf(xstderr, "%s: %s: exit status %d\n",
+                    prgname, sessions[i].serial, sessions[i].exit_code);
+            ret = 1;
+        }
+
+    xflush(xstderr);
+    return ret;
+}
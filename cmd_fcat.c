@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "autocmd.h"
 #include "fs.h"
@@ -19,20 +21,163 @@
 FORWARD(fcat);
 
 #if !FBADB_MAIN
+
+// The part of each file we write: LENGTH bytes (or everything, if
+// !HAVE_LENGTH) starting OFFSET bytes from the start of the file, or
+// with FROM_END, from its end.
+struct fcat_range {
+    bool from_end;
+    uint64_t offset;
+    bool have_length;
+    uint64_t length;
+};
+
+struct fcat_ctx {
+    struct fcat_range range;
+    bool framed;
+    bool sendfile_ok;
+    uint8_t* buf;
+    size_t bufsz;
+};
+
+static uint64_t
+parse_fcat_number(const char* s, const char* what, bool* negative)
+{
+    const char* digits = s;
+    if (negative != NULL && (*negative = (digits[0] == '-')))
+        digits += 1;
+    char* endptr;
+    errno = 0;
+    unsigned long long n = strtoull(digits, &endptr, 10);
+    if (!isdigit((unsigned char) digits[0]) || *endptr != '\0' ||
+        errno != 0 || n > INT64_MAX)
+    {
+        die(EINVAL, "invalid %s %s", what, s);
+    }
+    return n;
+}
+
+// Clip our range to a file of SIZE bytes.  Return how many bytes of
+// it we write and set *START to where they begin.
+static uint64_t
+fcat_clip(const struct fcat_range* r, uint64_t size, uint64_t* start)
+{
+    if (r->from_end)
+        *start = r->offset < size ? size - r->offset : 0;
+    else
+        *start = XMIN(r->offset, size);
+    uint64_t nr = size - *start;
+    return r->have_length ? XMIN(nr, r->length) : nr;
+}
+
+static void
+fcat_frame_header(const struct fcat_ctx* ctx, uint64_t nr)
+{
+    if (ctx->framed) {
+        const char* hdr = xaprintf("%llu\n", (unsigned long long) nr);
+        write_all(STDOUT_FILENO, hdr, strlen(hdr));
+    }
+}
+
+// Write the range of the regular file FD, which has SIZE bytes.
+// Unless the file is shrinking under us, we never read anything we
+// don't write, and we let the kernel move the bytes when it can.
+static void
+fcat_regular(struct fcat_ctx* ctx,
+             const char* filename,
+             int fd,
+             uint64_t size)
+{
+    uint64_t start;
+    uint64_t nr = fcat_clip(&ctx->range, size, &start);
+    fcat_frame_header(ctx, nr);
+
+    off_t offset = start;
+    if (ctx->sendfile_ok && nr > 0)
+        nr -= sendfile_all(STDOUT_FILENO, fd, &offset,
+                           XMIN(nr, (uint64_t) SIZE_MAX),
+                           &ctx->sendfile_ok);
+
+    while (nr > 0) {
+        size_t chunksz = pread_all(fd, ctx->buf,
+                                   XMIN(nr, (uint64_t) ctx->bufsz),
+                                   offset);
+        if (chunksz == 0) {
+            // We promised the reader these bytes.
+            if (ctx->framed)
+                die(EINVAL, "%s: file shrank while reading", filename);
+            break;
+        }
+        write_all(STDOUT_FILENO, ctx->buf, chunksz);
+        offset += chunksz;
+        nr -= chunksz;
+    }
+}
+
+// Write the range of FD as we read it.  Files not regular, and files
+// like those in /proc that claim to be empty, have sizes we learn
+// only at EOF: we can't seek in them or, when framing, announce their
+// length before reading them.
+static void
+fcat_stream(struct fcat_ctx* ctx, int fd)
+{
+    const struct fcat_range* r = &ctx->range;
+    if (ctx->framed || r->from_end) {
+        size_t size;
+        const uint8_t* contents = (const uint8_t*) slurp_fd(fd, &size);
+        uint64_t start;
+        uint64_t nr = fcat_clip(r, size, &start);
+        fcat_frame_header(ctx, nr);
+        write_all(STDOUT_FILENO, contents + start, nr);
+        return;
+    }
+
+    uint64_t to_skip = r->offset;
+    uint64_t to_write = r->have_length ? r->length : UINT64_MAX;
+    while (to_write > 0) {
+        size_t nr_read = read_all(fd, ctx->buf, ctx->bufsz);
+        if (nr_read == 0)
+            break;
+        size_t skip = XMIN(to_skip, (uint64_t) nr_read);
+        to_skip -= skip;
+        size_t nr = XMIN(nr_read - skip, to_write);
+        write_all(STDOUT_FILENO, ctx->buf + skip, nr);
+        to_write -= nr;
+    }
+}
+
 int
 fcat_main(const struct cmd_fcat_info* info)
 {
-    size_t bufsz = 64*1024;
-    uint8_t* buf = xalloc(bufsz);
+    struct fcat_ctx ctx = {
+        .framed = info->fcat.framed,
+        .sendfile_ok = true,
+        .bufsz = 64*1024,
+    };
+
+    ctx.buf = xalloc(ctx.bufsz);
+    if (info->fcat.offset)
+        ctx.range.offset = parse_fcat_number(info->fcat.offset,
+                                             "offset",
+                                             &ctx.range.from_end);
+    if (info->fcat.length) {
+        ctx.range.have_length = true;
+        ctx.range.length = parse_fcat_number(info->fcat.length,
+                                             "length",
+                                             NULL);
+    }
+
     const char* const* files = info->files;
     while (files && *files) {
         SCOPED_RESLIST(rl);
         int fd = xopen(*files, O_RDONLY, 0);
-        size_t nr_read;
-        do {
-            nr_read = read_all(fd, buf, bufsz);
-            write_all(1, buf, nr_read);
-        } while (nr_read > 0);
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            die_errno("fstat(\"%s\")", *files);
+        if (S_ISREG(st.st_mode) && st.st_size > 0)
+            fcat_regular(&ctx, *files, fd, st.st_size);
+        else
+            fcat_stream(&ctx, fd);
         ++files;
     }
     return 0;
@@ -13,11 +13,76 @@
 #include <ctype.h>
 #include <limits.h>
 #include "util.h"
+#include "argv.h"
 #include "autocmd.h"
 #include "child.h"
 #include "peer.h"
 #include "xfer.h"
 #include "fs.h"
+#include "untar.h"
+
+// Run ctar on the device and unpack its output here.
+static int
+fget_recursive(const struct start_peer_info* spi,
+               const struct cmd_fget_info* info,
+               const char* local)
+{
+    const struct xfer_opts* xfer = &info->xfer;
+    if (info->more != NULL && info->more[0] != NULL)
+        die(EINVAL, "--recursive copies only one tree");
+    if (xfer->write_mode || xfer->delta || xfer->resume ||
+        xfer->streams || xfer->stats || xfer->if_changed)
+    {
+        die(EINVAL, "--recursive supports only --preserve, "
+            "--mode, and --sync from the file transfer options");
+    }
+
+    struct untar_opts opts = {
+        .preserve = xfer->preserve,
+        .sync = xfer->sync,
+    };
+
+    if (xfer->mode) {
+        char* endptr = NULL;
+        errno = 0;
+        unsigned long omode = strtoul(xfer->mode, &endptr, 8);
+        if (errno != 0 || *endptr != '\0' || (omode &~ 0777) != 0)
+            die(EINVAL, "invalid mode bits: %s", xfer->mode);
+        opts.chmod_explicit = true;
+        opts.chmod_explicit_modes = (mode_t) omode;
+    }
+
+    // Name the tree the way ctar will name it in the archive.
+    char* remote = xstrdup(info->remote);
+    size_t remote_length = strlen(remote);
+    while (remote_length > 1 && remote[remote_length - 1] == '/')
+        remote[--remote_length] = '\0';
+    const char* archive_root = remote;
+    while (archive_root[0] == '/')
+        archive_root += 1;
+    if (archive_root[0] == '\0')
+        archive_root = ".";
+
+    const char* dest_root = local;
+    struct stat st;
+    if (stat(local, &st) == 0 && S_ISDIR(st.st_mode)) {
+        const char* base = xbasename(remote);
+        if (strcmp(base, "/") != 0 && strcmp(base, ".") != 0)
+            dest_root = xaprintf("%s/%s", local, base);
+    }
+
+    struct cmd_ctar_info ci = {
+        .paths = ARGV(remote),
+    };
+
+    struct child* peer = start_peer(
+        spi,
+        make_args_cmd_ctar(CMD_ARG_NAME | CMD_ARG_FORWARDED, &ci));
+
+    untar(peer->fd[1]->fd, archive_root, dest_root, &opts);
+    child_wait_die_on_error(peer);
+    return 0;
+}
 
 int
 fget_main(const struct cmd_fget_info* info)
@@ -31,6 +96,30 @@ fget_main(const struct cmd_fget_info* info)
         .user = info->user,
     };
 
+    if (info->fget.recursive)
+        return fget_recursive(&spi, info, local);
+
+    size_t nr_more = info->more ? argv_count(info->more) : 0;
+    if (nr_more > 0) {
+        const char** remotes = ARGV_CONCAT(ARGV(info->remote, local),
+                                           info->more);
+        remotes[nr_more + 1] = NULL; // Last one is the directory
+
+        struct cmd_xfer_stub_info xilocal = {
+            .mode = "recv-many",
+            .filename = info->more[nr_more - 1],
+            .xfer = info->xfer,
+        };
+
+        struct cmd_xfer_stub_info xiremote = {
+            .mode = "send-many",
+            .filename = ".",
+            .xfer = info->xfer,
+        };
+
+        return xfer_handle_command(&spi, &xilocal, remotes, &xiremote);
+    }
+
     struct cmd_xfer_stub_info xilocal = {
         .mode = "recv",
         .filename = local,
@@ -44,5 +133,5 @@ fget_main(const struct cmd_fget_info* info)
         .xfer = info->xfer,
     };
 
-    return xfer_handle_command(&spi, &xilocal, &xiremote);
+    return xfer_handle_command(&spi, &xilocal, NULL, &xiremote);
 }
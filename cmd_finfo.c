@@ -15,14 +15,23 @@
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 #include "util.h"
 #include "autocmd.h"
 #include "json.h"
 #include "sha2.h"
 #include "argv.h"
 #include "fs.h"
+#include "constants.h"
 
 FORWARD(finfo_json);
 
@@ -166,18 +175,170 @@ finfo_readlink(struct json_writer* writer, const char* filename, void* data)
     json_emit_string(writer, xreadlink(filename));
 }
 
-static char*
-hex_sha256_fd(int fd)
+static struct sha256_hash
+sha256_file(const char* filename)
+{
+    SCOPED_RESLIST(rl);
+    int fd = xopen(filename, O_RDONLY, 0);
+    hint_sequential_access(fd);
+    return sha256_fd(fd);
+}
+
+// Worker processes, not threads (see util.h), that hash top-level
+// paths ahead of the main loop.  Worker W hashes paths W,
+// W + NR_WORKERS, and so on, in order, so the result for path I is
+// always the next one to arrive from worker I % NR_WORKERS.
+struct sha256_pool {
+    unsigned nr_workers;
+    pid_t* pids;
+    int* from_worker;
+    size_t next;
+};
+
+// What a worker sends for each path: an errno value, and then either
+// the digest or the length and text of an error message.
+struct sha256_pool_result {
+    int32_t err;
+    union {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        uint32_t msg_length;
+    } u;
+};
+
+struct sha256_pool_work {
+    const char* const* paths;
+    size_t nr_paths;
+    unsigned worker;
+    unsigned nr_workers;
+    int to_parent;
+};
+
+struct sha256_file_ctx {
+    const char* filename;
+    struct sha256_hash hash;
+};
+
+static void
+sha256_pool_hash_1(void* data)
+{
+    struct sha256_file_ctx* ctx = data;
+    ctx->hash = sha256_file(ctx->filename);
+}
+
+static void
+sha256_pool_work_1(void* data)
+{
+    struct sha256_pool_work* work = data;
+    const char* const* paths = work->paths;
+    for (size_t i = work->worker; i < work->nr_paths; i += work->nr_workers) {
+        SCOPED_RESLIST(rl);
+        struct sha256_file_ctx ctx = { .filename = paths[i] };
+        struct errinfo ei = { .want_msg = true };
+        struct sha256_pool_result result;
+        memset(&result, 0, sizeof (result));
+        if (catch_error(sha256_pool_hash_1, &ctx, &ei)) {
+            result.err = ei.err ?: EIO;
+            result.u.msg_length = strlen(ei.msg);
+            write_all(work->to_parent, &result, sizeof (result));
+            write_all(work->to_parent, ei.msg, result.u.msg_length);
+        } else {
+            memcpy(result.u.digest, ctx.hash.digest, sizeof (ctx.hash.digest));
+            write_all(work->to_parent, &result, sizeof (result));
+        }
+    }
+}
+
+static void
+sha256_pool_cleanup(void* data)
+{
+    struct sha256_pool* pool = data;
+    for (unsigned i = 0; i < pool->nr_workers; ++i) {
+        (void) kill(pool->pids[i], SIGKILL);
+        while (waitpid(pool->pids[i], NULL, 0) == -1 && errno == EINTR)
+            continue;
+    }
+}
+
+// Start hashing PATHS in the background, or return NULL if we
+// shouldn't or can't.
+static struct sha256_pool*
+sha256_pool_start(const char* const* paths)
 {
-    struct sha256_hash hash = sha256_fd(fd);
-    return hex_encode_bytes(hash.digest, sizeof (hash.digest));
+    size_t nr_paths = 0;
+    while (paths[nr_paths] != NULL)
+        nr_paths += 1;
+
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nr_workers = XMIN((unsigned long) XMAX(nr_cpus, 1L),
+                               (unsigned long) FINFO_MAX_HASH_WORKERS);
+    nr_workers = XMIN(nr_workers, nr_paths);
+    if (nr_workers < 2)
+        return NULL;
+
+    struct sha256_pool* pool = xcalloc(sizeof (*pool));
+    pool->pids = xalloc(nr_workers * sizeof (*pool->pids));
+    pool->from_worker = xalloc(nr_workers * sizeof (*pool->from_worker));
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, sha256_pool_cleanup, pool);
+
+    for (unsigned i = 0; i < nr_workers; ++i) {
+        int to_parent;
+        xpipe(&pool->from_worker[i], &to_parent);
+        pid_t child = fork();
+        if (child == (pid_t) -1) {
+            if (i == 0)
+                return NULL;
+            // Workers already running count on the stride they were
+            // given, so we can't just run with fewer of them.
+            die_errno("fork");
+        }
+
+        if (child == 0) {
+            trace_forked();
+            struct sha256_pool_work work = {
+                .paths = paths,
+                .nr_paths = nr_paths,
+                .worker = i,
+                .nr_workers = nr_workers,
+                .to_parent = to_parent,
+            };
+            struct errinfo ei = { 0 };
+            _exit(catch_error(sha256_pool_work_1, &work, &ei) ? 1 : 0);
+        }
+
+        xclose(to_parent);
+        pool->pids[pool->nr_workers++] = child;
+    }
+
+    return pool;
 }
 
 static void
 finfo_sha256(struct json_writer* writer, const char* filename, void* data)
 {
+    struct sha256_pool* pool = data;
+    if (pool == NULL) {
+        struct sha256_hash hash = sha256_file(filename);
+        json_emit_string(writer,
+                         hex_encode_bytes(hash.digest, sizeof (hash.digest)));
+        return;
+    }
+
+    int fd = pool->from_worker[pool->next++ % pool->nr_workers];
+    struct sha256_pool_result result;
+    if (read_all(fd, &result, sizeof (result)) != sizeof (result))
+        die(ECOMM, "hash worker died");
+    if (result.err != 0) {
+        char* msg = xalloc(result.u.msg_length + 1);
+        if (read_all(fd, msg, result.u.msg_length) != result.u.msg_length)
+            die(ECOMM, "hash worker died");
+        msg[result.u.msg_length] = '\0';
+        die(result.err, "%s", msg);
+    }
 
-    json_emit_string(writer, hex_sha256_fd(xopen(filename, O_RDONLY, 0)));
+    json_emit_string(writer,
+                     hex_encode_bytes(result.u.digest,
+                                      sizeof (result.u.digest)));
 }
 
 static void
@@ -207,6 +368,12 @@ dirent_type_to_name(unsigned char type)
 }
 #endif
 
+enum ent_type {
+    ENT_TYPE_UNKNOWN,
+    ENT_TYPE_DIR,
+    ENT_TYPE_NONDIR,
+};
+
 static const struct finfo_op available_ops[] = {
     { "stat",     FINFO_OP_ENABLED,  finfo_stat },
     { "lstat",    FINFO_OP_DISABLED, finfo_lstat },
@@ -230,11 +397,7 @@ finfo_ls(struct json_writer* writer, const char* filename, void* data)
         if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
             continue;
 
-        enum {
-            ENT_TYPE_UNKNOWN,
-            ENT_TYPE_DIR,
-            ENT_TYPE_NONDIR,
-        } ent_type = ENT_TYPE_UNKNOWN;
+        enum ent_type ent_type = ENT_TYPE_UNKNOWN;
 
         SCOPED_RESLIST(rl_ent);
         json_begin_object(writer);
@@ -412,6 +575,413 @@ parse_oplist(const char* spec,
     return ops;
 }
 
+// State for --recursive, which walks each path's tree and writes one
+// JSON object per line for every entry it finds, as it finds it.
+// The walk is a plain depth-first recursion in this process; see
+// util.h on why there are no threads.
+struct finfo_walk {
+    const struct finfo_op* ops;
+    const struct strlist* filters;
+    bool have_includes;
+    bool depth_limited;
+    unsigned max_depth;
+};
+
+struct finfo_walk_dir_ctx {
+    const struct finfo_walk* walk;
+    int dirfd;
+    const char* name;
+    const char* path;
+    unsigned depth;
+};
+
+static void walk_entry(const struct finfo_walk* walk,
+                       int dirfd,
+                       const char* name,
+                       const char* path,
+                       unsigned depth,
+                       enum ent_type ent_type);
+
+static bool
+walk_filter_matches_p(const struct finfo_walk* walk,
+                      const char* kind,
+                      const char* name)
+{
+    size_t kind_length = strlen(kind);
+    for (const char* filter = strlist_rewind(walk->filters);
+         filter != NULL;
+         filter = strlist_next(walk->filters))
+    {
+        if (strncmp(filter, kind, kind_length) == 0 &&
+            filter[kind_length] == '=' &&
+            fnmatch(filter + kind_length + 1, name, 0) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+emit_walk_record(const struct finfo_walk* walk,
+                 const char* path,
+                 unsigned depth,
+                 const struct errinfo* error)
+{
+    struct json_writer* writer = json_writer_create(xstdout);
+    json_begin_object(writer);
+    json_begin_field(writer, "filename");
+    json_emit_string(writer, path);
+    json_begin_field(writer, "depth");
+    json_emit_u64(writer, depth);
+    if (error != NULL) {
+        json_begin_field(writer, "error");
+        json_begin_object(writer);
+        json_begin_field(writer, "errno");
+        json_emit_i64(writer, error->err);
+        json_begin_field(writer, "errmsg");
+        json_emit_string(writer, error->msg);
+        json_end_object(writer);
+    } else {
+        const struct finfo_op* ops = walk->ops;
+        for (unsigned i = 0; i < NOPS; ++i) {
+            if (ops[i].state != FINFO_OP_DISABLED) {
+                json_begin_field(writer, ops[i].name);
+                emit_finfo_op(writer, path, ops[i].fn, ops[i].fndata);
+            }
+        }
+    }
+    json_end_object(writer);
+    xputc('\n', xstdout);
+}
+
+static void
+walk_dir_1(void* data)
+{
+    struct finfo_walk_dir_ctx* ctx = data;
+    // Don't follow symbolic links inside the tree, only ones the
+    // caller named.
+    DIR* dir = xopendirat(ctx->dirfd,
+                          ctx->name,
+                          ctx->depth > 0 ? O_NOFOLLOW : 0);
+    const char* sep = ctx->path[strlen(ctx->path) - 1] == '/' ? "" : "/";
+    struct dirent* ent;
+    while ((errno = 0, (ent = readdir(dir))) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        if (walk_filter_matches_p(ctx->walk, "exclude", ent->d_name))
+            continue;
+
+        enum ent_type ent_type = ENT_TYPE_UNKNOWN;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+        if (ent->d_type != DT_UNKNOWN)
+            ent_type = (ent->d_type == DT_DIR) ? ENT_TYPE_DIR : ENT_TYPE_NONDIR;
+#endif
+
+        SCOPED_RESLIST(rl_ent);
+        walk_entry(ctx->walk,
+                   dirfd(dir),
+                   ent->d_name,
+                   xaprintf("%s%s%s", ctx->path, sep, ent->d_name),
+                   ctx->depth + 1,
+                   ent_type);
+    }
+
+    if (errno != 0)
+        die_errno("readdir");
+}
+
+static void
+walk_entry(const struct finfo_walk* walk,
+           int dirfd,
+           const char* name,
+           const char* path,
+           unsigned depth,
+           enum ent_type ent_type)
+{
+    if (depth == 0 ||
+        !walk->have_includes ||
+        walk_filter_matches_p(walk, "include", name))
+    {
+        emit_walk_record(walk, path, depth, NULL);
+    }
+
+    if (walk->depth_limited && depth >= walk->max_depth)
+        return;
+
+    if (ent_type == ENT_TYPE_UNKNOWN) {
+        struct stat st;
+        int flags = depth > 0 ? AT_SYMLINK_NOFOLLOW : 0;
+        if (fstatat(dirfd, name, &st, flags) == 0)
+            ent_type = S_ISDIR(st.st_mode) ? ENT_TYPE_DIR : ENT_TYPE_NONDIR;
+    }
+
+    if (ent_type != ENT_TYPE_DIR)
+        return;
+
+    struct finfo_walk_dir_ctx ctx = {
+        .walk = walk,
+        .dirfd = dirfd,
+        .name = name,
+        .path = path,
+        .depth = depth,
+    };
+
+    struct errinfo ei = {
+        .want_msg = true,
+    };
+
+    if (catch_error(walk_dir_1, &ctx, &ei))
+        emit_walk_record(walk, path, depth, &ei);
+}
+
+static void
+finfo_walk_main(const struct cmd_finfo_json_info* info,
+                const struct finfo_op* ops)
+{
+    struct finfo_walk walk = {
+        .ops = ops,
+        .filters = info->finfo.filters ?: strlist_new(),
+    };
+
+    for (const char* filter = strlist_rewind(walk.filters);
+         filter != NULL;
+         filter = strlist_next(walk.filters))
+    {
+        if (string_starts_with_p(filter, "include="))
+            walk.have_includes = true;
+    }
+
+    if (info->finfo.max_depth) {
+        char* endptr = NULL;
+        errno = 0;
+        unsigned long max_depth = strtoul(info->finfo.max_depth, &endptr, 10);
+        if (errno != 0 || endptr == info->finfo.max_depth ||
+            *endptr != '\0' || max_depth > UINT_MAX)
+        {
+            die(EINVAL, "invalid depth: %s", info->finfo.max_depth);
+        }
+        walk.depth_limited = true;
+        walk.max_depth = (unsigned) max_depth;
+    }
+
+    for (const char* const* paths = info->paths; *paths; ++paths) {
+        SCOPED_RESLIST(rl_path);
+        walk_entry(&walk, AT_FDCWD, *paths, *paths, 0, ENT_TYPE_UNKNOWN);
+    }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+// State for --watch.  We watch each path's parent directory instead
+// of the path itself so that we see the path appear, disappear, and
+// get replaced by rename, none of which a watch on the path survives.
+struct finfo_watch_path {
+    const char* path;
+    const char* name;
+    int wd;
+    const char* pending_event;
+};
+
+static void
+emit_watch_record(const struct finfo_op* ops,
+                  const char* path,
+                  const char* event)
+{
+    struct json_writer* writer = json_writer_create(xstdout);
+    json_begin_object(writer);
+    json_begin_field(writer, "filename");
+    json_emit_string(writer, path);
+    json_begin_field(writer, "event");
+    json_emit_string(writer, event);
+    for (unsigned i = 0; i < NOPS; ++i) {
+        if (ops[i].state != FINFO_OP_DISABLED) {
+            json_begin_field(writer, ops[i].name);
+            emit_finfo_op(writer, path, ops[i].fn, ops[i].fndata);
+        }
+    }
+    json_end_object(writer);
+    xputc('\n', xstdout);
+}
+
+static const char*
+watch_event_name(uint32_t mask)
+{
+    if (mask & IN_CREATE)
+        return "create";
+    if (mask & IN_MOVED_TO)
+        return "move_in";
+    if (mask & IN_MOVED_FROM)
+        return "move_out";
+    if (mask & IN_DELETE)
+        return "delete";
+    if (mask & (IN_MODIFY | IN_CLOSE_WRITE))
+        return "modify";
+    if (mask & IN_ATTRIB)
+        return "attrib";
+    return NULL;
+}
+
+// Fold EVENT into the event PENDING for a path.  The latest event
+// wins, except that a path written right after it appears is still
+// reported as having appeared, and an overflow means we don't know.
+static const char*
+merge_watch_events(const char* pending, const char* event)
+{
+    if (pending == NULL)
+        return event;
+    if (!strcmp(pending, "overflow"))
+        return pending;
+    if ((!strcmp(pending, "create") || !strcmp(pending, "move_in")) &&
+        (!strcmp(event, "modify") || !strcmp(event, "attrib")))
+    {
+        return pending;
+    }
+    return event;
+}
+
+static int
+xinotify_init(void)
+{
+    struct cleanup* cl = cleanup_allocate();
+#ifdef HAVE_INOTIFY_INIT1
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+#else
+    int fd = inotify_init();
+    if (fd != -1 && fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        int saved_errno = errno;
+        (void) close(fd);
+        errno = saved_errno;
+        fd = -1;
+    }
+#endif
+    if (fd == -1)
+        die_errno("inotify_init");
+    cleanup_commit_close_fd(cl, fd);
+#ifndef HAVE_INOTIFY_INIT1
+    fd_set_blocking_mode(fd, non_blocking);
+#endif
+    return fd;
+}
+
+// Read every event queued on IFD and mark the paths they concern.
+// Draining the queue before reporting anything folds a burst of
+// writes to one file into one record.
+static void
+read_watch_events(int ifd,
+                  struct finfo_watch_path* wp,
+                  size_t nr_wp)
+{
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t nr_read = read(ifd, buf, sizeof (buf));
+        if (nr_read == -1 && errno == EINTR)
+            continue;
+        if (nr_read == -1 && errno == EAGAIN)
+            return;
+        if (nr_read <= 0)
+            die_errno("read(inotify)");
+
+        for (char* pos = buf; pos < buf + nr_read;) {
+            const struct inotify_event* ev = (void*) pos;
+            pos += sizeof (*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (size_t i = 0; i < nr_wp; ++i)
+                    wp[i].pending_event = "overflow";
+                continue;
+            }
+
+            for (size_t i = 0; i < nr_wp; ++i) {
+                if (wp[i].wd != ev->wd)
+                    continue;
+                if (ev->mask & IN_IGNORED)
+                    die(ENOENT, "%s: parent directory went away",
+                        wp[i].path);
+                const char* event = watch_event_name(ev->mask);
+                if (event != NULL && ev->len > 0 &&
+                    strcmp(ev->name, wp[i].name) == 0)
+                {
+                    wp[i].pending_event =
+                        merge_watch_events(wp[i].pending_event, event);
+                }
+            }
+        }
+    }
+}
+
+static void
+finfo_watch_main(const struct cmd_finfo_json_info* info,
+                 const struct finfo_op* ops)
+{
+    const uint32_t mask =
+        IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR;
+
+    int ifd = xinotify_init();
+    size_t nr_wp = argv_count(info->paths);
+    struct finfo_watch_path* wp = xalloc(nr_wp * sizeof (*wp));
+    for (size_t i = 0; i < nr_wp; ++i) {
+        const char* path = info->paths[i];
+        const char* parent = xdirname(path);
+        wp[i].path = path;
+        wp[i].name = xbasename(path);
+        wp[i].wd = inotify_add_watch(ifd, parent, mask);
+        wp[i].pending_event = NULL;
+        if (wp[i].wd == -1)
+            die_errno("inotify_add_watch(\"%s\")", parent);
+    }
+
+    // Report the current state only after the watches are in place so
+    // that no change falls between the two.
+    for (size_t i = 0; i < nr_wp; ++i) {
+        SCOPED_RESLIST(rl_record);
+        emit_watch_record(ops, wp[i].path, "initial");
+    }
+
+    struct pollfd p[2] = {
+        { .fd = ifd, .events = POLLIN },
+        { .fd = STDIN_FILENO, .events = POLLIN },
+    };
+
+    for (;;) {
+        xflush(xstdout);
+        if (xpoll(p, ARRAYSIZE(p), -1) <= 0)
+            continue;
+
+        // Our peer closing our standard input means nobody is
+        // listening anymore.
+        if (p[1].revents != 0) {
+            char c;
+            if (read(STDIN_FILENO, &c, 1) <= 0)
+                return;
+        }
+
+        if (p[0].revents != 0) {
+            read_watch_events(ifd, wp, nr_wp);
+            for (size_t i = 0; i < nr_wp; ++i) {
+                if (wp[i].pending_event != NULL) {
+                    SCOPED_RESLIST(rl_record);
+                    emit_watch_record(ops, wp[i].path, wp[i].pending_event);
+                    wp[i].pending_event = NULL;
+                }
+            }
+        }
+    }
+}
+
+#else
+
+static void
+finfo_watch_main(const struct cmd_finfo_json_info* info,
+                 const struct finfo_op* ops)
+{
+    die(ENOSYS, "--watch is not supported on this system");
+}
+
+#endif
+
 int
 finfo_json_main(const struct cmd_finfo_json_info* info)
 {
@@ -424,6 +994,37 @@ finfo_json_main(const struct cmd_finfo_json_info* info)
             NULL);
     }
 
+    if (info->finfo.watch) {
+        if (info->finfo.recursive)
+            die(EINVAL, "--watch and --recursive are incompatible");
+        finfo_watch_main(info, ops);
+        return 0;
+    }
+
+    if (info->finfo.recursive) {
+        finfo_walk_main(info, ops);
+        xflush(xstdout);
+        return 0;
+    }
+
+    if (info->finfo.max_depth || info->finfo.filters)
+        die(EINVAL, "--max-depth, --include, and --exclude "
+            "require --recursive");
+
+    // Hash the paths we were given in parallel.  Hashes of
+    // directory entries from ls still happen inline.
+    for (unsigned i = 0; i < NOPS; ++i) {
+        if (ops[i].fn == finfo_sha256 && ops[i].state != FINFO_OP_DISABLED) {
+            struct sha256_pool* pool = sha256_pool_start(info->paths);
+            if (pool != NULL) {
+                struct finfo_op* pool_ops = xalloc(sizeof (available_ops));
+                memcpy(pool_ops, ops, sizeof (available_ops));
+                pool_ops[i].fndata = pool;
+                ops = pool_ops;
+            }
+        }
+    }
+
     struct json_writer* writer = json_writer_create(xstdout);
     json_begin_array(writer);
     for (const char* const* paths = info->paths; *paths; ++paths) {
@@ -13,6 +13,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include "util.h"
+#include "argv.h"
 #include "autocmd.h"
 #include "child.h"
 #include "peer.h"
@@ -29,6 +30,27 @@ fput_main(const struct cmd_fput_info* info)
         .user = info->user,
     };
 
+    size_t nr_more = info->more ? argv_count(info->more) : 0;
+    if (nr_more > 0) {
+        const char** locals = ARGV_CONCAT(ARGV(info->local, info->remote),
+                                          info->more);
+        locals[nr_more + 1] = NULL; // Last one is the directory
+
+        struct cmd_xfer_stub_info xilocal = {
+            .mode = "send-many",
+            .filename = ".",
+            .xfer = info->xfer,
+        };
+
+        struct cmd_xfer_stub_info xiremote = {
+            .mode = "recv-many",
+            .filename = info->more[nr_more - 1],
+            .xfer = info->xfer,
+        };
+
+        return xfer_handle_command(&spi, &xilocal, locals, &xiremote);
+    }
+
     struct cmd_xfer_stub_info xilocal = {
         .mode = "send",
         .filename = info->local,
@@ -44,5 +66,5 @@ fput_main(const struct cmd_fput_info* info)
         .xfer = info->xfer,
     };
 
-    return xfer_handle_command(&spi, &xilocal, &xiremote);
+    return xfer_handle_command(&spi, &xilocal, NULL, &xiremote);
 }
@@ -16,6 +16,7 @@
 #include "autocmd.h"
 #include "fs.h"
 #include "json.h"
+#include "constants.h"
 
 #if FBADB_MAIN
 
@@ -33,6 +34,9 @@ getprop_main(const struct cmd_getprop_info* info)
 
 #include <sys/system_properties.h>
 #include <dlfcn.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 // N.B. The Android property system uses prop_info* as an
 // interned key for a property name.  A given prop_info pointer is
@@ -47,6 +51,7 @@ static int (*property_foreach)(
         void (*propfn)(const prop_info *pi, void *cookie),
         void *cookie);
 static const prop_info* (*property_find_nth)(unsigned n);
+static uint32_t (*property_area_serial)(void);
 
 static void find_symbol_in_libc(const char* name, void* fnptr_v)
 {
@@ -163,7 +168,6 @@ find_all_properties_raw(void)
         if (ctx.oom)
             die_oom();
         reslist_xfer(rl->parent, rl);
-        property_vector_sort(ctx.pv);
         return ctx.pv;
     }
 }
@@ -185,13 +189,35 @@ property_vector_equal(const struct property_vector* a,
         memcmp(a->props, b->props, a->size * sizeof (a->props[0])) == 0;
 }
 
+// Android bumps the property area's serial whenever it adds or
+// changes a property, so where bionic tells us the serial, one
+// enumeration that starts and ends with the same serial is a
+// consistent snapshot.  Otherwise, we enumerate until two passes in a
+// row agree.
 static struct property_vector*
 find_all_properties(void)
 {
+    find_symbol_in_libc("__system_property_area_serial",
+                        &property_area_serial);
+    if (property_area_serial != NULL) {
+        for (;;) {
+            SCOPED_RESLIST(rl);
+            uint32_t serial = property_area_serial();
+            struct property_vector* pv = find_all_properties_raw();
+            if (property_area_serial() == serial) {
+                reslist_xfer(rl->parent, rl);
+                property_vector_sort(pv);
+                return pv;
+            }
+        }
+    }
+
     struct property_vector* pv1 = find_all_properties_raw();
+    property_vector_sort(pv1);
     for (;;) {
         SCOPED_RESLIST(pv);
         struct property_vector* pv2 = find_all_properties_raw();
+        property_vector_sort(pv2);
         if (property_vector_equal(pv1, pv2))
             return pv1;
         property_vector_swap(pv1, pv2);
@@ -264,6 +290,195 @@ output_property(bool* first,
     }
 }
 
+// Property watching.  Android bumps a global serial number whenever
+// any property changes, and since Android 8.0, bionic lets us sleep
+// on that serial with a timeout; older systems have only
+// __system_property_wait_any, which sleeps forever.  Where neither
+// exists, we just poll.
+
+static bool (*property_wait)(const prop_info* pi,
+                             uint32_t old_serial,
+                             uint32_t* new_serial,
+                             const struct timespec* relative_timeout);
+static uint32_t (*property_wait_any)(uint32_t old_serial);
+
+struct watched_property {
+    char name[PROP_NAME_MAX];
+    char value[PROP_VALUE_MAX];
+    bool found;
+};
+
+struct property_snapshot {
+    struct reslist* rl;
+    size_t size;
+    struct watched_property* props;
+};
+
+// Read the current value of each property in NAMES (which must be
+// sorted) or, if NAMES is empty, of every property.  The snapshot
+// gets its own reslist, which the caller destroys.
+static struct property_snapshot
+take_property_snapshot(const char** names, size_t nr_names)
+{
+    struct property_snapshot snap = { .rl = reslist_create() };
+    WITH_CURRENT_RESLIST(snap.rl);
+    if (nr_names > 0) {
+        snap.props = xalloc(nr_names * sizeof (snap.props[0]));
+        for (size_t i = 0; i < nr_names; ++i) {
+            struct watched_property* wp = &snap.props[i];
+            snprintf(wp->name, sizeof (wp->name), "%s", names[i]);
+            const prop_info* pi = __system_property_find(names[i]);
+            wp->found = pi != NULL;
+            if (pi != NULL)
+                __system_property_read(pi, NULL, wp->value);
+        }
+        snap.size = nr_names;
+    } else {
+        struct property_vector* pv = find_all_properties();
+        snap.props = xalloc(pv->size * sizeof (snap.props[0]));
+        for (size_t i = 0; i < pv->size; ++i) {
+            struct watched_property* wp = &snap.props[snap.size];
+            (void) __system_property_read(pv->props[i], wp->name, wp->value);
+            wp->found = true;
+            if (snap.size > 0 && !strcmp(wp->name, wp[-1].name))
+                continue;
+            snap.size += 1;
+        }
+    }
+    return snap;
+}
+
+static void
+emit_property_change(struct json_writer** writer,
+                     const struct watched_property* wp,
+                     bool found)
+{
+    if (*writer == NULL) {
+        *writer = json_writer_create(xstdout);
+        json_begin_object(*writer);
+    }
+    json_begin_field(*writer, wp->name);
+    if (found)
+        json_emit_string(*writer, wp->value);
+    else
+        json_emit_null(*writer);
+}
+
+// Print, as one JSON object on one line, every property whose value
+// differs between OLD and NEW.  Properties that have gone away
+// become null.  Both snapshots are sorted by name.
+static void
+emit_property_changes(const struct property_snapshot* old,
+                      const struct property_snapshot* new)
+{
+    SCOPED_RESLIST(rl);
+    struct json_writer* writer = NULL;
+    size_t i = 0, j = 0;
+    while (i < old->size || j < new->size) {
+        const struct watched_property* o =
+            i < old->size ? &old->props[i] : NULL;
+        const struct watched_property* n =
+            j < new->size ? &new->props[j] : NULL;
+        int cmp = o == NULL ? 1 : n == NULL ? -1 : strcmp(o->name, n->name);
+        if (cmp < 0) {
+            if (o->found)
+                emit_property_change(&writer, o, false);
+            i += 1;
+        } else if (cmp > 0) {
+            emit_property_change(&writer, n, n->found);
+            j += 1;
+        } else {
+            if (o->found != n->found ||
+                (n->found && strcmp(o->value, n->value)))
+                emit_property_change(&writer, n, n->found);
+            i += 1;
+            j += 1;
+        }
+    }
+
+    if (writer != NULL) {
+        json_end_object(writer);
+        xputc('\n', xstdout);
+        xflush(xstdout);
+    }
+}
+
+// Return whether our peer has closed our standard input, meaning
+// nobody is listening anymore, waiting up to TIMEOUT_MS for it.
+static bool
+peer_gone_p(int timeout_ms)
+{
+    struct pollfd p = { .fd = STDIN_FILENO, .events = POLLIN };
+    if (xpoll(&p, 1, timeout_ms) <= 0)
+        return false;
+    char c;
+    return read(STDIN_FILENO, &c, 1) <= 0;
+}
+
+// Sleep until some property might have changed since *SERIAL, then
+// update *SERIAL.  Return false if we should stop watching instead.
+static bool
+wait_for_property_change(uint32_t* serial)
+{
+    if (property_wait != NULL && property_area_serial != NULL) {
+        struct timespec timeout = {
+            .tv_sec = GETPROP_WATCH_CHECK_MS / 1000,
+            .tv_nsec = (GETPROP_WATCH_CHECK_MS % 1000) * 1000000L,
+        };
+        while (!property_wait(NULL, *serial, serial, &timeout))
+            if (peer_gone_p(0))
+                return false;
+        return true;
+    }
+
+    if (property_wait_any != NULL) {
+        if (peer_gone_p(0))
+            return false;
+        *serial = property_wait_any(*serial);
+        return true;
+    }
+
+    return !peer_gone_p(GETPROP_WATCH_POLL_MS);
+}
+
+static int
+getprop_watch(const char** names)
+{
+    size_t nr_names = argv_count(names);
+    qsort(names, nr_names, sizeof (names[0]), property_argv_compare);
+
+    find_symbol_in_libc("__system_property_area_serial",
+                        &property_area_serial);
+    find_symbol_in_libc("__system_property_wait", &property_wait);
+    find_symbol_in_libc("__system_property_wait_any", &property_wait_any);
+
+    dbg("using %s to wait for property changes",
+        (property_wait != NULL && property_area_serial != NULL)
+        ? "__system_property_wait"
+        : property_wait_any != NULL
+        ? "__system_property_wait_any"
+        : "polling");
+
+    // Read the serial before taking the snapshot so that we notice
+    // changes that race with it.  Without __system_property_area_serial,
+    // the first wait returns right away with the current serial and
+    // costs us one redundant (and silent) snapshot.
+    uint32_t serial = property_area_serial ? property_area_serial() : 0;
+    struct property_snapshot empty = { 0 };
+    struct property_snapshot snap = take_property_snapshot(names, nr_names);
+    emit_property_changes(&empty, &snap);
+
+    while (wait_for_property_change(&serial)) {
+        struct property_snapshot next =
+            take_property_snapshot(names, nr_names);
+        emit_property_changes(&snap, &next);
+        reslist_destroy(snap.rl);
+        snap = next;
+    }
+
+    return 0;
+}
+
 int
 getprop_main(const struct cmd_getprop_info* info)
 {
@@ -273,6 +488,8 @@ getprop_main(const struct cmd_getprop_info* info)
     if (null && format == NULL && format_not_found == NULL)
         usage_error("must supply --format or "
                     "--format-not-found or both if using -0");
+    if (info->getprop.watch && (format != NULL || format_not_found != NULL))
+        usage_error("--watch always emits JSON");
 
     find_symbol_in_libc("__system_property_foreach",
                         &property_foreach);
@@ -284,6 +501,9 @@ getprop_main(const struct cmd_getprop_info* info)
         ? "compat_property_foreach"
         : "__system_property_foreach");
 
+    if (info->getprop.watch)
+        return getprop_watch(ARGV_CONCAT(info->properties));
+
     int exit_status = 0;
 
     struct json_writer* writer = NULL;
@@ -14,6 +14,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
 
@@ -27,7 +28,9 @@
 #include "adb.h"
 #include "net.h"
 #include "errcodes.h"
-#include "tree.h"
+#include "devinfo.h"
+#include "sha2.h"
+#include "json.h"
 
 #include "peer.h"
 
@@ -196,6 +199,27 @@
 
 #define ART_HARDCODED_PACKET_MAXIMUM 8192
 #define REFERENCE_CACHE_SIZE 5000
+// When the reftype cache fills, evict this fraction of it.
+#define REFERENCE_CACHE_EVICTION_DIVISOR 4
+
+// How many of its own commands the proxy lets the app have at once.
+// Keep the sum of commands and replies comfortably below what socket
+// buffers hold, or we and the app can both block writing.
+#define MAX_OUTSTANDING_TRANSACTIONS 64
+
+// How many signatures at a time we look up when learning classes.
+#define CLASS_REFRESH_BATCH_SIZE 1000
+
+// Packets of up to JDWP_POOL_MIN_SIZE << (JDWP_POOL_NR_CLASSES - 1)
+// bytes come from struct jdwp_packet_pool, which keeps at most
+// JDWP_POOL_MAX_FREE idle buffers of each size.
+#define JDWP_POOL_MIN_SIZE 256
+#define JDWP_POOL_NR_CLASSES 9
+#define JDWP_POOL_MAX_FREE 32
+
+// Latency histograms have a bucket for each power of two
+// microseconds, the last catching everything longer.
+#define JDWP_STATS_NR_BUCKETS 32
 
 #define ENUM_JDWP_ERRORS(x)                       \
     x(JDWP_ERR_NONE, 0),                          \
@@ -317,6 +341,127 @@ cmp_u64(uint64_t a, uint64_t b)
     return 0;
 }
 
+static size_t
+hash_u64(uint64_t value)
+{
+    uint64_t h = value * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t) (h ^ (h >> 32));
+}
+
+// Open-addressing hash table of pointers, with linear probing and
+// backward-shift deletion so that we never need tombstones.  The
+// table doesn't know about keys: users supply the hash of each entry
+// and pick among the entries with a given hash themselves.
+
+struct ptr_table_slot {
+    size_t hash;
+    void* value; // NULL for an empty slot
+};
+
+struct ptr_table {
+    struct reslist* rl; // Owns the slots
+    struct growable_buffer gb;
+    size_t nr_slots; // Zero or a power of two
+    size_t nr_used;
+};
+
+static struct ptr_table_slot*
+ptr_table_slots(const struct ptr_table* t)
+{
+    return (struct ptr_table_slot*) t->gb.buf;
+}
+
+// Return the first value with hash HASH for which MATCH returns true.
+static void*
+ptr_table_find(const struct ptr_table* t,
+               size_t hash,
+               bool (*match)(const void* value, const void* key),
+               const void* key)
+{
+    if (t->nr_slots == 0)
+        return NULL;
+    struct ptr_table_slot* slots = ptr_table_slots(t);
+    size_t mask = t->nr_slots - 1;
+    for (size_t i = hash & mask; slots[i].value; i = (i + 1) & mask)
+        if (slots[i].hash == hash && match(slots[i].value, key))
+            return slots[i].value;
+    return NULL;
+}
+
+static void
+ptr_table_insert_1(struct ptr_table_slot* slots,
+                   size_t nr_slots,
+                   size_t hash,
+                   void* value)
+{
+    size_t mask = nr_slots - 1;
+    size_t i = hash & mask;
+    while (slots[i].value)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].value = value;
+}
+
+static void
+ptr_table_insert(struct ptr_table* t, size_t hash, void* value)
+{
+    assert(value != NULL);
+    if (t->nr_used + 1 > t->nr_slots / 2) {
+        size_t new_nr_slots = t->nr_slots ? t->nr_slots * 2 : 64;
+        if (new_nr_slots > SIZE_MAX / sizeof (struct ptr_table_slot))
+            die_oom();
+        struct growable_buffer new_gb = { 0 };
+        {
+            WITH_CURRENT_RESLIST(t->rl);
+            resize_buffer(&new_gb,
+                          new_nr_slots * sizeof (struct ptr_table_slot));
+        }
+        struct ptr_table_slot* new_slots =
+            (struct ptr_table_slot*) new_gb.buf;
+        memset(new_slots, 0, new_gb.bufsz);
+        struct ptr_table_slot* old_slots = ptr_table_slots(t);
+        for (size_t i = 0; i < t->nr_slots; ++i)
+            if (old_slots[i].value)
+                ptr_table_insert_1(new_slots,
+                                   new_nr_slots,
+                                   old_slots[i].hash,
+                                   old_slots[i].value);
+        cleanup_forget(t->gb.cl);
+        free(t->gb.buf);
+        t->gb = new_gb;
+        t->nr_slots = new_nr_slots;
+    }
+
+    ptr_table_insert_1(ptr_table_slots(t), t->nr_slots, hash, value);
+    t->nr_used += 1;
+}
+
+static void
+ptr_table_remove(struct ptr_table* t, size_t hash, void* value)
+{
+    struct ptr_table_slot* slots = ptr_table_slots(t);
+    size_t mask = t->nr_slots - 1;
+    size_t i = hash & mask;
+    while (slots[i].value != value) {
+        assert(slots[i].value != NULL);
+        i = (i + 1) & mask;
+    }
+
+    // Move back any entry after the hole that can't be found
+    // without it.
+    for (size_t j = (i + 1) & mask; slots[j].value; j = (j + 1) & mask) {
+        size_t home = slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    slots[i].hash = 0;
+    slots[i].value = NULL;
+    t->nr_used -= 1;
+}
+
 static const char*
 jdwp_error_to_string(uint16_t errcode)
 {
@@ -478,16 +623,131 @@ jdwp_header_to_network(struct jdwp_header* jh)
         jh->reply.error_code = htons(jh->reply.error_code);
 }
 
+// A packet fresh off the wire is loose: it has no reslist, and the
+// proxy loop recycles it with jdwp_packet_release once it's handled,
+// which for the packets we just forward is all that happens to them.
+// Code that keeps a packet around calls jdwp_packet_adopt instead of
+// reparenting RL, and the packet's new reslist recycles it.  Packets
+// too big for the pool get their own reslist from the start.
 struct jdwp_packet {
-    struct reslist* rl; // Owns itself
-    LIST_ENTRY(jdwp_packet) link;
+    struct reslist* rl; // Owns itself; NULL while loose
+    struct jdwp_packet_pool* pool; // NULL if not from a pool
+    LIST_ENTRY(jdwp_packet) link; // Also links the pool's free lists
+    uint8_t pool_class;
     bool on_list;
     bool has_rewritten_id;
+    bool from_proxy;
     uint32_t original_id;
+    double sent_at; // For commands we forward to the app
     struct jdwp_header header;
      // struct hack at end of jdwp_header; do not add data here
 };
 
+struct jdwp_packet_pool {
+    LIST_HEAD(, jdwp_packet) free[JDWP_POOL_NR_CLASSES];
+    unsigned nr_free[JDWP_POOL_NR_CLASSES];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static void
+jdwp_packet_pool_cleanup(void* data)
+{
+    struct jdwp_packet_pool* pool = data;
+    for (unsigned i = 0; i < JDWP_POOL_NR_CLASSES; ++i) {
+        while (!LIST_EMPTY(&pool->free[i])) {
+            struct jdwp_packet* packet = LIST_FIRST(&pool->free[i]);
+            LIST_REMOVE(packet, link);
+            free(packet);
+        }
+    }
+}
+
+// Set up POOL, which the current reslist owns.  Destroy the reslist
+// only after those of the pool's packets: a packet still loose when
+// we die is simply not freed before we exit.
+static void
+jdwp_packet_pool_init(struct jdwp_packet_pool* pool)
+{
+    struct cleanup* cl = cleanup_allocate();
+    memset(pool, 0, sizeof (*pool));
+    for (unsigned i = 0; i < JDWP_POOL_NR_CLASSES; ++i)
+        LIST_INIT(&pool->free[i]);
+    cleanup_commit(cl, jdwp_packet_pool_cleanup, pool);
+}
+
+// Return a loose packet with room for ALLOCSZ bytes from the start of
+// struct jdwp_packet, or NULL if that's too big for POOL.
+static struct jdwp_packet*
+jdwp_packet_pool_get(struct jdwp_packet_pool* pool, size_t allocsz)
+{
+    unsigned pool_class = 0;
+    while (pool_class < JDWP_POOL_NR_CLASSES &&
+           ((size_t) JDWP_POOL_MIN_SIZE << pool_class) < allocsz)
+    {
+        pool_class += 1;
+    }
+
+    if (pool_class == JDWP_POOL_NR_CLASSES)
+        return NULL;
+
+    struct jdwp_packet* packet = LIST_FIRST(&pool->free[pool_class]);
+    if (packet != NULL) {
+        LIST_REMOVE(packet, link);
+        pool->nr_free[pool_class] -= 1;
+        pool->hits += 1;
+    } else {
+        packet = malloc((size_t) JDWP_POOL_MIN_SIZE << pool_class);
+        if (packet == NULL)
+            die_oom();
+        pool->misses += 1;
+    }
+
+    memset(packet, 0, offsetof(struct jdwp_packet, header));
+    packet->pool = pool;
+    packet->pool_class = pool_class;
+    return packet;
+}
+
+static void
+jdwp_packet_recycle(void* data)
+{
+    struct jdwp_packet* packet = data;
+    struct jdwp_packet_pool* pool = packet->pool;
+    unsigned pool_class = packet->pool_class;
+    if (pool->nr_free[pool_class] >= JDWP_POOL_MAX_FREE) {
+        free(packet);
+        return;
+    }
+
+    LIST_INSERT_HEAD(&pool->free[pool_class], packet, link);
+    pool->nr_free[pool_class] += 1;
+}
+
+// Move PACKET to the current reslist, first giving it a reslist of
+// its own if it's loose.
+static void
+jdwp_packet_adopt(struct jdwp_packet* packet)
+{
+    if (packet->rl != NULL) {
+        reslist_reparent(packet->rl);
+        return;
+    }
+
+    packet->rl = reslist_create();
+    WITH_CURRENT_RESLIST(packet->rl);
+    struct cleanup* cl = cleanup_allocate();
+    cleanup_commit(cl, jdwp_packet_recycle, packet);
+}
+
+// We're done with PACKET.  If nothing adopted it, recycle it now.
+static void
+jdwp_packet_release(struct jdwp_packet* packet)
+{
+    if (packet->rl == NULL)
+        jdwp_packet_recycle(packet);
+}
+
 static void
 jdwp_send_packet(int fd, const struct jdwp_header* jh)
 {
@@ -588,12 +848,6 @@ struct jdwp_type {
         struct jdwp_cursor_frame* frame,
         void* value,
         size_t size);
-    void (*write)(
-        struct jdwp_type* this,
-        struct jdwp_cursor* c,
-        struct jdwp_cursor_frame* frame,
-        const void* value,
-        size_t size);
     struct jdwp_type* (*next_type)(
         struct jdwp_type* this,
         struct jdwp_cursor* c,
@@ -617,6 +871,16 @@ struct jdwp_type {
             struct jdwp_type* element_type;
         } array;
     };
+
+    // Filled in by jdwp_type_table_compute_layouts once we know the
+    // ID sizes.  A type with a fixed layout always occupies
+    // fixed_size bytes and has its reference type IDs at
+    // reftype_offsets, so we can find them without a cursor.
+    bool layout_done;
+    bool may_contain_reftype_ids;
+    int fixed_size; // -1 if the layout varies
+    unsigned nr_reftype_offsets;
+    unsigned* reftype_offsets;
 };
 
 static void
@@ -727,14 +991,6 @@ jdwp_cursor_slurp(
     c->pos += length;
 }
 
-static void
-jdwp_cursor_memcpy_in(struct jdwp_cursor* c, const void* in, size_t length)
-{
-    if (c->end - c->pos < length)
-        die(EINVAL, "truncated packet");
-    memcpy(c->pos, in, length);
-}
-
 static struct jdwp_type*
 jdwp_cursor_current_type(struct jdwp_cursor* c)
 {
@@ -920,22 +1176,6 @@ jdwp_cursor_read_string(struct jdwp_cursor* c)
     return value;
 }
 
-static void
-jdwp_cursor_write(struct jdwp_cursor* c, void* value, size_t size)
-{
-    struct jdwp_type* current = jdwp_cursor_current_type(c);
-    if (current->write == NULL)
-        die(EINVAL, "cannot update value of type %s", current->name);
-    current->write(current, c, &c->stack[c->depth], value, size);
-}
-
-static uint64_t
-jdwp_cursor_write_id(struct jdwp_cursor* c, uint64_t id, struct jdwp_type* id_type)
-{
-    jdwp_cursor_write(c, &id, jdwp_scalar_width(id_type));
-    return id;
-}
-
 static struct jdwp_type*
 jdwp_try_find_type(
     struct jdwp_type_table* tt,
@@ -1135,12 +1375,46 @@ jdwp_define_special_type(
     return type;
 }
 
+struct jdwp_histogram {
+    uint64_t count;
+    double total;
+    double max;
+    uint64_t buckets[JDWP_STATS_NR_BUCKETS];
+};
+
+// Who sent a command.
+enum jdwp_source {
+    JDWP_FROM_DEBUGGER,
+    JDWP_FROM_APP,
+    JDWP_FROM_PROXY,
+    JDWP_NR_SOURCES,
+};
+
+static const char* const jdwp_source_names[JDWP_NR_SOURCES] = {
+    "debugger",
+    "app",
+    "proxy",
+};
+
+struct jdwp_command_stats {
+    uint64_t nr_commands[JDWP_NR_SOURCES];
+    uint64_t command_bytes[JDWP_NR_SOURCES];
+    // Indexed by the sender of the command, not of the reply
+    uint64_t nr_replies[JDWP_NR_SOURCES];
+    uint64_t reply_bytes[JDWP_NR_SOURCES];
+    // From forwarding a debugger command to reading the app's reply
+    struct jdwp_histogram app_latency;
+    // Rewriting reference type IDs in commands and replies
+    struct jdwp_histogram translate;
+};
+
 struct jdwp_command {
     struct jdwp_command* next;
     uint8_t command_group;
     uint8_t command_code;
     struct jdwp_type* type;
     struct jdwp_type* reply_type;
+    struct jdwp_command_stats stats;
 };
 
 static struct jdwp_command*
@@ -1203,28 +1477,6 @@ jdwp_scalar_read(
     return width;
 }
 
-static void
-jdwp_scalar_write(
-    struct jdwp_type* this,
-    struct jdwp_cursor* c,
-    struct jdwp_cursor_frame* frame,
-    const void* value,
-    size_t size)
-{
-    unsigned width = jdwp_scalar_width(this);
-    if (size > width) {
-        die(EINVAL,
-            "writing too many bytes: type `%s' width is %u",
-            this->name,
-            width);
-    }
-    uint8_t bytes[8];
-    memset(bytes, 0, sizeof (bytes));
-    memcpy(bytes, value, size);
-    swap_bytes(bytes, width);
-    jdwp_cursor_memcpy_in(c, bytes, width);
-}
-
 static void
 jdwp_scalar_advance(
     struct jdwp_type* this,
@@ -1373,7 +1625,6 @@ jdwp_type_table_new()
 #define SCALAR_DEFAULT                                  \
     .scalar.width = -1,                                 \
         .read = jdwp_scalar_read,                       \
-        .write = jdwp_scalar_write,                     \
         .advance = jdwp_scalar_advance
 
     struct {
@@ -1622,6 +1873,77 @@ jdwp_type_table_new()
     return tt;
 }
 
+static void
+jdwp_type_compute_layout(struct jdwp_type* type)
+{
+    if (type->layout_done)
+        return;
+
+    struct jdwp_type_table* tt = type->tt;
+    type->layout_done = true;
+    type->fixed_size = -1;
+    type->nr_reftype_offsets = 0;
+    if (type->advance == jdwp_scalar_advance) {
+        type->fixed_size = jdwp_scalar_width(type);
+        if (jdwp_type_isinstance(type, tt->type.reference_type_id)) {
+            type->may_contain_reftype_ids = true;
+            type->nr_reftype_offsets = 1;
+            type->reftype_offsets = xcalloc(sizeof (unsigned));
+        }
+    } else if (type->next_type == jdwp_struct_next_type) {
+        unsigned nr_fields = type->struct_.nr_fields;
+        struct jdwp_type** field_types = type->struct_.field_types;
+        bool fixed = true;
+        unsigned size = 0;
+        unsigned nr_offsets = 0;
+        for (unsigned i = 0; i < nr_fields; ++i) {
+            jdwp_type_compute_layout(field_types[i]);
+            if (field_types[i]->may_contain_reftype_ids)
+                type->may_contain_reftype_ids = true;
+            if (field_types[i]->fixed_size < 0)
+                fixed = false;
+            else
+                nr_offsets += field_types[i]->nr_reftype_offsets;
+        }
+        if (fixed) {
+            type->reftype_offsets = xalloc(nr_offsets * sizeof (unsigned));
+            for (unsigned i = 0; i < nr_fields; ++i) {
+                struct jdwp_type* field_type = field_types[i];
+                for (unsigned j = 0; j < field_type->nr_reftype_offsets; ++j)
+                    type->reftype_offsets[type->nr_reftype_offsets++] =
+                        size + field_type->reftype_offsets[j];
+                size += field_type->fixed_size;
+            }
+            type->fixed_size = size;
+        }
+    } else if (type->init_frame == jdwp_array_init_frame) {
+        jdwp_type_compute_layout(type->array.element_type);
+        type->may_contain_reftype_ids =
+            type->array.element_type->may_contain_reftype_ids;
+    } else {
+        // Strings carry no IDs, and the tag of a value or an
+        // arrayregion never names a reference type.  Anything else
+        // picks its type as it goes, so assume the worst.
+        type->may_contain_reftype_ids =
+            !(type == tt->type.string ||
+              type->init_frame == jdwp_value_init_frame ||
+              type == tt->type.arrayregion);
+    }
+}
+
+// Work out which types can hold reference type IDs, and where, so
+// that translating a packet can skip the cursor walk.  Call once the
+// ID sizes are set.
+static void
+jdwp_type_table_compute_layouts(struct jdwp_type_table* tt)
+{
+    WITH_CURRENT_RESLIST(tt->rl);
+    for (struct jdwp_type* type = tt->types; type != NULL; type = type->next)
+        type->layout_done = false;
+    for (struct jdwp_type* type = tt->types; type != NULL; type = type->next)
+        jdwp_type_compute_layout(type);
+}
+
 static struct jdwp_command*
 jdwp_find_command(struct jdwp_type_table* tt,
                   uint8_t command_group,
@@ -1659,9 +1981,6 @@ struct real_reftype;
 struct jdwp_classloader {
     uint64_t id;
     SLIST_ENTRY(jdwp_classloader) link;
-    SPLAY_HEAD(fake_reftype_by_signature,
-               fake_reftype) fake_reftypes_by_signature;
-
 };
 
 enum jdwp_mode {
@@ -1675,8 +1994,12 @@ struct jdwp_proxy {
     LIST_HEAD(, jdwp_packet) pending_packets;
     LIST_HEAD(, jdwp_packet) deferred_from_app;
     SLIST_HEAD(, jdwp_classloader) classloaders;
-    SPLAY_HEAD(fake_reftype_by_id, fake_reftype) fake_reftypes_by_id;
-    SPLAY_HEAD(real_reftype_by_id, real_reftype) real_reftype_cache;
+    // We hand out fake IDs sequentially and never forget them, so we
+    // can find fake reftypes by ID with a plain array of pointers.
+    struct growable_buffer fake_reftypes_by_id;
+    struct ptr_table fake_reftypes_by_signature;
+    struct ptr_table real_reftype_cache;
+    TAILQ_HEAD(real_reftype_lru, real_reftype) real_reftype_lru; // MRU first
     uint32_t real_reftype_cache_size;
     uint32_t real_reftype_cache_max;
     int to_app_fd;
@@ -1687,8 +2010,21 @@ struct jdwp_proxy {
     uint32_t app_packet_size_limit;
     uint32_t nr_classloaders;
     uint32_t nr_fake_ids;
+    struct jdwp_packet_pool packet_pool;
     enum jdwp_mode mode;
     bool quiet;
+    struct {
+        double start;
+        // Waiting for replies to the proxy's own commands
+        struct jdwp_histogram blocked;
+        uint64_t reftype_hits;
+        uint64_t reftype_misses;
+        uint64_t reftype_evictions;
+        // Packets for commands missing from our type table, and all
+        // replies in dumb mode
+        uint64_t nr_unknown_packets;
+        uint64_t unknown_bytes;
+    } stats;
 };
 
 __attribute__((format(printf, 2, 3)))
@@ -1715,6 +2051,171 @@ log_info(struct jdwp_proxy* proxy, const char* fmt, ...)
     }
 }
 
+static double
+jdwp_stats_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return xclock_gettime(CLOCK_MONOTONIC);
+#else
+    return seconds_since_epoch();
+#endif
+}
+
+static uint64_t
+jdwp_stats_us(double seconds)
+{
+    return seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+}
+
+static void
+jdwp_histogram_add(struct jdwp_histogram* h, double seconds)
+{
+    uint64_t us = jdwp_stats_us(seconds);
+    unsigned bucket = 0;
+    while (bucket + 1 < JDWP_STATS_NR_BUCKETS && (us >> (bucket + 1)) != 0)
+        bucket += 1;
+    h->buckets[bucket] += 1;
+    h->count += 1;
+    h->total += seconds;
+    if (seconds > h->max)
+        h->max = seconds;
+}
+
+// Record the time since START in H and return the current time.
+static double
+jdwp_histogram_add_since(struct jdwp_histogram* h, double start)
+{
+    double now = jdwp_stats_now();
+    jdwp_histogram_add(h, now - start);
+    return now;
+}
+
+static void
+emit_jdwp_histogram(struct json_writer* writer, const struct jdwp_histogram* h)
+{
+    json_begin_object(writer);
+    json_begin_field(writer, "count");
+    json_emit_u64(writer, h->count);
+    json_begin_field(writer, "total_us");
+    json_emit_u64(writer, jdwp_stats_us(h->total));
+    json_begin_field(writer, "max_us");
+    json_emit_u64(writer, jdwp_stats_us(h->max));
+    // Each nonzero bucket as [upper bound in microseconds, count];
+    // the last bucket's bound is null.
+    json_begin_field(writer, "buckets");
+    json_begin_array(writer);
+    for (unsigned i = 0; i < JDWP_STATS_NR_BUCKETS; ++i) {
+        if (h->buckets[i] == 0)
+            continue;
+        json_begin_array(writer);
+        if (i + 1 < JDWP_STATS_NR_BUCKETS)
+            json_emit_u64(writer, UINT64_C(1) << (i + 1));
+        else
+            json_emit_null(writer);
+        json_emit_u64(writer, h->buckets[i]);
+        json_end_array(writer);
+    }
+    json_end_array(writer);
+    json_end_object(writer);
+}
+
+static void
+emit_jdwp_by_source(struct json_writer* writer,
+                    const char* name,
+                    const uint64_t counts[JDWP_NR_SOURCES])
+{
+    json_begin_field(writer, name);
+    json_begin_object(writer);
+    for (unsigned i = 0; i < JDWP_NR_SOURCES; ++i) {
+        json_begin_field(writer, jdwp_source_names[i]);
+        json_emit_u64(writer, counts[i]);
+    }
+    json_end_object(writer);
+}
+
+static bool
+jdwp_command_stats_empty_p(const struct jdwp_command_stats* stats)
+{
+    for (unsigned i = 0; i < JDWP_NR_SOURCES; ++i)
+        if (stats->nr_commands[i] || stats->nr_replies[i])
+            return false;
+    return true;
+}
+
+// Write what we know about the session's traffic, as JSON, to the
+// file named DEST or to standard error if DEST is "-".
+static void
+jdwp_write_stats(struct jdwp_proxy* proxy, const char* dest)
+{
+    SCOPED_RESLIST(rl);
+    FILE* out = xstderr;
+    if (strcmp(dest, "-") != 0)
+        out = xfdopen(xopen(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666), "w");
+
+    struct json_writer* writer = json_writer_create(out);
+    json_begin_object(writer);
+    json_begin_field(writer, "uptime_us");
+    json_emit_u64(writer, jdwp_stats_us(jdwp_stats_now() - proxy->stats.start));
+    json_begin_field(writer, "proxy_blocked");
+    emit_jdwp_histogram(writer, &proxy->stats.blocked);
+    json_begin_field(writer, "reftype_cache");
+    json_begin_object(writer);
+    json_begin_field(writer, "hits");
+    json_emit_u64(writer, proxy->stats.reftype_hits);
+    json_begin_field(writer, "misses");
+    json_emit_u64(writer, proxy->stats.reftype_misses);
+    json_begin_field(writer, "evictions");
+    json_emit_u64(writer, proxy->stats.reftype_evictions);
+    json_begin_field(writer, "size");
+    json_emit_u64(writer, proxy->real_reftype_cache_size);
+    json_end_object(writer);
+    json_begin_field(writer, "packet_pool");
+    json_begin_object(writer);
+    json_begin_field(writer, "hits");
+    json_emit_u64(writer, proxy->packet_pool.hits);
+    json_begin_field(writer, "misses");
+    json_emit_u64(writer, proxy->packet_pool.misses);
+    json_end_object(writer);
+    json_begin_field(writer, "unknown_packets");
+    json_emit_u64(writer, proxy->stats.nr_unknown_packets);
+    json_begin_field(writer, "unknown_bytes");
+    json_emit_u64(writer, proxy->stats.unknown_bytes);
+    json_begin_field(writer, "commands");
+    json_begin_array(writer);
+    for (const struct jdwp_command* command = proxy->tt->commands;
+         command != NULL;
+         command = command->next)
+    {
+        const struct jdwp_command_stats* stats = &command->stats;
+        if (jdwp_command_stats_empty_p(stats))
+            continue;
+        json_begin_object(writer);
+        json_begin_field(writer, "name");
+        json_emit_string(writer, command->type->name);
+        json_begin_field(writer, "command_set");
+        json_emit_u64(writer, command->command_group);
+        json_begin_field(writer, "command");
+        json_emit_u64(writer, command->command_code);
+        emit_jdwp_by_source(writer, "commands", stats->nr_commands);
+        emit_jdwp_by_source(writer, "command_bytes", stats->command_bytes);
+        emit_jdwp_by_source(writer, "replies", stats->nr_replies);
+        emit_jdwp_by_source(writer, "reply_bytes", stats->reply_bytes);
+        if (stats->app_latency.count > 0) {
+            json_begin_field(writer, "app_latency");
+            emit_jdwp_histogram(writer, &stats->app_latency);
+        }
+        if (stats->translate.count > 0) {
+            json_begin_field(writer, "translate");
+            emit_jdwp_histogram(writer, &stats->translate);
+        }
+        json_end_object(writer);
+    }
+    json_end_array(writer);
+    json_end_object(writer);
+    xputc('\n', out);
+    xflush(out);
+}
+
 static void
 send_generic_reply(struct jdwp_proxy* proxy,
                    uint16_t id,
@@ -1738,7 +2239,7 @@ mark_packet_pending(struct jdwp_proxy* proxy,
     LIST_INSERT_HEAD(&proxy->pending_packets, packet, link);
     packet->on_list = true;
     WITH_CURRENT_RESLIST(proxy->rl);
-    reslist_reparent(packet->rl);
+    jdwp_packet_adopt(packet);
 }
 
 static struct jdwp_packet*
@@ -1762,7 +2263,7 @@ pop_pending_packet(struct jdwp_proxy* proxy, uint32_t id)
         assert(packet->on_list);
         LIST_REMOVE(packet, link);
         packet->on_list = false;
-        reslist_reparent(packet->rl);
+        jdwp_packet_adopt(packet);
     }
 
     return packet;
@@ -2066,12 +2567,15 @@ on_jdwp_command(struct jdwp_proxy* proxy,
     }
 
     dbg("translating payload for command ID %u", packet->header.id);
+    double translate_start = jdwp_stats_now();
     uint16_t err = translate_payload(
         proxy,
         from_debugger ? TRANSLATE_TO_APP : TRANSLATE_TO_DEBUGGER,
         command->type,
         packet->header.data,
         packet->header.length - sizeof(packet->header));
+    packet->sent_at = jdwp_histogram_add_since(
+        &command->stats.translate, translate_start);
 
     if (err != 0) {
         dbg("translating produced JDWP error %hu (%s)",
@@ -2125,6 +2629,14 @@ on_jdwp_reply(struct jdwp_proxy* proxy,
         return;
     }
 
+    if (command_packet->from_proxy) {
+        // We gave up on a batch of our own commands while errors
+        // unwound the stack.
+        dbg("dropping reply to abandoned proxy command %s",
+            describe_jdwp_message(&packet->header));
+        return;
+    }
+
     if (command_packet->has_rewritten_id) {
         dbg("rewrote reply command ID from %u to original debugger ID %u",
             packet->header.id, command_packet->original_id);
@@ -2136,6 +2648,8 @@ on_jdwp_reply(struct jdwp_proxy* proxy,
             proxy->tt,
             command_packet->header.command.group,
             command_packet->header.command.code);
+    jdwp_histogram_add_since(&command->stats.app_latency,
+                             command_packet->sent_at);
 
     struct jdwp_type* reply_type = command->reply_type;
     if (reply_type == NULL) {
@@ -2158,12 +2672,15 @@ on_jdwp_reply(struct jdwp_proxy* proxy,
 
         if (packet->header.reply.error_code == 0) {
             dbg("Translating reply payload");
+            double translate_start = jdwp_stats_now();
             uint16_t err = translate_payload(
                 proxy,
                 TRANSLATE_TO_DEBUGGER,
                 reply_type,
                 packet->header.data,
                 packet->header.length - sizeof(packet->header));
+            jdwp_histogram_add_since(&command->stats.translate,
+                                     translate_start);
 
             if (err != 0) {
                 dbg("translating reply produced JDWP error %hu (%s)",
@@ -3276,7 +3793,7 @@ jdwp_pop_deferred_packet_from_app(struct jdwp_proxy* proxy)
     assert(packet->on_list);
     LIST_REMOVE(packet, link);
     packet->on_list = false;
-    reslist_reparent(packet->rl);
+    jdwp_packet_adopt(packet);
     return packet;
 }
 
@@ -3289,11 +3806,11 @@ jdwp_defer_packet_from_app(
     LIST_INSERT_HEAD(&proxy->deferred_from_app, packet, link);
     packet->on_list = true;
     WITH_CURRENT_RESLIST(proxy->rl);
-    reslist_reparent(packet->rl);
+    jdwp_packet_adopt(packet);
 }
 
-static struct jdwp_packet*
-jdwp_read_packet(struct jdwp_proxy* proxy, int fd)
+static struct jdwp_header
+jdwp_read_header(struct jdwp_proxy* proxy, int fd)
 {
     struct jdwp_header header;
     size_t nr_read;
@@ -3307,27 +3824,56 @@ jdwp_read_packet(struct jdwp_proxy* proxy, int fd)
     jdwp_header_to_host(&header);
     if (header.length < sizeof (header))
         die(EINVAL, "impossibly small JDWP packet");
+    return header;
+}
 
+// Read the rest of the packet whose header we've already read and the
+// first PREFIX_SIZE bytes of whose body are at PREFIX.  The packet may
+// be loose: see struct jdwp_packet.
+static struct jdwp_packet*
+jdwp_read_packet_rest(struct jdwp_proxy* proxy,
+                      int fd,
+                      const struct jdwp_header* header,
+                      const void* prefix,
+                      size_t prefix_size)
+{
     size_t allocsz = offsetof(struct jdwp_packet, header);
-    if (SATADD(&allocsz, allocsz, header.length) ||
+    if (SATADD(&allocsz, allocsz, header->length) ||
         SATADD(&allocsz, allocsz, 1))
     {
         die(EINVAL, "impossibly huge JDWP packet");
     }
 
-    struct reslist* rl = reslist_create();
-    WITH_CURRENT_RESLIST(rl);
-    struct jdwp_packet* packet = xcalloc(allocsz);
-    packet->rl = rl;
-    packet->header = header;
-    size_t to_read = header.length - sizeof (header);
-    nr_read = read_all(fd, &packet->header.data[0], to_read);
+    struct jdwp_packet* packet =
+        jdwp_packet_pool_get(&proxy->packet_pool, allocsz);
+    if (packet == NULL) {
+        struct reslist* rl = reslist_create();
+        WITH_CURRENT_RESLIST(rl);
+        packet = xcalloc(allocsz);
+        packet->rl = rl;
+    }
+
+    ((char*) packet)[allocsz - 1] = '\0';
+    packet->header = *header;
+    size_t to_read = header->length - sizeof (*header);
+    assert(prefix_size <= to_read);
+    memcpy(&packet->header.data[0], prefix, prefix_size);
+    to_read -= prefix_size;
+    size_t nr_read =
+        read_all(fd, &packet->header.data[prefix_size], to_read);
     if (nr_read < to_read) {
         die(ERR_JDWP_EOF, "short read of JDWP packet");
     }
     return packet;
 }
 
+static struct jdwp_packet*
+jdwp_read_packet(struct jdwp_proxy* proxy, int fd)
+{
+    struct jdwp_header header = jdwp_read_header(proxy, fd);
+    return jdwp_read_packet_rest(proxy, fd, &header, NULL, 0);
+}
+
 static struct jdwp_packet*
 jdwp_read_packet_from_app(struct jdwp_proxy* proxy)
 {
@@ -3346,69 +3892,259 @@ cleanup_decrement_transact_count(void* arg)
     proxy->nr_tx -= 1;
 }
 
-static struct jdwp_packet*
-jdwp_transact_with_app(struct jdwp_proxy* proxy,
-                       struct jdwp_builder* b)
-{
-    SCOPED_RESLIST(rl);
+// A jdwp_batch is a group of commands the proxy itself sends the app.
+// We send each command as soon as it's added to the batch and collect
+// the replies afterward, so a batch costs about one round trip no
+// matter how many commands are in it.  Packets the app sends us in
+// the meantime are deferred, just as they are for a single
+// transaction.  Each command also sits in the pending-packet table
+// until its reply arrives, so that we don't reuse its ID and so that
+// on_jdwp_reply knows to drop replies to commands in a batch we
+// abandoned on error.
 
-    assert(proxy->nr_tx == 0);
-    struct cleanup* cl_nr_tx = cleanup_allocate();
-    proxy->nr_tx += 1;
-    cleanup_commit(cl_nr_tx, cleanup_decrement_transact_count, proxy);
+struct jdwp_tx {
+    STAILQ_ENTRY(jdwp_tx) link;
+    uint32_t id;
+    struct cleanup* cl_nr_tx;
+    struct jdwp_type* reply_type;
+    struct jdwp_command_stats* stats;
+    struct jdwp_packet* command; // In the pending-packet table
+    struct jdwp_packet* reply; // NULL until the reply arrives
+    bool checked;
+};
 
-    uint32_t transaction_id = make_jdwp_id(proxy);
-    struct jdwp_header* command = &b->header;
-    command->id = transaction_id;
-    jdwp_builder_send(b, proxy->to_app_fd);
+struct jdwp_batch {
+    struct jdwp_proxy* proxy;
+    struct reslist* rl; // Owns transactions and replies
+    STAILQ_HEAD(, jdwp_tx) outstanding;
+    unsigned nr_outstanding;
+    uint16_t error_code; // First error from a checked transaction
+    LIST_HEAD(, jdwp_packet) deferred;
+};
 
-    LIST_HEAD(, jdwp_packet) deferred = LIST_HEAD_INITIALIZER(&deferred);
-    struct jdwp_packet* reply = NULL;
-    do {
-        SCOPED_RESLIST(rl_loop);
-        struct jdwp_packet* packet = jdwp_read_packet_from_app(proxy);
-        WITH_CURRENT_RESLIST(rl);
-        reslist_reparent(packet->rl);
-        if (!jdwp_command_p(&packet->header) &&
-            packet->header.id == transaction_id)
-        {
-            reply = packet;
-        } else {
-            assert(!packet->on_list);
-            LIST_INSERT_HEAD(&deferred, packet, link);
-            packet->on_list = true;
-        }
-    } while (!reply);
+static void
+jdwp_batch_init(struct jdwp_batch* batch, struct jdwp_proxy* proxy)
+{
+    memset(batch, 0, sizeof (*batch));
+    batch->proxy = proxy;
+    batch->rl = reslist_create();
+    STAILQ_INIT(&batch->outstanding);
+    LIST_INIT(&batch->deferred);
+}
 
-    while (!LIST_EMPTY(&deferred)) {
-        struct jdwp_packet* packet = LIST_FIRST(&deferred);
-        assert(packet->on_list);
-        LIST_REMOVE(packet, link);
-        packet->on_list = false;
-        jdwp_defer_packet_from_app(proxy, packet);
+// Read one packet from the app and, if it answers one of our
+// commands, retire that command.
+static void
+jdwp_batch_collect_one(struct jdwp_batch* batch)
+{
+    struct jdwp_proxy* proxy = batch->proxy;
+    SCOPED_RESLIST(rl_loop);
+    struct jdwp_packet* packet = jdwp_read_packet_from_app(proxy);
+    WITH_CURRENT_RESLIST(batch->rl);
+    jdwp_packet_adopt(packet);
+    if (!jdwp_command_p(&packet->header)) {
+        struct jdwp_tx* tx;
+        STAILQ_FOREACH(tx, &batch->outstanding, link) {
+            if (tx->id == packet->header.id) {
+                STAILQ_REMOVE(&batch->outstanding, tx, jdwp_tx, link);
+                batch->nr_outstanding -= 1;
+                cleanup_forget(tx->cl_nr_tx);
+                cleanup_decrement_transact_count(proxy);
+                struct jdwp_packet* command =
+                    pop_pending_packet(proxy, tx->id);
+                assert(command == tx->command);
+                (void) command;
+                tx->reply = packet;
+                tx->stats->nr_replies[JDWP_FROM_PROXY] += 1;
+                tx->stats->reply_bytes[JDWP_FROM_PROXY] +=
+                    packet->header.length;
+                if (tx->checked && batch->error_code == 0)
+                    batch->error_code = packet->header.reply.error_code;
+                return;
+            }
+        }
     }
 
-    WITH_CURRENT_RESLIST(rl->parent);
-    reslist_reparent(reply->rl);
-
-    if (reply->header.reply.error_code != 0)
-        die_jdwp(reply->header.reply.error_code);
-
-    return reply;
+    // Not ours: keep it away from jdwp_read_packet_from_app until we
+    // finish, since otherwise we'd just read it again.
+    assert(!packet->on_list);
+    LIST_INSERT_HEAD(&batch->deferred, packet, link);
+    packet->on_list = true;
 }
 
-static void
-handle_packet_toplevel(
-    struct jdwp_proxy* proxy,
-    struct jdwp_packet* packet,
-    int recv_fd,
-    int onward_fd)
+// Send the command in B.  Its reply is in the returned transaction's
+// reply field once jdwp_batch_wait returns.
+static struct jdwp_tx*
+jdwp_batch_send(struct jdwp_batch* batch, struct jdwp_builder* b)
+{
+    struct jdwp_proxy* proxy = batch->proxy;
+    if (batch->nr_outstanding >= MAX_OUTSTANDING_TRANSACTIONS) {
+        double start = jdwp_stats_now();
+        while (batch->nr_outstanding >= MAX_OUTSTANDING_TRANSACTIONS)
+            jdwp_batch_collect_one(batch);
+        jdwp_histogram_add_since(&proxy->stats.blocked, start);
+    }
+
+    WITH_CURRENT_RESLIST(batch->rl);
+    struct jdwp_tx* tx = xcalloc(sizeof (*tx));
+    tx->id = make_jdwp_id(proxy);
+    struct jdwp_command* command = jdwp_find_command(
+        proxy->tt,
+        b->header.command.group,
+        b->header.command.code);
+    tx->reply_type = command->reply_type;
+    tx->stats = &command->stats;
+    b->header.id = tx->id;
+
+    struct reslist* command_rl = reslist_create();
+    {
+        WITH_CURRENT_RESLIST(command_rl);
+        tx->command = xcalloc(sizeof (*tx->command));
+    }
+    tx->command->rl = command_rl;
+    tx->command->from_proxy = true;
+    tx->command->header = b->header;
+    mark_packet_pending(proxy, tx->command);
+
+    jdwp_builder_send(b, proxy->to_app_fd);
+    tx->stats->nr_commands[JDWP_FROM_PROXY] += 1;
+    tx->stats->command_bytes[JDWP_FROM_PROXY] += b->header.length;
+
+    tx->cl_nr_tx = cleanup_allocate();
+    proxy->nr_tx += 1;
+    cleanup_commit(tx->cl_nr_tx, cleanup_decrement_transact_count, proxy);
+    STAILQ_INSERT_TAIL(&batch->outstanding, tx, link);
+    batch->nr_outstanding += 1;
+    return tx;
+}
+
+// Send the command in B for its effect alone.  If the app reports an
+// error, jdwp_batch_wait dies with it.
+static void
+jdwp_batch_send_checked(struct jdwp_batch* batch, struct jdwp_builder* b)
+{
+    jdwp_batch_send(batch, b)->checked = true;
+}
+
+// Wait for replies to all commands in the batch.  We look at the
+// error codes only of the replies to checked commands; the rest are
+// the caller's business.
+static void
+jdwp_batch_wait(struct jdwp_batch* batch)
+{
+    if (batch->nr_outstanding > 0) {
+        double start = jdwp_stats_now();
+        while (batch->nr_outstanding > 0)
+            jdwp_batch_collect_one(batch);
+        jdwp_histogram_add_since(&batch->proxy->stats.blocked, start);
+    }
+
+    while (!LIST_EMPTY(&batch->deferred)) {
+        struct jdwp_packet* packet = LIST_FIRST(&batch->deferred);
+        assert(packet->on_list);
+        LIST_REMOVE(packet, link);
+        packet->on_list = false;
+        jdwp_defer_packet_from_app(batch->proxy, packet);
+    }
+
+    if (batch->error_code != 0) {
+        uint16_t error_code = batch->error_code;
+        batch->error_code = 0;
+        die_jdwp(error_code);
+    }
+}
+
+static void
+jdwp_tx_check(const struct jdwp_tx* tx)
+{
+    assert(tx->reply != NULL);
+    if (tx->reply->header.reply.error_code != 0)
+        die_jdwp(tx->reply->header.reply.error_code);
+}
+
+static struct jdwp_cursor
+jdwp_tx_reply_cursor(const struct jdwp_tx* tx)
+{
+    jdwp_tx_check(tx);
+    return jdwp_cursor_create(
+        tx->reply_type,
+        tx->reply->header.data,
+        tx->reply->header.length - sizeof (tx->reply->header));
+}
+
+static struct jdwp_packet*
+jdwp_transact_with_app(struct jdwp_proxy* proxy,
+                       struct jdwp_builder* b)
+{
+    SCOPED_RESLIST(rl);
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    struct jdwp_tx* tx = jdwp_batch_send(&batch, b);
+    jdwp_batch_wait(&batch);
+    WITH_CURRENT_RESLIST(rl->parent);
+    jdwp_packet_adopt(tx->reply);
+    jdwp_tx_check(tx);
+    return tx->reply;
+}
+
+static void
+count_jdwp_packet(struct jdwp_proxy* proxy,
+                  struct jdwp_packet* packet,
+                  int recv_fd)
+{
+    struct jdwp_header* header = &packet->header;
+    struct jdwp_command* command = NULL;
+    enum jdwp_source source;
+    if (jdwp_command_p(header)) {
+        command = jdwp_find_command(proxy->tt,
+                                    header->command.group,
+                                    header->command.code);
+        source = recv_fd == proxy->to_debugger_fd
+            ? JDWP_FROM_DEBUGGER
+            : JDWP_FROM_APP;
+        if (command != NULL) {
+            command->stats.nr_commands[source] += 1;
+            command->stats.command_bytes[source] += header->length;
+            return;
+        }
+    } else {
+        // We track commands, and so can attribute replies, only
+        // when rewriting.
+        struct jdwp_packet* command_packet =
+            peek_pending_packet(proxy, header->id);
+        if (command_packet != NULL) {
+            command = jdwp_find_command(
+                proxy->tt,
+                command_packet->header.command.group,
+                command_packet->header.command.code);
+            source = command_packet->from_proxy
+                ? JDWP_FROM_PROXY
+                : JDWP_FROM_DEBUGGER;
+        }
+        if (command != NULL) {
+            command->stats.nr_replies[source] += 1;
+            command->stats.reply_bytes[source] += header->length;
+            return;
+        }
+    }
+
+    proxy->stats.nr_unknown_packets += 1;
+    proxy->stats.unknown_bytes += header->length;
+}
+
+static void
+handle_packet_toplevel(
+    struct jdwp_proxy* proxy,
+    struct jdwp_packet* packet,
+    int recv_fd,
+    int onward_fd)
 {
     dbg("received from %s JDWP packet %s",
         ( recv_fd == proxy->to_debugger_fd
           ? "debugger"
           : "debugee" ),
         describe_jdwp_message(&packet->header));
+    count_jdwp_packet(proxy, packet, recv_fd);
 
     if (proxy->mode == JDWP_MODE_REWRITE) {
         if (jdwp_command_p(&packet->header))
@@ -3420,7 +4156,35 @@ handle_packet_toplevel(
     }
 }
 
+struct jdwp_id_sizes {
+    int32_t field_id;
+    int32_t method_id;
+    int32_t object_id;
+    int32_t reference_type_id;
+    int32_t frame_id;
+};
+
 static void
+set_type_sizes(struct jdwp_proxy* proxy, const struct jdwp_id_sizes* sizes)
+{
+    proxy->tt->type.field_id->scalar.width = sizes->field_id;
+    proxy->tt->type.method_id->scalar.width = sizes->method_id;
+    proxy->tt->type.object_id->scalar.width = sizes->object_id;
+    proxy->tt->type.reference_type_id->scalar.width =
+        sizes->reference_type_id;
+    proxy->tt->type.frame_id->scalar.width = sizes->frame_id;
+    jdwp_type_table_compute_layouts(proxy->tt);
+
+    dbg("updated type sizes: fieldIDSize:%d methodIDSize:%d "
+        "objectIDSize:%d referenceTypeIDSize:%d frameIDSize:%d",
+        (int) sizes->field_id,
+        (int) sizes->method_id,
+        (int) sizes->object_id,
+        (int) sizes->reference_type_id,
+        (int) sizes->frame_id);
+}
+
+static struct jdwp_id_sizes
 update_type_sizes(struct jdwp_proxy* proxy)
 {
     SCOPED_RESLIST(rl);
@@ -3474,173 +4238,117 @@ update_type_sizes(struct jdwp_proxy* proxy)
 
     assert(c.pos == c.end);
 
-    proxy->tt->type.field_id->scalar.width = fieldIDSize;
-    proxy->tt->type.method_id->scalar.width = methodIDSize;
-    proxy->tt->type.object_id->scalar.width = objectIDSize;
-    proxy->tt->type.reference_type_id->scalar.width = referenceTypeIDSize;
-    proxy->tt->type.frame_id->scalar.width = frameIDSize;
-
-    dbg("updated type sizes: fieldIDSize:%d methodIDSize:%d "
-        "objectIDSize:%d referenceTypeIDSize:%d frameIDSize:%d",
-        (int) fieldIDSize,
-        (int) methodIDSize,
-        (int) objectIDSize,
-        (int) referenceTypeIDSize,
-        (int) frameIDSize);
-}
-
-struct heap_dump {
-    uint8_t* data;
-    size_t size;
-};
-
-static struct heap_dump
-read_heap_dump(
-    struct jdwp_proxy* proxy)
-{
-    SCOPED_RESLIST(rl);
-
-    struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
-    b.header.command.group = JDWP_COMMANDSET_DDM;
-    b.header.command.code = JDWP_COMMAND_DDM_CHUNK;
-    b.header.id = make_jdwp_id(proxy);
-
-    uint8_t chunk_type[] = { 'H', 'P', 'D', 'S' }; // HeaP Dump Streaming
-    uint32_t chunk_length = 0;
-    jdwp_builder_raw_bytes(&b, chunk_type, sizeof (chunk_type));
-    jdwp_builder_u32(&b, chunk_length);
-
-    log_info(proxy, "requesting heap dump for class list; please wait...");
-    double start_time = seconds_since_epoch();
-    jdwp_transact_with_app(proxy, &b);
-
-    // Between our requesting a heap dump and getting the JDWP reply,
-    // the debugee should have sent us a command packet containing the
-    // dump itself.  (Why not put the dump in the reply? That would
-    // make sense. Can't have that on mobile.)  Pull the dump packet
-    // out of the queue, assume ownership, and give it to our caller.
-
-    struct jdwp_packet* dump = NULL;
-    struct jdwp_packet* packet;
-
-    LIST_FOREACH(packet, &proxy->deferred_from_app, link) {
-        if (jdwp_command_p(&packet->header) &&
-            packet->header.command.group == JDWP_COMMANDSET_DDM &&
-            packet->header.command.code == JDWP_COMMAND_DDM_CHUNK &&
-            packet->header.length >= 8 &&
-            memcmp(packet->header.data, chunk_type, 4) == 0)
-        {
-            assert(packet->on_list);
-            LIST_REMOVE(packet, link);
-            packet->on_list = false;
-            reslist_reparent(packet->rl);
-            dump = packet;
-            break;
-        }
-    }
-
-    if (dump == NULL)
-        die(EINVAL, "did not receive JDWP dump reply as expected");
-
-    double elapsed = seconds_since_epoch() - start_time;
-    log_info(proxy, "heap dump received (%uKB in %g seconds)",
-             (unsigned) ((dump->header.length - sizeof (dump->header))/1024),
-             elapsed);
-
-    uint8_t* payload = &dump->header.data[0];
-    uint32_t chunk_size;
-    memcpy(&chunk_size, payload + 4, 4);
-    chunk_size = ntohl(chunk_size);
-
-    WITH_CURRENT_RESLIST(rl->parent);
-    reslist_reparent(dump->rl);
-    struct heap_dump hd = {
-        .data = payload + 8,
-        .size = chunk_size,
+    struct jdwp_id_sizes sizes = {
+        .field_id = fieldIDSize,
+        .method_id = methodIDSize,
+        .object_id = objectIDSize,
+        .reference_type_id = referenceTypeIDSize,
+        .frame_id = frameIDSize,
     };
-    return hd;
+    set_type_sizes(proxy, &sizes);
+    return sizes;
 }
 
-enum hd_item_type {
-    HD_ITEM_STRING,
-    HD_ITEM_CLASS,
-};
+// We parse the heap dump as it arrives on the JDWP connection
+// instead of buffering all of it: dumps of big apps run to hundreds of
+// megabytes, and all we want from them is the names of the loaded
+// classes.  We keep the text of every STRING record in one arena,
+// find strings by ID through an open-addressing hash table, and read
+// past everything else, heap segments included, without parsing it.
 
-struct hd_item {
+struct hd_string_slot {
     uint64_t id;
-    enum hd_item_type type;
-    RB_ENTRY(hd_item) link;
-    union {
-        struct {
-            char data[0];
-        } string;
+    size_t offset; // Into the arena, plus one; zero for an empty slot
+};
 
-        struct {
-            uint64_t name_string_id;
-        } class;
-    };
+struct hd_class {
+    uint64_t id;
+    uint64_t name_string_id;
 };
 
 struct hd_parse_context {
-    uint8_t* start;
-    uint8_t* pos;
-    uint8_t* end;
+    struct reslist* rl; // Owns the buffers below
+    int fd;
+    uint64_t remaining; // Dump bytes not yet read from FD
+    uint8_t* buf;
+    size_t pos;
+    size_t end;
     int id_size;
-    RB_HEAD(hd_items, hd_item) items;
+    struct growable_buffer arena;
+    size_t arena_used;
+    struct growable_buffer slots_gb;
+    size_t nr_slots; // Zero or a power of two
+    size_t nr_strings;
+    struct growable_buffer classes_gb;
+    size_t nr_classes;
 };
 
-static int
-hd_item_cmp(struct hd_item* left, struct hd_item* right)
+#define HPROF_TAG_STRING 0x01
+#define HPROF_TAG_LOAD_CLASS 0x02
+#define HPROF_TAG_HEAP_DUMP 0x0C
+#define HPROF_TAG_HEAP_DUMP_SEGMENT 0x1C
+
+static bool
+hd_more_p(const struct hd_parse_context* pc)
 {
-    if (left->id < right->id)
-        return -1;
-    if (left->id > right->id)
-        return 1;
-    if (left->type < right->type)
-        return -1;
-    if (left->type > right->type)
-        return 1;
-    return 0;
+    return pc->pos < pc->end || pc->remaining > 0;
 }
 
-RB_PROTOTYPE_STATIC(hd_items, hd_item, link, hd_item_cmp);
-RB_GENERATE_STATIC(hd_items, hd_item, link, hd_item_cmp);
-
+// Read more of the dump into our buffer, keeping what we haven't
+// consumed yet.
 static void
-hd_checked_memcpy(
-    struct hd_parse_context* pc,
-    void* out_bytes,
-    size_t size)
+hd_fill(struct hd_parse_context* pc)
 {
-    if (pc->end - pc->pos < size)
+    if (pc->remaining == 0)
         die(EINVAL, "truncated heap dump");
-    memcpy(out_bytes, pc->pos, size);
+    size_t leftover = pc->end - pc->pos;
+    memmove(pc->buf, pc->buf + pc->pos, leftover);
+    pc->pos = 0;
+    pc->end = leftover;
+    size_t to_read = HPROF_READ_BUFFER_SIZE - pc->end;
+    if (to_read > pc->remaining)
+        to_read = (size_t) pc->remaining;
+    if (read_all(pc->fd, pc->buf + pc->end, to_read) < to_read)
+        die(ERR_JDWP_EOF, "short read of JDWP packet");
+    pc->end += to_read;
+    pc->remaining -= to_read;
 }
 
-#define HPROF_TAG_STRING 0x01
-#define HPROF_TAG_LOAD_CLASS 0x02
-#define HPROF_TAG_HEAP_DUMP 0x0C
-#define HPROF_TAG_HEAP_DUMP_SEGMENT 0x1C
-
 static void
 hd_slurp(
     struct hd_parse_context* pc,
     void* out_bytes,
     size_t size)
 {
-    hd_checked_memcpy(pc, out_bytes, size);
-    pc->pos += size;
+    uint8_t* out = out_bytes;
+    while (size > 0) {
+        if (pc->pos == pc->end)
+            hd_fill(pc);
+        size_t chunk = XMIN(size, pc->end - pc->pos);
+        memcpy(out, pc->buf + pc->pos, chunk);
+        pc->pos += chunk;
+        out += chunk;
+        size -= chunk;
+    }
 }
 
 static void
 hd_skip(
     struct hd_parse_context* pc,
-    size_t size)
+    uint64_t size)
 {
-    if (pc->end - pc->pos < size)
+    size_t buffered = XMIN(size, pc->end - pc->pos);
+    pc->pos += buffered;
+    size -= buffered;
+    if (size > pc->remaining)
         die(EINVAL, "truncated heap dump");
-    pc->pos += size;
+    while (size > 0) {
+        size_t chunk = (size_t) XMIN(size, HPROF_READ_BUFFER_SIZE);
+        if (read_all(pc->fd, pc->buf, chunk) < chunk)
+            die(ERR_JDWP_EOF, "short read of JDWP packet");
+        pc->remaining -= chunk;
+        size -= chunk;
+    }
 }
 
 static uint32_t
@@ -3700,34 +4408,54 @@ hd_slurp_id(struct hd_parse_context* pc)
     return value;
 }
 
-static struct hd_item*
-hd_find_item(struct hd_parse_context* pc,
-             uint64_t id,
-             enum hd_item_type type)
+static struct hd_string_slot*
+hd_find_slot(struct hd_string_slot* slots, size_t nr_slots, uint64_t id)
 {
-    struct hd_item search = {
-        .id = id,
-        .type = type,
-    };
-    return RB_FIND(hd_items, &pc->items, &search);
+    size_t mask = nr_slots - 1;
+    size_t i = hash_u64(id) & mask;
+    while (slots[i].offset != 0 && slots[i].id != id)
+        i = (i + 1) & mask;
+    return &slots[i];
 }
 
 static const char*
 hd_find_string(struct hd_parse_context* pc, uint64_t id)
 {
-    struct hd_item* item = hd_find_item(pc, id, HD_ITEM_STRING);
-    return item == NULL ? NULL : item->string.data;
+    if (pc->nr_slots == 0)
+        return NULL;
+    struct hd_string_slot* slot =
+        hd_find_slot((struct hd_string_slot*) pc->slots_gb.buf,
+                     pc->nr_slots,
+                     id);
+    return slot->offset == 0
+        ? NULL
+        : (const char*) pc->arena.buf + slot->offset - 1;
 }
 
+// Keep the hash table at most half full.
 static void
-hd_insert_item(struct hd_parse_context* pc, struct hd_item* item)
+hd_reserve_string_slot(struct hd_parse_context* pc)
 {
-#ifndef NDEBUG
-    if (hd_find_item(pc, item->id, item->type) != NULL)
-        die(EINVAL, "duplicate item id:%llu type:%d",
-            (llu) item->id, item->type);
-#endif
-    RB_INSERT(hd_items, &pc->items, item);
+    if (pc->nr_slots != 0 && pc->nr_strings < pc->nr_slots / 2)
+        return;
+
+    size_t new_nr_slots = pc->nr_slots ? pc->nr_slots * 2 : 1024;
+    if (new_nr_slots > SIZE_MAX / sizeof (struct hd_string_slot))
+        die(EINVAL, "too many strings in heap dump");
+    struct growable_buffer new_gb = { 0 };
+    resize_buffer(&new_gb, new_nr_slots * sizeof (struct hd_string_slot));
+    memset(new_gb.buf, 0, new_gb.bufsz);
+    struct hd_string_slot* old_slots =
+        (struct hd_string_slot*) pc->slots_gb.buf;
+    for (size_t i = 0; i < pc->nr_slots; ++i)
+        if (old_slots[i].offset != 0)
+            *hd_find_slot((struct hd_string_slot*) new_gb.buf,
+                          new_nr_slots,
+                          old_slots[i].id) = old_slots[i];
+    cleanup_forget(pc->slots_gb.cl);
+    free(pc->slots_gb.buf);
+    pc->slots_gb = new_gb;
+    pc->nr_slots = new_nr_slots;
 }
 
 static unsigned
@@ -3777,37 +4505,202 @@ hd_intern_string_chunk(struct hd_parse_context* pc, size_t length)
     if (length < pc->id_size)
         die(EINVAL, "short string tag");
     size_t data_size = length - pc->id_size;
-    size_t allocsz;
-    if (SATADD(&allocsz, sizeof(struct hd_item), data_size) ||
-        SATADD(&allocsz, allocsz, 1) /* terminating NUL */)
+    size_t needed;
+    if (SATADD(&needed, pc->arena_used, data_size) ||
+        SATADD(&needed, needed, 1) /* terminating NUL */)
         die(EINVAL, "overlong tag");
-    struct hd_item* item = xcalloc(allocsz);
-    item->id = hd_slurp_id(pc);
-    item->type = HD_ITEM_STRING;
-    hd_slurp(pc, item->string.data, data_size);
-    item->string.data[data_size] = '\0';
+    while (pc->arena.bufsz < needed)
+        grow_buffer_dwim(&pc->arena);
+
+    uint64_t id = hd_slurp_id(pc);
+    char* data = (char*) pc->arena.buf + pc->arena_used;
+    hd_slurp(pc, data, data_size);
+    data[data_size] = '\0';
 #ifdef HPROF_VERBOSE_DEBUG
-    dbg("interning string chunk id:%llu data:[%s]",
-        (llu) item->id, item->string.data);
+    dbg("interning string chunk id:%llu data:[%s]", (llu) id, data);
 #endif
-    hd_insert_item(pc, item);
+
+    hd_reserve_string_slot(pc);
+    struct hd_string_slot* slot =
+        hd_find_slot((struct hd_string_slot*) pc->slots_gb.buf,
+                     pc->nr_slots,
+                     id);
+    if (slot->offset != 0)
+        die(EINVAL, "duplicate string id:%llu", (llu) id);
+    slot->id = id;
+    slot->offset = pc->arena_used + 1;
+    pc->arena_used = needed;
+    pc->nr_strings += 1;
 }
 
 static void
 hd_intern_class_chunk(struct hd_parse_context* pc, size_t length)
 {
-    struct hd_item* item = xcalloc(sizeof (*item));
-    item->type = HD_ITEM_CLASS;
+    size_t needed = (pc->nr_classes + 1) * sizeof (struct hd_class);
+    while (pc->classes_gb.bufsz < needed)
+        grow_buffer_dwim(&pc->classes_gb);
+    struct hd_class* class =
+        &((struct hd_class*) pc->classes_gb.buf)[pc->nr_classes++];
     hd_skip(pc, 4); // Don't care about serial number
-    item->id = hd_slurp_id(pc);
+    class->id = hd_slurp_id(pc);
     hd_skip(pc, 4); // Don't care about stack trace serial number
-    item->class.name_string_id = hd_slurp_id(pc);
+    class->name_string_id = hd_slurp_id(pc);
 #if HPROF_VERBOSE_DEBUG
     dbg("interning class id:%llu name:[%s]",
-        (llu) item->id,
-        hd_find_string(pc, item->class.name_string_id));
+        (llu) class->id,
+        hd_find_string(pc, class->name_string_id));
 #endif
-    hd_insert_item(pc, item);
+}
+
+// Parse the hprof data that PC's file descriptor is about to give us.
+static void
+hd_parse(struct hd_parse_context* pc)
+{
+    WITH_CURRENT_RESLIST(pc->rl);
+    char magic[32];
+    size_t magic_length = 0;
+    do {
+        if (magic_length == sizeof (magic))
+            die(EINVAL, "invalid heap dump format");
+        magic[magic_length] = hd_slurp_u8(pc);
+    } while (magic[magic_length++] != '\0');
+    dbg("heap dump format: [%s]", magic);
+
+    if (strcmp(magic, "JAVA PROFILE 1.0.3") != 0)
+        die(EINVAL, "invalid heap dump format [%s]", magic);
+
+    pc->id_size = hd_slurp_u32(pc);
+#if HPROF_VERBOSE_DEBUG
+    dbg("heap dump ID size is %u", pc->id_size);
+#endif
+    if (pc->id_size > 8)
+        die(EINVAL, "bogus heap dump ID size %u", pc->id_size);
+
+    hd_skip(pc, 8); // We don't care about dump timestamp
+
+    while (hd_more_p(pc)) {
+        uint8_t tag = hd_slurp_u8(pc);
+        hd_skip(pc, 4); // Don't care about timestamp
+        uint32_t length = hd_slurp_u32(pc);
+        if (tag == HPROF_TAG_STRING) {
+            hd_intern_string_chunk(pc, length);
+        } else if (tag == HPROF_TAG_LOAD_CLASS) {
+            hd_intern_class_chunk(pc, length);
+        } else {
+#if HPROF_VERBOSE_DEBUG
+            dbg("skipping hprof chunk type:0x%02hhx length:%u", tag, length);
+#endif
+            hd_skip(pc, length);
+        }
+    }
+}
+
+// Ask the VM for a heap dump and feed it to PC as it arrives.
+static void
+read_heap_dump(
+    struct jdwp_proxy* proxy,
+    struct hd_parse_context* pc)
+{
+    SCOPED_RESLIST(rl);
+
+    struct jdwp_builder b;
+    jdwp_builder_start(&b, proxy);
+    b.header.command.group = JDWP_COMMANDSET_DDM;
+    b.header.command.code = JDWP_COMMAND_DDM_CHUNK;
+
+    uint8_t chunk_type[] = { 'H', 'P', 'D', 'S' }; // HeaP Dump Streaming
+    uint32_t chunk_length = 0;
+    jdwp_builder_raw_bytes(&b, chunk_type, sizeof (chunk_type));
+    jdwp_builder_u32(&b, chunk_length);
+
+    log_info(proxy, "requesting heap dump for class list; please wait...");
+    double start_time = seconds_since_epoch();
+
+    // Between our requesting a heap dump and getting the JDWP reply,
+    // the debugee should send us a command packet containing the
+    // dump itself.  (Why not put the dump in the reply? That would
+    // make sense. Can't have that on mobile.)  We do the transaction
+    // by hand instead of with jdwp_transact_with_app so that we can
+    // parse that packet straight off the wire.
+
+    assert(proxy->nr_tx == 0);
+    struct cleanup* cl_nr_tx = cleanup_allocate();
+    proxy->nr_tx += 1;
+    cleanup_commit(cl_nr_tx, cleanup_decrement_transact_count, proxy);
+
+    uint32_t transaction_id = make_jdwp_id(proxy);
+    b.header.id = transaction_id;
+    jdwp_builder_send(&b, proxy->to_app_fd);
+
+    int fd = proxy->to_app_fd;
+    bool got_dump = false;
+    uint32_t dump_size = 0;
+    for (;;) {
+        SCOPED_RESLIST(rl_loop);
+        struct jdwp_header header = jdwp_read_header(proxy, fd);
+        size_t body_size = header.length - sizeof (header);
+        if (!jdwp_command_p(&header) && header.id == transaction_id) {
+            struct jdwp_packet* reply =
+                jdwp_read_packet_rest(proxy, fd, &header, NULL, 0);
+            jdwp_packet_adopt(reply);
+            if (reply->header.reply.error_code != 0)
+                die_jdwp(reply->header.reply.error_code);
+            break;
+        }
+
+        uint8_t prefix[8];
+        size_t prefix_size = 0;
+        if (!got_dump &&
+            jdwp_command_p(&header) &&
+            header.command.group == JDWP_COMMANDSET_DDM &&
+            header.command.code == JDWP_COMMAND_DDM_CHUNK &&
+            body_size >= sizeof (prefix))
+        {
+            prefix_size = sizeof (prefix);
+            if (read_all(fd, prefix, prefix_size) < prefix_size)
+                die(ERR_JDWP_EOF, "short read of JDWP packet");
+            uint32_t hprof_size;
+            memcpy(&hprof_size, prefix + 4, 4);
+            hprof_size = ntohl(hprof_size);
+            if (memcmp(prefix, chunk_type, 4) == 0 &&
+                hprof_size <= body_size - prefix_size)
+            {
+                pc->fd = fd;
+                pc->remaining = hprof_size;
+                hd_parse(pc);
+                size_t trailer = body_size - prefix_size - hprof_size;
+                pc->remaining = trailer;
+                hd_skip(pc, trailer);
+                got_dump = true;
+                dump_size = hprof_size;
+                continue;
+            }
+        }
+
+        struct jdwp_packet* packet =
+            jdwp_read_packet_rest(proxy, fd, &header, prefix, prefix_size);
+        jdwp_defer_packet_from_app(proxy, packet);
+    }
+
+    if (!got_dump)
+        die(EINVAL, "did not receive JDWP dump reply as expected");
+
+    double elapsed = seconds_since_epoch() - start_time;
+    log_info(proxy, "heap dump received (%uKB in %g seconds)",
+             (unsigned) (dump_size / 1024),
+             elapsed);
+}
+
+static int
+hd_class_cmp(const void* a, const void* b)
+{
+    const struct hd_class* ca = a;
+    const struct hd_class* cb = b;
+    if (ca->id < cb->id)
+        return -1;
+    if (ca->id > cb->id)
+        return 1;
+    return 0;
 }
 
 struct hd_class_list {
@@ -3877,101 +4770,38 @@ java_class_name_to_signature(const char* name)
     return signature;
 }
 
-static struct heap_dump
-map_heap_dump(const char* filename)
-{
-    int fd = xopen("/home/dancol/com.facebook.wakizashi.hprof", O_RDONLY, 0);
-    struct stat stat = xfstat(fd);
-
-    struct heap_dump hd = {
-        .data = (uint8_t*) mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0),
-        .size = stat.st_size,
-    };
-
-    if (hd.data == (uint8_t*) MAP_FAILED)
-        die_errno("mmap");
-
-    return hd;
-}
-
 static struct hd_class_list
 read_class_list_via_heap_dump(struct jdwp_proxy* proxy)
 {
     SCOPED_RESLIST(rl);
-    struct heap_dump hd = read_heap_dump(proxy);
     struct hd_parse_context pc_buf = {
-        .start = hd.data,
-        .pos = hd.data,
-        .end = hd.data + hd.size,
+        .rl = rl,
+        .buf = xalloc(HPROF_READ_BUFFER_SIZE),
         .id_size = -1,
     };
     struct hd_parse_context* pc = &pc_buf;
-    RB_INIT(&pc->items);
+    read_heap_dump(proxy, pc);
 
-    char* magic = xstrndup((char*) pc->pos, pc->end - pc->pos);
-    dbg("heap dump format: [%s]", magic);
-    pc->pos += strlen(magic) + 1;
-    if (pc->pos > pc->end)
-        die(EINVAL, "truncated heap dump");
-
-    if (strcmp(magic, "JAVA PROFILE 1.0.3") != 0)
-        die(EINVAL, "invalid heap dump format [%s]", magic);
-
-    pc->id_size = hd_slurp_u32(pc);
-#if HPROF_VERBOSE_DEBUG
-    dbg("heap dump ID size is %u", pc->id_size);
-#endif
-    if (pc->id_size > 8)
-        die(EINVAL, "bogus heap dump ID size %u", pc->id_size);
-
-    hd_skip(pc, 8); // We don't care about dump timestamp
-
-    while (pc->pos < pc->end) {
-        uint8_t tag = hd_slurp_u8(pc);
-        hd_skip(pc, 4); // Don't care about timestamp
-        uint32_t length = hd_slurp_u32(pc);
-        if (tag == HPROF_TAG_STRING) {
-            hd_intern_string_chunk(pc, length);
-        } else if (tag == HPROF_TAG_LOAD_CLASS) {
-            hd_intern_class_chunk(pc, length);
-        } else {
-#if HPROF_VERBOSE_DEBUG
-            dbg("skipping hprof chunk type:0x%02hhx length:%u", tag, length);
-#endif
-            hd_skip(pc, length);
-        }
-    }
+    struct hd_class* classes = (struct hd_class*) pc->classes_gb.buf;
+    qsort(classes, pc->nr_classes, sizeof (classes[0]), hd_class_cmp);
 
     WITH_CURRENT_RESLIST(rl->parent);
 
-    struct hd_item* item;
     struct hd_class_list hcl;
     memset(&hcl, 0, sizeof (hcl));
-    RB_FOREACH(item, hd_items, &pc->items)
-        if (item->type == HD_ITEM_CLASS)
-            hcl.nr_classes++;
-
-    if (hcl.nr_classes > SIZE_MAX / sizeof (hcl.signatures[0]))
-        die(EINVAL, "too many classes");
-
-    size_t i = 0;
-    hcl.signatures = xalloc(hcl.nr_classes * sizeof (hcl.signatures[0]));
-    RB_FOREACH(item, hd_items, &pc->items) {
-        if (item->type == HD_ITEM_CLASS) {
-            uint64_t name_string_id = item->class.name_string_id;
-            const char* name = hd_find_string(pc, name_string_id);
-            if (name == NULL) {
-                log_warn(proxy,
-                         "could not find name of class (id:%llu) in heap dump",
-                         (llu) name_string_id);
-                hcl.nr_classes -= 1;
-                continue;
-            }
-            hcl.signatures[i++] = java_class_name_to_signature(name);
+    hcl.signatures = xalloc(pc->nr_classes * sizeof (hcl.signatures[0]));
+    for (size_t i = 0; i < pc->nr_classes; ++i) {
+        uint64_t name_string_id = classes[i].name_string_id;
+        const char* name = hd_find_string(pc, name_string_id);
+        if (name == NULL) {
+            log_warn(proxy,
+                     "could not find name of class (id:%llu) in heap dump",
+                     (llu) name_string_id);
+            continue;
         }
+        hcl.signatures[hcl.nr_classes++] = java_class_name_to_signature(name);
     }
 
-    assert(i == hcl.nr_classes);
     return hcl;
 }
 
@@ -4037,11 +4867,11 @@ resume_vm(struct jdwp_proxy* proxy)
 }
 
 static void
-dispose_object_id(struct jdwp_proxy* proxy, uint64_t id)
+dispose_object_id(struct jdwp_batch* batch, uint64_t id)
 {
     SCOPED_RESLIST(rl);
     struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
+    jdwp_builder_start(&b, batch->proxy);
     b.header.command.group = JDWP_COMMANDSET_VIRTUALMACHINE;
     b.header.command.code = JDWP_COMMAND_VM_DISPOSEOBJECTS;
     jdwp_builder_i32(&b, 1); // number of dispose records
@@ -4050,7 +4880,7 @@ dispose_object_id(struct jdwp_proxy* proxy, uint64_t id)
     jdwp_builder_reference_type_id(&b, id); // id
     jdwp_builder_i32(&b, 1); // refcount
 
-    jdwp_transact_with_app(proxy, &b);
+    jdwp_batch_send_checked(batch, &b);
 }
 
 // Keep track of fake reference type IDs we've sent to the debugger.
@@ -4058,9 +4888,7 @@ dispose_object_id(struct jdwp_proxy* proxy, uint64_t id)
 
 struct jdwp_classloader;
 struct fake_reftype {
-    SPLAY_ENTRY(fake_reftype) link_by_fake_id;
     uint64_t fake_id;
-    SPLAY_ENTRY(fake_reftype) link_by_signature;
     struct jdwp_classloader* cl;
     const char* signature;
     uint8_t ref_type_tag;
@@ -4069,147 +4897,116 @@ struct fake_reftype {
     struct real_reftype* real; // weak; set to NULL when real disappears
 };
 
-static int
-fake_reftype_cmp_by_id(
-    struct fake_reftype* left,
-    struct fake_reftype* right)
+struct fake_reftype_key {
+    const struct jdwp_classloader* cl;
+    const char* signature;
+};
+
+static size_t
+hash_fake_reftype_key(const struct jdwp_classloader* cl,
+                      const char* signature)
 {
-    return cmp_u64(left->fake_id, right->fake_id);
+    // FNV-1a
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (const char* p = signature; *p; ++p)
+        h = (h ^ (uint8_t) *p) * UINT64_C(1099511628211);
+    return (size_t) h ^ hash_u64((uintptr_t) cl);
 }
 
-SPLAY_PROTOTYPE_STATIC(
-    fake_reftype_by_id,
-    fake_reftype,
-    link_by_fake_id,
-    fake_reftype_cmp_by_id);
-
-SPLAY_GENERATE_STATIC(
-    fake_reftype_by_id,
-    fake_reftype,
-    link_by_fake_id,
-    fake_reftype_cmp_by_id);
-
-static int
-fake_reftype_cmp_by_signature(
-    struct fake_reftype* left,
-    struct fake_reftype* right)
+static bool
+fake_reftype_matches_key_p(const void* value, const void* key_arg)
 {
-    return strcmp(left->signature, right->signature);
+    const struct fake_reftype* fr = value;
+    const struct fake_reftype_key* key = key_arg;
+    return fr->cl == key->cl && strcmp(fr->signature, key->signature) == 0;
 }
 
-SPLAY_PROTOTYPE_STATIC(
-    fake_reftype_by_signature,
-    fake_reftype,
-    link_by_signature,
-    fake_reftype_cmp_by_signature);
-
-SPLAY_GENERATE_STATIC(
-    fake_reftype_by_signature,
-    fake_reftype,
-    link_by_signature,
-    fake_reftype_cmp_by_signature);
-
-// Keep track of reference types we've received from the debuggee; we
-// flush these once we have too many.
+// Keep track of reference types we've received from the debuggee.
+// Each holds VM references we give back with DisposeObjects when we
+// evict the least recently used entries to make room for new ones.
 
 struct real_reftype {
-    SPLAY_ENTRY(real_reftype) link;
+    TAILQ_ENTRY(real_reftype) lru_link;
     uint64_t real_id;
     uint64_t refcount;
     struct fake_reftype* fake; // strong
     struct reslist* rl;
 };
 
-static int
-real_reftype_cmp(
-    struct real_reftype* left,
-    struct real_reftype* right)
+static bool
+real_reftype_matches_id_p(const void* value, const void* key)
 {
-    return cmp_u64(left->real_id, right->real_id);
+    const struct real_reftype* rr = value;
+    return rr->real_id == *(const uint64_t*) key;
 }
 
-SPLAY_PROTOTYPE_STATIC(
-    real_reftype_by_id,
-    real_reftype,
-    link,
-    real_reftype_cmp);
-
-SPLAY_GENERATE_STATIC(
-    real_reftype_by_id,
-    real_reftype,
-    link,
-    real_reftype_cmp);
-
 static struct real_reftype*
 find_real_reftype_by_real_id(
     struct jdwp_proxy* proxy,
     uint64_t real_id)
 {
-    struct real_reftype probe = {
-        .real_id = real_id,
-    };
-    return SPLAY_FIND(real_reftype_by_id, &proxy->real_reftype_cache, &probe);
+    return ptr_table_find(&proxy->real_reftype_cache,
+                          hash_u64(real_id),
+                          real_reftype_matches_id_p,
+                          &real_id);
+}
+
+static void
+touch_real_reftype(struct jdwp_proxy* proxy, struct real_reftype* rr)
+{
+    if (TAILQ_FIRST(&proxy->real_reftype_lru) != rr) {
+        TAILQ_REMOVE(&proxy->real_reftype_lru, rr, lru_link);
+        TAILQ_INSERT_HEAD(&proxy->real_reftype_lru, rr, lru_link);
+    }
 }
 
 static struct fake_reftype*
 find_fake_reftype_by_signature(
+    struct jdwp_proxy* proxy,
     struct jdwp_classloader* cl,
     const char* signature)
 {
-    struct fake_reftype probe = {
+    struct fake_reftype_key key = {
+        .cl = cl,
         .signature = signature,
     };
-    return SPLAY_FIND(fake_reftype_by_signature,
-                      &cl->fake_reftypes_by_signature,
-                      &probe);
+    return ptr_table_find(&proxy->fake_reftypes_by_signature,
+                          hash_fake_reftype_key(cl, signature),
+                          fake_reftype_matches_key_p,
+                          &key);
 }
 
-static char*
-fetch_signature_for_reftype(
-    struct jdwp_proxy* proxy,
+static struct jdwp_tx*
+send_reftype_query(
+    struct jdwp_batch* batch,
+    uint8_t code,
     uint64_t id)
 {
+    struct jdwp_proxy* proxy = batch->proxy;
     SCOPED_RESLIST(rl);
     struct jdwp_builder b;
     jdwp_builder_start(&b, proxy);
     b.header.command.group = JDWP_COMMANDSET_REFERENCETYPE;
-    b.header.command.code = JDWP_COMMAND_RT_SIGNATURE;
+    b.header.command.code = code;
     jdwp_builder_id(&b, id, proxy->tt->type.reference_type_id);
-    struct jdwp_packet* reply =
-        jdwp_transact_with_app(proxy, &b);
-    struct jdwp_cursor c = jdwp_cursor_create(
-        jdwp_find_reply_type(proxy->tt, &b.header),
-        reply->header.data,
-        reply->header.length - sizeof (reply->header));
+    return jdwp_batch_send(batch, &b);
+}
+
+static char*
+read_signature_reply(struct jdwp_tx* tx)
+{
+    struct jdwp_cursor c = jdwp_tx_reply_cursor(tx);
     jdwp_cursor_enter(&c);
-    char* signature;
-    {
-        WITH_CURRENT_RESLIST(rl->parent);
-        signature = jdwp_cursor_read_string(&c);
-    }
+    char* signature = jdwp_cursor_read_string(&c);
     jdwp_cursor_next(&c);
     jdwp_cursor_leave(&c);
-    dbg("reftype_id:%llu signature:{%s}", (llu) id, signature);
     return signature;
 }
 
 static uint64_t
-fetch_classloader_for_reftype(
-    struct jdwp_proxy* proxy,
-    uint64_t id)
+read_classloader_reply(struct jdwp_proxy* proxy, struct jdwp_tx* tx)
 {
-    SCOPED_RESLIST(rl);
-    struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
-    b.header.command.group = JDWP_COMMANDSET_REFERENCETYPE;
-    b.header.command.code = JDWP_COMMAND_RT_CLASSLOADER;
-    jdwp_builder_id(&b, id, proxy->tt->type.reference_type_id);
-    struct jdwp_packet* reply =
-        jdwp_transact_with_app(proxy, &b);
-    struct jdwp_cursor c = jdwp_cursor_create(
-        jdwp_find_reply_type(proxy->tt, &b.header),
-        reply->header.data,
-        reply->header.length - sizeof (reply->header));
+    struct jdwp_cursor c = jdwp_tx_reply_cursor(tx);
     jdwp_cursor_enter(&c);
     uint64_t classloader_id =
         jdwp_cursor_read_id(&c, proxy->tt->type.object_id);
@@ -4219,22 +5016,9 @@ fetch_classloader_for_reftype(
 }
 
 static bool
-fetch_is_interface_for_reftype(
-    struct jdwp_proxy* proxy,
-    uint64_t id)
+read_is_interface_reply(struct jdwp_tx* tx)
 {
-    SCOPED_RESLIST(rl);
-    struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
-    b.header.command.group = JDWP_COMMANDSET_REFERENCETYPE;
-    b.header.command.code = JDWP_COMMAND_RT_MODIFIERS;
-    jdwp_builder_id(&b, id, proxy->tt->type.reference_type_id);
-    struct jdwp_packet* reply =
-        jdwp_transact_with_app(proxy, &b);
-    struct jdwp_cursor c = jdwp_cursor_create(
-        jdwp_find_reply_type(proxy->tt, &b.header),
-        reply->header.data,
-        reply->header.length - sizeof (reply->header));
+    struct jdwp_cursor c = jdwp_tx_reply_cursor(tx);
     jdwp_cursor_enter(&c);
     int32_t modifiers = jdwp_cursor_read_i32(&c);
     jdwp_cursor_next(&c);
@@ -4242,6 +5026,63 @@ fetch_is_interface_for_reftype(
     return modifiers & ACC_INTERFACE;
 }
 
+static char*
+fetch_signature_for_reftype(
+    struct jdwp_proxy* proxy,
+    uint64_t id)
+{
+    SCOPED_RESLIST(rl);
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    struct jdwp_tx* tx =
+        send_reftype_query(&batch, JDWP_COMMAND_RT_SIGNATURE, id);
+    jdwp_batch_wait(&batch);
+    WITH_CURRENT_RESLIST(rl->parent);
+    char* signature = read_signature_reply(tx);
+    dbg("reftype_id:%llu signature:{%s}", (llu) id, signature);
+    return signature;
+}
+
+static uint64_t
+fetch_classloader_for_reftype(
+    struct jdwp_proxy* proxy,
+    uint64_t id)
+{
+    SCOPED_RESLIST(rl);
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    struct jdwp_tx* tx =
+        send_reftype_query(&batch, JDWP_COMMAND_RT_CLASSLOADER, id);
+    jdwp_batch_wait(&batch);
+    return read_classloader_reply(proxy, tx);
+}
+
+static bool
+fetch_is_interface_for_reftype(
+    struct jdwp_proxy* proxy,
+    uint64_t id)
+{
+    SCOPED_RESLIST(rl);
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    struct jdwp_tx* tx =
+        send_reftype_query(&batch, JDWP_COMMAND_RT_MODIFIERS, id);
+    jdwp_batch_wait(&batch);
+    return read_is_interface_reply(tx);
+}
+
+// What we already know about a real reftype we're about to add to our
+// cache, so that we don't have to ask the app.  The classloader ID
+// comes with a VM reference, so whoever uses it clears
+// have_classloader_id.
+struct reftype_facts {
+    uint64_t real_id;
+    const char* signature; // NULL if unknown
+    uint64_t classloader_id;
+    bool have_classloader_id;
+    uint8_t ref_type_tag; // Zero if unknown
+};
+
 static struct jdwp_classloader*
 find_or_create_classloader(
     struct jdwp_proxy* proxy,
@@ -4261,7 +5102,6 @@ find_or_create_classloader(
     WITH_CURRENT_RESLIST(proxy->rl);
     cl = xcalloc(sizeof (*cl));
     cl->id = id;
-    SPLAY_INIT(&cl->fake_reftypes_by_signature);
     SLIST_INSERT_HEAD(&proxy->classloaders, cl, link);
     proxy->nr_classloaders += 1;
     if (created_anew)
@@ -4270,84 +5110,63 @@ find_or_create_classloader(
 }
 
 static void
-disable_gc_for_object(struct jdwp_proxy* proxy, uint64_t id)
+disable_gc_for_object(struct jdwp_batch* batch, uint64_t id)
 {
     SCOPED_RESLIST(rl);
     struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
+    jdwp_builder_start(&b, batch->proxy);
     b.header.command.group = JDWP_COMMANDSET_OBJECTREFERENCE;
     b.header.command.code = JDWP_COMMAND_OR_DISABLECOLLECTION;
     jdwp_builder_reference_type_id(&b, id);
-    jdwp_transact_with_app(proxy, &b);
+    jdwp_batch_send_checked(batch, &b);
 }
 
+// Find the classloader for a reftype and settle the VM reference we
+// got along with its ID.  The commands we send for the latter go in
+// BATCH, for which the caller must wait.
 static struct jdwp_classloader*
-cl_for_reftype(struct jdwp_proxy* proxy, uint64_t real_reftype_id)
-{
+cl_for_reftype(struct jdwp_batch* batch,
+               uint64_t real_reftype_id,
+               struct reftype_facts* facts)
+{
+    struct jdwp_proxy* proxy = batch->proxy;
+    uint64_t classloader_id;
+    if (facts != NULL && facts->have_classloader_id) {
+        classloader_id = facts->classloader_id;
+        facts->have_classloader_id = false;
+    } else {
+        classloader_id =
+            fetch_classloader_for_reftype(proxy, real_reftype_id);
+    }
+
     bool cl_created_anew;
     struct jdwp_classloader* cl =
         find_or_create_classloader(
             proxy,
-            fetch_classloader_for_reftype(proxy, real_reftype_id),
+            classloader_id,
             &cl_created_anew);
     if (cl->id == 0) {
         // Do nothing: we're looking at the system classloader
     } else if (cl_created_anew) {
         // We hold onto classloaders forever, so the VM should too
-        disable_gc_for_object(proxy, cl->id);
+        disable_gc_for_object(batch, cl->id);
     } else {
         // We don't want to overflow the object reference count, so
         // release the refcount back to the VM if we already have a
         // permanent reference in the jdwp_classloader
-        dispose_object_id(proxy, cl->id);
+        dispose_object_id(batch, cl->id);
     }
 
     return cl;
 }
 
+// Evict the NR_TO_EVICT least recently used entries from the reftype
+// cache, giving their references back to the VM with as few
+// DisposeObjects commands, sent in BATCH, as fit.
 static void
-flush_reftype_cache_1(struct jdwp_proxy* proxy, uint32_t max_to_kill)
-{
-    SCOPED_RESLIST(rl);
-    struct real_reftype* rr;
-    struct real_reftype* rr_first;
-    struct real_reftype_by_id* cache = &proxy->real_reftype_cache;
-    struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
-    b.header.command.group = JDWP_COMMANDSET_VIRTUALMACHINE;
-    b.header.command.code = JDWP_COMMAND_VM_DISPOSEOBJECTS;
-    uint32_t to_kill = XMIN(max_to_kill, proxy->real_reftype_cache_size);
-    jdwp_builder_i32(&b, to_kill);
-
-    rr_first = SPLAY_MIN(real_reftype_by_id, cache);
-    rr = rr_first;
-    for (uint32_t i = 0;
-         i < to_kill;
-         ++i, rr = SPLAY_NEXT(real_reftype_by_id, cache, rr))
-    {
-        jdwp_builder_reference_type_id(&b, rr->real_id);
-        jdwp_builder_i32(&b, rr->refcount);
-    }
-
-    jdwp_transact_with_app(proxy, &b);
-
-    struct real_reftype* rr_next = rr_first;
-    for (uint32_t i = 0; i < to_kill; ++i) {
-        rr = rr_next;
-        rr_next = SPLAY_NEXT(real_reftype_by_id, cache, rr);
-        assert(rr);
-        SPLAY_REMOVE(real_reftype_by_id, &proxy->real_reftype_cache, rr);
-        assert(rr->fake);
-        rr->fake->real = NULL;
-        reslist_destroy(rr->rl);
-    }
-
-    proxy->real_reftype_cache_size -= to_kill;
-}
-
-static void
-flush_reftype_cache(struct jdwp_proxy* proxy)
+evict_real_reftypes(struct jdwp_batch* batch, uint32_t nr_to_evict)
 {
+    struct jdwp_proxy* proxy = batch->proxy;
     uint32_t overhead = sizeof (struct jdwp_header) + 4;
     uint32_t bytes_per_dispose =
         jdwp_scalar_width(proxy->tt->type.reference_type_id) + 4;
@@ -4359,32 +5178,65 @@ flush_reftype_cache(struct jdwp_proxy* proxy)
     uint32_t max_disposes_per_packet =
         (proxy->app_packet_size_limit - overhead) / bytes_per_dispose;
 
-    dbg("clearing reftype cache cursize:%u max:%u per-pkt:%u",
+    nr_to_evict = XMIN(nr_to_evict, proxy->real_reftype_cache_size);
+    dbg("evicting %u of %u cached reftypes (max:%u per-pkt:%u)",
+        nr_to_evict,
         proxy->real_reftype_cache_size,
         proxy->real_reftype_cache_max,
         max_disposes_per_packet);
 
-
-    while (proxy->real_reftype_cache_size)
-        flush_reftype_cache_1(proxy, max_disposes_per_packet);
-    assert(SPLAY_EMPTY(&proxy->real_reftype_cache));
+    while (nr_to_evict > 0) {
+        SCOPED_RESLIST(rl);
+        uint32_t to_kill = XMIN(nr_to_evict, max_disposes_per_packet);
+        struct jdwp_builder b;
+        jdwp_builder_start(&b, proxy);
+        b.header.command.group = JDWP_COMMANDSET_VIRTUALMACHINE;
+        b.header.command.code = JDWP_COMMAND_VM_DISPOSEOBJECTS;
+        jdwp_builder_i32(&b, to_kill);
+        for (uint32_t i = 0; i < to_kill; ++i) {
+            struct real_reftype* rr =
+                TAILQ_LAST(&proxy->real_reftype_lru, real_reftype_lru);
+            assert(rr);
+            jdwp_builder_reference_type_id(&b, rr->real_id);
+            jdwp_builder_i32(&b, rr->refcount);
+            TAILQ_REMOVE(&proxy->real_reftype_lru, rr, lru_link);
+            ptr_table_remove(&proxy->real_reftype_cache,
+                             hash_u64(rr->real_id),
+                             rr);
+            assert(rr->fake);
+            rr->fake->real = NULL;
+            reslist_destroy(rr->rl);
+        }
+        jdwp_batch_send_checked(batch, &b);
+        proxy->real_reftype_cache_size -= to_kill;
+        proxy->stats.reftype_evictions += to_kill;
+        nr_to_evict -= to_kill;
+    }
 }
 
+// Translate REAL_ID to a fake reftype, using FACTS, if not NULL, to
+// avoid asking the app about REAL_ID.  Commands whose replies we
+// don't need go in BATCH, for which the caller must wait.
 static struct fake_reftype*
 translate_and_cache_real_reftype(
-    struct jdwp_proxy* proxy,
+    struct jdwp_batch* batch,
     uint64_t real_id,
-    const char* optional_signature,
-    const uint8_t* optional_ref_type_tag)
+    struct reftype_facts* facts)
 {
     SCOPED_RESLIST(rl);
+    struct jdwp_proxy* proxy = batch->proxy;
 
     struct real_reftype* rr = find_real_reftype_by_real_id(proxy, real_id);
     bool new_real_reftype = false;
     if (rr == NULL) {
+        proxy->stats.reftype_misses += 1;
         assert(proxy->real_reftype_cache_max > 0);
         if (proxy->real_reftype_cache_size >= proxy->real_reftype_cache_max)
-            flush_reftype_cache(proxy);
+            evict_real_reftypes(
+                batch,
+                XMAX(proxy->real_reftype_cache_max /
+                     REFERENCE_CACHE_EVICTION_DIVISOR,
+                     1));
 
         new_real_reftype = true;
         WITH_CURRENT_RESLIST(proxy->rl);
@@ -4393,25 +5245,29 @@ translate_and_cache_real_reftype(
         rr = xcalloc(sizeof (*rr));
         rr->real_id = real_id;
         rr->rl = rr_rl;
-        SPLAY_INSERT(real_reftype_by_id, &proxy->real_reftype_cache,  rr);
+        ptr_table_insert(&proxy->real_reftype_cache, hash_u64(real_id), rr);
+        TAILQ_INSERT_HEAD(&proxy->real_reftype_lru, rr, lru_link);
         proxy->real_reftype_cache_size += 1;
+    } else {
+        proxy->stats.reftype_hits += 1;
+        touch_real_reftype(proxy, rr);
     }
     assert(rr->refcount < UINT64_MAX);
     rr->refcount += 1;
 
     if (new_real_reftype) {
         assert(rr->fake == NULL);
-        struct jdwp_classloader* cl = cl_for_reftype(proxy, real_id);
-        const char* signature = optional_signature;
+        struct jdwp_classloader* cl = cl_for_reftype(batch, real_id, facts);
+        const char* signature = facts ? facts->signature : NULL;
         if (signature == NULL)
             signature = fetch_signature_for_reftype(proxy, real_id);
-        rr->fake = find_fake_reftype_by_signature(cl, signature);
+        rr->fake = find_fake_reftype_by_signature(proxy, cl, signature);
         if (rr->fake != NULL) {
             assert(rr->fake->real == NULL);
         } else {
             uint8_t ref_type_tag;
-            if (optional_ref_type_tag != NULL)
-                ref_type_tag = *optional_ref_type_tag;
+            if (facts != NULL && facts->ref_type_tag != 0)
+                ref_type_tag = facts->ref_type_tag;
             else if (signature[0] == '[')
                 ref_type_tag = REFKIND_ARRAY;
             else
@@ -4424,32 +5280,128 @@ translate_and_cache_real_reftype(
             fr->cl = cl;
             fr->signature = xstrdup(signature);
             fr->ref_type_tag = ref_type_tag;
-            SPLAY_INSERT(
-                fake_reftype_by_signature,
-                &cl->fake_reftypes_by_signature,
-                fr);
-            SPLAY_INSERT(
-                fake_reftype_by_id,
-                &proxy->fake_reftypes_by_id,
-                fr);
-            proxy->nr_fake_ids += 1;
+            ptr_table_insert(&proxy->fake_reftypes_by_signature,
+                             hash_fake_reftype_key(cl, fr->signature),
+                             fr);
+            size_t needed = (proxy->nr_fake_ids + 1) * sizeof (fr);
+            while (proxy->fake_reftypes_by_id.bufsz < needed)
+                grow_buffer_dwim(&proxy->fake_reftypes_by_id);
+            ((struct fake_reftype**) proxy->fake_reftypes_by_id.buf)
+                [proxy->nr_fake_ids++] = fr;
             rr->fake = fr;
         }
         rr->fake->real = rr;
     }
 
-    return rr->fake;
-}
-
-static struct fake_reftype*
-find_fake_reftype_by_id(
-    struct jdwp_proxy* proxy,
-    uint64_t id)
-{
-    struct fake_reftype probe = {
-        .fake_id = id,
-    };
-    return SPLAY_FIND(fake_reftype_by_id, &proxy->fake_reftypes_by_id, &probe);
+    return rr->fake;
+}
+
+static struct fake_reftype*
+find_fake_reftype_by_id(
+    struct jdwp_proxy* proxy,
+    uint64_t id)
+{
+    uint64_t first_fake_id =
+        proxy->next_fake_reftype_id - proxy->nr_fake_ids + 1;
+    if (id < first_fake_id || id > proxy->next_fake_reftype_id)
+        return NULL;
+    return ((struct fake_reftype**) proxy->fake_reftypes_by_id.buf)
+        [id - first_fake_id];
+}
+
+struct refreshed_class {
+    struct reftype_facts facts;
+    int32_t status;
+};
+
+// Learn about the classes with each of the NR_SIGNATURES signatures
+// in SIGNATURES.  We look up all the signatures at once, then the
+// classloaders of all the classes we haven't seen, so the cost is a
+// few round trips for the whole lot instead of a few per class.
+static void
+refresh_classes_with_signatures(
+    struct jdwp_proxy* proxy,
+    const char* const* signatures,
+    size_t nr_signatures)
+{
+    SCOPED_RESLIST(rl);
+    struct jdwp_type* reference_type_id = proxy->tt->type.reference_type_id;
+
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    struct jdwp_tx** txs = xalloc(nr_signatures * sizeof (*txs));
+    for (size_t i = 0; i < nr_signatures; ++i) {
+        SCOPED_RESLIST(rl_build);
+        struct jdwp_builder b;
+        jdwp_builder_start(&b, proxy);
+        b.header.command.group = JDWP_COMMANDSET_VIRTUALMACHINE;
+        b.header.command.code = JDWP_COMMAND_VM_CLASSESBYSIGNATURE;
+        jdwp_builder_string(&b, signatures[i]);
+        txs[i] = jdwp_batch_send(&batch, &b);
+    }
+    jdwp_batch_wait(&batch);
+
+    struct growable_buffer classes_gb = { 0 };
+    size_t nr_classes = 0;
+    for (size_t i = 0; i < nr_signatures; ++i) {
+        struct jdwp_cursor c = jdwp_tx_reply_cursor(txs[i]);
+        jdwp_cursor_enter(&c);
+        uint32_t nr_found = jdwp_cursor_array_length(&c);
+        jdwp_cursor_enter(&c);
+        for (uint32_t j = 0; j < nr_found; ++j) {
+            while (classes_gb.bufsz <
+                   (nr_classes + 1) * sizeof (struct refreshed_class))
+                grow_buffer_dwim(&classes_gb);
+            struct refreshed_class* rc =
+                &((struct refreshed_class*) classes_gb.buf)[nr_classes++];
+            memset(rc, 0, sizeof (*rc));
+            rc->facts.signature = signatures[i];
+            jdwp_cursor_enter(&c);
+            uint8_t ref_type_tag = jdwp_cursor_read_u8(&c);
+            if (ref_type_tag != REFKIND_CLASS &&
+                ref_type_tag != REFKIND_INTERFACE &&
+                ref_type_tag != REFKIND_ARRAY)
+                die(EINVAL, "invalid ref type id from debugee: %hhu",
+                    ref_type_tag);
+            rc->facts.ref_type_tag = ref_type_tag;
+            jdwp_cursor_next(&c);
+            rc->facts.real_id = jdwp_cursor_read_id(&c, reference_type_id);
+            jdwp_cursor_next(&c);
+            rc->status = jdwp_cursor_read_i32(&c);
+            jdwp_cursor_next(&c);
+            jdwp_cursor_leave(&c);
+            jdwp_cursor_next(&c);
+        }
+        jdwp_cursor_leave(&c);
+        jdwp_cursor_leave(&c);
+    }
+
+    struct refreshed_class* classes = (struct refreshed_class*) classes_gb.buf;
+    txs = xalloc(nr_classes * sizeof (*txs));
+    for (size_t i = 0; i < nr_classes; ++i)
+        txs[i] = find_real_reftype_by_real_id(proxy, classes[i].facts.real_id)
+            ? NULL
+            : send_reftype_query(&batch,
+                                 JDWP_COMMAND_RT_CLASSLOADER,
+                                 classes[i].facts.real_id);
+    jdwp_batch_wait(&batch);
+    for (size_t i = 0; i < nr_classes; ++i) {
+        if (txs[i] != NULL) {
+            classes[i].facts.classloader_id =
+                read_classloader_reply(proxy, txs[i]);
+            classes[i].facts.have_classloader_id = true;
+        }
+    }
+
+    for (size_t i = 0; i < nr_classes; ++i) {
+        struct fake_reftype* fr =
+            translate_and_cache_real_reftype(
+                &batch,
+                classes[i].facts.real_id,
+                &classes[i].facts);
+        fr->status = classes[i].status;
+    }
+    jdwp_batch_wait(&batch);
 }
 
 static void
@@ -4457,48 +5409,7 @@ refresh_classes_with_signature(
     struct jdwp_proxy* proxy,
     const char* signature)
 {
-    SCOPED_RESLIST(rl);
-    struct jdwp_builder b;
-    jdwp_builder_start(&b, proxy);
-    b.header.command.group = JDWP_COMMANDSET_VIRTUALMACHINE;
-    b.header.command.code = JDWP_COMMAND_VM_CLASSESBYSIGNATURE;
-    jdwp_builder_string(&b, signature);
-    struct jdwp_packet* reply = jdwp_transact_with_app(proxy, &b);
-    struct jdwp_type* reply_type =
-        jdwp_find_reply_type(proxy->tt, &b.header);
-    struct jdwp_cursor c =
-        jdwp_cursor_create(
-            reply_type,
-            reply->header.data,
-            reply->header.length - sizeof (reply->header));
-    jdwp_cursor_enter(&c);
-    uint32_t nr_classes = jdwp_cursor_array_length(&c);
-    jdwp_cursor_enter(&c);
-    struct jdwp_type* reference_type_id = proxy->tt->type.reference_type_id;
-    for (uint32_t i = 0; i < nr_classes; ++i) {
-        jdwp_cursor_enter(&c);
-        uint8_t ref_type_tag = jdwp_cursor_read_u8(&c);
-        if (ref_type_tag != REFKIND_CLASS &&
-            ref_type_tag != REFKIND_INTERFACE &&
-            ref_type_tag != REFKIND_ARRAY)
-            die(EINVAL, "invalid ref type id from debugee: %hhu", ref_type_tag);
-        jdwp_cursor_next(&c);
-        uint64_t real_refid = jdwp_cursor_read_id(&c, reference_type_id);
-        jdwp_cursor_next(&c);
-        int32_t status = jdwp_cursor_read_i32(&c);
-        jdwp_cursor_next(&c);
-        jdwp_cursor_leave(&c);
-        struct fake_reftype* fr =
-            translate_and_cache_real_reftype(
-                proxy,
-                real_refid,
-                signature,
-                &ref_type_tag);
-        fr->status = status;
-        jdwp_cursor_next(&c);
-    }
-    jdwp_cursor_leave(&c);
-    jdwp_cursor_leave(&c);
+    refresh_classes_with_signatures(proxy, &signature, 1);
 }
 
 static uint64_t
@@ -4514,6 +5425,12 @@ translate_fake_reftype_to_real_reftype(
         dbg("could not find fake reftype by fake_id:%llu", (llu) fake_id);
         die_jdwp(JDWP_ERR_INVALID_OBJECT);
     }
+    if (fr->real != NULL) {
+        proxy->stats.reftype_hits += 1;
+        touch_real_reftype(proxy, fr->real);
+    } else {
+        proxy->stats.reftype_misses += 1;
+    }
     if (fr->real == NULL && !fr->was_unloaded)
         refresh_classes_with_signature(proxy, fr->signature);
     if (fr->real == NULL) {
@@ -4535,9 +5452,11 @@ jdwp_send_all_classes_reply(
     enum all_classes_reply_mode mode,
     uint64_t class_loader_filter)
 {
-    struct fake_reftype* fr;
+    struct fake_reftype** fake_reftypes =
+        (struct fake_reftype**) proxy->fake_reftypes_by_id.buf;
     uint32_t nr_live_classes = 0;
-    SPLAY_FOREACH(fr, fake_reftype_by_id, &proxy->fake_reftypes_by_id) {
+    for (uint32_t i = 0; i < proxy->nr_fake_ids; ++i) {
+        struct fake_reftype* fr = fake_reftypes[i];
         if (mode == ALL_CLASSES_REPLY_CLR &&
             fr->cl->id != class_loader_filter)
         {
@@ -4552,7 +5471,8 @@ jdwp_send_all_classes_reply(
     b.header.id = id;
     b.header.flags = JDWP_FLAG_REPLY;
     jdwp_builder_u32(&b, nr_live_classes);
-    SPLAY_FOREACH(fr, fake_reftype_by_id, &proxy->fake_reftypes_by_id) {
+    for (uint32_t i = 0; i < proxy->nr_fake_ids; ++i) {
+        struct fake_reftype* fr = fake_reftypes[i];
         if (mode == ALL_CLASSES_REPLY_CLR &&
             fr->cl->id != class_loader_filter)
         {
@@ -4572,16 +5492,63 @@ jdwp_send_all_classes_reply(
     jdwp_builder_send(&b, proxy->to_debugger_fd);
 }
 
+static int
+reftype_facts_cmp(const void* a, const void* b)
+{
+    const struct reftype_facts* fa = a;
+    const struct reftype_facts* fb = b;
+    return cmp_u64(fa->real_id, fb->real_id);
+}
+
+static uint64_t
+load_reftype_id(const uint8_t* pos, unsigned width)
+{
+    uint8_t bytes[8];
+    uint64_t id = 0;
+    memcpy(bytes, pos, width);
+    swap_bytes(bytes, width);
+    memcpy(&id, bytes, width);
+    return id;
+}
+
 static void
-translate_payload_2(
+store_reftype_id(uint8_t* pos, uint64_t id, unsigned width)
+{
+    uint8_t bytes[8];
+    memcpy(bytes, &id, width);
+    swap_bytes(bytes, width);
+    memcpy(pos, bytes, width);
+}
+
+// Find the reference type IDs in a payload of type TOP_TYPE.  Return
+// the number of IDs and set *POSITIONS_OUT to where each one begins.
+static size_t
+find_reftype_ids(
     struct jdwp_proxy* proxy,
-    enum translate_mode mode,
     struct jdwp_type* top_type,
-    void* data,
-    size_t data_size)
-{
-    SCOPED_RESLIST(rl);
+    uint8_t* data,
+    size_t data_size,
+    uint8_t*** positions_out)
+{
+    *positions_out = NULL;
+    assert(top_type->layout_done);
+    if (!top_type->may_contain_reftype_ids)
+        return 0;
+
+    if (top_type->fixed_size >= 0) {
+        if (data_size < top_type->fixed_size)
+            die(EINVAL, "truncated packet");
+        size_t nr_ids = top_type->nr_reftype_offsets;
+        uint8_t** positions = xalloc(nr_ids * sizeof (*positions));
+        for (size_t i = 0; i < nr_ids; ++i)
+            positions[i] = data + top_type->reftype_offsets[i];
+        *positions_out = positions;
+        return nr_ids;
+    }
+
     struct jdwp_type* reference_type_id = proxy->tt->type.reference_type_id;
+    struct growable_buffer positions_gb = { 0 };
+    size_t nr_ids = 0;
     struct jdwp_cursor c = jdwp_cursor_create(top_type, data, data_size);
     while (jdwp_cursor_has_value(&c)) {
         struct jdwp_type* type = jdwp_cursor_current_type(&c);
@@ -4591,30 +5558,11 @@ translate_payload_2(
         }
 
         if (jdwp_type_isinstance(type, reference_type_id)) {
-            uint64_t id = jdwp_cursor_read_id(&c, reference_type_id);
-            if (id != 0) {
-                const char* direction;
-                uint64_t orig_id = id;
-                if (mode == TRANSLATE_TO_DEBUGGER) {
-                    direction = "debugger";
-                    id = translate_and_cache_real_reftype(
-                        proxy, id, NULL, NULL)->fake_id;
-                } else if (mode == TRANSLATE_TO_APP) {
-                    direction = "app";
-                    id = translate_fake_reftype_to_real_reftype(proxy, id);
-                } else {
-                    assert(!"invalid mode");
-                }
-
-                (void) orig_id;
-                (void) direction;
-                dbg("rewrote reference_type_id %llu to %llu for "
-                    "consumption by %s",
-                    (llu) orig_id,
-                    (llu) id,
-                    direction);
-            }
-            jdwp_cursor_write_id(&c, id, reference_type_id);
+            // Make sure the whole ID is there before we touch it.
+            (void) jdwp_cursor_read_id(&c, reference_type_id);
+            while (positions_gb.bufsz < (nr_ids + 1) * sizeof (uint8_t*))
+                grow_buffer_dwim(&positions_gb);
+            ((uint8_t**) positions_gb.buf)[nr_ids++] = c.pos;
         }
 
         jdwp_cursor_next(&c);
@@ -4622,6 +5570,148 @@ translate_payload_2(
             jdwp_cursor_leave(&c);
         }
     }
+
+    *positions_out = (uint8_t**) positions_gb.buf;
+    return nr_ids;
+}
+
+// Ask the app about all the reference type IDs at POSITIONS that we
+// haven't seen before at once, so that translating the payload costs
+// one round trip instead of three per new ID.  Queries that fail
+// leave their facts unknown; translation asks again and reports the
+// error.
+static struct reftype_facts*
+prefetch_reftype_facts(
+    struct jdwp_proxy* proxy,
+    uint8_t** positions,
+    size_t nr_ids,
+    size_t* nr_facts_out)
+{
+    unsigned width = jdwp_scalar_width(proxy->tt->type.reference_type_id);
+    struct growable_buffer facts_gb = { 0 };
+    size_t nr_facts = 0;
+    for (size_t i = 0; i < nr_ids; ++i) {
+        uint64_t id = load_reftype_id(positions[i], width);
+        if (id != 0 && find_real_reftype_by_real_id(proxy, id) == NULL) {
+            while (facts_gb.bufsz <
+                   (nr_facts + 1) * sizeof (struct reftype_facts))
+                grow_buffer_dwim(&facts_gb);
+            struct reftype_facts* facts =
+                &((struct reftype_facts*) facts_gb.buf)[nr_facts++];
+            memset(facts, 0, sizeof (*facts));
+            facts->real_id = id;
+        }
+    }
+
+    struct reftype_facts* facts = (struct reftype_facts*) facts_gb.buf;
+    if (nr_facts > 1) {
+        qsort(facts, nr_facts, sizeof (facts[0]), reftype_facts_cmp);
+        size_t nr_unique = 1;
+        for (size_t i = 1; i < nr_facts; ++i)
+            if (facts[i].real_id != facts[nr_unique - 1].real_id)
+                facts[nr_unique++] = facts[i];
+        nr_facts = nr_unique;
+    }
+
+    if (nr_facts > 0) {
+        SCOPED_RESLIST(rl_query);
+        struct jdwp_batch batch;
+        jdwp_batch_init(&batch, proxy);
+        struct jdwp_tx** txs = xalloc(nr_facts * 3 * sizeof (*txs));
+        for (size_t i = 0; i < nr_facts; ++i) {
+            uint64_t id = facts[i].real_id;
+            txs[3*i+0] = send_reftype_query(
+                &batch, JDWP_COMMAND_RT_CLASSLOADER, id);
+            txs[3*i+1] = send_reftype_query(
+                &batch, JDWP_COMMAND_RT_SIGNATURE, id);
+            txs[3*i+2] = send_reftype_query(
+                &batch, JDWP_COMMAND_RT_MODIFIERS, id);
+        }
+        jdwp_batch_wait(&batch);
+
+        for (size_t i = 0; i < nr_facts; ++i) {
+            struct jdwp_tx* cl_tx = txs[3*i+0];
+            struct jdwp_tx* sig_tx = txs[3*i+1];
+            struct jdwp_tx* mod_tx = txs[3*i+2];
+            if (cl_tx->reply->header.reply.error_code == 0) {
+                facts[i].classloader_id =
+                    read_classloader_reply(proxy, cl_tx);
+                facts[i].have_classloader_id = true;
+            }
+            if (sig_tx->reply->header.reply.error_code == 0) {
+                WITH_CURRENT_RESLIST(rl_query->parent);
+                facts[i].signature = read_signature_reply(sig_tx);
+            }
+            if (facts[i].signature != NULL && facts[i].signature[0] == '[')
+                facts[i].ref_type_tag = REFKIND_ARRAY;
+            else if (mod_tx->reply->header.reply.error_code == 0)
+                facts[i].ref_type_tag = read_is_interface_reply(mod_tx)
+                    ? REFKIND_INTERFACE
+                    : REFKIND_CLASS;
+        }
+    }
+
+    *nr_facts_out = nr_facts;
+    return facts;
+}
+
+static void
+translate_payload_2(
+    struct jdwp_proxy* proxy,
+    enum translate_mode mode,
+    struct jdwp_type* top_type,
+    void* data,
+    size_t data_size)
+{
+    SCOPED_RESLIST(rl);
+    uint8_t** positions;
+    size_t nr_ids = find_reftype_ids(
+        proxy, top_type, data, data_size, &positions);
+    if (nr_ids == 0)
+        return;
+
+    unsigned width = jdwp_scalar_width(proxy->tt->type.reference_type_id);
+    struct reftype_facts* facts = NULL;
+    size_t nr_facts = 0;
+    if (mode == TRANSLATE_TO_DEBUGGER)
+        facts = prefetch_reftype_facts(proxy, positions, nr_ids, &nr_facts);
+
+    struct jdwp_batch batch;
+    jdwp_batch_init(&batch, proxy);
+    for (size_t i = 0; i < nr_ids; ++i) {
+        uint64_t id = load_reftype_id(positions[i], width);
+        if (id == 0)
+            continue;
+
+        const char* direction;
+        uint64_t orig_id = id;
+        if (mode == TRANSLATE_TO_DEBUGGER) {
+            direction = "debugger";
+            struct reftype_facts probe = { .real_id = id };
+            id = translate_and_cache_real_reftype(
+                &batch,
+                id,
+                bsearch(&probe, facts, nr_facts,
+                        sizeof (facts[0]), reftype_facts_cmp))
+                ->fake_id;
+        } else if (mode == TRANSLATE_TO_APP) {
+            direction = "app";
+            id = translate_fake_reftype_to_real_reftype(proxy, id);
+        } else {
+            assert(!"invalid mode");
+        }
+
+        (void) orig_id;
+        (void) direction;
+        dbg("rewrote reference_type_id %llu to %llu for "
+            "consumption by %s",
+            (llu) orig_id,
+            (llu) id,
+            direction);
+        store_reftype_id(positions[i], id, width);
+    }
+
+    jdwp_batch_wait(&batch);
 }
 
 struct translate_args {
@@ -4746,6 +5836,337 @@ pidof(const struct cmd_jdwp_info* info, const char* what)
     return xstrdup(resp);
 }
 
+// We remember the class list of each build of each app we've
+// debugged, along with the VM's ID sizes, so that attaching to the
+// same build again doesn't need a heap dump.  The cache key covers
+// the device, the package, the SHA-256 of each of its APKs, and the
+// VM's version, so a reinstall or an OS update misses the cache.
+
+#define CLASS_CACHE_HEADER "fb-adb-jdwp-classes-1"
+
+// Compute the class cache key for the app with process ID PID, or
+// die if we can't.
+static char*
+class_cache_key_1(const struct cmd_jdwp_info* info,
+                  unsigned long pid,
+                  const struct vm_info* vi)
+{
+    SCOPED_RESLIST(rl);
+    struct strlist* adb_args_list = strlist_new();
+    emit_args_adb_opts(adb_args_list, &info->adb);
+    const char* const* adb_args = strlist_to_argv(adb_args_list);
+
+    // We get one line: the package followed by pm's "package:PATH"
+    // word for each APK.
+    char* output = adb_shell_output(
+        xaprintf("n=$(cat /proc/%lu/cmdline); n=${n%%%%:*}; "
+                 "echo \"$n\" $(pm path \"$n\")",
+                 pid),
+        adb_args);
+    char* saveptr = NULL;
+    const char* package = strtok_r(output, " ", &saveptr);
+    if (package == NULL || package[0] == '\0')
+        die(EINVAL, "cannot determine package of process %lu", pid);
+
+    struct strlist* finfo_args = strlist_from_argv(
+        ARGV("finfo-json", "-i", "sha256"));
+    bool have_apk = false;
+    char* word;
+    while ((word = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        if (string_starts_with_p(word, "package:")) {
+            strlist_append(finfo_args, word + strlen("package:"));
+            have_apk = true;
+        }
+    }
+    if (!have_apk)
+        die(EINVAL, "cannot find APK of package %s", package);
+
+    struct start_peer_info spi = {
+        .adb = info->adb,
+        .transport = info->transport,
+        .specified_io = true,
+        .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+    };
+    struct child* peer = start_peer(&spi, finfo_args);
+    char* apk_info = slurp_fd(peer->fd[STDOUT_FILENO]->fd, NULL);
+    child_wait_die_on_error(peer);
+
+    char* key = xaprintf("%s\n%s\n%s\n%s\n%s\n%s",
+                         device_cache_key(adb_args),
+                         package,
+                         apk_info,
+                         vi->description,
+                         vi->version,
+                         vi->name);
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    SHA256_Data((const uint8_t*) key, strlen(key), digest);
+    dbg("class cache key for package %s is %s", package, digest);
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xstrdup(digest);
+}
+
+struct class_cache_key_ctx {
+    const struct cmd_jdwp_info* info;
+    unsigned long pid;
+    const struct vm_info* vi;
+    char* key;
+};
+
+static void
+class_cache_key_2(void* data)
+{
+    struct class_cache_key_ctx* ctx = data;
+    ctx->key = class_cache_key_1(ctx->info, ctx->pid, ctx->vi);
+}
+
+// Return the class cache key for the app with process ID PID, or NULL
+// if we can't identify the app's build, in which case we don't cache.
+static char*
+class_cache_key(const struct cmd_jdwp_info* info,
+                unsigned long pid,
+                const struct vm_info* vi)
+{
+    struct class_cache_key_ctx ctx = {
+        .info = info,
+        .pid = pid,
+        .vi = vi,
+    };
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(class_cache_key_2, &ctx, &ei)) {
+        dbg("not caching class list: %s", ei.msg);
+        return NULL;
+    }
+    return ctx.key;
+}
+
+static char*
+class_cache_file_name(const char* key)
+{
+    return xaprintf("%s/jdwp-classes-%.16s", my_fb_adb_directory(), key);
+}
+
+struct class_cache_load_ctx {
+    const char* key;
+    struct jdwp_id_sizes* sizes;
+    struct hd_class_list* hcl;
+    struct reslist* rl; // For the class list
+    bool found;
+};
+
+static void
+class_cache_load_1(void* data)
+{
+    struct class_cache_load_ctx* ctx = data;
+    int fd = try_xopen(class_cache_file_name(ctx->key), O_RDONLY, 0);
+    if (fd == -1)
+        return;
+
+    char* contents = slurp_fd(fd, NULL);
+    char* saveptr = NULL;
+    char* line = strtok_r(contents, "\n", &saveptr);
+    if (line == NULL || strcmp(line, CLASS_CACHE_HEADER) != 0)
+        die(EINVAL, "bad class cache file header");
+
+    bool same_key = false;
+    bool have_sizes = false;
+    size_t nr_classes = 0;
+    struct growable_buffer signatures_gb = { 0 };
+    while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+        char* value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        if (!strcmp(line, "key")) {
+            same_key = !strcmp(value, ctx->key);
+        } else if (!strcmp(line, "id_sizes")) {
+            struct jdwp_id_sizes* sizes = ctx->sizes;
+            have_sizes = sscanf(value, "%d,%d,%d,%d,%d",
+                                &sizes->field_id,
+                                &sizes->method_id,
+                                &sizes->object_id,
+                                &sizes->reference_type_id,
+                                &sizes->frame_id) == 5;
+        } else if (!strcmp(line, "class")) {
+            size_t needed = (nr_classes + 1) * sizeof (char*);
+            while (signatures_gb.bufsz < needed)
+                grow_buffer_dwim(&signatures_gb);
+            ((char**) signatures_gb.buf)[nr_classes++] = value;
+        }
+    }
+
+    if (!same_key || !have_sizes)
+        return;
+
+    WITH_CURRENT_RESLIST(ctx->rl);
+    ctx->hcl->nr_classes = nr_classes;
+    ctx->hcl->signatures = xalloc(nr_classes * sizeof (char*));
+    for (size_t i = 0; i < nr_classes; ++i)
+        ctx->hcl->signatures[i] = xstrdup(((char**) signatures_gb.buf)[i]);
+    ctx->found = true;
+}
+
+// Read the class list and ID sizes cached under KEY.  Return false if
+// we have nothing cached.
+static bool
+class_cache_load(const char* key,
+                 struct jdwp_id_sizes* sizes,
+                 struct hd_class_list* hcl)
+{
+    SCOPED_RESLIST(rl);
+    struct class_cache_load_ctx ctx = {
+        .key = key,
+        .sizes = sizes,
+        .hcl = hcl,
+        .rl = rl->parent,
+    };
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(class_cache_load_1, &ctx, &ei)) {
+        dbg("ignoring class cache: %s", ei.msg);
+        return false;
+    }
+    return ctx.found;
+}
+
+struct class_cache_store_ctx {
+    const char* key;
+    const struct jdwp_id_sizes* sizes;
+    const struct hd_class_list* hcl;
+};
+
+static void
+class_cache_store_1(void* data)
+{
+    struct class_cache_store_ctx* ctx = data;
+    const struct jdwp_id_sizes* sizes = ctx->sizes;
+    const char* filename = class_cache_file_name(ctx->key);
+    const char* tmpname = xaprintf("%s.%s",
+                                   filename,
+                                   gen_hex_random(ENOUGH_ENTROPY));
+    struct cleanup* cl = cleanup_allocate();
+    int fd = xopen(tmpname, O_CREAT | O_EXCL | O_WRONLY, 0600);
+    cleanup_commit(cl, unlink_cleanup, tmpname);
+
+    char* head = xaprintf(
+        CLASS_CACHE_HEADER "\n"
+        "key=%s\n"
+        "id_sizes=%d,%d,%d,%d,%d\n",
+        ctx->key,
+        (int) sizes->field_id,
+        (int) sizes->method_id,
+        (int) sizes->object_id,
+        (int) sizes->reference_type_id,
+        (int) sizes->frame_id);
+    size_t size = strlen(head);
+    for (size_t i = 0; i < ctx->hcl->nr_classes; ++i)
+        size += strlen("class=") + strlen(ctx->hcl->signatures[i]) + 1;
+
+    char* contents = xalloc(size);
+    char* pos = stpcpy(contents, head);
+    for (size_t i = 0; i < ctx->hcl->nr_classes; ++i) {
+        pos = stpcpy(pos, "class=");
+        pos = stpcpy(pos, ctx->hcl->signatures[i]);
+        *pos++ = '\n';
+    }
+    assert(pos == contents + size);
+    write_all(fd, contents, size);
+    xrename(tmpname, filename);
+    cleanup_forget(cl);
+}
+
+// Remember HCL and SIZES under KEY.  Failure isn't fatal: we just
+// don't remember.
+static void
+class_cache_store(const char* key,
+                  const struct jdwp_id_sizes* sizes,
+                  const struct hd_class_list* hcl)
+{
+    SCOPED_RESLIST(rl);
+    struct class_cache_store_ctx ctx = {
+        .key = key,
+        .sizes = sizes,
+        .hcl = hcl,
+    };
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(class_cache_store_1, &ctx, &ei))
+        dbg("could not save class cache: %s", ei.msg);
+}
+
+static bool saw_sigusr1 = false;
+static void
+handle_sigusr1(int signo)
+{
+    saw_sigusr1 = true;
+}
+
+struct jdwp_loop_ctx {
+    struct jdwp_proxy* proxy;
+    const char* stats_dest;
+};
+
+// Shuttle packets between the debugger and the app until one of them
+// goes away.  Write statistics on SIGUSR1.
+static void
+jdwp_proxy_loop(void* data)
+{
+    struct jdwp_loop_ctx* ctx = data;
+    struct jdwp_proxy* proxy = ctx->proxy;
+    struct pollfd fds[] = {
+        { proxy->to_app_fd, POLLIN },
+        { proxy->to_debugger_fd, POLLIN },
+    };
+
+    // As with SIGWINCH in shex, take SIGUSR1 only while we wait in
+    // ppoll, so that it can't interrupt us in the middle of a packet.
+    sigset_t blocked_signals;
+    sigemptyset(&blocked_signals);
+    sigaddset(&blocked_signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked_signals, NULL);
+    signal(SIGUSR1, handle_sigusr1);
+
+    sigset_t poll_sigmask;
+    VERIFY(sigprocmask(SIG_BLOCK, NULL, &poll_sigmask) == 0);
+    sigdelset(&poll_sigmask, SIGUSR1);
+    for (int i = 1; i < NSIG; ++i)
+        if (sigismember(&signals_unblock_for_io, i))
+            sigdelset(&poll_sigmask, i);
+
+    struct jdwp_packet* packet;
+
+    for (;;) {
+        SCOPED_RESLIST(rl_loop);
+        packet = jdwp_pop_deferred_packet_from_app(proxy);
+        if (packet != NULL) {
+            handle_packet_toplevel(
+                proxy,
+                packet,
+                proxy->to_app_fd,
+                proxy->to_debugger_fd);
+            continue;
+        }
+
+        for (unsigned i = 0; i < ARRAYSIZE(fds); ++i)
+            fds[i].revents = 0;
+        if (xppoll(fds, ARRAYSIZE(fds), NULL, &poll_sigmask) == -1 &&
+            errno != EINTR)
+        {
+            die_errno("poll");
+        }
+        if (saw_sigusr1) {
+            saw_sigusr1 = false;
+            jdwp_write_stats(proxy, ctx->stats_dest);
+        }
+        for (unsigned i = 0; i < ARRAYSIZE(fds); ++i) {
+            if (!fds[i].revents) continue;
+            int recv_fd = fds[i].fd;
+            int onward_fd = fds[(i+1)%2].fd;
+            packet = jdwp_read_packet(proxy, recv_fd);
+            handle_packet_toplevel(proxy, packet, recv_fd, onward_fd);
+            jdwp_packet_release(packet);
+        }
+    }
+}
+
 static void
 jdwp_main_1(void* arg)
 {
@@ -4760,15 +6181,18 @@ jdwp_main_1(void* arg)
         .app_packet_size_limit = INT32_MAX,
         .next_fake_reftype_id = 1000000000LLU /* make more prominent */,
         .quiet = info->jdwp.quiet,
+        .stats.start = jdwp_stats_now(),
     };
 
     struct jdwp_proxy* proxy = &proxy_object;
+    jdwp_packet_pool_init(&proxy->packet_pool);
     setup_jdwp_types(proxy->tt);
     LIST_INIT(&proxy->pending_packets);
     LIST_INIT(&proxy->deferred_from_app);
     SLIST_INIT(&proxy->classloaders);
-    SPLAY_INIT(&proxy->fake_reftypes_by_id);
-    SPLAY_INIT(&proxy->real_reftype_cache);
+    proxy->fake_reftypes_by_signature.rl = rl;
+    proxy->real_reftype_cache.rl = rl;
+    TAILQ_INIT(&proxy->real_reftype_lru);
 
     const char* to_what = info->to_what;
     if (!may_be_pid(to_what))
@@ -4779,7 +6203,6 @@ jdwp_main_1(void* arg)
         info->to_what, proxy->to_app_fd);
 
     do_jdwp_handshake_as_client(proxy->to_app_fd);
-    update_type_sizes(proxy);
     struct vm_info vi = update_vm_version(proxy);
     dbg("VM: description:[%s] major:%d minor:%d version:[%s] name:[%s]",
         vi.description, vi.major, vi.minor, vi.version, vi.name);
@@ -4806,6 +6229,22 @@ jdwp_main_1(void* arg)
         assert(strcmp(mode, "dumb") == 0);
     }
 
+    // Only rewriting needs the class list, so only rewriting
+    // bothers with the cache.
+    char* class_cache = NULL;
+    bool have_cached_classes = false;
+    struct jdwp_id_sizes id_sizes;
+    struct hd_class_list hcl = { 0 };
+    if (proxy->mode == JDWP_MODE_REWRITE)
+        class_cache = class_cache_key(
+            info, strtoul(to_what, NULL, 10), &vi);
+    if (class_cache != NULL && !info->jdwp.refresh_class_cache)
+        have_cached_classes = class_cache_load(class_cache, &id_sizes, &hcl);
+    if (have_cached_classes)
+        set_type_sizes(proxy, &id_sizes);
+    else
+        id_sizes = update_type_sizes(proxy);
+
     if (info->jdwp.suspend) {
         log_info(proxy, "suspending VM as requested");
         suspend_vm(proxy);
@@ -4816,14 +6255,24 @@ jdwp_main_1(void* arg)
 
     if (proxy->mode == JDWP_MODE_REWRITE) {
         suspend_vm(proxy);
-        struct hd_class_list hcl = read_class_list_via_heap_dump(proxy);
-        log_info(proxy, "learing about the %u classes from the heap dump",
-                 (unsigned) hcl.nr_classes);
+        if (have_cached_classes) {
+            log_info(proxy, "learning about the %u classes from the cache",
+                     (unsigned) hcl.nr_classes);
+        } else {
+            hcl = read_class_list_via_heap_dump(proxy);
+            if (class_cache != NULL)
+                class_cache_store(class_cache, &id_sizes, &hcl);
+            log_info(proxy, "learing about the %u classes from the heap dump",
+                     (unsigned) hcl.nr_classes);
+        }
         double start_time = seconds_since_epoch();
-        for (size_t i = 0; i < hcl.nr_classes; ++i) {
-            if (i > 0 && i % 5000 == 0)
+        for (size_t i = 0; i < hcl.nr_classes;) {
+            size_t n = XMIN(hcl.nr_classes - i, CLASS_REFRESH_BATCH_SIZE);
+            refresh_classes_with_signatures(
+                proxy, (const char* const*) &hcl.signatures[i], n);
+            i += n;
+            if (i < hcl.nr_classes && i % 5000 == 0)
                 log_info(proxy, "learned about %u classes", (unsigned) i);
-            refresh_classes_with_signature(proxy, hcl.signatures[i]);
         }
         double elapsed = seconds_since_epoch() - start_time;
         log_info(proxy, "learned about %u classes in %g seconds",
@@ -4842,36 +6291,16 @@ jdwp_main_1(void* arg)
 
     do_jdwp_handshake_as_server(proxy->to_debugger_fd);
 
-    struct pollfd fds[] = {
-        { proxy->to_app_fd, POLLIN },
-        { proxy->to_debugger_fd, POLLIN },
+    struct jdwp_loop_ctx ctx = {
+        .proxy = proxy,
+        .stats_dest = info->jdwp.stats ?: "-",
     };
-
-    struct jdwp_packet* packet;
-
-    for (;;) {
-        SCOPED_RESLIST(rl_loop);
-        packet = jdwp_pop_deferred_packet_from_app(proxy);
-        if (packet != NULL) {
-            handle_packet_toplevel(
-                proxy,
-                packet,
-                proxy->to_app_fd,
-                proxy->to_debugger_fd);
-            continue;
-        }
-
-        for (unsigned i = 0; i < ARRAYSIZE(fds); ++i)
-            fds[i].revents = 0;
-        xpoll(fds, ARRAYSIZE(fds), -1);
-        for (unsigned i = 0; i < ARRAYSIZE(fds); ++i) {
-            if (!fds[i].revents) continue;
-            int recv_fd = fds[i].fd;
-            int onward_fd = fds[(i+1)%2].fd;
-            packet = jdwp_read_packet(proxy, recv_fd);
-            handle_packet_toplevel(proxy, packet, recv_fd, onward_fd);
-        }
-    }
+    struct errinfo ei = { .want_msg = true };
+    bool failed = catch_error(jdwp_proxy_loop, &ctx, &ei);
+    if (info->jdwp.stats != NULL)
+        jdwp_write_stats(proxy, info->jdwp.stats);
+    if (failed)
+        die_rethrow(&ei);
 }
 
 int
@@ -4884,7 +6313,6 @@ jdwp_main(const struct cmd_jdwp_info* info)
     (void) hd_slurp_u16;
     (void) hd_slurp_string;
     (void) hd_slurp_element_size;
-    (void) map_heap_dump;
 
     struct errinfo ei = { .want_msg = true };
     if (catch_error(jdwp_main_1, (void*) info, &ei)) {
@@ -13,11 +13,15 @@
 #include <ctype.h>
 #include <limits.h>
 #include <time.h>
+#include <poll.h>
+#include <unistd.h>
 #include "util.h"
 #include "autocmd.h"
 #include "child.h"
 #include "fs.h"
 #include "json.h"
+#include "strutil.h"
+#include "constants.h"
 
 // ------------- FROM AOSP ------------
 
@@ -70,20 +74,25 @@ struct logger_entry_v3 {
     char        msg[0];    /* the entry's payload */
 } __attribute__((__packed__));
 
-// ----------- END AOSP -----------
+struct logger_entry_v4 {
+    uint16_t    len;       /* length of the payload */
+    uint16_t    hdr_size;  /* sizeof(struct logger_entry_v4) */
+    int32_t     pid;       /* generating process's pid */
+    uint32_t    tid;       /* generating process's tid */
+    uint32_t    sec;       /* seconds since Epoch */
+    uint32_t    nsec;      /* nanoseconds */
+    uint32_t    lid;       /* log id of the payload, bottom 4 bits currently */
+    uint32_t    uid;       /* generating process's uid */
+    char        msg[0];    /* the entry's payload */
+} __attribute__((__packed__));
 
-static void
-read_all_or_die(int fd, void* buf, size_t sz)
-{
-    size_t nr_read = read_all(fd, buf, sz);
-    if (nr_read != sz)
-        die(ENOTBLK, "unexpected EOF from inferior logcat");
-}
+// ----------- END AOSP -----------
 
 union logent {
     struct logger_entry v1;
     struct logger_entry_v2 v2;
     struct logger_entry_v3 v3;
+    struct logger_entry_v4 v4;
 };
 
 static const char*
@@ -100,21 +109,186 @@ logcat_priority_name(uint8_t priority)
     }
 }
 
-static void
-read_and_dump_log_entry(int logcat_fd,
-                        unsigned api_level,
-                        bool gmt,
-                        const char* time_format)
+// logd's buffers, indexed by the log id that v3 and later records
+// carry.
+static const char* const log_buffer_names[] = {
+    "main",
+    "radio",
+    "events",
+    "system",
+    "crash",
+    "stats",
+    "security",
+    "kernel",
+};
+
+static const char*
+log_buffer_name(unsigned lid)
+{
+    return lid < ARRAYSIZE(log_buffer_names)
+        ? log_buffer_names[lid]
+        : "?";
+}
+
+// Whether records in buffer LID hold binary events instead of text.
+static bool
+binary_log_buffer_p(unsigned lid)
+{
+    return lid < ARRAYSIZE(log_buffer_names) &&
+        (!strcmp(log_buffer_names[lid], "events") ||
+         !strcmp(log_buffer_names[lid], "stats") ||
+         !strcmp(log_buffer_names[lid], "security"));
+}
+
+// Binary events name their tags by number.  We read the device's map
+// from numbers to names once, before logcat starts, and keep it
+// sorted so each record costs one binary search.
+
+struct event_tag {
+    uint32_t number;
+    const char* name;
+};
+
+struct event_tag_map {
+    size_t nr;
+    struct event_tag* tags;
+};
+
+static int
+compare_event_tags(const void* a, const void* b)
+{
+    uint32_t na = ((const struct event_tag*) a)->number;
+    uint32_t nb = ((const struct event_tag*) b)->number;
+    return na < nb ? -1 : na > nb;
+}
+
+static const char*
+event_tag_name(const struct event_tag_map* map, uint32_t number)
 {
-    SCOPED_RESLIST(rl);
+    struct event_tag key = { .number = number };
+    const struct event_tag* tag =
+        map->nr > 0
+        ? bsearch(&key, map->tags, map->nr, sizeof (key), compare_event_tags)
+        : NULL;
+    return tag != NULL ? tag->name : NULL;
+}
+
+// Type codes in binary event payloads, from AOSP's EventLogTags
+enum event_type {
+    EVENT_TYPE_INT = 0,
+    EVENT_TYPE_LONG = 1,
+    EVENT_TYPE_STRING = 2,
+    EVENT_TYPE_LIST = 3,
+    EVENT_TYPE_FLOAT = 4,
+};
+
+// Decode one event value at *POS, advancing *POS past it, and emit
+// it to WRITER if WRITER is not NULL.  Return false if the value is
+// malformed.  We check a record with a NULL WRITER first, so that we
+// never emit half a value.
+static bool
+dump_event_value(struct json_writer* writer,
+                 const char** pos,
+                 const char* end,
+                 unsigned depth)
+{
+    if (end - *pos < 1 || depth > LOGCAT_EVENT_MAX_DEPTH)
+        return false;
+
+    uint8_t type = *(*pos)++;
+    switch (type) {
+        case EVENT_TYPE_INT: {
+            int32_t v;
+            if (end - *pos < sizeof (v))
+                return false;
+            memcpy(&v, *pos, sizeof (v));
+            *pos += sizeof (v);
+            if (writer)
+                json_emit_i64(writer, v);
+            return true;
+        }
+        case EVENT_TYPE_LONG: {
+            int64_t v;
+            if (end - *pos < sizeof (v))
+                return false;
+            memcpy(&v, *pos, sizeof (v));
+            *pos += sizeof (v);
+            if (writer)
+                json_emit_i64(writer, v);
+            return true;
+        }
+        case EVENT_TYPE_FLOAT: {
+            float v;
+            if (end - *pos < sizeof (v))
+                return false;
+            memcpy(&v, *pos, sizeof (v));
+            *pos += sizeof (v);
+            if (writer) {
+                char buf[32];
+                snprintf(buf, sizeof (buf), "%g", (double) v);
+                json_emit_string(writer, buf);
+            }
+            return true;
+        }
+        case EVENT_TYPE_STRING: {
+            int32_t len;
+            if (end - *pos < sizeof (len))
+                return false;
+            memcpy(&len, *pos, sizeof (len));
+            *pos += sizeof (len);
+            if (len < 0 || end - *pos < len)
+                return false;
+            if (writer)
+                json_emit_string_n(writer, *pos, len);
+            *pos += len;
+            return true;
+        }
+        case EVENT_TYPE_LIST: {
+            if (end - *pos < 1)
+                return false;
+            uint8_t count = *(*pos)++;
+            if (writer)
+                json_begin_array(writer);
+            for (unsigned i = 0; i < count; ++i)
+                if (!dump_event_value(writer, pos, end, depth + 1))
+                    return false;
+            if (writer)
+                json_end_array(writer);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// We read logcat's binary output in big chunks and carve the records
+// out of our buffer ourselves: a pair of reads per record can't keep
+// up with a device logging thousands of lines a second.
+
+struct logcat_reader {
+    int fd;
+    unsigned api_level;
+    uint8_t* buf;
+    size_t start;
+    size_t end;
+};
 
+// Return the next complete record in our buffer, or NULL if we need
+// to read more first.
+static const union logent*
+logcat_reader_next(struct logcat_reader* rd,
+                   size_t* hdrsz_out,
+                   size_t* payloadsz_out)
+{
+    size_t avail = rd->end - rd->start;
     union logent hdr;
-    union logent* le;
     size_t hdrsz;
     size_t payloadsz;
 
-    read_all_or_die(logcat_fd, &hdr.v1, sizeof (hdr.v1));
-    if (api_level < 21) {
+    if (avail < sizeof (hdr.v1))
+        return NULL;
+    memcpy(&hdr.v1, rd->buf + rd->start, sizeof (hdr.v1));
+    if (rd->api_level < 21) {
         payloadsz = hdr.v1.len;
         hdrsz = sizeof (hdr.v1);
     } else {
@@ -124,15 +298,195 @@ read_and_dump_log_entry(int logcat_fd,
             die(EINVAL, "bogus packet from logcat");
     }
 
-    le = alloca(hdrsz + payloadsz);
-    memcpy(&le->v1, &hdr.v1, sizeof (hdr.v1));
-    read_all_or_die(logcat_fd,
-                    (uint8_t*) le + sizeof (hdr.v1),
-                    hdrsz + payloadsz - sizeof (hdr.v1));
-    char* payload = (char*) le + hdrsz;
-    char* payload_end = payload + payloadsz;
+    if (avail < hdrsz + payloadsz)
+        return NULL;
+
+    const union logent* le = (const union logent*) (rd->buf + rd->start);
+    rd->start += hdrsz + payloadsz;
+    *hdrsz_out = hdrsz;
+    *payloadsz_out = payloadsz;
+    return le;
+}
+
+// Read as much as logcat has for us, blocking until there's
+// something.  Return false at EOF.
+static bool
+logcat_reader_fill_1(struct logcat_reader* rd)
+{
+    size_t leftover = rd->end - rd->start;
+    memmove(rd->buf, rd->buf + rd->start, leftover);
+    rd->start = 0;
+    rd->end = leftover;
+    ssize_t nr_read;
+    do {
+        WITH_IO_SIGNALS_ALLOWED();
+        nr_read = read(rd->fd,
+                       rd->buf + rd->end,
+                       LOGCAT_JSON_READ_SIZE - rd->end);
+    } while (nr_read == -1 && errno == EINTR);
+    if (nr_read < 0)
+        die_errno("read(%d)", rd->fd);
+    rd->end += nr_read;
+    return nr_read > 0;
+}
+
+static void
+logcat_reader_fill(struct logcat_reader* rd)
+{
+    if (!logcat_reader_fill_1(rd))
+        die(ENOTBLK, "unexpected EOF from inferior logcat");
+}
+
+// Return the next line of the text the device sends before logcat
+// starts, without its newline.  The line lives in our buffer, so it
+// lasts only until the next read.
+static char*
+logcat_reader_line(struct logcat_reader* rd)
+{
+    for (;;) {
+        char* start = (char*) rd->buf + rd->start;
+        char* nl = memchr(start, '\n', rd->end - rd->start);
+        if (nl != NULL) {
+            *nl = '\0';
+            rd->start = (uint8_t*) nl + 1 - rd->buf;
+            return start;
+        }
+
+        if (rd->end - rd->start == LOGCAT_JSON_READ_SIZE)
+            die(ECOMM, "line too long from device");
+        if (!logcat_reader_fill_1(rd))
+            die(ECOMM, "device hung up before starting logcat");
+    }
+}
+
+// What the device sends after the event tag map
+static const char event_tags_end[] = "fb-adb-end-of-event-tags";
+
+// Read the contents of the device's event-log-tags file, in which
+// each line begins with a tag number and name.
+static struct event_tag_map
+read_event_tag_map(struct logcat_reader* rd)
+{
+    struct event_tag_map map = { 0 };
+    struct growable_buffer gb = { 0 };
+    for (;;) {
+        char* line = logcat_reader_line(rd);
+        if (!strcmp(line, event_tags_end))
+            break;
 
-    struct json_writer* writer = json_writer_create(xstdout);
+        char* endptr;
+        errno = 0;
+        unsigned long number = strtoul(line, &endptr, 10);
+        if (endptr == line || errno != 0 || number > UINT32_MAX ||
+            (*endptr != ' ' && *endptr != '\t'))
+        {
+            continue; // Comment, blank line, or junk
+        }
+
+        const char* name = endptr + strspn(endptr, " \t");
+        size_t name_length = strcspn(name, " \t\r");
+        if (name_length == 0)
+            continue;
+
+        while ((map.nr + 1) * sizeof (map.tags[0]) > gb.bufsz)
+            grow_buffer_dwim(&gb);
+        map.tags = (struct event_tag*) gb.buf;
+        map.tags[map.nr].number = number;
+        map.tags[map.nr].name = xstrndup(name, name_length);
+        map.nr += 1;
+    }
+
+    if (map.nr > 0)
+        qsort(map.tags, map.nr, sizeof (map.tags[0]), compare_event_tags);
+    dbg("read %zu event tags from device", map.nr);
+    return map;
+}
+
+struct logcat_owner_filter {
+    bool enabled;
+    size_t nr_pids;
+    uint32_t* pids;
+    size_t nr_uids;
+    uint32_t* uids;
+};
+
+static bool
+id_in_set_p(uint32_t id, const uint32_t* ids, size_t nr_ids)
+{
+    for (size_t i = 0; i < nr_ids; ++i)
+        if (ids[i] == id)
+            return true;
+    return false;
+}
+
+// Return whether to print a record.  Records written before Android
+// 7.0 don't say who wrote them, so they never match a uid.
+static bool
+logent_wanted_p(const struct logcat_owner_filter* filter,
+                const union logent* le,
+                size_t hdrsz)
+{
+    if (!filter->enabled)
+        return true;
+    if (id_in_set_p((uint32_t) le->v1.pid, filter->pids, filter->nr_pids))
+        return true;
+    return hdrsz >= sizeof (le->v4) &&
+        id_in_set_p(le->v4.uid, filter->uids, filter->nr_uids);
+}
+
+// Emit the tag and values of a binary event record, whose payload
+// runs from PAYLOAD to PAYLOAD_END.
+static void
+dump_event_payload(struct json_writer* writer,
+                   const struct event_tag_map* events,
+                   const char* payload,
+                   const char* payload_end)
+{
+    uint32_t number = 0;
+    if (payload_end - payload >= sizeof (number)) {
+        memcpy(&number, payload, sizeof (number));
+        payload += sizeof (number);
+    }
+
+    json_begin_field(writer, "tag");
+    const char* name = event_tag_name(events, number);
+    if (name != NULL) {
+        json_emit_string(writer, name);
+    } else {
+        char buf[16];
+        snprintf(buf, sizeof (buf), "%u", (unsigned) number);
+        json_emit_string(writer, buf);
+    }
+
+    json_begin_field(writer, "values");
+    const char* check = payload;
+    if (!dump_event_value(NULL, &check, payload_end, 0)) {
+        json_emit_null(writer);
+    } else if (*payload == EVENT_TYPE_LIST) {
+        dump_event_value(writer, &payload, payload_end, 0);
+    } else {
+        json_begin_array(writer);
+        dump_event_value(writer, &payload, payload_end, 0);
+        json_end_array(writer);
+    }
+}
+
+// Emit one record.  BUFFER, if not NULL, names the buffer it came
+// from.  EVENTS is NULL unless the record is a binary event.
+static void
+dump_log_entry(struct json_writer* writer,
+               const union logent* le,
+               size_t hdrsz,
+               size_t payloadsz,
+               bool gmt,
+               const char* time_format,
+               const char* buffer,
+               const struct event_tag_map* events)
+{
+    const char* payload = (const char*) le + hdrsz;
+    const char* payload_end = payload + payloadsz;
+
+    json_writer_reset(writer);
     json_begin_object(writer);
     json_begin_field(writer, "pid");
     json_emit_i64(writer, le->v1.pid);
@@ -158,6 +512,18 @@ read_and_dump_log_entry(int logcat_fd,
         }
     }
 
+    if (buffer != NULL) {
+        json_begin_field(writer, "buffer");
+        json_emit_string(writer, buffer);
+    }
+
+    if (events != NULL) {
+        dump_event_payload(writer, events, payload, payload_end);
+        json_end_object(writer);
+        json_end_record(writer);
+        return;
+    }
+
     uint8_t priority;
     if (payload < payload_end) {
         priority = *payload;
@@ -180,19 +546,157 @@ read_and_dump_log_entry(int logcat_fd,
     json_begin_field(writer, "message");
     json_emit_string_n(writer, payload, message_length);
     json_end_object(writer);
-    xputc('\n', xstdout);
-    xflush(xstdout);
+    json_end_record(writer);
+}
+
+static char
+parse_logcat_priority(const char* name)
+{
+    static const char* const names[] = {
+        "verbose", "debug", "info", "warn", "error", "fatal",
+    };
+    for (size_t i = 0; i < ARRAYSIZE(names); ++i)
+        if (!strcmp(name, names[i]) ||
+            (name[0] != '\0' && name[1] == '\0' &&
+             tolower((unsigned char) name[0]) == names[i][0]))
+            return toupper((unsigned char) names[i][0]);
+    usage_error("invalid log priority: %s", name);
+}
+
+// Build the logcat filterspecs that make the device-side logcat drop
+// records we don't want before they ever reach us.
+static const char*
+make_logcat_filterspecs(const struct cmd_logcat_json_info* info)
+{
+    char priority = 'V';
+    if (info->logcat_json.priority)
+        priority = parse_logcat_priority(info->logcat_json.priority);
+
+    const char* specs = "";
+    bool have_tags = false;
+    if (info->logcat_json.tags) {
+        for (const char* tag = strlist_rewind(info->logcat_json.tags);
+             tag != NULL;
+             tag = strlist_next(info->logcat_json.tags))
+        {
+            tag += strlen("tag=");
+            if (*tag == '\0' || strchr(tag, ':') != NULL)
+                usage_error("invalid log tag: \"%s\"", tag);
+            specs = xaprintf("%s %s",
+                             specs,
+                             xshellquote(xaprintf("%s:%c", tag, priority)));
+            have_tags = true;
+        }
+    }
+
+    if (have_tags)
+        specs = xaprintf("%s '*:S'", specs);
+    else if (priority != 'V')
+        specs = xaprintf(" '*:%c'", priority);
+    return specs;
+}
+
+static uint32_t
+parse_owner_id(const char* kind, const char* value)
+{
+    char* endptr = NULL;
+    errno = 0;
+    unsigned long id = strtoul(value, &endptr, 10);
+    if (errno != 0 || endptr == value || *endptr != '\0' || id > UINT32_MAX)
+        die(EINVAL, "invalid %s: %s", kind, value);
+    return id;
+}
+
+static struct logcat_owner_filter
+make_owner_filter(const struct strlist* owners)
+{
+    struct logcat_owner_filter filter = { 0 };
+    if (owners == NULL)
+        return filter;
+    filter.enabled = true;
+    size_t nr_owners = 0;
+    for (const char* o = strlist_rewind(owners); o; o = strlist_next(owners))
+        nr_owners += 1;
+    filter.pids = xalloc(nr_owners * sizeof (filter.pids[0]));
+    filter.uids = xalloc(nr_owners * sizeof (filter.uids[0]));
+    for (const char* o = strlist_rewind(owners); o; o = strlist_next(owners)) {
+        if (string_starts_with_p(o, "pid="))
+            filter.pids[filter.nr_pids++] =
+                parse_owner_id("pid", o + strlen("pid="));
+        else if (string_starts_with_p(o, "uid="))
+            filter.uids[filter.nr_uids++] =
+                parse_owner_id("uid", o + strlen("uid="));
+    }
+    return filter;
+}
+
+// Turn the --buffers list into logcat -b options.  Set *ONLY_LID to
+// the buffer's log id if there's just one, or to -1, and set
+// *WANT_EVENTS if any of the buffers holds binary events.
+static const char*
+make_logcat_buffer_args(const char* buffers,
+                        int* only_lid,
+                        bool* want_events)
+{
+    const char* args = "";
+    unsigned nr = 0;
+    char* saveptr = NULL;
+    for (char* name = strtok_r(xstrdup(buffers), ",", &saveptr);
+         name != NULL;
+         name = strtok_r(NULL, ",", &saveptr))
+    {
+        int lid = -1;
+        for (unsigned i = 0; i < ARRAYSIZE(log_buffer_names); ++i)
+            if (!strcmp(name, log_buffer_names[i]))
+                lid = i;
+        if (lid == -1)
+            usage_error("unknown log buffer: %s", name);
+        args = xaprintf("%s -b %s", args, name);
+        if (binary_log_buffer_p(lid))
+            *want_events = true;
+        *only_lid = lid;
+        nr += 1;
+    }
+
+    if (nr == 0)
+        usage_error("no log buffers given");
+    if (nr > 1)
+        *only_lid = -1;
+    return args;
 }
 
 int
 logcat_json_main(const struct cmd_logcat_json_info* info)
 {
+    // Without --buffers, we don't say where records came from and
+    // treat them all as text, as logcat's default buffers are.
+    const char* buffer_args = "";
+    const char* event_tags_command = "";
+    int only_lid = -1;
+    bool want_events = false;
+    if (info->logcat_json.buffers) {
+        buffer_args = make_logcat_buffer_args(info->logcat_json.buffers,
+                                              &only_lid,
+                                              &want_events);
+        if (want_events)
+            event_tags_command = xaprintf(
+                "{ cat /system/etc/event-log-tags 2>/dev/null;"
+                "echo;echo %s; }&&",
+                event_tags_end);
+    }
+
     struct cmd_shell_info shcmdi = {
         .adb = info->adb,
         .transport = info->transport,
         .user = info->user,
-        .command = "getprop ro.build.version.sdk&&exec logcat -B"
+        .command = xaprintf("getprop ro.build.version.sdk&&%s"
+                            "exec logcat -B%s%s",
+                            event_tags_command,
+                            buffer_args,
+                            make_logcat_filterspecs(info)),
     };
+    struct logcat_owner_filter owner_filter =
+        make_owner_filter(info->logcat_json.owners);
 
     struct strlist* args = strlist_new();
     strlist_append(args, orig_argv0);
@@ -210,33 +714,88 @@ logcat_json_main(const struct cmd_logcat_json_info* info)
     struct child* captive_logcat = child_start(&csi);
     install_child_error_converter(captive_logcat);
     int logcat_fd = captive_logcat->fd[1]->fd;
-    unsigned api_level = 0;
+    struct logcat_reader rd = {
+        .fd = logcat_fd,
+        .buf = xalloc(LOGCAT_JSON_READ_SIZE),
+    };
 
-    for (;;) {
-        char c;
-        if (read_all(logcat_fd, &c, 1) < 1)
-            die(ECOMM, "invalid API level");
-        if ('0' <= c && c <= '9')
-            api_level = api_level * 10 + (c - '0');
-        else if (c == '\n')
-            break;
-        else
+    const char* api_line = logcat_reader_line(&rd);
+    unsigned api_level = 0;
+    for (const char* c = api_line; *c != '\0'; ++c) {
+        if (*c < '0' || *c > '9')
             die(ECOMM, "invalid API level");
+        api_level = api_level * 10 + (*c - '0');
     }
 
     if (api_level == 0)
         die(ECOMM, "invalid API level");
+    rd.api_level = api_level;
+
+    // Before 5.0, records don't say which buffer they're from.
+    if (info->logcat_json.buffers && only_lid == -1 && api_level < 21)
+        die(ENOSYS, "reading several log buffers needs Android 5.0");
+
+    struct event_tag_map events = { 0 };
+    if (want_events)
+        events = read_event_tag_map(&rd);
 
     const char* time_format = "%a, %d %b %Y %H:%M:%S";
     if (info->logcat_json.time_format)
         time_format = info->logcat_json.time_format;
     bool gmt = info->logcat_json.gmt;
 
+    // Flush when our buffer fills or when the oldest record in it has
+    // waited LOGCAT_JSON_FLUSH_MS, not after every record.  Terminals
+    // stay line-buffered.
+    if (!isatty(STDOUT_FILENO) &&
+        setvbuf(xstdout, NULL, _IOFBF, LOGCAT_JSON_FLUSH_BYTES) != 0)
+        die_errno("setvbuf");
+
+    enum json_format format = JSON_FORMAT_TEXT;
+    if (info->logcat_json.format)
+        format = json_format_from_name(info->logcat_json.format);
+    struct json_writer* writer = json_writer_create_format(xstdout, format);
+    bool pending = false;
+    double flush_deadline = 0;
+
     for (;;) {
-        read_and_dump_log_entry(
-            logcat_fd,
-            api_level,
-            gmt,
-            time_format);
+        const union logent* le;
+        size_t hdrsz;
+        size_t payloadsz;
+        while ((le = logcat_reader_next(&rd, &hdrsz, &payloadsz))) {
+            if (!logent_wanted_p(&owner_filter, le, hdrsz))
+                continue;
+            const char* buffer = NULL;
+            const struct event_tag_map* record_events = NULL;
+            if (info->logcat_json.buffers) {
+                unsigned lid = only_lid;
+                if (only_lid == -1 && hdrsz >= sizeof (le->v3))
+                    lid = le->v3.lid;
+                buffer = log_buffer_name(lid);
+                if (binary_log_buffer_p(lid))
+                    record_events = &events;
+            }
+            dump_log_entry(writer, le, hdrsz, payloadsz, gmt, time_format,
+                           buffer, record_events);
+            if (!pending) {
+                pending = true;
+                flush_deadline = xclock_gettime(CLOCK_MONOTONIC) +
+                    LOGCAT_JSON_FLUSH_MS / 1000.0;
+            }
+        }
+
+        if (pending) {
+            double now = xclock_gettime(CLOCK_MONOTONIC);
+            int timeout_ms = now < flush_deadline
+                ? (int) ((flush_deadline - now) * 1000) + 1
+                : 0;
+            struct pollfd p = { .fd = logcat_fd, .events = POLLIN };
+            if (timeout_ms == 0 || xpoll(&p, 1, timeout_ms) == 0) {
+                xflush(xstdout);
+                pending = false;
+            }
+        }
+
+        logcat_reader_fill(&rd);
     }
 }
@@ -15,6 +15,7 @@
 #include "util.h"
 #include "autocmd.h"
 #include "argv.h"
+#include "fs.h"
 
 #if FBADB_MAIN
 
@@ -50,29 +51,118 @@ tolower_inplace(char* s)
     }
 }
 
+static int
+parse_priority(const char* name)
+{
+    char* xprio = xstrdup(name);
+    tolower_inplace(xprio);
+    size_t xprio_len = strlen(xprio);
+    for (unsigned i = 0; i < ARRAYSIZE(log_levels) - 1; ++i)
+        if (!strncmp(xprio, log_levels[i], xprio_len))
+            return ANDROID_LOG_VERBOSE + i;
+
+    usage_error("unknown priority \"%s\"", name);
+}
+
+static void
+log_write(int priority, const char* tag, const char* msg)
+{
+    int ret = __android_log_write(priority, tag, msg);
+    if (ret < 0) {
+        errno = -ret;
+        die_errno("__android_log_write");
+    }
+}
+
+// Read the next record, which ends at DELIM or EOF, from FILE into
+// GB as a NUL-terminated string.  Return false at EOF.
+static bool
+read_record(FILE* file, int delim, struct growable_buffer* gb)
+{
+    size_t nr = 0;
+    int c;
+    for (;;) {
+        if (nr + 1 >= gb->bufsz)
+            grow_buffer_dwim(gb);
+        c = getc(file);
+        if (c == EOF || c == delim)
+            break;
+        gb->buf[nr++] = c;
+    }
+
+    if (c == EOF) {
+        if (ferror(file))
+            die_errno("getc");
+        if (nr == 0)
+            return false;
+    }
+
+    gb->buf[nr] = '\0';
+    return true;
+}
+
+// If MSG begins with a logcat-style "P/TAG: " prefix, split it off,
+// set *PRIORITY and *TAG from it, and return the rest of the message.
+static const char*
+strip_record_prefix(char* msg, int* priority, const char** tag)
+{
+    static const char letters[] = "VDIWEF";
+    const char* letter = msg[0] ? strchr(letters, toupper(msg[0])) : NULL;
+    if (letter == NULL || msg[1] != '/')
+        return msg;
+
+    char* colon = strstr(msg + 2, ": ");
+    if (colon == NULL || colon == msg + 2)
+        return msg;
+
+    *colon = '\0';
+    *priority = ANDROID_LOG_VERBOSE + (letter - letters);
+    *tag = msg + 2;
+    return colon + 2;
+}
+
+static void
+logwrite_records(FILE* file,
+                 int delim,
+                 bool prefixed,
+                 int priority,
+                 const char* tag)
+{
+    struct growable_buffer gb = { 0 };
+    while (read_record(file, delim, &gb)) {
+        int record_priority = priority;
+        const char* record_tag = tag;
+        char* record = (char*) gb.buf;
+        const char* msg = record;
+        if (prefixed)
+            msg = strip_record_prefix(record, &record_priority, &record_tag);
+        log_write(record_priority, record_tag, msg);
+    }
+}
+
 int
 logwrite_main(const struct cmd_logwrite_info* info)
 {
     const char* tag = info->logwrite.tag ?: "fb-adb-logwrite";
-    int priority = ANDROID_LOG_INFO;
-
-    if (info->logwrite.priority) {
-        priority = -1;
-        char* xprio = xstrdup(info->logwrite.priority);
-        tolower_inplace(xprio);
-        size_t xprio_len = strlen(xprio);
-        for (unsigned i = 0; i < ARRAYSIZE(log_levels) - 1; ++i) {
-            if (!strncmp(xprio, log_levels[i], xprio_len)) {
-                priority = ANDROID_LOG_VERBOSE + i;
-                break;
-            }
-        }
-
-        if (priority == -1)
-            usage_error("unknown priority \"%s\"",
-                        info->logwrite.priority);
+    int priority = info->logwrite.priority
+        ? parse_priority(info->logwrite.priority)
+        : ANDROID_LOG_INFO;
+
+    bool have_message = info->message_parts[0] != NULL;
+    if (info->logwrite.from_stdin) {
+        if (have_message)
+            usage_error("cannot give both --from-stdin and a message");
+        logwrite_records(xstdin,
+                         info->logwrite.null ? '\0' : '\n',
+                         info->logwrite.prefixed,
+                         priority,
+                         tag);
+        return 0;
     }
 
+    if (!have_message)
+        usage_error("no message given");
+
     const char* const* p;
     size_t sz = 1;
 
@@ -93,12 +183,7 @@ logwrite_main(const struct cmd_logwrite_info* info)
     }
 
     msg[sz-1] = '\0';
-    int ret = __android_log_write(priority, tag, msg);
-    if (ret < 0) {
-        errno = -ret;
-        die_errno("__android_log_write");
-    }
-
+    log_write(priority, tag, msg);
     return 0;
 }
 #endif
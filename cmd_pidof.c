@@ -31,38 +31,217 @@ pidof_main(const struct cmd_pidof_info* info)
 
 #else
 
-int
-pidof_main(const struct cmd_pidof_info* info)
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include "argv.h"
+#include "constants.h"
+
+struct pidof_match {
+    size_t target; // Index into the sorted target names
+    unsigned long pid;
+};
+
+struct pidof_scan {
+    const char** targets; // Sorted and unique
+    size_t nr_targets;
+    size_t* nr_found; // Indexed like targets
+    struct pidof_match* matches; // Sorted by target, then pid
+    size_t nr_matches;
+};
+
+static int
+compare_names(const void* a, const void* b)
 {
-    const char* name = info->name;
-    DIR* procdir = xopendir("/proc");
+    const char* sa;
+    const char* sb;
+    memcpy(&sa, a, sizeof (sa));
+    memcpy(&sb, b, sizeof (sb));
+    return strcmp(sa, sb);
+}
+
+static int
+compare_matches(const void* a, const void* b)
+{
+    const struct pidof_match* ma = a;
+    const struct pidof_match* mb = b;
+    if (ma->target != mb->target)
+        return ma->target < mb->target ? -1 : 1;
+    if (ma->pid != mb->pid)
+        return ma->pid < mb->pid ? -1 : 1;
+    return 0;
+}
+
+static ssize_t
+find_target(const struct pidof_scan* scan, const char* name)
+{
+    const char** found = bsearch(&name,
+                                 scan->targets,
+                                 scan->nr_targets,
+                                 sizeof (scan->targets[0]),
+                                 compare_names);
+    return found ? found - scan->targets : -1;
+}
+
+// Make one pass over /proc, reading each process's command line once
+// and matching it against every target at the same time.
+static void
+pidof_scan(DIR* procdir, struct pidof_scan* scan)
+{
+    struct growable_buffer matches = { 0 };
+    scan->nr_matches = 0;
+    memset(scan->nr_found, 0, scan->nr_targets * sizeof (scan->nr_found[0]));
+    rewinddir(procdir);
+
     struct dirent* ent;
-    unsigned long found_pid = 0;
-    bool found = false;
     while ((ent = readdir(procdir)) != NULL) {
-        SCOPED_RESLIST(rl);
         char* endptr = NULL;
         errno = 0;
         unsigned long pid = strtoul(ent->d_name, &endptr, 10);
         if (pid == 0 || errno != 0 || *endptr != '\0')
             continue;
-        int cmdline_fd = try_xopen(xaprintf("/proc/%lu/cmdline", pid), O_RDONLY, 0);
-        if (cmdline_fd == -1)
-            continue;
-        char* name = slurp_fd(cmdline_fd, NULL);
-        if (strcmp(name, info->name) == 0) {
-            if (found)
-                die(EINVAL, "more than one process has name `%s'", name);
-            found = true;
-            found_pid = pid;
+        ssize_t target;
+        {
+            SCOPED_RESLIST(rl);
+            int cmdline_fd = try_xopen(
+                xaprintf("/proc/%lu/cmdline", pid), O_RDONLY, 0);
+            if (cmdline_fd == -1)
+                continue;
+            target = find_target(scan, slurp_fd(cmdline_fd, NULL));
         }
+        if (target < 0)
+            continue;
+        size_t needed = (scan->nr_matches + 1) * sizeof (scan->matches[0]);
+        if (matches.bufsz < needed)
+            grow_buffer_dwim(&matches);
+        scan->matches = (struct pidof_match*) matches.buf;
+        scan->matches[scan->nr_matches++] = (struct pidof_match){
+            .target = (size_t) target,
+            .pid = pid,
+        };
+        scan->nr_found[target] += 1;
     }
 
-    if (!found)
-        die(ENOENT, "no process has name `%s'", name);
-    xprintf(xstdout, "%lu%s", found_pid, info->pidof.zero ? "" : "\n");
+    qsort(scan->matches,
+          scan->nr_matches,
+          sizeof (scan->matches[0]),
+          compare_matches);
+}
+
+static bool
+pidof_all_found_p(const struct pidof_scan* scan)
+{
+    for (size_t i = 0; i < scan->nr_targets; ++i)
+        if (scan->nr_found[i] == 0)
+            return false;
+    return true;
+}
+
+// Sleep before we look again.  Return false if our peer has closed
+// our standard input, meaning nobody is waiting for an answer.
+static bool
+pidof_wait(void)
+{
+    struct pollfd p = { .fd = STDIN_FILENO, .events = POLLIN };
+    if (xpoll(&p, 1, PIDOF_WAIT_POLL_MS) <= 0)
+        return true;
+    char c;
+    return read(STDIN_FILENO, &c, 1) > 0;
+}
+
+static int
+pidof_emit_json(const struct pidof_scan* scan)
+{
+    struct json_writer* writer = json_writer_create(xstdout);
+    json_begin_object(writer);
+    const struct pidof_match* match = scan->matches;
+    for (size_t i = 0; i < scan->nr_targets; ++i) {
+        json_begin_field(writer, scan->targets[i]);
+        json_begin_array(writer);
+        for (size_t j = 0; j < scan->nr_found[i]; ++j)
+            json_emit_u64(writer, (match++)->pid);
+        json_end_array(writer);
+    }
+    json_end_object(writer);
+    json_end_record(writer);
+    xflush(xstdout);
+    return pidof_all_found_p(scan) ? 0 : 4;
+}
+
+static int
+pidof_emit_text(const struct pidof_scan* scan,
+                const char* const* names,
+                bool zero)
+{
+    for (size_t i = 0; names[i] != NULL; ++i) {
+        size_t target = (size_t) find_target(scan, names[i]);
+        if (scan->nr_found[target] == 0)
+            die(ENOENT, "no process has name `%s'", names[i]);
+        if (scan->nr_found[target] > 1)
+            die(EINVAL, "more than one process has name `%s'", names[i]);
+    }
+
+    for (size_t i = 0; names[i] != NULL; ++i) {
+        size_t target = (size_t) find_target(scan, names[i]);
+        const struct pidof_match* match = scan->matches;
+        while (match->target != target)
+            match += 1;
+        if (i > 0)
+            xputc(zero ? '\0' : '\n', xstdout);
+        xprintf(xstdout, "%lu", match->pid);
+    }
+    if (!zero)
+        xputc('\n', xstdout);
     xflush(xstdout);
     return 0;
 }
 
+int
+pidof_main(const struct cmd_pidof_info* info)
+{
+    const char** names = ARGV_CONCAT(ARGV(info->name),
+                                      info->more_names ?: empty_argv);
+    struct pidof_scan scan = { 0 };
+    scan.nr_targets = argv_count(names);
+    scan.targets = xalloc(scan.nr_targets * sizeof (scan.targets[0]));
+    memcpy(scan.targets, names, scan.nr_targets * sizeof (scan.targets[0]));
+    qsort(scan.targets,
+          scan.nr_targets,
+          sizeof (scan.targets[0]),
+          compare_names);
+    size_t nr_unique = 0;
+    for (size_t i = 0; i < scan.nr_targets; ++i)
+        if (nr_unique == 0 ||
+            strcmp(scan.targets[i], scan.targets[nr_unique - 1]) != 0)
+            scan.targets[nr_unique++] = scan.targets[i];
+    scan.nr_targets = nr_unique;
+    scan.nr_found = xalloc(scan.nr_targets * sizeof (scan.nr_found[0]));
+
+    double deadline = 0;
+    bool wait = info->pidof.wait != NULL;
+    if (wait) {
+        char* endptr = NULL;
+        errno = 0;
+        unsigned long timeout_ms = strtoul(info->pidof.wait, &endptr, 10);
+        if (errno != 0 || endptr == info->pidof.wait || *endptr != '\0')
+            die(EINVAL, "invalid timeout: %s", info->pidof.wait);
+        if (timeout_ms > 0)
+            deadline = xclock_gettime(CLOCK_MONOTONIC) + timeout_ms / 1000.0;
+    }
+
+    DIR* procdir = xopendir("/proc");
+    for (;;) {
+        SCOPED_RESLIST(rl);
+        pidof_scan(procdir, &scan);
+        if (!wait || pidof_all_found_p(&scan) ||
+            (deadline != 0 && xclock_gettime(CLOCK_MONOTONIC) >= deadline) ||
+            !pidof_wait())
+        {
+            if (info->pidof.json)
+                return pidof_emit_json(&scan);
+            return pidof_emit_text(&scan, names, info->pidof.zero);
+        }
+    }
+}
+
 #endif
@@ -8,28 +8,174 @@
  *  in the same directory.
  *
  */
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include "util.h"
 #include "autocmd.h"
 #include "peer.h"
 #include "fs.h"
+#include "json.h"
+#include "constants.h"
+
+static double
+ping_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return xclock_gettime(CLOCK_MONOTONIC);
+#else
+    return seconds_since_epoch();
+#endif
+}
 
 static
 void
-ping(struct child* peer)
+ping(struct child* peer, char* sendbuf, char* recvbuf, size_t size)
 {
-    char csend = '.';
-    write_all(peer->fd[STDIN_FILENO]->fd, &csend, sizeof (csend));
-    char crecv;
-    if (!read_all(peer->fd[STDOUT_FILENO]->fd, &crecv, sizeof (crecv)))
+    write_all(peer->fd[STDIN_FILENO]->fd, sendbuf, size);
+    if (read_all(peer->fd[STDOUT_FILENO]->fd, recvbuf, size) != size)
         die(EINVAL, "remote did not echo ping");
-    if (csend != crecv)
+    if (memcmp(sendbuf, recvbuf, size) != 0)
         die(EINVAL, "child replied with wrong pong byte");
 }
 
+static unsigned
+parse_ping_number(const char* s, const char* what)
+{
+    char* endptr;
+    errno = 0;
+    unsigned long n = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        n == 0 || n > UINT_MAX)
+    {
+        die(EINVAL, "invalid %s %s", what, s);
+    }
+    return n;
+}
+
+static int
+parse_ping_interval_ms(const char* s)
+{
+    char* endptr;
+    errno = 0;
+    double seconds = strtod(s, &endptr);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        !(seconds >= 0) || seconds > INT_MAX / 1000)
+    {
+        die(EINVAL, "invalid interval %s", s);
+    }
+    return (int) (seconds * 1000 + 0.5);
+}
+
+static int
+compare_doubles(const void* a, const void* b)
+{
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return da < db ? -1 : da > db;
+}
+
+static uint64_t
+seconds_to_us(double seconds)
+{
+    return (uint64_t) (seconds * 1e6 + 0.5);
+}
+
+// The sample at percentile PCT of the NR sorted SAMPLES, by the
+// nearest-rank method.
+static double
+percentile(const double* samples, unsigned nr, unsigned pct)
+{
+    unsigned rank = (unsigned) (((uint64_t) pct * nr + 99) / 100);
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Emit counts of SAMPLES falling in power-of-two microsecond
+// buckets, each labeled with its inclusive upper bound.
+static void
+emit_histogram(struct json_writer* writer,
+               const double* samples,
+               unsigned nr)
+{
+    json_begin_array(writer);
+    unsigned i = 0;
+    for (uint64_t le_us = 1; i < nr; le_us *= 2) {
+        unsigned count = 0;
+        while (i < nr && seconds_to_us(samples[i]) <= le_us) {
+            count += 1;
+            i += 1;
+        }
+
+        if (count > 0) {
+            json_begin_object(writer);
+            json_begin_field(writer, "le_us");
+            json_emit_u64(writer, le_us);
+            json_begin_field(writer, "count");
+            json_emit_u64(writer, count);
+            json_end_object(writer);
+        }
+    }
+    json_end_array(writer);
+}
+
+static void
+print_ping_json(double setup,
+                double* samples,
+                unsigned nr,
+                size_t size,
+                double total)
+{
+    struct json_writer* writer = json_writer_create(xstdout);
+    json_begin_object(writer);
+    json_begin_field(writer, "size");
+    json_emit_u64(writer, size);
+    json_begin_field(writer, "setup_us");
+    json_emit_u64(writer, seconds_to_us(setup));
+    json_begin_field(writer, "rounds");
+    json_emit_u64(writer, nr);
+    json_begin_field(writer, "min_us");
+    json_emit_u64(writer, seconds_to_us(samples[0]));
+    json_begin_field(writer, "avg_us");
+    json_emit_u64(writer, seconds_to_us(total / nr));
+    json_begin_field(writer, "p50_us");
+    json_emit_u64(writer, seconds_to_us(percentile(samples, nr, 50)));
+    json_begin_field(writer, "p99_us");
+    json_emit_u64(writer, seconds_to_us(percentile(samples, nr, 99)));
+    json_begin_field(writer, "max_us");
+    json_emit_u64(writer, seconds_to_us(samples[nr - 1]));
+    json_begin_field(writer, "histogram");
+    emit_histogram(writer, samples, nr);
+    json_end_object(writer);
+    json_end_record(writer);
+}
+
 int
 ping_main(const struct cmd_ping_info* info)
 {
+    bool summary = info->ping.count || info->ping.json;
+    unsigned rounds = info->ping.count
+        ? parse_ping_number(info->ping.count, "count")
+        : 1;
+    size_t size = info->ping.size
+        ? parse_ping_number(info->ping.size, "size")
+        : 1;
+    // We write a whole ping before reading any of it back, so it has
+    // to fit in the buffers between here and the device.
+    if (size > PING_MAX_SIZE)
+        die(EINVAL, "ping size %zu exceeds maximum of %u",
+            size, (unsigned) PING_MAX_SIZE);
+    int interval_ms = info->ping.interval
+        ? parse_ping_interval_ms(info->ping.interval)
+        : 0;
+
+    // Vary the bytes so we notice the device scrambling them.
+    char* sendbuf = xalloc(size);
+    char* recvbuf = xalloc(size);
+    for (size_t i = 0; i < size; ++i)
+        sendbuf[i] = '.' + i % 64;
+
     struct start_peer_info spi = {
         .adb = info->adb,
         .transport = info->transport,
@@ -37,13 +183,46 @@ ping_main(const struct cmd_ping_info* info)
         .io[STDIN_FILENO] = CHILD_IO_PIPE,
         .io[STDOUT_FILENO] = CHILD_IO_PIPE,
     };
+
+    // The first round trip waits for the session to come up, so it
+    // tells us how long setup took and doesn't count as a sample.
+    double time_start = ping_now();
     struct child* peer = start_peer(
         &spi, strlist_from_argv(ARGV("_echo")));
-    ping(peer);
-    double time_ping = seconds_since_epoch();
-    ping(peer);
-    double time_pong = seconds_since_epoch();
-    xprintf(xstdout, "%gms", (time_pong - time_ping) * 1000.0);
+    ping(peer, sendbuf, recvbuf, size);
+    double setup = ping_now() - time_start;
+
+    double* samples = xalloc(rounds * sizeof (*samples));
+    double total = 0;
+    for (unsigned i = 0; i < rounds; ++i) {
+        if (i > 0 && interval_ms > 0)
+            (void) xpoll(NULL, 0, interval_ms);
+        double time_ping = ping_now();
+        ping(peer, sendbuf, recvbuf, size);
+        samples[i] = ping_now() - time_ping;
+        total += samples[i];
+    }
+
+    if (!summary) {
+        xprintf(xstdout, "%gms", samples[0] * 1000.0);
+        return 0;
+    }
+
+    qsort(samples, rounds, sizeof (*samples), compare_doubles);
+    if (info->ping.json) {
+        print_ping_json(setup, samples, rounds, size, total);
+        return 0;
+    }
+
+    xprintf(xstdout, "setup %.3fms\n", setup * 1000.0);
+    xprintf(xstdout,
+            "%u round trips of %zu bytes: "
+            "min/avg/p50/p99/max = %.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+            rounds, size,
+            samples[0] * 1000.0,
+            total / rounds * 1000.0,
+            percentile(samples, rounds, 50) * 1000.0,
+            percentile(samples, rounds, 99) * 1000.0,
+            samples[rounds - 1] * 1000.0);
     return 0;
 }
-
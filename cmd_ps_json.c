@@ -12,10 +12,16 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <poll.h>
 #include "util.h"
 #include "autocmd.h"
 #include "fs.h"
 #include "json.h"
+#include "tree.h"
+
+#ifndef __unused
+# define __unused __attribute__((unused))
+#endif
 
 #if FBADB_MAIN
 
@@ -87,50 +93,228 @@ compar_pids(const void* ap, const void* bp)
     return (a < b) ? -1 : a != b;
 }
 
+struct ps_ctx;
+
 struct pid_field {
     const char* name;
-    void (*emit)(struct json_writer*, uint32_t pid);
+    void (*emit)(struct json_writer*, struct ps_ctx*, uint32_t pid);
+    bool by_default;
+};
+
+struct ps_ctx {
+    int procfd;
+    struct reslist* rl; // Owns buf
+    struct growable_buffer buf; // Holds whatever we read last
+    const bool* want; // Indexed like pid_fields
+    enum json_format format;
 };
 
+// Read /proc/PID/NAME into CTX's buffer, which we NUL-terminate and
+// return.  The contents last only until the next read.
+static char*
+read_proc_file(struct ps_ctx* ctx,
+               uint32_t pid,
+               const char* name,
+               size_t* size_out)
+{
+    char path[64];
+    snprintf(path, sizeof (path), "%u/%s", pid, name);
+    int fd = openat(ctx->procfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        die_errno("open(\"/proc/%s\")", path);
+
+    size_t size = 0;
+    for (;;) {
+        if (ctx->buf.bufsz - size < 2) {
+            WITH_CURRENT_RESLIST(ctx->rl);
+            grow_buffer_dwim(&ctx->buf);
+        }
+        ssize_t nr_read = read(fd, ctx->buf.buf + size, ctx->buf.bufsz - size - 1);
+        if (nr_read == 0)
+            break;
+        if (nr_read == -1 && errno == EINTR)
+            continue;
+        if (nr_read == -1) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            die_errno("read(\"/proc/%s\")", path);
+        }
+        size += nr_read;
+    }
+
+    close(fd);
+    ctx->buf.buf[size] = '\0';
+    if (size_out)
+        *size_out = size;
+    return (char*) ctx->buf.buf;
+}
+
 static void
-pid_emit_cmdline(struct json_writer* writer, uint32_t pid)
+emit_nul_separated(struct json_writer* writer, const char* pos, size_t size)
 {
-    int cmdline_file =
-        xopen(xaprintf("/proc/%u/cmdline", pid), O_RDONLY, 0);
-    size_t cmdlinesz;
-    char* cmdline = slurp_fd(cmdline_file, &cmdlinesz);
-    char* cmdline_end = cmdline + cmdlinesz;
+    const char* end = pos + size;
     json_begin_array(writer);
-    while (cmdline < cmdline_end) {
-        json_emit_string(writer, cmdline);
-        cmdline += strlen(cmdline) + 1;
+    while (pos < end) {
+        json_emit_string(writer, pos);
+        pos += strlen(pos) + 1;
     }
     json_end_array(writer);
 }
 
 static void
-pid_emit_environ(struct json_writer* writer, uint32_t pid)
+pid_emit_cmdline(struct json_writer* writer, struct ps_ctx* ctx, uint32_t pid)
+{
+    size_t cmdlinesz;
+    char* cmdline = read_proc_file(ctx, pid, "cmdline", &cmdlinesz);
+    emit_nul_separated(writer, cmdline, cmdlinesz);
+}
+
+static void
+pid_emit_environ(struct json_writer* writer, struct ps_ctx* ctx, uint32_t pid)
 {
-    int environ_file =
-        xopen(xaprintf("/proc/%u/environ", pid), O_RDONLY, 0);
     size_t environsz;
-    char* environ_pos = slurp_fd(environ_file, &environsz);
-    char* environ_end = environ_pos + environsz;
-    json_begin_array(writer);
-    while (environ_pos < environ_end) {
-        json_emit_string(writer, environ_pos);
-        environ_pos += strlen(environ_pos) + 1;
+    char* environ_pos = read_proc_file(ctx, pid, "environ", &environsz);
+    emit_nul_separated(writer, environ_pos, environsz);
+}
+
+// Split the fields of a /proc/PID/stat line that follow the command
+// name, storing the first NR of them in FIELDS.  The command name in
+// parentheses can contain anything, including spaces and
+// parentheses, so we find its end from the right.
+static void
+split_stat_line(char* line, uint32_t pid, char** comm, char** fields, size_t nr)
+{
+    char* open = strchr(line, '(');
+    char* close = strrchr(line, ')');
+    if (open == NULL || close == NULL || close < open)
+        die(EINVAL, "bad stat line for %u", pid);
+    *close = '\0';
+    *comm = open + 1;
+    char* saveptr = NULL;
+    char* pos = close + 1;
+    for (size_t i = 0; i < nr; ++i) {
+        fields[i] = strtok_r(pos, " \n", &saveptr);
+        if (fields[i] == NULL)
+            die(EINVAL, "bad stat line for %u", pid);
+        pos = NULL;
     }
-    json_end_array(writer);
+}
+
+// Fields of /proc/PID/stat, numbered as in proc(5).
+#define STAT_FIRST_AFTER_COMM 3
+#define STAT_STARTTIME 22
+
+static void
+pid_emit_stat(struct json_writer* writer, struct ps_ctx* ctx, uint32_t pid)
+{
+    static const struct {
+        const char* name;
+        unsigned number;
+        bool is_signed;
+    } stat_fields[] = {
+        { "ppid", 4 },
+        { "pgrp", 5 },
+        { "session", 6 },
+        { "minflt", 10 },
+        { "majflt", 12 },
+        { "utime", 14 },
+        { "stime", 15 },
+        { "priority", 18, true },
+        { "nice", 19, true },
+        { "num_threads", 20 },
+        { "starttime", STAT_STARTTIME },
+        { "vsize", 23 },
+        { "rss", 24 },
+        { "processor", 39 },
+    };
+
+    char* comm;
+    char* fields[39 - STAT_FIRST_AFTER_COMM + 1];
+    split_stat_line(read_proc_file(ctx, pid, "stat", NULL),
+                    pid, &comm, fields, ARRAYSIZE(fields));
+
+    json_begin_object(writer);
+    json_begin_field(writer, "comm");
+    json_emit_string(writer, comm);
+    json_begin_field(writer, "state");
+    json_emit_string(writer, fields[0]);
+    for (size_t i = 0; i < ARRAYSIZE(stat_fields); ++i) {
+        const char* text = fields[stat_fields[i].number - STAT_FIRST_AFTER_COMM];
+        json_begin_field(writer, stat_fields[i].name);
+        if (stat_fields[i].is_signed)
+            json_emit_i64(writer, strtoll(text, NULL, 10));
+        else
+            json_emit_u64(writer, strtoull(text, NULL, 10));
+    }
+    json_end_object(writer);
+}
+
+static void
+pid_emit_statm(struct json_writer* writer, struct ps_ctx* ctx, uint32_t pid)
+{
+    static const char* const statm_fields[] = {
+        "size", "resident", "shared", "text", "lib", "data", "dt",
+    };
+
+    char* pos = read_proc_file(ctx, pid, "statm", NULL);
+    json_begin_object(writer);
+    json_begin_field(writer, "page_size");
+    json_emit_u64(writer, (uint64_t) sysconf(_SC_PAGESIZE));
+    for (size_t i = 0; i < ARRAYSIZE(statm_fields); ++i) {
+        json_begin_field(writer, statm_fields[i]);
+        json_emit_u64(writer, strtoull(pos, &pos, 10));
+    }
+    json_end_object(writer);
+}
+
+static void
+pid_emit_status(struct json_writer* writer, struct ps_ctx* ctx, uint32_t pid)
+{
+    char* saveptr = NULL;
+    json_begin_object(writer);
+    for (char* line = strtok_r(read_proc_file(ctx, pid, "status", NULL),
+                               "\n",
+                               &saveptr);
+         line != NULL;
+         line = strtok_r(NULL, "\n", &saveptr))
+    {
+        char* colon = strchr(line, ':');
+        if (colon == NULL)
+            continue;
+        *colon = '\0';
+        char* value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+            value += 1;
+        json_begin_field(writer, line);
+        json_emit_string(writer, value);
+    }
+    json_end_object(writer);
+}
+
+static void
+pid_emit_oom_score_adj(struct json_writer* writer,
+                       struct ps_ctx* ctx,
+                       uint32_t pid)
+{
+    char* text = read_proc_file(ctx, pid, "oom_score_adj", NULL);
+    json_emit_i64(writer, strtoll(text, NULL, 10));
 }
 
 static const struct pid_field pid_fields[] = {
-    { "cmdline", pid_emit_cmdline },
-    { "environ", pid_emit_environ },
+    { "cmdline", pid_emit_cmdline, true },
+    { "environ", pid_emit_environ, true },
+    { "stat", pid_emit_stat },
+    { "statm", pid_emit_statm },
+    { "status", pid_emit_status },
+    { "oom_score_adj", pid_emit_oom_score_adj },
 };
 
+#define NR_PID_FIELDS ARRAYSIZE(pid_fields)
+
 struct emit_field_ctx {
     struct json_writer* writer;
+    struct ps_ctx* ps;
     uint32_t pid;
     const struct pid_field* field;
 };
@@ -139,11 +323,12 @@ static void
 emit_pid_field_1(void* data)
 {
     struct emit_field_ctx* ctx = data;
-    ctx->field->emit(ctx->writer, ctx->pid);
+    ctx->field->emit(ctx->writer, ctx->ps, ctx->pid);
 }
 
 static void
 emit_pid_field(struct json_writer* writer,
+               struct ps_ctx* ps,
                uint32_t pid,
                const struct pid_field* field)
 {
@@ -153,6 +338,7 @@ emit_pid_field(struct json_writer* writer,
     json_begin_field(writer, "value");
     struct emit_field_ctx ctx = {
         .writer = writer,
+        .ps = ps,
         .pid = pid,
         .field = field,
     };
@@ -172,13 +358,247 @@ emit_pid_field(struct json_writer* writer,
     json_end_object(writer);
 }
 
+// A process we've reported in --watch mode.  A PID alone doesn't
+// name a process, since the kernel reuses PIDs, so we key on the
+// PID and the process's start time.
+struct watched_proc {
+    RB_ENTRY(watched_proc) link;
+    uint32_t pid;
+    uint64_t start_time;
+    struct reslist* rl; // Owns this entry
+    unsigned generation;
+    char* cmdline;
+    size_t cmdlinesz;
+};
+
+static int
+watched_proc_cmp(struct watched_proc* left, struct watched_proc* right)
+{
+    if (left->pid != right->pid)
+        return left->pid < right->pid ? -1 : 1;
+    if (left->start_time != right->start_time)
+        return left->start_time < right->start_time ? -1 : 1;
+    return 0;
+}
+
+RB_HEAD(watched_procs, watched_proc);
+RB_PROTOTYPE_STATIC(watched_procs, watched_proc, link, watched_proc_cmp);
+RB_GENERATE_STATIC(watched_procs, watched_proc, link, watched_proc_cmp);
+
+// Return the start time, in clock ticks since boot, of process PID,
+// or die if it's gone.
+static uint64_t
+read_start_time(struct ps_ctx* ctx, uint32_t pid)
+{
+    char* comm;
+    char* fields[STAT_STARTTIME - STAT_FIRST_AFTER_COMM + 1];
+    split_stat_line(read_proc_file(ctx, pid, "stat", NULL),
+                    pid, &comm, fields, ARRAYSIZE(fields));
+    return strtoull(fields[STAT_STARTTIME - STAT_FIRST_AFTER_COMM], NULL, 10);
+}
+
+struct watch_sample {
+    struct ps_ctx* ps;
+    uint32_t pid;
+    uint64_t start_time;
+    char* cmdline;
+    size_t cmdlinesz;
+};
+
+static void
+watch_sample_1(void* data)
+{
+    struct watch_sample* sample = data;
+    sample->start_time = read_start_time(sample->ps, sample->pid);
+    sample->cmdline = read_proc_file(sample->ps,
+                                     sample->pid,
+                                     "cmdline",
+                                     &sample->cmdlinesz);
+}
+
+static void
+emit_watch_event(struct ps_ctx* ps,
+                 const char* event,
+                 const struct watched_proc* proc,
+                 bool with_fields)
+{
+    struct json_writer* writer = json_writer_create_format(xstdout, ps->format);
+    json_begin_object(writer);
+    json_begin_field(writer, "event");
+    json_emit_string(writer, event);
+    json_begin_field(writer, "pid");
+    json_emit_u64(writer, proc->pid);
+    json_begin_field(writer, "start_time");
+    json_emit_u64(writer, proc->start_time);
+    if (with_fields) {
+        json_begin_field(writer, "cmdline");
+        json_begin_object(writer);
+        json_begin_field(writer, "value");
+        emit_nul_separated(writer, proc->cmdline, proc->cmdlinesz);
+        json_end_object(writer);
+    }
+    // We've already read the command line, and other fields we
+    // report only when we first see a process.
+    if (strcmp(event, "spawn") == 0)
+        for (size_t i = 0; i < NR_PID_FIELDS; ++i)
+            if (ps->want[i] && pid_fields[i].emit != pid_emit_cmdline)
+                emit_pid_field(writer, ps, proc->pid, &pid_fields[i]);
+    json_end_object(writer);
+    json_end_record(writer);
+}
+
+struct watch_state {
+    struct ps_ctx* ps;
+    struct watched_procs procs;
+    struct reslist* rl; // Owns the entries' reslists
+    unsigned generation;
+};
+
+static void
+watch_note_pid(struct watch_state* ws, uint32_t pid)
+{
+    SCOPED_RESLIST(rl);
+    struct watch_sample sample = { .ps = ws->ps, .pid = pid };
+    struct errinfo ei = { 0 };
+    if (catch_error(watch_sample_1, &sample, &ei))
+        return; // Exited while we looked; it'll show up as gone
+
+    struct watched_proc search = {
+        .pid = pid,
+        .start_time = sample.start_time,
+    };
+    struct watched_proc* proc = RB_FIND(watched_procs, &ws->procs, &search);
+    if (proc == NULL) {
+        WITH_CURRENT_RESLIST(ws->rl);
+        struct reslist* proc_rl = reslist_create();
+        WITH_CURRENT_RESLIST(proc_rl);
+        proc = xcalloc(sizeof (*proc));
+        proc->pid = pid;
+        proc->start_time = sample.start_time;
+        proc->rl = proc_rl;
+        proc->cmdline = xalloc(sample.cmdlinesz + 1);
+        memcpy(proc->cmdline, sample.cmdline, sample.cmdlinesz);
+        proc->cmdlinesz = sample.cmdlinesz;
+        RB_INSERT(watched_procs, &ws->procs, proc);
+        emit_watch_event(ws->ps, "spawn", proc, true);
+    } else if (sample.cmdlinesz > 0 &&
+               (proc->cmdlinesz != sample.cmdlinesz ||
+                memcmp(proc->cmdline, sample.cmdline, sample.cmdlinesz) != 0))
+    {
+        // Processes can rewrite their argument vectors, as zygote's
+        // children do when they become an app.  (An empty command
+        // line just means a zombie, which we'll soon report gone.)
+        WITH_CURRENT_RESLIST(proc->rl);
+        proc->cmdline = xalloc(sample.cmdlinesz + 1);
+        memcpy(proc->cmdline, sample.cmdline, sample.cmdlinesz);
+        proc->cmdlinesz = sample.cmdlinesz;
+        emit_watch_event(ws->ps, "change", proc, true);
+    }
+
+    proc->generation = ws->generation;
+}
+
+// Return whether we should keep watching after waiting INTERVAL_MS.
+static bool
+watch_wait(unsigned interval_ms)
+{
+    // Our peer closing our standard input means nobody's listening.
+    struct pollfd p = { .fd = STDIN_FILENO, .events = POLLIN };
+    if (xpoll(&p, 1, interval_ms) <= 0)
+        return true;
+    char c;
+    return read(STDIN_FILENO, &c, 1) > 0;
+}
+
+static int
+ps_json_watch(DIR* procdir, struct ps_ctx* ps, unsigned interval_ms)
+{
+    struct watch_state ws = {
+        .ps = ps,
+        .rl = reslist_create(),
+    };
+    RB_INIT(&ws.procs);
+
+    for (ws.generation = 1;; ++ws.generation) {
+        SCOPED_RESLIST(rl);
+        uint32_t* pids;
+        size_t nr_pids;
+        slurp_pids(procdir, &pids, &nr_pids);
+        qsort(pids, nr_pids, sizeof (pids[0]), compar_pids);
+        for (size_t i = 0; i < nr_pids; ++i)
+            watch_note_pid(&ws, pids[i]);
+
+        struct watched_proc* proc;
+        struct watched_proc* next;
+        for (proc = RB_MIN(watched_procs, &ws.procs); proc != NULL; proc = next) {
+            next = RB_NEXT(watched_procs, &ws.procs, proc);
+            if (proc->generation != ws.generation) {
+                emit_watch_event(ps, "exit", proc, false);
+                RB_REMOVE(watched_procs, &ws.procs, proc);
+                reslist_destroy(proc->rl);
+            }
+        }
+
+        xflush(xstdout);
+        if (!watch_wait(interval_ms))
+            return 0;
+    }
+}
+
+static const bool*
+parse_fields(const char* spec)
+{
+    bool* want = xcalloc(NR_PID_FIELDS * sizeof (*want));
+    if (spec == NULL) {
+        for (size_t i = 0; i < NR_PID_FIELDS; ++i)
+            want[i] = pid_fields[i].by_default;
+        return want;
+    }
+
+    char* saveptr = NULL;
+    for (char* name = strtok_r(xstrdup(spec), ",", &saveptr);
+         name != NULL;
+         name = strtok_r(NULL, ",", &saveptr))
+    {
+        size_t i = 0;
+        while (i < NR_PID_FIELDS && strcmp(pid_fields[i].name, name) != 0)
+            i += 1;
+        if (i == NR_PID_FIELDS)
+            die(EINVAL, "unknown field %s", name);
+        want[i] = true;
+    }
+
+    return want;
+}
+
 int
 ps_json_main(const struct cmd_ps_json_info* info)
 {
     DIR* procdir = xopendir("/proc");
+    struct ps_ctx ps = {
+        .procfd = dirfd(procdir),
+        .rl = reslist_create(),
+        .want = parse_fields(info->ps.fields),
+        .format = info->ps.format
+        ? json_format_from_name(info->ps.format)
+        : JSON_FORMAT_TEXT,
+    };
+
+    if (info->ps.watch) {
+        char* endptr = NULL;
+        errno = 0;
+        unsigned long interval_ms = strtoul(info->ps.watch, &endptr, 10);
+        if (errno != 0 || endptr == info->ps.watch || *endptr != '\0' ||
+            interval_ms == 0 || interval_ms > INT_MAX)
+        {
+            die(EINVAL, "invalid interval: %s", info->ps.watch);
+        }
+        return ps_json_watch(procdir, &ps, (unsigned) interval_ms);
+    }
+
     uint32_t* pids;
     size_t nr_pids;
-    struct json_writer* writer = json_writer_create(xstdout);
+    struct json_writer* writer = json_writer_create_format(xstdout, ps.format);
 
     json_begin_array(writer);
 
@@ -189,9 +609,9 @@ ps_json_main(const struct cmd_ps_json_info* info)
         json_begin_object(writer);
         json_begin_field(writer, "pid");
         json_emit_u64(writer, pids[i]);
-        for (size_t j = 0; j < ARRAYSIZE(pid_fields); ++j) {
-            emit_pid_field(writer, pids[i], &pid_fields[j]);
-        }
+        for (size_t j = 0; j < NR_PID_FIELDS; ++j)
+            if (ps.want[j])
+                emit_pid_field(writer, &ps, pids[i], &pid_fields[j]);
         json_end_object(writer);
     }
 
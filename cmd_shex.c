@@ -20,6 +20,7 @@
 #include <ctype.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include "util.h"
 #include "child.h"
@@ -32,6 +33,7 @@
 #include "adbenc.h"
 #include "constants.h"
 #include "adb.h"
+#include "adbserver.h"
 #include "chat.h"
 #include "stubs.h"
 #include "timestamp.h"
@@ -45,6 +47,14 @@
 #include "errcodes.h"
 #include "peer.h"
 #include "fdrecorder.h"
+#include "mux.h"
+#include "timing.h"
+#include "devinfo.h"
+#include "sha2.h"
+#include "stripe.h"
+#include "json.h"
+#include "hashcache.h"
+#include "lz4.h"
 
 #define ARG_DEFAULT_SH ((const char*)MSG_CMDLINE_DEFAULT_SH)
 #define ARG_DEFAULT_SH_LOGIN ((const char*)MSG_CMDLINE_DEFAULT_SH_LOGIN)
@@ -63,15 +73,40 @@ enum transport_type {
 struct transport {
     enum transport_type type;
     const char* tcp_addr;
+    unsigned tcp_bufsz; // Zero for the kernel's choice
 };
 
 typedef void (*writer_function)(int, const void*, size_t);
 
+// Bytes collected for a MSG_EXEC_REQUEST.  The buffer begins with
+// room for the request header.
+struct tc_batch {
+    struct growable_buffer gb;
+    size_t size;
+};
+
+// Our ends of a local stub's shared memory transport
+struct childcom_shm {
+    struct shmring* to_stub;
+    struct fdh* to_stub_bell;
+    struct shmring* from_stub;
+    struct fdh* from_stub_bell;
+};
+
 struct childcom {
     struct fdh* to_child;
     struct fdh* from_child;
     writer_function writer;
     bool old_adb_detected;
+    struct tc_batch* batch; // Non-NULL while collecting an exec request
+    struct childcom_shm* shm; // Non-NULL if the stub has our shm rings
+    bool device_socket; // Connected to an abstract socket on the device
+#ifdef HAVE_LOCAL_STUB
+    bool local;
+#endif
+    struct fdh* stripes[MAX_STRIPES]; // Extra connections; 0 unused
+    unsigned nr_stripes;
+    struct chat* cc; // Reads hellos; may hold the start of the protocol
 };
 
 struct adb_info {
@@ -84,7 +119,53 @@ tc_write(const struct childcom* tc,
          const void* buf,
          size_t sz)
 {
-    tc->writer(tc->to_child->fd, buf, sz);
+    struct tc_batch* batch = tc->batch;
+    if (batch == NULL) {
+        tc->writer(tc->to_child->fd, buf, sz);
+        return;
+    }
+
+    size_t new_size;
+    if (SATADD(&new_size, batch->size, sz))
+        die_oom();
+    while (batch->gb.bufsz < new_size)
+        grow_buffer_dwim(&batch->gb);
+    memcpy(batch->gb.buf + batch->size, buf, sz);
+    batch->size = new_size;
+}
+
+// Until tc_batch_send, collect what we'd send so that it goes to the
+// peer as one MSG_EXEC_REQUEST.  Only the messages the stub reads
+// while gathering its child's command line may be batched.
+static void
+tc_batch_begin(struct childcom* tc)
+{
+    assert(tc->batch == NULL);
+    struct tc_batch* batch = xcalloc(sizeof (*batch));
+    batch->size = sizeof (struct msg_exec_request);
+    grow_buffer(&batch->gb, 4096);
+    tc->batch = batch;
+}
+
+static void
+tc_batch_send(struct childcom* tc)
+{
+    struct tc_batch* batch = tc->batch;
+    tc->batch = NULL;
+
+    size_t payload_size = batch->size - sizeof (struct msg_exec_request);
+    if (payload_size > UINT32_MAX)
+        die(EINVAL, "command too long");
+
+    struct msg_exec_request m = {
+        .msg.type = MSG_EXEC_REQUEST,
+        .msg.size = sizeof (m),
+        .payload_size = payload_size,
+    };
+
+    dbgmsg(&m.msg, "tc_batch_send");
+    memcpy(batch->gb.buf, &m, sizeof (m));
+    tc_write(tc, batch->gb.buf, batch->size);
 }
 
 static void
@@ -95,16 +176,24 @@ tc_sendmsg(const struct childcom* tc,
     tc_write(tc, m, m->size);
 }
 
+static size_t
+tc_chat_reader(void* data, void* buf, size_t sz)
+{
+    return chat_read_all((struct chat*) data, buf, sz);
+}
+
+// Read messages through the chat, since it may have read the first
+// bytes of the protocol along with the last hello.
 static struct msg*
 tc_recvmsg(const struct childcom* tc)
 {
-    return read_msg(tc->from_child->fd, read_all);
+    return read_msg_ctx(tc_chat_reader, tc->cc);
 }
 
 static struct chat*
-tc_chat_new(const struct childcom* tc)
+tc_chat(const struct childcom* tc)
 {
-    return chat_new(tc->to_child->fd, tc->from_child->fd);
+    return tc->cc;
 }
 
 struct child_hello {
@@ -112,12 +201,17 @@ struct child_hello {
     unsigned abi_mask;
     unsigned uid;
     unsigned api_level;
+    char boot_id[FB_ADB_BOOT_ID_LENGTH+1];
+    struct chat* cc; // Read the hello; set only when starting a stub
 };
 
 struct fb_adb_shex {
     struct fb_adb_sh sh;
     int child_exit_status;
     bool child_exited;
+#ifdef HAVE_TIMING
+    bool saw_child_data;
+#endif
 };
 
 static bool
@@ -129,14 +223,66 @@ parse_child_hello(const char* line, struct child_hello* chello)
            &chello->abi_mask,
            &chello->uid,
            &chello->api_level,
+           &chello->boot_id[0],
            &n);
 
     return n != -1;
 }
 
+// Decompress the first BUFSZ bytes of STUB (or all of it, if it's
+// smaller) into BUF.  Return the number of bytes we produced.
+static size_t
+stub_inflate_prefix(const struct fbadb_stub* stub, void* buf, size_t bufsz)
+{
+    size_t want = XMIN(bufsz, stub->size);
+    int ret = LZ4_decompress_safe_partial(stub->zdata, buf,
+                                          stub->zsize, want, want);
+    if (ret < 0 || (size_t) ret < want)
+        die(EINVAL, "corrupt embedded stub");
+    return want;
+}
+
+// Decompress STUB into a new buffer owned by the current reslist.
+static const void*
+stub_inflate(const struct fbadb_stub* stub)
+{
+    void* data = xalloc(stub->size);
+    stub_inflate_prefix(stub, data, stub->size);
+    return data;
+}
+
 #ifdef HAVE_LOCAL_STUB
+#ifdef HAVE_SHM_TRANSPORT
+// A local stub can share memory with us, so hand it a pair of rings
+// for the peer channels.  It keeps its standard input and output for
+// the setup messages that come before the channels.  Our copies of
+// the stub's ends belong to the current reslist; everything we keep
+// belongs to KEEP_RL.
+static const char*
+offer_shm_transport(struct reslist* keep_rl, struct childcom_shm** shm_out)
+{
+    struct shm_transport* st = shm_transport_new();
+    allow_inherit(st->memfd);
+    allow_inherit(st->to_stub[1]);
+    allow_inherit(st->from_stub[1]);
+
+    WITH_CURRENT_RESLIST(keep_rl);
+    struct childcom_shm* shm = xcalloc(sizeof (*shm));
+    shm->to_stub = shmring_open(st->memfd, 0, true);
+    shm->to_stub_bell = fdh_dup(st->to_stub[0]);
+    shm->from_stub = shmring_open(st->memfd, 1, false);
+    shm->from_stub_bell = fdh_dup(st->from_stub[0]);
+    *shm_out = shm;
+
+    return xaprintf("--shm-transport=%d,%d,%d",
+                    st->memfd,
+                    st->to_stub[1],
+                    st->from_stub[1]);
+}
+#endif
+
 static struct child*
-start_stub_local(struct child_hello* chello)
+start_stub_local(struct child_hello* chello, struct childcom_shm** shm_out)
 {
     SCOPED_RESLIST(rl);
 
@@ -169,7 +315,7 @@ start_stub_local(struct child_hello* chello)
             int tmpfd = xopen(stub_exe_tmp_name,
                               O_CREAT | O_EXCL | O_WRONLY,
                               0700);
-            write_all(tmpfd, stubs[0].data, stubs[0].size);
+            write_all(tmpfd, stub_inflate(&stubs[0]), stubs[0].size);
             WITH_CURRENT_RESLIST(rl);
             exefd = xopen(stub_exe_tmp_name, O_RDONLY, 0);
             xrename(stub_exe_tmp_name, stub_exe_name);
@@ -178,23 +324,42 @@ start_stub_local(struct child_hello* chello)
 
     allow_inherit(exefd);
 
-    const struct child_start_info csi = {
-        .io[STDIN_FILENO] = CHILD_IO_PIPE,
-        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
-        .io[STDERR_FILENO] = CHILD_IO_RECORD,
-        .exename = xaprintf("/proc/self/fd/%d", exefd),
-        .argv = ARGV(stub_exe_name, "stub"),
-    };
-
     SCOPED_RESLIST(rl_child);
-    struct child* child = child_start(&csi);
+    struct child* child;
+    {
+        // Close our copies of the stub's ends of the shm transport
+        // once the stub has them.
+        SCOPED_RESLIST(rl_shm_offer);
+        const char* argv[] = { stub_exe_name, "stub", NULL, NULL };
+        *shm_out = NULL;
+#ifdef HAVE_SHM_TRANSPORT
+        if (!getenv("FB_ADB_NO_SHM"))
+            argv[2] = offer_shm_transport(rl_child, shm_out);
+#endif
+
+        const struct child_start_info csi = {
+            .io[STDIN_FILENO] = CHILD_IO_PIPE,
+            .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+            .io[STDERR_FILENO] = CHILD_IO_RECORD,
+            .exename = xaprintf("/proc/self/fd/%d", exefd),
+            .argv = argv,
+        };
+
+        WITH_CURRENT_RESLIST(rl_child);
+        child = child_start(&csi);
+    }
+
     install_child_error_converter(child);
-    WITH_CURRENT_RESLIST(rl);
 
+    struct chat* cc;
+    {
+        WITH_CURRENT_RESLIST(rl_child);
+        cc = chat_new(child->fd[STDIN_FILENO]->fd,
+                      child->fd[STDOUT_FILENO]->fd);
+    }
+
+    WITH_CURRENT_RESLIST(rl);
     char* resp;
-    struct chat* cc = chat_new(
-        child->fd[STDIN_FILENO]->fd,
-        child->fd[STDOUT_FILENO]->fd);
 
     do {
         resp = chat_read_line(cc);
@@ -206,32 +371,42 @@ start_stub_local(struct child_hello* chello)
     if (strcmp(chello->ver, build_fingerprint) != 0)
         die(ERR_FINGERPRINT_MISMATCH, "stale stub?!");
 
+    chello->cc = cc;
     reslist_xfer(rl->parent, rl_child);
     return child;
 }
 #endif
 
-static void
-send_stub(const void* data,
-          size_t datasz,
+// Push STUB to ADB_NAME on the device.  If PROPS is not NULL,
+// don't bother pushing a stub that can't run there, and return false
+// instead.
+static bool
+send_stub(const struct fbadb_stub* stub,
+          const struct adb_device_props* props,
           const char* const* adb_args,
           const char* adb_name)
 {
     SCOPED_RESLIST(rl);
-    const char* tmpfilename;
-    int tmpfile = xnamed_tempfile(&tmpfilename);
-    write_all(tmpfile, data, datasz);
+    double span_start = timing_span_begin();
+    // The ELF header is all we need to rule a stub out, so don't
+    // decompress the rest of stubs we won't send.
+    char elf_header[64];
+    if (props != NULL &&
+        !elf_compatible_buf_p(elf_header,
+                              stub_inflate_prefix(stub, elf_header,
+                                                  sizeof (elf_header)),
+                              props->api_level, props->abi_mask))
+    {
+        dbg("skipping stub incompatible with device");
+        return false;
+    }
 
-    // N.B. The device-side adb server helpfully copies the user
-    // permission bits to group and world, so if we were to make this
-    // file writable for us locally, we'd actually be making it
-    // world-writable on device!
-    if (fchmod(tmpfile, 0555 /* -r-xr-xr-x */) == -1)
-        die_errno("fchmod");
-    adb_send_file(tmpfilename, adb_name, adb_args);
+    adb_send_data(stub_inflate(stub), stub->size, 0555 /* -r-xr-xr-x */,
+                  adb_name, adb_args);
+    timing_span_end(span_start, "send-stub", adb_name);
+    return true;
 }
 
-
 static struct child*
 try_adb_stub_2(const struct child_start_info* csi,
                const char* adb_name,
@@ -240,6 +415,7 @@ try_adb_stub_2(const struct child_start_info* csi,
 {
     SCOPED_RESLIST(rl);
     struct child* child = child_start(csi);
+    timing_mark("adb-spawn", "shell");
     install_child_error_converter(child);
 
     struct chat* cc = chat_new(
@@ -288,11 +464,13 @@ try_adb_stub_2(const struct child_start_info* csi,
         resp = chat_read_line(cc);
     } while (clowny_output_line_p(resp));
     dbg("stub resp: [%s]", resp);
+    timing_mark("stub-hello", adb_name);
 
     if (parse_child_hello(resp, chello) &&
         !strcmp(chello->ver, build_fingerprint))
     {
         dbg("found good child version");
+        chello->cc = cc;
         reslist_xfer(rl->parent, rl);
         return child;
     }
@@ -412,6 +590,15 @@ static void
 delete_device_tmpfile_cleanup_1(void* data)
 {
     struct delete_device_tmpfile* ddt = data;
+    char* output;
+    int exit_status;
+    if (adb_server_shell(ddt->adb_args,
+                         xaprintf("</dev/null rm -f %s",
+                                  ddt->device_filename),
+                         &output,
+                         &exit_status))
+        return;
+
     const struct child_start_info csi = {
         .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
         .io[STDOUT_FILENO] = CHILD_IO_DEV_NULL,
@@ -449,19 +636,147 @@ add_cleanup_delete_device_tmpfile(const char* device_filename,
     cleanup_commit(cl, delete_device_tmpfile_cleanup, ddt);
 }
 
+// Remember what the hello CHELLO tells us about the device.  CACHED
+// is what we knew before, or NULL.  STUB_USED is the index in stubs
+// of the stub we just installed, or -1 if we didn't install one.
+static void
+note_device_hello(const char* const* adb_args,
+                  const struct device_info* cached,
+                  const struct child_hello* chello,
+                  int stub_used)
+{
+    struct device_info di = { .stub = -1 };
+    if (cached)
+        di = *cached;
+
+    bool changed = false;
+    if (strcmp(di.boot_id, chello->boot_id) != 0 ||
+        di.api_level != chello->api_level ||
+        di.abi_mask != chello->abi_mask)
+    {
+        // Rebooted, reflashed, or a different device altogether.
+        snprintf(di.boot_id, sizeof (di.boot_id), "%s", chello->boot_id);
+        di.api_level = chello->api_level;
+        di.abi_mask = chello->abi_mask;
+        di.stub = -1;
+        changed = true;
+    }
+
+    if (stub_used != -1 && di.stub != stub_used) {
+        di.stub = stub_used;
+        changed = true;
+    }
+
+    if (changed)
+        device_info_store(adb_args, &di);
+}
+
+// Push stubs to TMP_ADB one at a time until one runs, trying stub
+// number PREFERRED (unless it's -1) first and skipping stubs that
+// PROPS (if not NULL) says can't run.  On success, set *STUB_USED to
+// the stub's index.
+static struct child*
+send_and_try_stubs(struct try_adb_stub_memory* tasm,
+                   const char* const* adb_args,
+                   const char* tmp_adb,
+                   const struct adb_device_props* props,
+                   int preferred,
+                   struct child_hello* chello,
+                   char** err,
+                   int* stub_used)
+{
+    size_t ns = nr_stubs;
+    size_t first_stub = 0;
+#ifdef HAVE_LOCAL_STUB
+    first_stub = 1;
+#endif
+    if (preferred != -1 &&
+        ((size_t) preferred < first_stub || (size_t) preferred >= ns))
+    {
+        preferred = -1;
+    }
+
+    struct child* child = NULL;
+    bool sent_any = false;
+    for (size_t n = first_stub; n < ns && !child; ++n) {
+        // Visit PREFERRED first, then everything else in order.
+        size_t i = n;
+        if (preferred != -1) {
+            if (n == first_stub)
+                i = preferred;
+            else if (n <= (size_t) preferred)
+                i = n - 1;
+        }
+
+        if (send_stub(&stubs[i], props, adb_args, tmp_adb)) {
+            sent_any = true;
+            child = try_adb_stub(tasm, adb_args, tmp_adb, chello, err);
+            if (child)
+                *stub_used = (int) i;
+        }
+    }
+
+    if (!sent_any && props != NULL)
+        *err = xaprintf("no fb-adb stub is compatible with device "
+                        "(API level %u, ABI mask 0x%x)",
+                        props->api_level, props->abi_mask);
+
+    return child;
+}
+
 static struct child*
 start_stub_adb(const char* const* adb_args,
                struct child_hello* chello,
                bool* old_adb_detected)
 {
     struct try_adb_stub_memory tasm = { };
+    double span_start = timing_span_begin();
+
+    // If the device doesn't already have our stub, we'll need to know
+    // which of our stubs can run there.  If we haven't seen this
+    // device before, ask while we're waiting for the first stub
+    // attempt instead of afterward.
+    struct device_info di;
+    bool have_di = device_info_load(adb_args, &di);
+    struct adb_device_probe* probe = NULL;
+    if (!have_di)
+        probe = adb_device_probe_start(adb_args);
 
     struct child* child = NULL;
     char* err = NULL;
+    int stub_used = -1;
     child = try_adb_stub(
         &tasm, adb_args, FB_ADB_REMOTE_FILENAME, chello, &err);
 
     if (child == NULL) {
+        // A stale stub's hello describes the device just as well as
+        // the probe does, and we already have it.
+        struct adb_device_props props_buf;
+        struct adb_device_props* props = NULL;
+        bool props_from_cache = false;
+        struct child_hello stale_chello;
+        if (parse_child_hello(err, &stale_chello) &&
+            stale_chello.abi_mask != 0)
+        {
+            props_buf.api_level = stale_chello.api_level;
+            props_buf.abi_mask = stale_chello.abi_mask;
+            props = &props_buf;
+        } else if (have_di) {
+            props_buf.api_level = di.api_level;
+            props_buf.abi_mask = di.abi_mask;
+            props = &props_buf;
+            props_from_cache = true;
+        } else if (adb_device_probe_finish(probe, &props_buf)) {
+            props = &props_buf;
+            probe = NULL;
+        }
+
+        if (probe != NULL)
+            adb_device_probe_cancel(probe);
+
+        if (props != NULL && props->abi_mask == 0)
+            props = NULL; // Unknown ABI: just try everything
+
         char* tmp_adb = xaprintf(
             "%s.%s",
             FB_ADB_REMOTE_FILENAME,
@@ -469,14 +784,24 @@ start_stub_adb(const char* const* adb_args,
 
         add_cleanup_delete_device_tmpfile(tmp_adb, adb_args);
 
-        size_t ns = nr_stubs;
-        size_t first_stub = 0;
-#ifdef HAVE_LOCAL_STUB
-        first_stub = 1;
-#endif
-        for (unsigned i = first_stub; i < ns && !child; ++i) {
-            send_stub(stubs[i].data, stubs[i].size, adb_args, tmp_adb);
-            child = try_adb_stub(&tasm, adb_args, tmp_adb, chello, &err);
+        child = send_and_try_stubs(&tasm, adb_args, tmp_adb, props,
+                                   have_di ? di.stub : -1,
+                                   chello, &err, &stub_used);
+
+        if (!child && props_from_cache) {
+            // Our notes may describe some other device that used to
+            // have this serial number.  Ask this one.
+            dbg("cached device info did not work; probing device");
+            have_di = false;
+            props = NULL;
+            if (adb_device_probe_finish(adb_device_probe_start(adb_args),
+                                        &props_buf) &&
+                props_buf.abi_mask != 0)
+            {
+                props = &props_buf;
+            }
+            child = send_and_try_stubs(&tasm, adb_args, tmp_adb, props, -1,
+                                       chello, &err, &stub_used);
         }
 
         if (!child)
@@ -484,7 +809,8 @@ start_stub_adb(const char* const* adb_args,
 
         child_kill(child, SIGTERM);
         child_wait(child);
-        unsigned api_level = adb_api_level(adb_args);
+        // The stub we just ran told us the API level in its hello.
+        unsigned api_level = chello->api_level;
         dbg("device appears to have API level %u", api_level);
         adb_rename_file(tmp_adb,
                         FB_ADB_REMOTE_FILENAME,
@@ -495,9 +821,13 @@ start_stub_adb(const char* const* adb_args,
                              FB_ADB_REMOTE_FILENAME, chello, &err);
         if (!child)
             die(ECOMM, "trouble starting adb stub: %s", err);
+    } else if (probe != NULL) {
+        adb_device_probe_cancel(probe);
     }
 
+    note_device_hello(adb_args, have_di ? &di : NULL, chello, stub_used);
     *old_adb_detected = tasm.old_adb_detected;
+    timing_span_end(span_start, "start-stub-adb", NULL);
     return child;
 }
 
@@ -511,9 +841,23 @@ shex_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
         dbgmsg(&m.msg, "recv");
         shex->child_exited = true;
         shex->child_exit_status = m.exit_status;
+        timing_mark("child-exit", NULL);
         return;
     }
 
+#ifdef HAVE_TIMING
+    if (mhdr.type == MSG_CHANNEL_DATA ||
+        mhdr.type == MSG_CHANNEL_DATA_LZ4 ||
+        mhdr.type == MSG_CHANNEL_DATA_JUMBO)
+    {
+        struct fb_adb_shex* shex = (struct fb_adb_shex*) sh;
+        if (!shex->saw_child_data) {
+            shex->saw_child_data = true;
+            timing_mark("first-child-byte", NULL);
+        }
+    }
+#endif
+
     fb_adb_sh_process_msg(sh, mhdr);
 }
 
@@ -543,6 +887,7 @@ struct tty_flags {
     unsigned want_pty_p : 1;
     unsigned compress : 1;
     unsigned our_very_own_open_file_description : 1;
+    uint16_t lz4_acceleration;
 };
 
 struct msg_shex_hello*
@@ -559,6 +904,12 @@ make_hello_msg(size_t stdio_ringbufsz,
         m->si[i].bufsz = stdio_ringbufsz;
         m->si[i].pty_p = tty_flags[i].want_pty_p;
         m->si[i].compress = tty_flags[i].compress;
+        m->si[i].compress_stream = tty_flags[i].compress;
+        // The dictionary is device output; what we send the device
+        // is mostly file data and keystrokes.
+        m->si[i].compress_dict =
+            tty_flags[i].compress && i != STDIN_FILENO;
+        m->si[i].lz4_acceleration = tty_flags[i].lz4_acceleration;
     }
 
     m->posix_vdisable_value = _POSIX_VDISABLE;
@@ -829,7 +1180,7 @@ command_re_exec_as_root(const struct childcom* tc)
 
     tc_sendmsg(tc, &rmsg);
 
-    struct chat* cc = tc_chat_new(tc);
+    struct chat* cc = tc_chat(tc);
     char* resp;
 
     do {
@@ -880,7 +1231,7 @@ command_re_exec_as_user_1(void* arg)
     memcpy(m->username, want_user, want_user_length);
     tc_sendmsg(tc, &m->msg);
 
-    struct chat* cc = tc_chat_new(tc);
+    struct chat* cc = tc_chat(tc);
     char* resp;
 
     do {
@@ -966,8 +1317,11 @@ send_rebind_to_unix_socket_message(const struct childcom* tc,
     tc_write(tc, device_socket, device_socket_length);
 }
 
-static struct childcom*
-connect_to_device_socket(
+// Forward a fresh socket on the host to the abstract socket
+// DEVICE_SOCKET on the device and return the address of the local
+// end.  The forward lasts as long as the current reslist.
+static const struct addr*
+forward_device_socket(
     const char* const* adb_args,
     const char* device_socket)
 {
@@ -985,15 +1339,24 @@ connect_to_device_socket(
     adb_add_forward(local, remote, adb_args);
     cleanup_commit(ucl, unlink_cleanup, host_socket);
     remove_forward_cleanup_commit(crf);
+    dbg("forwarding local:%s remote:%s", local, remote);
+    return make_addr_unix_filesystem(host_socket);
+}
 
+static struct childcom*
+connect_to_device_socket(
+    const char* const* adb_args,
+    const char* device_socket)
+{
     int scon = xsocket(AF_UNIX, SOCK_STREAM, 0);
-    xconnect(scon, make_addr_unix_filesystem(host_socket));
+    xconnect(scon, forward_device_socket(adb_args, device_socket));
 
     struct childcom* ntc = xcalloc(sizeof (*ntc));
     ntc->from_child = fdh_dup(scon);
     ntc->to_child = fdh_dup(scon);
     ntc->writer = write_all;
-    dbg("AF_UNIX connection local:%s remote:%s", local, remote);
+    ntc->device_socket = true;
+    ntc->cc = chat_new(ntc->to_child->fd, ntc->from_child->fd);
     return ntc;
 }
 
@@ -1025,6 +1388,64 @@ reconnect_over_unix_socket(
     return connect_to_device_socket(adb_args, device_socket);
 }
 
+// Ask the stub for NR_STRIPES - 1 more connections over which to
+// stripe the session (see stripe.h) and make them.  Like
+// reconnect_over_unix_socket, wait for the stub to start listening
+// before connecting.
+static void
+open_stripes(struct childcom* tc,
+             const char* const* adb_args,
+             unsigned nr_stripes)
+{
+    SCOPED_RESLIST(rl);
+    char* device_socket =
+        xaprintf("%s/fb-adb-stripes-%s.sock",
+                 DEVICE_TEMP_DIR,
+                 gen_hex_random(10));
+
+    size_t device_socket_length = strlen(device_socket);
+    struct msg_open_stripes m;
+    size_t msgsz = sizeof (m) + device_socket_length;
+    if (msgsz > UINT16_MAX)
+        die(EINVAL, "socket name too long");
+
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_OPEN_STRIPES;
+    m.msg.size = msgsz;
+    m.nr_stripes = nr_stripes;
+    tc_write(tc, &m, sizeof (m));
+    tc_write(tc, device_socket, device_socket_length);
+
+    struct msg* reply = tc_recvmsg(tc);
+    if (reply->type != MSG_LISTENING_ON_SOCKET)
+        die(ECOMM, "child sent incorrect reply %u to stripe request",
+            (unsigned) reply->type);
+
+    const struct addr* addr;
+#ifdef HAVE_LOCAL_STUB
+    if (tc->local)
+        addr = make_addr_unix_abstract_s(device_socket);
+    else
+#endif
+        addr = forward_device_socket(adb_args, device_socket);
+
+    for (unsigned stripe = 1; stripe < nr_stripes; ++stripe) {
+        SCOPED_RESLIST(rl_stripe);
+        int scon = xsocket(AF_UNIX, SOCK_STREAM, 0);
+        xconnect(scon, addr);
+        struct msg_stripe_hello sh;
+        memset(&sh, 0, sizeof (sh));
+        sh.msg.type = MSG_STRIPE_HELLO;
+        sh.msg.size = sizeof (sh);
+        sh.stripe = stripe;
+        write_all(scon, &sh, sizeof (sh));
+        WITH_CURRENT_RESLIST(rl->parent);
+        tc->stripes[stripe] = fdh_dup(scon);
+    }
+
+    tc->nr_stripes = nr_stripes;
+}
+
 static struct child* monitored_child;
 
 static void
@@ -1077,9 +1498,11 @@ accept_die_on_sigchld(int sock, struct child* child)
 static struct childcom*
 reconnect_over_tcp_socket(const struct childcom* tc,
                           struct child* adb,
-                          const char* tcp_addr)
+                          struct transport transport)
 {
+    const char* tcp_addr = transport.tcp_addr;
     SCOPED_RESLIST(rl);
+    double span_start = timing_span_begin();
 
     static const struct addrinfo hints = {
         .ai_family = AF_INET,
@@ -1092,7 +1515,7 @@ reconnect_over_tcp_socket(const struct childcom* tc,
     str2gaiargs(tcp_addr, &node, &service);
 
     struct addrinfo* ai =
-        xgetaddrinfo_interruptible(node, service, &hints);
+        xgetaddrinfo_cached(node, service, &hints);
 
     while (ai && ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
         ai = ai->ai_next;
@@ -1106,6 +1529,8 @@ reconnect_over_tcp_socket(const struct childcom* tc,
 
     int v = 1;
     xsetsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &v, sizeof (v));
+    // Accepted connections inherit the buffer sizes.
+    (void) tune_tcp_socket(sock, transport.tcp_bufsz);
 
     // Bind to TCP socket and start accepting connections
     xbind(sock, addrinfo2addr(ai));
@@ -1120,6 +1545,7 @@ reconnect_over_tcp_socket(const struct childcom* tc,
         m.msg.size = sizeof (m);
         m.port = a->sin_port;
         m.addr = a->sin_addr.s_addr;
+        m.sockbufsz = transport.tcp_bufsz;
         tc_sendmsg(tc, &m.msg);
     } else if (ai->ai_family == AF_INET6) {
         struct msg_rebind_to_tcp6_socket m;
@@ -1130,6 +1556,7 @@ reconnect_over_tcp_socket(const struct childcom* tc,
         m.msg.size = sizeof (m);
         m.port = a->sin6_port;
         memcpy(&m.addr, a->sin6_addr.s6_addr, 16);
+        m.sockbufsz = transport.tcp_bufsz;
         tc_sendmsg(tc, &m.msg);
     } else {
         assert(!"invalid family");
@@ -1150,12 +1577,17 @@ reconnect_over_tcp_socket(const struct childcom* tc,
     }
 
     disable_tcp_nagle(conn);
+    char* tuning = tune_tcp_socket(conn, transport.tcp_bufsz);
+    dbg("tcp socket: %s", tuning);
+    timing_mark("tcp-socket", tuning);
 
     WITH_CURRENT_RESLIST(rl->parent);
     struct childcom* ntc = xcalloc(sizeof (*ntc));
     ntc->from_child = fdh_dup(conn);
     ntc->to_child = fdh_dup(conn);
     ntc->writer = write_all;
+    ntc->cc = chat_new(ntc->to_child->fd, ntc->from_child->fd);
+    timing_span_end(span_start, "reconnect-over-tcp-socket", tcp_addr);
     return ntc;
 }
 
@@ -1194,6 +1626,74 @@ parse_transport(const char* s)
     return transport;
 }
 
+// Parse the argument of --tcp-buffer-size.
+static unsigned
+parse_tcp_buffer_size(const char* s)
+{
+    if (!strcmp(s, "window"))
+        return MAX_CHANNEL_WINDOW;
+
+    char* endptr;
+    errno = 0;
+    unsigned long bufsz = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        bufsz == 0 || bufsz > INT_MAX)
+    {
+        die(EINVAL, "invalid TCP buffer size %s", s);
+    }
+
+    return bufsz;
+}
+
+// Parse the argument of --stripes.
+static unsigned
+parse_stripes(const char* s)
+{
+    char* endptr;
+    errno = 0;
+    unsigned long nr_stripes = strtoul(s, &endptr, 10);
+    if (endptr == s || *endptr != '\0' || errno != 0 ||
+        nr_stripes == 0 || nr_stripes > MAX_STRIPES)
+    {
+        die(EINVAL, "invalid stripe count %s: must be 1 through %u",
+            s, (unsigned) MAX_STRIPES);
+    }
+
+    return nr_stripes;
+}
+
+// Parse the argument of --compression-acceleration into LZ4
+// acceleration factors for data going to the device and data coming
+// from it.
+static void
+parse_compression_acceleration(const char* s,
+                               unsigned* to_device,
+                               unsigned* from_device)
+{
+    unsigned long level[2];
+    const char* p = s;
+    char* endptr;
+    unsigned nr_levels = 0;
+
+    do {
+        if (nr_levels > 0)
+            p = endptr + 1;
+        errno = 0;
+        level[nr_levels] = strtoul(p, &endptr, 10);
+        if (endptr == p || errno != 0 ||
+            level[nr_levels] > MAX_LZ4_ACCELERATION)
+        {
+            die(EINVAL, "invalid compression acceleration %s", s);
+        }
+    } while (++nr_levels < ARRAYSIZE(level) && *endptr == ',');
+
+    if (*endptr != '\0')
+        die(EINVAL, "invalid compression acceleration %s", s);
+
+    *to_device = level[0];
+    *from_device = level[nr_levels - 1];
+}
+
 static void
 forward_envvar(struct environ_op** inout_environ_ops, const char* name)
 {
@@ -1359,6 +1859,7 @@ struct shex_common_info {
     const char* command;
     const char** args;
     struct strlist* xcmd_candidates;
+    struct strlist* xcmd_preloads;
 };
 
 static struct environ_op*
@@ -1477,34 +1978,167 @@ send_open_exec_file(const struct childcom* tc,
     tc_write(tc, exe_basename, exe_basename_length);
 }
 
-static int
-find_xcmd_candidate(
-    const char* program,
-    const struct strlist* candidates,
-    unsigned api_level,
-    unsigned abi_mask)
-{
+struct xcmd_candidate {
+    const char* name;
+    struct reslist* rl; // Owns fd
+    int fd;
+    struct elf_id id;
+};
+
+// Open each of CANDIDATES and read its ELF header.  We do this before
+// we've heard from the device, while we'd otherwise just be waiting
+// for the stub, so that choosing a candidate later needs only the
+// device's API level and ABI mask.  Return the number of candidates
+// that are executables at all.
+static size_t
+probe_xcmd_candidates(const char* program,
+                      const struct strlist* candidates,
+                      struct xcmd_candidate** out)
+{
+    size_t nr_alloc = 0;
+    for (const char* candidate = strlist_rewind(candidates);
+         candidate != NULL;
+         candidate = strlist_next(candidates))
+    {
+        nr_alloc += 1;
+    }
+
+    struct xcmd_candidate* probed = xalloc(nr_alloc * sizeof (*probed));
+    size_t nr = 0;
     for (const char* candidate = strlist_rewind(candidates);
          candidate != NULL;
          candidate = strlist_next(candidates))
     {
-        SCOPED_RESLIST(rl);
-        int candidate_fd = try_xopen(candidate, O_RDONLY, 0);
+        struct reslist* rl = reslist_create();
+        int candidate_fd;
+        {
+            WITH_CURRENT_RESLIST(rl);
+            candidate_fd = try_xopen(candidate, O_RDONLY, 0);
+        }
         if (candidate_fd == -1) {
             dbg("could not open candidate %s: %s",
                 candidate, strerror(errno));
+            reslist_destroy(rl);
+            continue;
+        }
+
+        struct xcmd_candidate* c = &probed[nr];
+        if (!elf_id_fd(candidate_fd, &c->id)) {
+            dbg("candidate %s is not an executable we know", candidate);
+            reslist_destroy(rl);
             continue;
         }
 
-        dbg("testing candidate %s for compatibility", candidate);
-        if (elf_compatible_p(candidate_fd, api_level, abi_mask)) {
-            dbg("candidate is compatible");
-            reslist_xfer(rl->parent, rl);
-            return candidate_fd;
+        c->name = candidate;
+        c->rl = rl;
+        c->fd = candidate_fd;
+        nr += 1;
+    }
+
+    if (nr == 0)
+        die(ENOENT, "no suitable candidate found for xcmd %s", program);
+
+    *out = probed;
+    return nr;
+}
+
+// Choose the first of the NR probed CANDIDATES that can run on the
+// device and close the rest.
+static int
+find_xcmd_candidate(
+    const char* program,
+    struct xcmd_candidate* candidates,
+    size_t nr,
+    unsigned api_level,
+    unsigned abi_mask)
+{
+    int candidate_fd = -1;
+    for (size_t i = 0; i < nr; ++i) {
+        struct xcmd_candidate* c = &candidates[i];
+        if (candidate_fd == -1 &&
+            elf_id_compatible_p(&c->id, api_level, abi_mask))
+        {
+            dbg("candidate %s is compatible", c->name);
+            candidate_fd = c->fd;
+            reslist_reparent(c->rl);
+        } else {
+            reslist_destroy(c->rl);
         }
     }
 
-    die(ENOENT, "no suitable candidate found for xcmd %s", program);
+    if (candidate_fd == -1)
+        die(ENOENT, "no suitable candidate found for xcmd %s", program);
+    return candidate_fd;
+}
+
+// Send the device's xcmd cache whichever of the programs in
+// INFO->xcmd_preloads it doesn't already have.
+static void
+preload_xcmd_programs(const struct shex_common_info* info,
+                      const struct childcom* tc,
+                      unsigned api_level,
+                      unsigned abi_mask)
+{
+    SCOPED_RESLIST(rl);
+    const struct strlist* preloads = info->xcmd_preloads;
+    int fds[XCMD_QUERY_MAX];
+    uint8_t hashes[XCMD_QUERY_MAX][FB_ADB_XCMD_HASH_LENGTH];
+    size_t nr = 0;
+
+    for (const char* preload = strlist_rewind(preloads);
+         preload != NULL;
+         preload = strlist_next(preloads))
+    {
+        int fd = xopen(preload, O_RDONLY, 0);
+        if (!elf_compatible_p(fd, api_level, abi_mask)) {
+            dbg("not preloading %s: incompatible with device", preload);
+            continue;
+        }
+
+        if (nr == XCMD_QUERY_MAX)
+            die(EINVAL, "too many programs to preload");
+        xrewindfd(fd);
+        struct sha256_hash hash = hash_cache_sha256_fd(fd);
+        memcpy(hashes[nr], hash.digest, FB_ADB_XCMD_HASH_LENGTH);
+        fds[nr++] = fd;
+    }
+
+    if (nr == 0)
+        return;
+
+    struct msg_query_exec_files qef = {
+        .msg.type = MSG_QUERY_EXEC_FILES,
+        .msg.size = sizeof (qef) + nr * sizeof (hashes[0]),
+    };
+
+    tc_write(tc, &qef, sizeof (qef));
+    tc_write(tc, hashes, nr * sizeof (hashes[0]));
+
+    struct msg* msg = tc_recvmsg(tc);
+    if (msg->type != MSG_EXEC_FILES_PRESENT)
+        die(ECOMM, "unexpected message type");
+    struct msg_exec_files_present* efp =
+        CHECK_MSG_CAST(msg, struct msg_exec_files_present);
+    char* cache_directory = xstrndup(
+        efp->cache_directory,
+        efp->msg.size - offsetof(struct msg_exec_files_present,
+                                 cache_directory));
+
+    for (size_t i = 0; i < nr; ++i) {
+        if (efp->present & ((uint64_t) 1 << i))
+            continue;
+        xrewindfd(fds[i]);
+        send_file_to_device(&info->adb,
+                            &info->transport,
+                            &info->user,
+                            fds[i],
+                            xaprintf("%s/%s",
+                                     cache_directory,
+                                     hex_encode_bytes(
+                                         hashes[i],
+                                         FB_ADB_XCMD_HASH_LENGTH)),
+                            0500 /* -r-x------ */);
+    }
 }
 
 static bool
@@ -1542,16 +2176,21 @@ handle_open_exec_response(const struct shex_common_info* info,
     return false;
 }
 
+// Each device runs its own daemons, so key the cache by device.
 static char*
-daemon_cache_file_name(const struct user_opts* uopt)
+daemon_cache_file_name(const char* const* adb_args,
+                       const struct user_opts* uopt)
 {
+    const char* device = device_cache_key(adb_args);
     if (uopt->user)
-        return xaprintf("%s/socket-name-cache-u%s",
+        return xaprintf("%s/socket-name-cache-%s-u%s",
                         my_fb_adb_directory(),
+                        device,
                         uopt->user /* already sanity-checked */);
 
-    return xaprintf("%s/socket-name-cache-%s",
+    return xaprintf("%s/socket-name-cache-%s-%s",
                     my_fb_adb_directory(),
+                    device,
                     uopt->root ? "root" : "default");
 }
 
@@ -1570,7 +2209,7 @@ connect_fb_adb_daemon(const char* const* adb_args,
             : "the default user");
 #endif
 
-    const char* cache_file_name = daemon_cache_file_name(uopt);
+    const char* cache_file_name = daemon_cache_file_name(adb_args, uopt);
     dbg("looking for cached socket name for fb-adb daemon "
         "running as %s in cache file [%s]",
         user_description, cache_file_name);
@@ -1609,14 +2248,19 @@ connect_fb_adb_daemon(const char* const* adb_args,
     struct childcom* tc = connect_to_device_socket(adb_args, socknam);
     WITH_CURRENT_RESLIST(rl_tc->parent);
 
-    struct chat* cc = tc_chat_new(tc);
+    struct chat* cc = tc_chat(tc);
     char* resp = chat_read_line(cc);
+    timing_mark("daemon-hello", socknam);
     if (!parse_child_hello(resp, chello))
         die(ECOMM, "trouble reading daemon socket for %s: [%s]",
             cache_file_name, resp);
     if (strcmp(chello->ver, build_fingerprint) != 0)
         die(ERR_FINGERPRINT_MISMATCH, "stale daemon");
 
+    struct device_info di;
+    bool have_di = device_info_load(adb_args, &di);
+    note_device_hello(adb_args, have_di ? &di : NULL, chello, -1);
+
     struct timeval new_cache_filetimes[2];
     VERIFY(gettimeofday(&new_cache_filetimes[0], NULL) == 0);
     new_cache_filetimes[1] = new_cache_filetimes[0];
@@ -1705,8 +2349,10 @@ check_sane_user_name(const char* want_user)
         die(EINVAL, "invalid user name");
 }
 
+// CHELLO is the hello the stub gave us when we started CHILD.
 static struct childcom*
 tc_for_child(struct child* child,
+             const struct child_hello* chello,
              writer_function writer,
              bool old_adb_detected)
 {
@@ -1715,6 +2361,8 @@ tc_for_child(struct child* child,
     tc->from_child = child->fd[STDOUT_FILENO];
     tc->writer = writer;
     tc->old_adb_detected = old_adb_detected;
+    tc->cc = chello->cc;
+    assert(tc->cc != NULL);
     return tc;
 }
 
@@ -1728,10 +2376,12 @@ tc_upgrade(struct childcom* tc,
            struct transport transport,
            struct child* child)
 {
+    double span_start = timing_span_begin();
     if (transport.type == transport_unix)
         tc = reconnect_over_unix_socket(tc, adb_args);
     else if (transport.type == transport_tcp)
-        tc = reconnect_over_tcp_socket(tc, child, transport.tcp_addr);
+        tc = reconnect_over_tcp_socket(tc, child, transport);
+    timing_span_end(span_start, "tc-upgrade", NULL);
     return tc;
 }
 
@@ -1741,57 +2391,62 @@ tcp_upgrade_daemon_connection(struct childcom* tc,
                               struct transport transport)
 {
     if (transport.type == transport_tcp)
-        tc = reconnect_over_tcp_socket(tc, NULL, transport.tcp_addr);
+        tc = reconnect_over_tcp_socket(tc, NULL, transport);
     return tc;
 }
 
-static char*
-slurp_massaged_output(int fd)
-{
-    SCOPED_RESLIST(rl);
-    size_t sz;
-    char* output = slurp_fd(fd, &sz);
-    WITH_CURRENT_RESLIST(rl->parent);
-    return massage_output((uint8_t*) output, sz);
-}
-
+// The daemon prints its hello only once it's listening, so the hello
+// is all the readiness signal we need: as soon as we see it, record
+// the socket and let the caller connect, leaving PEER to wind down
+// its adb session on its own.  PEER must belong to a reslist that
+// outlives the connection attempt, since cleaning it up waits for it.
 static void
 complete_start_daemon_attempt(struct child* peer,
+                              const struct adb_opts* adb_opts,
                               const struct user_opts* uopt)
 {
     fdh_destroy(peer->fd[STDIN_FILENO]);
     peer->fd[STDIN_FILENO] = NULL;
 
-    char* output = slurp_massaged_output(peer->fd[STDOUT_FILENO]->fd);
-    fdh_destroy(peer->fd[STDOUT_FILENO]);
-    peer->fd[STDOUT_FILENO] = NULL;
-
     struct daemon_hello dhello;
     bool have_dhello = false;
-    int peer_status = child_wait(peer);
-    if (child_status_success_p(peer_status)) {
-        SCOPED_RESLIST(rl_parse);
-        char* saveptr = NULL;
-        for (char* line = strtok_r(xstrdup(output), "\n", &saveptr);
-             line != NULL;
-             line = strtok_r(NULL, "\n", &saveptr))
-        {
-            if (parse_daemon_hello(line, &dhello)) {
-                have_dhello = true;
-                break;
-            }
-        }
+    struct growable_buffer output = { 0 };
+    size_t output_size = 0;
+    FILE* peer_out = xfdopen(peer->fd[STDOUT_FILENO]->fd, "r");
+    while (!have_dhello) {
+        size_t linesz;
+        char* line = slurp_line(peer_out, &linesz);
+        if (line == NULL)
+            break;
+        grow_buffer(&output, output_size + linesz);
+        memcpy(output.buf + output_size, line, linesz);
+        output_size += linesz;
+        rtrim(line, &linesz, "\r\n");
+        have_dhello = parse_daemon_hello(line, &dhello);
     }
 
-    if (!have_dhello)
+    fdh_destroy(peer->fd[STDOUT_FILENO]);
+    peer->fd[STDOUT_FILENO] = NULL;
+
+    if (!have_dhello) {
+        int peer_status = child_wait(peer);
+        char* msg = output_size > 0
+            ? massage_output(output.buf, output_size)
+            : NULL;
         die(ECOMM, "error starting daemon: (exit:%d) %s",
             child_status_to_exit_code(peer_status),
-            (output && output[0]) ? output : "[no output]");
+            (msg && msg[0]) ? msg : "[no output]");
+    }
+
+    peer->reap_on_cleanup = true;
 
     dbg("started daemon on device; listening socket [%s]",
         dhello.socket_name);
 
-    const char* cache_file_name = daemon_cache_file_name(uopt);
+    struct strlist* adb_args = strlist_new();
+    emit_args_adb_opts(adb_args, adb_opts);
+    const char* cache_file_name = daemon_cache_file_name(
+        strlist_to_argv(adb_args), uopt);
     int cache_file_fd = xopen(cache_file_name, O_RDWR | O_CREAT, 0600);
     xflock(cache_file_fd, LOCK_EX);
     xftruncate(cache_file_fd, 0);
@@ -1815,17 +2470,24 @@ start_daemon_via_shell(const struct adb_opts* adb_opts,
         .user = *user_opts,
         .transport = *transport_opts,
         .transport.avoid_daemon = true,
+#ifdef HAVE_TIMING
+        .transport.timing = NULL, // We report; the helper shouldn't
+#endif
     };
 
     struct cmd_start_daemon_info cdsi = { };
 
-    struct child* peer = start_peer(
-        &spi,
-        make_args_cmd_start_daemon(
-            CMD_ARG_FORWARDED | CMD_ARG_NAME,
-            &cdsi));
+    struct child* peer;
+    {
+        WITH_CURRENT_RESLIST(rl->parent);
+        peer = start_peer(
+            &spi,
+            make_args_cmd_start_daemon(
+                CMD_ARG_FORWARDED | CMD_ARG_NAME,
+                &cdsi));
+    }
 
-    complete_start_daemon_attempt(peer, user_opts);
+    complete_start_daemon_attempt(peer, adb_opts, user_opts);
 }
 
 struct try_start_daemon_via_shell_ctx {
@@ -1874,14 +2536,19 @@ start_daemon_via_service_hack(const struct adb_opts* adb_opts,
         .package = want_user,
     };
 
-    struct child* peer = start_peer(
-        &spi,
-        make_args_cmd_stub_package_hack(
-            CMD_ARG_FORWARDED | CMD_ARG_NAME,
-            &sphi));
+    struct child* peer;
+    {
+        WITH_CURRENT_RESLIST(rl->parent);
+        peer = start_peer(
+            &spi,
+            make_args_cmd_stub_package_hack(
+                CMD_ARG_FORWARDED | CMD_ARG_NAME,
+                &sphi));
+    }
 
     complete_start_daemon_attempt(
         peer,
+        adb_opts,
         &(struct user_opts){.user = want_user});
 }
 
@@ -1963,6 +2630,7 @@ tc_connect_user_attempt(const struct adb_info* ai,
 
     struct childcom* tc = tc_for_child(
         adb,
+        chello,
         write_all_adb_encoded,
         old_adb_detected);
 
@@ -2052,6 +2720,7 @@ tc_connect_normal(const char* const* adb_args,
     struct child* adb = start_stub_adb(adb_args, chello, &old_adb_detected);
     struct childcom* tc = tc_for_child(
         adb,
+        chello,
         write_all_adb_encoded,
         old_adb_detected);
 
@@ -2063,9 +2732,9 @@ tc_connect_normal(const char* const* adb_args,
 }
 
 static struct childcom*
-tc_connect(const struct shex_common_info* info,
-           const char* const* adb_args,
-           struct child_hello* chello)
+tc_connect_direct(const struct shex_common_info* info,
+                  const char* const* adb_args,
+                  struct child_hello* chello)
 {
     bool want_root = false;
     const char* want_user = NULL;
@@ -2077,6 +2746,10 @@ tc_connect(const struct shex_common_info* info,
     if (utransport)
         transport = parse_transport(utransport);
 
+    if (info->transport.tcp_buffer_size != NULL)
+        transport.tcp_bufsz =
+            parse_tcp_buffer_size(info->transport.tcp_buffer_size);
+
 #ifdef HAVE_LOCAL_STUB
     if (transport.type == transport_local) {
         const char* unsupported_thing = NULL;
@@ -2091,9 +2764,15 @@ tc_connect(const struct shex_common_info* info,
             die(EINVAL,
                 "%s not supported with local transport",
                 unsupported_thing);
-        return tc_for_child(start_stub_local(chello),
-                            write_all,
-                            false /* old_adb_detected */);
+        struct childcom_shm* shm;
+        struct child* child = start_stub_local(chello, &shm);
+        struct childcom* tc = tc_for_child(child,
+                                           chello,
+                                           write_all,
+                                           false /* old_adb_detected */);
+        tc->shm = shm;
+        tc->local = true;
+        return tc;
     }
 #endif
 
@@ -2133,11 +2812,342 @@ tc_connect(const struct shex_common_info* info,
     return tc_connect_normal(adb_args, want_root, transport, chello);
 }
 
+// A control master keeps one mux connection (see mux.h) to the
+// device open and relays the sessions of later fb-adb invocations
+// over it.  Each of those sessions talks to a fresh stub exactly as
+// if we'd connected directly, so the client side needs nothing more
+// than a socket.  There is one control master per build, device,
+// user, and transport.
+
+static char*
+control_master_socket_name(const char* const* adb_args,
+                           const struct user_opts* uopt,
+                           const struct transport_opts* topt)
+{
+    SCOPED_RESLIST(rl);
+
+    const char* transport = topt->transport;
+    if (transport == NULL)
+        transport = getenv("FB_ADB_TRANSPORT");
+
+    const char* user_tag = uopt->user
+        ? xaprintf("u%s", uopt->user)
+        : (uopt->root ? "root" : "default");
+
+    char* key = xaprintf("%s\n%s\n%s\n%s",
+                         build_fingerprint,
+                         user_tag,
+                         transport ?: "shell",
+                         getenv("ANDROID_SERIAL") ?: "");
+    for (const char* const* arg = adb_args; *arg != NULL; ++arg)
+        key = xaprintf("%s\n%s", key, *arg);
+
+    // Hash so that the name is short enough for sun_path no matter
+    // what the device serial number looks like.
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    SHA256_Data((const uint8_t*) key, strlen(key), digest);
+
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xaprintf("%s/control-master-%.16s",
+                    my_fb_adb_directory(),
+                    digest);
+}
+
+static struct childcom*
+connect_control_master(const char* socket_name,
+                       struct child_hello* chello)
+{
+    SCOPED_RESLIST(rl);
+
+    dbg("connecting to control master on [%s]", socket_name);
+    int scon = xsocket(AF_UNIX, SOCK_STREAM, 0);
+    xconnect(scon, make_addr_unix_filesystem(socket_name));
+
+    struct childcom* tc = xcalloc(sizeof (*tc));
+    tc->from_child = fdh_dup(scon);
+    tc->to_child = fdh_dup(scon);
+    tc->writer = write_all;
+    tc->cc = chat_new(tc->to_child->fd, tc->from_child->fd);
+
+    // The master closes the connection without a hello if it can't
+    // start a stub for us.
+    char* resp = chat_read_line(tc_chat(tc));
+    timing_mark("control-master-hello", NULL);
+    if (!parse_child_hello(resp, chello))
+        die(ECOMM, "trouble reading control master socket: [%s]", resp);
+    if (strcmp(chello->ver, build_fingerprint) != 0)
+        die(ERR_FINGERPRINT_MISMATCH, "stale control master");
+
+    reslist_xfer(rl->parent, rl);
+    return tc;
+}
+
+struct try_connect_control_master_ctx {
+    const char* socket_name;
+    struct child_hello* chello;
+    struct childcom* tc;
+};
+
+static void
+try_connect_control_master_1(void* data)
+{
+    struct try_connect_control_master_ctx* ctx = data;
+    ctx->tc = connect_control_master(ctx->socket_name, ctx->chello);
+}
+
+static struct childcom*
+try_connect_control_master(const char* socket_name,
+                           struct child_hello* chello)
+{
+    struct try_connect_control_master_ctx ctx = {
+        .socket_name = socket_name,
+        .chello = chello,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(try_connect_control_master_1, &ctx, &ei)) {
+        dbg("could not connect to control master: %s", ei.msg);
+        return NULL;
+    }
+
+    dbg("connected to control master");
+    return ctx.tc;
+}
+
+static void
+start_control_master(const struct shex_common_info* info)
+{
+    SCOPED_RESLIST(rl);
+
+    struct cmd_control_master_info cmi = {
+        .adb = info->adb,
+        .transport = info->transport,
+        .user = info->user,
+    };
+#ifdef HAVE_TIMING
+    cmi.transport.timing = NULL;
+#endif
+
+    struct strlist* args = strlist_new();
+    strlist_append(args, orig_argv0);
+    strlist_xfer(args,
+                 make_args_cmd_control_master(
+                     CMD_ARG_ALL | CMD_ARG_NAME,
+                     &cmi));
+
+    // The master outlives us, so don't let it hold on to any of our
+    // pipes.  It goes into the background once it's ready.
+    const struct child_start_info csi = {
+        .io[STDIN_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDOUT_FILENO] = CHILD_IO_DEV_NULL,
+        .io[STDERR_FILENO] = CHILD_IO_DEV_NULL,
+        .exename = my_exe(),
+        .argv = strlist_to_argv(args),
+    };
+
+    int status = child_wait(child_start(&csi));
+    if (!child_status_success_p(status))
+        die(ECOMM, "control master failed to start: exit %d",
+            child_status_to_exit_code(status));
+}
+
+static void
+try_start_control_master_1(void* data)
+{
+    start_control_master((const struct shex_common_info*) data);
+}
+
+static bool
+try_start_control_master(const struct shex_common_info* info)
+{
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(try_start_control_master_1, (void*) info, &ei)) {
+        dbg("could not start control master: %s", ei.msg);
+        return false;
+    }
+
+    return true;
+}
+
+static struct childcom*
+tc_connect(const struct shex_common_info* info,
+           const char* const* adb_args,
+           struct child_hello* chello)
+{
+    const char* mode = info->transport.control_master;
+    if (mode == NULL)
+        mode = getenv("FB_ADB_CONTROL_MASTER");
+
+    bool use_master = !(mode && !strcmp(mode, "no"));
+    bool auto_master = (mode && !strcmp(mode, "auto"));
+
+    if (use_master && !info->transport.avoid_daemon) {
+        const char* socket_name = control_master_socket_name(
+            adb_args, &info->user, &info->transport);
+        struct childcom* tc =
+            try_connect_control_master(socket_name, chello);
+        if (tc == NULL && auto_master && try_start_control_master(info))
+            tc = try_connect_control_master(socket_name, chello);
+        if (tc != NULL)
+            return tc;
+    }
+
+    return tc_connect_direct(info, adb_args, chello);
+}
+
+// When the stub shares our machine through the shm transport, it can
+// give the child our own standard streams, and then neither of us
+// needs to copy them.  We do that only for streams that aren't
+// terminals, since terminals need the stub's pty handling.  Return the
+// mask of streams to pass.
+static unsigned
+choose_passed_fds(const struct childcom* tc,
+                  const struct tty_flags tty_flags[3])
+{
+    unsigned passed_fds = 0;
+    if (tc->shm == NULL || getenv("FB_ADB_NO_FD_PASSING"))
+        return 0;
+
+    for (int fd = 0; fd < 3; ++fd)
+        if (!tty_flags[fd].tty_p &&
+            !tty_flags[fd].want_pty_p &&
+            fcntl(fd, F_GETFD) != -1)
+        {
+            passed_fds |= 1<<fd;
+        }
+
+    return passed_fds;
+}
+
+static void
+send_passed_fds(const struct childcom* tc, unsigned passed_fds)
+{
+    int fds[3];
+    unsigned nr = 0;
+    for (int fd = 0; fd < 3; ++fd)
+        if (passed_fds & (1<<fd))
+            fds[nr++] = fd;
+    dbg("passing stdio fds to stub: mask %u", passed_fds);
+    send_fds(tc->shm->to_stub_bell->fd, fds, nr);
+}
+
+static uint64_t
+stats_us(double seconds)
+{
+    return seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+}
+
+static void
+write_msg_stats(struct json_writer* writer, const struct channel* c)
+{
+    static const char* names[NR_MSG_TYPES] = {
+#define M(_name) [_name - MSG_TYPE_PRE - 1] = #_name,
+        ENUM_MSG_TYPES(M)
+#undef M
+    };
+
+    json_begin_object(writer);
+    for (unsigned i = 0; i < NR_MSG_TYPES; ++i)
+        if (c->stats.msgs[i] > 0) {
+            json_begin_field(writer, names[i]);
+            json_emit_u64(writer, c->stats.msgs[i]);
+        }
+    json_end_object(writer);
+}
+
+// Write the --stats report for the session SH to the file named
+// DEST, or to standard error if DEST is "-".
+static void
+write_session_stats(const struct fb_adb_sh* sh, const char* dest)
+{
+    // In channel number order
+    static const char* chnames[] = {
+        "from_peer",
+        "to_peer",
+        "stdin",
+        "stdout",
+        "stderr",
+    };
+
+    SCOPED_RESLIST(rl);
+    FILE* out = xstderr;
+    if (strcmp(dest, "-") != 0)
+        out = xfdopen(xopen(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666), "w");
+
+#ifdef HAVE_CLOCK_GETTIME
+    double now = xclock_gettime(CLOCK_MONOTONIC);
+#else
+    double now = 0;
+#endif
+    struct json_writer* writer = json_writer_create(out);
+    json_begin_object(writer);
+    json_begin_field(writer, "poll_wakeups");
+    json_emit_u64(writer, sh->nr_poll_wakeups);
+    json_begin_field(writer, "longest_pump_us");
+    json_emit_u64(writer, stats_us(sh->longest_pump));
+    json_begin_field(writer, "channels");
+    json_begin_array(writer);
+    for (unsigned chno = 0; chno < sh->nrch; ++chno) {
+        const struct channel* c = sh->ch[chno];
+        const struct channel_stats* st = &c->stats;
+        const struct channel_compression* cs = &c->compression;
+        double blocked = st->window_blocked;
+        if (st->window_blocked_since != 0)
+            blocked += now - st->window_blocked_since;
+
+        json_begin_object(writer);
+        json_begin_field(writer, "name");
+        json_emit_string(writer, chno < ARRAYSIZE(chnames)
+                         ? chnames[chno]
+                         : xaprintf("%u", chno));
+        json_begin_field(writer, "bytes_in");
+        json_emit_u64(writer, st->bytes_in);
+        json_begin_field(writer, "bytes_out");
+        json_emit_u64(writer, st->bytes_out);
+        json_begin_field(writer, "buffer_high_water");
+        json_emit_u64(writer, st->high_water);
+        if (c->dir == CHANNEL_FROM_FD && c->track_window) {
+            json_begin_field(writer, "window_blocked_us");
+            json_emit_u64(writer, stats_us(blocked));
+        }
+        if (cs->total_raw > 0 || cs->total_skipped > 0) {
+            json_begin_field(writer, "compressed_raw_bytes");
+            json_emit_u64(writer, cs->total_raw);
+            json_begin_field(writer, "compressed_wire_bytes");
+            json_emit_u64(writer, cs->total_wire);
+            json_begin_field(writer, "compressed_pct");
+            json_emit_u64(writer, cs->total_raw
+                          ? cs->total_wire * 100 / cs->total_raw
+                          : 0);
+            json_begin_field(writer, "uncompressed_bytes");
+            json_emit_u64(writer, cs->total_skipped);
+            json_begin_field(writer, "compression_pauses");
+            json_emit_u64(writer, cs->nr_backoffs);
+        }
+        if (chno == FROM_PEER || chno == TO_PEER) {
+            json_begin_field(writer, chno == FROM_PEER
+                             ? "messages_received"
+                             : "messages_sent");
+            write_msg_stats(writer, c);
+        }
+        json_end_object(writer);
+    }
+    json_end_array(writer);
+    json_end_object(writer);
+    xputc('\n', out);
+    xflush(out);
+}
+
 static int
 shex_main_common(const struct shex_common_info* info)
 {
     SCOPED_RESLIST(rl);
 
+#ifdef HAVE_TIMING
+    if (info->transport.timing)
+        timing_start(info->transport.timing);
+#endif
+
     size_t max_cmdsz = DEFAULT_MAX_CMDSZ;
     enum { TTY_AUTO,
            TTY_DISABLE,
@@ -2208,12 +3218,52 @@ shex_main_common(const struct shex_common_info* info)
             tty_flags[i].want_pty_p = true;
         }
 
+    unsigned accel_to_device = 1;
+    unsigned accel_from_device = 1;
+    if (info->transport.compression_acceleration != NULL)
+        parse_compression_acceleration(
+            info->transport.compression_acceleration,
+            &accel_to_device,
+            &accel_from_device);
+
     if (compress)
-        for (int i = 0; i < 3; ++i)
-            tty_flags[i].compress = true;
+        for (int i = 0; i < 3; ++i) {
+            unsigned accel = (i == STDIN_FILENO)
+                ? accel_to_device
+                : accel_from_device;
+            tty_flags[i].compress = (accel != 0);
+            tty_flags[i].lz4_acceleration = accel;
+        }
+
+    struct xcmd_candidate* xcmd_candidates = NULL;
+    size_t nr_xcmd_candidates = 0;
+    if (info->xcmd_candidates != NULL)
+        nr_xcmd_candidates = probe_xcmd_candidates(
+            info->command,
+            info->xcmd_candidates,
+            &xcmd_candidates);
 
     struct child_hello chello;
     struct childcom* tc = tc_connect(info, adb_args, &chello);
+    timing_mark("connected", NULL);
+
+    unsigned nr_stripes = info->transport.stripes
+        ? parse_stripes(info->transport.stripes)
+        : 1;
+
+    bool can_stripe = tc->device_socket;
+#ifdef HAVE_LOCAL_STUB
+    can_stripe = can_stripe || (tc->local && tc->shm == NULL);
+#endif
+    if (nr_stripes > 1 && !can_stripe) {
+        dbg("transport does not support striping: using one connection");
+        nr_stripes = 1;
+    }
+
+    if (nr_stripes > 1) {
+        open_stripes(tc, adb_args, nr_stripes);
+        timing_mark("stripes-open", NULL);
+    }
 
     dbg("remote API level is %u", chello.api_level);
     dbg("remote ABI support: %s", describe_abi_mask(chello.abi_mask));
@@ -2235,10 +3285,28 @@ shex_main_common(const struct shex_common_info* info)
     signal(SIGWINCH, handle_sigwinch);
 
     size_t command_ringbufsz = 1024 * 1024;
-    size_t stdio_ringbufsz = 1024 * 1024;
+    size_t stdio_ringbufsz = MAX_CHANNEL_WINDOW;
     struct msg_shex_hello* hello_msg =
         make_hello_msg(stdio_ringbufsz, command_ringbufsz, tty_flags);
     hello_msg->maxmsg = XMIN(max_cmdsz, MSG_MAX_SIZE);
+    // Both ends' command ring buffers are COMMAND_RINGBUFSZ bytes
+    // and must hold a whole frame.  Keeping frames to half that lets
+    // one drain while we build the next.
+    if (!use_adb_encoding_hack)
+        hello_msg->maxjumbo = command_ringbufsz / 2;
+
+    // Small writes are the norm in pty sessions; coalesce them.
+    bool any_pty = false;
+    for (int i = 0; i < 3; ++i)
+        if (tty_flags[i].want_pty_p)
+            any_pty = true;
+
+    if (any_pty) {
+        const char* cork_delay = getenv("FB_ADB_CORK_DELAY_MS");
+        hello_msg->cork_delay_ms = cork_delay
+            ? XMIN(strtoul(cork_delay, NULL, 10), 1000)
+            : DEFAULT_PTY_CORK_DELAY_MS;
+    }
     hello_msg->stub_send_bufsz = command_ringbufsz;
     hello_msg->stub_recv_bufsz = command_ringbufsz;
     hello_msg->nr_argv = 2 + argv_count(argv);
@@ -2249,27 +3317,43 @@ shex_main_common(const struct shex_common_info* info)
     if (use_adb_encoding_hack)
         hello_msg->adb_encoding_hack = true;
 
-    tc_sendmsg(tc, &hello_msg->msg);
+    if (tc->shm != NULL)
+        hello_msg->shm_transport = true;
 
-    if (info->cwd.chdir)
-        send_chdir(tc, info->cwd.chdir);
+    unsigned passed_fds = choose_passed_fds(tc, tty_flags);
+    hello_msg->passed_fds = passed_fds;
+
+    tc_sendmsg(tc, &hello_msg->msg);
+    if (passed_fds)
+        send_passed_fds(tc, passed_fds);
 
     if (info->xcmd_candidates != NULL) {
         SCOPED_RESLIST(rl_xcmd);
         int candidate_fd = find_xcmd_candidate(
             info->command,
-            info->xcmd_candidates,
+            xcmd_candidates,
+            nr_xcmd_candidates,
             chello.api_level,
             chello.abi_mask);
         xrewindfd(candidate_fd);
-        struct sha256_hash hash = sha256_fd(candidate_fd);
+        struct sha256_hash hash = hash_cache_sha256_fd(candidate_fd);
+        if (info->xcmd_preloads != NULL)
+            preload_xcmd_programs(info, tc,
+                                  chello.api_level, chello.abi_mask);
         do {
             send_open_exec_file(tc, &hash, candidate_fd, info->command);
         } while (!handle_open_exec_response(info, tc, candidate_fd));
     }
 
+    // The stub applies the directory only when it starts the child,
+    // so it can follow the exec file exchange above.
+    tc_batch_begin(tc);
+    if (info->cwd.chdir)
+        send_chdir(tc, info->cwd.chdir);
     send_environ_ops(tc, environ_ops);
     send_cmdline(tc, info->shex.exename, command, argv);
+    tc_batch_send(tc);
+    timing_mark("command-sent", NULL);
 
     struct fb_adb_shex shex;
     memset(&shex, 0, sizeof (shex));
@@ -2291,18 +3375,67 @@ shex_main_common(const struct shex_common_info* info)
     sh->poll_sigmask = &poll_sigmask;
 
     sh->max_outgoing_msg = max_cmdsz;
+    sh->max_outgoing_jumbo = hello_msg->maxjumbo;
+    sh->cork_delay_ms = hello_msg->cork_delay_ms;
     sh->process_msg = shex_process_msg;
+    sh->time_stats = (info->shex.stats != NULL);
     sh->nrch = 5;
     struct channel** ch = xalloc(sh->nrch * sizeof (*ch));
 
-    ch[FROM_PEER] = channel_new(tc->from_child,
-                                command_ringbufsz,
-                                CHANNEL_FROM_FD);
-    ch[FROM_PEER]->window = UINT32_MAX;
+#ifdef HAVE_SHM_TRANSPORT
+    if (tc->shm != NULL) {
+        dbg("using shared memory transport");
+        ch[FROM_PEER] = channel_new_shm(tc->shm->from_stub,
+                                        tc->shm->from_stub_bell,
+                                        command_ringbufsz,
+                                        CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new_shm(tc->shm->to_stub,
+                                      tc->shm->to_stub_bell,
+                                      command_ringbufsz,
+                                      CHANNEL_TO_FD);
+    } else
+#endif
+    if (tc->nr_stripes > 1) {
+        dbg("striping over %u connections", tc->nr_stripes);
+        struct fdh* from_stub[MAX_STRIPES];
+        struct fdh* to_stub[MAX_STRIPES];
+        from_stub[0] = tc->from_child;
+        to_stub[0] = tc->to_child;
+        for (unsigned i = 1; i < tc->nr_stripes; ++i) {
+            from_stub[i] = fdh_dup(tc->stripes[i]->fd);
+            to_stub[i] = tc->stripes[i];
+        }
+
+        ch[FROM_PEER] = channel_new_striped(
+            stripe_set_new(from_stub, tc->nr_stripes),
+            command_ringbufsz,
+            CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new_striped(
+            stripe_set_new(to_stub, tc->nr_stripes),
+            command_ringbufsz,
+            CHANNEL_TO_FD);
+    } else {
+        ch[FROM_PEER] = channel_new(tc->from_child,
+                                    command_ringbufsz,
+                                    CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new(tc->to_child,
+                                  command_ringbufsz,
+                                  CHANNEL_TO_FD);
+    }
 
-    ch[TO_PEER] = channel_new(tc->to_child,
-                              command_ringbufsz,
-                              CHANNEL_TO_FD);
+    // Whatever the chat read past the last message belongs to the
+    // protocol stream, so start the peer channel with it.
+    const void* pending;
+    size_t nr_pending = chat_take_pending(tc->cc, &pending);
+    if (nr_pending > 0) {
+        dbg("%zu bytes of protocol arrived with the hello", nr_pending);
+        if (ch[FROM_PEER]->fdh != tc->from_child)
+            die(ECOMM, "unexpected data from stub before channel setup");
+        ringbuf_copy_in(ch[FROM_PEER]->rb, pending, nr_pending);
+        ringbuf_note_added(ch[FROM_PEER]->rb, nr_pending);
+    }
+
+    ch[FROM_PEER]->window = UINT32_MAX;
     ch[TO_PEER]->adb_encoding_hack = use_adb_encoding_hack;
 
     dbg("using adb encoding hack: %s", use_adb_encoding_hack ? "yes" : "no");
@@ -2323,23 +3456,39 @@ shex_main_common(const struct shex_common_info* info)
                                   stdio_ringbufsz,
                                   CHANNEL_FROM_FD);
     ch[CHILD_STDIN]->track_window = true;
-    ch[CHILD_STDIN]->compress = compress;
+    ch[CHILD_STDIN]->priority = CHANNEL_PRIORITY_INTERACTIVE;
+    ch[CHILD_STDIN]->compress = tty_flags[STDIN_FILENO].compress;
+    ch[CHILD_STDIN]->compress_stream = tty_flags[STDIN_FILENO].compress;
+    ch[CHILD_STDIN]->lz4_acceleration =
+        tty_flags[STDIN_FILENO].lz4_acceleration;
 
     ch[CHILD_STDOUT] = channel_new(fdh_dup(STDOUT_FILENO),
                                    stdio_ringbufsz,
                                    CHANNEL_TO_FD);
     ch[CHILD_STDOUT]->track_bytes_written = true;
-    ch[CHILD_STDOUT]->compress = compress;
+    ch[CHILD_STDOUT]->compress = tty_flags[STDOUT_FILENO].compress;
+    ch[CHILD_STDOUT]->compress_stream = tty_flags[STDOUT_FILENO].compress;
+    ch[CHILD_STDOUT]->compress_dict = tty_flags[STDOUT_FILENO].compress;
     ch[CHILD_STDOUT]->bytes_written =
-        ringbuf_room(ch[CHILD_STDOUT]->rb);
+        XMIN(ringbuf_room(ch[CHILD_STDOUT]->rb), INITIAL_CHANNEL_WINDOW);
 
     ch[CHILD_STDERR] = channel_new(fdh_dup(STDERR_FILENO),
                                    stdio_ringbufsz,
                                    CHANNEL_TO_FD);
     ch[CHILD_STDERR]->track_bytes_written = true;
-    ch[CHILD_STDERR]->compress = compress;
+    ch[CHILD_STDERR]->compress = tty_flags[STDERR_FILENO].compress;
+    ch[CHILD_STDERR]->compress_stream = tty_flags[STDERR_FILENO].compress;
+    ch[CHILD_STDERR]->compress_dict = tty_flags[STDERR_FILENO].compress;
     ch[CHILD_STDERR]->bytes_written =
-        ringbuf_room(ch[CHILD_STDERR]->rb);
+        XMIN(ringbuf_room(ch[CHILD_STDERR]->rb), INITIAL_CHANNEL_WINDOW);
+
+    // The stub gave the child our descriptors for these streams, so
+    // there's nothing for us to copy.
+    for (unsigned i = 0; i < 3; ++i)
+        if (passed_fds & (1<<i)) {
+            channel_close(ch[CHILD_STDIN + i]);
+            ch[CHILD_STDIN + i]->sent_eof = true;
+        }
 
     struct reset_termios_context rtc;
     setup_reset_termios(&rtc, &tty_flags[0], &ch[CHILD_STDIN], 3);
@@ -2426,6 +3575,9 @@ shex_main_common(const struct shex_common_info* info)
     if (!shex.child_exited)
         die(EPIPE, "lost connection to peer");
 
+    if (info->shex.stats)
+        write_session_stats(sh, info->shex.stats);
+    timing_report();
     return shex.child_exit_status;
 }
 
@@ -2454,7 +3606,8 @@ shell_main(const struct cmd_shell_info* info)
         lim_format_shell_command_line(command, argv, &pos, script, sz);
         script[pos] = '\0';
         cinfo.command = ARG_DEFAULT_SH;
-        cinfo.args = ARGV("-c", script);
+        // ARGV's array lives only as long as this block.
+        cinfo.args = ARGV_CONCAT(ARGV("-c", script));
     }
 
     return shex_main_common(&cinfo);
@@ -2520,6 +3673,20 @@ xcmd_main(const struct cmd_xcmd_info* info)
         }
     }
 
+    struct strlist* preloads = strlist_new();
+    if (info->xcmd.preloads != NULL) {
+        const struct strlist* preload_args = info->xcmd.preloads;
+        for (const char* parg = strlist_rewind(preload_args);
+             parg != NULL;
+             parg = strlist_next(preload_args))
+        {
+            const char* prefix = "preload=";
+            if (!string_starts_with_p(parg, prefix))
+                die(EINVAL, "invalid preload option");
+            strlist_append(preloads, parg + strlen(prefix));
+        }
+    }
+
     const char* candidate_path = info->xcmd.candidate_path;
     if (candidate_path == NULL)
         candidate_path = getenv("FB_ADB_XCMD_PATH");
@@ -2549,6 +3716,297 @@ xcmd_main(const struct cmd_xcmd_info* info)
         .command = info->program,
         .args = info->args,
         .xcmd_candidates = candidates,
+        .xcmd_preloads = preloads,
     };
     return shex_main_common(&cinfo);
 }
+
+// Turn TC into a mux (see mux.h) of up to MAX_SESSIONS sessions,
+// each buffering SESSION_BUFSZ bytes in each direction.
+static struct mux*
+mux_over_childcom(const struct childcom* tc,
+                  unsigned max_sessions,
+                  size_t session_bufsz)
+{
+    bool use_adb_encoding_hack =
+        tc->writer == write_all_adb_encoded && tc->old_adb_detected;
+    size_t command_ringbufsz = 1024 * 1024;
+    size_t max_cmdsz = use_adb_encoding_hack
+        ? DEFAULT_MAX_CMDSZ
+        : DEFAULT_MAX_CMDSZ_SOCKET;
+
+    struct msg_mux_hello m = {
+        .msg.type = MSG_MUX_HELLO,
+        .msg.size = sizeof (m),
+        .stub_recv_bufsz = command_ringbufsz,
+        .stub_send_bufsz = command_ringbufsz,
+        .session_bufsz = session_bufsz,
+        .maxmsg = XMIN(max_cmdsz, MSG_MAX_SIZE),
+        // See the comment in shex_main_common.
+        .maxjumbo = use_adb_encoding_hack ? 0 : command_ringbufsz / 2,
+        .max_sessions = max_sessions,
+        .adb_encoding_hack = use_adb_encoding_hack,
+    };
+
+    tc_sendmsg(tc, &m.msg);
+
+    struct mux_info mi = {
+        .from_peer = tc->from_child,
+        .to_peer = tc->to_child,
+        .recv_bufsz = command_ringbufsz,
+        .send_bufsz = command_ringbufsz,
+        .session_bufsz = m.session_bufsz,
+        .maxmsg = max_cmdsz,
+        .maxjumbo = m.maxjumbo,
+        .max_sessions = m.max_sessions,
+        .adb_encoding_hack = use_adb_encoding_hack,
+    };
+
+    return mux_new(&mi);
+}
+
+struct control_master_setup_ctx {
+    struct reslist* rl;
+    const struct shex_common_info* info;
+    const char* const* adb_args;
+    const char* socket_name;
+    struct mux* mux;
+    struct fdh* listen;
+};
+
+static void
+control_master_setup(void* data)
+{
+    struct control_master_setup_ctx* ctx = data;
+    WITH_CURRENT_RESLIST(ctx->rl);
+
+    struct child_hello chello;
+    struct childcom* tc = tc_connect_direct(ctx->info,
+                                            ctx->adb_args,
+                                            &chello);
+    ctx->mux = mux_over_childcom(tc,
+                                 CONTROL_MASTER_MAX_SESSIONS,
+                                 CONTROL_MASTER_SESSION_BUFSZ);
+
+    // We hold the lock, so anything already at SOCKET_NAME belongs
+    // to a dead master.
+    (void) unlink(ctx->socket_name);
+    struct cleanup* unlink_cl = cleanup_allocate();
+    ctx->listen = fdh_dup(xsocket(AF_UNIX, SOCK_STREAM, 0));
+    xbind(ctx->listen->fd, make_addr_unix_filesystem(ctx->socket_name));
+    cleanup_commit(unlink_cl, unlink_cleanup, (void*) ctx->socket_name);
+    xlisten(ctx->listen->fd, 16);
+    fd_set_blocking_mode(ctx->listen->fd, non_blocking);
+    dbg("control master listening on [%s]", ctx->socket_name);
+}
+
+static void
+control_master_accept(struct mux* mux, int listen_fd)
+{
+    SCOPED_RESLIST(rl);
+    int client = xaccept_nonblock(listen_fd);
+    if (client != -1 && !mux_open_session(mux, client))
+        dbg("control master: no free sessions; dropping client");
+}
+
+int
+control_master_main(const struct cmd_control_master_info* info)
+{
+    SCOPED_RESLIST(rl);
+
+    unsigned idle_timeout_ms = CONTROL_MASTER_IDLE_TIMEOUT_MS;
+    const char* idle_timeout = info->control_master.idle_timeout;
+    if (idle_timeout != NULL) {
+        char* endptr = NULL;
+        errno = 0;
+        unsigned long seconds = strtoul(idle_timeout, &endptr, 10);
+        if (errno != 0 || endptr == idle_timeout || *endptr != '\0' ||
+            seconds > UINT_MAX / 1000)
+        {
+            die(EINVAL, "invalid idle timeout: %s", idle_timeout);
+        }
+        idle_timeout_ms = seconds * 1000;
+    }
+
+    struct strlist* adb_args_list = strlist_new();
+    emit_args_adb_opts(adb_args_list, &info->adb);
+    const char* const* adb_args = strlist_to_argv(adb_args_list);
+
+    struct shex_common_info cinfo = {
+        .adb = info->adb,
+        .user = info->user,
+        .transport = info->transport,
+    };
+
+    const char* socket_name = control_master_socket_name(
+        adb_args, &info->user, &info->transport);
+
+    // The lock is on an open file description, which outlives the
+    // fork in become_daemon; it's close-on-exec, so nothing we run
+    // can keep it after we're gone.
+    int lock_fd = xopen(xaprintf("%s.lock", socket_name),
+                        O_RDWR | O_CREAT,
+                        0600);
+    int lock_ret;
+    do {
+        lock_ret = flock(lock_fd, LOCK_EX | LOCK_NB);
+    } while (lock_ret == -1 && errno == EINTR);
+    if (lock_ret == -1) {
+        if (errno != EWOULDBLOCK)
+            die_errno("flock");
+        dbg("control master already running for [%s]", socket_name);
+        return 0;
+    }
+
+    struct control_master_setup_ctx ctx = {
+        .rl = rl,
+        .info = &cinfo,
+        .adb_args = adb_args,
+        .socket_name = socket_name,
+    };
+
+    if (info->control_master.foreground)
+        control_master_setup(&ctx);
+    else
+        become_daemon(control_master_setup, &ctx);
+
+    struct mux* mux = ctx.mux;
+    double idle_since = seconds_since_epoch();
+    for (;;) {
+        if (mux_peer_dead_p(mux)) {
+            dbg("control master lost its connection");
+            break;
+        }
+
+        unsigned timeout_ms = 0;
+        if (mux_nr_sessions(mux) == 0 && idle_timeout_ms != 0) {
+            double idle_ms = (seconds_since_epoch() - idle_since) * 1000;
+            if (idle_ms >= idle_timeout_ms) {
+                dbg("control master idle; exiting");
+                break;
+            }
+            timeout_ms = (unsigned) (idle_timeout_ms - idle_ms) + 1;
+        }
+
+        if (mux_step(mux, ctx.listen, timeout_ms))
+            control_master_accept(mux, ctx.listen->fd);
+
+        if (mux_nr_sessions(mux) > 0)
+            idle_since = seconds_since_epoch();
+    }
+
+    return 0;
+}
+
+// Where fb-adb forward connects: a TCP port on loopback if PORT is
+// nonzero and otherwise an abstract socket on the device.
+struct forward_endpoint {
+    unsigned port;
+    const char* socket_name;
+};
+
+static struct forward_endpoint
+parse_forward_endpoint(const char* spec, bool device)
+{
+    struct forward_endpoint ep = { 0 };
+    const char* abstract_prefix = "localabstract:";
+    if (string_starts_with_p(spec, "tcp:")) {
+        const char* port = spec + strlen("tcp:");
+        char* endptr;
+        errno = 0;
+        unsigned long portno = strtoul(port, &endptr, 10);
+        if (endptr == port || *endptr != '\0' || errno != 0 ||
+            portno == 0 || portno > UINT16_MAX)
+        {
+            die(EINVAL, "invalid port in %s", spec);
+        }
+        ep.port = portno;
+    } else if (device && string_starts_with_p(spec, abstract_prefix)) {
+        ep.socket_name = spec + strlen(abstract_prefix);
+        if (ep.socket_name[0] == '\0')
+            die(EINVAL, "empty socket name in %s", spec);
+    } else {
+        die(EINVAL, "unsupported %s socket %s",
+            device ? "device" : "host", spec);
+    }
+
+    return ep;
+}
+
+static struct fdh*
+forward_listen(unsigned port)
+{
+    SCOPED_RESLIST(rl);
+    int sock = xsocket(AF_INET, SOCK_STREAM, 0);
+    int v = 1;
+    xsetsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &v, sizeof (v));
+
+    struct addr addr;
+    memset(&addr, 0, sizeof (addr));
+    addr.size = sizeof (addr.addr_in);
+    addr.addr_in.sin_family = AF_INET;
+    addr.addr_in.sin_port = htons(port);
+    addr.addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    xbind(sock, &addr);
+    xlisten(sock, 128);
+    fd_set_blocking_mode(sock, non_blocking);
+    dbg("forward: listening on %s", describe_addr(&addr));
+
+    WITH_CURRENT_RESLIST(rl->parent);
+    return fdh_dup(sock);
+}
+
+// Accept every connection waiting on LISTEN_FD, so that a burst of
+// clients doesn't overflow the listen queue.  Return whether there
+// might be more.
+static bool
+forward_accept(struct mux* mux,
+               int listen_fd,
+               const struct forward_endpoint* remote)
+{
+    SCOPED_RESLIST(rl);
+    int client = xaccept_nonblock(listen_fd);
+    if (client == -1)
+        return false;
+
+    disable_tcp_nagle(client);
+    if (!mux_connect_session(mux, client, remote->port, remote->socket_name))
+        dbg("forward: too many connections; dropping client");
+    return true;
+}
+
+int
+forward_main(const struct cmd_forward_info* info)
+{
+    SCOPED_RESLIST(rl);
+
+    struct forward_endpoint local =
+        parse_forward_endpoint(info->local, false);
+    struct forward_endpoint remote =
+        parse_forward_endpoint(info->remote, true);
+
+    struct strlist* adb_args_list = strlist_new();
+    emit_args_adb_opts(adb_args_list, &info->adb);
+    const char* const* adb_args = strlist_to_argv(adb_args_list);
+
+    struct shex_common_info cinfo = {
+        .adb = info->adb,
+        .user = info->user,
+        .transport = info->transport,
+    };
+
+    struct fdh* listen = forward_listen(local.port);
+    struct child_hello chello;
+    struct childcom* tc = tc_connect_direct(&cinfo, adb_args, &chello);
+    struct mux* mux = mux_over_childcom(tc,
+                                        FORWARD_MAX_CONNECTIONS,
+                                        FORWARD_SESSION_BUFSZ);
+
+    while (!mux_peer_dead_p(mux))
+        if (mux_step(mux, listen, 0))
+            while (forward_accept(mux, listen->fd, &remote))
+                continue;
+
+    die(ECOMM, "lost connection to device with %u connections open",
+        mux_nr_sessions(mux));
+}
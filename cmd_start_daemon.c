@@ -36,6 +36,7 @@ start_daemon_main(const struct cmd_start_daemon_info* info)
         .stub.listen = true,
         .stub.daemonize = true,
         .stub.replace = info->start_daemon.replace,
+        .stub.pool_size = info->start_daemon.pool_size,
     };
 
     set_prgname(xaprintf("%s stub", xbasename(orig_argv0)));
@@ -47,9 +47,94 @@
 #include "stubdaemon.h"
 #include "androidmsg.h"
 #include "argv.h"
+#include "mux.h"
+#include "elfid.h"
+#include "xcmdcache.h"
+#include "stripe.h"
 
 static bool should_send_error_packet = false;
 
+#ifdef HAVE_SHM_TRANSPORT
+// The shared memory transport a local host offered with
+// --shm-transport.  We consume ring 0 and produce into ring 1; the
+// rings are mapped once the shex hello asks for them.
+struct stub_shm {
+    int memfd;
+    int rx_bell;
+    int tx_bell;
+    struct shmring* rx;
+    struct shmring* tx;
+};
+
+static struct stub_shm* stub_shm;
+
+static void
+parse_shm_transport(const char* arg)
+{
+    int fds[3];
+    int n = -1;
+    if (sscanf(arg, "%d,%d,%d%n", &fds[0], &fds[1], &fds[2], &n) != 3 ||
+        arg[n] != '\0')
+    {
+        die(EINVAL, "invalid shared memory transport: %s", arg);
+    }
+
+    // Don't leak the host's rings to our child.
+    for (unsigned i = 0; i < ARRAYSIZE(fds); ++i)
+        if (merge_O_CLOEXEC_into_fd_flags(fds[i], O_CLOEXEC) == -1)
+            die_errno("fcntl");
+
+    stub_shm = xcalloc(sizeof (*stub_shm));
+    stub_shm->memfd = fds[0];
+    stub_shm->rx_bell = fds[1];
+    stub_shm->tx_bell = fds[2];
+}
+#endif
+
+static void
+use_shm_transport(void)
+{
+#ifdef HAVE_SHM_TRANSPORT
+    if (stub_shm != NULL) {
+        stub_shm->rx = shmring_open(stub_shm->memfd, 0, false);
+        stub_shm->tx = shmring_open(stub_shm->memfd, 1, true);
+        return;
+    }
+#endif
+    die(ECOMM, "peer asked for a shared memory transport we lack");
+}
+
+// Receive the host's standard streams that it wants our child to use
+// directly.  The host sends them on the shm doorbell socket before it
+// rings any doorbell, so they're the first thing waiting there.
+// The descriptors are owned by the current reslist.
+static void
+receive_passed_fds(unsigned passed_fds, int fds[3])
+{
+#ifdef HAVE_SHM_TRANSPORT
+    if (stub_shm != NULL) {
+        int received[3];
+        unsigned nr = 0;
+        for (unsigned i = 0; i < 3; ++i)
+            if (passed_fds & (1<<i))
+                nr += 1;
+        recv_fds(stub_shm->rx_bell, received, nr);
+        nr = 0;
+        for (unsigned i = 0; i < 3; ++i)
+            fds[i] = (passed_fds & (1<<i)) ? received[nr++] : -1;
+        return;
+    }
+#endif
+    die(ECOMM, "peer passed file descriptors without a shm transport");
+}
+
+static void
+handle_sigchld_passed_fds(int signo)
+{
+    // Nothing to do: we just want ppoll to return so the main loop
+    // can notice that the child died.
+}
+
 static void
 send_exit_message(int status, struct fb_adb_sh* sh)
 {
@@ -197,33 +282,25 @@ handle_open_exec_file(struct msg_open_exec_file* oef)
         oef->msg.size - offsetof(struct msg_open_exec_file, basename));
     if (strchr(xcmd_basename, '/'))
         die(ECOMM, "xcmd command cannot contain slashes");
-    const char* mydir = my_fb_adb_directory();
-    const char* exec_filename = xaprintf("%s/%s", mydir, xcmd_basename);
     SCOPED_RESLIST(rl_exec_file);
-    int exec_file = try_xopen(exec_filename, O_RDONLY, 0);
+    int exec_file = xcmd_cache_open(oef->expected_sha256_hash);
     WITH_CURRENT_RESLIST(rl);
-    if (exec_file == -1 && errno != ENOENT)
-        die_errno("open(\"%s\")", exec_filename);
     if (exec_file != -1) {
-        struct sha256_hash hash = sha256_fd(exec_file);
-        _Static_assert(
-            sizeof (oef->expected_sha256_hash) <= sizeof (hash.digest),
-            "hash size mismatch");
-        if (memcmp(oef->expected_sha256_hash,
-                   hash.digest,
-                   sizeof (oef->expected_sha256_hash)) == 0)
-        {
-            struct msg m = {
-                .type = MSG_EXEC_FILE_OK,
-                .size = sizeof (m),
-            };
-
-            write_all(STDOUT_FILENO, &m, sizeof (m));
-            reslist_xfer(rl->parent, rl_exec_file);
-            return exec_file;
-        }
+        dbg("xcmd cache hit for %s", xcmd_basename);
+        struct msg m = {
+            .type = MSG_EXEC_FILE_OK,
+            .size = sizeof (m),
+        };
+
+        write_all(STDOUT_FILENO, &m, sizeof (m));
+        reslist_xfer(rl->parent, rl_exec_file);
+        return exec_file;
     }
 
+    // Make room now, since the host is about to send us the file.
+    xcmd_cache_trim();
+    const char* exec_filename =
+        xcmd_cache_file_name(oef->expected_sha256_hash);
     size_t exec_filename_length = strlen(exec_filename);
     struct msg_exec_file_mismatch errm = {
         .msg.type = MSG_EXEC_FILE_MISMATCH,
@@ -234,6 +311,83 @@ handle_open_exec_file(struct msg_open_exec_file* oef)
     return -1;
 }
 
+static void
+handle_query_exec_files(struct msg_query_exec_files* qef)
+{
+    SCOPED_RESLIST(rl);
+    size_t payloadsz = qef->msg.size - sizeof (*qef);
+    size_t nr_hashes = payloadsz / sizeof (qef->hashes[0]);
+    if (payloadsz % sizeof (qef->hashes[0]) != 0)
+        die(ECOMM, "bad xcmd query length");
+    _Static_assert(XCMD_QUERY_MAX <= 64, "present mask too small");
+    if (nr_hashes > XCMD_QUERY_MAX)
+        die(ECOMM, "too many hashes in xcmd query");
+
+    struct msg_exec_files_present m = {
+        .msg.type = MSG_EXEC_FILES_PRESENT,
+    };
+
+    bool all_present = true;
+    for (size_t i = 0; i < nr_hashes; ++i) {
+        if (xcmd_cache_has(qef->hashes[i]))
+            m.present |= (uint64_t) 1 << i;
+        else
+            all_present = false;
+    }
+
+    if (!all_present)
+        xcmd_cache_trim();
+
+    const char* dir = xcmd_cache_directory();
+    size_t dir_length = strlen(dir);
+    m.msg.size = sizeof (m) + dir_length;
+    write_all(STDOUT_FILENO, &m, sizeof (m));
+    write_all(STDOUT_FILENO, dir, dir_length);
+}
+
+// Bootstrap messages come either one by one on standard input or
+// packed into a MSG_EXEC_REQUEST, which we read whole and then parse
+// from memory.
+struct arglist_source {
+    reader rdr;
+    const uint8_t* buf; // Non-NULL while parsing an exec request
+    size_t pos;
+    size_t size;
+};
+
+static size_t
+arglist_source_read(struct arglist_source* src, void* buf, size_t sz)
+{
+    if (src->buf == NULL)
+        return src->rdr(STDIN_FILENO, buf, sz);
+
+    size_t nr = XMIN(sz, src->size - src->pos);
+    memcpy(buf, src->buf + src->pos, nr);
+    src->pos += nr;
+    return nr;
+}
+
+static struct msg*
+arglist_source_read_msg(struct arglist_source* src)
+{
+    if (src->buf == NULL)
+        return read_msg(STDIN_FILENO, src->rdr);
+
+    struct msg mhdr;
+    if (arglist_source_read(src, &mhdr, sizeof (mhdr)) < sizeof (mhdr))
+        die_setup_eof();
+    if (mhdr.size < sizeof (mhdr))
+        die(ECOMM, "bad handshake: impossible message in exec request");
+
+    struct msg* m = xalloc(mhdr.size);
+    memcpy(m, &mhdr, sizeof (mhdr));
+    size_t restsz = mhdr.size - sizeof (mhdr);
+    if (arglist_source_read(src, (char*) m + sizeof (mhdr), restsz) < restsz)
+        die_setup_eof();
+    dbgmsg(m, "exec request");
+    return m;
+}
+
 static void
 read_child_arglist(reader rdr,
                    size_t expected,
@@ -245,6 +399,7 @@ read_child_arglist(reader rdr,
     const char* cwd = NULL;
     struct xenviron* xe = NULL;
     int exec_file = -1;
+    struct arglist_source src = { .rdr = rdr };
 
     if (expected >= SIZE_MAX / sizeof (*argv))
         die(EFBIG, "too many arguments");
@@ -252,12 +407,30 @@ read_child_arglist(reader rdr,
     argv = xalloc(sizeof (*argv) * (1+expected));
     size_t argno = 0;
     while (argno < expected) {
+        if (src.buf != NULL && src.pos == src.size)
+            src.buf = NULL;
+
         SCOPED_RESLIST(rl_read_arg);
-        struct msg* mhdr = read_msg(STDIN_FILENO, rdr);
+        struct msg* mhdr = arglist_source_read_msg(&src);
         const char* argval = NULL;
         size_t arglen;
 
-        if (mhdr->type == MSG_CMDLINE_ARGUMENT) {
+        if (mhdr->type == MSG_EXEC_REQUEST) {
+            if (src.buf != NULL)
+                die(ECOMM, "bad handshake: nested exec request");
+            struct msg_exec_request* er =
+                CHECK_MSG_CAST(mhdr, struct msg_exec_request);
+            size_t payload_size = er->payload_size;
+            if (payload_size > 0) {
+                WITH_CURRENT_RESLIST(rl_read_arg->parent);
+                uint8_t* payload = xalloc(payload_size);
+                if (rdr(STDIN_FILENO, payload, payload_size) < payload_size)
+                    die_setup_eof();
+                src.buf = payload;
+                src.pos = 0;
+                src.size = payload_size;
+            }
+        } else if (mhdr->type == MSG_CMDLINE_ARGUMENT) {
             struct msg_cmdline_argument* m =
                 CHECK_MSG_CAST(mhdr, struct msg_cmdline_argument);
             argval = m->value;
@@ -289,7 +462,7 @@ read_child_arglist(reader rdr,
                                struct msg_cmdline_argument_jumbo);
             arglen = mj->actual_size;
             void* buf = xalloc(arglen);
-            size_t nr_read = rdr(STDIN_FILENO, buf, arglen);
+            size_t nr_read = arglist_source_read(&src, buf, arglen);
             if (nr_read != arglen)
                 die_setup_eof();
             argval = buf;
@@ -336,9 +509,13 @@ read_child_arglist(reader rdr,
             char* name = xalloc((size_t) ej->name_length + 1);
             char* value = xalloc((size_t) ej->value_length + 1);
 
-            if (rdr(STDIN_FILENO, name, ej->name_length) < ej->name_length ||
-                rdr(STDIN_FILENO, value, ej->value_length) < ej->value_length)
+            if (arglist_source_read(&src, name, ej->name_length)
+                < ej->name_length ||
+                arglist_source_read(&src, value, ej->value_length)
+                < ej->value_length)
+            {
                 die_setup_eof();
+            }
 
             name[ej->name_length] = '\0';
             value[ej->value_length] = '\0';
@@ -369,8 +546,11 @@ read_child_arglist(reader rdr,
                 die_setup_overflow();
 
             char* name = xalloc((size_t) uej->name_length + 1);
-            if (rdr(STDIN_FILENO, name, uej->name_length) < uej->name_length)
+            if (arglist_source_read(&src, name, uej->name_length)
+                < uej->name_length)
+            {
                 die_setup_eof();
+            }
 
             name[uej->name_length] = '\0';
             if (xe == NULL) {
@@ -389,6 +569,9 @@ read_child_arglist(reader rdr,
                 CHECK_MSG_CAST(mhdr, struct msg_open_exec_file);
             WITH_CURRENT_RESLIST(rl_read_arg->parent);
             exec_file = handle_open_exec_file(oef);
+        } else if (mhdr->type == MSG_QUERY_EXEC_FILES) {
+            handle_query_exec_files(
+                CHECK_MSG_CAST(mhdr, struct msg_query_exec_files));
         } else {
             die(ECOMM,
                 "bad handshake: unknown init msg s=%u t=%u",
@@ -409,12 +592,62 @@ read_child_arglist(reader rdr,
         }
     }
 
+    if (src.buf != NULL && src.pos != src.size)
+        die(ECOMM, "bad handshake: junk after arguments in exec request");
+
     argv[expected] = NULL;
     *out_argv = argv;
     *out_cwd = cwd;
     *out_xe = xe;
 }
 
+// Commands so small that exec'ing and initializing a fresh copy of
+// ourselves costs more than running them.  We run these in the child
+// we fork anyway: we still want a separate process so that the
+// session's io loop has an independent producer of output.
+static const char* const builtin_commands[] = {
+    "getprop",
+    "finfo-json",
+    "pidof",
+    "readlink",
+    "fcat",
+};
+
+struct builtin_child_info {
+    int argc;
+    char** argv;
+    const char* const* environ;
+};
+
+static bool
+builtin_command_p(char** child_args)
+{
+    if (strcmp(child_args[0], "/proc/self/exe") != 0 ||
+        child_args[1] == NULL ||
+        strcmp(child_args[1], orig_argv0) != 0 ||
+        child_args[2] == NULL)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < ARRAYSIZE(builtin_commands); ++i)
+        if (!strcmp(child_args[2], builtin_commands[i]))
+            return true;
+
+    return false;
+}
+
+__attribute__((noreturn))
+static void
+run_builtin_child(void* data)
+{
+    struct builtin_child_info* bci = data;
+    should_send_error_packet = false;
+    if (bci->environ != NULL)
+        environ = (char**) bci->environ;
+    run_main_in_child(bci->argc, bci->argv);
+}
+
 static struct child*
 start_child(reader rdr, struct msg_shex_hello* shex_hello)
 {
@@ -422,6 +655,10 @@ start_child(reader rdr, struct msg_shex_hello* shex_hello)
         die(ECOMM, "insufficient arguments given");
 
     SCOPED_RESLIST(rl_args);
+    int passed_fd[3] = { -1, -1, -1 };
+    if (shex_hello->passed_fds)
+        receive_passed_fds(shex_hello->passed_fds, passed_fd);
+
     char** child_args;
     const char* child_chdir = NULL;
     struct xenviron* child_xe = NULL;
@@ -444,14 +681,30 @@ start_child(reader rdr, struct msg_shex_hello* shex_hello)
         .child_chdir = child_chdir,
     };
 
-    for (unsigned i = 0; i < 3; ++i)
-        csi.io[i] = shex_hello->si[i].pty_p
-            ? CHILD_IO_PTY
-            : CHILD_IO_PIPE;
+    for (unsigned i = 0; i < 3; ++i) {
+        if (passed_fd[i] != -1) {
+            csi.io[i] = CHILD_IO_FD;
+            csi.io_fd[i] = passed_fd[i];
+        } else {
+            csi.io[i] = shex_hello->si[i].pty_p
+                ? CHILD_IO_PTY
+                : CHILD_IO_PIPE;
+        }
+    }
 
     if (shex_hello->ctty_p)
         csi.flags |= CHILD_CTTY;
 
+    if (builtin_command_p(child_args)) {
+        struct builtin_child_info* bci = xcalloc(sizeof (*bci));
+        bci->argv = child_args + 1;
+        bci->argc = argv_count((const char* const*) bci->argv);
+        bci->environ = csi.environ;
+        dbg("running builtin %s without exec", bci->argv[1]);
+        csi.pre_exec = run_builtin_child;
+        csi.pre_exec_data = bci;
+    }
+
     return child_start(&csi);
 }
 
@@ -544,6 +797,7 @@ connect_peer_tcp4_socket(struct msg* mhdr)
 
     int client = xsocket(AF_INET, SOCK_STREAM, 0);
     disable_tcp_nagle(client);
+    dbg("tcp socket: %s", tune_tcp_socket(client, rbmsg->sockbufsz));
 
     struct addr addr;
     memset(&addr, 0, sizeof (addr));
@@ -564,8 +818,9 @@ connect_peer_tcp6_socket(struct msg* mhdr)
     if (rbmsg->msg.size < sizeof (*rbmsg))
         die(ECOMM, "invalid MSG_REBIND_TO_TCP6_SOCKET length");
 
-    int client = xsocket(AF_INET, SOCK_STREAM, 0);
+    int client = xsocket(AF_INET6, SOCK_STREAM, 0);
     disable_tcp_nagle(client);
+    dbg("tcp socket: %s", tune_tcp_socket(client, rbmsg->sockbufsz));
 
     struct addr addr;
     memset(&addr, 0, sizeof (addr));
@@ -619,22 +874,6 @@ xmkraw(int fd)
     xtcsetattr(fd, &attr);
 }
 
-#ifdef __ANDROID__
-static unsigned
-abi_to_abi_bit(const char* abi)
-{
-    if (string_starts_with_p(abi, "armeabi"))
-        return FB_ADB_ARCH_ARM;
-    if (string_starts_with_p(abi, "arm64"))
-        return FB_ADB_ARCH_AARCH64;
-    if (!strcmp(abi, "x86"))
-        return FB_ADB_ARCH_X86;
-    if (!strcmp(abi, "x86_64"))
-        return FB_ADB_ARCH_AMD64;
-    return 0;
-}
-#endif
-
 static unsigned
 make_abi_mask(unsigned api_level)
 {
@@ -671,14 +910,98 @@ make_abi_mask(unsigned api_level)
     return abi_mask;
 }
 
+static unsigned
+parse_pool_size(const char* s)
+{
+    char* endptr = NULL;
+    errno = 0;
+    unsigned long pool_size = strtoul(s, &endptr, 10);
+    if (errno != 0 || endptr == s || *endptr != '\0' ||
+        pool_size > MAX_STUB_DAEMON_POOL_SIZE)
+    {
+        die(EINVAL, "invalid pool size: %s", s);
+    }
+    return (unsigned) pool_size;
+}
+
+// Extra connections the host stripes the session over, indexed by
+// stripe; stripe zero is our standard input and output.
+static struct fdh* stub_stripes[MAX_STRIPES];
+static unsigned stub_nr_stripes;
+
+static void
+accept_stripes(struct msg* mhdr)
+{
+    struct msg_open_stripes* osmsg =
+        CHECK_MSG_CAST(mhdr, struct msg_open_stripes);
+    unsigned nr_stripes = osmsg->nr_stripes;
+    if (nr_stripes < 2 || nr_stripes > MAX_STRIPES)
+        die(ECOMM, "invalid stripe count %u", nr_stripes);
+
+    SCOPED_RESLIST(rl_stripes);
+    size_t socket_name_length = osmsg->msg.size - sizeof (*osmsg);
+    char* socket_name = xstrndup(osmsg->socket, socket_name_length);
+    int listening_socket = xsocket(AF_UNIX, SOCK_STREAM, 0);
+    xbind(listening_socket, make_addr_unix_abstract(
+              socket_name, strlen(socket_name)));
+    xlisten(listening_socket, MAX_STRIPES);
+    send_socket_available_now_message();
+
+    set_timeout_ms(STRIPE_ACCEPT_TIMEOUT_MS, ETIMEDOUT,
+                   "timed out waiting for stripe connections");
+
+    for (unsigned i = 1; i < nr_stripes; ++i) {
+        int conn = xaccept(listening_socket);
+        struct msg* hello = read_msg(conn, read_all);
+        if (hello->type != MSG_STRIPE_HELLO)
+            die(ECOMM, "bad stripe hello");
+        unsigned stripe =
+            CHECK_MSG_CAST(hello, struct msg_stripe_hello)->stripe;
+        if (stripe == 0 || stripe >= nr_stripes ||
+            stub_stripes[stripe] != NULL)
+        {
+            die(ECOMM, "bad stripe number %u", stripe);
+        }
+
+        WITH_CURRENT_RESLIST(rl_stripes->parent);
+        stub_stripes[stripe] = fdh_dup(conn);
+    }
+
+    stub_nr_stripes = nr_stripes;
+}
+
+// Make a stripe set over PRIMARY_FD and the connections from
+// accept_stripes.  If DUP_STRIPES, use copies of those connections
+// so that the stripe set for the other direction can have the
+// originals.
+static struct stripe_set*
+stub_stripe_set(int primary_fd, bool dup_stripes)
+{
+    struct fdh* fdh[MAX_STRIPES];
+    fdh[0] = fdh_dup(primary_fd);
+    for (unsigned i = 1; i < stub_nr_stripes; ++i)
+        fdh[i] = dup_stripes
+            ? fdh_dup(stub_stripes[i]->fd)
+            : stub_stripes[i];
+    return stripe_set_new(fdh, stub_nr_stripes);
+}
+
 static int
 stub_main_1(const struct cmd_stub_info* info)
 {
+#ifdef HAVE_SHM_TRANSPORT
+    if (info->stub.shm_transport)
+        parse_shm_transport(info->stub.shm_transport);
+#endif
+
     if (info->stub.listen &&
         run_stub_daemon(
             (struct stub_daemon_info){
                 .daemonize = info->stub.daemonize,
                 .replace = info->stub.replace,
+                .pool_size = ( info->stub.pool_size
+                               ? parse_pool_size(info->stub.pool_size)
+                               : 0 ),
             }) == STUB_DAEMON_EXIT_PROGRAM)
     {
         return 0;
@@ -704,7 +1027,8 @@ stub_main_1(const struct cmd_stub_info* info)
             FB_ADB_PROTO_START_LINE "\n", build_fingerprint,
             make_abi_mask(my_api_level),
              (unsigned) getuid(),
-            my_api_level);
+            my_api_level,
+            boot_id());
     xflush(xstdout);
 
     should_send_error_packet = true;
@@ -733,6 +1057,15 @@ stub_main_1(const struct cmd_stub_info* info)
         re_exec_as_user(username, umsg->shell_thunk); // Never returns
     }
 
+    if (mhdr->type == MSG_MUX_HELLO)
+        return mux_stub_main(
+            CHECK_MSG_CAST(mhdr, struct msg_mux_hello));
+
+    if (mhdr->type == MSG_OPEN_STRIPES) {
+        accept_stripes(mhdr);
+        mhdr = read_msg(STDIN_FILENO, rdr);
+    }
+
     if (mhdr->type != MSG_SHEX_HELLO ||
         mhdr->size < sizeof (struct msg_shex_hello))
     {
@@ -740,6 +1073,8 @@ stub_main_1(const struct cmd_stub_info* info)
     }
 
     shex_hello = (struct msg_shex_hello*) mhdr;
+    if (shex_hello->shm_transport)
+        use_shm_transport();
 
     struct child* child = start_child(rdr, shex_hello);
 
@@ -755,14 +1090,44 @@ stub_main_1(const struct cmd_stub_info* info)
 
     sh->process_msg = stub_process_msg;
     sh->max_outgoing_msg = shex_hello->maxmsg;
+    sh->max_outgoing_jumbo = shex_hello->maxjumbo;
+    sh->cork_delay_ms = shex_hello->cork_delay_ms;
     sh->nrch = 5;
     struct channel** ch = xalloc(sh->nrch * sizeof (*ch));
 
     should_send_error_packet = false;
 
-    ch[FROM_PEER] = channel_new(fdh_dup(STDIN_FILENO),
-                                shex_hello->stub_recv_bufsz,
-                                CHANNEL_FROM_FD);
+#ifdef HAVE_SHM_TRANSPORT
+    if (shex_hello->shm_transport) {
+        dbg("using shared memory transport");
+        ch[FROM_PEER] = channel_new_shm(stub_shm->rx,
+                                        fdh_dup(stub_shm->rx_bell),
+                                        shex_hello->stub_recv_bufsz,
+                                        CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new_shm(stub_shm->tx,
+                                      fdh_dup(stub_shm->tx_bell),
+                                      shex_hello->stub_send_bufsz,
+                                      CHANNEL_TO_FD);
+    } else
+#endif
+    if (stub_nr_stripes > 1) {
+        dbg("striping over %u connections", stub_nr_stripes);
+        ch[FROM_PEER] = channel_new_striped(
+            stub_stripe_set(STDIN_FILENO, true),
+            shex_hello->stub_recv_bufsz,
+            CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new_striped(
+            stub_stripe_set(STDOUT_FILENO, false),
+            shex_hello->stub_send_bufsz,
+            CHANNEL_TO_FD);
+    } else {
+        ch[FROM_PEER] = channel_new(fdh_dup(STDIN_FILENO),
+                                    shex_hello->stub_recv_bufsz,
+                                    CHANNEL_FROM_FD);
+        ch[TO_PEER] = channel_new(fdh_dup(STDOUT_FILENO),
+                                  shex_hello->stub_send_bufsz,
+                                  CHANNEL_TO_FD);
+    }
 
     ch[FROM_PEER]->window = UINT32_MAX;
     ch[FROM_PEER]->adb_encoding_hack = shex_hello->adb_encoding_hack;
@@ -770,49 +1135,107 @@ stub_main_1(const struct cmd_stub_info* info)
     dbg("using adb encoding hack: %s",
         shex_hello->adb_encoding_hack ? "yes" : "no");
 
-    ch[TO_PEER] = channel_new(fdh_dup(STDOUT_FILENO),
-                              shex_hello->stub_send_bufsz,
-                              CHANNEL_TO_FD);
-
     replace_stdin_stdout_with_dev_null();
 
     // See comment in cmd_shex.c
     ch[TO_PEER]->always_buffer = true;
 
+    // Under a busy daemon, take only our share of its buffer budget.
+    // Window sizes follow buffer sizes, so this also caps the windows
+    // we advertise.  The peer channels need only hold one message,
+    // and they're the peer's to size, so leave them alone.
+    size_t stdio_bufsz_max =
+        XMAX(stub_daemon_buffer_budget() / 3, MIN_CHANNEL_WINDOW);
+    size_t stdio_bufsz[3];
+    for (unsigned i = 0; i < 3; ++i) {
+        stdio_bufsz[i] = XMIN(shex_hello->si[i].bufsz, stdio_bufsz_max);
+        if (stdio_bufsz[i] < shex_hello->si[i].bufsz)
+            dbg("daemon busy: capping stream %u buffer at %lu bytes",
+                i, (unsigned long) stdio_bufsz[i]);
+    }
+
     ch[CHILD_STDIN] = channel_new(child->fd[STDIN_FILENO],
-                                  shex_hello->si[STDIN_FILENO].bufsz,
+                                  stdio_bufsz[STDIN_FILENO],
                                   CHANNEL_TO_FD);
 
     if (shex_hello->si[STDIN_FILENO].compress)
         ch[CHILD_STDIN]->compress = true;
 
+    if (shex_hello->si[STDIN_FILENO].compress_stream)
+        ch[CHILD_STDIN]->compress_stream = true;
+
     ch[CHILD_STDIN]->track_bytes_written = true;
     ch[CHILD_STDIN]->bytes_written =
-        ringbuf_room(ch[CHILD_STDIN]->rb);
+        XMIN(ringbuf_room(ch[CHILD_STDIN]->rb), INITIAL_CHANNEL_WINDOW);
 
     ch[CHILD_STDOUT] = channel_new(child->fd[STDOUT_FILENO],
-                                   shex_hello->si[STDOUT_FILENO].bufsz,
+                                   stdio_bufsz[STDOUT_FILENO],
                                    CHANNEL_FROM_FD);
     ch[CHILD_STDOUT]->track_window = true;
+    ch[CHILD_STDOUT]->priority = shex_hello->si[STDOUT_FILENO].pty_p
+        ? CHANNEL_PRIORITY_INTERACTIVE
+        : CHANNEL_PRIORITY_BULK;
 
     if (shex_hello->si[STDOUT_FILENO].compress)
         ch[CHILD_STDOUT]->compress = true;
 
+    if (shex_hello->si[STDOUT_FILENO].compress_stream)
+        ch[CHILD_STDOUT]->compress_stream = true;
+
+    if (shex_hello->si[STDOUT_FILENO].compress_dict)
+        ch[CHILD_STDOUT]->compress_dict = true;
+
+    ch[CHILD_STDOUT]->lz4_acceleration = shex_hello->si[STDOUT_FILENO].lz4_acceleration;
+
     ch[CHILD_STDERR] = channel_new(child->fd[STDERR_FILENO],
-                                   shex_hello->si[STDERR_FILENO].bufsz,
+                                   stdio_bufsz[STDERR_FILENO],
                                    CHANNEL_FROM_FD);
     ch[CHILD_STDERR]->track_window = true;
+    ch[CHILD_STDERR]->priority = shex_hello->si[STDERR_FILENO].pty_p
+        ? CHANNEL_PRIORITY_INTERACTIVE
+        : CHANNEL_PRIORITY_STDERR;
 
     if (shex_hello->si[STDERR_FILENO].compress)
         ch[CHILD_STDERR]->compress = true;
 
+    if (shex_hello->si[STDERR_FILENO].compress_stream)
+        ch[CHILD_STDERR]->compress_stream = true;
+
+    if (shex_hello->si[STDERR_FILENO].compress_dict)
+        ch[CHILD_STDERR]->compress_dict = true;
+
+    ch[CHILD_STDERR]->lz4_acceleration = shex_hello->si[STDERR_FILENO].lz4_acceleration;
+
+    // The child uses the host's own descriptors for passed streams,
+    // so their channels start out dead on both sides and the peer
+    // expects no traffic for them.
+    for (unsigned i = 0; i < 3; ++i)
+        if (shex_hello->passed_fds & (1<<i)) {
+            channel_close(ch[CHILD_STDIN + i]);
+            ch[CHILD_STDIN + i]->sent_eof = true;
+        }
+
+    // Without our own pipes, end-of-file on the child's output no
+    // longer tells us that it's done, so we watch for its death.
+    bool watch_child = (shex_hello->passed_fds &
+                        ((1<<STDOUT_FILENO) | (1<<STDERR_FILENO)));
+    if (watch_child) {
+        struct sigaction sa = {
+            .sa_handler = handle_sigchld_passed_fds,
+        };
+        sigaction_restore_as_cleanup(SIGCHLD, &sa);
+        save_signals_unblock_for_io();
+        sigaddset(&signals_unblock_for_io, SIGCHLD);
+    }
+
     sh->ch = ch;
     io_loop_init(sh);
 
     PUMP_WHILE(sh, (!channel_dead_p(ch[FROM_PEER]) &&
                     !channel_dead_p(ch[TO_PEER]) &&
                     (!channel_dead_p(ch[CHILD_STDOUT]) ||
-                     !channel_dead_p(ch[CHILD_STDERR]))));
+                     !channel_dead_p(ch[CHILD_STDERR]) ||
+                     (watch_child && !child_poll_death(child)))));
 
     if (channel_dead_p(ch[FROM_PEER]) || channel_dead_p(ch[TO_PEER])) {
         dbg("abnormal exit: closing peer channels");
@@ -897,6 +1320,15 @@ send_error_packet(void* data)
     me->msg.type = MSG_ERROR;
     me->msg.size = packet_length;
     memcpy(&me->text[0], ei->msg, msg_length);
+#ifdef HAVE_SHM_TRANSPORT
+    // Depending on how far it got, the host is reading either the
+    // ring or our standard output, so tell both.
+    if (stub_shm != NULL && stub_shm->tx != NULL)
+        (void) shmring_write_now(stub_shm->tx,
+                                 stub_shm->tx_bell,
+                                 me,
+                                 packet_length);
+#endif
     write_all(STDOUT_FILENO, me, packet_length);
 }
 
@@ -906,6 +1338,9 @@ stub_main(const struct cmd_stub_info* info)
     if (info->stub.daemonize && !info->stub.listen)
         usage_error("--daemonize without --listen is nonsensical");
 
+    if (info->stub.pool_size && !info->stub.listen)
+        usage_error("--pool-size without --listen is nonsensical");
+
     struct stub_main_context ctx = { .info = info };
     struct errinfo ei = { .want_msg = true };
     if (catch_error(stub_main_trampoline, &ctx, &ei)) {
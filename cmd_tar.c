@@ -16,7 +16,9 @@
 #include <fnmatch.h>
 #include <pwd.h>
 #include <grp.h>
+#include <fcntl.h>
 #include <sys/queue.h>
+#include <time.h>
 
 #if defined(MAJOR_IN_MKDEV)
 #include <sys/mkdev.h>
@@ -29,62 +31,49 @@
 #include "util.h"
 #include "autocmd.h"
 #include "fs.h"
+#include "constants.h"
+#include "lz4.h"
+#include "tree.h"
+#include "tar.h"
 
-FORWARD(ctar);
+#ifndef __unused
+# define __unused __attribute__((unused))
+#endif
 
-#if !FBADB_MAIN
+#if FBADB_MAIN
+int
+ctar_main(const struct cmd_ctar_info* info)
+{
+    // LZ4 output won't shrink further, so unless told otherwise,
+    // don't make the channel try to compress it again.
+    struct cmd_ctar_info xinfo = *info;
+    if (info->ctar.compress != NULL &&
+        info->transport.compression_acceleration == NULL)
+    {
+        xinfo.transport.compression_acceleration = "1,0";
+    }
 
-#define TAR_BLOCK_SIZE 512
-
-struct tar_hdr_v7 {
-    char name[100];
-    char mode[8];
-    char uid[8];
-    char gid[8];
-    char size[12];
-    char mtime[12];
-    char checksum[8];
-    char typeflag;
-    char linkname[100];
-};
+    return forward_to_rcmd(
+        make_args_cmd_ctar(CMD_ARG_NON_FORWARDED, &xinfo),
+        make_args_cmd_ctar(CMD_ARG_FORWARDED, &xinfo));
+}
+#endif
 
-struct tar_hdr_ustar {
-    struct tar_hdr_v7 v7;
-    char magic[6];
-    char version[2];
-    char uname[32];
-    char gname[32];
-    char devmajor[8];
-    char devminor[8];
-    char prefix[155];
-    char pad[12];
-};
+#if !FBADB_MAIN
 
-struct tar_hdr_gnu {
-    struct tar_hdr_v7 v7;
-    char magic[6];
-    char version[2];
-    char uname[32];
-    char gname[32];
-    char devmajor[8];
-    char devminor[8];
-    char offset[12];
-    char longnames[4];
-    char unused[1];
-    struct {
-        char offset[12];
-        char numbytes[12];
-    } sparse[4];
-    char isextended[1];
-    char realsize[12];
-    char pad[17];
+// The runs of data in a sparse file, in order.  We archive only these
+// bytes.  As GNU tar does, we end the map with an empty run at EOF if
+// the file ends in a hole.
+struct tar_sparse_run {
+    uint64_t offset;
+    uint64_t length;
 };
 
-union tar_block {
-    struct tar_hdr_v7 v7;
-    struct tar_hdr_ustar ustar;
-    struct tar_hdr_gnu gnu;
-    char data[512];
+struct tar_sparse_map {
+    size_t nr_runs;
+    struct tar_sparse_run* runs; // Points into buf
+    struct growable_buffer buf;
+    uint64_t archived_size;
 };
 
 enum pattern_mode {
@@ -95,6 +84,10 @@ enum pattern_mode {
 enum pattern_kind {
     PATTERN_FNMATCH,
     PATTERN_REGMATCH,
+    // Glob patterns simple enough to match without fnmatch
+    PATTERN_LITERAL, // No wildcards at all
+    PATTERN_PREFIX,  // Literal followed by '*'
+    PATTERN_SUFFIX,  // '*' followed by literal
 };
 
 struct pattern {
@@ -103,16 +96,219 @@ struct pattern {
     const char* fnmatch_pattern;
     enum pattern_mode mode;
     enum pattern_kind kind;
+    // For glob patterns, the literal text before the first wildcard
+    // (for PATTERN_SUFFIX, the text after the '*').
+    const char* literal;
+    size_t literal_length;
+    // If this pattern matches "DIR/", it matches everything under DIR.
+    bool covers_subtree;
+};
+
+// One line of a manifest: what an archived entry looked like when we
+// last archived it.
+struct manifest_entry {
+    RB_ENTRY(manifest_entry) link;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_ns;
+    uint64_t dev;
+    uint64_t ino;
+    bool have_sha256;
+    bool seen;
+    uint8_t sha256[32];
+    char path[0];
+};
+
+static int
+manifest_entry_cmp(struct manifest_entry* left,
+                   struct manifest_entry* right)
+{
+    return strcmp(left->path, right->path);
+}
+
+RB_HEAD(manifest, manifest_entry);
+RB_PROTOTYPE_STATIC(manifest, manifest_entry, link, manifest_entry_cmp);
+RB_GENERATE_STATIC(manifest, manifest_entry, link, manifest_entry_cmp);
+
+// A multiply-linked regular file whose contents we've archived under
+// NAME, the member name we gave it.  Other links to the same inode
+// become hard link members pointing at NAME.  With --manifest-hash,
+// we remember the hash so that we needn't read the file again.
+struct archived_inode {
+    RB_ENTRY(archived_inode) link;
+    uint64_t dev;
+    uint64_t ino;
+    struct sha256_hash sha256;
+    char name[0];
 };
 
+static int
+archived_inode_cmp(struct archived_inode* left,
+                   struct archived_inode* right)
+{
+    if (left->dev != right->dev)
+        return left->dev < right->dev ? -1 : 1;
+    if (left->ino != right->ino)
+        return left->ino < right->ino ? -1 : 1;
+    return 0;
+}
+
+RB_HEAD(archived_inodes, archived_inode);
+RB_PROTOTYPE_STATIC(archived_inodes, archived_inode, link,
+                    archived_inode_cmp);
+RB_GENERATE_STATIC(archived_inodes, archived_inode, link,
+                   archived_inode_cmp);
+
 struct ctar_ctx {
     uint8_t* buf;
     size_t bufsz;
     bool force;
     bool promised_file;
+    bool sendfile_ok;
     STAILQ_HEAD(, pattern) patterns;
+    // With --compress=lz4, archive bytes collect in LZ4_BLOCK until
+    // we have a whole block to compress into LZ4_OUT.
+    char* lz4_block;
+    size_t lz4_block_used;
+    char* lz4_out;
+    // With --since-manifest, the entries of the old manifest; with
+    // --write-manifest, where the new one goes until we rename it.
+    bool have_old_manifest;
+    struct manifest old_manifest;
+    FILE* new_manifest;
+    bool manifest_hash;
+    // Multiply-linked files we've archived so far, and the reslist
+    // that owns them.
+    struct archived_inodes inodes;
+    struct reslist* keep;
 };
 
+// XXH32 of an input shorter than 16 bytes, which is all the LZ4
+// frame format asks of us: its header checksum covers only the
+// frame descriptor.
+static uint32_t
+xxh32_short(const uint8_t* p, size_t len, uint32_t seed)
+{
+    static const uint32_t prime1 = 2654435761U;
+    static const uint32_t prime2 = 2246822519U;
+    static const uint32_t prime3 = 3266489917U;
+    static const uint32_t prime4 = 668265263U;
+    static const uint32_t prime5 = 374761393U;
+#define XXH_ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+    assert(len < 16);
+    uint32_t h = seed + prime5 + (uint32_t) len;
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t word = (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+            ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+        h += word * prime3;
+        h = XXH_ROTL32(h, 17) * prime4;
+    }
+    for (; len > 0; p += 1, len -= 1) {
+        h += *p * prime5;
+        h = XXH_ROTL32(h, 11) * prime1;
+    }
+#undef XXH_ROTL32
+    h ^= h >> 15;
+    h *= prime2;
+    h ^= h >> 13;
+    h *= prime3;
+    h ^= h >> 16;
+    return h;
+}
+
+static void
+put_le32(uint8_t* p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+// Block maximum size codes from the LZ4 frame format's BD byte.
+static uint8_t
+lz4_frame_block_code(size_t block_size)
+{
+    switch (block_size) {
+        case 64*1024: return 4;
+        case 256*1024: return 5;
+        case 1024*1024: return 6;
+        case 4*1024*1024: return 7;
+        default: abort();
+    }
+}
+
+// Start an LZ4 frame of independent blocks, without checksums, so
+// that stock lz4 -d can unpack what we write.
+static void
+ctar_lz4_start(struct ctar_ctx* ctx)
+{
+    ctx->lz4_block = xalloc(CTAR_LZ4_BLOCK);
+    ctx->lz4_out = xalloc(LZ4_compressBound(CTAR_LZ4_BLOCK));
+    uint8_t header[7];
+    put_le32(&header[0], 0x184D2204);
+    header[4] = (1 << 6) | (1 << 5); // Version 01, independent blocks
+    header[5] = lz4_frame_block_code(CTAR_LZ4_BLOCK) << 4;
+    header[6] = (xxh32_short(&header[4], 2, 0) >> 8) & 0xFF;
+    write_all(STDOUT_FILENO, header, sizeof (header));
+}
+
+static void
+ctar_lz4_flush(struct ctar_ctx* ctx)
+{
+    if (ctx->lz4_block_used == 0)
+        return;
+
+    int size = LZ4_compress_default(ctx->lz4_block,
+                                    ctx->lz4_out,
+                                    (int) ctx->lz4_block_used,
+                                    LZ4_compressBound(CTAR_LZ4_BLOCK));
+    uint8_t block_header[4];
+    if (size <= 0 || (size_t) size >= ctx->lz4_block_used) {
+        // The high bit marks a block we store uncompressed.
+        put_le32(block_header, ctx->lz4_block_used | (1U << 31));
+        write_all(STDOUT_FILENO, block_header, sizeof (block_header));
+        write_all(STDOUT_FILENO, ctx->lz4_block, ctx->lz4_block_used);
+    } else {
+        put_le32(block_header, size);
+        write_all(STDOUT_FILENO, block_header, sizeof (block_header));
+        write_all(STDOUT_FILENO, ctx->lz4_out, size);
+    }
+    ctx->lz4_block_used = 0;
+}
+
+// Write SZ bytes of archive.
+static void
+ctar_write(struct ctar_ctx* ctx, const void* buf, size_t sz)
+{
+    if (ctx->lz4_block == NULL) {
+        write_all(STDOUT_FILENO, buf, sz);
+        return;
+    }
+
+    const char* p = buf;
+    while (sz > 0) {
+        size_t n = XMIN(sz, CTAR_LZ4_BLOCK - ctx->lz4_block_used);
+        memcpy(ctx->lz4_block + ctx->lz4_block_used, p, n);
+        ctx->lz4_block_used += n;
+        if (ctx->lz4_block_used == CTAR_LZ4_BLOCK)
+            ctar_lz4_flush(ctx);
+        p += n;
+        sz -= n;
+    }
+}
+
+static void
+ctar_finish(struct ctar_ctx* ctx)
+{
+    if (ctx->lz4_block != NULL) {
+        ctar_lz4_flush(ctx);
+        uint8_t end_mark[4] = { 0 };
+        write_all(STDOUT_FILENO, end_mark, sizeof (end_mark));
+    }
+}
+
 static uint64_t
 octal_field_max(unsigned octal_digits)
 {
@@ -177,14 +373,31 @@ fill_header_checksum(union tar_block* hdr)
     sprintf(hdr->v7.checksum, "%06o ", total);
 }
 
+static size_t
+tar_padding(uint64_t size)
+{
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+// Copy BYTES_LEFT bytes from FILE to the archive, followed by PAD
+// zero bytes.
 static void
 tar_copy_bytes_padded(struct ctar_ctx* ctx,
                       int file,
                       uint64_t bytes_left,
+                      size_t pad,
                       const char* path)
 {
     uint8_t* buf = ctx->buf;
     size_t bufsz = ctx->bufsz;
+    assert(pad < TAR_BLOCK_SIZE);
+
+    // When we don't need to see the bytes, let the kernel move them.
+    if (ctx->sendfile_ok && ctx->lz4_block == NULL && bytes_left > 0)
+        bytes_left -= sendfile_all(STDOUT_FILENO, file, NULL,
+                                   XMIN(bytes_left, (uint64_t) SIZE_MAX),
+                                   &ctx->sendfile_ok);
+
     while (bytes_left > 0) {
         size_t to_read = bufsz;
         if (to_read > bytes_left)
@@ -194,19 +407,130 @@ tar_copy_bytes_padded(struct ctar_ctx* ctx,
             die(EINVAL, "short %llu bytes reading %s",
                 (unsigned long long) bytes_left, path);
         bytes_left -= chunksz;
-        if (bytes_left == 0 && chunksz % TAR_BLOCK_SIZE) {
-            size_t pad = TAR_BLOCK_SIZE - (chunksz % TAR_BLOCK_SIZE);
+        if (bytes_left == 0 && pad > 0 && chunksz + pad <= bufsz) {
             memset(&buf[chunksz], 0, pad);
             chunksz += pad;
+            pad = 0;
         }
-        write_all(STDOUT_FILENO, buf, chunksz);
+        ctar_write(ctx, buf, chunksz);
+    }
+
+    if (pad > 0) {
+        memset(buf, 0, pad);
+        ctar_write(ctx, buf, pad);
+    }
+}
+
+static void
+tar_add_sparse_run(struct tar_sparse_map* map,
+                   uint64_t offset,
+                   uint64_t length)
+{
+    while (map->buf.bufsz < (map->nr_runs + 1) * sizeof (*map->runs))
+        grow_buffer_dwim(&map->buf);
+    map->runs = (struct tar_sparse_run*) map->buf.buf;
+    map->runs[map->nr_runs].offset = offset;
+    map->runs[map->nr_runs].length = length;
+    map->nr_runs += 1;
+    map->archived_size += length;
+}
+
+// Map the data in regular file FILE, or return NULL if we should
+// archive it normally.  The map's memory belongs to the current
+// reslist.
+static struct tar_sparse_map*
+tar_map_sparse_file(int file, const struct stat* st)
+{
+    if (!stat_sparse_p(st))
+        return NULL;
+
+    struct tar_sparse_map* map = xcalloc(sizeof (*map));
+    uint64_t size = st->st_size;
+    uint64_t pos = 0;
+    while (pos < size) {
+        uint64_t data_start, data_end;
+        if (!find_data_segment(file, pos, size, &data_start, &data_end))
+            return NULL;
+        if (data_start == size)
+            break;
+        tar_add_sparse_run(map, data_start, data_end - data_start);
+        pos = data_end;
+    }
+
+    if (map->nr_runs == 0 ||
+        map->runs[map->nr_runs - 1].offset +
+        map->runs[map->nr_runs - 1].length < size)
+    {
+        tar_add_sparse_run(map, size, 0);
+    }
+
+    return map;
+}
+
+static void
+fill_sparse_entry(const char* path,
+                  struct tar_sparse_entry* entry,
+                  const struct tar_sparse_run* run)
+{
+    fill_octal_field(path, "sparse offset",
+                     entry->offset, sizeof (entry->offset),
+                     run->offset, FIELD_ALLOW_BASE256);
+    fill_octal_field(path, "sparse numbytes",
+                     entry->numbytes, sizeof (entry->numbytes),
+                     run->length, FIELD_ALLOW_BASE256);
+}
+
+// Write the extension blocks for entries of MAP that didn't fit in
+// the main header.
+static void
+write_sparse_extensions(struct ctar_ctx* ctx,
+                        const char* path,
+                        const struct tar_sparse_map* map)
+{
+    size_t nr_in_header = ARRAYSIZE(((struct tar_hdr_gnu*)0)->sparse);
+    for (size_t i = nr_in_header; i < map->nr_runs;) {
+        union tar_block ext;
+        memset(&ext, 0, sizeof (ext));
+        size_t nr_in_block = ARRAYSIZE(ext.gnu_sparse_ext.sparse);
+        for (size_t j = 0; j < nr_in_block && i < map->nr_runs; ++j, ++i)
+            fill_sparse_entry(path,
+                              &ext.gnu_sparse_ext.sparse[j],
+                              &map->runs[i]);
+        if (i < map->nr_runs)
+            ext.gnu_sparse_ext.isextended[0] = '1';
+        ctar_write(ctx, &ext, sizeof (ext));
     }
 }
 
 static void
+tar_copy_sparse_file(struct ctar_ctx* ctx,
+                     int file,
+                     const struct tar_sparse_map* map,
+                     const char* path)
+{
+    size_t pad = tar_padding(map->archived_size);
+    for (size_t i = 0; i < map->nr_runs; ++i) {
+        const struct tar_sparse_run* run = &map->runs[i];
+        if (lseek(file, run->offset, SEEK_SET) == (off_t) -1)
+            die_errno("lseek(\"%s\")", path);
+        tar_copy_bytes_padded(ctx, file, run->length,
+                              i + 1 == map->nr_runs ? pad : 0,
+                              path);
+    }
+}
+
+// Write the header for PATH.  If SPARSE is not NULL, PATH is a
+// regular file we'd like to archive as a GNU sparse file with that
+// map.  Return SPARSE, or NULL if we archived the file normally after
+// all, because its name needs a ustar prefix.  HARDLINK, if not NULL,
+// names the member that already holds the contents of regular file
+// PATH, which we then archive as a hard link to it.
+static const struct tar_sparse_map*
 write_ctar_header(struct ctar_ctx* ctx,
                   const char* path,
-                  const struct stat* st)
+                  const struct stat* st,
+                  const struct tar_sparse_map* sparse,
+                  const char* hardlink)
 {
     union tar_block hdr;
     _Static_assert(sizeof (hdr) == TAR_BLOCK_SIZE, "tar spec");
@@ -242,6 +566,10 @@ write_ctar_header(struct ctar_ctx* ctx,
         die(EINVAL, "path too long: %s", orig_path);
     }
 
+    // GNU headers keep other things where ustar keeps the prefix.
+    if (prefix_end != prefix)
+        sparse = NULL;
+
     memcpy(hdr.v7.name, path, path_end - path);
     memcpy(hdr.ustar.prefix, prefix, prefix_end - prefix);
 
@@ -249,7 +577,7 @@ write_ctar_header(struct ctar_ctx* ctx,
 
     switch (st->st_mode & S_IFMT) {
         case S_IFSOCK: {
-            return; // Silently skip sockets
+            return NULL; // Silently skip sockets
         }
         case S_IFLNK: {
             hdr.v7.typeflag = '2';
@@ -261,7 +589,15 @@ write_ctar_header(struct ctar_ctx* ctx,
             break;
         }
         case S_IFREG: {
-            hdr.v7.typeflag = '0';
+            if (hardlink != NULL) {
+                hdr.v7.typeflag = '1';
+                size_t hardlink_length = strlen(hardlink);
+                assert(hardlink_length <= sizeof (hdr.v7.linkname));
+                memcpy(hdr.v7.linkname, hardlink, hardlink_length);
+                sparse = NULL;
+                break;
+            }
+            hdr.v7.typeflag = sparse ? 'S' : '0';
             break;
         }
         case S_IFBLK: {
@@ -300,9 +636,12 @@ write_ctar_header(struct ctar_ctx* ctx,
     fill_octal_field(path, "gid",
                      hdr.v7.gid, sizeof (hdr.v7.gid),
                      st->st_gid, FIELD_ALLOW_BASE256);
+    uint64_t archived_size = 0;
+    if (S_ISREG(st->st_mode) && hardlink == NULL)
+        archived_size = sparse ? sparse->archived_size : st->st_size;
     fill_octal_field(path, "size",
                      hdr.v7.size, sizeof (hdr.v7.size),
-                     S_ISREG(st->st_mode) ? st->st_size : 0,
+                     archived_size,
                      FIELD_ALLOW_BASE256);
     fill_octal_field(path, "mtime",
                      hdr.v7.mtime, sizeof (hdr.v7.mtime),
@@ -331,24 +670,189 @@ write_ctar_header(struct ctar_ctx* ctx,
             memcpy(hdr.ustar.gname, group->gr_name, gr_name_length);
     }
 
-    sprintf(hdr.ustar.magic, "ustar");
+    if (sparse) {
+        memcpy(hdr.gnu.magic, "ustar ", sizeof (hdr.gnu.magic));
+        memcpy(hdr.gnu.version, " ", sizeof (hdr.gnu.version));
+        size_t nr_in_header = ARRAYSIZE(hdr.gnu.sparse);
+        for (size_t i = 0; i < nr_in_header && i < sparse->nr_runs; ++i)
+            fill_sparse_entry(path, &hdr.gnu.sparse[i], &sparse->runs[i]);
+        if (sparse->nr_runs > nr_in_header)
+            hdr.gnu.isextended[0] = '1';
+        fill_octal_field(path, "realsize",
+                         hdr.gnu.realsize, sizeof (hdr.gnu.realsize),
+                         st->st_size, FIELD_ALLOW_BASE256);
+    } else {
+        sprintf(hdr.ustar.magic, "ustar");
+    }
+
     fill_header_checksum(&hdr);
-    write_all(STDOUT_FILENO, &hdr, sizeof (hdr));
+    ctar_write(ctx, &hdr, sizeof (hdr));
+    if (sparse)
+        write_sparse_extensions(ctx, path, sparse);
+    return sparse;
 }
 
 static bool
-should_include_in_archive(struct ctar_ctx* ctx, const char* path)
+fnmatch_special_p(char c)
+{
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+// Set up PAT to match glob pattern TEXT, using a cheap comparison
+// instead of fnmatch if TEXT allows.
+static void
+compile_glob_pattern(struct pattern* pat, const char* text)
+{
+    size_t length = strlen(text);
+    size_t literal_length = 0;
+    while (literal_length < length && !fnmatch_special_p(text[literal_length]))
+        literal_length += 1;
+
+    pat->fnmatch_pattern = xstrdup(text);
+    pat->literal = pat->fnmatch_pattern;
+    pat->literal_length = literal_length;
+
+    if (literal_length == length) {
+        pat->kind = PATTERN_LITERAL;
+    } else if (literal_length == length - 1 && text[literal_length] == '*') {
+        pat->kind = PATTERN_PREFIX;
+    } else if (text[0] == '*') {
+        size_t i = 1;
+        while (i < length && !fnmatch_special_p(text[i]))
+            i += 1;
+        if (i == length) {
+            pat->kind = PATTERN_SUFFIX;
+            pat->literal = pat->fnmatch_pattern + 1;
+            pat->literal_length = length - 1;
+        }
+    }
+
+    // Without FNM_PATHNAME, a trailing '*' matches slashes too, so
+    // whatever matched a directory's path plus '/' still matches with
+    // more stuff added.  Count backslashes to see whether the '*' is
+    // escaped.
+    if (length > 0 && text[length - 1] == '*') {
+        size_t nr_backslashes = 0;
+        while (nr_backslashes < length - 1 &&
+               text[length - 2 - nr_backslashes] == '\\')
+            nr_backslashes += 1;
+        pat->covers_subtree = (nr_backslashes % 2 == 0);
+    }
+}
+
+static bool
+regex_may_merge_p(const char* text)
+{
+    // Merging renumbers groups, which would break backreferences.
+    for (const char* p = text; *p != '\0'; ++p)
+        if (p[0] == '\\' && p[1] != '\0' && isdigit(p[1]))
+            return false;
+    return true;
+}
+
+static bool
+pattern_matches_p(const struct pattern* pat,
+                  const char* path,
+                  size_t path_length)
+{
+    switch (pat->kind) {
+        case PATTERN_LITERAL:
+            return path_length == pat->literal_length &&
+                memcmp(path, pat->literal, path_length) == 0;
+        case PATTERN_PREFIX:
+            return path_length >= pat->literal_length &&
+                memcmp(path, pat->literal, pat->literal_length) == 0;
+        case PATTERN_SUFFIX:
+            return path_length >= pat->literal_length &&
+                memcmp(path + path_length - pat->literal_length,
+                       pat->literal,
+                       pat->literal_length) == 0;
+        case PATTERN_FNMATCH:
+            return fnmatch(pat->fnmatch_pattern, path, 0) == 0;
+        case PATTERN_REGMATCH:
+            return regexec(pat->regex_pattern, path, 0, NULL, 0) == 0;
+    }
+
+    abort();
+}
+
+// Order the patterns so that the ones we can match cheaply come first
+// and combine the exclusion regexes into one: a path must fail all of
+// them, so one alternation does the job in a single regexec.
+static void
+compile_patterns(struct ctar_ctx* ctx)
 {
+    STAILQ_HEAD(, pattern) cheap, expensive;
+    STAILQ_INIT(&cheap);
+    STAILQ_INIT(&expensive);
+    struct growable_buffer merged = { 0 };
+    size_t merged_length = 0;
+    unsigned nr_merged = 0;
+    bool merged_covers_subtree = true;
+
     struct pattern* pat;
-    STAILQ_FOREACH(pat, &ctx->patterns, link) {
-        bool match;
-        if (pat->kind == PATTERN_FNMATCH) {
-            match = fnmatch(pat->fnmatch_pattern, path, 0) == 0;
+    while ((pat = STAILQ_FIRST(&ctx->patterns)) != NULL) {
+        STAILQ_REMOVE_HEAD(&ctx->patterns, link);
+        if (pat->kind == PATTERN_REGMATCH &&
+            pat->mode == PATTERN_MUST_NOT_MATCH &&
+            regex_may_merge_p(pat->fnmatch_pattern))
+        {
+            const char* text = pat->fnmatch_pattern;
+            size_t text_length = strlen(text);
+            size_t need = merged_length + text_length + sizeof ("|()");
+            while (merged.bufsz < need)
+                grow_buffer_dwim(&merged);
+            merged_length += sprintf((char*) merged.buf + merged_length,
+                                     "%s(%s)",
+                                     nr_merged ? "|" : "",
+                                     text);
+            nr_merged += 1;
+            merged_covers_subtree &= pat->covers_subtree;
+            STAILQ_INSERT_TAIL(&expensive, pat, link);
+        } else if (pat->kind == PATTERN_FNMATCH ||
+                   pat->kind == PATTERN_REGMATCH)
+        {
+            STAILQ_INSERT_TAIL(&expensive, pat, link);
         } else {
-            assert(pat->kind == PATTERN_REGMATCH);
-            match = regexec(pat->regex_pattern, path, 0, NULL, 0) == 0;
+            STAILQ_INSERT_TAIL(&cheap, pat, link);
+        }
+    }
+
+    regex_t merged_regex;
+    if (nr_merged > 1 &&
+        regcomp(&merged_regex, (char*) merged.buf,
+                REG_EXTENDED | REG_NOSUB) == 0)
+    {
+        struct pattern* m = xcalloc(sizeof (*m));
+        m->mode = PATTERN_MUST_NOT_MATCH;
+        m->kind = PATTERN_REGMATCH;
+        m->regex_pattern = xalloc(sizeof (merged_regex));
+        *m->regex_pattern = merged_regex;
+        m->covers_subtree = merged_covers_subtree;
+        struct pattern* next;
+        for (pat = STAILQ_FIRST(&expensive); pat != NULL; pat = next) {
+            next = STAILQ_NEXT(pat, link);
+            if (pat->kind == PATTERN_REGMATCH &&
+                pat->mode == PATTERN_MUST_NOT_MATCH &&
+                regex_may_merge_p(pat->fnmatch_pattern))
+            {
+                STAILQ_REMOVE(&expensive, pat, pattern, link);
+            }
         }
+        STAILQ_INSERT_HEAD(&expensive, m, link);
+    }
+
+    STAILQ_CONCAT(&ctx->patterns, &cheap);
+    STAILQ_CONCAT(&ctx->patterns, &expensive);
+}
 
+static bool
+should_include_in_archive(struct ctar_ctx* ctx, const char* path)
+{
+    size_t path_length = strlen(path);
+    struct pattern* pat;
+    STAILQ_FOREACH(pat, &ctx->patterns, link) {
+        bool match = pattern_matches_p(pat, path, path_length);
         if (pat->mode == PATTERN_MUST_MATCH && !match)
             return false;
         if (pat->mode == PATTERN_MUST_NOT_MATCH && match)
@@ -358,8 +862,348 @@ should_include_in_archive(struct ctar_ctx* ctx, const char* path)
     return true;
 }
 
+// Whether the patterns rule out everything under directory DIR, so
+// we needn't look inside it.  That's the case when an exclusion
+// matches all of it or when an inclusion's literal beginning can't
+// start any path under DIR.
+static bool
+subtree_excluded_p(struct ctar_ctx* ctx, const char* dir)
+{
+    if (STAILQ_EMPTY(&ctx->patterns))
+        return false;
+
+    SCOPED_RESLIST(rl);
+    const char* prefix = xaprintf("%s/", dir);
+    size_t prefix_length = strlen(prefix);
+    struct pattern* pat;
+    STAILQ_FOREACH(pat, &ctx->patterns, link) {
+        if (pat->mode == PATTERN_MUST_NOT_MATCH) {
+            if (pat->covers_subtree &&
+                pattern_matches_p(pat, prefix, prefix_length))
+            {
+                return true;
+            }
+        } else if (pat->kind == PATTERN_LITERAL) {
+            // Only a path longer than PREFIX and beginning with it
+            // can be under DIR.
+            if (pat->literal_length <= prefix_length ||
+                memcmp(pat->literal, prefix, prefix_length) != 0)
+            {
+                return true;
+            }
+        } else if (pat->kind == PATTERN_PREFIX ||
+                   pat->kind == PATTERN_FNMATCH)
+        {
+            size_t n = XMIN(pat->literal_length, prefix_length);
+            if (memcmp(pat->literal, prefix, n) != 0)
+                return true;
+        }
+    }
+
+    return false;
+}
+
 static void write_ctar_file(struct ctar_ctx* ctx, const char* path);
 
+// A manifest is a line saying MANIFEST_MAGIC followed by one line per
+// archived entry: its mode in octal, size, mtime seconds, mtime
+// nanoseconds, device, inode, SHA-256 in hex or "-", and path.  The
+// path comes last so that it can contain spaces; we escape '%' and
+// newlines in it as %XX.
+
+static const char manifest_magic[] = "fb-adb-manifest 1\n";
+
+static void
+manifest_write_path(FILE* out, const char* path)
+{
+    for (; *path != '\0'; ++path) {
+        if (*path == '%' || *path == '\n')
+            xprintf(out, "%%%02X", (unsigned) (unsigned char) *path);
+        else
+            xputc(*path, out);
+    }
+}
+
+static char*
+manifest_read_path(const char* s, const char* filename)
+{
+    char* path = xstrdup(s);
+    char* out = path;
+    for (; *s != '\0'; ++s) {
+        if (*s == '%') {
+            unsigned c;
+            if (sscanf(s + 1, "%2x", &c) != 1 ||
+                !isxdigit(s[1]) || !isxdigit(s[2]))
+            {
+                die(EINVAL, "bad escape in manifest %s", filename);
+            }
+            *out++ = (char) c;
+            s += 2;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+    return path;
+}
+
+static void
+read_manifest(struct ctar_ctx* ctx, const char* filename)
+{
+    RB_INIT(&ctx->old_manifest);
+    ctx->have_old_manifest = true;
+
+    int fd = try_xopen(filename, O_RDONLY, 0);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return; // First snapshot: everything is new
+        die_errno("open(\"%s\")", filename);
+    }
+
+    FILE* in = xfdopen(fd, "r");
+    char* line = slurp_line(in, NULL);
+    if (line == NULL || strcmp(line, manifest_magic) != 0)
+        die(EINVAL, "%s is not an fb-adb manifest", filename);
+
+    while ((line = slurp_line(in, NULL)) != NULL) {
+        size_t line_length = strlen(line);
+        if (line_length == 0 || line[line_length - 1] != '\n')
+            die(EINVAL, "truncated manifest %s", filename);
+        line[line_length - 1] = '\0';
+
+        unsigned mode, mtime_ns;
+        unsigned long long size, dev, ino;
+        long long mtime;
+        char hash[65];
+        int path_offset = -1;
+        if (sscanf(line, "%o %llu %lld %u %llu %llu %64s %n",
+                   &mode, &size, &mtime, &mtime_ns, &dev, &ino,
+                   hash, &path_offset) != 7 ||
+            path_offset == -1)
+        {
+            die(EINVAL, "bad line in manifest %s", filename);
+        }
+
+        char* path = manifest_read_path(line + path_offset, filename);
+        size_t path_length = strlen(path);
+        struct manifest_entry* me =
+            xcalloc(sizeof (*me) + path_length + 1);
+        memcpy(me->path, path, path_length + 1);
+        me->mode = mode;
+        me->size = size;
+        me->mtime = mtime;
+        me->mtime_ns = mtime_ns;
+        me->dev = dev;
+        me->ino = ino;
+        if (strcmp(hash, "-") != 0) {
+            if (strlen(hash) != 2 * sizeof (me->sha256))
+                die(EINVAL, "bad hash in manifest %s", filename);
+            for (size_t i = 0; i < sizeof (me->sha256); ++i) {
+                unsigned byte;
+                if (sscanf(&hash[2 * i], "%2x", &byte) != 1)
+                    die(EINVAL, "bad hash in manifest %s", filename);
+                me->sha256[i] = byte;
+            }
+            me->have_sha256 = true;
+        }
+        RB_INSERT(manifest, &ctx->old_manifest, me);
+    }
+}
+
+// Decide whether PATH, described by ST and opened as FILE if it's a
+// regular file, differs from what the old manifest says we archived
+// before.  If we're keeping hashes, store FILE's in *SHA256 first.
+static bool
+manifest_changed_p(struct ctar_ctx* ctx,
+                   const char* path,
+                   const struct stat* st,
+                   int file,
+                   struct sha256_hash* sha256)
+{
+    bool have_sha256 = false;
+    if (ctx->manifest_hash && file != -1) {
+        *sha256 = sha256_fd(file);
+        xrewindfd(file);
+        have_sha256 = true;
+    }
+
+    if (!ctx->have_old_manifest)
+        return true;
+
+    size_t path_length = strlen(path);
+    struct manifest_entry* search = alloca(sizeof (*search) + path_length + 1);
+    memcpy(search->path, path, path_length + 1);
+    struct manifest_entry* me =
+        RB_FIND(manifest, &ctx->old_manifest, search);
+    if (me == NULL)
+        return true;
+
+    me->seen = true;
+    if (me->mode != st->st_mode ||
+        me->size != (uint64_t) st->st_size ||
+        me->mtime != (int64_t) st->st_mtime ||
+        me->mtime_ns != stat_mtime_ns(st) ||
+        me->dev != (uint64_t) st->st_dev ||
+        me->ino != (uint64_t) st->st_ino)
+    {
+        return true;
+    }
+
+    return have_sha256 && me->have_sha256 &&
+        memcmp(me->sha256, sha256->digest, sizeof (me->sha256)) != 0;
+}
+
+static void
+manifest_record(struct ctar_ctx* ctx,
+                const char* path,
+                const struct stat* st,
+                const struct sha256_hash* sha256)
+{
+    FILE* out = ctx->new_manifest;
+    xprintf(out, "%o %llu %lld %u %llu %llu %s ",
+            (unsigned) st->st_mode,
+            (unsigned long long) st->st_size,
+            (long long) st->st_mtime,
+            (unsigned) stat_mtime_ns(st),
+            (unsigned long long) st->st_dev,
+            (unsigned long long) st->st_ino,
+            sha256
+            ? hex_encode_bytes(sha256->digest, sizeof (sha256->digest))
+            : "-");
+    manifest_write_path(out, path);
+    xputc('\n', out);
+}
+
+// Archive, as the regular file DELETION_LIST_NAME, the NUL-terminated
+// paths of the old manifest's entries that we didn't see this time.
+static void
+write_deletion_list(struct ctar_ctx* ctx)
+{
+    SCOPED_RESLIST(rl);
+    struct growable_buffer gb = { 0 };
+    size_t size = 0;
+    struct manifest_entry* me;
+    RB_FOREACH(me, manifest, &ctx->old_manifest) {
+        if (me->seen)
+            continue;
+        size_t path_size = strlen(me->path) + 1;
+        while (gb.bufsz < size + path_size)
+            grow_buffer_dwim(&gb);
+        memcpy(gb.buf + size, me->path, path_size);
+        size += path_size;
+    }
+
+    struct stat st;
+    memset(&st, 0, sizeof (st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = size;
+    st.st_mtime = time(NULL);
+    write_ctar_header(ctx, CTAR_DELETION_LIST_NAME, &st, NULL, NULL);
+    ctar_write(ctx, gb.buf, size);
+    uint8_t zeros[TAR_BLOCK_SIZE] = { 0 };
+    ctar_write(ctx, zeros, tar_padding(size));
+}
+
+// Start reading NAME in directory DIRFD so that the data is in the
+// page cache by the time we archive it.  Reading files one at a time
+// leaves flash storage idle between requests; this way the kernel has
+// several files' reads in flight at once without our needing threads
+// (see util.h).  Failures don't matter here: we'll find out about
+// them when we really archive the file.
+static void
+ctar_prefetch(int dirfd, const char* name)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(st.st_mode) ||
+        st.st_size == 0)
+    {
+        return;
+    }
+
+    int fd = openat(dirfd, name,
+                    O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1)
+        return;
+    hint_will_need(fd, XMIN((uint64_t) st.st_size,
+                            (uint64_t) CTAR_PREFETCH_BYTES));
+    close(fd);
+}
+
+// Names of the entries of DIR other than "." and "..", in readdir
+// order, with a NULL sentinel.  Memory belongs to the current reslist.
+static char**
+read_directory_names(DIR* dir, size_t* nr_names_out)
+{
+    struct growable_buffer gb = { 0 };
+    size_t nr_names = 0;
+    struct dirent* ent;
+    do {
+        ent = readdir(dir);
+        if (ent != NULL &&
+            (strcmp(ent->d_name, ".") == 0 ||
+             strcmp(ent->d_name, "..") == 0))
+        {
+            continue;
+        }
+
+        while (gb.bufsz < (nr_names + 1) * sizeof (char*))
+            grow_buffer_dwim(&gb);
+        ((char**) gb.buf)[nr_names++] = ent ? xstrdup(ent->d_name) : NULL;
+    } while (ent != NULL);
+
+    *nr_names_out = nr_names - 1;
+    return (char**) gb.buf;
+}
+
+// The member name under which we archive PATH.
+static const char*
+ctar_member_name(const char* path)
+{
+    while (path[0] == '/')
+        path += 1;
+    return path[0] != '\0' ? path : ".";
+}
+
+// If we've already archived the contents of the file with stat
+// information ST under some name, return what we know about it.
+static const struct archived_inode*
+find_archived_inode(struct ctar_ctx* ctx, const struct stat* st)
+{
+    if (!S_ISREG(st->st_mode) || st->st_nlink < 2)
+        return NULL;
+    struct archived_inode search = {
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+    };
+    return RB_FIND(archived_inodes, &ctx->inodes, &search);
+}
+
+// Remember that we've archived the contents of PATH so that we can
+// archive the file's other links as hard links to it.
+static void
+remember_archived_inode(struct ctar_ctx* ctx,
+                        const char* path,
+                        const struct stat* st,
+                        const struct sha256_hash* sha256)
+{
+    if (!S_ISREG(st->st_mode) || st->st_nlink < 2)
+        return;
+    const char* name = ctar_member_name(path);
+    size_t name_length = strlen(name);
+    union tar_block hdr;
+    if (name_length > sizeof (hdr.v7.linkname))
+        return; // Can't point a hard link at it
+    WITH_CURRENT_RESLIST(ctx->keep);
+    struct archived_inode* ai = xalloc(sizeof (*ai) + name_length + 1);
+    ai->dev = st->st_dev;
+    ai->ino = st->st_ino;
+    if (sha256 != NULL)
+        ai->sha256 = *sha256;
+    memcpy(ai->name, name, name_length + 1);
+    RB_INSERT(archived_inodes, &ctx->inodes, ai);
+}
+
 void
 write_ctar_file_2(struct ctar_ctx* ctx, const char* path)
 {
@@ -378,31 +1222,67 @@ write_ctar_file_2(struct ctar_ctx* ctx, const char* path)
     }
 
     bool include_in_archive = should_include_in_archive(ctx, path);
+    const struct archived_inode* hardlink =
+        include_in_archive ? find_archived_inode(ctx, &st) : NULL;
     int file = -1;
-    if (S_ISREG(st.st_mode) && include_in_archive)
+    const struct tar_sparse_map* sparse = NULL;
+    if (S_ISREG(st.st_mode) && include_in_archive && hardlink == NULL)
         file = xopen(path, O_RDONLY, 0);
+
+    bool record_in_manifest = include_in_archive && ctx->new_manifest;
+    struct sha256_hash sha256;
+    if (hardlink != NULL)
+        sha256 = hardlink->sha256;
+    if (include_in_archive &&
+        !manifest_changed_p(ctx, path, &st, file, &sha256))
+    {
+        include_in_archive = false;
+        file = -1; // Closes with the reslist
+    }
+
+    if (file != -1)
+        sparse = tar_map_sparse_file(file, &st);
     if (include_in_archive) {
         ctx->promised_file = true;
-        write_ctar_header(ctx, path, &st);
+        sparse = write_ctar_header(ctx, path, &st, sparse,
+                                   hardlink ? hardlink->name : NULL);
     }
 
-    if (file != -1)
-        tar_copy_bytes_padded(ctx, file, st.st_size, path);
+    if (file != -1) {
+        hint_sequential_access(file);
+        if (sparse != NULL) {
+            tar_copy_sparse_file(ctx, file, sparse, path);
+        } else {
+            xrewindfd(file); // Mapping holes moves the file pointer
+            tar_copy_bytes_padded(ctx, file, st.st_size,
+                                  tar_padding(st.st_size), path);
+        }
+        remember_archived_inode(ctx, path, &st,
+                                ctx->manifest_hash ? &sha256 : NULL);
+    }
 
     ctx->promised_file = false;
 
-    if (S_ISDIR(st.st_mode)) {
+    if (record_in_manifest)
+        manifest_record(ctx, path, &st,
+                        ctx->manifest_hash && S_ISREG(st.st_mode)
+                        ? &sha256
+                        : NULL);
+
+    if (S_ISDIR(st.st_mode) && !subtree_excluded_p(ctx, path)) {
         DIR* dir = xopendir(path);
-        struct dirent* ent;
-        while ((ent = readdir(dir)) != NULL) {
-            if (strcmp(ent->d_name, ".") == 0 ||
-                strcmp(ent->d_name, "..") == 0)
+        size_t nr_names;
+        char** names = read_directory_names(dir, &nr_names);
+        size_t nr_prefetched = 0;
+        for (size_t i = 0; i < nr_names; ++i) {
+            while (nr_prefetched < nr_names &&
+                   nr_prefetched < i + CTAR_PREFETCH_FILES)
             {
-                continue;
+                ctar_prefetch(dirfd(dir), names[nr_prefetched++]);
             }
 
             SCOPED_RESLIST(rl_sub);
-            write_ctar_file(ctx, xaprintf("%s/%s", path, ent->d_name));
+            write_ctar_file(ctx, xaprintf("%s/%s", path, names[i]));
         }
     }
 }
@@ -452,7 +1332,29 @@ ctar_main(const struct cmd_ctar_info* info)
     ctx.buf = xalloc(ctx.bufsz);
     assert(ctx.bufsz % TAR_BLOCK_SIZE == 0);
     ctx.force = info->ctar.ignore_errors;
+    ctx.sendfile_ok = true;
     STAILQ_INIT(&ctx.patterns);
+    RB_INIT(&ctx.inodes);
+    ctx.keep = reslist_create();
+    if (info->ctar.compress != NULL)
+        ctar_lz4_start(&ctx);
+    ctx.manifest_hash = info->ctar.manifest_hash;
+    if (info->ctar.since_manifest != NULL)
+        read_manifest(&ctx, info->ctar.since_manifest);
+    const char* new_manifest_tmp = NULL;
+    struct cleanup* new_manifest_cl = NULL;
+    int new_manifest_fd = -1;
+    if (info->ctar.write_manifest != NULL) {
+        new_manifest_tmp = xaprintf("%s.fb-adb-tmp",
+                                    info->ctar.write_manifest);
+        new_manifest_fd =
+            xopen(new_manifest_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        ctx.new_manifest = xfdopen(new_manifest_fd, "w");
+        new_manifest_cl = cleanup_allocate();
+        cleanup_commit(new_manifest_cl, unlink_cleanup,
+                       (void*) new_manifest_tmp);
+        xputs(manifest_magic, ctx.new_manifest);
+    }
 
     if (info->ctar.excludes == NULL)
         goto no_patterns;
@@ -484,24 +1386,40 @@ ctar_main(const struct cmd_ctar_info* info)
         }
 
         if (pat->kind == PATTERN_REGMATCH) {
-            pat->regex_pattern = xregcomp(pattern_arg, REG_EXTENDED);
+            pat->regex_pattern = xregcomp(pattern_arg,
+                                          REG_EXTENDED | REG_NOSUB);
+            pat->fnmatch_pattern = xstrdup(pattern_arg); // For merging
+            pat->covers_subtree = (strchr(pattern_arg, '$') == NULL);
         } else {
-            pat->fnmatch_pattern = xstrdup(pattern_arg);
+            compile_glob_pattern(pat, pattern_arg);
         }
 
         STAILQ_INSERT_TAIL(&ctx.patterns, pat, link);
     }
 
+    compile_patterns(&ctx);
+
     no_patterns:;
 
     const char* const* paths = info->paths;
     while (paths && *paths != NULL)
         write_ctar_file(&ctx, *paths++);
 
+    if (ctx.have_old_manifest)
+        write_deletion_list(&ctx);
+
+    if (ctx.new_manifest != NULL) {
+        xflush(ctx.new_manifest);
+        xfsync(new_manifest_fd);
+        xrename(new_manifest_tmp, info->ctar.write_manifest);
+        cleanup_forget(new_manifest_cl);
+    }
+
     union tar_block hdr;
     memset(&hdr, 0, sizeof (hdr));
-    write_all(STDOUT_FILENO, &hdr, sizeof (hdr));
-    write_all(STDOUT_FILENO, &hdr, sizeof (hdr));
+    ctar_write(&ctx, &hdr, sizeof (hdr));
+    ctar_write(&ctx, &hdr, sizeof (hdr));
+    ctar_finish(&ctx);
     return 0;
 }
 #endif
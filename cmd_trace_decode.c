@@ -0,0 +1,121 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+#include "autocmd.h"
+#include "dbg.h"
+#include "fs.h"
+#include "proto.h"
+
+static const char*
+trace_event_name(unsigned event)
+{
+    static const char* names[] = {
+#define E(_name) [_name] = #_name,
+        ENUM_TRACE_EVENTS(E)
+#undef E
+    };
+
+    if (event < ARRAYSIZE(names) && names[event] != NULL)
+        return names[event] + strlen("TRACE_");
+    return "???";
+}
+
+static const char*
+msg_type_name(unsigned type)
+{
+#define M(_name) if (type == _name) return #_name;
+    ENUM_MSG_TYPES(M)
+#undef M
+    return "MSG_???";
+}
+
+static void
+print_record(const struct trace_record* r, uint64_t start_ns)
+{
+    xprintf(xstdout, "%12.3f %-15s",
+            (double) (r->ns - start_ns) / 1e6,
+            trace_event_name(r->event));
+
+    switch (r->event) {
+        case TRACE_MSG_SEND:
+            xprintf(xstdout, " ch=%-2u %s size=%u payload=%u",
+                    (unsigned) r->channel, msg_type_name(r->arg[0]),
+                    (unsigned) r->arg[1], (unsigned) r->arg[2]);
+            break;
+        case TRACE_MSG_RECV:
+            xprintf(xstdout, " %s size=%u",
+                    msg_type_name(r->arg[0]), (unsigned) r->arg[1]);
+            break;
+        case TRACE_POLL_WAIT:
+            xprintf(xstdout, " timeout=%d", (int) r->arg[0]);
+            break;
+        case TRACE_POLL_WAKE:
+            xprintf(xstdout, " rc=%d", (int) r->arg[0]);
+            break;
+        case TRACE_WINDOW_GRANT:
+            xprintf(xstdout, " ch=%-2u delta=%u window=%u",
+                    (unsigned) r->channel,
+                    (unsigned) r->arg[0], (unsigned) r->arg[1]);
+            break;
+        case TRACE_COMPRESS_PROBE:
+            xprintf(xstdout, " ch=%-2u raw=%u wire=%u skip=%u",
+                    (unsigned) r->channel, (unsigned) r->arg[0],
+                    (unsigned) r->arg[1], (unsigned) r->arg[2]);
+            break;
+        default:
+            xprintf(xstdout, " ch=%-2u %u %u %u",
+                    (unsigned) r->channel, (unsigned) r->arg[0],
+                    (unsigned) r->arg[1], (unsigned) r->arg[2]);
+            break;
+    }
+
+    xputc('\n', xstdout);
+}
+
+int
+trace_decode_main(const struct cmd_trace_decode_info* info)
+{
+    int fd = xopen(info->file, O_RDONLY | O_CLOEXEC, 0);
+    size_t sz;
+    const char* buf = slurp_fd(fd, &sz);
+
+    struct trace_file_header hdr;
+    if (sz < sizeof (hdr))
+        die(EINVAL, "%s: truncated trace", info->file);
+    memcpy(&hdr, buf, sizeof (hdr));
+    if (memcmp(hdr.magic, TRACE_FILE_MAGIC, sizeof (hdr.magic)) != 0)
+        die(EINVAL, "%s: not an fb-adb trace", info->file);
+    if (hdr.record_size != sizeof (struct trace_record))
+        die(EINVAL, "%s: unsupported record size %u",
+            info->file, (unsigned) hdr.record_size);
+    if ((sz - sizeof (hdr)) / hdr.record_size < hdr.nr_records)
+        die(EINVAL, "%s: truncated trace", info->file);
+
+    hdr.prgname[sizeof (hdr.prgname) - 1] = '\0';
+    xprintf(xstdout, "# %s pid %u: %u events\n",
+            hdr.prgname, (unsigned) hdr.pid, (unsigned) hdr.nr_records);
+
+    const char* records = buf + sizeof (hdr);
+    uint64_t start_ns = 0;
+    for (uint32_t i = 0; i < hdr.nr_records; ++i) {
+        struct trace_record r;
+        memcpy(&r, records + i * sizeof (r), sizeof (r));
+        if (i == 0)
+            start_ns = r.ns;
+        print_record(&r, start_ns);
+    }
+
+    xflush(xstdout);
+    return 0;
+}
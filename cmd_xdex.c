@@ -12,6 +12,10 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
 #include "util.h"
 #include "autocmd.h"
 #include "constants.h"
@@ -20,6 +24,11 @@
 #include "child.h"
 #include "peer.h"
 #include "dex.h"
+#include "net.h"
+
+FORWARD(agent_stub);
+
+static const char agent_class_name[] = "com.facebook.fbadb.agent.Agent";
 
 #if FBADB_MAIN
 
@@ -240,6 +249,18 @@ agent_main(const struct cmd_agent_info* info)
         full_dex_jar_path = xstrdup(resp);
     }
 
+    if (!info->agent.no_resident) {
+        set_prgname("agent-stub");
+        struct cmd_agent_stub_info agent_stub_info = {
+            .adb = info->adb,
+            .transport = info->transport,
+            .user = info->user,
+            .dexfile = full_dex_jar_path,
+            .args = info->args,
+        };
+        return agent_stub_main(&agent_stub_info);
+    }
+
     set_prgname("rdex");
     struct cmd_rdex_info rdex_info = {
         .rdex.no_compile = 1,
@@ -247,7 +268,7 @@ agent_main(const struct cmd_agent_info* info)
         .transport = info->transport,
         .user = info->user,
         .dexfile = full_dex_jar_path,
-        .classname = "com.facebook.fbadb.agent.Agent",
+        .classname = agent_class_name,
         .args = info->args,
     };
     return rdex_main(&rdex_info);
@@ -275,4 +296,151 @@ xdex_stub_main(const struct cmd_xdex_stub_info* info) {
     return 0;
 }
 
+// The resident agent is an app_process VM running the agent's serve
+// loop on an abstract socket named for the agent build and our uid.
+// It answers each connection with one run of the agent; see
+// Agent.java for the protocol.
+
+static char*
+agent_socket_name(const char* dex_file_name)
+{
+    char* stem = xbasename(dex_file_name);
+    char* dot = strchr(stem, '.');
+    if (dot != NULL)
+        *dot = '\0';
+    return xaprintf("fb-adb-%s-%u", stem, (unsigned) getuid());
+}
+
+static void
+agent_server_setup(void* data)
+{
+    const char* dex_file_name = data;
+    if (setenv("CLASSPATH", dex_file_name, 1) == -1)
+        die_errno("setenv");
+}
+
+static void
+start_agent_server(const char* dex_file_name, const char* socket_name)
+{
+    SCOPED_RESLIST(rl);
+    int ready_fd;
+    pid_t child;
+
+    {
+        SCOPED_RESLIST(rl_pipe);
+        int ready_read, ready_write;
+        xpipe(&ready_read, &ready_write);
+        child = fork();
+        if (child == (pid_t) -1)
+            die_errno("fork");
+
+        if (child == 0) {
+            // Our child exits once the grandchild is a daemon; the
+            // grandchild becomes the VM.
+            become_daemon(agent_server_setup, (void*) dex_file_name);
+            xdup3nc(ready_write, STDOUT_FILENO, 0);
+            sigset_t no_signals;
+            VERIFY(sigemptyset(&no_signals) == 0);
+            VERIFY(sigprocmask(SIG_SETMASK, &no_signals, NULL) == 0);
+            execvp("app_process",
+                   (char* const*)
+                   ARGV("app_process",
+                        xdirname(dex_file_name),
+                        agent_class_name,
+                        "--serve",
+                        socket_name,
+                        xaprintf("%d", AGENT_IDLE_TIMEOUT_MS)));
+            die_errno("execvp(\"app_process\", ...");
+        }
+
+        WITH_CURRENT_RESLIST(rl_pipe->parent);
+        ready_fd = xdup(ready_read);
+    }
+
+    int status;
+    while (waitpid(child, &status, 0) == -1)
+        if (errno != EINTR)
+            die_errno("waitpid");
+    if (!child_status_success_p(status))
+        die(ECOMM, "could not start resident agent");
+
+    // The VM closes its standard output once it is listening.  If it
+    // exits without saying so, another VM probably won the race to
+    // bind the socket, so try connecting either way.
+    char* ready = slurp_fd(ready_fd, NULL);
+    rtrim(ready, NULL, "\n");
+    dbg("resident agent startup: [%s]", ready);
+}
+
+struct agent_request {
+    const char* socket_name;
+    const char* const* args;
+    int32_t status;
+    char* err;
+    size_t errsz;
+    char* out;
+    size_t outsz;
+};
+
+static void
+agent_request_1(void* data)
+{
+    struct agent_request* req = data;
+    int fd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+    xconnect(fd, make_addr_unix_abstract_s(req->socket_name));
+#ifdef SO_PEERCRED
+    // Anyone can bind an abstract socket name, so make sure we're
+    // talking to our own agent.
+    if (get_peer_credentials(fd).uid != getuid())
+        die(ECOMM, "resident agent socket owned by another user");
+#endif
+
+    for (const char* const* argp = req->args; *argp != NULL; ++argp)
+        write_all(fd, *argp, strlen(*argp) + 1);
+    xshutdown(fd, SHUT_WR);
+
+    size_t replysz;
+    char* reply = slurp_fd(fd, &replysz);
+    uint32_t hdr[2];
+    if (replysz < sizeof (hdr))
+        die(ECOMM, "resident agent closed connection");
+    memcpy(hdr, reply, sizeof (hdr));
+    size_t errsz = ntohl(hdr[1]);
+    if (errsz > replysz - sizeof (hdr))
+        die(ECOMM, "resident agent reply truncated");
+
+    req->status = (int32_t) ntohl(hdr[0]);
+    req->err = reply + sizeof (hdr);
+    req->errsz = errsz;
+    req->out = req->err + errsz;
+    req->outsz = replysz - sizeof (hdr) - errsz;
+}
+
+int
+agent_stub_main(const struct cmd_agent_stub_info* info)
+{
+    const char* dex_file_name = info->dexfile;
+    compile_dex(dex_file_name);
+
+    struct agent_request req = {
+        .socket_name = agent_socket_name(dex_file_name),
+        .args = info->args ?: empty_argv,
+    };
+
+    // The resident VM may be gone, may never have started, or may
+    // have timed out just as we connected; in every case, starting a
+    // new one and asking again is the cure.
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(agent_request_1, &req, &ei)) {
+        dbg("no resident agent at [%s] (%s); starting one",
+            req.socket_name, ei.msg);
+        start_agent_server(dex_file_name, req.socket_name);
+        agent_request_1(&req);
+    }
+
+    write_all(STDERR_FILENO, req.err, req.errsz);
+    write_all(STDOUT_FILENO, req.out, req.outsz);
+    return req.status;
+}
+
 #endif
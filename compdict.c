@@ -0,0 +1,168 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include "compdict.h"
+
+// LZ4 finds matches anywhere in the history at the same cost, so
+// order doesn't matter much; we keep related text together for
+// whoever edits this next.  The stub and the host are built from the
+// same source, so changing this text doesn't break compatibility.
+const char compression_dictionary[] =
+    // dumpsys and am/pm output
+    "DUMP OF SERVICE activity:\n"
+    "ACTIVITY MANAGER PENDING INTENTS (dumpsys activity intents)\n"
+    "ACTIVITY MANAGER PROCESSES (dumpsys activity processes)\n"
+    "  mFocusedActivity: ActivityRecord{\n"
+    "  mResumedActivity: ActivityRecord{\n"
+    "    TaskRecord{ #0 A=com.android.launcher3 U=0 StackId=0 sz=1}\n"
+    "    Intent { act=android.intent.action.MAIN "
+    "cat=[android.intent.category.LAUNCHER] flg=0x10200000 cmp=}\n"
+    "DUMP OF SERVICE meminfo:\nApplications Memory Usage (in Kilobytes):\n"
+    "                   Pss  Private  Private  SwapPss     Heap     Heap"
+    "     Heap\n                 Total    Dirty    Clean    Dirty     Size"
+    "    Alloc     Free\n  Native Heap\n  Dalvik Heap\n  Dalvik Other\n"
+    "        Stack\n       Ashmem\n    Other dev\n     .so mmap\n"
+    "    .apk mmap\n    .dex mmap\n    .oat mmap\n    .art mmap\n"
+    "   Other mmap\n      Unknown\n        TOTAL\n"
+    "DUMP OF SERVICE package:\nPackages:\n  Package [com.android.]"
+    " (\n    userId=10\n    pkg=Package{\n    codePath=/data/app/\n"
+    "    resourcePath=/data/app/\n    legacyNativeLibraryDir=/data/app-lib/\n"
+    "    primaryCpuAbi=arm64-v8a\n    secondaryCpuAbi=null\n"
+    "    versionCode= minSdk= targetSdk=\n    versionName=\n"
+    "    dataDir=/data/user/0/\n    firstInstallTime=\n    lastUpdateTime=\n"
+    "    installPermissionsFixed=true\n    requested permissions:\n"
+    "      android.permission.INTERNET\n"
+    "      android.permission.ACCESS_NETWORK_STATE\n"
+    "      android.permission.WRITE_EXTERNAL_STORAGE\n"
+    "      android.permission.READ_EXTERNAL_STORAGE\n"
+    "      android.permission.WAKE_LOCK\n"
+    "    install permissions:\n      granted=true\n"
+    "package:/data/app/com.android.\npackage:/system/app/\n"
+    "package:/system/priv-app/\n"
+    "Starting: Intent { act=android.intent.action.VIEW dat=\n"
+    "Status: ok\nLaunchState: COLD\nActivity: \nTotalTime: \nWaitTime: \n"
+    "Complete\nSuccess\nFailure [INSTALL_FAILED_\n"
+    // Property names and getprop output
+    "[ro.build.version.sdk]: [\n[ro.build.version.release]: [\n"
+    "[ro.build.fingerprint]: [\n[ro.build.type]: [userdebug]\n"
+    "[ro.build.display.id]: [\n[ro.build.id]: [\n[ro.build.tags]: ["
+    "release-keys]\n[ro.product.model]: [\n[ro.product.manufacturer]: [\n"
+    "[ro.product.brand]: [\n[ro.product.device]: [\n[ro.product.name]: [\n"
+    "[ro.product.cpu.abi]: [arm64-v8a]\n[ro.product.cpu.abilist]: ["
+    "arm64-v8a,armeabi-v7a,armeabi]\n[ro.hardware]: [\n[ro.serialno]: [\n"
+    "[ro.debuggable]: [1]\n[ro.secure]: [1]\n[ro.boot.serialno]: [\n"
+    "[ro.boot.hardware]: [\n[persist.sys.timezone]: [\n"
+    "[persist.sys.usb.config]: [mtp,adb]\n[sys.boot_completed]: [1]\n"
+    "[init.svc.adbd]: [running]\n[init.svc.zygote]: [running]\n"
+    "[dalvik.vm.heapsize]: [\n[dalvik.vm.heapgrowthlimit]: [\n"
+    "[net.dns1]: [\n[wifi.interface]: [wlan0]\n[gsm.operator.alpha]: [\n"
+    // JSON from finfo-json, ps-json, logcat-json, and friends
+    "{\"filename\":\"/data/local/tmp/\",\"stat\":{\"result\":"
+    "{\"modes\":\"-rw-r--r--\",\"st_dev\":,\"st_ino\":,\"st_mode\":33188,"
+    "\"st_nlink\":1,\"st_uid\":0,\"st_gid\":0,\"st_rdev\":0,\"st_size\":,"
+    "\"st_blksize\":4096,\"st_blocks\":8,\"st_atime\":,\"st_atim\":,"
+    "\"st_mtime\":,\"st_mtim\":,\"st_ctime\":,\"st_ctim\":}},"
+    "\"lstat\":{\"result\":{\"modes\":\"drwxrwx--x\"}},"
+    "\"sha256\":{\"result\":\"\"},"
+    "\"ls\":{\"result\":[{\"d_name\":\"\",\"d_ino\":,\"d_type\":\"DT_REG\"},"
+    "{\"d_type\":\"DT_DIR\"},{\"d_type\":\"DT_LNK\"}]},"
+    "\"depth\":1,\"event\":\"modify\"}\n"
+    "{\"result\":null,\"error\":{\"errno\":2,\"errmsg\":"
+    "\"stat: No such file or directory\"}}\n"
+    "{\"errmsg\":\"open: Permission denied\"}\n"
+    "{\"pid\":,\"start_time\":,\"event\":\"spawn\",\"cmdline\":"
+    "[\"/system/bin/\",\"zygote64\",\"app_process\",\"--zygote\"],"
+    "\"environ\":[\"PATH=/sbin:/system/sbin:/system/bin:/system/xbin:"
+    "/vendor/bin\",\"ANDROID_DATA=/data\",\"ANDROID_ROOT=/system\","
+    "\"ANDROID_ASSETS=/system/app\",\"ANDROID_STORAGE=/storage\","
+    "\"EXTERNAL_STORAGE=/sdcard\",\"BOOTCLASSPATH=/system/framework/"
+    "core-oj.jar:/system/framework/framework.jar\"],"
+    "\"stat\":{\"comm\":\"\",\"state\":\"S\",\"ppid\":1,\"pgrp\":,"
+    "\"session\":0,\"minflt\":,\"majflt\":,\"utime\":,\"stime\":,"
+    "\"priority\":20,\"nice\":0,\"num_threads\":,\"starttime\":,"
+    "\"vsize\":,\"rss\":,\"processor\":0},\"statm\":{\"page_size\":4096,"
+    "\"size\":,\"resident\":,\"shared\":,\"text\":,\"lib\":0,\"data\":,"
+    "\"dt\":0},\"oom_score_adj\":0,\"status\":{\"Name\":\"\","
+    "\"State\":\"S (sleeping)\",\"Tgid\":\"\",\"Pid\":\"\",\"PPid\":\"\","
+    "\"Uid\":\"\",\"Gid\":\"\",\"VmRSS\":\" kB\",\"Threads\":\"\"}}\n"
+    "{\"event\":\"exit\"}\n{\"event\":\"change\"}\n"
+    "{\"buffer\":\"main\",\"pid\":,\"tid\":,\"sec\":,\"nsec\":,"
+    "\"time\":\"\",\"priority\":\"I\",\"tag\":\"ActivityManager\","
+    "\"message\":\"\"}\n{\"buffer\":\"system\",\"priority\":\"D\"}\n"
+    "{\"buffer\":\"events\",\"tag\":\"am_proc_start\",\"values\":[]}\n"
+    "{\"buffer\":\"crash\",\"priority\":\"E\",\"tag\":\"AndroidRuntime\"}\n"
+    // logcat -v threadtime
+    " I ActivityManager: Start proc \n"
+    " I ActivityManager: Displayed com.\n"
+    " I ActivityManager: Process com. (pid ) has died\n"
+    " I ActivityManager: START u0 {act=android.intent.action.MAIN "
+    "cat=[android.intent.category.LAUNCHER] flg=0x10200000 cmp=} from uid "
+    "2000 on display 0\n"
+    " W ActivityManager: Slow operation: \n"
+    " D PackageManager: \n I PackageManager: \n"
+    " I art     : Background concurrent mark sweep GC freed (), "
+    "% free, /, paused ms total ms\n"
+    " I art     : Background sticky concurrent mark sweep GC freed\n"
+    " I zygote64: Explicit concurrent copying GC freed \n"
+    " D dalvikvm: GC_CONCURRENT freed K, % free K/K, paused ms+ms, "
+    "total ms\n"
+    " E AndroidRuntime: FATAL EXCEPTION: main\n"
+    " E AndroidRuntime: Process: com., PID: \n"
+    " E AndroidRuntime: java.lang.RuntimeException: \n"
+    " E AndroidRuntime: java.lang.NullPointerException: Attempt to invoke "
+    "virtual method ' on a null object reference\n"
+    " E AndroidRuntime: \tat android.app.ActivityThread."
+    "performLaunchActivity(ActivityThread.java:)\n"
+    " E AndroidRuntime: \tat android.os.Handler.dispatchMessage"
+    "(Handler.java:)\n"
+    " E AndroidRuntime: \tat android.os.Looper.loop(Looper.java:)\n"
+    " E AndroidRuntime: \tat android.app.ActivityThread.main"
+    "(ActivityThread.java:)\n"
+    " E AndroidRuntime: \tat java.lang.reflect.Method.invoke(Native Method)\n"
+    " E AndroidRuntime: \tat com.android.internal.os.ZygoteInit.main"
+    "(ZygoteInit.java:)\n"
+    " E AndroidRuntime: Caused by: \n"
+    " F DEBUG   : *** *** *** *** *** *** *** *** *** *** *** *** *** *** "
+    "*** ***\n F DEBUG   : Build fingerprint: '\n"
+    " F DEBUG   : Revision: '0'\n F DEBUG   : ABI: 'arm64'\n"
+    " F DEBUG   : pid: , tid: , name:   >>> <<<\n"
+    " F DEBUG   : signal 11 (SIGSEGV), code 1 (SEGV_MAPERR), fault addr 0x\n"
+    " F DEBUG   : backtrace:\n F DEBUG   :     #00 pc  /system/lib64/"
+    "libc.so (\n F DEBUG   :     #01 pc  /system/lib64/libart.so (\n"
+    " I chatty  : uid= expire  lines\n"
+    " D ConnectivityService: \n I WifiService: \n D WifiStateMachine: \n"
+    " I InputDispatcher: \n W InputMethodManagerService: \n"
+    " I WindowManager: \n D SurfaceFlinger: \n I Choreographer: Skipped "
+    "frames!  The application may be doing too much work on its main "
+    "thread.\n"
+    " D OpenGLRenderer: \n I ActivityThread: \n W System.err: \n"
+    " D NetworkSecurityConfig: No Network Security Config specified, "
+    "using platform default\n"
+    " I System.out: \n D BluetoothAdapter: \n I PowerManagerService: \n"
+    " D BatteryService: \n I Zygote  : \n I ServiceManager: \n"
+    " I auditd  : type=1400 audit(): avc: denied { read } for pid= "
+    "comm=\"\" name=\"\" dev=\"\" ino= scontext=u:r:untrusted_app:s0:c512,"
+    "c768 tcontext=u:object_r:  tclass=file permissive=0\n"
+    "--------- beginning of main\n--------- beginning of system\n"
+    "--------- beginning of crash\n"
+    // ls -l and ps
+    "drwxr-xr-x root     root              \n"
+    "-rw-r--r-- root     root              \n"
+    "lrwxrwxrwx root     root              \n"
+    "drwxrwx--x system   system            \n"
+    "drwxr-x--x u0_a     u0_a              \n"
+    "USER      PID   PPID  VSIZE  RSS   WCHAN              PC  NAME\n"
+    "root      1     0                SyS_epoll_wait         S /init\n"
+    "u0_a         zygote64               S com.android.\n"
+    "system       zygote64               S system_server\n"
+    ;
+
+const size_t compression_dictionary_size =
+    sizeof (compression_dictionary) - 1;
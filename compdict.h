@@ -0,0 +1,20 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stddef.h>
+
+// Text typical of what device commands write: logcat lines, the JSON
+// our own commands emit, property names, and dumpsys output.  Streams
+// with compress_dict set start their LZ4 history with these bytes, so
+// even the first block of such a stream has something to refer to.
+// Both ends must agree on every byte.
+extern const char compression_dictionary[];
+extern const size_t compression_dictionary_size;
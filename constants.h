@@ -25,10 +25,73 @@
 #define DEFAULT_MAX_CMDSZ 4096
 #define DEFAULT_MAX_CMDSZ_SOCKET MSG_MAX_SIZE
 
+// How much we read at once from a peer we're talking to in lines,
+// e.g., an adb shell while bootstrapping a stub.
+#define CHAT_BUFFER_SIZE 4096
+
 // The LZ4 format is designed to work with 64k blocks, so there's no
 // point letting it compress more.
 #define MAX_COMPRESSION_BLOCK 65536
 
+// Channels using streaming compression remember this much of the
+// stream so later blocks can refer back to earlier ones.  LZ4 match
+// offsets can't reach back any further.
+#define LZ4_HISTORY_SIZE 65536
+
+// Every time we've tried to compress this many bytes of a channel,
+// check whether compression saved at least COMPRESSION_MIN_SAVINGS_PCT
+// percent.  If it didn't, send the next COMPRESSION_BACKOFF_MIN bytes
+// uncompressed, doubling that pause (up to COMPRESSION_BACKOFF_MAX)
+// for each consecutive failed probe.
+#define COMPRESSION_PROBE_SIZE (64*1024)
+#define COMPRESSION_MIN_SAVINGS_PCT 5
+#define COMPRESSION_BACKOFF_MIN (256*1024)
+#define COMPRESSION_BACKOFF_MAX (32*1024*1024)
+
+// Largest LZ4 acceleration factor --compression-acceleration accepts.
+// LZ4 barely bothers to look for matches well below this value.
+#define MAX_LZ4_ACCELERATION 1024
+
+// Receive windows for stdio channels start at INITIAL_CHANNEL_WINDOW
+// bytes and then follow the measured bandwidth-delay product, staying
+// between MIN_CHANNEL_WINDOW and MAX_CHANNEL_WINDOW.  Ring buffers
+// are MAX_CHANNEL_WINDOW bytes, but we touch only as much of them as
+// the window lets the peer fill.
+#define INITIAL_CHANNEL_WINDOW (1024*1024)
+#define MIN_CHANNEL_WINDOW (128*1024)
+#define MAX_CHANNEL_WINDOW (8*1024*1024)
+
+// On the TCP transport, keep at most TCP_NOTSENT_LOWAT_BYTES of data
+// the peer hasn't yet been sent in the kernel; the rest waits in our
+// ring buffers, where it coalesces into bigger frames.
+#define TCP_NOTSENT_LOWAT_BYTES (128*1024)
+
+// Receiving channels hold back window credit until the consumer has
+// drained 1/ACK_THRESHOLD_FRACTION of the window or the peer is down
+// to half its window, and then send the credit for all channels at
+// once.
+#define ACK_THRESHOLD_FRACTION 4
+
+// In pty sessions, hold data for the peer for up to
+// DEFAULT_PTY_CORK_DELAY_MS milliseconds (FB_ADB_CORK_DELAY_MS
+// overrides) while less than CORK_FLUSH_SIZE bytes are waiting, so
+// bursts of small writes leave in one adb packet.
+#define DEFAULT_PTY_CORK_DELAY_MS 2
+#define CORK_FLUSH_SIZE 4096
+
+// Each scheduling round, a sending channel may queue up to its
+// priority's weight times CHANNEL_QUANTUM bytes for the peer.  Bulk
+// channels stop queueing once BULK_BACKLOG_LIMIT bytes are waiting
+// to go out, so more urgent data never waits behind more than that.
+#define CHANNEL_QUANTUM (16*1024)
+#define BULK_BACKLOG_LIMIT (128*1024)
+
+// Once one io_loop_pump has compressed this many bytes, it goes back
+// to poll before compressing more, so that a channel full of
+// compressible output doesn't keep the loop from reading input and
+// acks for long.
+#define COMPRESSION_PUMP_BUDGET (256*1024)
+
 // LZ4 will emit all literals for blocks smaller than this value, so
 // don't bother attempting to compressing them.
 #define MIN_COMPRESSION_BLOCK 13
@@ -41,10 +104,61 @@
 // connection before exiting
 #define DAEMON_TIMEOUT_MS (5*60*1000)
 
+// Number of milliseconds the resident agent VM waits for a new
+// request before exiting
+#define AGENT_IDLE_TIMEOUT_MS DAEMON_TIMEOUT_MS
+
+// Largest pre-forked worker pool the stub daemon will keep
+#define MAX_STUB_DAEMON_POOL_SIZE 32
+
+// Bytes of stdio buffering all of a stub daemon's sessions together
+// should use.  Each session started under the daemon gets an equal
+// share of this budget, but never less than MIN_CHANNEL_WINDOW per
+// stream.
+#define STUB_DAEMON_BUFFER_BUDGET (96*1024*1024)
+
+// After this many milliseconds with nothing to do, the io loop
+// gives back the memory behind its empty ring buffers.
+#define IDLE_BUFFER_TRIM_MS (10*1000)
+
+// Number of milliseconds a control master waits with no sessions
+// before exiting
+#define CONTROL_MASTER_IDLE_TIMEOUT_MS (10*60*1000)
+
+// Number of sessions fb-adb fanout runs at once unless told otherwise
+#define FANOUT_DEFAULT_JOBS 16
+
+// fb-adb bench moves this many bytes each way unless told otherwise,
+// in blocks of BENCH_BLOCK_SIZE, times BENCH_DEFAULT_ROUNDS round
+// trips for each latency test, and sets up BENCH_SETUP_ROUNDS
+// sessions.
+#define BENCH_DEFAULT_SIZE (64*1024*1024)
+#define BENCH_BLOCK_SIZE (64*1024)
+#define BENCH_DEFAULT_ROUNDS 100
+#define BENCH_SETUP_ROUNDS 10
+
+// Number of sessions a control master runs at once, and the size of
+// the ring buffers for each direction of each session
+#define CONTROL_MASTER_MAX_SESSIONS 32
+#define CONTROL_MASTER_SESSION_BUFSZ (2*1024*1024)
+
+// Number of connections fb-adb forward tunnels at once, and the size
+// of the ring buffers for each direction of each connection
+#define FORWARD_MAX_CONNECTIONS 1024
+#define FORWARD_SESSION_BUFSZ (512*1024)
+
 // Number of milliseconds we wait for a TCP connection callback when
 // we don't have an ADB stub process to monitor.
 #define TCP_CALLBACK_MS (1*1000)
 
+// A striped session (--stripes) uses at most MAX_STRIPES connections
+// and sends the protocol stream in chunks of at most
+// STRIPE_CHUNK_SIZE bytes.  The stub gives up if the host's extra
+// connections don't all arrive within STRIPE_ACCEPT_TIMEOUT_MS.
+#define MAX_STRIPES 8
+#define STRIPE_CHUNK_SIZE (128*1024)
+#define STRIPE_ACCEPT_TIMEOUT_MS (10*1000)
+
 // String to append to daemon socket name to form the
 // corresponding daemon control socket name.
 #define DAEMON_CONTROL_SUFFIX ".c"
@@ -52,3 +166,146 @@
 // Number of milliseconds to wait for the service to connect to our
 // listening socket on "am start".
 #define SERVICE_HACK_CALLBACK_TIMEOUT_MS 1000
+
+// Number of received files whose fsync and rename we defer while
+// receiving later files in a multi-file transfer with --sync.
+#define XFER_SYNC_WINDOW 16
+
+// Bounds on the size of the data chunks in a file transfer.  Each
+// file's chunks start at the minimum and double up to the maximum.
+#define XFER_MIN_CHUNK (32*1024)
+#define XFER_MAX_CHUNK (4*1024*1024)
+
+// Most connections one --streams transfer may use, the smallest
+// range worth a connection of its own, and the size of the chunks we
+// send to each connection in turn.
+#define XFER_MAX_STREAMS 16
+#define XFER_MIN_RANGE (16*1024*1024)
+#define XFER_STREAM_CHUNK (1024*1024)
+
+// Size of each direction's ring in the local transport's shared
+// memory; must be a power of two
+#define SHM_TRANSPORT_RING_SIZE (1024*1024)
+
+// Bounds on the block size in a --delta transfer.  Between them, we
+// pick the power of two nearest the square root of the file size.
+#define XFER_DELTA_MIN_BLOCK 2048
+#define XFER_DELTA_MAX_BLOCK (128*1024)
+
+// Number of bytes a --resume transfer receives between checkpoints.
+#define XFER_RESUME_CHECKPOINT (16*1024*1024)
+
+// Size beyond which the device starts evicting the least recently
+// used programs from its xcmd cache.
+#define XCMD_CACHE_MAX_BYTES (128*1024*1024)
+
+// touch_lru_entry leaves an entry's modification time alone if it's
+// at most this many seconds old.
+#define LRU_TOUCH_GRANULARITY_S (60*60)
+
+// Total size of the records the hash cache keeps before it starts
+// forgetting the least recently used.
+#define HASH_CACHE_MAX_BYTES (256*1024)
+
+// The hash cache doesn't remember files modified or changed this
+// recently, since a same-tick modification could go unnoticed on
+// filesystems with coarse timestamps.
+#define HASH_CACHE_RACY_S 2
+
+// Largest ping fb-adb ping sends.
+#define PING_MAX_SIZE (64*1024)
+
+// Seconds for which xgetaddrinfo_cached trusts a name it resolved.
+#define GAI_CACHE_TTL_S (5*60)
+
+// Total size of the records the address cache keeps before it starts
+// forgetting the least recently used.
+#define GAI_CACHE_MAX_BYTES (64*1024)
+
+// Seconds for which fb-adb bash-completion-query reuses a directory
+// listing or the list of property names.  Completion only needs to be
+// roughly right, but a file the user just created should show up.
+#define COMPLETION_CACHE_LS_TTL_S 10
+#define COMPLETION_CACHE_PROPERTIES_TTL_S 60
+
+// Total size of the records the completion cache keeps before it
+// starts forgetting the least recently used.
+#define COMPLETION_CACHE_MAX_BYTES (1024*1024)
+
+// How long xconnect_host waits on one address before also trying the
+// next, per RFC 8305's "Connection Attempt Delay".
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+// Size beyond which the device starts evicting the least recently
+// used compiled dex files from its odex cache.
+#define ODEX_CACHE_MAX_BYTES (64*1024*1024)
+
+// Most programs one MSG_QUERY_EXEC_FILES may ask about.
+#define XCMD_QUERY_MAX 64
+
+// Name of the archive member in which ctar --since-manifest lists the
+// paths that have disappeared since the manifest was written.
+#define CTAR_DELETION_LIST_NAME ".fb-adb-deleted"
+
+// Uncompressed size of each block of ctar's --compress=lz4 output.
+// This must be one of the LZ4 frame format's block sizes.
+#define CTAR_LZ4_BLOCK (1024*1024)
+
+// When ctar reaches a directory, it asks the kernel to start reading
+// the next this many of its files while it archives the current one,
+// and at most this many bytes from the start of each.
+#define CTAR_PREFETCH_FILES 16
+#define CTAR_PREFETCH_BYTES (1024*1024)
+
+// Most events --timing records; later ones are counted but dropped.
+#define MAX_TIMING_EVENTS 128
+
+// Longest detail string --timing records for an event.
+#define MAX_TIMING_DETAIL 64
+
+// Most file data fget --recursive moves from the archive to a file in
+// one write.
+#define UNTAR_BUFFER_SIZE (1024*1024)
+
+// Most processes finfo-json forks to hash the files it's given.
+#define FINFO_MAX_HASH_WORKERS 8
+
+// Bytes sha256_fd reads at a time.
+#define SHA256_READ_SIZE (256*1024)
+
+// How often getprop --watch checks for property changes when the
+// system gives us no way to sleep until one happens.
+#define GETPROP_WATCH_POLL_MS 100
+
+// Longest getprop --watch sleeps waiting for a property change before
+// checking whether anyone is still listening.
+#define GETPROP_WATCH_CHECK_MS 1000
+
+// Bytes logcat-json reads from logcat at a time.  Must hold the
+// largest possible record: two 16-bit lengths' worth.
+#define LOGCAT_JSON_READ_SIZE (256*1024)
+
+// logcat-json flushes its output when it has buffered this many
+// bytes or when a record has waited this long for a flush.
+#define LOGCAT_JSON_FLUSH_BYTES (64*1024)
+#define LOGCAT_JSON_FLUSH_MS 50
+
+// Deepest nesting of lists logcat-json decodes in a binary event
+// record.
+#define LOGCAT_EVENT_MAX_DEPTH 16
+
+// Deepest nesting of arrays and maps cbor-json accepts.
+#define CBOR_JSON_MAX_DEPTH 256
+
+// Bytes a json_writer collects before handing them to stdio.
+#define JSON_WRITER_BUFFER_SIZE 4096
+
+// How often pidof --wait looks for the processes it's waiting for.
+#define PIDOF_WAIT_POLL_MS 50
+
+// Bytes jdwp reads at a time from the heap dump it parses for the
+// class list.
+#define HPROF_READ_BUFFER_SIZE (256*1024)
+
+// Events the always-on trace ring remembers.  Must be a power of two.
+#define TRACE_RING_SIZE 8192
@@ -14,13 +14,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <limits.h>
+#include <fcntl.h>
+#ifdef HAVE_SPLICE
+# include <sys/socket.h>
+#endif
 #include "core.h"
 #include "ringbuf.h"
 #include "channel.h"
 #include "constants.h"
 #include "lz4.h"
+#include "compdict.h"
 #include "fs.h"
+#include "pollset.h"
 
 // If non-zero, transfer as much data as possible between ringbuffers.
 // If zero, run the event loop (and do IO) between iterations.
@@ -34,6 +41,13 @@
 #define TURN_INCREMENT 1
 #endif
 
+// Relative share of each round a channel's priority earns it
+static const unsigned channel_priority_weight[] = {
+    [CHANNEL_PRIORITY_BULK] = 1,
+    [CHANNEL_PRIORITY_STDERR] = 2,
+    [CHANNEL_PRIORITY_INTERACTIVE] = 4,
+};
+
 __attribute__((noreturn,format(printf,1,2)))
 static void
 die_proto_error(const char* fmt, ...)
@@ -59,7 +73,7 @@ look_for_stub_error(struct msg* m)
 }
 #endif
 
-static bool
+bool
 detect_msg(struct ringbuf* rb, struct msg* mhdr)
 {
     memset(mhdr, 0, sizeof (*mhdr));
@@ -68,12 +82,28 @@ detect_msg(struct ringbuf* rb, struct msg* mhdr)
         return false;
 
     ringbuf_copy_out(rb, mhdr, sizeof (*mhdr));
-    if (avail < mhdr->size) {
-        if (mhdr->size - avail > ringbuf_room(rb))
+    size_t want = mhdr->size;
+
+    // Jumbo frames need their data in the buffer too; we process
+    // them in one go like everything else.
+    if (mhdr->type == MSG_CHANNEL_DATA_JUMBO &&
+        mhdr->size == sizeof (struct msg_channel_data_jumbo) &&
+        avail >= mhdr->size)
+    {
+        struct msg_channel_data_jumbo mj;
+        ringbuf_copy_out(rb, &mj, sizeof (mj));
+        if (mj.actual_size > ringbuf_capacity(rb))
+            die_proto_error("impossibly large jumbo frame: sz:%lu",
+                            (unsigned long) mj.actual_size);
+        want += mj.actual_size;
+    }
+
+    if (avail < want) {
+        if (want - avail > ringbuf_room(rb))
             die_proto_error("impossibly large message: "
                             "type:%u sz:%lu room:%lu",
                             mhdr->type,
-                            (unsigned long)(mhdr->size - avail),
+                            (unsigned long)(want - avail),
                             (unsigned long)ringbuf_room(rb));
 
         return false;
@@ -82,21 +112,275 @@ detect_msg(struct ringbuf* rb, struct msg* mhdr)
     return true;                /* Can now read msg */
 }
 
+// Channels with compress_stream set compress each block against
+// the last LZ4_HISTORY_SIZE bytes of the channel, not just against
+// itself.  Both ends append every byte the channel carries, compressed
+// on the wire or not, to an identical history, so the encoder can
+// refer to anything the decoder has already seen.  New data goes
+// right after the history in BUF so LZ4 can treat the history as a
+// prefix; we slide the history back to the start of BUF only when
+// the next block might not fit, which happens at most once per
+// LZ4_HISTORY_SIZE bytes.  With compress_dict, the history starts
+// out holding compression_dictionary instead of nothing.  Receiving
+// channels keep their history in the channel ring buffer instead
+// when they can; see lz4_ring_history_init.
+struct lz4_history {
+    LZ4_stream_t stream; // Used only when sending
+    size_t len;
+    // True if STREAM's dictionary is the whole history.  Blocks we
+    // send without compressing (see compression_backoff_p) go into
+    // the history behind LZ4's back, so we reload the dictionary
+    // before compressing again.
+    bool in_dict;
+    char buf[2*LZ4_HISTORY_SIZE + MAX_COMPRESSION_BLOCK];
+};
+
+static struct lz4_history*
+lz4_history_new(bool primed)
+{
+    struct lz4_history* h = xalloc(sizeof (*h));
+    LZ4_resetStream(&h->stream);
+    h->len = 0;
+    h->in_dict = true;
+    if (primed) {
+        assert(compression_dictionary_size <= LZ4_HISTORY_SIZE);
+        memcpy(h->buf, compression_dictionary, compression_dictionary_size);
+        h->len = compression_dictionary_size;
+        LZ4_loadDict(&h->stream, h->buf, h->len);
+    }
+    return h;
+}
+
+// Where the next block goes in H's buffer
+static char*
+lz4_history_end(struct lz4_history* h)
+{
+    assert(h->len + MAX_COMPRESSION_BLOCK <= sizeof (h->buf));
+    return &h->buf[h->len];
+}
+
+// Note that SZ bytes at lz4_history_end(H) are now part of the
+// stream.  COMPRESSED is true if they went through
+// LZ4_compress_fast_continue.
+static void
+lz4_history_note_added(struct lz4_history* h, size_t sz, bool compressed)
+{
+    assert(sz <= MAX_COMPRESSION_BLOCK);
+    h->len += sz;
+    if (!compressed)
+        h->in_dict = false;
+    if (h->len + MAX_COMPRESSION_BLOCK > sizeof (h->buf)) {
+        if (h->in_dict) {
+            h->len = LZ4_saveDict(&h->stream, h->buf, LZ4_HISTORY_SIZE);
+        } else {
+            memmove(h->buf,
+                    &h->buf[h->len - LZ4_HISTORY_SIZE],
+                    LZ4_HISTORY_SIZE);
+            h->len = LZ4_HISTORY_SIZE;
+        }
+    }
+}
+
+// A receiving channel with a mirrored ring buffer big enough to hold
+// a full history and a block behind it can keep its LZ4 history in
+// that buffer: we decompress each block straight into the room after
+// the bytes already there, which are the ones the block can refer
+// to.  Every byte the channel receives, compressed or not, then lands
+// in the ring exactly once.  Return whether C works this way.
+static bool
+lz4_ring_history_init(struct channel* c)
+{
+    if (c->dir != CHANNEL_TO_FD ||
+        ringbuf_capacity(c->rb) < LZ4_HISTORY_SIZE + MAX_COMPRESSION_BLOCK ||
+        !ringbuf_keep_history(c->rb))
+    {
+        return false;
+    }
+
+    if (c->compress_dict) {
+        ringbuf_copy_in(c->rb,
+                        compression_dictionary,
+                        compression_dictionary_size);
+        ringbuf_note_added(c->rb, compression_dictionary_size);
+        ringbuf_note_removed(c->rb, compression_dictionary_size);
+    }
+
+    c->lz4_in_ring = true;
+    return true;
+}
+
+static double
+window_clock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return xclock_gettime(CLOCK_MONOTONIC);
+#else
+    return 0; // No RTT estimates, so windows only grow
+#endif
+}
+
+// Start or end C's window_blocked stall.  Reading is window-blocked
+// when we have room to buffer more input but no window to send it.
+static void
+note_window_blocked(struct channel* c, double now)
+{
+    struct channel_stats* st = &c->stats;
+    bool blocked = c->dir == CHANNEL_FROM_FD &&
+        c->fdh != NULL &&
+        c->track_window &&
+        c->window == 0 &&
+        ringbuf_room(c->rb) > 0;
+
+    if (blocked && st->window_blocked_since == 0) {
+        st->window_blocked_since = now;
+    } else if (!blocked && st->window_blocked_since != 0) {
+        st->window_blocked += now - st->window_blocked_since;
+        st->window_blocked_since = 0;
+    }
+}
+
+static void
+window_tuning_init(struct channel* c)
+{
+    struct channel_window_tuning* t = &c->window_tuning;
+    t->target = XMAX(c->bytes_written, 1);
+    t->round_start = window_clock();
+}
+
+// Change the window we advertise for C to TARGET bytes.  We grow the
+// window by sending extra credit right away and shrink it by
+// withholding credit we'd otherwise send as the consumer drains
+// our buffer.
+static void
+window_set_target(struct channel* c, unsigned chno, uint32_t target)
+{
+    struct channel_window_tuning* t = &c->window_tuning;
+    if (target > t->target) {
+        uint32_t delta = target - t->target;
+        uint32_t repaid = XMIN(delta, t->debt);
+        t->debt -= repaid;
+        delta -= repaid;
+        delta = XMIN(delta, UINT32_MAX - c->bytes_written);
+        c->bytes_written += delta;
+    } else {
+        t->debt += t->target - target;
+    }
+
+    dbg("ch %u: window %lu -> %lu (rtt %gms)",
+        chno,
+        (unsigned long) t->target,
+        (unsigned long) target,
+        t->rtt * 1000);
+    t->target = target;
+}
+
+// Once a window's worth of data has arrived, decide whether to
+// resize the window.  If the window held the peer back at any point,
+// double it.  Otherwise, if we know the round trip time, shrink the
+// window when it's well over the bandwidth-delay product.
+static void
+window_end_round(struct channel* c, unsigned chno, double now)
+{
+    struct channel_window_tuning* t = &c->window_tuning;
+    uint32_t max_window = XMIN(ringbuf_capacity(c->rb), UINT32_MAX);
+    uint32_t min_window = XMIN(MIN_CHANNEL_WINDOW, max_window);
+    double elapsed = now - t->round_start;
+
+    if (t->window_limited) {
+        if (t->target < max_window)
+            window_set_target(c, chno,
+                              XMIN((uint64_t) t->target * 2, max_window));
+    } else if (t->rtt > 0 && elapsed > 0) {
+        double bdp = t->round_bytes / elapsed * t->rtt;
+        if (bdp * 4 < t->target && t->target > min_window)
+            window_set_target(c, chno, XMAX(t->target / 2, min_window));
+    }
+
+    t->round_bytes = 0;
+    t->round_start = now;
+    t->window_limited = false;
+}
+
+// Account for SZ bytes of data arriving for receiving channel C.
+// We know exactly how much credit the peer has left, so we can
+// tell when the window, rather than the link or the consumer of
+// our buffer, is holding the peer back: the peer has almost no
+// credit and our buffer is almost empty.  The time between our
+// giving a peer in that state more credit and the data arriving
+// is the round trip time.
+static void
+window_note_received(struct channel* c, unsigned chno, size_t sz)
+{
+    struct channel_window_tuning* t = &c->window_tuning;
+    if (t->target == 0)
+        return;
+
+    if (sz > t->peer_window)
+        die_proto_error("window desync");
+    t->peer_window -= sz;
+
+    double now = window_clock();
+    if (t->unstall_time != 0) {
+        double sample = now - t->unstall_time;
+        t->rtt = t->rtt != 0 ? (7 * t->rtt + sample) / 8 : sample;
+        t->unstall_time = 0;
+    }
+
+    if (t->peer_window < t->target / 8 &&
+        ringbuf_size(c->rb) < t->target / 8)
+    {
+        t->stalled = true;
+        t->window_limited = true;
+    }
+
+    t->round_bytes += sz;
+    if (t->round_bytes >= t->target)
+        window_end_round(c, chno, now);
+}
+
+// Note that the SZ bytes in RB's first SZ bytes went over the wire
+// uncompressed.  Only the last LZ4_HISTORY_SIZE bytes of the stream
+// matter to LZ4, so blocks larger than MAX_COMPRESSION_BLOCK (which
+// only jumbo frames carry) contribute just their tail.
+static void
+lz4_history_note_raw(struct lz4_history* h,
+                     const struct ringbuf* rb,
+                     size_t sz)
+{
+    size_t tailsz = XMIN(sz, MAX_COMPRESSION_BLOCK);
+    size_t skip = sz - tailsz;
+    struct iovec iov[2];
+    ringbuf_readable_iov(rb, iov, sz);
+    char* out = lz4_history_end(h);
+    for (unsigned i = 0; i < ARRAYSIZE(iov); ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t nr = iov[i].iov_len - skip;
+        memcpy(out, (char*) iov[i].iov_base + skip, nr);
+        out += nr;
+        skip = 0;
+    }
+
+    lz4_history_note_added(h, tailsz, false);
+}
+
 static void
-fb_adb_sh_process_msg_channel_data(struct fb_adb_sh* sh,
-                                   struct msg_channel_data* m)
+fb_adb_sh_process_channel_data(struct fb_adb_sh* sh,
+                               unsigned chno,
+                               size_t payloadsz)
 {
     unsigned nrch = sh->nrch;
     struct channel* cmdch = sh->ch[FROM_PEER];
 
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
-        die_proto_error("data: invalid channel %d", m->channel);
+    if (chno <= NR_SPECIAL_CH || chno >= nrch)
+        die_proto_error("data: invalid channel %d", chno);
 
-    struct channel* c = sh->ch[m->channel];
+    struct channel* c = sh->ch[chno];
     if (c->dir == CHANNEL_FROM_FD)
-        die_proto_error("wrong channel direction ch=%u", m->channel);
-
-    size_t payloadsz = m->msg.size - sizeof (*m);
+        die_proto_error("wrong channel direction ch=%u", chno);
 
     if (c->fdh == NULL) {
         /* Channel already closed.  Just drop the write. */
@@ -112,7 +396,12 @@ fb_adb_sh_process_msg_channel_data(struct fb_adb_sh* sh,
     struct iovec iov[2];
     ringbuf_readable_iov(cmdch->rb, iov, payloadsz);
     channel_write(c, iov, 2);
+
+    if (c->lz4h != NULL)
+        lz4_history_note_raw(c->lz4h, cmdch->rb, payloadsz);
+
     ringbuf_note_removed(cmdch->rb, payloadsz);
+    window_note_received(c, chno, payloadsz);
 }
 
 static void
@@ -122,7 +411,7 @@ fb_adb_sh_process_msg_channel_data_lz4(struct fb_adb_sh* sh,
     unsigned nrch = sh->nrch;
     struct channel* cmdch = sh->ch[FROM_PEER];
 
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         die_proto_error("data: invalid channel %d", m->channel);
 
     struct channel* c = sh->ch[m->channel];
@@ -155,21 +444,64 @@ fb_adb_sh_process_msg_channel_data_lz4(struct fb_adb_sh* sh,
         ringbuf_copy_out(cmdch->rb, src_buffer, compressed_size);
     }
 
-    void* dst_buffer = alloca(uncompressed_size);
-    int ret = LZ4_decompress_safe(src_buffer,
+    struct lz4_history* h = c->lz4h;
+    void* dst_buffer;
+    bool in_place = false;
+    int ret;
+
+    if ((c->lz4_in_ring || h != NULL) &&
+        uncompressed_size > MAX_COMPRESSION_BLOCK)
+    {
+        die_proto_error("oversized compressed block");
+    }
+
+    if (c->lz4_in_ring) {
+        size_t histsz;
+        dst_buffer = ringbuf_history_window(c->rb,
+                                            LZ4_HISTORY_SIZE,
+                                            uncompressed_size,
+                                            &histsz);
+        ret = LZ4_decompress_safe_usingDict(src_buffer,
+                                            dst_buffer,
+                                            compressed_size,
+                                            uncompressed_size,
+                                            (char*) dst_buffer - histsz,
+                                            histsz);
+        in_place = true;
+    } else if (h != NULL) {
+        // Streaming decompression has to leave the block in the
+        // history anyway, so decompress there and copy to the
+        // channel from it.
+        dst_buffer = lz4_history_end(h);
+        ret = LZ4_decompress_safe_usingDict(src_buffer,
+                                            dst_buffer,
+                                            compressed_size,
+                                            uncompressed_size,
+                                            h->buf,
+                                            h->len);
+    } else {
+        dst_buffer = alloca(uncompressed_size);
+        ret = LZ4_decompress_safe(src_buffer,
                                   dst_buffer,
                                   compressed_size,
                                   uncompressed_size);
+    }
 
-    if (ret == 0)
+    if (ret != uncompressed_size)
         die_proto_error("invalid compressed data");
 
-    assert(ret == uncompressed_size);
+    if (in_place) {
+        channel_write_in_place(c, uncompressed_size);
+    } else {
+        iov[0].iov_base = dst_buffer;
+        iov[0].iov_len = uncompressed_size;
+        channel_write(c, iov, 1);
+    }
 
-    iov[0].iov_base = dst_buffer;
-    iov[0].iov_len = uncompressed_size;
-    channel_write(c, iov, 1);
+    if (h != NULL)
+        lz4_history_note_added(h, uncompressed_size, false);
     ringbuf_note_removed(cmdch->rb, compressed_size);
+    window_note_received(c, m->channel, uncompressed_size);
 }
 
 static void
@@ -177,7 +509,7 @@ fb_adb_sh_process_msg_channel_window(struct fb_adb_sh* sh,
                                      struct msg_channel_window* m)
 {
     unsigned nrch = sh->nrch;
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         die_proto_error("window: invalid channel %d", m->channel);
 
     struct channel* c = sh->ch[m->channel];
@@ -190,6 +522,8 @@ fb_adb_sh_process_msg_channel_window(struct fb_adb_sh* sh,
     if (SATADD(&c->window, c->window, m->window_delta)) {
         die_proto_error("window overflow!?");
     }
+
+    trace(TRACE_WINDOW_GRANT, m->channel, m->window_delta, c->window, 0);
 }
 
 static void
@@ -197,7 +531,7 @@ fb_adb_sh_process_msg_channel_close(struct fb_adb_sh* sh,
                                     struct msg_channel_close* m)
 {
     unsigned nrch = sh->nrch;
-    if (m->channel <= NR_SPECIAL_CH || m->channel > nrch)
+    if (m->channel <= NR_SPECIAL_CH || m->channel >= nrch)
         return;                 /* Ignore invalid close */
 
     struct channel* c = sh->ch[m->channel];
@@ -232,7 +566,12 @@ fb_adb_sh_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
         ringbuf_copy_out(cmdch->rb, &m, sizeof (m));
         ringbuf_note_removed(cmdch->rb, sizeof (m));
         dbgmsg(&m.msg, "recv");
-        fb_adb_sh_process_msg_channel_data(sh, &m);
+        fb_adb_sh_process_channel_data(sh, m.channel, m.msg.size - sizeof (m));
+    } else if (mhdr.type == MSG_CHANNEL_DATA_JUMBO) {
+        struct msg_channel_data_jumbo m;
+        read_cmdmsg(sh, mhdr, &m, sizeof (m));
+        dbgmsg(&m.msg, "recv");
+        fb_adb_sh_process_channel_data(sh, m.channel, m.actual_size);
     } else if (mhdr.type == MSG_CHANNEL_DATA_LZ4) {
         struct msg_channel_data_lz4 m;
         if (mhdr.size < sizeof (m))
@@ -273,11 +612,60 @@ fb_adb_maxoutmsg(struct fb_adb_sh* sh)
                 ringbuf_room(sh->ch[TO_PEER]->rb));
 }
 
+// Largest jumbo frame, header included, we can send right now
+static size_t
+fb_adb_maxoutjumbo(struct fb_adb_sh* sh)
+{
+    return XMIN(sh->max_outgoing_jumbo,
+                ringbuf_room(sh->ch[TO_PEER]->rb));
+}
+
+// Count a message of type TYPE against C's statistics.
+static void
+note_msg_stats(struct channel* c, unsigned type)
+{
+    unsigned slot = type - MSG_TYPE_PRE - 1;
+    if (slot < NR_MSG_TYPES)
+        c->stats.msgs[slot] += 1;
+}
+
+// Account for sending M through DST, the channel to our peer.
+static void
+note_msg_sent(struct channel* dst, const struct msg* m)
+{
+    trace_msg(TRACE_MSG_SEND, m);
+    note_msg_stats(dst, m->type);
+}
+
+// Decide whether C's pending credit is worth a message of its own.
+// A peer with at least half its window left isn't waiting on us, so
+// we can let credit accumulate.  Untuned channels ack everything
+// right away.
+static bool
+window_ack_due_p(struct channel* c)
+{
+    struct channel_window_tuning* t = &c->window_tuning;
+
+    if (t->debt > 0) {
+        uint32_t repaid = XMIN(t->debt, c->bytes_written);
+        t->debt -= repaid;
+        c->bytes_written -= repaid;
+    }
+
+    if (c->bytes_written == 0)
+        return false;
+
+    return t->target == 0 ||
+        c->bytes_written >= t->target / ACK_THRESHOLD_FRACTION ||
+        t->peer_window < t->target / 2;
+}
+
 static void
 xmit_acks(struct channel* c, unsigned chno, struct fb_adb_sh* sh)
 {
     size_t maxoutmsg = fb_adb_maxoutmsg(sh);
     struct msg_channel_window m;
+    struct channel_window_tuning* t = &c->window_tuning;
 
     if (c->bytes_written > 0 && maxoutmsg >= sizeof (m)) {
         memset(&m, 0, sizeof (m));
@@ -286,11 +674,131 @@ xmit_acks(struct channel* c, unsigned chno, struct fb_adb_sh* sh)
         m.channel = chno;
         m.window_delta = c->bytes_written;
         dbgmsg(&m.msg, "send");
+        note_msg_sent(sh->ch[TO_PEER], &m.msg);
         channel_write(sh->ch[TO_PEER], &(struct iovec){&m, sizeof (m)}, 1);
+        if (t->target != 0) {
+            t->peer_window += c->bytes_written;
+            if (t->stalled) {
+                t->unstall_time = window_clock();
+                t->stalled = false;
+            }
+        }
         c->bytes_written = 0;
     }
 }
 
+// Record that sending a block that would have cost RAW bytes on the
+// wire uncompressed actually cost WIRE bytes.  Every
+// COMPRESSION_PROBE_SIZE raw bytes, decide whether compression is
+// earning its keep; if it isn't, stop trying for a while, doubling
+// the pause each time a probe fails, and try again afterward.
+static void
+compression_note_result(struct channel* c,
+                        unsigned chno,
+                        size_t raw,
+                        size_t wire)
+{
+    struct channel_compression* cs = &c->compression;
+    cs->probe_raw += raw;
+    cs->probe_wire += wire;
+    cs->total_raw += raw;
+    cs->total_wire += wire;
+
+    if (cs->probe_raw < COMPRESSION_PROBE_SIZE)
+        return;
+
+    unsigned pct_saved = cs->probe_wire >= cs->probe_raw
+        ? 0
+        : 100 - (unsigned) (cs->probe_wire * 100 / cs->probe_raw);
+
+    if (pct_saved < COMPRESSION_MIN_SAVINGS_PCT) {
+        cs->backoff = cs->backoff
+            ? XMIN(cs->backoff * 2, COMPRESSION_BACKOFF_MAX)
+            : COMPRESSION_BACKOFF_MIN;
+        cs->skip = cs->backoff;
+        cs->nr_backoffs += 1;
+        dbg("ch %u: compression saved %u%% of last %lu bytes: "
+            "not compressing next %lu bytes",
+            chno, pct_saved,
+            (unsigned long) cs->probe_raw,
+            (unsigned long) cs->skip);
+    } else if (cs->backoff) {
+        dbg("ch %u: compression saving %u%% again", chno, pct_saved);
+        cs->backoff = 0;
+    }
+
+    trace(TRACE_COMPRESS_PROBE, chno,
+          cs->probe_raw, cs->probe_wire, cs->skip);
+    cs->probe_raw = 0;
+    cs->probe_wire = 0;
+}
+
+// If we're in the middle of a compression pause, note that we're
+// about to send SZ more bytes without compression and return true.
+static bool
+compression_backoff_p(struct channel* c, size_t sz)
+{
+    struct channel_compression* cs = &c->compression;
+    if (cs->skip == 0)
+        return false;
+
+    cs->skip -= XMIN(cs->skip, sz);
+    cs->total_skipped += sz;
+    return true;
+}
+
+union msg_channel_data_any {
+    struct msg msg;
+    struct msg_channel_data normal;
+    struct msg_channel_data_jumbo jumbo;
+};
+
+// Fill M with the header of a message carrying PAYLOADSZ bytes of
+// data for channel CHNO and return the header's size.
+static size_t
+make_data_header(union msg_channel_data_any* m,
+                 unsigned chno,
+                 size_t payloadsz,
+                 bool jumbo)
+{
+    assert(chno != 0);
+    memset(m, 0, sizeof (*m));
+    if (jumbo) {
+        assert(payloadsz <= UINT32_MAX);
+        m->jumbo.msg.type = MSG_CHANNEL_DATA_JUMBO;
+        m->jumbo.msg.size = sizeof (m->jumbo);
+        m->jumbo.actual_size = payloadsz;
+        m->jumbo.channel = chno;
+        return sizeof (m->jumbo);
+    }
+
+    assert(sizeof (m->normal) + payloadsz <= MSG_MAX_SIZE);
+    m->normal.msg.type = MSG_CHANNEL_DATA;
+    m->normal.msg.size = sizeof (m->normal) + payloadsz;
+    m->normal.channel = chno;
+    return sizeof (m->normal);
+}
+
+// Send the first PAYLOADSZ bytes of C's buffer as they are.
+static unsigned
+xmit_data_raw(struct channel* c,
+              unsigned chno,
+              struct channel* dst,
+              size_t payloadsz,
+              bool jumbo)
+{
+    union msg_channel_data_any m;
+    struct iovec iov[3] = {
+        { &m, make_data_header(&m, chno, payloadsz, jumbo) }
+    };
+    ringbuf_readable_iov(c->rb, &iov[1], payloadsz);
+    dbgmsg(&m.msg, "send");
+    note_msg_sent(dst, &m.msg);
+    channel_write(dst, iov, ARRAYSIZE(iov));
+    ringbuf_note_removed(c->rb, payloadsz);
+    return 1;
+}
+
 static unsigned
 xmit_data_uncompressed(struct channel* c,
                        unsigned chno,
@@ -303,17 +811,39 @@ xmit_data_uncompressed(struct channel* c,
         return 0;
 
     size_t payloadsz = XMIN(avail, maxoutmsg - sizeof (m));
-    struct iovec iov[3] = {{ &m, sizeof (m) }};
-    ringbuf_readable_iov(c->rb, &iov[1], payloadsz);
-    memset(&m, 0, sizeof (m));
-    m.msg.type = MSG_CHANNEL_DATA;
-    m.msg.size = iovec_sum(iov, ARRAYSIZE(iov));
-    m.channel = chno;
-    assert(chno != 0);
-    dbgmsg(&m.msg, "send");
-    channel_write(dst, iov, ARRAYSIZE(iov));
-    ringbuf_note_removed(c->rb, payloadsz);
-    return 1;
+    return xmit_data_raw(c, chno, dst, payloadsz, false);
+}
+
+// Send data we've decided not to compress, in a jumbo frame if
+// MAXOUTJUMBO allows, keeping C's compression history (if any) in
+// step with what the peer sees.
+static unsigned
+xmit_data_plain(struct channel* c,
+                unsigned chno,
+                struct channel* dst,
+                size_t avail,
+                size_t maxoutmsg,
+                size_t maxoutjumbo)
+{
+    size_t payloadsz;
+    bool jumbo = false;
+
+    if (avail + sizeof (struct msg_channel_data) > maxoutmsg &&
+        maxoutjumbo > maxoutmsg)
+    {
+        payloadsz = XMIN(avail,
+                         maxoutjumbo - sizeof (struct msg_channel_data_jumbo));
+        jumbo = true;
+    } else if (maxoutmsg >= sizeof (struct msg_channel_data)) {
+        payloadsz = XMIN(avail, maxoutmsg - sizeof (struct msg_channel_data));
+    } else {
+        return 0;
+    }
+
+    if (c->lz4h != NULL)
+        lz4_history_note_raw(c->lz4h, c->rb, payloadsz);
+
+    return xmit_data_raw(c, chno, dst, payloadsz, jumbo);
 }
 
 static unsigned
@@ -337,6 +867,8 @@ xmit_data_lz4(struct channel* c,
 
     struct iovec iov[2];
 
+    // Mirrored ring buffers never split a region, so we copy here
+    // only when the system couldn't give us one.
     void* src_buffer;
     ringbuf_readable_iov(c->rb, &iov[0], src_size);
     if (src_size <= iov[0].iov_len) {
@@ -351,14 +883,30 @@ xmit_data_lz4(struct channel* c,
 
     void* dst_buffer = alloca(dst_size);
     int consumed_size = src_size;
-    int out_size = LZ4_compress_destSize(
-        src_buffer,
-        dst_buffer,
-        &consumed_size,
-        dst_size);
+    int out_size;
+
+    // LZ4_compress_destSize has no acceleration knob, so when asked
+    // to go faster, try to compress the whole block and send it raw
+    // if it doesn't fit.
+    if (c->lz4_acceleration > 1)
+        out_size = LZ4_compress_fast(
+            src_buffer,
+            dst_buffer,
+            src_size,
+            dst_size,
+            c->lz4_acceleration);
+    else
+        out_size = LZ4_compress_destSize(
+            src_buffer,
+            dst_buffer,
+            &consumed_size,
+            dst_size);
 
     if (out_size == 0) {
         dbg("compression failed");
+        compression_note_result(c, chno,
+                                src_size + sizeof (struct msg_channel_data),
+                                src_size + sizeof (struct msg_channel_data));
         return xmit_data_uncompressed(c, chno, dst, avail, maxoutmsg);
     }
 
@@ -373,10 +921,15 @@ xmit_data_lz4(struct channel* c,
     if (out_size + sizeof (m) >= equiv_uncompressed) {
         dbg("sending uncompressed: compression would have wasted %u bytes",
             (unsigned)((out_size + sizeof (m)) - equiv_uncompressed));
+        compression_note_result(c, chno,
+                                equiv_uncompressed,
+                                equiv_uncompressed);
         return xmit_data_uncompressed(
             c, chno, dst, consumed_size, maxoutmsg);
     }
 
+    compression_note_result(c, chno, equiv_uncompressed, out_size + sizeof (m));
+
     memset(&m, 0, sizeof (m));
     m.msg.type = MSG_CHANNEL_DATA_LZ4;
     m.msg.size = out_size + sizeof (m);
@@ -390,35 +943,310 @@ xmit_data_lz4(struct channel* c,
     iov[1].iov_len = out_size;
 
     dbgmsg(&m.msg, "send-compressed");
+    note_msg_sent(dst, &m.msg);
     channel_write(dst, iov, ARRAYSIZE(iov));
     ringbuf_note_removed(c->rb, consumed_size);
     return 1;
 }
 
+static unsigned
+xmit_data_lz4_stream(struct channel* c,
+                     unsigned chno,
+                     struct channel* dst,
+                     size_t avail,
+                     size_t maxoutmsg)
+{
+    struct msg_channel_data_lz4 m;
+    struct lz4_history* h = c->lz4h;
+
+    // Every block goes into the history whether or not we end up
+    // sending it compressed, so make sure we can always send it
+    // uncompressed.
+    if (maxoutmsg < XMAX(sizeof (m), sizeof (struct msg_channel_data)))
+        return 0;
+
+    size_t src_size = XMIN(avail, MAX_COMPRESSION_BLOCK);
+    src_size = XMIN(src_size, UINT16_MAX);
+    src_size = XMIN(src_size, maxoutmsg - sizeof (struct msg_channel_data));
+
+    char* src_buffer = lz4_history_end(h);
+    ringbuf_copy_out(c->rb, src_buffer, src_size);
+
+    if (!h->in_dict) {
+        LZ4_loadDict(&h->stream, h->buf, h->len);
+        h->in_dict = true;
+    }
+
+    int dst_size = XMIN(maxoutmsg - sizeof (m),
+                        (size_t) LZ4_compressBound(src_size));
+    void* dst_buffer = alloca(dst_size);
+
+    // LZ4 adds the block to its dictionary even if the output
+    // doesn't fit, so that's fine: the decoder does the same with
+    // uncompressed blocks.
+    int out_size = LZ4_compress_fast_continue(&h->stream,
+                                              src_buffer,
+                                              dst_buffer,
+                                              src_size,
+                                              dst_size,
+                                              XMAX(c->lz4_acceleration, 1));
+    lz4_history_note_added(h, src_size, true);
+
+    size_t equiv_uncompressed = src_size + sizeof (struct msg_channel_data);
+    if (out_size == 0 || out_size + sizeof (m) >= equiv_uncompressed) {
+        compression_note_result(c, chno,
+                                equiv_uncompressed,
+                                equiv_uncompressed);
+        return xmit_data_uncompressed(c, chno, dst, src_size, maxoutmsg);
+    }
+
+    compression_note_result(c, chno, equiv_uncompressed, out_size + sizeof (m));
+
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_CHANNEL_DATA_LZ4;
+    m.msg.size = out_size + sizeof (m);
+    m.uncompressed_size = (unsigned) src_size;
+    m.channel = chno;
+
+    struct iovec iov[2] = {
+        { &m, sizeof (m) },
+        { dst_buffer, out_size },
+    };
+
+    dbgmsg(&m.msg, "send-compressed-stream");
+    note_msg_sent(dst, &m.msg);
+    channel_write(dst, iov, ARRAYSIZE(iov));
+    ringbuf_note_removed(c->rb, src_size);
+    return 1;
+}
+
+#ifdef HAVE_SPLICE
+static size_t
+send_header_more(int fd, const void* buf, size_t sz)
+{
+    // Tell the socket more data follows so the header doesn't go
+    // out in a segment of its own.
+    ssize_t ret = send(fd, buf, sz, MSG_MORE | MSG_DONTWAIT);
+    if (ret < 0 && errno == ENOTSOCK)
+        ret = write(fd, buf, sz);
+    return ret < 0 ? 0 : ret;
+}
+
+// Send up to BUDGET bytes of data waiting in C's pipe to DST's file
+// descriptor without copying it through our address space.  Once
+// we've written the header, the payload must follow, so if the peer
+// stops accepting data partway through, read the rest of the message
+// into DST's ring buffer and let the normal write path finish the job.
+static unsigned
+xmit_data_splice(struct channel* c,
+                 unsigned chno,
+                 struct channel* dst,
+                 size_t maxoutmsg,
+                 size_t maxoutjumbo,
+                 size_t budget)
+{
+    if (maxoutmsg < sizeof (struct msg_channel_data) ||
+        dst->fdh == NULL ||
+        ringbuf_size(dst->rb) > 0)
+    {
+        return 0;
+    }
+
+    size_t payloadsz = XMIN(c->splice_avail, budget);
+    if (c->track_window)
+        payloadsz = XMIN(payloadsz, c->window);
+    if (payloadsz == 0)
+        return 0;
+
+    bool jumbo = false;
+    if (payloadsz + sizeof (struct msg_channel_data) <= maxoutmsg) {
+        /* Fits in a normal frame */
+    } else if (maxoutjumbo > maxoutmsg) {
+        payloadsz = XMIN(payloadsz,
+                         maxoutjumbo - sizeof (struct msg_channel_data_jumbo));
+        jumbo = true;
+    } else {
+        payloadsz = maxoutmsg - sizeof (struct msg_channel_data);
+    }
 
+    union msg_channel_data_any m;
+    size_t hdrsz = make_data_header(&m, chno, payloadsz, jumbo);
+    dbgmsg(&m.msg, "send-splice");
+    note_msg_sent(dst, &m.msg);
+
+    int srcfd = c->fdh->fd;
+    int dstfd = dst->fdh->fd;
+    size_t nr_sent = send_header_more(dstfd, &m, hdrsz);
+    size_t nr_spliced = 0;
+
+    if (nr_sent == hdrsz) {
+        while (nr_spliced < payloadsz) {
+            ssize_t ret = splice(srcfd, NULL, dstfd, NULL,
+                                 payloadsz - nr_spliced,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret <= 0) {
+                if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    dbg("splice unsupported here: falling back to copy");
+                    c->splice = false;
+                }
+                break;
+            }
+            nr_spliced += ret;
+        }
+    } else {
+        ringbuf_copy_in(dst->rb,
+                        (char*) &m + nr_sent,
+                        hdrsz - nr_sent);
+        ringbuf_note_added(dst->rb, hdrsz - nr_sent);
+    }
+
+    // FIONREAD told us the bytes are in the pipe and nobody else
+    // reads from it, so these reads can't come up short.
+    size_t nr_copied = nr_spliced;
+    while (nr_copied < payloadsz) {
+        struct iovec iov[2];
+        ringbuf_writable_iov(dst->rb, iov, payloadsz - nr_copied);
+        ssize_t ret = readv(srcfd, iov, ARRAYSIZE(iov));
+        if (ret < 0)
+            die_errno("readv");
+        if (ret == 0)
+            die(ECOMM, "pipe lost data during splice");
+        ringbuf_note_added(dst->rb, ret);
+        nr_copied += ret;
+    }
+
+    if (nr_spliced < payloadsz)
+        dbg("splice sent %lu of %lu bytes; buffered the rest",
+            (unsigned long) nr_spliced,
+            (unsigned long) payloadsz);
+
+    c->splice_avail -= payloadsz;
+    if (c->track_window)
+        c->window -= payloadsz;
+    c->stats.bytes_in += payloadsz;
+    dst->stats.bytes_out += nr_sent + nr_spliced;
+
+    return 1;
+}
+#endif
+
+// Send one message carrying at most BUDGET bytes of C's data.
 static unsigned
 xmit_data(struct channel* c,
           unsigned chno,
-          struct fb_adb_sh* sh)
+          struct fb_adb_sh* sh,
+          size_t budget)
 {
     unsigned work_done = 0;
     if (c->dir == CHANNEL_FROM_FD) {
         size_t maxoutmsg = fb_adb_maxoutmsg(sh);
-        size_t avail = ringbuf_size(c->rb);
+        size_t maxoutjumbo = fb_adb_maxoutjumbo(sh);
+        size_t buffered = ringbuf_size(c->rb);
+        size_t avail = XMIN(buffered, budget);
 
         if (avail > 0) {
             struct channel* dst = sh->ch[TO_PEER];
 
-            if (c->compress && avail >= MIN_COMPRESSION_BLOCK)
-                work_done =
-                    xmit_data_lz4(
-                        c, chno, dst, avail, maxoutmsg);
-            else
+            if (c->compress &&
+                avail >= MIN_COMPRESSION_BLOCK &&
+                !compression_backoff_p(
+                    c, XMIN(avail, XMAX(maxoutmsg, maxoutjumbo))))
+            {
+                work_done = c->lz4h != NULL
+                    ? xmit_data_lz4_stream(c, chno, dst, avail, maxoutmsg)
+                    : xmit_data_lz4(c, chno, dst, avail, maxoutmsg);
+                sh->pump_compressed += buffered - ringbuf_size(c->rb);
+            } else
                 work_done =
-                    xmit_data_uncompressed(
-                        c, chno, dst, avail, maxoutmsg);
+                    xmit_data_plain(
+                        c, chno, dst, avail, maxoutmsg, maxoutjumbo);
+        }
+#ifdef HAVE_SPLICE
+        else if (c->splice_avail > 0 && c->fdh != NULL)
+            work_done = xmit_data_splice(c, chno, sh->ch[TO_PEER],
+                                         maxoutmsg, maxoutjumbo, budget);
+#endif
+    }
+
+    return work_done;
+}
+
+static size_t
+xmit_data_pending(const struct channel* c)
+{
+    size_t pending = ringbuf_size(c->rb);
+#ifdef HAVE_SPLICE
+    pending += c->splice_avail;
+#endif
+    return pending;
+}
+
+// True if a sending data channel other than C has data waiting.
+static bool
+xmit_data_contended_p(const struct channel* c, const struct fb_adb_sh* sh)
+{
+    for (unsigned chno = NR_SPECIAL_CH + 1; chno < sh->nrch; ++chno) {
+        const struct channel* other = sh->ch[chno];
+        if (other != c &&
+            other->dir == CHANNEL_FROM_FD &&
+            xmit_data_pending(other) > 0)
+        {
+            return true;
         }
     }
+    return false;
+}
+
+// Deficit round robin: give C its quantum for this round and send
+// messages until it's used up, C runs out of data, or, for bulk
+// channels, the peer backlog gets too deep.  While other channels
+// are waiting, no message may carry more than what's left of the
+// quantum, since a single jumbo frame can be many quanta long.
+static unsigned
+xmit_data_scheduled(struct channel* c,
+                    unsigned chno,
+                    struct fb_adb_sh* sh)
+{
+    struct ringbuf* peer_rb = sh->ch[TO_PEER]->rb;
+    bool bulk = (c->priority == CHANNEL_PRIORITY_BULK);
+    unsigned work_done = 0;
+
+    if (c->dir != CHANNEL_FROM_FD || xmit_data_pending(c) == 0) {
+        c->sched_deficit = 0;
+        return 0;
+    }
+
+    if (bulk && ringbuf_size(peer_rb) >= BULK_BACKLOG_LIMIT)
+        return 0;
+
+    uint32_t quantum = CHANNEL_QUANTUM * channel_priority_weight[c->priority];
+    uint32_t carried = c->sched_deficit;
+    bool contended = xmit_data_contended_p(c, sh);
+    c->sched_deficit = carried + quantum;
+    while (c->sched_deficit > 0) {
+        size_t pending_before = xmit_data_pending(c);
+        size_t budget = contended ? c->sched_deficit : SIZE_MAX;
+        unsigned work = xmit_data(c, chno, sh, budget);
+        if (work == 0)
+            break;
+
+        work_done += work;
+        size_t sent = pending_before - xmit_data_pending(c);
+        c->sched_deficit -= XMIN(c->sched_deficit, sent);
+        if (bulk && ringbuf_size(peer_rb) >= BULK_BACKLOG_LIMIT)
+            break;
+    }
+
+    // A channel stuck behind a closed window or a full peer ring
+    // didn't get to use this round's quantum, so it doesn't get to
+    // keep it, and no channel banks more than one quantum: otherwise
+    // a long-blocked channel would burst past everyone else once it
+    // could send again.
+    if (xmit_data_pending(c) == 0)
+        c->sched_deficit = 0;
+    else if (work_done == 0)
+        c->sched_deficit = carried;
+    c->sched_deficit = XMIN(c->sched_deficit, quantum);
 
     return work_done;
 }
@@ -441,9 +1269,20 @@ xmit_eof(struct channel* c,
         m.msg.size = sizeof (m);
         m.channel = chno;
         dbgmsg(&m.msg, "send");
+        note_msg_sent(sh->ch[TO_PEER], &m.msg);
         channel_write(sh->ch[TO_PEER], &(struct iovec){&m, sizeof (m)}, 1);
         c->sent_eof = true;
         work_done += 1;
+
+        const struct channel_compression* cs = &c->compression;
+        if (cs->total_raw > 0 || cs->total_skipped > 0)
+            dbg("ch %u: compressed %llu bytes to %llu; "
+                "skipped compression for %llu bytes in %u pauses",
+                chno,
+                (unsigned long long) cs->total_raw,
+                (unsigned long long) cs->total_wire,
+                (unsigned long long) cs->total_skipped,
+                cs->nr_backoffs);
     }
 
     return work_done;
@@ -461,18 +1300,90 @@ do_pending_close(struct channel* c)
     }
 }
 
+void
+io_loop_init_channel(struct fb_adb_sh* sh, unsigned chno)
+{
+    struct channel* c = sh->ch[chno];
+
+    if (c->fdh != NULL)
+#ifdef FBADB_CHANNEL_NONBLOCK_HACK
+        if (!c->nonblock_hack)
+#endif
+            fd_set_blocking_mode(c->fdh->fd, non_blocking);
+
+    if (chno <= NR_SPECIAL_CH)
+        return;
+
+    if (c->compress_stream && !lz4_ring_history_init(c))
+        c->lz4h = lz4_history_new(c->compress_dict);
+
+    if (c->dir == CHANNEL_TO_FD && c->track_bytes_written)
+        window_tuning_init(c);
+
+#ifdef HAVE_SPLICE
+    // With no compression or adb escaping to do, data from a pipe can
+    // go straight to the peer.
+    struct stat st;
+    if (c->dir == CHANNEL_FROM_FD &&
+        c->fdh != NULL &&
+        !c->compress &&
+        !sh->ch[TO_PEER]->adb_encoding_hack &&
+        sh->ch[TO_PEER]->stripes == NULL &&
+#ifdef HAVE_SHM_TRANSPORT
+        sh->ch[TO_PEER]->shm == NULL &&
+#endif
+        fstat(c->fdh->fd, &st) == 0 &&
+        S_ISFIFO(st.st_mode))
+    {
+        dbg("using splice for channel %u", chno);
+        c->splice = true;
+    }
+#endif
+}
+
 void
 io_loop_init(struct fb_adb_sh* sh)
 {
-    struct channel** ch = sh->ch;
     unsigned nrch = sh->nrch;
-    unsigned chno;
-    for (chno = 0; chno < nrch; ++chno)
-        if (ch[chno]->fdh != NULL)
-#ifdef FBADB_CHANNEL_NONBLOCK_HACK
-            if (!ch[chno]->nonblock_hack)
+    for (unsigned chno = 0; chno < nrch; ++chno)
+        io_loop_init_channel(sh, chno);
+
+    sh->pollset = pollset_new(nrch + 1); // Last slot is listen_fdh
+}
+
+// Decide whether to hold back the small amount of data waiting for
+// the peer in the hope that more arrives and it all goes out in one
+// write.  If so, lower *TIMEOUT_MS to when we have to give up.
+static bool
+peer_corked_p(struct fb_adb_sh* sh, int* timeout_ms)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    size_t backlog = ringbuf_size(sh->ch[TO_PEER]->rb);
+    if (sh->cork_delay_ms == 0 ||
+        backlog == 0 ||
+        backlog >= CORK_FLUSH_SIZE)
+    {
+        sh->cork_start = 0;
+        return false;
+    }
+
+    double now = xclock_gettime(CLOCK_MONOTONIC);
+    if (sh->cork_start == 0)
+        sh->cork_start = now;
+
+    double left_ms = (sh->cork_start - now) * 1000 + sh->cork_delay_ms;
+    if (left_ms <= 0) {
+        sh->cork_start = 0;
+        return false;
+    }
+
+    int wait_ms = (int) left_ms + 1;
+    if (*timeout_ms < 0 || wait_ms < *timeout_ms)
+        *timeout_ms = wait_ms;
+    return true;
+#else
+    return false;
 #endif
-                fd_set_blocking_mode(ch[chno]->fdh->fd, non_blocking);
 }
 
 void
@@ -483,30 +1394,90 @@ io_loop_do_io(struct fb_adb_sh* sh)
 
     struct channel** ch = sh->ch;
     unsigned nrch = sh->nrch;
-    struct pollfd polls[nrch];
+    short revents[nrch + 1];
     int rc;
     short work = 0;
+    int timeout_ms = sh->poll_timeout_ms ? (int) sh->poll_timeout_ms : -1;
+
+    assert(sh->pollset != NULL);
+
+    // If the last pump ran out of compression budget, just look for
+    // input and go back to sending.
+    if (sh->pump_unfinished)
+        timeout_ms = 0;
+
+    if (sh->time_stats) {
+        double now = window_clock();
+        for (unsigned chno = 0; chno < nrch; ++chno)
+            note_window_blocked(ch[chno], now);
+    }
 
+    // The pollset remembers what we asked for last time, so this
+    // loop costs a system call only when a channel's interest
+    // actually changes.
     for (unsigned chno = 0; chno < nrch; ++chno) {
-        polls[chno] = channel_request_poll(ch[chno]);
-        work |= polls[chno].events;
+        struct pollfd p = channel_request_poll(ch[chno]);
+        if (chno == TO_PEER &&
+            (p.events & POLLOUT) &&
+            peer_corked_p(sh, &timeout_ms))
+        {
+            p.events &= ~POLLOUT;
+            work |= POLLOUT; // Wait for the cork timeout at least
+        }
+
+        pollset_update(sh->pollset,
+                       chno,
+                       p.fd != -1 ? ch[chno]->fdh : NULL,
+                       p.events);
+        work |= p.events;
+        revents[chno] = 0;
+    }
+
+    pollset_update(sh->pollset, nrch, sh->listen_fdh, POLLIN);
+    revents[nrch] = 0;
+    if (sh->listen_fdh != NULL)
+        work |= POLLIN;
+
+    // Wake up once after a while with nothing to do, so that a
+    // session sitting idle gives back its buffers.
+    bool trim_when_idle = false;
+    if (!sh->buffers_trimmed &&
+        (timeout_ms == -1 || timeout_ms > IDLE_BUFFER_TRIM_MS))
+    {
+        timeout_ms = IDLE_BUFFER_TRIM_MS;
+        trim_when_idle = true;
     }
 
-    if (work != 0) {
+    if (work != 0 || sh->pump_unfinished) {
 #if !defined(NDEBUG) && defined(HAVE_CLOCK_GETTIME)
         double start = xclock_gettime(CLOCK_REALTIME);
 #endif
+        trace(TRACE_POLL_WAIT, 0, timeout_ms, 0, 0);
 
         if (sh->poll_sigmask) {
-            rc = xppoll(polls, nrch, NULL, sh->poll_sigmask);
+            rc = pollset_wait(sh->pollset, sh->poll_sigmask,
+                              timeout_ms, revents);
         } else {
             WITH_IO_SIGNALS_ALLOWED();
-            rc = poll(polls, nrch, -1);
+            rc = pollset_wait(sh->pollset, NULL, timeout_ms, revents);
         }
 
+        trace(TRACE_POLL_WAKE, 0, rc, 0, 0);
+        if (rc > 0) {
+            sh->nr_poll_wakeups += 1;
+            sh->buffers_trimmed = false;
+        }
         if (rc < 0 && errno != EINTR)
             die_errno("poll");
 
+        if (rc == 0 && trim_when_idle) {
+            dbg("idle: trimming empty buffers");
+            for (unsigned chno = 0; chno < nrch; ++chno)
+                if (ringbuf_size(ch[chno]->rb) == 0)
+                    ringbuf_trim(ch[chno]->rb);
+            sh->buffers_trimmed = true;
+        }
+
 #if !defined(NDEBUG) && defined(HAVE_CLOCK_GETTIME)
         double elapsed = xclock_gettime(CLOCK_REALTIME) - start;
         if (elapsed > 0.5)
@@ -515,10 +1486,18 @@ io_loop_do_io(struct fb_adb_sh* sh)
     }
 
     for (unsigned chno = 0; chno < nrch; ++chno)
-        if (polls[chno].revents != 0)
+        if (revents[chno] != 0)
             channel_poll(ch[chno]);
+
+    sh->listen_ready = (revents[nrch] != 0);
 }
 
+// The io loop and the message handlers it calls must not allocate
+// on the heap in the steady state: message headers live on the
+// stack, payloads move straight between ring buffers, and compression
+// uses alloca or the per-channel lz4_history.  The scoped reslists
+// here and in io_loop_do_io live on the stack too, and cost nothing
+// unless a handler for some rare message allocates into them.
 void
 io_loop_pump(struct fb_adb_sh* sh)
 {
@@ -529,10 +1508,14 @@ io_loop_pump(struct fb_adb_sh* sh)
     unsigned i;
     unsigned nrch = sh->nrch;
     assert(nrch >= NR_SPECIAL_CH);
+    double pump_start = sh->time_stats ? window_clock() : 0;
 
     struct msg mhdr;
-    while (detect_msg(ch[FROM_PEER]->rb, &mhdr))
+    while (detect_msg(ch[FROM_PEER]->rb, &mhdr)) {
+        trace(TRACE_MSG_RECV, 0, mhdr.type, mhdr.size, 0);
+        note_msg_stats(ch[FROM_PEER], mhdr.type);
         sh->process_msg(sh, mhdr);
+    }
 
     // If FROM_PEER's fdh is closed, it's not going to ever receive
     // more bytes, so empty its buffer and allow the closure
@@ -546,21 +1529,40 @@ io_loop_pump(struct fb_adb_sh* sh)
                              ringbuf_size(ch[FROM_PEER]->rb));
     }
 
-    for (i = 0; i < nrch; ++i) {
-        chno = (i + sh->turn) % nrch;
-        xmit_acks(ch[chno], chno, sh);
-    }
+    // When one channel's credit is due, send everyone's: the acks
+    // then share a write to the peer.
+    bool acks_due = false;
+    for (chno = 0; chno < nrch; ++chno)
+        if (window_ack_due_p(ch[chno]))
+            acks_due = true;
+
+    if (acks_due)
+        for (i = 0; i < nrch; ++i) {
+            chno = (i + sh->turn) % nrch;
+            xmit_acks(ch[chno], chno, sh);
+        }
 
     sh->turn += TURN_INCREMENT;
 
+    // Queue data for the peer in priority order, so that urgent data
+    // goes out ahead of bulk data generated at the same time.
+    // Compression runs inline, since there's no other thread to give
+    // it to (see util.h), so stop batching once we've compressed our
+    // budget and let io_loop_do_io service the other channels before
+    // we come back for the rest.
     unsigned work_done;
+    sh->pump_compressed = 0;
     do {
         work_done = 0;
+        for (int prio = CHANNEL_PRIORITY_MAX; prio >= 0; --prio)
+            for (i = 0; i < nrch; ++i) {
+                chno = (i + sh->turn) % nrch;
+                if (chno > NR_SPECIAL_CH && ch[chno]->priority == prio)
+                    work_done += xmit_data_scheduled(ch[chno], chno, sh);
+            }
+
         for (i = 0; i < nrch; ++i) {
             chno = (i + sh->turn) % nrch;
-            if (chno > NR_SPECIAL_CH)
-                work_done += xmit_data(ch[chno], chno, sh);
-
             do_pending_close(ch[chno]);
             work_done += xmit_eof(ch[chno], chno, sh);
         }
@@ -568,7 +1570,14 @@ io_loop_pump(struct fb_adb_sh* sh)
         work_done = 0;
 #endif
         sh->turn += TURN_INCREMENT;
-    } while (work_done > 0);
+    } while (work_done > 0 &&
+             sh->pump_compressed < COMPRESSION_PUMP_BUDGET);
+
+    sh->pump_unfinished =
+        work_done > 0 && sh->pump_compressed >= COMPRESSION_PUMP_BUDGET;
+
+    if (sh->time_stats)
+        sh->longest_pump = XMAX(sh->longest_pump, window_clock() - pump_start);
 }
 
 void
@@ -576,14 +1585,34 @@ queue_message_synch(struct fb_adb_sh* sh, struct msg* m)
 {
     PUMP_WHILE(sh, fb_adb_maxoutmsg(sh) < m->size);
     dbgmsg(m, "send[synch]");
+    note_msg_sent(sh->ch[TO_PEER], m);
     channel_write(sh->ch[TO_PEER], &(struct iovec){m, m->size}, 1);
 }
 
+struct read_msg_fd_ctx {
+    int fd;
+    reader rdr;
+};
+
+static size_t
+read_msg_fd_reader(void* data, void* buf, size_t sz)
+{
+    struct read_msg_fd_ctx* ctx = data;
+    return ctx->rdr(ctx->fd, buf, sz);
+}
+
 struct msg*
 read_msg(int fd, reader rdr)
+{
+    struct read_msg_fd_ctx ctx = { .fd = fd, .rdr = rdr };
+    return read_msg_ctx(read_msg_fd_reader, &ctx);
+}
+
+struct msg*
+read_msg_ctx(ctx_reader rdr, void* ctx)
 {
     struct msg mhdr;
-    size_t nr_read = rdr(fd, &mhdr, sizeof (mhdr));
+    size_t nr_read = rdr(ctx, &mhdr, sizeof (mhdr));
     if (nr_read < sizeof (mhdr))
         die_proto_error("peer disconnected");
 
@@ -596,7 +1625,7 @@ read_msg(int fd, reader rdr)
     memcpy(m, &mhdr, sizeof (mhdr));
     char* rest = (char*) m + sizeof (mhdr);
     size_t restsz = mhdr.size - sizeof (mhdr);
-    nr_read = rdr(fd, rest, restsz);
+    nr_read = rdr(ctx, rest, restsz);
     if (nr_read < restsz)
         die_proto_error("truncated message");
 
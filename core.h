@@ -16,6 +16,8 @@
 #include "proto.h"
 
 struct channel;
+struct ringbuf;
+struct pollset;
 
 enum channel_names {
     FROM_PEER,
@@ -26,18 +28,39 @@ enum channel_names {
 struct fb_adb_sh {
     sigset_t* poll_sigmask;
     size_t max_outgoing_msg;
+    size_t max_outgoing_jumbo; // Zero disables MSG_CHANNEL_DATA_JUMBO
+    unsigned cork_delay_ms; // Zero disables corking; see peer_corked_p
+    double cork_start;
     unsigned nrch;
     unsigned turn; // Round-robin fairness state
     struct channel** ch;
+    struct pollset* pollset; // Set up by io_loop_init
+    struct fdh* listen_fdh; // Optional; io_loop_do_io also polls it
+    bool listen_ready; // Whether listen_fdh was readable last time
+    unsigned poll_timeout_ms; // Zero means no limit
+    size_t pump_compressed; // Bytes compressed by this io_loop_pump
+    bool pump_unfinished; // io_loop_pump stopped with data left to send
+    bool buffers_trimmed; // No IO since we last trimmed idle buffers
+    bool time_stats; // Keep the statistics that need the clock
+    uint64_t nr_poll_wakeups;
+    double longest_pump; // Seconds; only if time_stats
     void (*process_msg)(struct fb_adb_sh* sh, struct msg mhdr);
 };
 
 void queue_message_synch(struct fb_adb_sh* sh, struct msg* m);
 void io_loop_init(struct fb_adb_sh* sh);
+// Prepare the channel in slot CHNO for the io loop.  io_loop_init
+// does this for every channel; call it for channels put in place
+// afterward.
+void io_loop_init_channel(struct fb_adb_sh* sh, unsigned chno);
 void io_loop_pump(struct fb_adb_sh* sh);
 void io_loop_do_io(struct fb_adb_sh* sh);
 void fb_adb_sh_process_msg(struct fb_adb_sh* sh, struct msg mhdr);
 
+// If RB starts with a complete message, fill MHDR with its header and
+// return true.  Otherwise, return false.
+bool detect_msg(struct ringbuf* rb, struct msg* mhdr);
+
 void read_cmdmsg(struct fb_adb_sh* sh,
                  struct msg mhdr,
                  void* mbuf,
@@ -58,6 +81,11 @@ typedef size_t (*reader)(int, void*,size_t);
 __attribute__((malloc))
 struct msg* read_msg(int fd, reader rdr);
 
+// Like read_msg, but read with RDR, passing it CTX instead of an fd.
+typedef size_t (*ctx_reader)(void* ctx, void*, size_t);
+__attribute__((malloc))
+struct msg* read_msg_ctx(ctx_reader rdr, void* ctx);
+
 void* check_msg_cast(struct msg* h, size_t minimum_size);
 #define CHECK_MSG_CAST(_mhdr, _type) \
     ((_type *) check_msg_cast((_mhdr), sizeof (_type)))
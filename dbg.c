@@ -23,6 +23,9 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
 #include <ctype.h>
 #include "dbg.h"
 #include "util.h"
@@ -197,6 +200,14 @@ dbgmsg(const struct msg* msg, const char* tag)
                 chname(m->channel), m->msg.size, m->msg.size - sizeof (*m));
             break;
         }
+        case MSG_CHANNEL_DATA_JUMBO: {
+            struct msg_channel_data_jumbo* m = (void*) msg;
+            dbg("%s %s ch=%s sz=%u payloadsz=%u",
+                tag, msgtoname(msg),
+                chname(m->channel), m->msg.size,
+                (unsigned) m->actual_size);
+            break;
+        }
         case MSG_CHANNEL_DATA_LZ4: {
             struct msg_channel_data_lz4* m = (void*) msg;
             dbg(("%s %s ch=%s sz=%u "
@@ -231,6 +242,22 @@ dbgmsg(const struct msg* msg, const char* tag)
             dbg("%s %s status=%u", tag, msgtoname(msg), m->exit_status);
             break;
         }
+        case MSG_SESSION_OPEN: {
+            struct msg_session_open* m = (void*) msg;
+            dbg("%s %s session=%u", tag, msgtoname(msg), m->session);
+            break;
+        }
+        case MSG_SESSION_CLOSED: {
+            struct msg_session_closed* m = (void*) msg;
+            dbg("%s %s session=%u", tag, msgtoname(msg), m->session);
+            break;
+        }
+        case MSG_EXEC_REQUEST: {
+            struct msg_exec_request* m = (void*) msg;
+            dbg("%s %s payload_size=%u",
+                tag, msgtoname(msg), (unsigned) m->payload_size);
+            break;
+        }
         case MSG_CHDIR: {
             struct msg_chdir* m = (void*) msg;
             dbg("%s %s dir=%.*s",
@@ -269,6 +296,11 @@ chname(int chno)
 void
 dbgch(const char* label, struct channel** ch, unsigned nrch)
 {
+    // We run on every trip through the io loop, so don't even
+    // compute poll requests unless someone's listening.
+    if (!dbg_enabled_p())
+        return;
+
     SCOPED_RESLIST(rl_dbgch);
     unsigned chno;
 
@@ -316,3 +348,169 @@ dbgch(const char* label, struct channel** ch, unsigned nrch)
 }
 
 #endif
+
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_next;
+// We name the file when we dump, not in trace_init, because children
+// we fork without exec'ing inherit our trace state but need files of
+// their own.  Leave room for ".PID".  An empty prefix means we
+// couldn't settle on one and can't dump.
+static char trace_prefix[PATH_MAX - 24];
+static bool trace_dump_on_failure;
+
+void
+trace_1(enum trace_event event,
+        unsigned channel,
+        uint32_t arg0,
+        uint32_t arg1,
+        uint32_t arg2)
+{
+    // Atomic only so that a dump from a signal handler never sees a
+    // slot claimed twice; we don't trace from more than one thread.
+    uint64_t n = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    struct trace_record* r = &trace_ring[n % TRACE_RING_SIZE];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->event = event;
+    r->channel = channel;
+    r->arg[0] = arg0;
+    r->arg[1] = arg1;
+    r->arg[2] = arg2;
+}
+
+void
+trace_msg_1(enum trace_event event, const struct msg* m)
+{
+    unsigned channel = 0;
+    uint32_t payloadsz = 0;
+    switch (m->type) {
+        case MSG_CHANNEL_DATA:
+            channel = ((struct msg_channel_data*) m)->channel;
+            payloadsz = m->size - sizeof (struct msg_channel_data);
+            break;
+        case MSG_CHANNEL_DATA_LZ4:
+            channel = ((struct msg_channel_data_lz4*) m)->channel;
+            payloadsz = ((struct msg_channel_data_lz4*) m)->uncompressed_size;
+            break;
+        case MSG_CHANNEL_DATA_JUMBO:
+            channel = ((struct msg_channel_data_jumbo*) m)->channel;
+            payloadsz = ((struct msg_channel_data_jumbo*) m)->actual_size;
+            break;
+        case MSG_CHANNEL_WINDOW:
+            channel = ((struct msg_channel_window*) m)->channel;
+            payloadsz = ((struct msg_channel_window*) m)->window_delta;
+            break;
+        case MSG_CHANNEL_CLOSE:
+            channel = ((struct msg_channel_close*) m)->channel;
+            break;
+    }
+
+    trace_1(event, channel, m->type, m->size, payloadsz);
+}
+
+static void
+trace_signal_handler(int signo)
+{
+    trace_dump();
+}
+
+void
+trace_init(void)
+{
+    const char* prefix = getenv("FB_ADB_TRACE");
+    int n;
+    if (prefix != NULL && prefix[0] != '\0') {
+        trace_dump_on_failure = true;
+        n = snprintf(trace_prefix, sizeof (trace_prefix), "%s", prefix);
+    } else {
+        n = snprintf(trace_prefix, sizeof (trace_prefix),
+                     "%s/fb-adb-trace", system_tempdir());
+    }
+
+    if (n < 0 || n >= sizeof (trace_prefix))
+        trace_prefix[0] = '\0';
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa));
+    sa.sa_handler = trace_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+void
+trace_forked(void)
+{
+    __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+}
+
+void
+trace_dump(void)
+{
+    if (trace_prefix[0] == '\0')
+        return;
+
+    int saved_errno = errno;
+
+    // No snprintf here: it isn't async-signal-safe.
+    char digits[24];
+    char* p = &digits[sizeof (digits)];
+    *--p = '\0';
+    unsigned long pid = (unsigned long) getpid();
+    do {
+        *--p = '0' + pid % 10;
+        pid /= 10;
+    } while (pid != 0);
+    *--p = '.';
+
+    char file_name[PATH_MAX];
+    size_t prefixsz = strlen(trace_prefix);
+    memcpy(file_name, trace_prefix, prefixsz);
+    memcpy(file_name + prefixsz, p, &digits[sizeof (digits)] - p);
+
+    int fd = open(file_name,
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd == -1)
+        goto out;
+
+    uint64_t next = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    uint64_t nr = XMIN(next, (uint64_t) TRACE_RING_SIZE);
+    struct trace_file_header hdr;
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, TRACE_FILE_MAGIC, sizeof (hdr.magic));
+    hdr.record_size = sizeof (struct trace_record);
+    hdr.nr_records = nr;
+    hdr.pid = getpid();
+    if (prgname != NULL)
+        strncpy(hdr.prgname, prgname, sizeof (hdr.prgname) - 1);
+
+    // Oldest first: once the ring has wrapped, that's the slot we'd
+    // fill next.
+    size_t start = (next - nr) % TRACE_RING_SIZE;
+    size_t first = XMIN(nr, (uint64_t) (TRACE_RING_SIZE - start));
+    struct iovec iov[3] = {
+        { &hdr, sizeof (hdr) },
+        { &trace_ring[start], first * sizeof (struct trace_record) },
+        { &trace_ring[0], (nr - first) * sizeof (struct trace_record) },
+    };
+
+    // Best effort: we can't report failure from a signal handler.
+    // Plain write, because POSIX doesn't promise writev is
+    // async-signal-safe.
+    for (unsigned i = 0; i < ARRAYSIZE(iov); ++i)
+        if (iov[i].iov_len > 0 &&
+            write(fd, iov[i].iov_base, iov[i].iov_len) != iov[i].iov_len)
+            break;
+    close(fd);
+
+  out:
+    errno = saved_errno;
+}
+
+void
+trace_dump_fatal(void)
+{
+    if (trace_dump_on_failure)
+        trace_dump();
+}
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef NDEBUG
 #define dbg(...) ({;})
@@ -49,3 +50,77 @@ dbg_enabled_p(void)
     return dbgout != NULL;
 #endif
 }
+
+// The trace ring is a fixed-size, in-memory record of a process's
+// last TRACE_RING_SIZE protocol events, cheap enough to leave on in
+// release builds: recording one is a clock read and a few stores,
+// with no locks, formatting, or system calls beyond the clock.  Every
+// process records, always.  On SIGUSR2, a process writes its ring to
+// PREFIX.PID, where PREFIX is FB_ADB_TRACE or, by default,
+// fb-adb-trace in the system temporary directory.  With FB_ADB_TRACE
+// set, it also dumps when it dies of an error or a quit signal.
+// fb-adb trace-decode prints a dump.
+//
+// Each event has a channel number and three event-specific
+// arguments, named after the event below.
+
+#define ENUM_TRACE_EVENTS(_e)                                      \
+    _e(TRACE_MSG_SEND)       /* type, size, payload bytes */      \
+    _e(TRACE_MSG_RECV)       /* type, size */                     \
+    _e(TRACE_POLL_WAIT)      /* timeout in ms, or -1 */           \
+    _e(TRACE_POLL_WAKE)      /* poll return value */              \
+    _e(TRACE_WINDOW_GRANT)   /* delta, new window */              \
+    _e(TRACE_COMPRESS_PROBE) /* raw bytes, wire bytes, skip */
+
+enum trace_event {
+    TRACE_EVENT_PRE, // Zero is not a valid event
+#define E(_name) _name,
+    ENUM_TRACE_EVENTS(E)
+#undef E
+};
+
+struct trace_record {
+    uint64_t ns;      // CLOCK_MONOTONIC
+    uint16_t event;
+    uint16_t channel;
+    uint32_t arg[3];
+};
+
+#define TRACE_FILE_MAGIC "FBADBTR1"
+
+// A dump is this header followed by nr_records records, oldest
+// first, all in the byte order of the machine that wrote them.
+struct trace_file_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t nr_records;
+    uint32_t pid;
+    uint32_t reserved;
+    char prgname[32];
+};
+
+struct msg;
+
+#define trace(...) trace_1(__VA_ARGS__)
+void trace_1(enum trace_event event,
+             unsigned channel,
+             uint32_t arg0,
+             uint32_t arg1,
+             uint32_t arg2);
+
+// Record sending or receiving the whole message M.
+#define trace_msg(...) trace_msg_1(__VA_ARGS__)
+void trace_msg_1(enum trace_event event, const struct msg* m);
+
+void trace_init(void);
+
+// Start the ring of a child we forked and won't exec empty, so that
+// its dumps hold only its own events.
+void trace_forked(void);
+
+// Write the ring to its file.  Async-signal-safe.
+void trace_dump(void);
+
+// Call trace_dump if FB_ADB_TRACE asked for dumps when a process
+// fails.  Async-signal-safe.
+void trace_dump_fatal(void);
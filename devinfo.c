@@ -0,0 +1,167 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.h"
+#include "fs.h"
+#include "sha2.h"
+#include "constants.h"
+#include "timestamp.h"
+#include "devinfo.h"
+
+// Cache file format: a header line naming the build that wrote the
+// file, then one "name=value" line per field.
+#define DEVICE_INFO_HEADER "fb-adb-device-info-1"
+
+char*
+device_cache_key(const char* const* adb_args)
+{
+    SCOPED_RESLIST(rl);
+    char* key = xaprintf("%s", getenv("ANDROID_SERIAL") ?: "");
+    for (const char* const* arg = adb_args; *arg != NULL; ++arg)
+        key = xaprintf("%s\n%s", key, *arg);
+
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    SHA256_Data((const uint8_t*) key, strlen(key), digest);
+
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xaprintf("%.16s", digest);
+}
+
+static char*
+device_info_file_name(const char* const* adb_args)
+{
+    return xaprintf("%s/device-info-%s",
+                    my_fb_adb_directory(),
+                    device_cache_key(adb_args));
+}
+
+struct device_info_load_ctx {
+    const char* const* adb_args;
+    struct device_info* di;
+    bool found;
+};
+
+static void
+device_info_load_1(void* data)
+{
+    struct device_info_load_ctx* ctx = data;
+    struct device_info* di = ctx->di;
+    const char* filename = device_info_file_name(ctx->adb_args);
+    int fd = try_xopen(filename, O_RDONLY, 0);
+    if (fd == -1)
+        return;
+
+    size_t sz;
+    char* contents = slurp_fd(fd, &sz);
+    char* saveptr = NULL;
+    char* line = strtok_r(contents, "\n", &saveptr);
+    if (line == NULL || strcmp(line, DEVICE_INFO_HEADER) != 0)
+        die(EINVAL, "bad device info file header");
+
+    memset(di, 0, sizeof (*di));
+    di->stub = -1;
+    bool same_build = false;
+    int stub = -1;
+    while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+        char* value = strchr(line, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        if (!strcmp(line, "fingerprint"))
+            same_build = !strcmp(value, build_fingerprint);
+        else if (!strcmp(line, "boot_id"))
+            snprintf(di->boot_id, sizeof (di->boot_id), "%s", value);
+        else if (!strcmp(line, "api_level"))
+            di->api_level = (unsigned) strtoul(value, NULL, 10);
+        else if (!strcmp(line, "abi_mask"))
+            di->abi_mask = (unsigned) strtoul(value, NULL, 16);
+        else if (!strcmp(line, "stub"))
+            stub = atoi(value);
+    }
+
+    if (same_build)
+        di->stub = stub;
+    ctx->found = di->api_level != 0;
+}
+
+bool
+device_info_load(const char* const* adb_args, struct device_info* di)
+{
+    SCOPED_RESLIST(rl);
+    struct device_info_load_ctx ctx = {
+        .adb_args = adb_args,
+        .di = di,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(device_info_load_1, &ctx, &ei)) {
+        dbg("ignoring device info cache: %s", ei.msg);
+        return false;
+    }
+
+    if (ctx.found)
+        dbg("cached device info: boot %s API level %u ABI mask 0x%x stub %d",
+            di->boot_id, di->api_level, di->abi_mask, di->stub);
+    return ctx.found;
+}
+
+struct device_info_store_ctx {
+    const char* const* adb_args;
+    const struct device_info* di;
+};
+
+static void
+device_info_store_1(void* data)
+{
+    struct device_info_store_ctx* ctx = data;
+    const struct device_info* di = ctx->di;
+    const char* filename = device_info_file_name(ctx->adb_args);
+    const char* tmpname = xaprintf("%s.%s",
+                                   filename,
+                                   gen_hex_random(ENOUGH_ENTROPY));
+    struct cleanup* cl = cleanup_allocate();
+    int fd = xopen(tmpname, O_CREAT | O_EXCL | O_WRONLY, 0600);
+    cleanup_commit(cl, unlink_cleanup, tmpname);
+
+    char* contents = xaprintf(
+        DEVICE_INFO_HEADER "\n"
+        "fingerprint=%s\n"
+        "boot_id=%s\n"
+        "api_level=%u\n"
+        "abi_mask=%x\n"
+        "stub=%d\n",
+        build_fingerprint,
+        di->boot_id,
+        di->api_level,
+        di->abi_mask,
+        di->stub);
+    write_all(fd, contents, strlen(contents));
+    xrename(tmpname, filename);
+    cleanup_forget(cl);
+}
+
+void
+device_info_store(const char* const* adb_args, const struct device_info* di)
+{
+    SCOPED_RESLIST(rl);
+    struct device_info_store_ctx ctx = {
+        .adb_args = adb_args,
+        .di = di,
+    };
+
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    if (catch_error(device_info_store_1, &ctx, &ei))
+        dbg("could not save device info: %s", ei.msg);
+}
@@ -0,0 +1,39 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include "proto.h"
+
+// What we remember about a device between invocations so that we can
+// skip asking it.  Every stub hello tells us these facts afresh, so
+// the cache is only ever consulted for the stretch of connection
+// setup before we've seen one.
+
+struct device_info {
+    char boot_id[FB_ADB_BOOT_ID_LENGTH+1];
+    unsigned api_level;
+    unsigned abi_mask;
+    int stub; // Index in stubs of a stub known to run; -1 if unknown
+};
+
+// Short name for the device ADB_ARGS (and ANDROID_SERIAL) select,
+// suitable for use in file names.
+char* device_cache_key(const char* const* adb_args);
+
+// Read what we know about the device ADB_ARGS selects.  Return false
+// if we know nothing.  DI->stub is -1 if the cache comes from a
+// different build of fb-adb.
+bool device_info_load(const char* const* adb_args, struct device_info* di);
+
+// Replace what we know about the device ADB_ARGS selects.  Failure
+// isn't fatal: we just don't remember.
+void device_info_store(const char* const* adb_args,
+                       const struct device_info* di);
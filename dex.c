@@ -11,11 +11,17 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include "constants.h"
 #include "argv.h"
 #include "util.h"
 #include "fs.h"
 #include "child.h"
+#include "sha2.h"
+
+#ifdef __ANDROID__
+# include <sys/system_properties.h>
+#endif
 
 static char*
 make_odex_name(const char* dex_file_name)
@@ -77,6 +83,68 @@ compile_dex_with_dexopt(const char* dex_file_name,
     xrename(odex_temp_filename, odex_file_name);
 }
 
+// Dexopt output depends on the dex and on the boot classpath it was
+// optimized against, so we keep each odex we make in a per-user cache
+// named after a hash of both.  Using an entry touches it, and the
+// cache is trimmed, least recently used first, to
+// ODEX_CACHE_MAX_BYTES.  Other users don't share the cache: they'd
+// be running code we wrote.
+
+static const char*
+odex_cache_directory(void)
+{
+    const char* dir = xaprintf("%s/odex-cache", my_fb_adb_directory());
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", dir);
+    return dir;
+}
+
+static bool
+odex_cache_entry_name_p(const char* name)
+{
+    return strlen(name) == SHA256_DIGEST_STRING_LENGTH - 1 &&
+        strspn(name, "0123456789abcdef") == strlen(name);
+}
+
+static char*
+odex_cache_file_name(const char* dex_file_name)
+{
+#ifdef __ANDROID__
+    char fingerprint[PROP_VALUE_MAX] = "";
+    (void) __system_property_get("ro.build.fingerprint", fingerprint);
+#else
+    const char* fingerprint = "";
+#endif
+    struct sha256_hash dex_hash = sha256_fd(xopen(dex_file_name, O_RDONLY, 0));
+    char* key = xaprintf("%s\n%s\n%s",
+                         hex_encode_bytes(dex_hash.digest,
+                                          sizeof (dex_hash.digest)),
+                         fingerprint,
+                         getenv("BOOTCLASSPATH") ?: "");
+    char digest[SHA256_DIGEST_STRING_LENGTH];
+    SHA256_Data((const uint8_t*) key, strlen(key), digest);
+    return xaprintf("%s/%s", odex_cache_directory(), digest);
+}
+
+// Atomically make NEW_NAME a hard link to OLD_NAME.  Return false if
+// we can't, e.g., because the two are on different filesystems.
+static bool
+try_link_over(const char* old_name, const char* new_name)
+{
+    const char* tmp_name = xaprintf(
+        "%s.tmp.%s",
+        new_name,
+        gen_hex_random(ENOUGH_ENTROPY));
+    if (link(old_name, tmp_name) == -1) {
+        dbg("could not link [%s] to [%s]: %s",
+            old_name, tmp_name, strerror(errno));
+        return false;
+    }
+    cleanup_commit(cleanup_allocate(), cleanup_tmpfile, tmp_name);
+    xrename(tmp_name, new_name);
+    return true;
+}
+
 void
 compile_dex(const char* dex_file_name)
 {
@@ -85,16 +153,25 @@ compile_dex(const char* dex_file_name)
 
     SCOPED_RESLIST(rl);
 
-    struct stat dex_stat = xstat(dex_file_name);
     const char* odex_file_name = make_odex_name(dex_file_name);
-    bool need_recompile = true;
-    struct stat odex_stat;
-    if (stat(odex_file_name, &odex_stat) == 0 &&
-        dex_stat.st_mtime <= odex_stat.st_mtime)
-    {
-        need_recompile = false;
+    const char* cache_file_name = odex_cache_file_name(dex_file_name);
+    int cache_fd = try_xopen(cache_file_name, O_RDONLY, 0);
+    if (cache_fd != -1) {
+        struct stat cache_stat = xfstat(cache_fd);
+        struct stat odex_stat;
+        bool have_odex = stat(odex_file_name, &odex_stat) == 0 &&
+            odex_stat.st_dev == cache_stat.st_dev &&
+            odex_stat.st_ino == cache_stat.st_ino;
+        if (have_odex || try_link_over(cache_file_name, odex_file_name)) {
+            dbg("using cached odex [%s]", cache_file_name);
+            touch_lru_entry(cache_fd, cache_file_name);
+            return;
+        }
     }
 
-    if (need_recompile)
-        compile_dex_with_dexopt(dex_file_name, odex_file_name);
+    compile_dex_with_dexopt(dex_file_name, odex_file_name);
+    trim_lru_directory(odex_cache_directory(),
+                       odex_cache_entry_name_p,
+                       ODEX_CACHE_MAX_BYTES);
+    (void) try_link_over(odex_file_name, cache_file_name);
 }
@@ -33,10 +33,11 @@ struct elf_header {
     uint16_t e_machine;
 };
 
-struct elf_compatible_ctx {
+struct elf_id_ctx {
     int fd;
-    unsigned api_level;
-    unsigned abi_mask;
+    const void* buf; // If not NULL, read from here instead of FD
+    size_t bufsz;
+    struct elf_id* id;
 };
 
 static const struct {
@@ -49,33 +50,24 @@ static const struct {
     { EM_AARCH64, FB_ADB_ARCH_AARCH64 },
 };
 
-void
-elf_compatible_p_1(void* data)
+static void
+elf_id_1(void* data)
 {
-    struct elf_compatible_ctx* ctx = data;
+    struct elf_id_ctx* ctx = data;
     struct elf_header hdr;
-    if (read_all(ctx->fd, &hdr, sizeof (hdr)) != sizeof (hdr))
+    if (ctx->buf != NULL) {
+        if (ctx->bufsz < sizeof (hdr))
+            die(EIO, "short ELF file");
+        memcpy(&hdr, ctx->buf, sizeof (hdr));
+    } else if (read_all(ctx->fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
         die(EIO, "short ELF file");
+    }
     const char elfmag[4] = "\177ELF";
     if (memcmp(elfmag, hdr.e_ident, sizeof (elfmag)) != 0)
         die(EIO, "not an ELF file");
 
-    unsigned api_level = ctx->api_level;
-
-    switch (hdr.e_type) {
-        case ET_EXEC:
-            if (api_level > 19)
-                die(EIO, "newer versions of Android support only "
-                    "position-independent executables");
-            break;
-        case ET_DYN:
-            if (api_level < 15)
-                die(EIO, "older versions of Android cannot "
-                    "execute position-independent executables");
-            break;
-        default:
-            die(EIO, "unexpected ELF type %u", (unsigned) hdr.e_type);
-    }
+    if (hdr.e_type != ET_EXEC && hdr.e_type != ET_DYN)
+        die(EIO, "unexpected ELF type %u", (unsigned) hdr.e_type);
 
     unsigned arch_bit = 0;
     for (size_t i = 0; arch_bit == 0 && i < ARRAYSIZE(arch_map); ++i)
@@ -85,9 +77,30 @@ elf_compatible_p_1(void* data)
     if (arch_bit == 0)
         die(EIO, "ELF file not in recognized architecture");
 
-    if ((arch_bit & ctx->abi_mask) == 0)
-        die(EIO, "ELF file has no architectures in common "
-            "with target machine");
+    ctx->id->arch_bit = arch_bit;
+    ctx->id->pie = (hdr.e_type == ET_DYN);
+}
+
+bool
+elf_id_fd(int fd, struct elf_id* id)
+{
+    struct elf_id_ctx ctx = {
+        .fd = fd,
+        .id = id,
+    };
+    return !catch_error(elf_id_1, &ctx, NULL);
+}
+
+bool
+elf_id_compatible_p(const struct elf_id* id,
+                    unsigned api_level,
+                    unsigned abi_mask)
+{
+    // Newer versions of Android support only position-independent
+    // executables, and older versions can't run them at all.
+    if (id->pie ? api_level < 15 : api_level > 19)
+        return false;
+    return (id->arch_bit & abi_mask) != 0;
 }
 
 bool
@@ -95,10 +108,38 @@ elf_compatible_p(int fd,
                  unsigned api_level,
                  unsigned abi_mask)
 {
-    struct elf_compatible_ctx ctx = {
-        .fd = fd,
-        .api_level = api_level,
-        .abi_mask = abi_mask,
+    struct elf_id id;
+    return elf_id_fd(fd, &id) &&
+        elf_id_compatible_p(&id, api_level, abi_mask);
+}
+
+bool
+elf_compatible_buf_p(const void* buf,
+                     size_t bufsz,
+                     unsigned api_level,
+                     unsigned abi_mask)
+{
+    struct elf_id id;
+    struct elf_id_ctx ctx = {
+        .fd = -1,
+        .buf = buf,
+        .bufsz = bufsz,
+        .id = &id,
     };
-    return !catch_error(elf_compatible_p_1, &ctx, NULL);
+    return !catch_error(elf_id_1, &ctx, NULL) &&
+        elf_id_compatible_p(&id, api_level, abi_mask);
+}
+
+unsigned
+abi_to_abi_bit(const char* abi)
+{
+    if (string_starts_with_p(abi, "armeabi"))
+        return FB_ADB_ARCH_ARM;
+    if (string_starts_with_p(abi, "arm64"))
+        return FB_ADB_ARCH_AARCH64;
+    if (!strcmp(abi, "x86"))
+        return FB_ADB_ARCH_X86;
+    if (!strcmp(abi, "x86_64"))
+        return FB_ADB_ARCH_AMD64;
+    return 0;
 }
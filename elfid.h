@@ -11,8 +11,35 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "proto.h"
 
+// What elf_compatible_p needs to know about an executable.  It
+// doesn't depend on the device, so we can read it before we know
+// which device we'll run the program on.
+struct elf_id {
+    unsigned arch_bit; // FB_ADB_ARCH_* bit
+    bool pie;
+};
+
+// Read the ELF header of the executable at FD into ID.  Return false
+// if FD isn't an executable in an architecture we know.
+bool elf_id_fd(int fd, struct elf_id* id);
+
+bool elf_id_compatible_p(const struct elf_id* id,
+                         unsigned api_level,
+                         unsigned abi_mask);
+
 bool elf_compatible_p(int fd,
                       unsigned api_level,
                       unsigned abi_mask);
+
+// Like elf_compatible_p, but examine the BUFSZ bytes at BUF.
+bool elf_compatible_buf_p(const void* buf,
+                          size_t bufsz,
+                          unsigned api_level,
+                          unsigned abi_mask);
+
+// Map an Android ABI name (e.g., "arm64-v8a") to its FB_ADB_ARCH_*
+// bit, or zero if we don't know the ABI.
+unsigned abi_to_abi_bit(const char* abi);
@@ -18,6 +18,9 @@
 #include "fs.h"
 #include "constants.h"
 #include "sha2.h"
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 
 #if XPPOLL == XPPOLL_KQUEUE
 # include <sys/event.h>
@@ -434,6 +437,31 @@ read_all(int fd, void* buf, size_t sz)
     return nr_read;
 }
 
+size_t
+pread_all(int fd, void* buf, size_t sz, off_t offset)
+{
+    size_t nr_read = 0;
+    ssize_t ret;
+    char* pos = buf;
+
+    while (nr_read < sz) {
+        do {
+            WITH_IO_SIGNALS_ALLOWED();
+            ret = pread(fd, &pos[nr_read], sz - nr_read, offset + nr_read);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret < 0)
+            die_errno("pread(%d)", fd);
+
+        if (ret < 1)
+            break;
+
+        nr_read += ret;
+    }
+
+    return nr_read;
+}
+
 void
 write_all(int fd, const void* buf, size_t sz)
 {
@@ -454,6 +482,61 @@ write_all(int fd, const void* buf, size_t sz)
     }
 }
 
+void
+pwrite_all(int fd, const void* buf, size_t sz, off_t offset)
+{
+    size_t nr_written = 0;
+    ssize_t ret;
+    const char* pos = buf;
+
+    while (nr_written < sz) {
+        do {
+            WITH_IO_SIGNALS_ALLOWED();
+            ret = pwrite(fd, &pos[nr_written], sz - nr_written,
+                         offset + nr_written);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret < 0)
+            die_errno("pwrite(%d)", fd);
+
+        nr_written += ret;
+    }
+}
+
+size_t
+sendfile_all(int out_fd,
+             int in_fd,
+             off_t* offset,
+             size_t sz,
+             bool* sendfile_ok)
+{
+    size_t nr_sent = 0;
+#ifdef HAVE_SYS_SENDFILE_H
+    while (nr_sent < sz) {
+        ssize_t ret;
+        do {
+            WITH_IO_SIGNALS_ALLOWED();
+            ret = sendfile(out_fd, in_fd, offset, sz - nr_sent);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == 0)
+            break;
+        if (ret < 0) {
+            if (errno != EINVAL && errno != ENOSYS)
+                die_errno("sendfile");
+            dbg("sendfile unsupported here: falling back to copy");
+            break;
+        }
+        nr_sent += ret;
+    }
+#else
+    (void) out_fd; (void) in_fd; (void) offset;
+#endif
+    if (nr_sent < sz)
+        *sendfile_ok = false;
+    return nr_sent;
+}
+
 void
 write_all_v(int fd, const struct iovec* iov_in, int iovcnt)
 {
@@ -1057,6 +1140,27 @@ hint_sequential_access(int fd)
 #endif
 }
 
+void
+hint_will_need(int fd, uint64_t length)
+{
+#if defined(HAVE_POSIX_FADVISE)
+    (void) posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+#else
+    (void) fd;
+    (void) length;
+#endif
+}
+
+void
+start_writeback(int fd)
+{
+#if defined(HAVE_SYNC_FILE_RANGE)
+    (void) sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#else
+    (void) fd;
+#endif
+}
+
 void
 xputc(char c, FILE* out)
 {
@@ -1131,7 +1235,7 @@ sha256_fd(int fd)
         sizeof (sh.digest) == SHA256_DIGEST_LENGTH,
         "hash size mismatch");
 
-    size_t bufsz = 32768;
+    size_t bufsz = SHA256_READ_SIZE;
     uint8_t* buf = xalloc(bufsz);
     size_t nr_read;
     SHA256_CTX sha256;
@@ -1144,6 +1248,76 @@ sha256_fd(int fd)
     return sh;
 }
 
+uint32_t
+stat_mtime_ns(const struct stat* st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    return st->st_mtim.tv_nsec;
+#else
+    (void) st;
+    return 0;
+#endif
+}
+
+uint32_t
+stat_ctime_ns(const struct stat* st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    return st->st_ctim.tv_nsec;
+#else
+    (void) st;
+    return 0;
+#endif
+}
+
+bool
+stat_sparse_p(const struct stat* st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_BLOCKS
+    return S_ISREG(st->st_mode) &&
+        (uint64_t) st->st_blocks * 512 < (uint64_t) st->st_size;
+#else
+    (void) st;
+    return false;
+#endif
+}
+
+bool
+find_data_segment(int fd,
+                  uint64_t pos,
+                  uint64_t size,
+                  uint64_t* data_start,
+                  uint64_t* data_end)
+{
+#ifdef SEEK_DATA
+    if (pos >= size) {
+        *data_start = *data_end = size;
+        return true;
+    }
+
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data == (off_t) -1) {
+        if (errno != ENXIO)
+            return false;
+        *data_start = *data_end = size;
+        return true;
+    }
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == (off_t) -1)
+        return false;
+
+    *data_start = XMIN((uint64_t) data, size);
+    *data_end = XMIN((uint64_t) hole, size);
+    if (*data_end <= *data_start && *data_start < size)
+        *data_end = size; // File changed under us
+    return true;
+#else
+    (void) fd; (void) pos; (void) size; (void) data_start; (void) data_end;
+    return false;
+#endif
+}
+
 void
 xrewindfd(int fd)
 {
@@ -1336,3 +1510,227 @@ xopendir(const char* path)
     cleanup_commit(cl, cleanup_closedir, dir);
     return dir;
 }
+
+void
+touch_lru_entry(int fd, const char* filename)
+{
+    // Leave entries used recently alone, so that using one doesn't
+    // usually change its metadata: hash_cache_sha256_fd keys on it.
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        st.st_mtime <= time(NULL) &&
+        time(NULL) - st.st_mtime < LRU_TOUCH_GRANULARITY_S)
+    {
+        return;
+    }
+
+    int ret;
+#ifdef HAVE_FUTIMES
+    ret = futimes(fd, NULL);
+#else
+    (void) fd;
+    ret = utimes(filename, NULL);
+#endif
+    if (ret == -1)
+        dbg("could not touch cache entry [%s]: %s",
+            filename, strerror(errno));
+}
+
+struct lru_entry {
+    char* name;
+    off_t size;
+    time_t mtime;
+};
+
+static int
+lru_entry_cmp_mtime(const void* a, const void* b)
+{
+    time_t ma = ((const struct lru_entry*) a)->mtime;
+    time_t mb = ((const struct lru_entry*) b)->mtime;
+    return ma < mb ? -1 : ma > mb;
+}
+
+void
+trim_lru_directory(const char* dirname,
+                   bool (*name_p)(const char* name),
+                   uint64_t max_bytes)
+{
+    SCOPED_RESLIST(rl);
+    DIR* dir = xopendir(dirname);
+    struct lru_entry* entries = NULL;
+    size_t nr_entries = 0;
+    size_t entries_capacity = 0;
+    uint64_t total_size = 0;
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!name_p(ent->d_name))
+            continue;
+        char* name = xaprintf("%s/%s", dirname, ent->d_name);
+        struct stat st;
+        if (stat(name, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (nr_entries == entries_capacity) {
+            entries_capacity = XMAX(entries_capacity * 2, (size_t) 16);
+            struct lru_entry* new_entries =
+                xalloc(entries_capacity * sizeof (*entries));
+            if (nr_entries > 0)
+                memcpy(new_entries, entries, nr_entries * sizeof (*entries));
+            entries = new_entries;
+        }
+        entries[nr_entries++] = (struct lru_entry) {
+            .name = name,
+            .size = st.st_size,
+            .mtime = st.st_mtime,
+        };
+        total_size += st.st_size;
+    }
+
+    if (total_size <= max_bytes)
+        return;
+
+    qsort(entries, nr_entries, sizeof (*entries), lru_entry_cmp_mtime);
+    for (size_t i = 0; i < nr_entries && total_size > max_bytes; ++i) {
+        dbg("evicting cache entry [%s]", entries[i].name);
+        if (unlink(entries[i].name) == -1 && errno != ENOENT)
+            dbg("could not evict [%s]: %s",
+                entries[i].name, strerror(errno));
+        else
+            total_size -= entries[i].size;
+    }
+}
+
+struct ttl_cache_header {
+    char magic[8];
+    int64_t expires;
+};
+
+struct ttl_cache_ctx {
+    const struct ttl_cache* cache;
+    const char* key;
+    int ttl_s;
+    void (*write_body)(int fd, void* data);
+    void* data;
+    char* body;
+    size_t size;
+};
+
+static const char*
+ttl_cache_directory(const struct ttl_cache* cache)
+{
+    const char* dir = xaprintf("%s/%s", my_fb_adb_directory(), cache->subdir);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", dir);
+    return dir;
+}
+
+static bool
+ttl_cache_record_name_p(const char* name)
+{
+    size_t len = strlen(name);
+    return len == SHA256_DIGEST_STRING_LENGTH - 1 &&
+        strspn(name, "0123456789abcdef") == len;
+}
+
+static void
+ttl_cache_lookup_1(void* data)
+{
+    struct ttl_cache_ctx* ctx = data;
+    SCOPED_RESLIST(rl);
+    const char* name = xaprintf("%s/%s",
+                                ttl_cache_directory(ctx->cache),
+                                ctx->key);
+    int fd = try_xopen(name, O_RDONLY, 0);
+    if (fd == -1)
+        return;
+
+    struct ttl_cache_header hdr;
+    if (read_all(fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+        memcmp(hdr.magic, ctx->cache->magic, sizeof (hdr.magic)) != 0 ||
+        hdr.expires <= (int64_t) time(NULL))
+    {
+        return;
+    }
+
+    touch_lru_entry(fd, name);
+    WITH_CURRENT_RESLIST(rl->parent);
+    ctx->body = slurp_fd(fd, &ctx->size);
+}
+
+char*
+ttl_cache_lookup(const struct ttl_cache* cache,
+                 const char* key,
+                 size_t* size)
+{
+    assert(ttl_cache_record_name_p(key));
+    struct ttl_cache_ctx ctx = {
+        .cache = cache,
+        .key = key,
+    };
+    if (catch_error(ttl_cache_lookup_1, &ctx, NULL))
+        dbg("%s lookup failed", cache->subdir);
+    *size = ctx.size;
+    return ctx.body;
+}
+
+static void
+ttl_cache_store_1(void* data)
+{
+    struct ttl_cache_ctx* ctx = data;
+    SCOPED_RESLIST(rl);
+    const char* dir = ttl_cache_directory(ctx->cache);
+    const char* name = xaprintf("%s/%s", dir, ctx->key);
+    const char* tmp_name = xaprintf("%s.tmp.%s",
+                                    name,
+                                    gen_hex_random(ENOUGH_ENTROPY));
+    trim_lru_directory(dir, ttl_cache_record_name_p, ctx->cache->max_bytes);
+    struct cleanup* cl = cleanup_allocate();
+    int fd = xopen(tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    cleanup_commit(cl, unlink_cleanup, (void*) tmp_name);
+
+    struct ttl_cache_header hdr;
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, ctx->cache->magic, sizeof (hdr.magic));
+    hdr.expires = (int64_t) time(NULL) + ctx->ttl_s;
+    write_all(fd, &hdr, sizeof (hdr));
+    ctx->write_body(fd, ctx->data);
+    xrename(tmp_name, name);
+    cleanup_forget(cl);
+}
+
+void
+ttl_cache_store(const struct ttl_cache* cache,
+                const char* key,
+                int ttl_s,
+                void (*write_body)(int fd, void* data),
+                void* data)
+{
+    assert(ttl_cache_record_name_p(key));
+    struct ttl_cache_ctx ctx = {
+        .cache = cache,
+        .key = key,
+        .ttl_s = ttl_s,
+        .write_body = write_body,
+        .data = data,
+    };
+    if (catch_error(ttl_cache_store_1, &ctx, NULL))
+        dbg("could not store %s record", cache->subdir);
+}
+
+DIR*
+xopendirat(int dirfd, const char* path, int flags)
+{
+    struct cleanup* cl = cleanup_allocate();
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+    if (fd == -1)
+        die_errno("open(\"%s\")", path);
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        die_errno("fdopendir(\"%s\")", path);
+    }
+    cleanup_commit(cl, cleanup_closedir, dir);
+    return dir;
+}
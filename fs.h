@@ -91,10 +91,27 @@ size_t xread(int fd, void* buf, size_t sz);
 // May return short read on EOF.
 size_t read_all(int fd, void* buf, size_t sz);
 
+// Like read_all, but read at OFFSET without moving the file pointer.
+size_t pread_all(int fd, void* buf, size_t sz, off_t offset);
+
 // Write SZ bytes to FD, retrying on EINTR.
 void write_all(int fd, const void* buf, size_t sz);
 void write_all_v(int fd, const struct iovec* iov, int iovcnt);
 
+// Like write_all, but write at OFFSET without moving the file pointer.
+void pwrite_all(int fd, const void* buf, size_t sz, off_t offset);
+
+// Send up to SZ bytes from IN_FD to OUT_FD without copying them
+// through our address space, starting at *OFFSET and advancing it, or
+// if OFFSET is NULL, at the file pointer.  Return the number of bytes
+// sent: if it's less than SZ, the source is shorter than we thought or
+// the kernel can't sendfile to OUT_FD, and *SENDFILE_OK is now false.
+size_t sendfile_all(int out_fd,
+                    int in_fd,
+                    off_t* offset,
+                    size_t sz,
+                    bool* sendfile_ok);
+
 #ifndef HAVE_DUP3
 int dup3(int oldfd, int newfd, int flags);
 #endif
@@ -159,6 +176,14 @@ void xftruncate(int fd, uint64_t size);
 void xrename(const char* old, const char* new);
 
 void hint_sequential_access(int fd);
+
+// Ask the kernel to start reading the first LENGTH bytes of FD into
+// the page cache without waiting for them.
+void hint_will_need(int fd, uint64_t length);
+
+// Ask the kernel to start writing FD's dirty pages to storage without
+// waiting for it to finish, so that a later fsync(2) has less to do.
+void start_writeback(int fd);
 void _fs_on_init(void);
 
 void xputc(char c, FILE* out);
@@ -174,6 +199,26 @@ struct sha256_hash {
     uint8_t digest[32];
 };
 struct sha256_hash sha256_fd(int fd);
+
+// Nanosecond part of ST's modification time, or zero if the system
+// doesn't tell us.
+uint32_t stat_mtime_ns(const struct stat* st);
+
+// Likewise, for ST's change time.
+uint32_t stat_ctime_ns(const struct stat* st);
+
+// Whether ST describes a regular file with holes in it.
+bool stat_sparse_p(const struct stat* st);
+
+// Find the first run of data at or after POS in the regular file FD,
+// which is SIZE bytes long, and store its bounds in *DATA_START and
+// *DATA_END; past the last run, both are SIZE.  Return false if the
+// system can't tell us where the holes are.  Moves the file pointer.
+bool find_data_segment(int fd,
+                       uint64_t pos,
+                       uint64_t size,
+                       uint64_t* data_start,
+                       uint64_t* data_end);
 void xrewindfd(int fd);
 
 #ifdef HAVE_REALPATH
@@ -203,3 +248,48 @@ int xF_GETFL(int fd);
 void xF_SETFL(int fd, int flags);
 
 DIR* xopendir(const char* path);
+
+// Mark FILENAME, open as FD, as just used, for trim_lru_directory.
+// Entries touched in the last LRU_TOUCH_GRANULARITY_S seconds already
+// count as just used.
+void touch_lru_entry(int fd, const char* filename);
+
+// Delete the least recently modified of the regular files in DIRNAME
+// whose names satisfy NAME_P until those files total at most
+// MAX_BYTES.
+void trim_lru_directory(const char* dirname,
+                        bool (*name_p)(const char* name),
+                        uint64_t max_bytes);
+
+// A TTL cache is a directory of small records under
+// my_fb_adb_directory(), each a header holding the cache's magic and
+// an expiry time, then a body only the cache's users understand.
+// Records are named by keys of SHA256_DIGEST_STRING_LENGTH-1 hex
+// digits and replaced atomically, so processes sharing a cache need
+// no locking.  Once the records total more than max_bytes, the least
+// recently used go first.
+struct ttl_cache {
+    const char* subdir;
+    char magic[8];
+    uint64_t max_bytes;
+};
+
+// Return the NUL-terminated body of the unexpired record KEY in
+// CACHE, setting *SIZE to its length, or NULL if there is no such
+// record.  Problems with the cache count as a miss, never an error.
+char* ttl_cache_lookup(const struct ttl_cache* cache,
+                       const char* key,
+                       size_t* size);
+
+// Replace record KEY in CACHE with one that expires TTL_S seconds
+// from now and whose body WRITE_BODY writes to FD.  If we can't,
+// we just don't remember.
+void ttl_cache_store(const struct ttl_cache* cache,
+                     const char* key,
+                     int ttl_s,
+                     void (*write_body)(int fd, void* data),
+                     void* data);
+
+// Open directory PATH relative to directory fd DIRFD.  FLAGS are
+// extra open(2) flags, e.g., O_NOFOLLOW.
+DIR* xopendirat(int dirfd, const char* path, int flags);
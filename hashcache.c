@@ -0,0 +1,156 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "constants.h"
+#include "hashcache.h"
+
+struct hash_cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mtime_ns;
+    uint32_t ctime_ns;
+    struct sha256_hash hash;
+};
+
+static const char*
+hash_cache_directory(void)
+{
+    const char* dir = xaprintf("%s/hash-cache", my_fb_adb_directory());
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", dir);
+    return dir;
+}
+
+static bool
+hash_cache_record_name_p(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 0 && strspn(name, "0123456789abcdef-") == len;
+}
+
+static struct hash_cache_record
+hash_cache_key(const struct stat* st)
+{
+    struct hash_cache_record key;
+    memset(&key, 0, sizeof (key)); // No garbage in the padding
+    key.dev = st->st_dev;
+    key.ino = st->st_ino;
+    key.size = st->st_size;
+    key.mtime = st->st_mtime;
+    key.ctime = st->st_ctime;
+    key.mtime_ns = stat_mtime_ns(st);
+    key.ctime_ns = stat_ctime_ns(st);
+    return key;
+}
+
+static bool
+hash_cache_key_equal_p(const struct hash_cache_record* a,
+                       const struct hash_cache_record* b)
+{
+    return memcmp(a, b, offsetof(struct hash_cache_record, hash)) == 0;
+}
+
+struct hash_cache_ctx {
+    const struct hash_cache_record* key;
+    struct sha256_hash* hash;
+    bool found;
+};
+
+static void
+hash_cache_lookup_1(void* data)
+{
+    struct hash_cache_ctx* ctx = data;
+    const struct hash_cache_record* key = ctx->key;
+    const char* name = xaprintf("%s/%llx-%llx",
+                                hash_cache_directory(),
+                                (unsigned long long) key->dev,
+                                (unsigned long long) key->ino);
+    int fd = try_xopen(name, O_RDONLY, 0);
+    if (fd == -1)
+        return;
+
+    struct hash_cache_record record;
+    if (read_all(fd, &record, sizeof (record)) == sizeof (record) &&
+        hash_cache_key_equal_p(&record, key))
+    {
+        touch_lru_entry(fd, name);
+        *ctx->hash = record.hash;
+        ctx->found = true;
+    }
+}
+
+static void
+hash_cache_store_1(void* data)
+{
+    const struct hash_cache_record* record = data;
+    const char* dir = hash_cache_directory();
+    const char* name = xaprintf("%s/%llx-%llx",
+                                dir,
+                                (unsigned long long) record->dev,
+                                (unsigned long long) record->ino);
+    const char* tmp_name = xaprintf("%s.tmp.%s",
+                                    name,
+                                    gen_hex_random(ENOUGH_ENTROPY));
+    trim_lru_directory(dir, hash_cache_record_name_p, HASH_CACHE_MAX_BYTES);
+    struct cleanup* cl = cleanup_allocate();
+    int fd = xopen(tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    cleanup_commit(cl, unlink_cleanup, (void*) tmp_name);
+    write_all(fd, record, sizeof (*record));
+    xrename(tmp_name, name);
+    cleanup_forget(cl);
+}
+
+struct sha256_hash
+hash_cache_sha256_fd(int fd)
+{
+    SCOPED_RESLIST(rl);
+    struct stat st = xfstat(fd);
+    xrewindfd(fd);
+    if (!S_ISREG(st.st_mode))
+        return sha256_fd(fd);
+
+    struct hash_cache_record record = hash_cache_key(&st);
+    struct hash_cache_ctx ctx = {
+        .key = &record,
+        .hash = &record.hash,
+    };
+
+    // The cache is only an optimization, so never fail because of it.
+    if (catch_error(hash_cache_lookup_1, &ctx, NULL))
+        dbg("hash cache lookup failed");
+    if (ctx.found) {
+        dbg("hash cache hit for %llx-%llx",
+            (unsigned long long) record.dev,
+            (unsigned long long) record.ino);
+        return record.hash;
+    }
+
+    record.hash = sha256_fd(fd);
+    time_t now = time(NULL);
+    if (now - st.st_mtime >= HASH_CACHE_RACY_S &&
+        now - st.st_ctime >= HASH_CACHE_RACY_S &&
+        catch_error(hash_cache_store_1, &record, NULL))
+    {
+        dbg("could not remember hash");
+    }
+
+    return record.hash;
+}
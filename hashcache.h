@@ -0,0 +1,25 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include "fs.h"
+
+// Hashing a big program takes a while, so we remember the hashes of
+// files we've hashed before, keyed by the metadata that changes
+// whenever a file's contents can have: device, inode, size, and
+// modification and change times.  Nobody can set a change time, so
+// rewriting a file and restoring its modification time still shows.
+// Each record is a small file under my_fb_adb_directory() named after
+// the device and inode, replaced atomically, so processes sharing the
+// cache need no locking.
+
+// Like sha256_fd, but hash the whole file, and consult and fill the
+// cache if FD is a regular file.  Leaves FD's offset unspecified.
+struct sha256_hash hash_cache_sha256_fd(int fd);
@@ -4,6 +4,13 @@
 #include "json.h"
 #include "util.h"
 #include "utf8.h"
+#include "constants.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 
 #define UTF8_FULL 0
 
@@ -22,13 +29,39 @@ struct json_context {
     enum json_state state;
 };
 
+// CBOR major types, RFC 8949 section 3.1.
+enum cbor_major {
+    CBOR_UINT = 0,
+    CBOR_NEGINT = 1,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+};
+
+#define CBOR_INDEFINITE 31
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_NULL 0xF6
+#define CBOR_BREAK 0xFF
+
 struct json_writer {
     FILE* out;
+    enum json_format format;
     struct json_writer_config config;
+    // In CBOR, strings need their length up front, so we collect each
+    // one here before writing it.  We manage this buffer ourselves
+    // because it can grow while some other reslist is current.
+    uint8_t* strbuf;
+    size_t strbuf_size;
+    size_t strbuf_used;
     struct json_context* context;
     uint32_t utf8_state;
     uint8_t utf8_buf[5];
     uint8_t utf8_bufsz;
+    // We batch output here instead of making a stdio call for every
+    // byte, and hand it to OUT whenever a top-level value ends.
+    size_t obuf_used;
+    uint8_t obuf[JSON_WRITER_BUFFER_SIZE];
 };
 
 static const char*
@@ -94,12 +127,34 @@ json_pop_context(struct json_writer* writer)
     free(context);
 }
 
+static bool
+json_flush_obuf_1(struct json_writer* writer)
+{
+    size_t used = writer->obuf_used;
+    writer->obuf_used = 0;
+    return used == 0 || fwrite(writer->obuf, used, 1, writer->out) == 1;
+}
+
+static void
+json_flush_obuf(struct json_writer* writer)
+{
+    if (!json_flush_obuf_1(writer)) {
+        if (writer->context != NULL)
+            writer->context->state = IOERR;
+        die_errno("fwrite");
+    }
+}
+
 static void
 json_writer_cleanup(void* data)
 {
     struct json_writer* writer = data;
+    // Don't lose what a writer abandoned mid-value had written, but
+    // we can't report errors from here.
+    (void) json_flush_obuf_1(writer);
     while (writer->context)
         json_pop_context(writer);
+    free(writer->strbuf);
     free(writer);
 }
 
@@ -124,10 +179,57 @@ json_check_state(struct json_writer* writer, unsigned allowed_states)
 static void
 json_emitc(struct json_writer* writer, char c)
 {
-    if (putc(c, writer->out) == EOF) {
-        writer->context->state = IOERR;
-        die_errno("putc");
+    if (writer->obuf_used == sizeof (writer->obuf))
+        json_flush_obuf(writer);
+    writer->obuf[writer->obuf_used++] = (uint8_t) c;
+}
+
+static void
+json_emit_bytes(struct json_writer* writer, const void* data, size_t n)
+{
+    const uint8_t* pos = data;
+    while (n > 0) {
+        if (writer->obuf_used == sizeof (writer->obuf))
+            json_flush_obuf(writer);
+        size_t chunk = XMIN(n, sizeof (writer->obuf) - writer->obuf_used);
+        memcpy(writer->obuf + writer->obuf_used, pos, chunk);
+        writer->obuf_used += chunk;
+        pos += chunk;
+        n -= chunk;
+    }
+}
+
+static const char json_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Format NUMBER in decimal so that it ends just before END and return
+// where it starts.  We make two digits per division.
+static char*
+json_format_u64(char* end, uint64_t number)
+{
+    char* pos = end;
+    while (number >= 100) {
+        unsigned pair = (unsigned) (number % 100);
+        number /= 100;
+        pos -= 2;
+        memcpy(pos, &json_digit_pairs[2 * pair], 2);
     }
+    if (number >= 10) {
+        pos -= 2;
+        memcpy(pos, &json_digit_pairs[2 * number], 2);
+    } else {
+        *--pos = (char) ('0' + number);
+    }
+    return pos;
 }
 
 static void
@@ -138,14 +240,139 @@ json_emits(struct json_writer* writer, const char* s)
         json_emitc(writer, c);
 }
 
+// Emit a CBOR data item head: the major type and its argument, in as
+// few bytes as the argument allows.
+static void
+cbor_emit_head(struct json_writer* writer,
+               enum cbor_major major,
+               uint64_t argument)
+{
+    uint8_t head[9];
+    size_t headsz;
+    uint8_t mt = (uint8_t) (major << 5);
+    if (argument < 24) {
+        head[0] = mt | (uint8_t) argument;
+        headsz = 1;
+    } else if (argument <= UINT8_MAX) {
+        head[0] = mt | 24;
+        headsz = 2;
+    } else if (argument <= UINT16_MAX) {
+        head[0] = mt | 25;
+        headsz = 3;
+    } else if (argument <= UINT32_MAX) {
+        head[0] = mt | 26;
+        headsz = 5;
+    } else {
+        head[0] = mt | 27;
+        headsz = 9;
+    }
+    for (size_t i = 1; i < headsz; ++i)
+        head[i] = (uint8_t) (argument >> (8 * (headsz - 1 - i)));
+    json_emit_bytes(writer, head, headsz);
+}
+
+// Emit a CBOR head whose argument means "indefinite length".
+static void
+cbor_emit_indefinite(struct json_writer* writer, enum cbor_major major)
+{
+    json_emitc(writer, (uint8_t) (major << 5) | CBOR_INDEFINITE);
+}
+
+// Emit bytes of the string being written, which must need no
+// escaping: straight out for JSON, into the string buffer for CBOR.
+static void
+json_emit_string_bytes(struct json_writer* writer,
+                       const uint8_t* bytes,
+                       size_t n)
+{
+    if (writer->format == JSON_FORMAT_TEXT) {
+        json_emit_bytes(writer, bytes, n);
+        return;
+    }
+
+    while (writer->strbuf_size - writer->strbuf_used < n) {
+        size_t new_size;
+        if (SATADD(&new_size, writer->strbuf_size, writer->strbuf_size ?: 64))
+            die_oom();
+        uint8_t* new_strbuf = realloc(writer->strbuf, new_size);
+        if (new_strbuf == NULL)
+            die_oom();
+        writer->strbuf = new_strbuf;
+        writer->strbuf_size = new_size;
+    }
+    memcpy(writer->strbuf + writer->strbuf_used, bytes, n);
+    writer->strbuf_used += n;
+}
+
+static void
+json_emit_string_byte(struct json_writer* writer, uint8_t c)
+{
+    json_emit_string_bytes(writer, &c, 1);
+}
+
+// Nonzero for bytes that can't go into a JSON string literal as they
+// are: quotes, backslashes, controls, and DEL (which we escape for
+// the benefit of terminals).  Bytes of multibyte UTF-8 sequences are
+// fine once utf8_valid_prefix has vouched for them.
+static const uint8_t json_special_byte[256] = {
+    [0x00 ... 0x1F] = 1,
+    ['"'] = 1,
+    ['\\'] = 1,
+    [0x7F] = 1,
+};
+
+// Return how many bytes at the start of S need no escaping.
+static size_t
+json_plain_prefix(const uint8_t* s, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        // SSE2 has no unsigned less-than, but v <= 0x1F exactly when
+        // min(v, 0x1F) == v.
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, control_max), v);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, backslash)),
+            _mm_or_si128(control, _mm_cmpeq_epi8(v, del)));
+        unsigned mask = (unsigned) _mm_movemask_epi8(special);
+        if (mask != 0)
+            return i + (size_t) __builtin_ctz(mask);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t del = vdupq_n_u8(0x7F);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t special = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)),
+            vorrq_u8(vcltq_u8(v, space), vceqq_u8(v, del)));
+        if (vmaxvq_u8(special) != 0)
+            break;
+    }
+#endif
+    while (i < n && !json_special_byte[s[i]])
+        i += 1;
+    return i;
+}
+
 static void
 json_value_start(struct json_writer* writer)
 {
     json_check_state(writer, VALUE | ARRAY_EMPTY | ARRAY_NONEMPTY);
-    if (json_writer_state(writer) == ARRAY_NONEMPTY)
-        json_emitc(writer, ',');
-    else if (json_writer_state(writer) == ARRAY_EMPTY)
+    if (json_writer_state(writer) == ARRAY_NONEMPTY) {
+        if (writer->format == JSON_FORMAT_TEXT)
+            json_emitc(writer, ',');
+    } else if (json_writer_state(writer) == ARRAY_EMPTY) {
         writer->context->state = ARRAY_NONEMPTY;
+    }
 }
 
 static void
@@ -153,10 +380,18 @@ json_value_end(struct json_writer* writer)
 {
     if (json_writer_state(writer) == VALUE)
         json_pop_context(writer);
+    if (writer->context == NULL)
+        json_flush_obuf(writer);
 }
 
 struct json_writer*
 json_writer_create(FILE* out)
+{
+    return json_writer_create_format(out, JSON_FORMAT_TEXT);
+}
+
+struct json_writer*
+json_writer_create_format(FILE* out, enum json_format format)
 {
     struct cleanup* cl = cleanup_allocate();
     struct json_writer* writer = calloc(1, sizeof (*writer));
@@ -164,18 +399,49 @@ json_writer_create(FILE* out)
         die_oom();
     cleanup_commit(cl, json_writer_cleanup, writer);
     writer->out = out;
+    writer->format = format;
     writer->config.bad_utf8_mode = JSON_WRITER_BAD_UTF8_REPLACE;
     writer->config.bad_utf8_replacement = "\\uFFFD";
     json_push_context(writer, VALUE);
     return writer;
 }
 
+void
+json_writer_reset(struct json_writer* writer)
+{
+    if (writer->context == NULL)
+        json_push_context(writer, VALUE);
+    json_check_state(writer, VALUE);
+}
+
+void
+json_end_record(struct json_writer* writer)
+{
+    if (writer->format == JSON_FORMAT_TEXT) {
+        json_emitc(writer, '\n');
+        json_flush_obuf(writer);
+    }
+}
+
+enum json_format
+json_format_from_name(const char* name)
+{
+    if (!strcmp(name, "json"))
+        return JSON_FORMAT_TEXT;
+    if (!strcmp(name, "cbor") || !strcmp(name, "binary"))
+        return JSON_FORMAT_CBOR;
+    die(EINVAL, "unknown output format \"%s\"", name);
+}
+
 void
 json_begin_array(struct json_writer* writer)
 {
     json_value_start(writer);
     json_push_context(writer, ARRAY_EMPTY);
-    json_emitc(writer, '[');
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emitc(writer, '[');
+    else
+        cbor_emit_indefinite(writer, CBOR_ARRAY);
 }
 
 void
@@ -183,7 +449,7 @@ json_end_array(struct json_writer* writer)
 {
     json_check_state(writer, ARRAY_EMPTY | ARRAY_NONEMPTY);
     json_pop_context(writer);
-    json_emitc(writer, ']');
+    json_emitc(writer, writer->format == JSON_FORMAT_TEXT ? ']' : CBOR_BREAK);
     json_value_end(writer);
 }
 
@@ -192,7 +458,10 @@ json_begin_object(struct json_writer* writer)
 {
     json_value_start(writer);
     json_push_context(writer, OBJECT_EMPTY);
-    json_emitc(writer, '{');
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emitc(writer, '{');
+    else
+        cbor_emit_indefinite(writer, CBOR_MAP);
 }
 
 void
@@ -200,14 +469,16 @@ json_end_object(struct json_writer* writer)
 {
     json_check_state(writer, OBJECT_EMPTY | OBJECT_NONEMPTY);
     json_pop_context(writer);
-    json_emitc(writer, '}');
+    json_emitc(writer, writer->format == JSON_FORMAT_TEXT ? '}' : CBOR_BREAK);
     json_value_end(writer);
 }
 
 static void
 json_emit_ascii(struct json_writer* writer, uint8_t c)
 {
-    if (c == '"' || c == '\\') {
+    if (writer->format != JSON_FORMAT_TEXT) {
+        json_emit_string_byte(writer, c);
+    } else if (c == '"' || c == '\\') {
         json_emitc(writer, '\\');
         json_emitc(writer, c);
     } else if (c == '\n') {
@@ -236,7 +507,14 @@ json_bad_utf8(struct json_writer* writer)
         case JSON_WRITER_BAD_UTF8_DIE:
             die(EINVAL, "invalid UTF-8 sequence");
         case JSON_WRITER_BAD_UTF8_REPLACE:
-            json_emits(writer, writer->config.bad_utf8_replacement);
+            if (writer->format == JSON_FORMAT_TEXT) {
+                json_emits(writer, writer->config.bad_utf8_replacement);
+            } else {
+                // U+FFFD REPLACEMENT CHARACTER
+                json_emit_string_byte(writer, 0xEF);
+                json_emit_string_byte(writer, 0xBF);
+                json_emit_string_byte(writer, 0xBD);
+            }
             break;
     }
 }
@@ -248,6 +526,20 @@ json_emit_string_part(struct json_writer* writer,
 {
     json_check_state(writer, STRING);
     for (size_t i = 0; i < n; ++i) {
+        // Between sequences, copy whatever is valid UTF-8 and needs
+        // no escaping in bulk, leaving everything else to the DFA
+        // below one byte at a time.
+        while (writer->utf8_bufsz == 0 && i < n) {
+            const uint8_t* pos = (const uint8_t*) s + i;
+            size_t plain = utf8_valid_prefix(
+                pos, json_plain_prefix(pos, n - i));
+            if (plain == 0)
+                break;
+            json_emit_string_bytes(writer, pos, plain);
+            i += plain;
+        }
+        if (i == n)
+            break;
         uint8_t c = s[i];
         assert(writer->utf8_bufsz < sizeof (writer->utf8_buf));
         writer->utf8_buf[writer->utf8_bufsz++] = c;
@@ -256,9 +548,9 @@ json_emit_string_part(struct json_writer* writer,
                 if (writer->utf8_bufsz == 1) {
                     json_emit_ascii(writer, c);
                 } else {
-                    for (uint8_t j = 0; j < writer->utf8_bufsz; ++j) {
-                        json_emitc(writer, writer->utf8_buf[j]);
-                    }
+                    json_emit_string_bytes(writer,
+                                           writer->utf8_buf,
+                                           writer->utf8_bufsz);
                 }
                 writer->utf8_bufsz = 0;
                 writer->utf8_state = UTF8_ACCEPT;
@@ -286,7 +578,9 @@ static void
 json_begin_string_no_check(struct json_writer* writer)
 {
     json_push_context(writer, STRING);
-    json_emitc(writer, '"');
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emitc(writer, '"');
+    writer->strbuf_used = 0;
     writer->utf8_state = UTF8_ACCEPT;
     writer->utf8_bufsz = 0;
 }
@@ -305,7 +599,12 @@ json_end_string(struct json_writer* writer)
     if (writer->utf8_state != UTF8_ACCEPT)
         json_bad_utf8(writer);
     json_pop_context(writer);
-    json_emitc(writer, '"');
+    if (writer->format == JSON_FORMAT_TEXT) {
+        json_emitc(writer, '"');
+    } else {
+        cbor_emit_head(writer, CBOR_TEXT, writer->strbuf_used);
+        json_emit_bytes(writer, writer->strbuf, writer->strbuf_used);
+    }
     json_value_end(writer);
 }
 
@@ -313,14 +612,17 @@ void
 json_begin_field(struct json_writer* writer, const char* name)
 {
     json_check_state(writer, OBJECT_EMPTY | OBJECT_NONEMPTY);
-    if (json_writer_state(writer) == OBJECT_NONEMPTY)
-        json_emitc(writer, ',');
-    else if (json_writer_state(writer) == OBJECT_EMPTY)
+    if (json_writer_state(writer) == OBJECT_NONEMPTY) {
+        if (writer->format == JSON_FORMAT_TEXT)
+            json_emitc(writer, ',');
+    } else if (json_writer_state(writer) == OBJECT_EMPTY) {
         writer->context->state = OBJECT_NONEMPTY;
+    }
     json_begin_string_no_check(writer);
     json_emit_string_part(writer, name, strlen(name));
     json_end_string(writer);
-    json_emitc(writer, ':');
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emitc(writer, ':');
     json_push_context(writer, VALUE);
 }
 
@@ -343,20 +645,36 @@ json_emit_string(struct json_writer* writer, const char* string)
 void
 json_emit_i64(struct json_writer* writer, int64_t number)
 {
-    char buf[sizeof ("-18446744073709551616")];
-    sprintf(buf, "%lld", (long long) number);
     json_value_start(writer);
-    json_emits(writer, buf);
+    if (writer->format == JSON_FORMAT_TEXT) {
+        char buf[sizeof ("-18446744073709551616")];
+        char* end = buf + sizeof (buf);
+        // Negate in unsigned arithmetic so that INT64_MIN works.
+        char* start = json_format_u64(
+            end, number < 0 ? -(uint64_t) number : (uint64_t) number);
+        if (number < 0)
+            *--start = '-';
+        json_emit_bytes(writer, start, end - start);
+    } else if (number < 0) {
+        cbor_emit_head(writer, CBOR_NEGINT, (uint64_t) -(number + 1));
+    } else {
+        cbor_emit_head(writer, CBOR_UINT, (uint64_t) number);
+    }
     json_value_end(writer);
 }
 
 void
 json_emit_u64(struct json_writer* writer, uint64_t number)
 {
-    char buf[sizeof ("18446744073709551615")];
-    sprintf(buf, "%llu", (unsigned long long) number);
     json_value_start(writer);
-    json_emits(writer, buf);
+    if (writer->format == JSON_FORMAT_TEXT) {
+        char buf[sizeof ("18446744073709551615")];
+        char* end = buf + sizeof (buf);
+        char* start = json_format_u64(end, number);
+        json_emit_bytes(writer, start, end - start);
+    } else {
+        cbor_emit_head(writer, CBOR_UINT, number);
+    }
     json_value_end(writer);
 }
 
@@ -364,7 +682,10 @@ void
 json_emit_null(struct json_writer* writer)
 {
     json_value_start(writer);
-    json_emits(writer, "null");
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emits(writer, "null");
+    else
+        json_emitc(writer, CBOR_NULL);
     json_value_end(writer);
 }
 
@@ -372,7 +693,10 @@ void
 json_emit_bool(struct json_writer* writer, bool b)
 {
     json_value_start(writer);
-    json_emits(writer, b ? "true" : "false");
+    if (writer->format == JSON_FORMAT_TEXT)
+        json_emits(writer, b ? "true" : "false");
+    else
+        json_emitc(writer, b ? CBOR_TRUE : CBOR_FALSE);
     json_value_end(writer);
 }
 
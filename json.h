@@ -25,7 +25,27 @@ struct json_writer_config {
     const char* bad_utf8_replacement;
 };
 
+// How a json_writer encodes what it writes.  JSON_FORMAT_CBOR writes
+// the same values as RFC 8949 CBOR, which is cheaper to produce and
+// to parse; fb-adb cbor-json turns it back into JSON.
+enum json_format {
+    JSON_FORMAT_TEXT,
+    JSON_FORMAT_CBOR,
+};
+
+// Parse the argument of a --format option.
+enum json_format json_format_from_name(const char* name);
+
 struct json_writer* json_writer_create(FILE* out);
+struct json_writer* json_writer_create_format(FILE* out,
+                                              enum json_format format);
+// Ready WRITER, which must not be in the middle of a value, to write
+// another one, so that a stream of values can share one writer.
+void json_writer_reset(struct json_writer* writer);
+
+// End one item of a stream of them: a newline for JSON and nothing
+// for CBOR, whose items delimit themselves.
+void json_end_record(struct json_writer* writer);
 struct json_writer_config json_writer_get_config(
     struct json_writer* writer);
 void json_writer_set_config(
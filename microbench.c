@@ -0,0 +1,485 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+#include "adbenc.h"
+#include "constants.h"
+#include "core.h"
+#include "fs.h"
+#include "json.h"
+#include "lz4.h"
+#include "proto.h"
+#include "ringbuf.h"
+
+// Microbenchmarks for the primitives on fb-adb's data path, run
+// without a device: fb-adb-microbench prints, for each, the time
+// and (where the CPU has a cheap cycle counter) the cycles it takes
+// per byte, and how many reslist allocations each operation makes.
+// The io loop is supposed to allocate nothing in the steady state,
+// so anything but zero for the pieces it uses is a bug.
+
+#if defined(__x86_64__) || defined(__i386__)
+# define HAVE_CYCLE_COUNTER 1
+static uint64_t
+read_cycle_counter(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+#endif
+
+// Run each benchmark for at least this long
+#define MICROBENCH_MIN_SECONDS 0.25
+
+typedef size_t (*microbench_fn)(void* data);
+
+static double
+microbench_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    return xclock_gettime(CLOCK_MONOTONIC);
+#else
+    return seconds_since_epoch();
+#endif
+}
+
+// Call FN, which does one operation on DATA and returns the number
+// of bytes it processed, until MICROBENCH_MIN_SECONDS pass, and
+// report the results as NAME.
+static void
+microbench_run(const char* name, microbench_fn fn, void* data)
+{
+    SCOPED_RESLIST(rl);
+    fn(data); // Warm caches and let lazy setup happen
+
+    unsigned iterations = 1;
+    for (;;) {
+        uint64_t allocs_before = nr_cleanups_allocated;
+#ifdef HAVE_CYCLE_COUNTER
+        uint64_t cycles_before = read_cycle_counter();
+#endif
+        double start = microbench_now();
+        uint64_t bytes = 0;
+        for (unsigned i = 0; i < iterations; ++i)
+            bytes += fn(data);
+        double elapsed = microbench_now() - start;
+#ifdef HAVE_CYCLE_COUNTER
+        uint64_t cycles = read_cycle_counter() - cycles_before;
+#endif
+        uint64_t allocs = nr_cleanups_allocated - allocs_before;
+
+        if (elapsed < MICROBENCH_MIN_SECONDS && iterations < (1U<<30)) {
+            iterations *= 2;
+            continue;
+        }
+
+        bytes = XMAX(bytes, 1);
+        xprintf(xstdout, "%-32s %10.3f", name, elapsed * 1e9 / bytes);
+#ifdef HAVE_CYCLE_COUNTER
+        xprintf(xstdout, " %12.3f", (double) cycles / bytes);
+#else
+        xprintf(xstdout, " %12s", "-");
+#endif
+        xprintf(xstdout, " %10.2f\n", (double) allocs / iterations);
+        xflush(xstdout);
+        return;
+    }
+}
+
+// Deterministic filler, so runs are comparable
+static uint32_t
+microbench_random(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Fill BUF with SZ bytes that look like logcat output: mostly ASCII,
+// with timestamps, tags, quotes, tabs, and the occasional bit of
+// UTF-8, so that JSON has something to escape and LZ4 finds matches.
+static void
+fill_log_like(char* buf, size_t sz)
+{
+    static const char* const tags[] = {
+        "ActivityManager", "PackageManager", "chatty", "WifiService",
+    };
+    static const char* const texts[] = {
+        "Start proc %u:com.example.app/u0a%u for activity "
+        "{com.example.app/.MainActivity}",
+        "Displayed com.example.app/.Main: +%ums (total +%ums)",
+        "uid=%u(u0_a%u) \"RenderThread\"\tidentical 3 lines",
+        "Caf\xc3\xa9 \xe2\x9c\x93 %u/%u \\ done",
+    };
+
+    uint32_t rnd = 0x12345678;
+    size_t pos = 0;
+    while (pos < sz) {
+        char line[512];
+        unsigned which = microbench_random(&rnd) % ARRAYSIZE(texts);
+        char text[256];
+        snprintf(text, sizeof (text), texts[which],
+                 microbench_random(&rnd) % 30000,
+                 microbench_random(&rnd) % 1000);
+        int n = snprintf(line, sizeof (line),
+                         "10-14 09:%02u:%02u.%03u %5u %5u I %s: %s\n",
+                         microbench_random(&rnd) % 60,
+                         microbench_random(&rnd) % 60,
+                         microbench_random(&rnd) % 1000,
+                         microbench_random(&rnd) % 30000,
+                         microbench_random(&rnd) % 30000,
+                         tags[microbench_random(&rnd) % ARRAYSIZE(tags)],
+                         text);
+        size_t chunk = XMIN((size_t) n, sz - pos);
+        memcpy(buf + pos, line, chunk);
+        pos += chunk;
+    }
+}
+
+struct ringbuf_bench {
+    struct ringbuf* rb;
+    const char* src;
+    size_t chunk;
+    int fd;
+};
+
+// Each operation adds and removes a chunk whose size doesn't divide
+// the capacity, so the copies keep landing across the wrap point.
+// One byte stays behind so the buffer never empties and resets its
+// positions.
+static void
+ringbuf_bench_init(struct ringbuf_bench* rbb, int fd)
+{
+    rbb->rb = ringbuf_new(256 * 1024);
+    rbb->chunk = 48 * 1024 + 13;
+    rbb->src = xcalloc(rbb->chunk);
+    rbb->fd = fd;
+    ringbuf_copy_in(rbb->rb, "", 1);
+    ringbuf_note_added(rbb->rb, 1);
+}
+
+static size_t
+bench_ringbuf_copy_in(void* data)
+{
+    struct ringbuf_bench* rbb = data;
+    ringbuf_copy_in(rbb->rb, rbb->src, rbb->chunk);
+    ringbuf_note_added(rbb->rb, rbb->chunk);
+    ringbuf_note_removed(rbb->rb, rbb->chunk);
+    return rbb->chunk;
+}
+
+static size_t
+bench_ringbuf_read_in(void* data)
+{
+    struct ringbuf_bench* rbb = data;
+    size_t nr = ringbuf_read_in(rbb->rb, rbb->fd, rbb->chunk);
+    ringbuf_note_added(rbb->rb, nr);
+    ringbuf_note_removed(rbb->rb, nr);
+    return nr;
+}
+
+struct adbenc_bench {
+    const char* in;
+    size_t insz;
+    char* out;
+    size_t outsz;
+};
+
+static size_t
+bench_adb_encode(void* data)
+{
+    struct adbenc_bench* ab = data;
+    uint8_t state = 0;
+    char* enc = ab->out;
+    const char* in = ab->in;
+    adb_encode(&state, &enc, ab->out + ab->outsz, &in, ab->in + ab->insz);
+    return ab->insz;
+}
+
+static size_t
+bench_adb_decode(void* data)
+{
+    struct adbenc_bench* ab = data;
+    uint8_t state = 0;
+    char* dec = ab->out;
+    const char* in = ab->in;
+    adb_decode(&state, &dec, ab->out + ab->outsz, &in, ab->in + ab->insz);
+    return ab->insz;
+}
+
+// Benchmark encoding SZ bytes of IN, and decoding the result.
+static void
+microbench_adbenc(const char* kind, const char* in, size_t sz)
+{
+    SCOPED_RESLIST(rl);
+    struct adbenc_bench enc = {
+        .in = in,
+        .insz = sz,
+        .out = xalloc(2 * sz),
+        .outsz = 2 * sz,
+    };
+
+    microbench_run(xaprintf("adb_encode %s", kind), bench_adb_encode, &enc);
+
+    uint8_t state = 0;
+    char* encend = enc.out;
+    const char* inp = in;
+    adb_encode(&state, &encend, enc.out + enc.outsz, &inp, in + sz);
+    struct adbenc_bench dec = {
+        .in = enc.out,
+        .insz = encend - enc.out,
+        .out = xalloc(sz),
+        .outsz = sz,
+    };
+
+    microbench_run(xaprintf("adb_decode %s", kind), bench_adb_decode, &dec);
+}
+
+struct lz4_bench {
+    const char* src;
+    int srcsz;
+    char* dst;
+    int dstsz;
+};
+
+static size_t
+bench_lz4_compress(void* data)
+{
+    struct lz4_bench* lb = data;
+    for (int off = 0; off < lb->srcsz; off += MAX_COMPRESSION_BLOCK) {
+        int n = XMIN(lb->srcsz - off, MAX_COMPRESSION_BLOCK);
+        int ret = LZ4_compress_fast(lb->src + off, lb->dst, n, lb->dstsz, 1);
+        if (ret == 0)
+            die(EINVAL, "LZ4_compress_fast failed");
+    }
+    return lb->srcsz;
+}
+
+// SRC holds one compressed block of BLOCKSZ bytes at each
+// MAX_COMPRESSION_BLOCK offset, compressed to the size in the block's
+// first four bytes.
+static size_t
+bench_lz4_decompress(void* data)
+{
+    struct lz4_bench* lb = data;
+    size_t total = 0;
+    for (int off = 0; off < lb->srcsz; off += MAX_COMPRESSION_BLOCK) {
+        int csz;
+        memcpy(&csz, lb->src + off, sizeof (csz));
+        int ret = LZ4_decompress_safe(lb->src + off + sizeof (csz),
+                                      lb->dst, csz, lb->dstsz);
+        if (ret < 0)
+            die(EINVAL, "LZ4_decompress_safe failed");
+        total += ret;
+    }
+    return total;
+}
+
+// Compress and decompress log-like data in blocks of BLOCKSZ bytes,
+// the way xmit_data_lz4 and its receiving side do.
+static void
+microbench_lz4(const char* log, size_t logsz, int blocksz)
+{
+    SCOPED_RESLIST(rl);
+    int bound = LZ4_compressBound(blocksz);
+    struct lz4_bench comp = {
+        .src = log,
+        .srcsz = blocksz,
+        .dst = xalloc(bound),
+        .dstsz = bound,
+    };
+
+    microbench_run(xaprintf("lz4 compress %dB blocks", blocksz),
+                   bench_lz4_compress, &comp);
+
+    // Lay out compressed blocks covering LOG, one per
+    // MAX_COMPRESSION_BLOCK, so decompression doesn't just keep
+    // hitting the same few cache lines.
+    unsigned nr_blocks = logsz / MAX_COMPRESSION_BLOCK;
+    char* packed = xalloc(nr_blocks * MAX_COMPRESSION_BLOCK);
+    for (unsigned i = 0; i < nr_blocks; ++i) {
+        char* slot = packed + i * MAX_COMPRESSION_BLOCK;
+        int csz = LZ4_compress_fast(log + i * MAX_COMPRESSION_BLOCK,
+                                    slot + sizeof (csz),
+                                    blocksz,
+                                    MAX_COMPRESSION_BLOCK - sizeof (csz),
+                                    1);
+        if (csz == 0)
+            die(EINVAL, "LZ4_compress_fast failed");
+        memcpy(slot, &csz, sizeof (csz));
+    }
+
+    struct lz4_bench decomp = {
+        .src = packed,
+        .srcsz = nr_blocks * MAX_COMPRESSION_BLOCK,
+        .dst = xalloc(blocksz),
+        .dstsz = blocksz,
+    };
+
+    microbench_run(xaprintf("lz4 decompress %dB blocks", blocksz),
+                   bench_lz4_decompress, &decomp);
+}
+
+// The ring is full of back-to-back data messages and its capacity is
+// a multiple of their size, so putting a parsed message back leaves
+// the same message at the end of the buffer.
+#define DETECT_MSG_SIZE 128
+
+static size_t
+bench_detect_msg(void* data)
+{
+    struct ringbuf* rb = data;
+    struct msg mhdr;
+    if (!detect_msg(rb, &mhdr))
+        die(EINVAL, "detect_msg found no message");
+    ringbuf_note_removed(rb, mhdr.size);
+    ringbuf_note_added(rb, mhdr.size);
+    return mhdr.size;
+}
+
+static void
+microbench_detect_msg(void)
+{
+    SCOPED_RESLIST(rl);
+    struct ringbuf* rb = ringbuf_new(64 * 1024);
+    char buf[DETECT_MSG_SIZE];
+    memset(buf, 'x', sizeof (buf));
+    struct msg_channel_data m;
+    memset(&m, 0, sizeof (m));
+    m.msg.type = MSG_CHANNEL_DATA;
+    m.msg.size = sizeof (buf);
+    m.channel = NR_SPECIAL_CH + 1;
+    memcpy(buf, &m, sizeof (m));
+    while (ringbuf_room(rb) >= sizeof (buf)) {
+        ringbuf_copy_in(rb, buf, sizeof (buf));
+        ringbuf_note_added(rb, sizeof (buf));
+    }
+
+    microbench_run("detect_msg", bench_detect_msg, rb);
+}
+
+struct json_bench {
+    struct json_writer* writer;
+    const char* log;
+    size_t logsz;
+};
+
+// Emit each line of the log as a JSON string, as logcat-json does.
+static size_t
+bench_json_emit_string(void* data)
+{
+    struct json_bench* jb = data;
+    const char* p = jb->log;
+    const char* end = jb->log + jb->logsz;
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        size_t n = nl ? (size_t) (nl - p) : (size_t) (end - p);
+        json_emit_string_n(jb->writer, p, n);
+        p += n + (nl != NULL);
+    }
+    return jb->logsz;
+}
+
+static void
+microbench_json(const char* log)
+{
+    SCOPED_RESLIST(rl);
+    FILE* devnull = xfdopen(
+        xopen("/dev/null", O_WRONLY | O_CLOEXEC, 0), "w");
+    struct json_bench jb = {
+        .writer = json_writer_create(devnull),
+        .log = log,
+        .logsz = 16 * 1024,
+    };
+
+    json_begin_array(jb.writer);
+    microbench_run("json_emit_string_n log lines",
+                   bench_json_emit_string, &jb);
+}
+
+struct sha256_bench {
+    int fd;
+    size_t size;
+};
+
+static size_t
+bench_sha256_fd(void* data)
+{
+    struct sha256_bench* sb = data;
+    if (lseek(sb->fd, 0, SEEK_SET) == -1)
+        die_errno("lseek");
+    sha256_fd(sb->fd);
+    return sb->size;
+}
+
+static void
+microbench_sha256(const char* log, size_t logsz)
+{
+    SCOPED_RESLIST(rl);
+    const char* name;
+    struct sha256_bench sb = {
+        .fd = xnamed_tempfile(&name),
+        .size = logsz,
+    };
+
+    write_all(sb.fd, log, logsz);
+    microbench_run("sha256_fd", bench_sha256_fd, &sb);
+}
+
+int
+real_main(int argc, char** argv)
+{
+    size_t logsz = 4 * 1024 * 1024;
+    char* log = xalloc(logsz);
+    fill_log_like(log, logsz);
+
+    xprintf(xstdout, "%-32s %10s %12s %10s\n",
+            "benchmark", "ns/byte", "cycles/byte", "allocs/op");
+
+    struct ringbuf_bench rbb;
+    ringbuf_bench_init(&rbb, xopen("/dev/zero", O_RDONLY | O_CLOEXEC, 0));
+    microbench_run("ringbuf_copy_in wrapping",
+                   bench_ringbuf_copy_in, &rbb);
+    microbench_run("ringbuf_read_in /dev/zero",
+                   bench_ringbuf_read_in, &rbb);
+
+    // Clean data has no escape bytes; adversarial data is nothing but.
+    size_t adbsz = 64 * 1024;
+    char* clean = xalloc(adbsz);
+    uint32_t rnd = 0xdeadbeef;
+    for (size_t i = 0; i < adbsz; ++i) {
+        do {
+            clean[i] = (char) microbench_random(&rnd);
+        } while (clean[i] == '~' || clean[i] == '!');
+    }
+    char* adversarial = xalloc(adbsz);
+    for (size_t i = 0; i < adbsz; ++i)
+        adversarial[i] = (i % 3) ? '~' : '!';
+
+    microbench_adbenc("clean", clean, adbsz);
+    microbench_adbenc("adversarial", adversarial, adbsz);
+
+    static const int lz4_block_sizes[] = {
+        1024, 4096, 16384, MAX_COMPRESSION_BLOCK
+    };
+    for (unsigned i = 0; i < ARRAYSIZE(lz4_block_sizes); ++i)
+        microbench_lz4(log, logsz, lz4_block_sizes[i]);
+
+    microbench_detect_msg();
+    microbench_json(log);
+    microbench_sha256(log, logsz);
+    return 0;
+}
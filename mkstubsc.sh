@@ -10,10 +10,12 @@
 
 #
 # This file takes a list of stub names on its command line and
-# writes to stdout the contents of the corresponding stubs.c.
+# writes to stdout the contents of the corresponding stubs.c.  We
+# store each stub as a single LZ4 block, compressed with $MKSTUBZ.
 #
 set -euo pipefail
 : ${XXD=xxd}
+: ${MKSTUBZ=./mkstubz}
 
 cat <<EOF
 #include <stdint.h>
@@ -25,7 +27,7 @@ for stub in "$@"; do
     cname=${stub%/stub}
     cname=${cname//-/_}
     printf 'static const uint8_t %s[] = {\n' "$cname"
-    $XXD -i < $stub
+    $MKSTUBZ < $stub | $XXD -i
     printf '};\n\n'
 done
 
@@ -33,7 +35,8 @@ printf 'const struct fbadb_stub stubs[] = {\n'
 for stub in "$@"; do
     cname=${stub%/stub}
     cname=${cname//-/_}
-    printf '  { %s, sizeof(%s) },\n' "$cname" "$cname"
+    size=$(wc -c < $stub)
+    printf '  { %s, sizeof(%s), %s },\n' "$cname" "$cname" $size
 done
 printf '};\n\n'
 printf 'const size_t nr_stubs=%s;\n' $#
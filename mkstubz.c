@@ -0,0 +1,73 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+// Build-time helper for mkstubsc.sh: compress stdin into a single LZ4
+// block on stdout, which is how we embed the stubs in fb-adb.  This
+// program runs on the build machine only, so it deliberately uses
+// nothing but stdio and the LZ4 we ship.
+
+int
+main(int argc, char** argv)
+{
+    size_t alloc = 1024 * 1024;
+    size_t size = 0;
+    char* buf = malloc(alloc);
+
+    for (;;) {
+        if (buf == NULL) {
+            perror("malloc");
+            return 1;
+        }
+
+        size_t nr = fread(buf + size, 1, alloc - size, stdin);
+        size += nr;
+        if (size < alloc)
+            break;
+        alloc *= 2;
+        buf = realloc(buf, alloc);
+    }
+
+    if (ferror(stdin)) {
+        perror("read");
+        return 1;
+    }
+
+    if (size > LZ4_MAX_INPUT_SIZE) {
+        fprintf(stderr, "%s: input too large\n", argv[0]);
+        return 1;
+    }
+
+    int zalloc = LZ4_compressBound((int) size);
+    char* zbuf = malloc(zalloc);
+    if (zbuf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int zsize = LZ4_compress_default(buf, zbuf, (int) size, zalloc);
+    if (zsize <= 0) {
+        fprintf(stderr, "%s: compression failed\n", argv[0]);
+        return 1;
+    }
+
+    if (fwrite(zbuf, 1, zsize, stdout) != (size_t) zsize ||
+        fflush(stdout) != 0)
+    {
+        perror("write");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,518 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "mux.h"
+#include "util.h"
+#include "core.h"
+#include "channel.h"
+#include "ringbuf.h"
+#include "child.h"
+#include "argv.h"
+#include "constants.h"
+#include "fs.h"
+#include "net.h"
+
+struct mux_session {
+    struct reslist* rl; // Owns the session's channels and stub
+    unsigned open : 1;
+    unsigned peer_closed : 1; // Host: got MSG_SESSION_CLOSED
+    unsigned shut_wr : 1;     // Passed the peer's EOF along
+    unsigned socket : 1;      // Device: relaying a socket, not a stub
+};
+
+struct mux {
+    struct fb_adb_sh sh;
+    struct reslist* rl;
+    bool stub;
+    size_t session_bufsz;
+    unsigned max_sessions;
+    unsigned nr_sessions;
+    struct mux_session* sessions;
+    // Unused sessions' channel slots point at these, one per
+    // direction.  They're dead, so the io loop leaves them alone, and
+    // messages still in flight for a session that just closed
+    // fall on the floor.
+    struct channel* idle[2];
+};
+
+// Session SESSNO's UP channel carries bytes from the host to the
+// device and its DOWN channel carries them back.
+static unsigned
+mux_up_chno(unsigned sessno)
+{
+    return NR_SPECIAL_CH + 1 + 2 * sessno;
+}
+
+static unsigned
+mux_down_chno(unsigned sessno)
+{
+    return mux_up_chno(sessno) + 1;
+}
+
+static struct channel*
+idle_channel_new(enum channel_direction dir)
+{
+    struct channel* c = channel_new(NULL, 1, dir);
+    c->sent_eof = true;
+    return c;
+}
+
+// Give session SESSNO channels reading FROM and writing TO.  Called
+// with the session's reslist current.
+static void
+mux_session_attach(struct mux* mux,
+                   unsigned sessno,
+                   struct fdh* from,
+                   struct fdh* to)
+{
+    struct fb_adb_sh* sh = &mux->sh;
+
+    struct channel* in = channel_new(from, mux->session_bufsz,
+                                     CHANNEL_FROM_FD);
+    in->track_window = true;
+
+    struct channel* out = channel_new(to, mux->session_bufsz,
+                                      CHANNEL_TO_FD);
+    out->track_bytes_written = true;
+    out->bytes_written =
+        XMIN(ringbuf_room(out->rb), INITIAL_CHANNEL_WINDOW);
+
+    unsigned up_chno = mux_up_chno(sessno);
+    unsigned down_chno = mux_down_chno(sessno);
+    unsigned in_chno = mux->stub ? down_chno : up_chno;
+    unsigned out_chno = mux->stub ? up_chno : down_chno;
+    sh->ch[in_chno] = in;
+    sh->ch[out_chno] = out;
+    io_loop_init_channel(sh, in_chno);
+    io_loop_init_channel(sh, out_chno);
+}
+
+static void
+mux_session_free(struct mux* mux, unsigned sessno)
+{
+    struct fb_adb_sh* sh = &mux->sh;
+    struct mux_session* sess = &mux->sessions[sessno];
+    unsigned up_chno = mux_up_chno(sessno);
+    unsigned down_chno = mux_down_chno(sessno);
+
+    dbg("mux: session %u finished", sessno);
+    sh->ch[up_chno] = mux->idle[sh->ch[up_chno]->dir];
+    sh->ch[down_chno] = mux->idle[sh->ch[down_chno]->dir];
+    reslist_destroy(sess->rl);
+    memset(sess, 0, sizeof (*sess));
+    mux->nr_sessions -= 1;
+}
+
+// Drop whatever C has buffered for a peer that won't take it.
+static void
+mux_discard_unsent(struct channel* c)
+{
+    assert(c->dir == CHANNEL_FROM_FD);
+    ringbuf_note_removed(c->rb, ringbuf_size(c->rb));
+}
+
+static struct mux_session*
+mux_session_for_msg(struct mux* mux, unsigned sessno)
+{
+    if (sessno >= mux->max_sessions)
+        die(ECOMM, "mux: invalid session %u", sessno);
+    return &mux->sessions[sessno];
+}
+
+struct start_session_stub_ctx {
+    struct mux* mux;
+    unsigned sessno;
+};
+
+static void
+start_session_stub_1(void* data)
+{
+    struct start_session_stub_ctx* ctx = data;
+    struct child_start_info csi = {
+        .io[STDIN_FILENO] = CHILD_IO_PIPE,
+        .io[STDOUT_FILENO] = CHILD_IO_PIPE,
+        .io[STDERR_FILENO] = CHILD_IO_DUP_TO_STDOUT,
+        .exename = my_exe(),
+        .argv = ARGV(orig_argv0, "stub"),
+    };
+
+    struct child* stub = child_start(&csi);
+    mux_session_attach(ctx->mux,
+                       ctx->sessno,
+                       stub->fd[STDOUT_FILENO],
+                       stub->fd[STDIN_FILENO]);
+}
+
+struct connect_session_socket_ctx {
+    struct mux* mux;
+    const struct msg_session_connect* m;
+};
+
+static void
+connect_session_socket_1(void* data)
+{
+    struct connect_session_socket_ctx* ctx = data;
+    const struct msg_session_connect* m = ctx->m;
+    int sock;
+    if (m->port != 0) {
+        sock = xsocket(AF_INET, SOCK_STREAM, 0);
+        struct addr addr;
+        memset(&addr, 0, sizeof (addr));
+        addr.size = sizeof (addr.addr_in);
+        addr.addr_in.sin_family = AF_INET;
+        addr.addr_in.sin_port = htons(m->port);
+        addr.addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        xconnect(sock, &addr);
+        disable_tcp_nagle(sock);
+    } else {
+        sock = xsocket(AF_UNIX, SOCK_STREAM, 0);
+        xconnect(sock, make_addr_unix_abstract(
+                     m->socket, strnlen(m->socket, sizeof (m->socket))));
+    }
+
+    mux_session_attach(ctx->mux, m->session, fdh_dup(sock), fdh_dup(sock));
+}
+
+// Open session SESSNO at the device end.  If CONNECT is NULL, run
+// a stub for it; otherwise, connect it as CONNECT says.
+static void
+mux_stub_open_session(struct mux* mux,
+                      unsigned sessno,
+                      const struct msg_session_connect* connect)
+{
+    struct mux_session* sess = mux_session_for_msg(mux, sessno);
+    if (sess->open)
+        die(ECOMM, "mux: session %u already open", sessno);
+
+    sess->open = true;
+    sess->socket = (connect != NULL);
+    mux->nr_sessions += 1;
+    WITH_CURRENT_RESLIST(mux->rl);
+    sess->rl = reslist_create();
+    WITH_CURRENT_RESLIST(sess->rl);
+
+    // If we can't start the stub or connect, the session's channels
+    // stay idle and mux_retire_sessions reports it closed.  The
+    // client sees its connection close without a hello.
+    struct errinfo ei = ERRINFO_WANT_MSG_IF_DEBUG;
+    bool failed;
+    if (connect != NULL) {
+        struct connect_session_socket_ctx ctx = {
+            .mux = mux,
+            .m = connect,
+        };
+        failed = catch_error(connect_session_socket_1, &ctx, &ei);
+    } else {
+        struct start_session_stub_ctx ctx = {
+            .mux = mux,
+            .sessno = sessno,
+        };
+        failed = catch_error(start_session_stub_1, &ctx, &ei);
+    }
+
+    if (failed)
+        dbg("mux: could not open session %u: %s", sessno, ei.msg);
+    else
+        dbg("mux: session %u open", sessno);
+}
+
+static void
+mux_process_msg(struct fb_adb_sh* sh, struct msg mhdr)
+{
+    struct mux* mux = (struct mux*) sh;
+
+    if (mhdr.type == MSG_SESSION_OPEN && mux->stub) {
+        struct msg_session_open m;
+        read_cmdmsg(sh, mhdr, &m, sizeof (m));
+        dbgmsg(&m.msg, "recv");
+        mux_stub_open_session(mux, m.session, NULL);
+        return;
+    }
+
+    if (mhdr.type == MSG_SESSION_CONNECT && mux->stub) {
+        struct msg_session_connect m;
+        read_cmdmsg(sh, mhdr, &m, sizeof (m));
+        dbgmsg(&m.msg, "recv");
+        mux_stub_open_session(mux, m.session, &m);
+        return;
+    }
+
+    if (mhdr.type == MSG_SESSION_CLOSED && !mux->stub) {
+        struct msg_session_closed m;
+        read_cmdmsg(sh, mhdr, &m, sizeof (m));
+        dbgmsg(&m.msg, "recv");
+        struct mux_session* sess = mux_session_for_msg(mux, m.session);
+        if (!sess->open)
+            die(ECOMM, "mux: session %u not open", (unsigned) m.session);
+        sess->peer_closed = true;
+        return;
+    }
+
+    fb_adb_sh_process_msg(sh, mhdr);
+}
+
+struct mux*
+mux_new(const struct mux_info* info)
+{
+    if (info->max_sessions == 0 ||
+        mux_down_chno(info->max_sessions - 1) > UINT16_MAX)
+    {
+        die(EINVAL, "mux: bad session count %u", info->max_sessions);
+    }
+
+    struct mux* mux = xcalloc(sizeof (*mux));
+    mux->rl = reslist_create();
+    mux->stub = info->stub;
+    mux->session_bufsz = info->session_bufsz;
+    mux->max_sessions = info->max_sessions;
+    mux->sessions = xcalloc(sizeof (*mux->sessions) * info->max_sessions);
+    mux->idle[CHANNEL_TO_FD] = idle_channel_new(CHANNEL_TO_FD);
+    mux->idle[CHANNEL_FROM_FD] = idle_channel_new(CHANNEL_FROM_FD);
+
+    struct fb_adb_sh* sh = &mux->sh;
+    sh->max_outgoing_msg = info->maxmsg;
+    sh->max_outgoing_jumbo = info->maxjumbo;
+    sh->process_msg = mux_process_msg;
+    sh->nrch = mux_down_chno(info->max_sessions - 1) + 1;
+    sh->ch = xalloc(sh->nrch * sizeof (*sh->ch));
+
+    struct channel** ch = sh->ch;
+    ch[FROM_PEER] = channel_new(info->from_peer,
+                                info->recv_bufsz,
+                                CHANNEL_FROM_FD);
+    ch[FROM_PEER]->window = UINT32_MAX;
+    ch[TO_PEER] = channel_new(info->to_peer,
+                              info->send_bufsz,
+                              CHANNEL_TO_FD);
+    ch[TO_PEER]->always_buffer = true; // See comment in cmd_shex.c
+
+    // The adb encoding hack applies to whatever travels
+    // host-to-device.
+    if (info->stub)
+        ch[FROM_PEER]->adb_encoding_hack = info->adb_encoding_hack;
+    else
+        ch[TO_PEER]->adb_encoding_hack = info->adb_encoding_hack;
+
+    for (unsigned sessno = 0; sessno < info->max_sessions; ++sessno) {
+        enum channel_direction up_dir =
+            info->stub ? CHANNEL_TO_FD : CHANNEL_FROM_FD;
+        enum channel_direction down_dir =
+            info->stub ? CHANNEL_FROM_FD : CHANNEL_TO_FD;
+        ch[mux_up_chno(sessno)] = mux->idle[up_dir];
+        ch[mux_down_chno(sessno)] = mux->idle[down_dir];
+    }
+
+    io_loop_init(sh);
+    return mux;
+}
+
+static int
+mux_find_free_session(const struct mux* mux)
+{
+    for (unsigned sessno = 0; sessno < mux->max_sessions; ++sessno)
+        if (!mux->sessions[sessno].open)
+            return sessno;
+    return -1;
+}
+
+// Start session SESSNO on FD once the device has heard about it
+// from OPEN_MSG.
+static void
+mux_host_start_session(struct mux* mux,
+                       unsigned sessno,
+                       int fd,
+                       struct msg* open_msg)
+{
+    // The device must hear about the session before it sees our
+    // window credit for it.
+    queue_message_synch(&mux->sh, open_msg);
+
+    struct mux_session* sess = &mux->sessions[sessno];
+    sess->open = true;
+    mux->nr_sessions += 1;
+    WITH_CURRENT_RESLIST(mux->rl);
+    sess->rl = reslist_create();
+    WITH_CURRENT_RESLIST(sess->rl);
+    mux_session_attach(mux, sessno, fdh_dup(fd), fdh_dup(fd));
+    dbg("mux: session %u open on fd %d", sessno, fd);
+    io_loop_pump(&mux->sh);
+}
+
+bool
+mux_open_session(struct mux* mux, int fd)
+{
+    assert(!mux->stub);
+    int sessno = mux_find_free_session(mux);
+    if (sessno == -1)
+        return false;
+
+    struct msg_session_open m = {
+        .msg.type = MSG_SESSION_OPEN,
+        .msg.size = sizeof (m),
+        .session = sessno,
+    };
+    mux_host_start_session(mux, sessno, fd, &m.msg);
+    return true;
+}
+
+bool
+mux_connect_session(struct mux* mux,
+                    int fd,
+                    unsigned port,
+                    const char* socket_name)
+{
+    assert(!mux->stub);
+    int sessno = mux_find_free_session(mux);
+    if (sessno == -1)
+        return false;
+
+    struct msg_session_connect m = {
+        .msg.type = MSG_SESSION_CONNECT,
+        .msg.size = sizeof (m),
+        .session = sessno,
+        .port = port,
+    };
+    if (port == 0) {
+        if (strlen(socket_name) > sizeof (m.socket))
+            die(EINVAL, "socket name too long: %s", socket_name);
+        strncpy(m.socket, socket_name, sizeof (m.socket));
+    }
+    mux_host_start_session(mux, sessno, fd, &m.msg);
+    return true;
+}
+
+unsigned
+mux_nr_sessions(const struct mux* mux)
+{
+    return mux->nr_sessions;
+}
+
+bool
+mux_peer_dead_p(const struct mux* mux)
+{
+    struct channel** ch = mux->sh.ch;
+    return channel_dead_p(ch[FROM_PEER]) || channel_dead_p(ch[TO_PEER]);
+}
+
+// The device end retires a session once its stub is done with both
+// pipes and then tells the host, which retires the session once it's
+// flushed what it had for its client.  Each end's last word about
+// the session precedes the MSG_SESSION_CLOSED or MSG_SESSION_OPEN
+// behind it, so no stale data reaches a new session using the
+// same number.
+static void
+mux_retire_sessions(struct mux* mux)
+{
+    struct fb_adb_sh* sh = &mux->sh;
+    for (unsigned sessno = 0; sessno < mux->max_sessions; ++sessno) {
+        struct mux_session* sess = &mux->sessions[sessno];
+        if (!sess->open)
+            continue;
+
+        struct channel* up = sh->ch[mux_up_chno(sessno)];
+        struct channel* down = sh->ch[mux_down_chno(sessno)];
+        struct channel* in = mux->stub ? down : up;
+
+        // A close from the peer means it's stopped giving us credit.
+        if (in->fdh == NULL && in->sent_eof)
+            mux_discard_unsent(in);
+
+        if (!mux->stub) {
+            if (sess->peer_closed) {
+                channel_close(up);
+                channel_close(down);
+                mux_discard_unsent(up);
+            }
+
+            // UP and DOWN share a socket, so closing DOWN doesn't
+            // tell the client anything.
+            if (!sess->shut_wr && down->fdh == NULL && up->fdh != NULL) {
+                (void) shutdown(up->fdh->fd, SHUT_WR);
+                sess->shut_wr = true;
+            }
+
+            if (sess->peer_closed &&
+                channel_dead_p(up) &&
+                channel_dead_p(down))
+            {
+                mux_session_free(mux, sessno);
+            }
+        } else {
+            // As on the host, UP and DOWN of a socket session share
+            // the socket.
+            if (sess->socket &&
+                !sess->shut_wr &&
+                up->fdh == NULL &&
+                down->fdh != NULL)
+            {
+                (void) shutdown(down->fdh->fd, SHUT_WR);
+                sess->shut_wr = true;
+            }
+
+            if (channel_dead_p(up) && channel_dead_p(down)) {
+                mux_session_free(mux, sessno);
+                struct msg_session_closed m = {
+                    .msg.type = MSG_SESSION_CLOSED,
+                    .msg.size = sizeof (m),
+                    .session = sessno,
+                };
+                queue_message_synch(sh, &m.msg);
+            }
+        }
+    }
+}
+
+bool
+mux_step(struct mux* mux, struct fdh* listen, unsigned timeout_ms)
+{
+    struct fb_adb_sh* sh = &mux->sh;
+    sh->listen_fdh = listen;
+    sh->poll_timeout_ms = timeout_ms;
+    io_loop_do_io(sh);
+    sh->listen_fdh = NULL;
+    sh->poll_timeout_ms = 0;
+    io_loop_pump(sh);
+    mux_retire_sessions(mux);
+    return listen != NULL && sh->listen_ready;
+}
+
+int
+mux_stub_main(const struct msg_mux_hello* hello)
+{
+    SCOPED_RESLIST(rl);
+
+    struct mux_info info = {
+        .from_peer = fdh_dup(STDIN_FILENO),
+        .to_peer = fdh_dup(STDOUT_FILENO),
+        .recv_bufsz = hello->stub_recv_bufsz,
+        .send_bufsz = hello->stub_send_bufsz,
+        .session_bufsz = hello->session_bufsz,
+        .maxmsg = hello->maxmsg,
+        .maxjumbo = hello->maxjumbo,
+        .max_sessions = hello->max_sessions,
+        .adb_encoding_hack = hello->adb_encoding_hack,
+        .stub = true,
+    };
+
+    struct mux* mux = mux_new(&info);
+    replace_stdin_stdout_with_dev_null();
+    dbg("mux: serving up to %u sessions", info.max_sessions);
+
+    io_loop_pump(&mux->sh);
+    while (!mux_peer_dead_p(mux))
+        (void) mux_step(mux, NULL, 0);
+
+    dbg("mux: peer disconnected with %u sessions open",
+        mux_nr_sessions(mux));
+    return 0;
+}
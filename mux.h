@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "proto.h"
+
+// A mux carries many independent fb-adb sessions over one peer
+// connection.  Each session is an ordinary fb-adb conversation (stub
+// hello line, MSG_SHEX_HELLO, channel traffic, and so on) between a
+// client on the host and a stub the device end of the mux starts for
+// it.  The mux itself just moves each session's bytes, using a pair
+// of channels per session so that every session gets its own flow
+// control and no session can stall another.
+//
+// The host end opens sessions with mux_open_session.  The device end
+// answers MSG_SESSION_OPEN by running a stub on a pair of pipes and
+// sends MSG_SESSION_CLOSED once that stub is done and both of the
+// session's channels are closed, after which the host may reuse the
+// session number.
+//
+// A session can instead relay a plain byte stream: the host end opens
+// it with mux_connect_session, and the device end answers
+// MSG_SESSION_CONNECT by connecting to a socket on the device and
+// closes the session once both directions of that socket are done.
+// fb-adb forward uses these sessions to tunnel connections.
+
+struct fdh;
+struct mux;
+
+struct mux_info {
+    struct fdh* from_peer;
+    struct fdh* to_peer;
+    size_t recv_bufsz;
+    size_t send_bufsz;
+    size_t session_bufsz;
+    size_t maxmsg;
+    size_t maxjumbo;
+    unsigned max_sessions;
+    bool adb_encoding_hack;
+    bool stub; // True at the device end
+};
+
+// Make a mux owned by the current reslist.
+struct mux* mux_new(const struct mux_info* info);
+
+// Start a session relaying the bytes of socket FD, which remains the
+// caller's, to a new stub on the device.  Return false if all
+// session numbers are in use.  Host end only.
+bool mux_open_session(struct mux* mux, int fd);
+
+// Like mux_open_session, but relay FD to TCP port PORT on the
+// device's loopback interface if PORT is nonzero and otherwise to
+// the abstract socket SOCKET_NAME.
+bool mux_connect_session(struct mux* mux,
+                         int fd,
+                         unsigned port,
+                         const char* socket_name);
+
+// Number of sessions that have not yet finished closing.
+unsigned mux_nr_sessions(const struct mux* mux);
+
+// Whether we've lost the peer connection.
+bool mux_peer_dead_p(const struct mux* mux);
+
+// Wait for IO and then move data, like io_loop_do_io followed by
+// io_loop_pump, and then retire finished sessions.  If LISTEN is not
+// NULL, also wake up when it becomes readable, and return whether it
+// did.  Wait at most TIMEOUT_MS milliseconds unless it's zero.
+bool mux_step(struct mux* mux, struct fdh* listen, unsigned timeout_ms);
+
+// Run the device end of a mux on our standard input and output
+// until the peer disconnects.
+int mux_stub_main(const struct msg_mux_hello* hello);
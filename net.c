@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -7,11 +8,18 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include "util.h"
 #include "net.h"
 #include "child.h"
 #include "fs.h"
 #include "fdrecorder.h"
+#include "constants.h"
+#include "sha2.h"
 
 #if defined(__linux__) && !defined(SOCK_CLOEXEC)
 # define SOCK_CLOEXEC O_CLOEXEC
@@ -317,6 +325,41 @@ disable_tcp_nagle(int fd)
     xsetsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 }
 
+char*
+tune_tcp_socket(int fd, unsigned bufsz)
+{
+    if (bufsz > INT_MAX)
+        bufsz = INT_MAX;
+
+    if (bufsz != 0) {
+        int v = (int) bufsz;
+        xsetsockopt(fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof (v));
+        xsetsockopt(fd, SOL_SOCKET, SO_RCVBUF, &v, sizeof (v));
+    }
+
+    const char* lowat = "unsupported";
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat_bytes = TCP_NOTSENT_LOWAT_BYTES;
+    // Old kernels lack the option even when the headers have it.
+    lowat = setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                       &lowat_bytes, sizeof (lowat_bytes)) == 0
+        ? xaprintf("%d", lowat_bytes)
+        : "unavailable";
+#endif
+
+    int sndbuf = 0;
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof (sndbuf);
+    (void) getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+    optlen = sizeof (rcvbuf);
+    (void) getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+
+    return xaprintf("sndbuf=%d rcvbuf=%d%s notsent_lowat=%s",
+                    sndbuf, rcvbuf,
+                    bufsz != 0 ? "" : " (autotuned)",
+                    lowat);
+}
+
 struct write_all_or_die {
     int fd;
     const void* buf;
@@ -356,20 +399,25 @@ write_blob(int fd, const void* data, size_t sz)
     write_all(fd, data, sz);
 }
 
+static void
+write_addrinfo(int fd, const struct addrinfo* ai)
+{
+    write_blob(fd, ai, sizeof (*ai));
+    write_blob(fd, ai->ai_addr, ai->ai_addrlen);
+    if (ai->ai_canonname)
+        write_blob(fd, ai->ai_canonname, strlen(ai->ai_canonname)+1);
+}
+
 static void
 xgai_preexec_1(void* data)
 {
     struct xgai* xa = data;
-    int fd = STDOUT_FILENO;
     for (struct addrinfo* ai =
              xgetaddrinfo(xa->node, xa->service, xa->hints);
          ai;
          ai = ai->ai_next)
     {
-        write_blob(fd, ai, sizeof (*ai));
-        write_blob(fd, ai->ai_addr, ai->ai_addrlen);
-        if (ai->ai_canonname)
-            write_blob(fd, ai->ai_canonname, strlen(ai->ai_canonname)+1);
+        write_addrinfo(STDOUT_FILENO, ai);
     }
 }
 
@@ -411,6 +459,37 @@ decode_blob(uint8_t** data_inout, size_t* sz_out, uint8_t* data_end)
     return blob;
 }
 
+// Decode what write_addrinfo wrote.  The addrinfo structures point
+// into the buffer.
+static struct addrinfo*
+decode_addrinfo_list(uint8_t* data, uint8_t* data_end)
+{
+    struct addrinfo* ai_list = NULL;
+    struct addrinfo** next = &ai_list;
+
+    while (data < data_end) {
+        struct addrinfo* ai;
+        size_t sz;
+
+        ai = decode_blob(&data, &sz, data_end);
+        if (sz != sizeof (*ai))
+            die(ECOMM, "gai protocol error");
+
+        ai->ai_addr = decode_blob(&data, &sz, data_end);
+        if (sz != ai->ai_addrlen)
+            die(ECOMM, "gai protocol error");
+
+        if (ai->ai_canonname)
+            ai->ai_canonname = decode_blob(&data, &sz, data_end);
+
+        *next = ai;
+        next = &ai->ai_next;
+    }
+
+    *next = NULL;
+    return ai_list;
+}
+
 struct addrinfo*
 xgetaddrinfo_interruptible(
     const char* node,
@@ -453,32 +532,265 @@ xgetaddrinfo_interruptible(
 
     // Subprocesses supposedly succeeded.  Read from the serialized
     // GAI information.
+    return decode_addrinfo_list((uint8_t*) out.buf,
+                                (uint8_t*) out.buf + out.bufsz);
+}
 
-    uint8_t* data = (uint8_t*) out.buf;
-    uint8_t* data_end = data + out.bufsz;
-    struct addrinfo* ai_list = NULL;
-    struct addrinfo** next = &ai_list;
+static const struct ttl_cache gai_cache = {
+    .subdir = "gai-cache",
+    .magic = "fbgai01",
+    .max_bytes = GAI_CACHE_MAX_BYTES,
+};
 
-    while (data < data_end) {
-        struct addrinfo* ai;
-        size_t sz;
+struct gai_cache_ctx {
+    const char* node;
+    const char* service;
+    const struct addrinfo* hints;
+    struct addrinfo* ai;
+    const struct addrinfo* preferred;
+};
 
-        ai = decode_blob(&data, &sz, data_end);
-        if (sz != sizeof (*ai))
-            die(ECOMM, "gai protocol error");
+static void
+gai_cache_hash_string(SHA256_CTX* sha256, const char* s)
+{
+    uint8_t present = (s != NULL);
+    SHA256_Update(sha256, &present, sizeof (present));
+    if (s != NULL)
+        SHA256_Update(sha256, (const uint8_t*) s, strlen(s) + 1);
+}
 
-        ai->ai_addr = decode_blob(&data, &sz, data_end);
-        if (sz != ai->ai_addrlen)
-            die(ECOMM, "gai protocol error");
+static const char*
+gai_cache_key(const struct gai_cache_ctx* ctx)
+{
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    gai_cache_hash_string(&sha256, ctx->node);
+    gai_cache_hash_string(&sha256, ctx->service);
+    int hints[] = {
+        ctx->hints->ai_flags,
+        ctx->hints->ai_family,
+        ctx->hints->ai_socktype,
+        ctx->hints->ai_protocol,
+    };
+    SHA256_Update(&sha256, (const uint8_t*) hints, sizeof (hints));
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &sha256);
+    return hex_encode_bytes(digest, sizeof (digest));
+}
 
-        if (ai->ai_canonname)
-            ai->ai_canonname = decode_blob(&data, &sz, data_end);
+static void
+gai_cache_lookup_1(void* data)
+{
+    struct gai_cache_ctx* ctx = data;
+    SCOPED_RESLIST(rl);
+    size_t size;
+    const char* body = ttl_cache_lookup(&gai_cache, gai_cache_key(ctx), &size);
+    if (body == NULL)
+        return;
+
+    WITH_CURRENT_RESLIST(rl->parent);
+    ctx->ai = decode_addrinfo_list((uint8_t*) body,
+                                   (uint8_t*) body + size);
+}
 
-        *next = ai;
-        next = &ai->ai_next;
+static void
+gai_cache_write_body(int fd, void* data)
+{
+    const struct gai_cache_ctx* ctx = data;
+    if (ctx->preferred != NULL)
+        write_addrinfo(fd, ctx->preferred);
+    for (const struct addrinfo* ai = ctx->ai; ai; ai = ai->ai_next)
+        if (ai != ctx->preferred)
+            write_addrinfo(fd, ai);
+}
+
+static void
+gai_cache_store(struct gai_cache_ctx* ctx)
+{
+    SCOPED_RESLIST(rl);
+    ttl_cache_store(&gai_cache,
+                    gai_cache_key(ctx),
+                    GAI_CACHE_TTL_S,
+                    gai_cache_write_body,
+                    ctx);
+}
+
+struct addrinfo*
+xgetaddrinfo_cached(
+    const char* node,
+    const char* service,
+    const struct addrinfo* hints)
+{
+    struct gai_cache_ctx ctx = {
+        .node = node,
+        .service = service,
+        .hints = hints,
+    };
+
+    // A record we can't decode is as good as no record.
+    if (catch_error(gai_cache_lookup_1, &ctx, NULL))
+        dbg("address cache lookup failed");
+    if (ctx.ai != NULL) {
+        dbg("address cache hit for %s:%s", node ?: "", service ?: "");
+        return ctx.ai;
     }
 
-    return ai_list;
+    ctx.ai = xgetaddrinfo_interruptible(node, service, hints);
+    gai_cache_store(&ctx);
+    return ctx.ai;
+}
+
+// Order AI_LIST the way RFC 8305 suggests we try it: alternate
+// between address families, starting with the family of the first
+// address.  Return the number of addresses we can try.
+static unsigned
+order_connect_attempts(const struct addrinfo* ai_list,
+                       const struct addrinfo*** out)
+{
+    unsigned nr = 0;
+    for (const struct addrinfo* ai = ai_list; ai; ai = ai->ai_next)
+        nr += 1;
+
+    const struct addrinfo** first = xalloc(nr * sizeof (*first));
+    const struct addrinfo** other = xalloc(nr * sizeof (*other));
+    unsigned nr_first = 0;
+    unsigned nr_other = 0;
+    for (const struct addrinfo* ai = ai_list; ai; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            continue;
+        if (nr_first == 0 || ai->ai_family == first[0]->ai_family)
+            first[nr_first++] = ai;
+        else
+            other[nr_other++] = ai;
+    }
+
+    const struct addrinfo** order = xalloc(nr * sizeof (*order));
+    unsigned nr_order = 0;
+    for (unsigned i = 0; i < nr_first || i < nr_other; ++i) {
+        if (i < nr_first)
+            order[nr_order++] = first[i];
+        if (i < nr_other)
+            order[nr_order++] = other[i];
+    }
+
+    *out = order;
+    return nr_order;
+}
+
+// Connect to one of the addresses in AI_LIST.  Start an attempt on
+// the next address every CONNECT_ATTEMPT_DELAY_MS until one connects,
+// so an address that's unreachable costs us a short delay instead of
+// a whole connect timeout.  Return the connected socket, owned by the
+// current reslist, and set *WINNER to the address it connected to.
+static int
+xconnect_staggered(const struct addrinfo* ai_list,
+                   const struct addrinfo** winner)
+{
+    SCOPED_RESLIST(rl);
+    const struct addrinfo** order;
+    unsigned nr = order_connect_attempts(ai_list, &order);
+    if (nr == 0)
+        die(ENOENT, "xgetaddrinfo returned no addresses");
+
+    struct pollfd* polls = xalloc(nr * sizeof (*polls));
+    const struct addrinfo** pending_ai = xalloc(nr * sizeof (*pending_ai));
+    unsigned nr_pending = 0;
+    unsigned next = 0;
+    double next_start = 0;
+    int err = ENOENT;
+    int sock = -1;
+
+    while (sock == -1) {
+        double now = xclock_gettime(CLOCK_MONOTONIC);
+        while (sock == -1 &&
+               next < nr &&
+               (nr_pending == 0 || now >= next_start))
+        {
+            const struct addrinfo* ai = order[next++];
+            int s = xsocket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            fd_set_blocking_mode(s, non_blocking);
+            dbg("connecting to %s", describe_addr(addrinfo2addr(ai)));
+            if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+                sock = s;
+                *winner = ai;
+            } else if (errno == EINPROGRESS || errno == EINTR) {
+                polls[nr_pending].fd = s;
+                polls[nr_pending].events = POLLOUT;
+                polls[nr_pending].revents = 0;
+                pending_ai[nr_pending++] = ai;
+                next_start = now + CONNECT_ATTEMPT_DELAY_MS / 1000.0;
+            } else {
+                err = errno;
+            }
+        }
+
+        if (sock != -1)
+            break;
+
+        if (nr_pending == 0) {
+            errno = err;
+            die_errno("connect");
+        }
+
+        int timeout = -1;
+        if (next < nr)
+            timeout = next_start > now
+                ? (int) ((next_start - now) * 1000) + 1
+                : 0;
+        if (xpoll(polls, nr_pending, timeout) == -1)
+            die_errno("poll");
+
+        for (unsigned i = 0; i < nr_pending && sock == -1;) {
+            if (polls[i].revents == 0) {
+                i += 1;
+                continue;
+            }
+
+            int soerr = 0;
+            socklen_t optlen = sizeof (soerr);
+            if (getsockopt(polls[i].fd, SOL_SOCKET, SO_ERROR,
+                           &soerr, &optlen) == -1)
+            {
+                soerr = errno;
+            }
+
+            if (soerr == 0) {
+                sock = polls[i].fd;
+                *winner = pending_ai[i];
+            } else {
+                dbg("connect to %s failed: %s",
+                    describe_addr(addrinfo2addr(pending_ai[i])),
+                    strerror(soerr));
+                err = soerr;
+                nr_pending -= 1;
+                polls[i] = polls[nr_pending];
+                pending_ai[i] = pending_ai[nr_pending];
+            }
+        }
+    }
+
+    fd_set_blocking_mode(sock, blocking);
+    WITH_CURRENT_RESLIST(rl->parent);
+    return xdup(sock);
+}
+
+int
+xconnect_host(const char* node,
+              const char* service,
+              const struct addrinfo* hints)
+{
+    struct gai_cache_ctx ctx = {
+        .node = node,
+        .service = service,
+        .hints = hints,
+        .ai = xgetaddrinfo_cached(node, service, hints),
+    };
+
+    int sock = xconnect_staggered(ctx.ai, &ctx.preferred);
+    if (ctx.preferred != ctx.ai)
+        gai_cache_store(&ctx);
+
+    return sock;
 }
 
 void
@@ -508,3 +820,103 @@ get_peer_credentials(int socketfd)
     return peer_credentials;
 }
 #endif
+
+#define MAX_PASSED_FDS 3
+
+void
+send_fds(int sock, const int* fds, unsigned nfds)
+{
+    assert(nfds > 0 && nfds <= MAX_PASSED_FDS);
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof (int))];
+    } control;
+    memset(&control, 0, sizeof (control));
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(nfds * sizeof (int)),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof (int));
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        die_errno("sendmsg");
+}
+
+void
+recv_fds(int sock, int* fds, unsigned nfds)
+{
+    assert(nfds > 0 && nfds <= MAX_PASSED_FDS);
+    struct cleanup* cl[MAX_PASSED_FDS];
+    for (unsigned i = 0; i < nfds; ++i)
+        cl[i] = cleanup_allocate();
+
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof (int))];
+    } control;
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof (control.buf),
+    };
+
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &mh, flags);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        die_errno("recvmsg");
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    unsigned nr_received = 0;
+    if (ret == 1 &&
+        cmsg != NULL &&
+        cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        nr_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+    }
+
+    // Take ownership of whatever arrived before checking it, so a
+    // short or oversized message doesn't leak descriptors.
+    int received[MAX_PASSED_FDS + 1];
+    nr_received = XMIN(nr_received, ARRAYSIZE(received));
+    if (nr_received > 0)
+        memcpy(received, CMSG_DATA(cmsg), nr_received * sizeof (int));
+    for (unsigned i = 0; i < nr_received; ++i) {
+        if (i < nfds)
+            cleanup_commit_close_fd(cl[i], received[i]);
+        else
+            (void) close(received[i]);
+#ifndef MSG_CMSG_CLOEXEC
+        if (i < nfds)
+            merge_O_CLOEXEC_into_fd_flags(received[i], O_CLOEXEC);
+#endif
+    }
+
+    if (nr_received != nfds || (mh.msg_flags & MSG_CTRUNC))
+        die(ECOMM, "expected %u passed file descriptors, got %u",
+            nfds, nr_received);
+
+    memcpy(fds, received, nfds * sizeof (int));
+}
@@ -47,6 +47,22 @@ struct addrinfo* xgetaddrinfo_interruptible(
     const char* service,
     const struct addrinfo* hints);
 
+// Like xgetaddrinfo_interruptible, but remember the answer for
+// GAI_CACHE_TTL_S seconds in a file under my_fb_adb_directory(), so
+// that commands against the same host don't each wait for a resolver.
+struct addrinfo* xgetaddrinfo_cached(
+    const char* node,
+    const char* service,
+    const struct addrinfo* hints);
+
+// Connect a stream socket to NODE and SERVICE, resolved with
+// xgetaddrinfo_cached.  We race staggered attempts against all the
+// addresses we find and remember the winner, which we try first next
+// time.  The socket is owned by the current reslist.
+int xconnect_host(const char* node,
+                  const char* service,
+                  const struct addrinfo* hints);
+
 struct addr* addrinfo2addr(const struct addrinfo* ai);
 
 void xconnect(int fd, const struct addr* addr);
@@ -76,8 +92,26 @@ void xsocketpair(int domain, int type, int protocol,
 void xsocketpairnc(int domain, int type, int protocol, int sv[2]);
 
 void disable_tcp_nagle(int fd);
+
+// Tune the TCP socket FD for bulk transfer.  If BUFSZ is non-zero,
+// ask for send and receive buffers of BUFSZ bytes instead of leaving
+// them to the kernel's autotuning; do that before connecting or
+// listening, since the kernel picks the window scale then.  Where
+// the system supports it, also limit the unsent data the kernel
+// holds, so more of it waits in our own buffers, where we can
+// coalesce and compress it.  Return a description of the settings
+// now in effect.
+char* tune_tcp_socket(int fd, unsigned bufsz);
 void xshutdown(int socketfd, int how);
 
 #ifdef SO_PEERCRED
 struct ucred get_peer_credentials(int socketfd);
 #endif
+
+// Send the NFDS file descriptors FDS over the unix socket SOCK along
+// with a single byte of ordinary data.
+void send_fds(int sock, const int* fds, unsigned nfds);
+
+// Receive exactly NFDS file descriptors sent with send_fds.
+// The descriptors are owned by the current reslist and close-on-exec.
+void recv_fds(int sock, int* fds, unsigned nfds);
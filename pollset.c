@@ -0,0 +1,544 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "pollset.h"
+#include "fs.h"
+
+#define POLLSET_EPOLL 1
+#define POLLSET_KQUEUE 2
+#define POLLSET_PPOLL 3
+
+#ifndef POLLSET
+# if defined(__linux__)
+#  define POLLSET POLLSET_EPOLL
+# elif defined(HAVE_KQUEUE)
+#  define POLLSET POLLSET_KQUEUE
+# else
+#  define POLLSET POLLSET_PPOLL
+# endif
+#endif
+
+#if POLLSET == POLLSET_EPOLL
+# include <sys/epoll.h>
+# include <sys/syscall.h>
+#elif POLLSET == POLLSET_KQUEUE
+# include <sys/event.h>
+# include <sys/time.h>
+#endif
+
+struct pollset_slot {
+    struct pollset* ps;
+    struct fdh* fdh;
+    // Lives in fdh's reslist and tells us when fdh goes away, which
+    // happens before fdh closes its file descriptor, so we
+    // can still deregister it.
+    struct cleanup* fdh_cl;
+    short events;
+    // We can't (or needn't) ask the kernel about this file
+    // descriptor, so just report it as ready whenever
+    // anyone asks.  poll(2) does the same thing for regular files.
+    bool always_ready;
+};
+
+struct pollset {
+    int kfd; // epoll or kqueue descriptor; -1 means use ppoll
+    bool signals_registered;
+    unsigned nr_slots;
+    struct pollset_slot* slots;
+};
+
+const char*
+pollset_backend_name(const struct pollset* ps)
+{
+    if (ps->kfd == -1)
+        return "ppoll";
+#if POLLSET == POLLSET_EPOLL
+    return "epoll";
+#elif POLLSET == POLLSET_KQUEUE
+    return "kqueue";
+#else
+    abort();
+#endif
+}
+
+static void
+pollset_fall_back_to_ppoll(struct pollset* ps, int err)
+{
+    dbg("%s pollset failed: %s: falling back to ppoll",
+        pollset_backend_name(ps), strerror(err));
+    // Closing the kernel object drops every registration at once.
+    close(ps->kfd);
+    ps->kfd = -1;
+}
+
+#if POLLSET == POLLSET_EPOLL
+static bool
+kernel_set_interest(struct pollset* ps,
+                    struct pollset_slot* slot,
+                    short old_events,
+                    short new_events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (ev));
+    ev.data.u32 = slot - ps->slots;
+    if (new_events & POLLIN)
+        ev.events |= EPOLLIN;
+    if (new_events & POLLOUT)
+        ev.events |= EPOLLOUT;
+
+    // Deregister idle slots instead of setting an empty event mask:
+    // epoll reports EPOLLHUP and EPOLLERR regardless of the mask, and
+    // we'd spin on a hung-up descriptor we don't currently care
+    // about.
+    int op;
+    if (old_events == 0)
+        op = EPOLL_CTL_ADD;
+    else if (new_events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    return epoll_ctl(ps->kfd, op, slot->fdh->fd, &ev) == 0;
+}
+
+static int
+kernel_wait(struct pollset* ps,
+            const sigset_t* sigmask,
+            int timeout_ms,
+            short* revents)
+{
+    struct epoll_event events[ps->nr_slots];
+
+    // Use the raw system call for the same reason xppoll does:
+    // older Bionic versions don't wrap it.
+    int nret = syscall(__NR_epoll_pwait,
+                       ps->kfd,
+                       events,
+                       (int) ps->nr_slots,
+                       timeout_ms,
+                       sigmask,
+                       _NSIG/8);
+    if (nret < 0)
+        return -1;
+
+    int nr_ready = 0;
+    for (int i = 0; i < nret; ++i) {
+        unsigned slotno = events[i].data.u32;
+        assert(slotno < ps->nr_slots);
+        short r = 0;
+        if (events[i].events & EPOLLIN)
+            r |= POLLIN;
+        if (events[i].events & EPOLLOUT)
+            r |= POLLOUT;
+        if (events[i].events & EPOLLERR)
+            r |= POLLERR;
+        if (events[i].events & EPOLLHUP)
+            r |= POLLHUP;
+        if (revents[slotno] == 0 && r != 0)
+            nr_ready += 1;
+        revents[slotno] |= r;
+    }
+
+    return nr_ready;
+}
+#elif POLLSET == POLLSET_KQUEUE
+static bool
+kernel_set_interest(struct pollset* ps,
+                    struct pollset_slot* slot,
+                    short old_events,
+                    short new_events)
+{
+    static const struct {
+        short poll_event;
+        short filter;
+    } filters[] = {
+        { POLLIN, EVFILT_READ },
+        { POLLOUT, EVFILT_WRITE },
+    };
+
+    struct kevent changes[ARRAYSIZE(filters)];
+    struct kevent results[ARRAYSIZE(filters)];
+    int nr_changes = 0;
+    uintptr_t slotno = slot - ps->slots;
+
+    for (unsigned i = 0; i < ARRAYSIZE(filters); ++i) {
+        bool was = (old_events & filters[i].poll_event) != 0;
+        bool want = (new_events & filters[i].poll_event) != 0;
+        if (was != want)
+            EV_SET(&changes[nr_changes++],
+                   slot->fdh->fd,
+                   filters[i].filter,
+                   (want ? EV_ADD : EV_DELETE) | EV_RECEIPT,
+                   0, 0, (void*) slotno);
+    }
+
+    if (nr_changes == 0)
+        return true;
+
+    int nret = kevent(ps->kfd, changes, nr_changes,
+                      results, nr_changes, NULL);
+    if (nret < 0)
+        return false;
+
+    for (int i = 0; i < nret; ++i)
+        if ((results[i].flags & EV_ERROR) && results[i].data != 0) {
+            errno = results[i].data;
+            return false;
+        }
+
+    return true;
+}
+
+static bool
+kernel_register_signals(struct pollset* ps, const sigset_t* sigmask)
+{
+    // EVFILT_SIGNAL records delivery attempts whether or not the
+    // signal is blocked, so registering the signals SIGMASK
+    // unblocks once and leaving them registered means a
+    // signal arriving between waits still wakes the next one.
+    struct kevent changes[NSIG];
+    struct kevent results[NSIG];
+    int nr_changes = 0;
+    for (int sig = 1; sig < NSIG; ++sig)
+        if (!sigismember(sigmask, sig))
+            EV_SET(&changes[nr_changes++], sig, EVFILT_SIGNAL,
+                   EV_ADD | EV_RECEIPT, 0, 0, NULL);
+
+    if (nr_changes == 0)
+        return true;
+
+    int nret = kevent(ps->kfd, changes, nr_changes,
+                      results, nr_changes, NULL);
+    if (nret < 0)
+        return false;
+
+    for (int i = 0; i < nret; ++i)
+        if ((results[i].flags & EV_ERROR) && results[i].data != 0) {
+            errno = results[i].data;
+            return false;
+        }
+
+    return true;
+}
+
+static int
+kernel_wait(struct pollset* ps,
+            const sigset_t* sigmask,
+            int timeout_ms,
+            short* revents)
+{
+    sigset_t oldmask;
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long) (timeout_ms % 1000) * 1000000,
+    };
+    struct kevent events[ps->nr_slots * 2 + NSIG];
+
+    if (sigmask && !ps->signals_registered) {
+        if (!kernel_register_signals(ps, sigmask))
+            return -1;
+        ps->signals_registered = true;
+    }
+
+    // As in xppoll: signals already pending don't trigger
+    // EVFILT_SIGNAL, so check for them explicitly.  Unblocking them
+    // with SIG_SETMASK delivers them, so EINTR is accurate.
+    if (sigmask) {
+        sigset_t pending;
+        sigpending(&pending);
+        sigprocmask(SIG_SETMASK, sigmask, &oldmask);
+        for (int sig = 1; sig < NSIG; ++sig) {
+            if (sigismember(&pending, sig) && !sigismember(sigmask, sig)) {
+                sigprocmask(SIG_SETMASK, &oldmask, NULL);
+                errno = EINTR;
+                return -1;
+            }
+        }
+    }
+
+    int nret = kevent(ps->kfd, NULL, 0, events, ARRAYSIZE(events),
+                      timeout_ms >= 0 ? &timeout : NULL);
+    int saved_errno = errno;
+    if (sigmask)
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    errno = saved_errno;
+
+    if (nret < 0)
+        return -1;
+
+    int nr_ready = 0;
+    bool sig_happened = false;
+    for (int i = 0; i < nret; ++i) {
+        struct kevent* kev = &events[i];
+        if (kev->filter == EVFILT_SIGNAL) {
+            sig_happened = true;
+            continue;
+        }
+
+        uintptr_t slotno = (uintptr_t) kev->udata;
+        assert(slotno < ps->nr_slots);
+        short r = (kev->filter == EVFILT_READ) ? POLLIN : POLLOUT;
+        if (kev->flags & EV_EOF)
+            r |= POLLHUP;
+        if (revents[slotno] == 0)
+            nr_ready += 1;
+        revents[slotno] |= r;
+    }
+
+    if (sig_happened && nr_ready == 0) {
+        errno = EINTR;
+        return -1;
+    }
+
+    return nr_ready;
+}
+#else
+static bool
+kernel_set_interest(struct pollset* ps,
+                    struct pollset_slot* slot,
+                    short old_events,
+                    short new_events)
+{
+    abort();
+}
+
+static int
+kernel_wait(struct pollset* ps,
+            const sigset_t* sigmask,
+            int timeout_ms,
+            short* revents)
+{
+    abort();
+}
+#endif
+
+static void
+slot_set_events(struct pollset* ps,
+                struct pollset_slot* slot,
+                short events)
+{
+    if (ps->kfd != -1 && !slot->always_ready && slot->events != events) {
+        if (!kernel_set_interest(ps, slot, slot->events, events)) {
+            // epoll refuses regular files and some character devices
+            // (like /dev/null) with EPERM.  poll would report
+            // them as always ready, so do the same.
+            if (slot->events == 0 && errno == EPERM)
+                slot->always_ready = true;
+            else
+                pollset_fall_back_to_ppoll(ps, errno);
+        }
+    }
+
+    slot->events = events;
+}
+
+static void
+slot_fdh_destroyed(void* data)
+{
+    struct pollset_slot* slot = data;
+    slot_set_events(slot->ps, slot, 0);
+    slot->fdh = NULL;
+    slot->fdh_cl = NULL; // Being deallocated by our caller
+    slot->always_ready = false;
+}
+
+static void
+slot_attach(struct pollset* ps,
+            struct pollset_slot* slot,
+            struct fdh* fdh)
+{
+    assert(slot->fdh == NULL);
+    assert(slot->events == 0);
+
+    {
+        WITH_CURRENT_RESLIST(fdh->rl);
+        struct cleanup* cl = cleanup_allocate();
+        cleanup_commit(cl, slot_fdh_destroyed, slot);
+        slot->fdh_cl = cl;
+    }
+
+    slot->fdh = fdh;
+    slot->always_ready = false;
+
+#if POLLSET == POLLSET_KQUEUE
+    // kqueue has bizarre and rarely useful semantics for regular
+    // files, so assume that disk files are always capable of IO.
+    struct stat st;
+    if (fstat(fdh->fd, &st) == 0 && S_ISREG(st.st_mode))
+        slot->always_ready = true;
+#endif
+}
+
+static void
+slot_detach(struct pollset* ps, struct pollset_slot* slot)
+{
+    slot_set_events(ps, slot, 0);
+    cleanup_forget(slot->fdh_cl);
+    slot->fdh_cl = NULL;
+    slot->fdh = NULL;
+    slot->always_ready = false;
+}
+
+static void
+pollset_cleanup(void* data)
+{
+    struct pollset* ps = data;
+    for (unsigned slotno = 0; slotno < ps->nr_slots; ++slotno) {
+        struct pollset_slot* slot = &ps->slots[slotno];
+        cleanup_forget(slot->fdh_cl);
+        slot->fdh_cl = NULL;
+        slot->fdh = NULL;
+    }
+
+    if (ps->kfd != -1)
+        close(ps->kfd);
+}
+
+struct pollset*
+pollset_new(unsigned nr_slots)
+{
+    assert(nr_slots > 0);
+    struct pollset* ps = xcalloc(sizeof (*ps));
+    ps->slots = xcalloc(sizeof (*ps->slots) * nr_slots);
+    ps->nr_slots = nr_slots;
+    for (unsigned slotno = 0; slotno < nr_slots; ++slotno)
+        ps->slots[slotno].ps = ps;
+
+    struct cleanup* cl = cleanup_allocate();
+#if POLLSET == POLLSET_EPOLL
+    ps->kfd = epoll_create(nr_slots);
+    if (ps->kfd != -1 &&
+        merge_O_CLOEXEC_into_fd_flags(ps->kfd, O_CLOEXEC) < 0)
+    {
+        close(ps->kfd);
+        ps->kfd = -1;
+    }
+#elif POLLSET == POLLSET_KQUEUE
+    ps->kfd = kqueue(); // Not inherited across fork
+#else
+    ps->kfd = -1;
+#endif
+    cleanup_commit(cl, pollset_cleanup, ps);
+    dbg("new pollset with %u slots using %s",
+        nr_slots, pollset_backend_name(ps));
+    return ps;
+}
+
+void
+pollset_update(struct pollset* ps,
+               unsigned slotno,
+               struct fdh* fdh,
+               short events)
+{
+    assert(slotno < ps->nr_slots);
+    struct pollset_slot* slot = &ps->slots[slotno];
+
+    events &= (POLLIN | POLLOUT);
+    if (fdh == NULL)
+        events = 0;
+
+    if (slot->fdh == fdh && slot->events == events)
+        return;
+
+    if (slot->fdh != fdh) {
+        if (slot->fdh != NULL)
+            slot_detach(ps, slot);
+        if (fdh != NULL)
+            slot_attach(ps, slot, fdh);
+    }
+
+    slot_set_events(ps, slot, events);
+}
+
+static int
+pollset_wait_ppoll(struct pollset* ps,
+                   const sigset_t* sigmask,
+                   int timeout_ms,
+                   short* revents)
+{
+    struct pollfd polls[ps->nr_slots];
+    for (unsigned slotno = 0; slotno < ps->nr_slots; ++slotno) {
+        struct pollset_slot* slot = &ps->slots[slotno];
+        if (slot->fdh != NULL && slot->events != 0)
+            polls[slotno] = (struct pollfd){
+                slot->fdh->fd, slot->events, 0 };
+        else
+            polls[slotno] = (struct pollfd){ -1, 0, 0 };
+    }
+
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long) (timeout_ms % 1000) * 1000000,
+    };
+
+    int rc = sigmask
+        ? xppoll(polls, ps->nr_slots,
+                 timeout_ms >= 0 ? &timeout : NULL,
+                 sigmask)
+        : poll(polls, ps->nr_slots, timeout_ms);
+
+    if (rc < 0)
+        return -1;
+
+    for (unsigned slotno = 0; slotno < ps->nr_slots; ++slotno)
+        revents[slotno] = polls[slotno].revents;
+
+    return rc;
+}
+
+int
+pollset_wait(struct pollset* ps,
+             const sigset_t* sigmask,
+             int timeout_ms,
+             short* revents)
+{
+    int nr_always_ready = 0;
+    for (unsigned slotno = 0; slotno < ps->nr_slots; ++slotno) {
+        struct pollset_slot* slot = &ps->slots[slotno];
+        revents[slotno] = 0;
+        if (ps->kfd != -1 && slot->always_ready && slot->events != 0) {
+            revents[slotno] = slot->events;
+            nr_always_ready += 1;
+        }
+    }
+
+    if (ps->kfd == -1)
+        return pollset_wait_ppoll(ps, sigmask, timeout_ms, revents);
+
+    // If some slot is ready no matter what, just collect whatever
+    // else happens to be ready without blocking.
+    int rc = kernel_wait(ps,
+                         sigmask,
+                         nr_always_ready > 0 ? 0 : timeout_ms,
+                         revents);
+
+    if (rc < 0 && nr_always_ready > 0)
+        return nr_always_ready;
+
+    if (rc < 0 && errno != EINTR) {
+        pollset_fall_back_to_ppoll(ps, errno);
+        return pollset_wait_ppoll(ps, sigmask, timeout_ms, revents);
+    }
+
+    if (rc < 0)
+        return -1;
+
+    return rc + nr_always_ready;
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <signal.h>
+#include "util.h"
+
+// A pollset remembers, for each of a fixed number of slots, which fdh
+// we're interested in and whether we want to read or write it.
+// Where the system lets us keep interest sets in the kernel (epoll on
+// Linux, kqueue on BSD and OS X), we tell the kernel about a slot
+// only when its interest changes instead of resubmitting every file
+// descriptor on every wakeup.  Elsewhere, or if the kernel refuses
+// to watch one of our file descriptors, we fall back to ppoll(2).
+
+struct pollset;
+struct fdh;
+
+// Allocate a pollset with NR_SLOTS slots, all initially idle.
+// The pollset is owned by the current reslist.
+struct pollset* pollset_new(unsigned nr_slots);
+
+// Set the interest of slot SLOTNO.  EVENTS is a combination of POLLIN
+// and POLLOUT; zero, or a NULL FDH, makes the slot idle.  Cheap when
+// nothing has changed since the last call.  The pollset notices on
+// its own when FDH is destroyed.
+void pollset_update(struct pollset* ps,
+                    unsigned slotno,
+                    struct fdh* fdh,
+                    short events);
+
+// Wait until at least one slot is ready or TIMEOUT_MS milliseconds
+// pass (-1 means forever), filling REVENTS (which must have room for
+// one entry per slot) with poll(2)-style event bits.  SIGMASK has the
+// same meaning as in ppoll(2), and must be the same on every call.
+// Return the number of ready slots, or -1 with errno set on failure
+// (including EINTR).
+int pollset_wait(struct pollset* ps,
+                 const sigset_t* sigmask,
+                 int timeout_ms,
+                 short* revents);
+
+// Name of the readiness mechanism PS is currently using.
+const char* pollset_backend_name(const struct pollset* ps);
@@ -21,6 +21,7 @@
 #define ENUM_MSG_TYPES(_m)                         \
     _m(MSG_CHANNEL_DATA)                           \
     _m(MSG_CHANNEL_DATA_LZ4)                       \
+    _m(MSG_CHANNEL_DATA_JUMBO)                     \
     _m(MSG_CHANNEL_WINDOW)                         \
     _m(MSG_CHANNEL_CLOSE)                          \
     _m(MSG_CHILD_EXIT)                             \
@@ -47,15 +48,28 @@
     _m(MSG_LISTENING_ON_SOCKET)                    \
     _m(MSG_OPEN_EXEC_FILE)                         \
     _m(MSG_EXEC_FILE_OK)                           \
-    _m(MSG_EXEC_FILE_MISMATCH)
+    _m(MSG_EXEC_FILE_MISMATCH)                     \
+    _m(MSG_QUERY_EXEC_FILES)                       \
+    _m(MSG_EXEC_FILES_PRESENT)                     \
+    _m(MSG_MUX_HELLO)                              \
+    _m(MSG_SESSION_OPEN)                           \
+    _m(MSG_SESSION_CLOSED)                         \
+    _m(MSG_EXEC_REQUEST)                           \
+    _m(MSG_OPEN_STRIPES)                           \
+    _m(MSG_STRIPE_HELLO)                           \
+    _m(MSG_STRIPE_CHUNK)                           \
+    _m(MSG_SESSION_CONNECT)
 
 enum msg_type {
     MSG_TYPE_PRE = 39, // Make sure zero is not a valid message
 #define M(_name) _name,
     ENUM_MSG_TYPES(M)
 #undef M
+    MSG_TYPE_POST, // One past the last message type
 };
 
+#define NR_MSG_TYPES (MSG_TYPE_POST - MSG_TYPE_PRE - 1)
+
 #define MSG_MAX_SIZE UINT16_MAX
 
 struct msg {
@@ -65,26 +79,35 @@ struct msg {
 
 struct msg_channel_data {
     struct msg msg;
-    uint8_t channel;
+    uint16_t channel;
     char data[0];
 };
 
 struct msg_channel_data_lz4 {
     struct msg msg;
     uint16_t uncompressed_size;
-    uint8_t channel;
+    uint16_t channel;
     char data[0];
 };
 
+// Like MSG_CHANNEL_DATA, but with ACTUAL_SIZE bytes of data
+// following the message instead of being part of it.  Used only if
+// the peer's hello said it could take these frames.
+struct msg_channel_data_jumbo {
+    struct msg msg;
+    uint32_t actual_size;
+    uint16_t channel;
+};
+
 struct msg_channel_window {
     struct msg msg;
     uint32_t window_delta;
-    uint8_t channel;
+    uint16_t channel;
 };
 
 struct msg_channel_close {
     struct msg msg;
-    uint8_t channel;
+    uint16_t channel;
 };
 
 struct msg_error {
@@ -116,8 +139,11 @@ struct term_control {
 
 struct stream_information {
     uint32_t bufsz;
+    uint16_t lz4_acceleration; // For the sender of this stream
     unsigned pty_p : 1;
     unsigned compress : 1;
+    unsigned compress_stream : 1; // LZ4 blocks share history
+    unsigned compress_dict : 1; // History starts with compdict.h's text
 };
 
 struct msg_shex_hello {
@@ -128,11 +154,15 @@ struct msg_shex_hello {
     uint32_t ispeed;
     uint32_t ospeed;
     uint16_t maxmsg;
+    uint32_t maxjumbo; // Zero if jumbo data frames aren't allowed
+    uint16_t cork_delay_ms;
     struct window_size ws;
     uint8_t have_ws;
     uint8_t posix_vdisable_value;
     uint8_t ctty_p : 1;
     uint8_t adb_encoding_hack : 1;
+    uint8_t shm_transport : 1; // Peer channels use the --shm-transport rings
+    uint8_t passed_fds : 3; // Bit N: child fd N was sent over the shm socket
     struct stream_information si[3];
     struct term_control tctl[0]; // Must be last
 };
@@ -170,6 +200,16 @@ struct msg_environment_variable_unset_jumbo {
     // Name follows
 };
 
+// Carries a run of the bootstrap messages above (command line
+// arguments, environment operations, and MSG_CHDIR), jumbo forms
+// included, exactly as they'd appear on the wire one by one, so that
+// the whole command goes over in one write.
+struct msg_exec_request {
+    struct msg msg;
+    uint32_t payload_size;
+    // Packed messages follow.
+};
+
 struct msg_exec_as_user {
     struct msg msg;
     uint8_t shell_thunk;
@@ -186,22 +226,49 @@ struct msg_rebind_to_unix_socket {
     char socket[0];
 };
 
+// Asks the stub to listen on the abstract socket SOCKET for
+// NR_STRIPES - 1 more connections, over which we stripe the protocol
+// stream along with the one we're using now.  The stub replies with
+// MSG_LISTENING_ON_SOCKET.
+struct msg_open_stripes {
+    struct msg msg;
+    uint8_t nr_stripes;
+    char socket[0];
+};
+
+// First message on each connection MSG_OPEN_STRIPES asked for
+struct msg_stripe_hello {
+    struct msg msg;
+    uint8_t stripe;
+};
+
+// Precedes each chunk of a striped stream: see stripe.h
+struct msg_stripe_chunk {
+    struct msg msg;
+    uint32_t seq;
+    uint32_t payload_size;
+};
+
 struct msg_rebind_to_tcp4_socket {
     struct msg msg;
     uint16_t port;
     uint32_t addr; // Like in_addr
+    uint32_t sockbufsz; // Zero to leave socket buffers to the kernel
 };
 
 struct msg_rebind_to_tcp6_socket {
     struct msg msg;
     uint16_t port;
     uint8_t addr[16]; // Like in6_addr
+    uint32_t sockbufsz; // Zero to leave socket buffers to the kernel
 };
 
+// No need for all 32 bytes of the hash
+#define FB_ADB_XCMD_HASH_LENGTH 16
+
 struct msg_open_exec_file {
     struct msg msg;
-    // No need for all 32 bytes of the hash
-    uint8_t expected_sha256_hash[16];
+    uint8_t expected_sha256_hash[FB_ADB_XCMD_HASH_LENGTH];
     char basename[0];
 };
 
@@ -210,6 +277,53 @@ struct msg_exec_file_mismatch {
     char filename_to_update[0];
 };
 
+// Ask which of up to XCMD_QUERY_MAX programs the device's xcmd cache
+// already has.  The device answers with MSG_EXEC_FILES_PRESENT.
+struct msg_query_exec_files {
+    struct msg msg;
+    uint8_t hashes[0][FB_ADB_XCMD_HASH_LENGTH];
+};
+
+struct msg_exec_files_present {
+    struct msg msg;
+    uint64_t present; // Bit N set if we have hashes[N]
+    char cache_directory[0]; // Where to put the missing ones
+};
+
+// Sent instead of MSG_SHEX_HELLO to turn the connection into a
+// session multiplexer: see mux.h.
+struct msg_mux_hello {
+    struct msg msg;
+    uint32_t stub_recv_bufsz;
+    uint32_t stub_send_bufsz;
+    uint32_t session_bufsz;
+    uint16_t maxmsg;
+    uint32_t maxjumbo;
+    uint16_t max_sessions;
+    uint8_t adb_encoding_hack : 1;
+};
+
+struct msg_session_open {
+    struct msg msg;
+    uint16_t session;
+};
+
+// Like MSG_SESSION_OPEN, but the device end connects the session to
+// a socket instead of starting a stub: to TCP port PORT on its
+// loopback interface if PORT is nonzero and otherwise to the
+// abstract socket named by SOCKET, which is NUL-padded.
+struct msg_session_connect {
+    struct msg msg;
+    uint16_t session;
+    uint16_t port;
+    char socket[108];
+};
+
+struct msg_session_closed {
+    struct msg msg;
+    uint16_t session;
+};
+
 #pragma pack(pop)
 
 static const unsigned CHILD_STDIN = 2;
@@ -224,6 +338,7 @@ static const unsigned CHILD_STDERR = 4;
 #define FB_ADB_ARCH_AARCH64  (1<<3)
 
 #define FB_ADB_FINGERPRINT_LENGTH 22
-#define FB_ADB_PROTO_START_LINE "FB_ADB %22s (x=%x) (u=%x) (a=%x)"
+#define FB_ADB_BOOT_ID_LENGTH 36
+#define FB_ADB_PROTO_START_LINE "FB_ADB %22s (x=%x) (u=%x) (a=%x) (b=%36s)"
 #define FB_ADB_STUB_DAEMON_SOCKET_NAME_LENGTH 44
 #define FB_ADB_STUB_DAEMON_LINE "FB_ADB %22s (listening@%44s pid=%u)"
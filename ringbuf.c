@@ -16,17 +16,81 @@
 #include "ringbuf.h"
 #include "util.h"
 
+#if defined(__linux__) && !defined(RINGBUF_MIRROR)
+# define RINGBUF_MIRROR 1
+#endif
+
+#if RINGBUF_MIRROR
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
 struct ringbuf {
     size_t nr_removed;
     size_t nr_added;
     size_t capacity;
     char* __restrict__ mem;
+    // If true, mem[capacity + i] is the same byte as mem[i], so any
+    // region of the buffer is contiguous.
+    bool mirrored;
+    bool keep_history; // See ringbuf_keep_history
 };
 
 struct ringbuf_io {
     struct iovec v[2];
 };
 
+#if RINGBUF_MIRROR
+static void
+ringbuf_unmap_cleanup(void* data)
+{
+    struct ringbuf* rb = data;
+    munmap(rb->mem, 2 * rb->capacity);
+}
+
+// Map CAPACITY bytes of memory twice, back to back.  Return NULL if
+// CAPACITY isn't a whole number of pages or if the kernel won't
+// cooperate.
+static char*
+ringbuf_map_mirrored(size_t capacity)
+{
+    long pagesz = sysconf(_SC_PAGESIZE);
+    if (pagesz <= 0 ||
+        capacity % (size_t) pagesz != 0 ||
+        capacity > SIZE_MAX / 2)
+    {
+        return NULL;
+    }
+
+    char* base = mmap(NULL, 2 * capacity, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    // Growing a zero-length range of a shared mapping with mremap
+    // creates a second view of the same pages, so we don't need a
+    // memfd or ashmem region to mirror the buffer.  Use the raw
+    // system call because Bionic's mremap doesn't take a new address.
+    if (mmap(base, capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED ||
+        (char*) syscall(__NR_mremap, base, 0, capacity,
+                        MREMAP_MAYMOVE | MREMAP_FIXED,
+                        base + capacity) != base + capacity)
+    {
+        munmap(base, 2 * capacity);
+        return NULL;
+    }
+
+    base[0] = 1;
+    if (base[capacity] != 1) {
+        munmap(base, 2 * capacity);
+        return NULL;
+    }
+
+    return base;
+}
+#endif
+
 struct ringbuf*
 ringbuf_new(size_t capacity)
 {
@@ -39,6 +103,19 @@ ringbuf_new(size_t capacity)
 
     struct ringbuf* rb = xcalloc(sizeof (*rb));
     rb->capacity = capacity;
+
+#if RINGBUF_MIRROR
+    struct cleanup* cl = cleanup_allocate();
+    rb->mem = ringbuf_map_mirrored(capacity);
+    if (rb->mem != NULL) {
+        rb->mirrored = true;
+        cleanup_commit(cl, ringbuf_unmap_cleanup, rb);
+        return rb;
+    }
+
+    cleanup_forget(cl);
+#endif
+
     rb->mem = xalloc(capacity);
     return rb;
 }
@@ -84,7 +161,7 @@ ringbuf_io_region(const struct ringbuf* rb, size_t pos, size_t len)
     struct ringbuf_io rio;
     rio.v[0].iov_base = &rb->mem[idx];
     rio.v[0].iov_len = len;
-    if (idx + len > rb->capacity) {
+    if (idx + len > rb->capacity && !rb->mirrored) {
         rio.v[0].iov_len = rb->capacity - idx;
         rio.v[1].iov_base = rb->mem;
         rio.v[1].iov_len = len - rio.v[0].iov_len;
@@ -110,7 +187,7 @@ ringbuf_note_removed(struct ringbuf* rb, size_t nr)
 {
     assert(nr <= ringbuf_size(rb));
     rb->nr_removed += nr;
-    if (ringbuf_size(rb) == 0) {
+    if (ringbuf_size(rb) == 0 && !rb->keep_history) {
         rb->nr_added = 0;
         rb->nr_removed = 0;
     }
@@ -195,3 +272,44 @@ ringbuf_writable_iov(const struct ringbuf* rb,
     iov[0] = rio.v[0];
     iov[1] = rio.v[1];
 }
+
+void
+ringbuf_trim(struct ringbuf* rb)
+{
+    assert(ringbuf_size(rb) == 0);
+#if RINGBUF_MIRROR && defined(MADV_REMOVE)
+    // The mirrored views share one shmem object, so punching a hole
+    // through one of them frees the pages behind both.
+    if (rb->mirrored && !rb->keep_history)
+        (void) madvise(rb->mem, rb->capacity, MADV_REMOVE);
+#endif
+}
+
+bool
+ringbuf_keep_history(struct ringbuf* rb)
+{
+    if (!rb->mirrored)
+        return false;
+    rb->keep_history = true;
+    return true;
+}
+
+char*
+ringbuf_history_window(const struct ringbuf* rb,
+                       size_t max_histsz,
+                       size_t sz,
+                       size_t* histsz_out)
+{
+    assert(rb->keep_history);
+    assert(sz <= ringbuf_room(rb));
+    size_t histsz = XMIN(max_histsz, rb->nr_added);
+    assert(histsz + sz <= rb->capacity);
+    // The history can't begin before mem, so if it would, point into
+    // the second view instead, where the room still fits since
+    // histsz + sz <= capacity.
+    size_t idx = ringbuf_clip(rb, rb->nr_added);
+    if (idx < histsz)
+        idx += rb->capacity;
+    *histsz_out = histsz;
+    return &rb->mem[idx];
+}
@@ -32,3 +32,24 @@ void ringbuf_writable_iov(const struct ringbuf* rb,
 
 size_t ringbuf_note_removed(struct ringbuf* rb, size_t nr);
 size_t ringbuf_note_added(struct ringbuf* rb, size_t nr);
+
+// Give the system back the memory behind empty buffer RB.  RB stays
+// usable: pages come back, zeroed, as we touch them again.  A noop
+// where we can't release part of a buffer.
+void ringbuf_trim(struct ringbuf* rb);
+
+// Make RB remember what it held: never rewind to the start of its
+// memory when it empties, and don't let ringbuf_trim discard it, so
+// that the bytes most recently added stay readable right behind the
+// room for the next ones.  Only mirrored buffers can do this; return
+// false, changing nothing, for others.
+bool ringbuf_keep_history(struct ringbuf* rb);
+
+// For RB keeping history, return a pointer to the room for the next
+// SZ bytes, contiguous with the last *HISTSZ_OUT bytes added before
+// it, which is MAX_HISTSZ bytes unless RB has seen fewer.  The
+// history and the room together must fit in RB's capacity.
+char* ringbuf_history_window(const struct ringbuf* rb,
+                             size_t max_histsz,
+                             size_t sz,
+                             size_t* histsz_out);
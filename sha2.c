@@ -42,6 +42,32 @@
 #endif
 #include "sha2.h"
 
+/*
+ * HARDWARE ACCELERATION NOTE:
+ * On x86 CPUs with the SHA extensions and on ARMv8 CPUs with the
+ * SHA-2 crypto extension, SHA256_Update hands whole blocks to a kernel
+ * built on those instructions.  We compile the kernels with per-function
+ * target attributes and pick one at runtime, so the same binary still
+ * runs (on the portable transform below) on CPUs without them.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+# define SHA2_HAVE_X86_SHA 1
+# include <immintrin.h>
+# include <cpuid.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) &&               \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2) || \
+     (!defined(__clang__) && __GNUC__ >= 8))
+# define SHA2_HAVE_ARMV8_SHA 1
+# include <arm_neon.h>
+# include <sys/auxv.h>
+# ifndef HWCAP_SHA2
+#  define HWCAP_SHA2 (1 << 6)
+# endif
+#endif
+
 /*
  * ASSERT NOTE:
  * Some sanity checking code is included using assert().  On my FreeBSD
@@ -523,6 +549,158 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/*** SHA-256 BLOCK KERNELS ********************************************/
+typedef void (*sha256_blocks_fn)(SHA256_CTX*, const sha2_byte*, size_t);
+
+static void SHA256_Blocks_Portable(SHA256_CTX* context,
+                                   const sha2_byte* data,
+                                   size_t nblocks) {
+        while (nblocks-- > 0) {
+                SHA256_Transform(context, (const sha2_word32*)data);
+                data += SHA256_BLOCK_LENGTH;
+        }
+}
+
+#ifdef SHA2_HAVE_X86_SHA
+/*
+ * The SHA instructions keep the state as ABEF and CDGH and run two
+ * rounds at a time; each group of four rounds consumes one vector of
+ * the message schedule, which sha256msg1/sha256msg2 extend.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void SHA256_Blocks_X86(SHA256_CTX* context,
+                              const sha2_byte* data,
+                              size_t nblocks) {
+        const __m128i	mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                              0x0405060700010203ULL);
+        __m128i		state0, state1, tmp, w, t, msg[4];
+        __m128i		abef_save, cdgh_save;
+        int		g;
+
+        tmp = _mm_loadu_si128((const __m128i*)&context->state[0]);
+        state1 = _mm_loadu_si128((const __m128i*)&context->state[4]);
+        tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+        state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+        state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+        while (nblocks-- > 0) {
+                abef_save = state0;
+                cdgh_save = state1;
+                for (g = 0; g < 16; g++) {
+                        if (g < 4) {
+                                w = _mm_loadu_si128((const __m128i*)(data + 16 * g));
+                                w = _mm_shuffle_epi8(w, mask);
+                        } else {
+                                w = _mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]);
+                                w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(g + 3) & 3],
+                                                                     msg[(g + 2) & 3], 4));
+                                w = _mm_sha256msg2_epu32(w, msg[(g + 3) & 3]);
+                        }
+                        msg[g & 3] = w;
+                        t = _mm_add_epi32(w, _mm_loadu_si128((const __m128i*)&K256[4 * g]));
+                        state1 = _mm_sha256rnds2_epu32(state1, state0, t);
+                        t = _mm_shuffle_epi32(t, 0x0E);
+                        state0 = _mm_sha256rnds2_epu32(state0, state1, t);
+                }
+                state0 = _mm_add_epi32(state0, abef_save);
+                state1 = _mm_add_epi32(state1, cdgh_save);
+                data += SHA256_BLOCK_LENGTH;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+        state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+        state1 = _mm_alignr_epi8(state1, tmp, 8);	/* ABEF */
+        _mm_storeu_si128((__m128i*)&context->state[0], state0);
+        _mm_storeu_si128((__m128i*)&context->state[4], state1);
+}
+
+static int sha256_x86_supported(void) {
+        unsigned int	eax, ebx, ecx, edx;
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 ||
+            (ecx & (1 << 9)) == 0 ||	/* SSSE3 */
+            (ecx & (1 << 19)) == 0)	/* SSE4.1 */
+                return 0;
+        if (__get_cpuid_max(0, 0) < 7)
+                return 0;
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx & (1 << 29)) != 0;	/* SHA */
+}
+#endif /* SHA2_HAVE_X86_SHA */
+
+#ifdef SHA2_HAVE_ARMV8_SHA
+/*
+ * sha256h/sha256h2 run four rounds on the ABCD and EFGH halves of the
+ * state; sha256su0/sha256su1 extend the message schedule.
+ */
+#if !defined(__ARM_FEATURE_CRYPTO) && !defined(__ARM_FEATURE_SHA2)
+__attribute__((target("+crypto")))
+#endif
+static void SHA256_Blocks_ARMv8(SHA256_CTX* context,
+                                const sha2_byte* data,
+                                size_t nblocks) {
+        uint32x4_t	state0, state1, abcd, w, t, msg[4];
+        uint32x4_t	abcd_save, efgh_save;
+        int		g;
+
+        state0 = vld1q_u32(&context->state[0]);
+        state1 = vld1q_u32(&context->state[4]);
+
+        while (nblocks-- > 0) {
+                abcd_save = state0;
+                efgh_save = state1;
+                for (g = 0; g < 16; g++) {
+                        if (g < 4) {
+                                w = vreinterpretq_u32_u8(
+                                        vrev32q_u8(vld1q_u8(data + 16 * g)));
+                        } else {
+                                w = vsha256su0q_u32(msg[g & 3], msg[(g + 1) & 3]);
+                                w = vsha256su1q_u32(w, msg[(g + 2) & 3], msg[(g + 3) & 3]);
+                        }
+                        msg[g & 3] = w;
+                        t = vaddq_u32(w, vld1q_u32(&K256[4 * g]));
+                        abcd = state0;
+                        state0 = vsha256hq_u32(state0, state1, t);
+                        state1 = vsha256h2q_u32(state1, abcd, t);
+                }
+                state0 = vaddq_u32(state0, abcd_save);
+                state1 = vaddq_u32(state1, efgh_save);
+                data += SHA256_BLOCK_LENGTH;
+        }
+
+        vst1q_u32(&context->state[0], state0);
+        vst1q_u32(&context->state[4], state1);
+}
+#endif /* SHA2_HAVE_ARMV8_SHA */
+
+static sha256_blocks_fn sha256_pick_blocks(void) {
+#ifdef SHA2_HAVE_X86_SHA
+        if (sha256_x86_supported())
+                return SHA256_Blocks_X86;
+#endif
+#ifdef SHA2_HAVE_ARMV8_SHA
+        if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+                return SHA256_Blocks_ARMv8;
+#endif
+        return SHA256_Blocks_Portable;
+}
+
+/*
+ * Racing threads may each pick a kernel, but they all pick the same
+ * one, so the unsynchronized store is harmless.
+ */
+static sha256_blocks_fn sha256_blocks;
+
+static void SHA256_Blocks(SHA256_CTX* context,
+                          const sha2_byte* data,
+                          size_t nblocks) {
+        if (sha256_blocks == 0)
+                sha256_blocks = sha256_pick_blocks();
+        sha256_blocks(context, data, nblocks);
+}
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
         unsigned int	freespace, usedspace;
 
@@ -545,7 +723,7 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
                         context->bitcount += freespace << 3;
                         len -= freespace;
                         data += freespace;
-                        SHA256_Transform(context, (sha2_word32*)context->buffer);
+                        SHA256_Blocks(context, context->buffer, 1);
                 } else {
                         /* The buffer is not yet full */
                         MEMCPY_BCOPY(&context->buffer[usedspace], data, len);
@@ -555,12 +733,13 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
                         return;
                 }
         }
-        while (len >= SHA256_BLOCK_LENGTH) {
+        if (len >= SHA256_BLOCK_LENGTH) {
                 /* Process as many complete blocks as we can */
-                SHA256_Transform(context, (sha2_word32*)data);
-                context->bitcount += SHA256_BLOCK_LENGTH << 3;
-                len -= SHA256_BLOCK_LENGTH;
-                data += SHA256_BLOCK_LENGTH;
+                size_t nblocks = len / SHA256_BLOCK_LENGTH;
+                SHA256_Blocks(context, data, nblocks);
+                context->bitcount += (sha2_word64)nblocks * SHA256_BLOCK_LENGTH << 3;
+                len -= nblocks * SHA256_BLOCK_LENGTH;
+                data += nblocks * SHA256_BLOCK_LENGTH;
         }
         if (len > 0) {
                 /* There's left-overs, so save 'em */
@@ -0,0 +1,263 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "shmring.h"
+#include "ringbuf.h"
+#include "constants.h"
+#include "fs.h"
+#include "net.h"
+
+#ifdef HAVE_SHM_TRANSPORT
+#include <sys/mman.h>
+
+// Positions count bytes modulo 2^32, so the ring size must be a power
+// of two.  Each side writes only its own line of the header.  The
+// waiting flags use sequentially consistent accesses: a side that
+// sets its flag and then looks at the other side's position, racing
+// with a peer that moves its position and then looks at the flag,
+// either sees the progress or gets a doorbell.
+struct shmring_header {
+    uint32_t head;             // Written by the producer
+    uint32_t producer_waiting; // Set by the producer, cleared by the consumer
+    char pad1[56];
+    uint32_t tail;             // Written by the consumer
+    uint32_t consumer_waiting; // Set by the consumer, cleared by the producer
+    char pad2[56];
+};
+
+#define SHMRING_HEADER_SIZE 4096
+#define SHMRING_SPAN (SHMRING_HEADER_SIZE + SHM_TRANSPORT_RING_SIZE)
+
+struct shmring {
+    struct shmring_header* hdr;
+    char* data;
+    bool producer;
+    bool peer_gone;
+};
+
+struct shmring_unmap_info {
+    void* mem;
+    size_t size;
+};
+
+static void
+shmring_unmap_cleanup(void* data)
+{
+    struct shmring_unmap_info* ui = data;
+    munmap(ui->mem, ui->size);
+}
+
+struct shm_transport*
+shm_transport_new(void)
+{
+    struct shm_transport* st = xcalloc(sizeof (*st));
+    struct cleanup* cl = cleanup_allocate();
+    int memfd = syscall(__NR_memfd_create, "fb-adb-shm", 0);
+    if (memfd == -1)
+        die_errno("memfd_create");
+    cleanup_commit_close_fd(cl, memfd);
+    if (merge_O_CLOEXEC_into_fd_flags(memfd, O_CLOEXEC) == -1)
+        die_errno("fcntl");
+    if (ftruncate(memfd, 2 * SHMRING_SPAN) == -1)
+        die_errno("ftruncate");
+
+    st->memfd = memfd;
+    xsocketpair(AF_UNIX, SOCK_STREAM, 0,
+                &st->to_stub[0], &st->to_stub[1]);
+    xsocketpair(AF_UNIX, SOCK_STREAM, 0,
+                &st->from_stub[0], &st->from_stub[1]);
+    return st;
+}
+
+struct shmring*
+shmring_open(int memfd, unsigned ringno, bool producer)
+{
+    assert(ringno < 2);
+    struct stat st = xfstat(memfd);
+    if (st.st_size != 2 * SHMRING_SPAN)
+        die(EINVAL, "shared memory transport has wrong size");
+
+    struct cleanup* cl = cleanup_allocate();
+    struct shmring_unmap_info* ui = xcalloc(sizeof (*ui));
+    ui->size = SHMRING_SPAN;
+    ui->mem = mmap(NULL, SHMRING_SPAN, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, memfd, (off_t) ringno * SHMRING_SPAN);
+    if (ui->mem == MAP_FAILED)
+        die_errno("mmap");
+    cleanup_commit(cl, shmring_unmap_cleanup, ui);
+
+    struct shmring* sr = xcalloc(sizeof (*sr));
+    sr->hdr = ui->mem;
+    sr->data = (char*) ui->mem + SHMRING_HEADER_SIZE;
+    sr->producer = producer;
+    return sr;
+}
+
+static uint32_t
+shmring_size(const struct shmring* sr)
+{
+    return __atomic_load_n(&sr->hdr->head, __ATOMIC_SEQ_CST) -
+        __atomic_load_n(&sr->hdr->tail, __ATOMIC_SEQ_CST);
+}
+
+static uint32_t
+shmring_avail(const struct shmring* sr)
+{
+    uint32_t size = shmring_size(sr);
+    return sr->producer ? SHM_TRANSPORT_RING_SIZE - size : size;
+}
+
+static void
+ring_doorbell(struct shmring* sr, int bellfd, uint32_t* waiting)
+{
+    if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+        // A doorbell already in the socket is as good as another.
+        static const char bell = 0;
+        if (send(bellfd, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1 &&
+            errno == EPIPE)
+        {
+            sr->peer_gone = true;
+        }
+    }
+}
+
+static void
+drain_doorbells(struct shmring* sr, int bellfd)
+{
+    char buf[64];
+    ssize_t ret;
+    do {
+        ret = recv(bellfd, buf, sizeof (buf), MSG_DONTWAIT);
+    } while (ret > 0 || (ret == -1 && errno == EINTR));
+    if (ret == 0 || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+        sr->peer_gone = true;
+}
+
+short
+shmring_poll_events(struct shmring* sr, int bellfd)
+{
+    if (sr->peer_gone || shmring_avail(sr) > 0)
+        return POLLOUT;
+
+    uint32_t* waiting = sr->producer
+        ? &sr->hdr->producer_waiting
+        : &sr->hdr->consumer_waiting;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    return shmring_avail(sr) > 0 ? POLLOUT : POLLIN;
+}
+
+// Copy between the ring, starting at position POS, and the NIOV
+// regions of IOV, in the direction TO_RING.
+static void
+shmring_copy(struct shmring* sr,
+             uint32_t pos,
+             const struct iovec* iov,
+             unsigned niov,
+             bool to_ring)
+{
+    for (unsigned i = 0; i < niov; ++i) {
+        char* buf = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t off = pos & (SHM_TRANSPORT_RING_SIZE - 1);
+            size_t chunk = XMIN(left, SHM_TRANSPORT_RING_SIZE - off);
+            if (to_ring)
+                memcpy(sr->data + off, buf, chunk);
+            else
+                memcpy(buf, sr->data + off, chunk);
+            buf += chunk;
+            left -= chunk;
+            pos += chunk;
+        }
+    }
+}
+
+size_t
+shmring_read_in(struct shmring* sr,
+                int bellfd,
+                const struct ringbuf* rb,
+                size_t sz)
+{
+    assert(!sr->producer);
+    drain_doorbells(sr, bellfd);
+    sz = XMIN(sz, shmring_avail(sr));
+    if (sz == 0) {
+        if (sr->peer_gone)
+            return 0;
+        die(EAGAIN, "shared memory ring empty");
+    }
+
+    struct iovec iov[2];
+    ringbuf_writable_iov(rb, iov, sz);
+    uint32_t tail = __atomic_load_n(&sr->hdr->tail, __ATOMIC_RELAXED);
+    shmring_copy(sr, tail, iov, ARRAYSIZE(iov), false);
+    __atomic_store_n(&sr->hdr->tail, tail + (uint32_t) sz,
+                     __ATOMIC_SEQ_CST);
+    ring_doorbell(sr, bellfd, &sr->hdr->producer_waiting);
+    return sz;
+}
+
+static void
+shmring_publish(struct shmring* sr, int bellfd, uint32_t sz)
+{
+    uint32_t head = __atomic_load_n(&sr->hdr->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&sr->hdr->head, head + sz, __ATOMIC_SEQ_CST);
+    ring_doorbell(sr, bellfd, &sr->hdr->consumer_waiting);
+}
+
+size_t
+shmring_write_out(struct shmring* sr,
+                  int bellfd,
+                  const struct ringbuf* rb,
+                  size_t sz)
+{
+    assert(sr->producer);
+    drain_doorbells(sr, bellfd);
+    if (sr->peer_gone)
+        die(EPIPE, "shared memory ring consumer gone");
+    sz = XMIN(sz, shmring_avail(sr));
+    if (sz == 0)
+        die(EAGAIN, "shared memory ring full");
+
+    struct iovec iov[2];
+    ringbuf_readable_iov(rb, iov, sz);
+    shmring_copy(sr,
+                 __atomic_load_n(&sr->hdr->head, __ATOMIC_RELAXED),
+                 iov, ARRAYSIZE(iov), true);
+    shmring_publish(sr, bellfd, sz);
+    return sz;
+}
+
+bool
+shmring_write_now(struct shmring* sr,
+                  int bellfd,
+                  const void* buf,
+                  size_t sz)
+{
+    assert(sr->producer);
+    if (sr->peer_gone || sz > shmring_avail(sr))
+        return false;
+
+    struct iovec iov = { (void*) buf, sz };
+    shmring_copy(sr,
+                 __atomic_load_n(&sr->hdr->head, __ATOMIC_RELAXED),
+                 &iov, 1, true);
+    shmring_publish(sr, bellfd, sz);
+    return true;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "util.h"
+
+// A shmring is a single-producer, single-consumer byte ring living
+// in memory shared by two processes on the same machine, which lets
+// the local transport move protocol data without copying it through
+// pipes.  Each ring comes with a stream socket whose two ends belong
+// to the producer and the consumer.  The socket carries doorbells:
+// a side that runs out of data or room says so in the ring header
+// and polls its end; its peer writes a byte after making progress.
+// Closing the socket is end-of-file (or a broken pipe), exactly as
+// with a pipe.
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+# ifdef __NR_memfd_create
+#  define HAVE_SHM_TRANSPORT 1
+# endif
+#endif
+
+#ifdef HAVE_SHM_TRANSPORT
+
+struct ringbuf;
+struct shmring;
+
+// The local transport's shared memory: a memfd with two rings of
+// SHM_TRANSPORT_RING_SIZE bytes each, one per direction, and a
+// doorbell socket pair for each ring.
+struct shm_transport {
+    int memfd;
+    int to_stub[2];   // Ring 0: the host produces, the stub consumes
+    int from_stub[2]; // Ring 1: the stub produces, the host consumes
+};
+
+// Allocate a shm_transport.  Everything in it is owned by the current
+// reslist and close-on-exec.
+struct shm_transport* shm_transport_new(void);
+
+// Map ring RINGNO of the shm_transport memfd MEMFD.  If PRODUCER,
+// we produce into the ring; otherwise, we consume from it.
+// The mapping is owned by the current reslist.
+struct shmring* shmring_open(int memfd, unsigned ringno, bool producer);
+
+// What to poll BELLFD for before our next shmring_read_in or
+// shmring_write_out call.  POLLOUT means that the ring is ready now,
+// since a connected socket is almost always writable; POLLIN means
+// that we're waiting for the peer to ring the doorbell.
+short shmring_poll_events(struct shmring* sr, int bellfd);
+
+// Move up to SZ bytes from the ring into the writable part of RB,
+// leaving it to the caller to ringbuf_note_added.  Return zero only
+// on end-of-file.  Die with EAGAIN if the ring is empty but the
+// producer is still around.
+size_t shmring_read_in(struct shmring* sr,
+                       int bellfd,
+                       const struct ringbuf* rb,
+                       size_t sz);
+
+// Move up to SZ bytes from RB into the ring, leaving it to the caller
+// to ringbuf_note_removed.  Die with EPIPE if the consumer is gone
+// and with EAGAIN if the ring is full.
+size_t shmring_write_out(struct shmring* sr,
+                         int bellfd,
+                         const struct ringbuf* rb,
+                         size_t sz);
+
+// Put all SZ bytes of BUF in the ring without waiting, or return
+// false if they don't fit.
+bool shmring_write_now(struct shmring* sr,
+                       int bellfd,
+                       const void* buf,
+                       size_t sz);
+
+#endif
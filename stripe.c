@@ -0,0 +1,206 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "stripe.h"
+#include "ringbuf.h"
+#include "proto.h"
+#include "constants.h"
+#include "fs.h"
+
+struct stripe_set {
+    struct fdh** fdh;
+    unsigned nr;
+    unsigned cur;           // Connection carrying chunk SEQ
+    uint32_t seq;           // Chunk we're reading or writing
+    uint32_t left;          // Payload bytes of chunk SEQ still to move
+    size_t hdr_done;        // Header bytes of chunk SEQ moved so far
+    struct msg_stripe_chunk hdr;
+    bool raw;               // Moving a bare message instead of a chunk
+};
+
+struct stripe_set*
+stripe_set_new(struct fdh** fdh, unsigned nr)
+{
+    assert(nr > 0);
+    struct stripe_set* ss = xcalloc(sizeof (*ss));
+    ss->fdh = xalloc(nr * sizeof (*ss->fdh));
+    memcpy(ss->fdh, fdh, nr * sizeof (*ss->fdh));
+    ss->nr = nr;
+    for (unsigned i = 0; i < nr; ++i)
+        fd_set_blocking_mode(fdh[i]->fd, non_blocking);
+    return ss;
+}
+
+struct fdh*
+stripe_current_fdh(const struct stripe_set* ss)
+{
+    return ss->fdh[ss->cur];
+}
+
+// Read more of the current chunk's header.  The peer sends error
+// packets bare, before it starts striping, so a header that turns
+// out to be some other message makes us pass that message through
+// as if it were a chunk, letting our caller report it.  Return the
+// number of bytes to hand our caller.
+static size_t
+stripe_read_header(struct stripe_set* ss, const struct ringbuf* rb)
+{
+    ssize_t ret;
+    {
+        WITH_IO_SIGNALS_ALLOWED();
+        ret = read(ss->fdh[ss->cur]->fd,
+                   (char*) &ss->hdr + ss->hdr_done,
+                   sizeof (ss->hdr) - ss->hdr_done);
+    }
+
+    if (ret < 0)
+        die_errno("read");
+    if (ret == 0) {
+        if (ss->hdr_done > 0)
+            die(ECOMM, "stripe %u ended inside a chunk header", ss->cur);
+        return 0;
+    }
+
+    ss->hdr_done += ret;
+    if (ss->hdr_done < sizeof (ss->hdr.msg))
+        die(EAGAIN, "partial chunk header");
+
+    if (ss->hdr.msg.type != MSG_STRIPE_CHUNK) {
+        size_t msgsz = ss->hdr.msg.size;
+        if (msgsz < ss->hdr_done || ringbuf_room(rb) < msgsz)
+            die(ECOMM, "bad message on stripe %u", ss->cur);
+
+        struct iovec iov[2];
+        size_t nr = ss->hdr_done;
+        ringbuf_writable_iov(rb, iov, nr);
+        const char* src = (const char*) &ss->hdr;
+        memcpy(iov[0].iov_base, src, iov[0].iov_len);
+        memcpy(iov[1].iov_base, src + iov[0].iov_len, iov[1].iov_len);
+        ss->raw = true;
+        ss->left = msgsz - nr;
+        return nr;
+    }
+
+    if (ss->hdr_done < sizeof (ss->hdr))
+        die(EAGAIN, "partial chunk header");
+
+    if (ss->hdr.msg.size != sizeof (ss->hdr) ||
+        ss->hdr.seq != ss->seq ||
+        ss->hdr.payload_size == 0)
+    {
+        die(ECOMM, "stripe %u: bad chunk header (seq %u, expected %u)",
+            ss->cur, (unsigned) ss->hdr.seq, (unsigned) ss->seq);
+    }
+
+    ss->left = ss->hdr.payload_size;
+    return 0;
+}
+
+// Account for having moved NR payload bytes.
+static void
+stripe_note_moved(struct stripe_set* ss, size_t nr)
+{
+    ss->left -= nr;
+    if (ss->left > 0)
+        return;
+
+    if (ss->raw) {
+        // Not a chunk, so the peer hasn't moved on to the next.
+        ss->raw = false;
+        ss->hdr_done = 0;
+    } else {
+        ss->seq += 1;
+        ss->cur = (ss->cur + 1) % ss->nr;
+        ss->hdr_done = 0;
+    }
+}
+
+size_t
+stripe_read_in(struct stripe_set* ss, const struct ringbuf* rb, size_t sz)
+{
+    if (!ss->raw && ss->hdr_done < sizeof (ss->hdr)) {
+        size_t nr = stripe_read_header(ss, rb);
+        if (ss->hdr_done == 0)
+            return 0; // End of file
+        if (nr > 0) {
+            stripe_note_moved(ss, 0);
+            return nr;
+        }
+    }
+
+    // Our caller counts what we return from the start of RB's
+    // writable region, so read only into that.
+    struct iovec iov[2];
+    ringbuf_writable_iov(rb, iov, XMIN(sz, ss->left));
+    ssize_t ret;
+    {
+        WITH_IO_SIGNALS_ALLOWED();
+        ret = readv(ss->fdh[ss->cur]->fd, iov, ARRAYSIZE(iov));
+    }
+
+    if (ret < 0)
+        die_errno("readv");
+    if (ret == 0)
+        die(ECOMM, "stripe %u ended inside a chunk", ss->cur);
+
+    stripe_note_moved(ss, ret);
+    return ret;
+}
+
+size_t
+stripe_write_out(struct stripe_set* ss, const struct ringbuf* rb, size_t sz)
+{
+    if (ss->hdr_done == 0 && ss->left == 0) {
+        memset(&ss->hdr, 0, sizeof (ss->hdr));
+        ss->hdr.msg.type = MSG_STRIPE_CHUNK;
+        ss->hdr.msg.size = sizeof (ss->hdr);
+        ss->hdr.seq = ss->seq;
+        ss->hdr.payload_size = XMIN(sz, STRIPE_CHUNK_SIZE);
+        ss->left = ss->hdr.payload_size;
+    }
+
+    // Send whatever's left of the header along with the payload.
+    size_t hdr_left = sizeof (ss->hdr) - ss->hdr_done;
+    size_t payloadsz = XMIN(sz, ss->left);
+    struct iovec iov[3];
+    iov[0].iov_base = (char*) &ss->hdr + ss->hdr_done;
+    iov[0].iov_len = hdr_left;
+    ringbuf_readable_iov(rb, &iov[1], payloadsz);
+
+    ssize_t ret;
+    {
+        WITH_IO_SIGNALS_ALLOWED();
+        ret = writev(ss->fdh[ss->cur]->fd, iov, ARRAYSIZE(iov));
+    }
+
+    if (ret < 0)
+        die_errno("writev");
+
+    size_t hdr_sent = XMIN((size_t) ret, hdr_left);
+    size_t nr_written = ret - hdr_sent;
+    ss->hdr_done += hdr_sent;
+    stripe_note_moved(ss, nr_written);
+    return nr_written;
+}
+
+void
+stripe_set_close(struct stripe_set* ss)
+{
+    for (unsigned i = 0; i < ss->nr; ++i)
+        if (ss->fdh[i] != NULL) {
+            fdh_destroy(ss->fdh[i]);
+            ss->fdh[i] = NULL;
+        }
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stddef.h>
+#include "util.h"
+
+// A stripe set spreads one direction of the protocol stream over
+// several connections, so that a session isn't limited by the flow
+// control of a single adb stream.  The stream goes out in chunks,
+// each preceded by a struct msg_stripe_chunk header, and chunk N
+// always travels on connection N modulo the number of connections.
+// Each side therefore needs to watch only one connection at a time:
+// the one carrying the chunk it's working on.  Chunks arrive in
+// order on each connection, so the reader reassembles the stream by
+// taking them round-robin.
+
+struct fdh;
+struct ringbuf;
+struct stripe_set;
+
+// Make a stripe set from the NR descriptors FDH, each of which we
+// use in one direction only.  FDH[0] is the primary connection.
+// The stripe set takes ownership of the descriptors.
+struct stripe_set* stripe_set_new(struct fdh** fdh, unsigned nr);
+
+// The connection carrying the current chunk: what to poll before
+// the next stripe_read_in or stripe_write_out.
+struct fdh* stripe_current_fdh(const struct stripe_set* ss);
+
+// Move up to SZ bytes of the stream into the writable part of RB,
+// leaving it to the caller to ringbuf_note_added.  Return zero only
+// on end-of-file.
+size_t stripe_read_in(struct stripe_set* ss,
+                      const struct ringbuf* rb,
+                      size_t sz);
+
+// Send up to SZ bytes from RB, leaving it to the caller to
+// ringbuf_note_removed.
+size_t stripe_write_out(struct stripe_set* ss,
+                        const struct ringbuf* rb,
+                        size_t sz);
+
+// Close all the connections in the stripe set.
+void stripe_set_close(struct stripe_set* ss);
@@ -11,6 +11,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 #include "stubdaemon.h"
 #include "util.h"
 #include "fs.h"
@@ -160,24 +165,25 @@ start_daemon_via_service_hack(const char* package_name)
     write_all(peer_fd, &script_length_be, sizeof (script_length_be));
     write_all(peer_fd, script, script_length);
 
-    char* output = slurp_fd(peer_fd, NULL);
-    char* endptr = NULL;
+    // The daemon says hello as soon as it's listening, so pass the
+    // hello along right away instead of waiting for the service's
+    // shell to finish.
+    FILE* peer_out = xfdopen(peer_fd, "r");
     char* error = NULL;
     bool found_daemon_hello = false;
 
-    for (char* line = strtok_r((output), "\n", &endptr);
-         line != NULL;
-         line = strtok_r(NULL, "\n", &endptr))
-    {
+    while (!found_daemon_hello) {
+        size_t linesz;
+        char* line = slurp_line(peer_out, &linesz);
+        if (line == NULL)
+            break;
+        rtrim(line, &linesz, "\r\n");
         struct daemon_hello dhello;
-        if (!found_daemon_hello &&
-            parse_daemon_hello(line, &dhello))
-        {
+        if (parse_daemon_hello(line, &dhello)) {
             xprintf(xstdout, "%s\n", line);
             xflush(xstdout);
             found_daemon_hello = true;
         } else if (error == NULL) {
-            rtrim(line, NULL, "\r\n");
             error = line;
         }
     }
@@ -394,10 +400,144 @@ try_reuse_current_daemon(void)
 }
 
 
+// Sessions running under this daemon, in memory the daemon shares
+// with every process it forks.  A session counts itself in when it
+// gets its connection; the daemon counts it out when it reaps it.
+// NULL if we're not a daemon or couldn't map the memory.
+static unsigned* daemon_nr_sessions;
+
+static void
+daemon_note_session_start(void)
+{
+    if (daemon_nr_sessions != NULL)
+        __atomic_fetch_add(daemon_nr_sessions, 1, __ATOMIC_RELAXED);
+}
+
+size_t
+stub_daemon_buffer_budget(void)
+{
+    if (daemon_nr_sessions == NULL)
+        return SIZE_MAX;
+
+    unsigned nr = __atomic_load_n(daemon_nr_sessions, __ATOMIC_RELAXED);
+    return STUB_DAEMON_BUFFER_BUDGET / XMAX(nr, 1);
+}
+
 static void
 daemon_sigchild_sigaction(int signum, siginfo_t* info, void* context)
 {
-    (void) waitpid(-1, NULL, WNOHANG);
+    // Signals coalesce, so reap everyone who's done.  Only we ever
+    // decrement the count, so checking first can't race.
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        if (daemon_nr_sessions != NULL &&
+            __atomic_load_n(daemon_nr_sessions, __ATOMIC_RELAXED) > 0)
+        {
+            __atomic_fetch_sub(daemon_nr_sessions, 1, __ATOMIC_RELAXED);
+        }
+}
+
+// With a worker pool, the daemon keeps POOL_SIZE forked workers
+// blocked in accept on the listening socket, so a client doesn't
+// wait for a fork.  A worker that gets a connection writes its pid
+// to the taken pipe and becomes an ordinary stub; the daemon then
+// forks a replacement.
+
+struct stub_daemon_pool {
+    unsigned size;
+    unsigned nr_idle;
+    pid_t* idle;
+    int taken_read;
+    int taken_write;
+};
+
+static void
+pool_worker_run(struct stub_daemon_pool* pool,
+                int listening_socket,
+                pid_t daemon_pid)
+{
+#ifdef __linux__
+    // Don't outlive a daemon that dies without killing us.
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != daemon_pid)
+        _exit(1);
+#endif
+
+    // Do what setup we can before there's a client waiting on it.
+    (void) api_level();
+    (void) boot_id();
+
+    int client_connection;
+    do {
+        WITH_IO_SIGNALS_ALLOWED();
+        client_connection = accept(listening_socket, NULL, NULL);
+    } while (client_connection == -1 && errno == EINTR);
+
+    // Count ourselves even if accept failed: the daemon will reap
+    // us either way.
+    daemon_note_session_start();
+    pid_t me = getpid();
+    write_all(pool->taken_write, &me, sizeof (me));
+    if (client_connection == -1)
+        _exit(1);
+
+#ifdef __linux__
+    (void) prctl(PR_SET_PDEATHSIG, 0);
+#endif
+    xdup3nc(client_connection, STDIN_FILENO, 0);
+    xdup3nc(client_connection, STDOUT_FILENO, 0);
+    if (client_connection > STDOUT_FILENO)
+        (void) close(client_connection);
+}
+
+// Fork workers until the pool is full.  Return true in a new worker
+// once it has a client.
+static bool
+pool_fill(struct stub_daemon_pool* pool, int listening_socket)
+{
+    pid_t daemon_pid = getpid();
+    while (pool->nr_idle < pool->size) {
+        pid_t child = fork();
+        if (child == (pid_t) -1) {
+            android_msg(ANDROID_LOG_WARN,
+                        "fork failed: %s",
+                        strerror(errno));
+            return false;
+        }
+
+        if (child == 0) {
+            trace_forked();
+            pool_worker_run(pool, listening_socket, daemon_pid);
+            return true;
+        }
+
+        pool->idle[pool->nr_idle++] = child;
+    }
+
+    return false;
+}
+
+static void
+pool_note_taken(struct stub_daemon_pool* pool)
+{
+    pid_t taken;
+    if (read_all(pool->taken_read, &taken, sizeof (taken))
+        != sizeof (taken))
+    {
+        die(ECOMM, "worker pool pipe closed");
+    }
+
+    for (unsigned i = 0; i < pool->nr_idle; ++i)
+        if (pool->idle[i] == taken) {
+            pool->idle[i] = pool->idle[--pool->nr_idle];
+            break;
+        }
+}
+
+static void
+pool_kill_idle(struct stub_daemon_pool* pool)
+{
+    for (unsigned i = 0; i < pool->nr_idle; ++i)
+        (void) kill(pool->idle[i], SIGTERM);
+    pool->nr_idle = 0;
 }
 
 enum stub_daemon_action
@@ -466,13 +606,33 @@ run_stub_daemon(struct stub_daemon_info info)
     xbind(control_socket, make_addr_unix_abstract_s(control_socket_name));
     xlisten(control_socket, 1);
 
+    struct stub_daemon_pool pool = {
+        .size = info.pool_size,
+    };
+
+    void* shared = mmap(NULL, sizeof (*daemon_nr_sessions),
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED)
+        daemon_nr_sessions = shared;
+
+    // Pool workers accept on their own, so the daemon watches the
+    // taken pipe in place of the listening socket, whose blocking
+    // mode the workers need.
     struct pollfd pollfds[] = {
         { listening_socket, POLLIN, 0 },
         { control_socket, POLLIN, 0 },
     };
 
-    for (unsigned i = 0; i < ARRAYSIZE(pollfds); ++i)
-        fd_set_blocking_mode(pollfds[i].fd, non_blocking);
+    if (pool.size > 0) {
+        pool.idle = xalloc(sizeof (*pool.idle) * pool.size);
+        xpipe(&pool.taken_read, &pool.taken_write);
+        pollfds[0].fd = pool.taken_read;
+        fd_set_blocking_mode(control_socket, non_blocking);
+    } else {
+        for (unsigned i = 0; i < ARRAYSIZE(pollfds); ++i)
+            fd_set_blocking_mode(pollfds[i].fd, non_blocking);
+    }
 
     if (info.daemonize)
         become_daemon(stub_daemon_setup, (void*) socket_name);
@@ -491,10 +651,14 @@ run_stub_daemon(struct stub_daemon_info info)
 
     for (;;) {
         SCOPED_RESLIST(rl_accept);
+        if (pool_fill(&pool, listening_socket))
+            return STUB_DAEMON_RUN_STUB;
+
         int pollret = xpoll(pollfds, ARRAYSIZE(pollfds), DAEMON_TIMEOUT_MS);
         if (pollret == 0) {
             android_msg(ANDROID_LOG_INFO,
                         "fb-adb daemon timed out; exiting");
+            pool_kill_idle(&pool);
             return STUB_DAEMON_EXIT_PROGRAM;
         }
 
@@ -506,7 +670,16 @@ run_stub_daemon(struct stub_daemon_info info)
             if (handle_control_connection(control_connection,
                                           socket_name,
                                           &action))
+            {
+                pool_kill_idle(&pool);
                 return action;
+            }
+            continue;
+        }
+
+        if (pool.size > 0) {
+            if (pollfds[0].revents)
+                pool_note_taken(&pool);
             continue;
         }
 
@@ -523,6 +696,8 @@ run_stub_daemon(struct stub_daemon_info info)
             }
 
             if (child == 0) {
+                trace_forked();
+                daemon_note_session_start();
                 xdup3nc(client_connection, STDIN_FILENO, 0);
                 xdup3nc(client_connection, STDOUT_FILENO, 0);
                 return STUB_DAEMON_RUN_STUB;
@@ -10,11 +10,13 @@
  */
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include "proto.h"
 
 struct stub_daemon_info {
     unsigned daemonize : 1;
     unsigned replace : 1;
+    unsigned pool_size; // Number of pre-forked workers; zero for none
 };
 
 enum stub_daemon_action {
@@ -25,3 +27,8 @@ enum stub_daemon_action {
 enum stub_daemon_action run_stub_daemon(struct stub_daemon_info info);
 void start_daemon_via_service_hack(const char* package_name);
 void stop_daemon(void);
+
+// Bytes of stdio buffering a session should allow itself: its share
+// of STUB_DAEMON_BUFFER_BUDGET if it's running under a daemon and
+// SIZE_MAX otherwise.
+size_t stub_daemon_buffer_budget(void);
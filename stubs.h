@@ -11,8 +11,11 @@
 #pragma once
 #include <stddef.h>
 
+// Each stub is a single LZ4 block: ZDATA holds ZSIZE compressed
+// bytes that decompress to SIZE bytes of executable.
 struct fbadb_stub {
-    const void* data;
+    const void* zdata;
+    size_t zsize;
     size_t size;
 };
 
@@ -0,0 +1,77 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+
+// On-disk tar header layouts, shared by ctar, which writes them, and
+// the host-side extractor behind fget --recursive, which reads them.
+
+#define TAR_BLOCK_SIZE 512
+
+struct tar_hdr_v7 {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+};
+
+struct tar_hdr_ustar {
+    struct tar_hdr_v7 v7;
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct tar_hdr_gnu {
+    struct tar_hdr_v7 v7;
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char atime[12];
+    char ctime[12];
+    char offset[12];
+    char longnames[4];
+    char unused[1];
+    struct tar_sparse_entry {
+        char offset[12];
+        char numbytes[12];
+    } sparse[4];
+    char isextended[1];
+    char realsize[12];
+    char pad[17];
+};
+
+// Follows a GNU sparse header with isextended set.
+struct tar_hdr_gnu_sparse_ext {
+    struct tar_sparse_entry sparse[21];
+    char isextended[1];
+    char pad[7];
+};
+
+union tar_block {
+    struct tar_hdr_v7 v7;
+    struct tar_hdr_ustar ustar;
+    struct tar_hdr_gnu gnu;
+    struct tar_hdr_gnu_sparse_ext gnu_sparse_ext;
+    char data[512];
+};
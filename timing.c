@@ -0,0 +1,146 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include "util.h"
+#include "fs.h"
+#include "json.h"
+#include "constants.h"
+#include "timing.h"
+
+#ifdef HAVE_TIMING
+
+// Events can happen inside reslists that are gone by the time we
+// report, so keep everything in static storage.
+
+struct timing_event {
+    const char* event;
+    double start;
+    double end;
+    bool span;
+    char detail[MAX_TIMING_DETAIL];
+};
+
+bool timing_on;
+static const char* timing_dest;
+static double timing_origin;
+static double timing_origin_realtime;
+static struct timing_event timing_events[MAX_TIMING_EVENTS];
+static unsigned timing_nr_events;
+static unsigned timing_nr_dropped;
+
+double
+timing_now(void)
+{
+    return xclock_gettime(CLOCK_MONOTONIC);
+}
+
+void
+timing_start(const char* dest)
+{
+    timing_dest = dest;
+    timing_origin = timing_now();
+    timing_origin_realtime = xclock_gettime(CLOCK_REALTIME);
+    timing_on = true;
+}
+
+static void
+timing_record(double start,
+              double end,
+              bool span,
+              const char* event,
+              const char* detail)
+{
+    if (timing_nr_events == MAX_TIMING_EVENTS) {
+        timing_nr_dropped += 1;
+        return;
+    }
+
+    struct timing_event* te = &timing_events[timing_nr_events++];
+    te->event = event;
+    te->start = start;
+    te->end = end;
+    te->span = span;
+    if (detail)
+        snprintf(te->detail, sizeof (te->detail), "%s", detail);
+}
+
+void
+timing_mark_1(const char* event, const char* detail)
+{
+    double now = timing_now();
+    timing_record(now, now, false, event, detail);
+}
+
+void
+timing_span_end_1(double start, const char* event, const char* detail)
+{
+    timing_record(start, timing_now(), true, event, detail);
+}
+
+static uint64_t
+timing_us(double seconds)
+{
+    return seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+}
+
+void
+timing_report(void)
+{
+    if (!timing_on)
+        return;
+
+    SCOPED_RESLIST(rl);
+    timing_on = false;
+
+    FILE* out = xstderr;
+    if (strcmp(timing_dest, "-") != 0)
+        out = xfdopen(xopen(timing_dest, O_WRONLY | O_CREAT | O_TRUNC, 0666),
+                      "w");
+
+    struct json_writer* writer = json_writer_create(out);
+    json_begin_object(writer);
+    json_begin_field(writer, "start_unix_us");
+    json_emit_u64(writer, timing_us(timing_origin_realtime));
+    json_begin_field(writer, "total_us");
+    json_emit_u64(writer, timing_us(timing_now() - timing_origin));
+    json_begin_field(writer, "events");
+    json_begin_array(writer);
+    for (unsigned i = 0; i < timing_nr_events; ++i) {
+        const struct timing_event* te = &timing_events[i];
+        json_begin_object(writer);
+        json_begin_field(writer, "event");
+        json_emit_string(writer, te->event);
+        json_begin_field(writer, "t_us");
+        json_emit_u64(writer, timing_us(te->start - timing_origin));
+        if (te->span) {
+            json_begin_field(writer, "dur_us");
+            json_emit_u64(writer, timing_us(te->end - te->start));
+        }
+        if (te->detail[0] != '\0') {
+            json_begin_field(writer, "detail");
+            json_emit_string(writer, te->detail);
+        }
+        json_end_object(writer);
+    }
+    json_end_array(writer);
+    if (timing_nr_dropped > 0) {
+        json_begin_field(writer, "dropped");
+        json_emit_u64(writer, timing_nr_dropped);
+    }
+    json_end_object(writer);
+    xputc('\n', out);
+    xflush(out);
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+
+// Phase timing for connection setup.  After timing_start, each
+// timing_mark records the monotonic time at which some step of
+// getting a command running on the device happened, and each
+// timing_span_end records when a step began and how long it took.
+// timing_report writes what we've recorded as JSON.  The host's
+// --timing option turns all this on; in builds configured with
+// --disable-timing, and in the stub, it compiles to nothing.
+
+#if defined(ENABLE_TIMING) && defined(FBADB_MAIN)
+# define HAVE_TIMING 1
+#endif
+
+#ifndef HAVE_TIMING
+#define timing_start(...) ({;})
+#define timing_mark(...) ({;})
+#define timing_span_begin() 0.0
+#define timing_span_end(start, ...) ({ (void) (start); })
+#define timing_report() ({;})
+#else
+extern bool timing_on;
+#define timing_mark(...) ({ if (timing_on) timing_mark_1(__VA_ARGS__); })
+#define timing_span_begin() (timing_on ? timing_now() : 0.0)
+#define timing_span_end(...) ({ if (timing_on) timing_span_end_1(__VA_ARGS__); })
+
+// Start recording.  Write the report to the file named DEST, or to
+// standard error if DEST is "-".
+void timing_start(const char* dest);
+
+// Record EVENT, with optional DETAIL (which we copy), as happening
+// now.
+void timing_mark_1(const char* event, const char* detail);
+
+// Record EVENT as having run from START (as returned by
+// timing_span_begin) until now.
+void timing_span_end_1(double start, const char* event, const char* detail);
+
+double timing_now(void);
+
+// Write the report, if we're recording.  Call at most once.
+void timing_report(void);
+#endif
@@ -0,0 +1,556 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "util.h"
+#include "fs.h"
+#include "constants.h"
+#include "tar.h"
+#include "tree.h"
+#include "untar.h"
+
+#ifndef __unused
+# define __unused __attribute__((unused))
+#endif
+
+// A symbolic link the archive created.  Nothing in the rest of the
+// archive may go through one.
+struct untar_link {
+    RB_ENTRY(untar_link) link;
+    char path[0];
+};
+
+static int
+untar_link_cmp(struct untar_link* left, struct untar_link* right)
+{
+    return strcmp(left->path, right->path);
+}
+
+RB_HEAD(untar_links, untar_link);
+RB_PROTOTYPE_STATIC(untar_links, untar_link, link, untar_link_cmp);
+RB_GENERATE_STATIC(untar_links, untar_link, link, untar_link_cmp);
+
+// A directory whose final attributes we apply only once we're done
+// creating things in it.
+struct untar_dir {
+    const char* path;
+    mode_t mode;
+    time_t mtime;
+};
+
+struct untar_ctx {
+    int fd;
+    const char* archive_root;
+    const char* dest_root;
+    const struct untar_opts* opts;
+    struct reslist* keep; // Owns what outlives a single member
+    uint8_t* buf;
+    struct untar_links links;
+    struct growable_buffer dirs;
+    size_t nr_dirs;
+};
+
+struct untar_member {
+    const char* name;     // As archived, without trailing slashes
+    const char* rel;      // Relative to archive_root
+    const char* path;     // Where we put it
+    char type;
+    mode_t mode;
+    time_t mtime;
+    uint64_t size;        // Bytes of data in the archive
+};
+
+static uint64_t
+tar_number(const char* name,
+           const char* field_name,
+           const char* field,
+           size_t field_size)
+{
+    const uint8_t* pos = (const uint8_t*) field;
+    const uint8_t* end = pos + field_size;
+    uint64_t value = 0;
+
+    if (*pos & 0x80) {
+        if (*pos & 0x40)
+            die(ECOMM, "%s: negative %s", name, field_name);
+        value = *pos++ & 0x3F;
+        for (; pos < end; ++pos) {
+            if (value >> 56)
+                die(ECOMM, "%s: %s too large", name, field_name);
+            value = (value << 8) | *pos;
+        }
+        return value;
+    }
+
+    while (pos < end && *pos == ' ')
+        pos += 1;
+    for (; pos < end && *pos >= '0' && *pos <= '7'; ++pos) {
+        if (value >> 61)
+            die(ECOMM, "%s: %s too large", name, field_name);
+        value = value * 8 + (*pos - '0');
+    }
+    if (pos < end && *pos != '\0' && *pos != ' ')
+        die(ECOMM, "%s: invalid %s", name, field_name);
+    return value;
+}
+
+#define TAR_NUMBER(name, field_name, field) \
+    tar_number((name), (field_name), (field), sizeof (field))
+
+static bool
+tar_block_zero_p(const union tar_block* block)
+{
+    for (size_t i = 0; i < sizeof (block->data); ++i)
+        if (block->data[i] != '\0')
+            return false;
+    return true;
+}
+
+static bool
+tar_checksum_ok_p(const union tar_block* hdr)
+{
+    // Some tars historically summed signed chars, so accept either.
+    unsigned usum = 0;
+    int ssum = 0;
+    const char* checksum = hdr->v7.checksum;
+    for (size_t i = 0; i < sizeof (hdr->data); ++i) {
+        bool in_checksum =
+            &hdr->data[i] >= checksum &&
+            &hdr->data[i] < checksum + sizeof (hdr->v7.checksum);
+        char c = in_checksum ? ' ' : hdr->data[i];
+        usum += (uint8_t) c;
+        ssum += (signed char) c;
+    }
+    uint64_t stored = TAR_NUMBER("header", "checksum", hdr->v7.checksum);
+    return stored == usum || stored == (uint64_t) (int64_t) ssum;
+}
+
+static void
+untar_read(struct untar_ctx* ctx, void* buf, size_t sz)
+{
+    if (read_all(ctx->fd, buf, sz) != sz)
+        die(ECOMM, "truncated archive");
+}
+
+// Move SIZE archive bytes to FILE at OFFSET, or discard them if FILE
+// is -1.
+static void
+untar_copy(struct untar_ctx* ctx, int file, uint64_t offset, uint64_t size)
+{
+    while (size > 0) {
+        size_t chunksz = XMIN(size, (uint64_t) UNTAR_BUFFER_SIZE);
+        untar_read(ctx, ctx->buf, chunksz);
+        if (file != -1)
+            pwrite_all(file, ctx->buf, chunksz, offset);
+        offset += chunksz;
+        size -= chunksz;
+    }
+}
+
+static void
+untar_skip_padding(struct untar_ctx* ctx, uint64_t size)
+{
+    size_t pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    untar_read(ctx, ctx->buf, pad);
+}
+
+static char*
+tar_member_name(const union tar_block* hdr)
+{
+    char* name = xstrndup(hdr->v7.name, sizeof (hdr->v7.name));
+    // GNU headers keep other things where ustar keeps the prefix.
+    if (memcmp(hdr->ustar.magic, "ustar", sizeof (hdr->ustar.magic)) == 0 &&
+        hdr->ustar.prefix[0] != '\0')
+    {
+        name = xaprintf("%s/%s",
+                        xstrndup(hdr->ustar.prefix, sizeof (hdr->ustar.prefix)),
+                        name);
+    }
+
+    size_t length = strlen(name);
+    while (length > 1 && name[length - 1] == '/')
+        name[--length] = '\0';
+    return name;
+}
+
+// Refuse names that would escape the destination.
+static void
+check_member_rel(struct untar_ctx* ctx, const char* name, const char* rel)
+{
+    const char* component = rel;
+    while (*component != '\0') {
+        const char* sep = strchr(component, '/');
+        size_t length = sep ? (size_t) (sep - component) : strlen(component);
+        if (length == 0 ||
+            (length == 1 && component[0] == '.') ||
+            (length == 2 && component[0] == '.' && component[1] == '.'))
+        {
+            die(ECOMM, "unsafe archive member name %s", name);
+        }
+
+        if (sep == NULL)
+            break;
+
+        size_t prefix_length = sep - rel;
+        struct untar_link* search = alloca(sizeof (*search) + prefix_length + 1);
+        memcpy(search->path, rel, prefix_length);
+        search->path[prefix_length] = '\0';
+        if (RB_FIND(untar_links, &ctx->links, search) != NULL)
+            die(ECOMM, "archive member %s lies under a symbolic link", name);
+
+        component = sep + 1;
+    }
+}
+
+static const char*
+member_rel(struct untar_ctx* ctx, const char* name)
+{
+    const char* root = ctx->archive_root;
+    size_t root_length = strlen(root);
+
+    if (strcmp(root, ".") == 0) {
+        while (name[0] == '.' && name[1] == '/')
+            name += 2;
+        return strcmp(name, ".") == 0 ? "" : name;
+    }
+
+    if (strcmp(name, root) == 0)
+        return "";
+    if (string_starts_with_p(name, root) && name[root_length] == '/')
+        return name + root_length + 1;
+    die(ECOMM, "unexpected archive member %s", name);
+}
+
+// Clear the way for a new file at PATH.  If KEEP_DIRECTORY and
+// there's already a directory there, leave it alone and return true.
+static bool
+make_room(const char* path, bool keep_directory)
+{
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        if (errno == ENOENT)
+            return false;
+        die_errno("lstat(\"%s\")", path);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (keep_directory)
+            return true;
+        if (rmdir(path) == -1)
+            die_errno("rmdir(\"%s\")", path);
+    } else if (unlink(path) == -1) {
+        die_errno("unlink(\"%s\")", path);
+    }
+
+    return false;
+}
+
+static void
+set_path_mtime(const char* path, time_t mtime)
+{
+    struct timeval times[2] = { { mtime, 0 }, { mtime, 0 } };
+    if (utimes(path, times) == -1)
+        die_errno("utimes(\"%s\")", path);
+}
+
+// Read the sparse map that follows HDR.  Return the runs, which
+// belong to the current reslist, and set *NR_RUNS_OUT.
+static struct tar_sparse_entry*
+read_sparse_map(struct untar_ctx* ctx,
+                const union tar_block* hdr,
+                size_t* nr_runs_out)
+{
+    struct growable_buffer gb = { 0 };
+    size_t nr_runs = 0;
+    const struct tar_sparse_entry* entries = hdr->gnu.sparse;
+    size_t nr_entries = ARRAYSIZE(hdr->gnu.sparse);
+    bool extended = hdr->gnu.isextended[0] != '\0';
+    union tar_block ext;
+
+    for (;;) {
+        for (size_t i = 0; i < nr_entries; ++i) {
+            if (entries[i].offset[0] == '\0' && entries[i].numbytes[0] == '\0')
+                break;
+            while (gb.bufsz < (nr_runs + 1) * sizeof (*entries))
+                grow_buffer_dwim(&gb);
+            ((struct tar_sparse_entry*) gb.buf)[nr_runs++] = entries[i];
+        }
+
+        if (!extended)
+            break;
+
+        untar_read(ctx, &ext, sizeof (ext));
+        entries = ext.gnu_sparse_ext.sparse;
+        nr_entries = ARRAYSIZE(ext.gnu_sparse_ext.sparse);
+        extended = ext.gnu_sparse_ext.isextended[0] != '\0';
+    }
+
+    *nr_runs_out = nr_runs;
+    return (struct tar_sparse_entry*) gb.buf;
+}
+
+static void
+extract_file(struct untar_ctx* ctx,
+             const struct untar_member* m,
+             const union tar_block* hdr)
+{
+    const struct untar_opts* opts = ctx->opts;
+    size_t nr_runs = 0;
+    struct tar_sparse_entry* runs = NULL;
+    uint64_t realsize = m->size;
+
+    if (m->type == 'S') {
+        runs = read_sparse_map(ctx, hdr, &nr_runs);
+        realsize = TAR_NUMBER(m->name, "realsize", hdr->gnu.realsize);
+    }
+
+    bool chmod_explicit = opts->preserve || opts->chmod_explicit;
+    mode_t chmod_explicit_modes = opts->chmod_explicit
+        ? opts->chmod_explicit_modes
+        : (m->mode & 0777);
+    mode_t creat_mode = (chmod_explicit ? 0200 : 0666);
+
+    make_room(m->path, false);
+    int file = xopen(m->path,
+                     O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+                     creat_mode);
+
+    if (runs == NULL) {
+        if (m->size > 0)
+            fallocate_if_supported(file, m->size);
+        untar_copy(ctx, file, 0, m->size);
+    } else {
+        uint64_t archived = 0;
+        for (size_t i = 0; i < nr_runs; ++i) {
+            uint64_t offset = TAR_NUMBER(m->name, "sparse offset", runs[i].offset);
+            uint64_t length = TAR_NUMBER(m->name, "sparse numbytes", runs[i].numbytes);
+            if (offset > realsize ||
+                length > realsize - offset ||
+                length > m->size - archived)
+            {
+                die(ECOMM, "%s: invalid sparse map", m->name);
+            }
+            untar_copy(ctx, file, offset, length);
+            archived += length;
+        }
+        if (archived != m->size)
+            die(ECOMM, "%s: invalid sparse map", m->name);
+        xftruncate(file, realsize);
+    }
+
+    untar_skip_padding(ctx, m->size);
+
+    if (opts->preserve) {
+        struct timeval times[2] = { { m->mtime, 0 }, { m->mtime, 0 } };
+#ifdef HAVE_FUTIMES
+        if (futimes(file, times) == -1)
+            die_errno("futimes");
+#else
+        if (utimes(m->path, times) == -1)
+            die_errno("utimes");
+#endif
+    }
+
+    if (chmod_explicit)
+        if (fchmod(file, chmod_explicit_modes) == -1)
+            die_errno("fchmod");
+
+    if (opts->sync)
+        xfsync(file);
+}
+
+static void
+extract_directory(struct untar_ctx* ctx, const struct untar_member* m)
+{
+    const struct untar_opts* opts = ctx->opts;
+    // Until we're done, make sure we can write the directory even if
+    // its archived mode says otherwise.
+    if (!make_room(m->path, true) &&
+        mkdir(m->path, opts->preserve ? 0700 | (m->mode & 0777) : 0777) == -1)
+    {
+        die_errno("mkdir(\"%s\")", m->path);
+    }
+
+    if (!opts->preserve && !opts->sync)
+        return;
+
+    WITH_CURRENT_RESLIST(ctx->keep);
+    while (ctx->dirs.bufsz < (ctx->nr_dirs + 1) * sizeof (struct untar_dir))
+        grow_buffer_dwim(&ctx->dirs);
+    struct untar_dir* dir = &((struct untar_dir*) ctx->dirs.buf)[ctx->nr_dirs++];
+    dir->path = xstrdup(m->path);
+    dir->mode = m->mode & 0777;
+    dir->mtime = m->mtime;
+}
+
+static void
+extract_symlink(struct untar_ctx* ctx,
+                const struct untar_member* m,
+                const union tar_block* hdr)
+{
+    const char* target = xstrndup(hdr->v7.linkname, sizeof (hdr->v7.linkname));
+    make_room(m->path, false);
+    if (symlink(target, m->path) == -1)
+        die_errno("symlink(\"%s\")", m->path);
+
+    WITH_CURRENT_RESLIST(ctx->keep);
+    size_t rel_length = strlen(m->rel);
+    struct untar_link* link = xalloc(sizeof (*link) + rel_length + 1);
+    memcpy(link->path, m->rel, rel_length + 1);
+    RB_INSERT(untar_links, &ctx->links, link);
+}
+
+static void
+extract_hardlink(struct untar_ctx* ctx,
+                 const struct untar_member* m,
+                 const union tar_block* hdr)
+{
+    const char* target_name =
+        xstrndup(hdr->v7.linkname, sizeof (hdr->v7.linkname));
+    const char* target_rel = member_rel(ctx, target_name);
+    check_member_rel(ctx, target_name, target_rel);
+    const char* target = target_rel[0] != '\0'
+        ? xaprintf("%s/%s", ctx->dest_root, target_rel)
+        : ctx->dest_root;
+
+    // Only link to a file the archive gave us, which means a regular
+    // file: hard links to symbolic links are nothing we write.
+    struct stat st;
+    if (lstat(target, &st) == -1)
+        die_errno("lstat(\"%s\")", target);
+    if (!S_ISREG(st.st_mode))
+        die(ECOMM, "%s: hard link to non-file %s", m->name, target_name);
+
+    make_room(m->path, false);
+    if (link(target, m->path) == -1)
+        die_errno("link(\"%s\")", m->path);
+}
+
+static void
+extract_fifo(struct untar_ctx* ctx, const struct untar_member* m)
+{
+    make_room(m->path, false);
+    if (mkfifo(m->path, ctx->opts->preserve ? (m->mode & 0777) : 0666) == -1)
+        die_errno("mkfifo(\"%s\")", m->path);
+    if (ctx->opts->preserve) {
+        if (chmod(m->path, m->mode & 0777) == -1)
+            die_errno("chmod(\"%s\")", m->path);
+        set_path_mtime(m->path, m->mtime);
+    }
+}
+
+// Extract one member.  Return false at the end of the archive.
+static bool
+extract_member(struct untar_ctx* ctx)
+{
+    SCOPED_RESLIST(rl);
+    union tar_block hdr;
+    _Static_assert(sizeof (hdr) == TAR_BLOCK_SIZE, "tar spec");
+    size_t nr_read = read_all(ctx->fd, &hdr, sizeof (hdr));
+    if (nr_read == 0 || (nr_read == sizeof (hdr) && tar_block_zero_p(&hdr)))
+        return false;
+    if (nr_read != sizeof (hdr))
+        die(ECOMM, "truncated archive");
+    if (!tar_checksum_ok_p(&hdr))
+        die(ECOMM, "bad tar header checksum");
+
+    struct untar_member m;
+    memset(&m, 0, sizeof (m));
+    m.name = tar_member_name(&hdr);
+    m.rel = member_rel(ctx, m.name);
+    check_member_rel(ctx, m.name, m.rel);
+    m.path = m.rel[0] != '\0'
+        ? xaprintf("%s/%s", ctx->dest_root, m.rel)
+        : ctx->dest_root;
+    m.type = hdr.v7.typeflag;
+    m.mode = TAR_NUMBER(m.name, "mode", hdr.v7.mode);
+    m.mtime = TAR_NUMBER(m.name, "mtime", hdr.v7.mtime);
+    m.size = TAR_NUMBER(m.name, "size", hdr.v7.size);
+
+    switch (m.type) {
+        case '\0':
+        case '0':
+        case '7':
+        case 'S':
+            extract_file(ctx, &m, &hdr);
+            return true;
+        case '5':
+            extract_directory(ctx, &m);
+            break;
+        case '1':
+            extract_hardlink(ctx, &m, &hdr);
+            break;
+        case '2':
+            extract_symlink(ctx, &m, &hdr);
+            break;
+        case '6':
+            extract_fifo(ctx, &m);
+            break;
+        case '3':
+        case '4':
+            xprintf(xstderr, "%s: WARNING: not creating device %s\n",
+                    prgname, m.name);
+            break;
+        default:
+            die(ECOMM, "%s: unsupported tar member type '%c'",
+                m.name, m.type);
+    }
+
+    untar_copy(ctx, -1, 0, m.size);
+    untar_skip_padding(ctx, m.size);
+    return true;
+}
+
+void
+untar(int fd,
+      const char* archive_root,
+      const char* dest_root,
+      const struct untar_opts* opts)
+{
+    SCOPED_RESLIST(rl);
+    struct untar_ctx ctx = {
+        .fd = fd,
+        .archive_root = archive_root,
+        .dest_root = dest_root,
+        .opts = opts,
+        .keep = reslist_create(),
+        .buf = xalloc(UNTAR_BUFFER_SIZE),
+    };
+    RB_INIT(&ctx.links);
+
+    while (extract_member(&ctx))
+        continue;
+
+    // Let the sender finish writing its end-of-archive padding.
+    while (read_all(fd, ctx.buf, UNTAR_BUFFER_SIZE) > 0)
+        continue;
+
+    // Children first, so that setting a parent's mtime comes after
+    // everything that changes it.
+    struct untar_dir* dirs = (struct untar_dir*) ctx.dirs.buf;
+    for (size_t i = ctx.nr_dirs; i > 0; --i) {
+        struct untar_dir* dir = &dirs[i - 1];
+        if (opts->preserve) {
+            set_path_mtime(dir->path, dir->mtime);
+            if (chmod(dir->path, dir->mode) == -1)
+                die_errno("chmod(\"%s\")", dir->path);
+        }
+        if (opts->sync) {
+            SCOPED_RESLIST(rl_dir);
+            xfsync(xopen(dir->path, O_RDONLY | O_DIRECTORY, 0));
+        }
+    }
+}
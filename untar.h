@@ -0,0 +1,32 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct untar_opts {
+    bool preserve; // Apply archived mtimes and UGO bits
+    bool sync;     // fsync what we write before returning
+    bool chmod_explicit;
+    mode_t chmod_explicit_modes; // For regular files, if chmod_explicit
+};
+
+// Extract the tar stream ctar writes to FD.  The archive member named
+// ARCHIVE_ROOT becomes DEST_ROOT, and members under ARCHIVE_ROOT go
+// under DEST_ROOT.  We die on any other member, on absolute names and
+// names with ".." components, and on names that would lead through a
+// symbolic link the archive itself created.  Members are created one
+// at a time, in stream order, in this process (see util.h on threads);
+// the link, not the disk, limits how fast we can go.
+void untar(int fd,
+           const char* archive_root,
+           const char* dest_root,
+           const struct untar_opts* opts);
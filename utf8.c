@@ -20,8 +20,15 @@
  * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE. */
+#include <stddef.h>
 #include "utf8.h"
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 static const uint8_t utf8d[] = {
   // The first part of the table maps bytes to character classes that
   // to reduce the size of the transition table and create bitmasks.
@@ -49,3 +56,49 @@ utf8_decode(uint32_t* state, uint32_t byte) {
   *state = utf8d[256 + *state + type];
   return *state;
 }
+
+// Return whether the 16 bytes at S are all ASCII.
+static int
+utf8_ascii16_p(const uint8_t* s)
+{
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) s)) == 0;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  return vmaxvq_u8(vld1q_u8(s)) < 0x80;
+#else
+  uint8_t any = 0;
+  for (int i = 0; i < 16; ++i)
+    any |= s[i];
+  return any < 0x80;
+#endif
+}
+
+size_t
+utf8_valid_prefix(const uint8_t* s, size_t n)
+{
+  size_t valid = 0;
+  size_t i = 0;
+  while (i < n) {
+    if (i + 16 <= n && utf8_ascii16_p(s + i)) {
+      i += 16;
+      valid = i;
+      continue;
+    }
+
+    if (s[i] < 0x80) {
+      valid = ++i;
+      continue;
+    }
+
+    // Run the DFA over one multibyte sequence.
+    uint32_t state = UTF8_ACCEPT;
+    do {
+      if (utf8_decode(&state, s[i++]) == UTF8_REJECT)
+        return valid;
+    } while (state != UTF8_ACCEPT && i < n);
+    if (state != UTF8_ACCEPT)
+      return valid;
+    valid = i;
+  }
+  return valid;
+}
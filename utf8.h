@@ -2,7 +2,12 @@
 // See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
 
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #define UTF8_ACCEPT 0
 #define UTF8_REJECT 12
 uint32_t utf8_decode(uint32_t* state, uint32_t byte);
+
+// Return the length of the longest prefix of the N bytes at S that
+// is complete, valid UTF-8.  Runs of ASCII go quickly.
+size_t utf8_valid_prefix(const uint8_t* s, size_t n);
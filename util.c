@@ -31,6 +31,9 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <libgen.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include "fs.h"
 #include "valgrind.h"
 
@@ -55,6 +58,7 @@
 
 #include "util.h"
 #include "constants.h"
+#include "proto.h"
 
 struct error_converter_record {
     LIST_ENTRY(error_converter_record) link;
@@ -76,6 +80,7 @@ static struct reslist* _reslist_current;
 static struct errhandler* current_errh;
 const char* prgname;
 const char* orig_argv0;
+uint64_t nr_cleanups_allocated;
 
 FILE* xstdin;
 FILE* xstdout;
@@ -283,6 +288,7 @@ cleanup_allocate(void)
     if (cl == NULL)
         die_oom();
 
+    nr_cleanups_allocated += 1;
     cl->r.type = RES_CLEANUP;
     reslist_insert_head(_reslist_current, &cl->r);
     return cl;
@@ -602,6 +608,7 @@ static void
 handle_quit_signal(int signum)
 {
     signal_quit_in_progress = signum;
+    trace_dump_fatal();
     if (hack_die_on_quit)
         die(ERR_QUIT_SIGNAL_FIRST - signum, "quit");
 
@@ -779,6 +786,32 @@ try_flush_xstream(void* data)
     xflush((FILE*) data);
 }
 
+static void
+run_main(struct main_info* mi)
+{
+    const char* orig_prgname = prgname;
+    struct errinfo ei = { .want_msg = true };
+    if (catch_error(main1, mi, &ei)) {
+        if (ei.prgname == NULL)
+            ei.prgname = orig_prgname;
+        mi->ret = 1;
+        trace_dump_fatal();
+        (void) catch_error(try_flush_xstream, xstdout, NULL);
+        (void) catch_error(try_flush_xstream, xstderr, NULL);
+        // We shouldn't complain about perfectly reasonable failures
+        // writing to broken output streams.
+        if (ei.err == EPIPE &&
+            (string_starts_with_p(ei.msg, "write(1): ") ||
+             string_starts_with_p(ei.msg, "write(2): ")))
+        {
+            dbg("ignoring EPIPE on standard stream");
+        } else {
+            (void) catch_error(print_toplevel_error, &ei, NULL);
+        }
+    }
+}
+
+
 int
 main(int argc, char** argv)
 {
@@ -810,26 +843,8 @@ main(int argc, char** argv)
     dbglock_init();
     orig_argv0 = argv[0];
     prgname = xbasename(argv[0]);
-    const char* orig_prgname = prgname;
-    struct errinfo ei = { .want_msg = true };
-    if (catch_error(main1, &mi, &ei)) {
-        if (ei.prgname == NULL)
-            ei.prgname = orig_prgname;
-        mi.ret = 1;
-        (void) catch_error(try_flush_xstream, xstdout, NULL);
-        (void) catch_error(try_flush_xstream, xstderr, NULL);
-        // We shouldn't complain about perfectly reasonable failures
-        // writing to broken output streams.
-        if (ei.err == EPIPE &&
-            (string_starts_with_p(ei.msg, "write(1): ") ||
-             string_starts_with_p(ei.msg, "write(2): ")))
-        {
-            dbg("ignoring EPIPE on standard stream");
-        } else {
-            (void) catch_error(print_toplevel_error, &ei, NULL);
-        }
-    }
-
+    trace_init();
+    run_main(&mi);
     empty_reslist(&reslist_top);
     return mi.ret;
 }
@@ -1088,6 +1103,51 @@ reset_orig_signal_context(struct saved_signal_context* ssc)
     (void) sigprocmask(SIG_SETMASK, &orig_sigmask, &ssc->saved_sigmask);
 }
 
+// Close what exec would have closed for us.
+static void
+close_cloexec_fds(void)
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+        return;
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        char* endptr;
+        long fd = strtol(de->d_name, &endptr, 10);
+        if (endptr == de->d_name || *endptr != '\0' ||
+            fd < 3 || fd == dirfd(dir))
+        {
+            continue;
+        }
+
+        int fdflags = fcntl(fd, F_GETFD);
+        if (fdflags != -1 && (fdflags & FD_CLOEXEC))
+            (void) close(fd);
+    }
+
+    (void) closedir(dir);
+}
+
+void
+run_main_in_child(int argc, char** argv)
+{
+    struct saved_signal_context ssc;
+    reset_orig_signal_context(&ssc);
+    VERIFY(signal(SIGPIPE, SIG_IGN) != SIG_ERR);
+    close_cloexec_fds();
+    trace_forked();
+
+    struct main_info mi;
+    mi.argc = argc;
+    mi.argv = argv;
+    prgname = xbasename(argv[0]);
+    run_main(&mi);
+
+    // Don't run our parent's cleanups: they're its business.
+    _exit(mi.ret);
+}
+
 static void
 restore_saved_signal_context(struct saved_signal_context* ssc)
 {
@@ -1544,6 +1604,35 @@ api_level()
 #endif
 }
 
+const char*
+boot_id(void)
+{
+    static char cached_boot_id[FB_ADB_BOOT_ID_LENGTH + 1];
+    if (cached_boot_id[0] == '\0') {
+        char buf[FB_ADB_BOOT_ID_LENGTH + 1] = { 0 };
+        int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            ssize_t nr_read;
+            do {
+                nr_read = read(fd, buf, FB_ADB_BOOT_ID_LENGTH);
+            } while (nr_read == -1 && errno == EINTR);
+            close(fd);
+            if (nr_read != FB_ADB_BOOT_ID_LENGTH)
+                buf[0] = '\0';
+        }
+
+        // Keep the hello line's layout fixed no matter what we read.
+        for (size_t i = 0; i < FB_ADB_BOOT_ID_LENGTH; ++i)
+            if (!isxdigit((unsigned char) buf[i]) && buf[i] != '-')
+                buf[0] = '\0';
+        if (buf[0] == '\0')
+            memset(buf, '0', FB_ADB_BOOT_ID_LENGTH);
+        memcpy(cached_boot_id, buf, sizeof (buf));
+    }
+
+    return cached_boot_id;
+}
+
 const char*
 maybe_my_exe(const char* exename)
 {
@@ -1603,6 +1692,7 @@ become_daemon(void (*daemon_setup)(void* setup_data),
 
     xclose(status_pipe[0]);
     status_pipe[0] = -1;
+    trace_forked();
 
     if (setsid() == (pid_t) -1)
         die_errno("setsid");
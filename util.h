@@ -55,6 +55,12 @@ static inline bool verify_dummy(bool x) { return x; }
 //
 // The only operations that can affect the _reslist_current are
 // SCOPED_RESLIST and WITH_CURRENT_RESLIST.
+//
+// There's one _reslist_current and one die() unwinding stack per
+// process, and nothing guards either, so fb-adb runs no threads.
+// When we want work done concurrently, we fork worker processes,
+// which can fail without taking their parent down, or we have the
+// kernel do it for us, e.g., with readahead.
 
 typedef void (*cleanupfn)(void* data);
 
@@ -128,6 +134,11 @@ void _reslist_guard_pop(struct reslist** saved_rl);
 // so can fail), but the new cleanup owns no resource.
 struct cleanup* cleanup_allocate(void);
 
+// Number of times cleanup_allocate has succeeded.  Every allocation
+// a reslist owns costs one, so this counter tells benchmarks how much
+// code allocates.
+extern uint64_t nr_cleanups_allocated;
+
 // Commit the cleanup object to a resource.  The cleanup object must
 // have been previously allocated with cleanup_allocate.  A given
 // cleanup object can be committed to a resource once.  When a cleanup
@@ -347,12 +358,21 @@ extern bool hack_die_on_quit;
 
 unsigned api_level(void);
 
+// The kernel's random per-boot identifier, always
+// FB_ADB_BOOT_ID_LENGTH characters long; all zeros if unknown.
+const char* boot_id(void);
+
 const char* my_exe(void);
 const char* maybe_my_exe(const char* exename);
 
 void become_daemon(void (*daemon_setup)(void* setup_data),
                    void* setup_data);
 
+// Run real_main on ARGV in a child we just forked, as if we'd exec'd
+// a fresh copy of ourselves, and exit with its status.
+__attribute__((noreturn))
+void run_main_in_child(int argc, char** argv);
+
 bool clowny_output_line_p(const char* line);
 
 // Destructively remove characters in SET from the end of STRING.
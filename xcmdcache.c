@@ -0,0 +1,104 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "util.h"
+#include "fs.h"
+#include "constants.h"
+#include "xcmdcache.h"
+#include "hashcache.h"
+
+static char* cached_xcmd_cache_directory;
+
+const char*
+xcmd_cache_directory(void)
+{
+    if (cached_xcmd_cache_directory)
+        return cached_xcmd_cache_directory;
+
+    SCOPED_RESLIST(rl);
+    const char* dir = xaprintf("%s/xcmd-cache", my_fb_adb_directory());
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        die_errno("mkdir(\"%s\")", dir);
+    cached_xcmd_cache_directory = strdup(dir);
+    if (cached_xcmd_cache_directory == NULL)
+        die_oom();
+    return cached_xcmd_cache_directory;
+}
+
+char*
+xcmd_cache_file_name(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH])
+{
+    return xaprintf("%s/%s",
+                    xcmd_cache_directory(),
+                    hex_encode_bytes(hash, FB_ADB_XCMD_HASH_LENGTH));
+}
+
+int
+xcmd_cache_open(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH])
+{
+    SCOPED_RESLIST(rl);
+    const char* filename = xcmd_cache_file_name(hash);
+    SCOPED_RESLIST(rl_entry);
+    int fd = try_xopen(filename, O_RDONLY, 0);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            die_errno("open(\"%s\")", filename);
+        return -1;
+    }
+
+    struct sha256_hash actual = hash_cache_sha256_fd(fd);
+    _Static_assert(FB_ADB_XCMD_HASH_LENGTH <= sizeof (actual.digest),
+                   "hash size mismatch");
+    if (memcmp(actual.digest, hash, FB_ADB_XCMD_HASH_LENGTH) != 0) {
+        dbg("xcmd cache entry [%s] corrupt: removing", filename);
+        (void) unlink(filename);
+        return -1;
+    }
+
+    touch_lru_entry(fd, filename);
+    xrewindfd(fd);
+    reslist_xfer(rl->parent, rl_entry);
+    return fd;
+}
+
+bool
+xcmd_cache_has(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH])
+{
+    SCOPED_RESLIST(rl);
+    const char* filename = xcmd_cache_file_name(hash);
+    int fd = try_xopen(filename, O_RDONLY, 0);
+    if (fd == -1)
+        return false;
+    touch_lru_entry(fd, filename);
+    return true;
+}
+
+static bool
+cache_entry_name_p(const char* name)
+{
+    return strlen(name) == 2 * FB_ADB_XCMD_HASH_LENGTH &&
+        strspn(name, "0123456789abcdef") == strlen(name);
+}
+
+void
+xcmd_cache_trim(void)
+{
+    trim_lru_directory(xcmd_cache_directory(),
+                       cache_entry_name_p,
+                       XCMD_CACHE_MAX_BYTES);
+}
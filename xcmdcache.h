@@ -0,0 +1,40 @@
+/*
+ *  Copyright (c) 2014, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in
+ *  the LICENSE file in the root directory of this source tree. An
+ *  additional grant of patent rights can be found in the PATENTS file
+ *  in the same directory.
+ *
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "proto.h"
+
+// The device keeps the programs xcmd runs in a directory of files
+// named after (a prefix of) their SHA-256 hashes, so many versions of
+// many programs can coexist.  Using an entry updates its modification
+// time; when the cache grows past XCMD_CACHE_MAX_BYTES, we delete the
+// entries used least recently.  The host fills the cache by writing
+// files into it atomically.
+
+// Directory holding the cache, created if necessary.
+const char* xcmd_cache_directory(void);
+
+// Name of the cache entry for HASH.
+char* xcmd_cache_file_name(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH]);
+
+// Open the cache entry for HASH, marking it recently used.
+// Return -1 if we have no valid entry.  The file descriptor is owned
+// by the current reslist.
+int xcmd_cache_open(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH]);
+
+// Like xcmd_cache_open, but just say whether we have the entry
+// without checking its contents.
+bool xcmd_cache_has(const uint8_t hash[FB_ADB_XCMD_HASH_LENGTH]);
+
+// Delete least recently used entries until the cache fits in
+// XCMD_CACHE_MAX_BYTES.  Call before the host adds an entry.
+void xcmd_cache_trim(void);
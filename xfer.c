@@ -15,24 +15,101 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include "util.h"
+#include "argv.h"
 #include "autocmd.h"
 #include "xfer.h"
 #include "fs.h"
 #include "constants.h"
+#include "sha2.h"
 #if FBADB_MAIN
 # include "peer.h"
+# include "json.h"
 #endif
 
 // This file describes a facility that file-transfer commands use to
 // talk to each other.  This protocol runs on top of the more
 // fundamental proto.h session protocol.
+//
+// A single-file transfer is a XFER_MSG_STAT followed by XFER_MSG_DATA
+// chunks, the last of which is empty.  In the multi-file modes, the
+// sender precedes each such file with a XFER_MSG_FILE giving its
+// basename and sends XFER_MSG_END after the last file.  When the
+// receiver knows which files it wants (as in fget), it first sends the
+// sender their names the same way, as XFER_MSG_FILE messages followed
+// by XFER_MSG_END.  Nobody waits for acknowledgement between files.
+//
+// With --delta, the receiver answers each XFER_MSG_STAT with a
+// XFER_MSG_SIGNATURE describing the fixed-size blocks of its existing
+// copy of the file, if any.  The sender then mixes XFER_MSG_COPY
+// references to those blocks into its XFER_MSG_DATA stream wherever
+// the source contains a block the receiver already has.  That's one
+// round trip per file, so we do it only when asked.
+//
+// With --resume, the receiver instead answers XFER_MSG_STAT with a
+// XFER_MSG_RESUME giving how much of the file it kept from an earlier
+// attempt and a hash of those bytes.  The sender replies with a
+// XFER_MSG_RESUME giving the offset at which it will actually start
+// sending: the proposed one if its own file begins with the same
+// bytes and zero otherwise.
+//
+// Whenever the sender finds a hole in a sparse source file, it sends a
+// XFER_MSG_HOLE instead of that many zero bytes of XFER_MSG_DATA.
+//
+// With --streams, a big file travels in ranges over several
+// connections at once.  On the main connection, after XFER_MSG_STAT
+// (and any XFER_MSG_CHECK exchange), the receiver sends a
+// XFER_MSG_FILE naming the file it's writing, or an empty name if
+// nobody else can write it.  The host end, which decides how to split
+// the file, then sends the device end a XFER_MSG_RANGE saying how much
+// of the file's beginning the main connection carries, and opens one
+// more xfer-stub connection for each remaining range, each of which
+// starts with its own XFER_MSG_RANGE.  Range connections carry plain
+// XFER_MSG_DATA chunks.  When the device receives, it acknowledges
+// each range with XFER_MSG_END once written, and the host sends a
+// final XFER_MSG_END on the main connection once all ranges are in,
+// after which the device moves the file into place.
+//
+// With --if-changed, before any of that, the receiver answers
+// XFER_MSG_STAT with a XFER_MSG_CHECK saying whether it already has
+// a file of the same size and modification time (so we skip the
+// transfer), doesn't have a file of that size (so we send it), or
+// has one whose contents we need to compare.  In the last case, the
+// message carries the file's SHA-256, and the sender replies with a
+// XFER_MSG_CHECK saying whether its file has the same hash.
+//
+// With --stats, the device end sends one XFER_MSG_STATS describing
+// its side of the work after everything else.
 
 enum xfer_msg_type {
     XFER_MSG_STAT = 10,
     XFER_MSG_DATA,
+    XFER_MSG_FILE,
+    XFER_MSG_END,
+    XFER_MSG_SIGNATURE,
+    XFER_MSG_COPY,
+    XFER_MSG_RESUME,
+    XFER_MSG_CHECK,
+    XFER_MSG_HOLE,
+    XFER_MSG_RANGE,
+    XFER_MSG_STATS,
 };
 
+// Range length meaning "all of it": we're not splitting the file.
+#define XFER_RANGE_ALL UINT64_MAX
+
+#define XFER_STAT_SPARSE (1<<0)
+
+enum xfer_check_verdict {
+    XFER_CHECK_DIFFERENT,
+    XFER_CHECK_SAME,
+    XFER_CHECK_HASH,
+};
+
+#define XFER_STRONG_SUM_LENGTH 16
+
 #pragma pack(push, 1)
 struct xfer_msg {
     uint8_t type;
@@ -47,158 +124,1406 @@ struct xfer_msg {
             uint32_t atime_ns;
             uint32_t mtime_ns;
             uint16_t ugo_bits;
+            uint8_t flags;
         } stat;
 
         struct {
             uint32_t payload_size;
         } data;
+
+        struct {
+            uint16_t name_length; // Name follows message
+        } file;
+
+        struct {
+            uint32_t block_size;
+            uint32_t nr_blocks; // Array of xfer_block_sum follows
+        } signature;
+
+        struct {
+            uint64_t first_block;
+            uint32_t nr_blocks;
+        } copy;
+
+        struct {
+            uint64_t offset;
+            uint8_t prefix_sha256[SHA256_DIGEST_LENGTH];
+        } resume;
+
+        struct {
+            uint8_t verdict;
+            uint8_t sha256[SHA256_DIGEST_LENGTH];
+        } check;
+
+        struct {
+            uint64_t length;
+        } hole;
+
+        struct {
+            uint64_t offset;
+            uint64_t length;
+        } range;
+
+        struct {
+            uint64_t bytes;
+            uint64_t chunks;
+            uint64_t wall_us;
+            uint64_t time_us[4]; // Indexed by xfer_time_kind
+        } stats;
     } u;
 };
+
+struct xfer_block_sum {
+    uint32_t weak;
+    uint8_t strong[XFER_STRONG_SUM_LENGTH];
+};
 #pragma pack(pop)
 
-#define XFER_MSG_SIZE(field)                      \
-    (offsetof(struct xfer_msg, u.field) +         \
-     sizeof (((struct xfer_msg*)0)->u.field))
+#define XFER_MSG_SIZE(field)                      \
+    (offsetof(struct xfer_msg, u.field) +         \
+     sizeof (((struct xfer_msg*)0)->u.field))
+
+static size_t
+xfer_msg_size(uint8_t type)
+{
+    switch (type) {
+        case XFER_MSG_STAT:
+            return XFER_MSG_SIZE(stat);
+        case XFER_MSG_DATA:
+            return XFER_MSG_SIZE(data);
+        case XFER_MSG_FILE:
+            return XFER_MSG_SIZE(file);
+        case XFER_MSG_END:
+            return offsetof(struct xfer_msg, u);
+        case XFER_MSG_SIGNATURE:
+            return XFER_MSG_SIZE(signature);
+        case XFER_MSG_COPY:
+            return XFER_MSG_SIZE(copy);
+        case XFER_MSG_RESUME:
+            return XFER_MSG_SIZE(resume);
+        case XFER_MSG_CHECK:
+            return XFER_MSG_SIZE(check);
+        case XFER_MSG_HOLE:
+            return XFER_MSG_SIZE(hole);
+        case XFER_MSG_RANGE:
+            return XFER_MSG_SIZE(range);
+        case XFER_MSG_STATS:
+            return XFER_MSG_SIZE(stats);
+        default:
+            die(ECOMM, "unknown message type %u", (unsigned) type);
+    }
+}
+
+// What --stats measures.  The counters live in static storage because
+// they cover the whole command, however many files it moves.
+
+enum xfer_time_kind {
+    XFER_TIME_PEER,   // Blocked reading from or writing to the peer
+    XFER_TIME_DISK,   // Blocked reading or writing local files
+    XFER_TIME_SPLICE, // In sendfile or splice, which do both at once
+    XFER_TIME_FSYNC,  // Waiting for data to reach storage
+    XFER_NR_TIME_KINDS,
+};
+
+struct xfer_stats {
+    uint64_t bytes;  // File data bytes sent or received
+    uint64_t chunks; // Non-empty XFER_MSG_DATA messages
+    double start;
+    double time[XFER_NR_TIME_KINDS];
+};
+
+static bool xfer_stats_on;
+static struct xfer_stats xfer_stats;
+
+static double
+stats_clock(void)
+{
+    return xfer_stats_on ? xclock_gettime(CLOCK_MONOTONIC) : 0.0;
+}
+
+// Charge the time since START, as returned by stats_clock, to KIND.
+static void
+stats_charge(double start, enum xfer_time_kind kind)
+{
+    if (xfer_stats_on)
+        xfer_stats.time[kind] += xclock_gettime(CLOCK_MONOTONIC) - start;
+}
+
+static void
+stats_count_chunk(size_t sz)
+{
+    if (sz > 0) {
+        xfer_stats.bytes += sz;
+        xfer_stats.chunks += 1;
+    }
+}
+
+static uint64_t
+stats_us(double seconds)
+{
+    return seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+}
+
+// Read exactly SZ bytes of file data from the peer.
+static void
+peer_read_data(int from_peer, void* buf, size_t sz)
+{
+    double start = stats_clock();
+    if (read_all(from_peer, buf, sz) != sz)
+        die(ECOMM, "unexpected EOF");
+    stats_charge(start, XFER_TIME_PEER);
+}
+
+static void
+peer_write_data(int to_peer, const void* buf, size_t sz)
+{
+    double start = stats_clock();
+    write_all(to_peer, buf, sz);
+    stats_charge(start, XFER_TIME_PEER);
+}
+
+static void
+disk_write(int dest_fd, const void* buf, size_t sz)
+{
+    double start = stats_clock();
+    write_all(dest_fd, buf, sz);
+    stats_charge(start, XFER_TIME_DISK);
+}
+
+static void
+stats_fsync(int fd)
+{
+    double start = stats_clock();
+    xfsync(fd);
+    stats_charge(start, XFER_TIME_FSYNC);
+}
+
+static struct xfer_msg
+recv_xfer_msg(int from_peer)
+{
+    double start = stats_clock();
+    dbg("reading xfer msg from fd %d", from_peer);
+    struct xfer_msg m;
+    size_t hsz = offsetof(struct xfer_msg, u);
+    if (read_all(from_peer, &m, hsz) < hsz)
+        die(ECOMM, "short xfer message");
+    dbg("... read message type=%u", (unsigned) m.type);
+    size_t msize = xfer_msg_size(m.type);
+    size_t remaining_bytes = msize - hsz;
+    dbg("... reading remaining %u bytes of %u (hdr was %u)",
+        (unsigned) remaining_bytes,
+        (unsigned) msize,
+        (unsigned) hsz);
+    read_all(from_peer, &m.u, remaining_bytes);
+    stats_charge(start, XFER_TIME_PEER);
+    return m;
+}
+
+static void
+send_xfer_msg(int to_peer, const struct xfer_msg* m)
+{
+    dbg("sending xfer message type=%u size=%u",
+        (unsigned) m->type,
+        (unsigned) xfer_msg_size(m->type));
+    double start = stats_clock();
+    write_all(to_peer, m, xfer_msg_size(m->type));
+    stats_charge(start, XFER_TIME_PEER);
+}
+
+static void
+send_stat_packet(int to_peer, int xfer_fd)
+{
+    struct stat st;
+    if (fstat(xfer_fd, &st) == -1)
+        die_errno("fstat");
+    struct xfer_msg m = {
+        .type = XFER_MSG_STAT,
+        .u.stat.atime = st.st_atime,
+        .u.stat.mtime = st.st_mtime,
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+        .u.stat.atime_ns = st.st_atim.tv_nsec,
+#endif
+        .u.stat.mtime_ns = stat_mtime_ns(&st),
+        .u.stat.size = st.st_size,
+        .u.stat.ugo_bits = st.st_mode & 0777,
+        .u.stat.flags = stat_sparse_p(&st) ? XFER_STAT_SPARSE : 0,
+    };
+
+    send_xfer_msg(to_peer, &m);
+}
+
+struct xfer_ctx {
+    int from_peer;
+    int to_peer;
+    const struct cmd_xfer_stub_info* info;
+    const char* const* filenames; // For multi-file modes, or NULL
+    // At the host end, how to reach the device again
+    const struct start_peer_info* spi;
+    const struct cmd_xfer_stub_info* remote;
+};
+
+// How a single-file transfer uses --streams.  SPI and REMOTE are NULL
+// at the device end, which just follows the host's lead.
+struct xfer_streams {
+    unsigned nr_streams;
+    const struct start_peer_info* spi;
+    const struct cmd_xfer_stub_info* remote;
+};
+
+static unsigned
+parse_streams(const char* s)
+{
+    char* endptr = NULL;
+    errno = 0;
+    unsigned long nr_streams = strtoul(s, &endptr, 10);
+    if (errno != 0 || endptr == s || *endptr != '\0' ||
+        nr_streams < 1 || nr_streams > XFER_MAX_STREAMS)
+    {
+        die(EINVAL, "invalid stream count: %s", s);
+    }
+    return (unsigned) nr_streams;
+}
+
+static struct xfer_msg
+recv_range_msg(int from_peer)
+{
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_RANGE)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+    return m;
+}
+
+static void
+recv_end_msg(int from_peer)
+{
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_END)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+}
+
+static void
+send_file_msg(int to_peer, const char* name)
+{
+    size_t name_length = strlen(name);
+    if (name_length > UINT16_MAX)
+        die(EINVAL, "file name too long: %s", name);
+    struct xfer_msg m = {
+        .type = XFER_MSG_FILE,
+        .u.file.name_length = name_length,
+    };
+
+    send_xfer_msg(to_peer, &m);
+    write_all(to_peer, name, name_length);
+}
+
+static void
+send_end_msg(int to_peer)
+{
+    struct xfer_msg m = {
+        .type = XFER_MSG_END,
+    };
+
+    send_xfer_msg(to_peer, &m);
+}
+
+// Read the next file name from FROM_PEER, or return NULL on
+// XFER_MSG_END.
+static char*
+recv_file_name(int from_peer)
+{
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type == XFER_MSG_END)
+        return NULL;
+    if (m.type != XFER_MSG_FILE)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+    size_t name_length = m.u.file.name_length;
+    char* name = xalloc(name_length + 1);
+    if (read_all(from_peer, name, name_length) != name_length)
+        die(ECOMM, "unexpected EOF");
+    name[name_length] = '\0';
+    return name;
+}
+
+static void
+send_data_header(int to_peer, uint32_t size)
+{
+    struct xfer_msg m = {
+        .type = XFER_MSG_DATA,
+        .u.data.payload_size = size,
+    };
+
+    send_xfer_msg(to_peer, &m);
+    stats_count_chunk(size);
+}
+
+// The rsync rolling checksum: cheap to slide along the source one
+// byte at a time, and good enough to tell us when a block might
+// match.  We confirm candidate matches with the strong sum.
+struct rolling_sum {
+    uint32_t a;
+    uint32_t b;
+};
+
+static struct rolling_sum
+rolling_sum_compute(const uint8_t* data, size_t len)
+{
+    struct rolling_sum rs = { 0, 0 };
+    for (size_t i = 0; i < len; ++i) {
+        rs.a += data[i];
+        rs.b += (uint32_t) (len - i) * data[i];
+    }
+    return rs;
+}
+
+static void
+rolling_sum_roll(struct rolling_sum* rs,
+                 size_t len,
+                 uint8_t out,
+                 uint8_t in)
+{
+    rs->a += (uint32_t) in - out;
+    rs->b += rs->a - (uint32_t) len * out;
+}
+
+static uint32_t
+rolling_sum_value(const struct rolling_sum* rs)
+{
+    return (rs->a & 0xFFFF) | (rs->b << 16);
+}
+
+static void
+strong_sum(const uint8_t* data,
+           size_t len,
+           uint8_t strong[XFER_STRONG_SUM_LENGTH])
+{
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX sha256;
+    SHA256_Init(&sha256);
+    SHA256_Update(&sha256, data, len);
+    SHA256_Final(digest, &sha256);
+    memcpy(strong, digest, XFER_STRONG_SUM_LENGTH);
+}
+
+static uint32_t
+delta_block_size(uint64_t file_size)
+{
+    uint32_t block_size = XFER_DELTA_MIN_BLOCK;
+    while (block_size < XFER_DELTA_MAX_BLOCK &&
+           (uint64_t) block_size * block_size < file_size)
+    {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+// Describe the whole blocks of BASIS_FD, which may be -1 if we have
+// no basis; return the block size.  The trailing partial block isn't
+// worth matching.
+static uint32_t
+send_signature(int to_peer, int basis_fd, uint32_t* nr_blocks_out)
+{
+    SCOPED_RESLIST(rl);
+    uint64_t basis_size = basis_fd != -1 ? xfstat(basis_fd).st_size : 0;
+    uint32_t block_size = delta_block_size(basis_size);
+    uint64_t nr_blocks = basis_size / block_size;
+    if (nr_blocks > UINT32_MAX)
+        nr_blocks = 0;
+
+    struct xfer_block_sum* sums = xalloc(nr_blocks * sizeof (*sums));
+    uint8_t* block = xalloc(block_size);
+    for (uint64_t i = 0; i < nr_blocks; ++i) {
+        if (read_all(basis_fd, block, block_size) < block_size) {
+            nr_blocks = i; // Shrank under us
+            break;
+        }
+
+        struct rolling_sum rs = rolling_sum_compute(block, block_size);
+        sums[i].weak = rolling_sum_value(&rs);
+        strong_sum(block, block_size, sums[i].strong);
+    }
+
+    struct xfer_msg m = {
+        .type = XFER_MSG_SIGNATURE,
+        .u.signature.block_size = block_size,
+        .u.signature.nr_blocks = nr_blocks,
+    };
+
+    send_xfer_msg(to_peer, &m);
+    write_all(to_peer, sums, nr_blocks * sizeof (*sums));
+    *nr_blocks_out = nr_blocks;
+    return block_size;
+}
+
+struct delta_signature {
+    uint32_t block_size;
+    uint32_t nr_blocks;
+    struct xfer_block_sum* sums;
+    // Chains of blocks by weak sum, for matching
+    uint32_t hash_mask;
+    int32_t* heads;
+    int32_t* next;
+};
+
+static struct delta_signature*
+recv_signature(int from_peer)
+{
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_SIGNATURE)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+
+    struct delta_signature* sig = xcalloc(sizeof (*sig));
+    sig->block_size = m.u.signature.block_size;
+    sig->nr_blocks = m.u.signature.nr_blocks;
+    if (sig->block_size < XFER_DELTA_MIN_BLOCK ||
+        sig->block_size > XFER_DELTA_MAX_BLOCK ||
+        sig->nr_blocks > INT32_MAX)
+    {
+        die(ECOMM, "invalid block signature");
+    }
+
+    size_t sums_size = sig->nr_blocks * sizeof (*sig->sums);
+    sig->sums = xalloc(sums_size);
+    if (read_all(from_peer, sig->sums, sums_size) != sums_size)
+        die(ECOMM, "unexpected EOF");
+
+    size_t nr_buckets = nextpow2sz(sig->nr_blocks ?: 1);
+    sig->hash_mask = nr_buckets - 1;
+    sig->heads = xalloc(nr_buckets * sizeof (*sig->heads));
+    sig->next = xalloc((sig->nr_blocks ?: 1) * sizeof (*sig->next));
+    for (size_t i = 0; i < nr_buckets; ++i)
+        sig->heads[i] = -1;
+    // Insert in reverse so each chain lists its earliest block first.
+    for (uint32_t i = sig->nr_blocks; i > 0; --i) {
+        uint32_t bucket = sig->sums[i - 1].weak & sig->hash_mask;
+        sig->next[i - 1] = sig->heads[bucket];
+        sig->heads[bucket] = i - 1;
+    }
+
+    return sig;
+}
+
+// Return the index of a block in SIG with the contents of DATA, which
+// is SIG->BLOCK_SIZE bytes long, or -1 if there is none.
+static int32_t
+find_matching_block(const struct delta_signature* sig,
+                    const uint8_t* data,
+                    uint32_t weak)
+{
+    bool have_strong = false;
+    uint8_t strong[XFER_STRONG_SUM_LENGTH];
+
+    for (int32_t i = sig->heads[weak & sig->hash_mask];
+         i != -1;
+         i = sig->next[i])
+    {
+        if (sig->sums[i].weak != weak)
+            continue;
+        if (!have_strong) {
+            strong_sum(data, sig->block_size, strong);
+            have_strong = true;
+        }
+        if (!memcmp(strong, sig->sums[i].strong, sizeof (strong)))
+            return i;
+    }
+
+    return -1;
+}
+
+static void
+send_copy_msg(int to_peer, uint64_t first_block, uint32_t nr_blocks)
+{
+    struct xfer_msg m = {
+        .type = XFER_MSG_COPY,
+        .u.copy.first_block = first_block,
+        .u.copy.nr_blocks = nr_blocks,
+    };
+
+    send_xfer_msg(to_peer, &m);
+}
+
+// What we know about a partially-received file, kept next to it so
+// that a later --resume transfer can pick up where we left off.
+struct xfer_checkpoint_data {
+    char magic[8];
+    uint64_t source_size;
+    uint64_t source_mtime;
+    uint32_t source_mtime_ns;
+    uint32_t pad;
+    uint64_t offset;
+    SHA256_CTX sha256; // Of the first OFFSET bytes
+};
+
+static const char xfer_checkpoint_magic[8] = "fbadbck1";
+
+struct xfer_checkpoint {
+    int fd;
+    const char* filename;
+    uint64_t saved_offset;
+    struct xfer_checkpoint_data data;
+};
+
+static void
+checkpoint_reset(struct xfer_checkpoint* cp)
+{
+    cp->data.offset = 0;
+    SHA256_Init(&cp->data.sha256);
+}
+
+// Open the checkpoint file FILENAME for a partial file matching the
+// source described by STATM.  If the checkpoint is missing or is for
+// some other source, start over.
+static struct xfer_checkpoint*
+checkpoint_open(const char* filename, const struct xfer_msg* statm)
+{
+    struct xfer_checkpoint* cp = xcalloc(sizeof (*cp));
+    cp->filename = filename;
+    cp->fd = xopen(filename, O_CREAT | O_RDWR, 0600);
+    struct xfer_checkpoint_data* d = &cp->data;
+    if (read_all(cp->fd, d, sizeof (*d)) != sizeof (*d) ||
+        memcmp(d->magic, xfer_checkpoint_magic, sizeof (d->magic)) ||
+        d->source_size != statm->u.stat.size ||
+        d->source_mtime != statm->u.stat.mtime ||
+        d->source_mtime_ns != statm->u.stat.mtime_ns ||
+        d->offset > d->source_size)
+    {
+        memset(d, 0, sizeof (*d));
+        memcpy(d->magic, xfer_checkpoint_magic, sizeof (d->magic));
+        d->source_size = statm->u.stat.size;
+        d->source_mtime = statm->u.stat.mtime;
+        d->source_mtime_ns = statm->u.stat.mtime_ns;
+        checkpoint_reset(cp);
+    }
+
+    cp->saved_offset = d->offset;
+    return cp;
+}
+
+// Record that DEST_FD holds the first CP->DATA.OFFSET bytes of the
+// file.  We flush the data first so that the checkpoint never claims
+// more than actually reached storage.
+static void
+checkpoint_save(struct xfer_checkpoint* cp, int dest_fd)
+{
+    stats_fsync(dest_fd);
+    ssize_t ret;
+    do {
+        ret = pwrite(cp->fd, &cp->data, sizeof (cp->data), 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1)
+        die_errno("pwrite(\"%s\")", cp->filename);
+    if (ret != sizeof (cp->data))
+        die(EIO, "short write to \"%s\"", cp->filename);
+    cp->saved_offset = cp->data.offset;
+}
+
+static void
+checkpoint_advance(struct xfer_checkpoint* cp,
+                   int dest_fd,
+                   const void* buf,
+                   size_t sz)
+{
+    SHA256_Update(&cp->data.sha256, buf, sz);
+    cp->data.offset += sz;
+    if (cp->data.offset - cp->saved_offset >= XFER_RESUME_CHECKPOINT)
+        checkpoint_save(cp, dest_fd);
+}
+
+static struct xfer_msg
+recv_check_msg(int from_peer)
+{
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_CHECK)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+    return m;
+}
+
+// Tell the sender what we know about FILENAME and return whether it
+// already matches the file the sender described in STATM.
+static bool
+recv_check_unchanged(int from_peer,
+                     int to_peer,
+                     const char* filename,
+                     const struct xfer_msg* statm)
+{
+    SCOPED_RESLIST(rl);
+    struct xfer_msg m = {
+        .type = XFER_MSG_CHECK,
+        .u.check.verdict = XFER_CHECK_DIFFERENT,
+    };
+
+    int fd = try_xopen(filename, O_RDONLY, 0);
+    if (fd != -1) {
+        struct stat st = xfstat(fd);
+        if (S_ISREG(st.st_mode) &&
+            (uint64_t) st.st_size == statm->u.stat.size)
+        {
+            // --preserve sets times only to the microsecond.
+            if ((uint64_t) st.st_mtime == statm->u.stat.mtime &&
+                stat_mtime_ns(&st) / 1000 == statm->u.stat.mtime_ns / 1000)
+            {
+                m.u.check.verdict = XFER_CHECK_SAME;
+            } else {
+                m.u.check.verdict = XFER_CHECK_HASH;
+                struct sha256_hash sh = sha256_fd(fd);
+                memcpy(m.u.check.sha256, sh.digest, sizeof (sh.digest));
+            }
+        }
+    }
+
+    send_xfer_msg(to_peer, &m);
+    if (m.u.check.verdict != XFER_CHECK_HASH)
+        return m.u.check.verdict == XFER_CHECK_SAME;
+    return recv_check_msg(from_peer).u.check.verdict == XFER_CHECK_SAME;
+}
+
+// Answer the receiver's XFER_MSG_CHECK and return whether it already
+// has the contents of SOURCE_FD.
+static bool
+send_check_unchanged(int from_peer, int to_peer, int source_fd)
+{
+    struct xfer_msg m = recv_check_msg(from_peer);
+    if (m.u.check.verdict != XFER_CHECK_HASH)
+        return m.u.check.verdict == XFER_CHECK_SAME;
+
+    struct xfer_msg reply = {
+        .type = XFER_MSG_CHECK,
+        .u.check.verdict = XFER_CHECK_DIFFERENT,
+    };
+
+    if (S_ISREG(xfstat(source_fd).st_mode)) {
+        struct sha256_hash sh = sha256_fd(source_fd);
+        xrewindfd(source_fd);
+        if (!memcmp(sh.digest, m.u.check.sha256, sizeof (sh.digest)))
+            reply.u.check.verdict = XFER_CHECK_SAME;
+    }
+
+    send_xfer_msg(to_peer, &reply);
+    return reply.u.check.verdict == XFER_CHECK_SAME;
+}
+
+// Agree with the sender on where to start receiving into DEST_FD and
+// position DEST_FD there.  Return the offset.
+static uint64_t
+negotiate_resume_recv(int from_peer,
+                      int to_peer,
+                      int dest_fd,
+                      struct xfer_checkpoint* cp)
+{
+    if (cp != NULL && (uint64_t) xfstat(dest_fd).st_size < cp->data.offset)
+        checkpoint_reset(cp);
+
+    struct xfer_msg m = {
+        .type = XFER_MSG_RESUME,
+    };
+
+    if (cp != NULL && cp->data.offset > 0) {
+        SHA256_CTX sha256 = cp->data.sha256;
+        m.u.resume.offset = cp->data.offset;
+        SHA256_Final(m.u.resume.prefix_sha256, &sha256);
+    }
+
+    send_xfer_msg(to_peer, &m);
+    uint64_t proposed = m.u.resume.offset;
+    m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_RESUME)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+    if (m.u.resume.offset != 0 && m.u.resume.offset != proposed)
+        die(ECOMM, "peer chose invalid resume offset");
+
+    if (cp == NULL)
+        return 0;
+
+    if (m.u.resume.offset == 0)
+        checkpoint_reset(cp);
+    dbg("resuming at offset %llu", (unsigned long long) cp->data.offset);
+    xftruncate(dest_fd, cp->data.offset);
+    if (lseek(dest_fd, cp->data.offset, SEEK_SET) == (off_t) -1)
+        die_errno("lseek");
+    return cp->data.offset;
+}
+
+// Answer the receiver's XFER_MSG_RESUME, leaving SOURCE_FD positioned
+// at the offset we'll start sending from.
+static void
+negotiate_resume_send(int from_peer, int to_peer, int source_fd)
+{
+    SCOPED_RESLIST(rl);
+    struct xfer_msg m = recv_xfer_msg(from_peer);
+    if (m.type != XFER_MSG_RESUME)
+        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+
+    uint64_t offset = m.u.resume.offset;
+    if (offset > 0 && S_ISREG(xfstat(source_fd).st_mode)) {
+        size_t bufsz = 64 * 1024;
+        uint8_t* buf = xalloc(bufsz);
+        uint64_t nr_hashed = 0;
+        SHA256_CTX sha256;
+        SHA256_Init(&sha256);
+        while (nr_hashed < offset) {
+            size_t want = XMIN(bufsz, offset - nr_hashed);
+            size_t nr_read = read_all(source_fd, buf, want);
+            SHA256_Update(&sha256, buf, nr_read);
+            nr_hashed += nr_read;
+            if (nr_read < want)
+                break;
+        }
+
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        SHA256_Final(digest, &sha256);
+        if (nr_hashed != offset ||
+            memcmp(digest, m.u.resume.prefix_sha256, sizeof (digest)))
+        {
+            dbg("resume prefix mismatch; starting over");
+            offset = 0;
+            if (lseek(source_fd, 0, SEEK_SET) == (off_t) -1)
+                die_errno("lseek");
+        }
+    } else {
+        offset = 0;
+    }
+
+    struct xfer_msg reply = {
+        .type = XFER_MSG_RESUME,
+        .u.resume.offset = offset,
+    };
+
+    send_xfer_msg(to_peer, &reply);
+}
+
+// Move up to SZ bytes from the pipe FROM_PEER to DEST_FD without
+// copying them through our address space.  Return the number of bytes
+// moved: if it's less than SZ, the kernel can't splice these files,
+// and *SPLICE_OK is now false.
+static size_t
+splice_to_file(int from_peer, int dest_fd, size_t sz, bool* splice_ok)
+{
+    size_t nr_moved = 0;
+#ifdef HAVE_SPLICE
+    double start = stats_clock();
+    while (nr_moved < sz) {
+        ssize_t ret;
+        do {
+            WITH_IO_SIGNALS_ALLOWED();
+            ret = splice(from_peer, NULL, dest_fd, NULL,
+                         sz - nr_moved, SPLICE_F_MOVE);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == 0)
+            die(ECOMM, "unexpected EOF");
+        if (ret < 0) {
+            if (errno != EINVAL && errno != ENOSYS)
+                die_errno("splice");
+            dbg("splice unsupported here: falling back to copy");
+            break;
+        }
+        nr_moved += ret;
+    }
+    stats_charge(start, XFER_TIME_SPLICE);
+#endif
+    if (nr_moved < sz)
+        *splice_ok = false;
+    return nr_moved;
+}
+
+// Receive file contents into DEST_FD, taking blocks the sender
+// references from BASIS_FD.  NR_BLOCKS is the number of blocks of
+// BLOCK_SIZE bytes we offered the sender; it's zero without --delta.
+// If CHECKPOINT is not NULL, keep it up to date as data arrives.
+static uint64_t
+copy_loop_posix_recv(
+    int from_peer,
+    int dest_fd,
+    int basis_fd,
+    uint32_t block_size,
+    uint32_t nr_blocks,
+    struct xfer_checkpoint* checkpoint)
+{
+    SCOPED_RESLIST(rl);
+    struct growable_buffer buf = { 0 };
+    uint64_t total_written = 0;
+    size_t chunksz;
+    bool dest_regular = S_ISREG(xfstat(dest_fd).st_mode);
+    bool use_splice = (checkpoint == NULL &&
+                       S_ISFIFO(xfstat(from_peer).st_mode) &&
+                       dest_regular);
+    bool skipped_holes = false;
+
+    for (;;) {
+        struct xfer_msg m = recv_xfer_msg(from_peer);
+        if (m.type == XFER_MSG_HOLE) {
+            uint64_t length = m.u.hole.length;
+            if (SATADD(&total_written, total_written, length))
+                die(ECOMM, "file size too large");
+            if (dest_regular && checkpoint == NULL) {
+                // Skipping ahead leaves a hole.
+                if (lseek(dest_fd, length, SEEK_CUR) == (off_t) -1)
+                    die_errno("lseek");
+                skipped_holes = true;
+                continue;
+            }
+            // Readers of pipes and checkpoints want real zeros.
+            grow_buffer(&buf, XMIN(length, (uint64_t) XFER_MIN_CHUNK));
+            memset(buf.buf, 0, buf.bufsz);
+            while (length > 0) {
+                size_t n = XMIN(length, (uint64_t) buf.bufsz);
+                disk_write(dest_fd, buf.buf, n);
+                if (checkpoint != NULL)
+                    checkpoint_advance(checkpoint, dest_fd, buf.buf, n);
+                length -= n;
+            }
+            continue;
+        }
+
+        if (m.type == XFER_MSG_COPY) {
+            uint64_t first_block = m.u.copy.first_block;
+            uint32_t nr_copy = m.u.copy.nr_blocks;
+            if (first_block > nr_blocks || nr_copy > nr_blocks - first_block)
+                die(ECOMM, "block reference out of range");
+            grow_buffer(&buf, block_size);
+            double start = stats_clock();
+            for (uint32_t i = 0; i < nr_copy; ++i) {
+                off_t offset = (off_t) ((first_block + i) * block_size);
+                if (pread_all(basis_fd, buf.buf, block_size, offset)
+                    != block_size)
+                {
+                    die(EIO, "basis file shrank during transfer");
+                }
+                write_all(dest_fd, buf.buf, block_size);
+            }
+            stats_charge(start, XFER_TIME_DISK);
+            if (SATADD(&total_written,
+                       total_written,
+                       (uint64_t) nr_copy * block_size))
+            {
+                die(ECOMM, "file size too large");
+            }
+            continue;
+        }
+
+        if (m.type != XFER_MSG_DATA)
+            die(ECOMM, "unexpected message type %u", (unsigned) m.type);
+        chunksz = m.u.data.payload_size;
+        dbg("data chunk header chunksz=%u", (unsigned) chunksz);
+        if (chunksz == 0)
+            break;
+        stats_count_chunk(chunksz);
+        size_t nr_moved = 0;
+        if (use_splice)
+            nr_moved = splice_to_file(from_peer, dest_fd, chunksz,
+                                      &use_splice);
+        if (nr_moved < chunksz) {
+            size_t rest = chunksz - nr_moved;
+            grow_buffer(&buf, rest);
+            peer_read_data(from_peer, buf.buf, rest);
+            disk_write(dest_fd, buf.buf, rest);
+            if (checkpoint != NULL)
+                checkpoint_advance(checkpoint, dest_fd, buf.buf, rest);
+        }
+        if (SATADD(&total_written, total_written, chunksz))
+            die(ECOMM, "file size too large");
+    }
+
+    // A hole at the end of the file has to reach EOF too.
+    if (skipped_holes) {
+        off_t end = lseek(dest_fd, 0, SEEK_CUR);
+        if (end == (off_t) -1)
+            die_errno("lseek");
+        if (end > xfstat(dest_fd).st_size)
+            xftruncate(dest_fd, end);
+    }
+
+    return total_written;
+}
+
+static size_t
+sendfile_to_peer(int to_peer,
+                 int source_fd,
+                 off_t* offset,
+                 size_t sz,
+                 bool* sendfile_ok)
+{
+    double start = stats_clock();
+    size_t nr_sent = sendfile_all(to_peer, source_fd, offset, sz,
+                                  sendfile_ok);
+    stats_charge(start, XFER_TIME_SPLICE);
+    return nr_sent;
+}
+
+// Send the SZ bytes of SOURCE_FD at OFFSET as one XFER_MSG_DATA chunk.
+static void
+send_chunk_at(int to_peer,
+              int source_fd,
+              uint64_t offset,
+              size_t sz,
+              bool* sendfile_ok,
+              struct growable_buffer* buf)
+{
+    send_data_header(to_peer, sz);
+    off_t pos = offset;
+    size_t nr_sent = 0;
+    if (*sendfile_ok)
+        nr_sent = sendfile_to_peer(to_peer, source_fd, &pos, sz, sendfile_ok);
+    if (nr_sent < sz) {
+        size_t rest = sz - nr_sent;
+        grow_buffer(buf, rest);
+        double start = stats_clock();
+        if (pread_all(source_fd, buf->buf, rest, offset + nr_sent) != rest)
+            die(EIO, "source file shrank during transfer");
+        stats_charge(start, XFER_TIME_DISK);
+        peer_write_data(to_peer, buf->buf, rest);
+    }
+}
+
+// Send LENGTH bytes of SOURCE_FD starting at OFFSET, then the empty
+// chunk that ends a transfer.
+static void
+copy_range_send(int to_peer,
+                int source_fd,
+                uint64_t offset,
+                uint64_t length)
+{
+    SCOPED_RESLIST(rl);
+    struct growable_buffer buf = { 0 };
+    bool sendfile_ok = true;
+    while (length > 0) {
+        size_t chunksz = XMIN(length, (uint64_t) XFER_MAX_CHUNK);
+        send_chunk_at(to_peer, source_fd, offset, chunksz,
+                      &sendfile_ok, &buf);
+        offset += chunksz;
+        length -= chunksz;
+    }
+    send_data_header(to_peer, 0);
+}
+
+static void
+send_hole_msg(int to_peer, uint64_t length)
+{
+    struct xfer_msg m = {
+        .type = XFER_MSG_HOLE,
+        .u.hole.length = length,
+    };
+
+    send_xfer_msg(to_peer, &m);
+}
+
+// Send the rest of SOURCE_FD.  Chunks start small so that short files
+// go out quickly and double up to XFER_MAX_CHUNK so that long ones
+// cost few messages.  When the source is a regular file, we know how
+// long each chunk will be before reading it, so we can let the kernel
+// move the data for us, and if the file is sparse, we can send its
+// holes as XFER_MSG_HOLE instead of reading them.
+static void
+copy_loop_posix_send(
+    int to_peer,
+    int source_fd)
+{
+    SCOPED_RESLIST(rl);
+    struct growable_buffer buf = { 0 };
+    size_t chunksz = XFER_MIN_CHUNK;
+    size_t nr_read;
+
+    assert(XFER_MAX_CHUNK <= UINT32_MAX);
+
+    struct stat st = xfstat(source_fd);
+    bool known_size = false;
+    bool use_sendfile = false;
+    bool find_holes = false;
+    uint64_t pos = 0;
+    uint64_t size = 0;
+    uint64_t segment_end = 0;
+    if (S_ISREG(st.st_mode)) {
+        off_t start = lseek(source_fd, 0, SEEK_CUR);
+        if (start != (off_t) -1 && start <= st.st_size) {
+            known_size = true;
+            use_sendfile = true;
+            find_holes = stat_sparse_p(&st);
+            pos = start;
+            size = st.st_size;
+            segment_end = find_holes ? pos : size;
+        }
+    }
+
+    do {
+        if (known_size && pos < size && pos == segment_end) {
+            uint64_t data_start;
+            if (find_data_segment(source_fd, pos, size,
+                                  &data_start, &segment_end))
+            {
+                if (data_start > pos)
+                    send_hole_msg(to_peer, data_start - pos);
+                pos = data_start;
+            } else {
+                find_holes = false;
+                segment_end = size;
+            }
+            if (lseek(source_fd, pos, SEEK_SET) == (off_t) -1)
+                die_errno("lseek");
+        }
+
+        if (known_size && pos < size) {
+            nr_read = XMIN(chunksz, segment_end - pos);
+            send_data_header(to_peer, nr_read);
+            size_t nr_sent = 0;
+            if (use_sendfile)
+                nr_sent = sendfile_to_peer(
+                    to_peer, source_fd, NULL, nr_read, &use_sendfile);
+            if (nr_sent < nr_read) {
+                // We've promised the peer NR_READ bytes.
+                size_t rest = nr_read - nr_sent;
+                grow_buffer(&buf, rest);
+                double start = stats_clock();
+                if (read_all(source_fd, buf.buf, rest) != rest)
+                    die(EIO, "source file shrank during transfer");
+                stats_charge(start, XFER_TIME_DISK);
+                peer_write_data(to_peer, buf.buf, rest);
+            }
+            pos += nr_read;
+        } else {
+            // Pipes, or a regular file that grew since we looked
+            grow_buffer(&buf, chunksz);
+            double start = stats_clock();
+            nr_read = read_all(source_fd, buf.buf, chunksz);
+            stats_charge(start, XFER_TIME_DISK);
+            send_data_header(to_peer, nr_read);
+            peer_write_data(to_peer, buf.buf, nr_read);
+        }
+        chunksz = XMIN(chunksz * 2, (size_t) XFER_MAX_CHUNK);
+    } while (nr_read > 0);
+}
+
+struct delta_sender {
+    int to_peer;
+    const uint8_t* data;
+    size_t literal_start;
+    uint64_t copy_first;
+    uint32_t copy_count;
+};
 
-static size_t
-xfer_msg_size(uint8_t type)
+static void
+delta_flush_copy(struct delta_sender* ds)
 {
-    switch (type) {
-        case XFER_MSG_STAT:
-            return XFER_MSG_SIZE(stat);
-        case XFER_MSG_DATA:
-            return XFER_MSG_SIZE(data);
-        default:
-            die(ECOMM, "unknown message type %u", (unsigned) type);
+    if (ds->copy_count > 0) {
+        send_copy_msg(ds->to_peer, ds->copy_first, ds->copy_count);
+        ds->copy_count = 0;
     }
 }
 
-static struct xfer_msg
-recv_xfer_msg(int from_peer)
+// Send the source bytes between the start of the current literal
+// run and END.
+static void
+delta_flush_literal(struct delta_sender* ds, size_t end)
 {
-    dbg("reading xfer msg from fd %d", from_peer);
-    struct xfer_msg m;
-    size_t hsz = offsetof(struct xfer_msg, u);
-    if (read_all(from_peer, &m, hsz) < hsz)
-        die(ECOMM, "short xfer message");
-    dbg("... read message type=%u", (unsigned) m.type);
-    size_t msize = xfer_msg_size(m.type);
-    size_t remaining_bytes = msize - hsz;
-    dbg("... reading remaining %u bytes of %u (hdr was %u)",
-        (unsigned) remaining_bytes,
-        (unsigned) msize,
-        (unsigned) hsz);
-    read_all(from_peer, &m.u, remaining_bytes);
-    return m;
+    if (end > ds->literal_start) {
+        delta_flush_copy(ds);
+        send_data_header(ds->to_peer, end - ds->literal_start);
+        peer_write_data(ds->to_peer,
+                        ds->data + ds->literal_start,
+                        end - ds->literal_start);
+    }
+    ds->literal_start = end;
 }
 
+// Send the SIZE bytes at DATA as literal runs and references to the
+// blocks in SIG.
 static void
-send_xfer_msg(int to_peer, const struct xfer_msg* m)
+copy_loop_delta_send(int to_peer,
+                     const struct delta_signature* sig,
+                     const uint8_t* data,
+                     size_t size)
 {
-    dbg("sending xfer message type=%u size=%u",
-        (unsigned) m->type,
-        (unsigned) xfer_msg_size(m->type));
-    write_all(to_peer, m, xfer_msg_size(m->type));
+    const size_t max_literal = 32 * 1024;
+    size_t block_size = sig->block_size;
+    struct delta_sender ds = {
+        .to_peer = to_peer,
+        .data = data,
+    };
+
+    size_t pos = 0;
+    struct rolling_sum rs = { 0, 0 };
+    if (size >= block_size)
+        rs = rolling_sum_compute(data, block_size);
+
+    while (pos + block_size <= size) {
+        int32_t block = find_matching_block(
+            sig, data + pos, rolling_sum_value(&rs));
+        if (block != -1) {
+            delta_flush_literal(&ds, pos);
+            if (ds.copy_count > 0 &&
+                ds.copy_first + ds.copy_count == (uint64_t) block &&
+                ds.copy_count < UINT32_MAX)
+            {
+                ds.copy_count += 1;
+            } else {
+                delta_flush_copy(&ds);
+                ds.copy_first = block;
+                ds.copy_count = 1;
+            }
+            pos += block_size;
+            ds.literal_start = pos;
+            if (pos + block_size <= size)
+                rs = rolling_sum_compute(data + pos, block_size);
+            continue;
+        }
+
+        if (pos - ds.literal_start >= max_literal)
+            delta_flush_literal(&ds, pos);
+        if (pos + block_size < size)
+            rolling_sum_roll(&rs, block_size,
+                             data[pos], data[pos + block_size]);
+        pos += 1;
+    }
+
+    while (ds.literal_start < size)
+        delta_flush_literal(
+            &ds, XMIN(size, ds.literal_start + max_literal));
+    delta_flush_copy(&ds);
+    send_data_header(to_peer, 0);
 }
 
+#if FBADB_MAIN
 static void
-send_stat_packet(int to_peer, int xfer_fd)
+send_range_msg(int to_peer, uint64_t offset, uint64_t length)
 {
-    struct stat st;
-    if (fstat(xfer_fd, &st) == -1)
-        die_errno("fstat");
     struct xfer_msg m = {
-        .type = XFER_MSG_STAT,
-        .u.stat.atime = st.st_atime,
-        .u.stat.mtime = st.st_mtime,
-#ifdef HAVE_STRUCT_STAT_ST_ATIM
-        .u.stat.atime_ns = st.st_atim.tv_nsec,
-#endif
-#ifdef HAVE_STRUCT_STAT_ST_MTIM
-        .u.stat.mtime_ns = st.st_mtim.tv_nsec,
-#endif
-        .u.stat.size = st.st_size,
-        .u.stat.ugo_bits = st.st_mode & 0777,
+        .type = XFER_MSG_RANGE,
+        .u.range.offset = offset,
+        .u.range.length = length,
     };
 
     send_xfer_msg(to_peer, &m);
 }
 
-struct xfer_ctx {
+// One connection's share of a --streams transfer, covering the bytes
+// from POS to END.  Stream zero is the main connection.
+struct xfer_stream {
+    struct child* peer; // NULL for the main connection
     int from_peer;
     int to_peer;
-    const struct cmd_xfer_stub_info* info;
+    uint64_t pos;
+    uint64_t end;
+    bool done;
 };
 
-static uint32_t
-recv_data_header(int from_peer)
+// Decide how many ranges to cut SIZE bytes into and store the size of
+// each range but the last in *RANGE_SIZE.
+static unsigned
+plan_ranges(uint64_t size, unsigned nr_streams, uint64_t* range_size)
 {
-    struct xfer_msg m = recv_xfer_msg(from_peer);
-    if (m.type != XFER_MSG_DATA)
-        die(ECOMM, "unexpected message type %u", (unsigned) m.type);
-    return m.u.data.payload_size;
+    uint64_t nr_ranges = XMIN(size / XFER_MIN_RANGE, (uint64_t) nr_streams);
+    if (nr_ranges < 2)
+        return 1;
+    uint64_t align = XFER_MAX_CHUNK;
+    uint64_t rsz = (size + nr_ranges - 1) / nr_ranges;
+    rsz = (rsz + align - 1) / align * align;
+    *range_size = rsz;
+    return (unsigned) ((size + rsz - 1) / rsz);
 }
 
-static void
-send_data_header(int to_peer, uint32_t size)
+// Tell the main connection how much it carries and open a connection
+// running xfer-stub in MODE on FILENAME for each other range.
+static struct xfer_stream*
+start_streams(const struct xfer_streams* xs,
+              const char* mode,
+              const char* filename,
+              uint64_t size,
+              unsigned nr_ranges,
+              uint64_t range_size,
+              int from_peer,
+              int to_peer)
 {
-    struct xfer_msg m = {
-        .type = XFER_MSG_DATA,
-        .u.data.payload_size = size,
+    struct xfer_stream* streams = xcalloc(nr_ranges * sizeof (*streams));
+    struct cmd_xfer_stub_info range_info = {
+        .mode = mode,
+        .filename = filename,
+        .xfer = xs->remote->xfer,
     };
 
-    send_xfer_msg(to_peer, &m);
+    for (unsigned i = 0; i < nr_ranges; ++i) {
+        struct xfer_stream* st = &streams[i];
+        st->pos = i * range_size;
+        st->end = XMIN(size, st->pos + range_size);
+        if (i == 0) {
+            st->from_peer = from_peer;
+            st->to_peer = to_peer;
+        } else {
+            st->peer = start_peer(
+                xs->spi,
+                make_args_cmd_xfer_stub(
+                    CMD_ARG_NAME | CMD_ARG_FORWARDED,
+                    &range_info));
+            st->from_peer = st->peer->fd[1]->fd;
+            st->to_peer = st->peer->fd[0]->fd;
+        }
+        send_range_msg(st->to_peer, st->pos, st->end - st->pos);
+    }
+
+    dbg("split %llu bytes into %u ranges of %llu",
+        (unsigned long long) size,
+        nr_ranges,
+        (unsigned long long) range_size);
+    return streams;
 }
 
-static uint64_t
-copy_loop_posix_recv(
-    int from_peer,
-    int dest_fd)
+static void
+finish_streams(struct xfer_stream* streams, unsigned nr_ranges)
+{
+    for (unsigned i = 1; i < nr_ranges; ++i)
+        child_wait_die_on_error(streams[i].peer);
+}
+
+// Send SOURCE_FD over STREAMS, a chunk to each in turn so that they
+// all make progress, and wait for the range connections to say
+// they've written their parts.
+static void
+send_streams(struct xfer_stream* streams,
+             unsigned nr_ranges,
+             int source_fd)
 {
     SCOPED_RESLIST(rl);
     struct growable_buffer buf = { 0 };
-    uint64_t total_written = 0;
-    size_t chunksz;
-
-    do {
-        chunksz = recv_data_header(from_peer);
-        dbg("data chunk header chunksz=%u", (unsigned) chunksz);
-        resize_buffer(&buf, chunksz);
-        if (read_all(from_peer, buf.buf, chunksz) != chunksz)
-            die(ECOMM, "unexpected EOF");
-        write_all(dest_fd, buf.buf, chunksz);
-        if (SATADD(&total_written, total_written, chunksz))
-            die(ECOMM, "file size too large");
-    } while (chunksz > 0);
+    bool sendfile_ok = true;
+    unsigned nr_done = 0;
+    while (nr_done < nr_ranges) {
+        for (unsigned i = 0; i < nr_ranges; ++i) {
+            struct xfer_stream* st = &streams[i];
+            if (st->done)
+                continue;
+            size_t chunksz = XMIN(st->end - st->pos,
+                                  (uint64_t) XFER_STREAM_CHUNK);
+            if (chunksz == 0) {
+                send_data_header(st->to_peer, 0);
+                st->done = true;
+                nr_done += 1;
+                continue;
+            }
+            send_chunk_at(st->to_peer, source_fd, st->pos, chunksz,
+                          &sendfile_ok, &buf);
+            st->pos += chunksz;
+        }
+    }
 
-    return total_written;
+    for (unsigned i = 1; i < nr_ranges; ++i)
+        recv_end_msg(streams[i].from_peer);
+    finish_streams(streams, nr_ranges);
 }
 
+// Receive into DEST_FD a chunk from each of STREAMS in turn.
 static void
-copy_loop_posix_send(
-    int to_peer,
-    int source_fd)
+recv_streams(struct xfer_stream* streams,
+             unsigned nr_ranges,
+             int dest_fd)
 {
     SCOPED_RESLIST(rl);
-    size_t bufsz = 32 * 1024;
-    uint8_t* buf = xalloc(bufsz);
-    size_t nr_read;
+    struct growable_buffer buf = { 0 };
+    unsigned nr_done = 0;
+    while (nr_done < nr_ranges) {
+        for (unsigned i = 0; i < nr_ranges; ++i) {
+            struct xfer_stream* st = &streams[i];
+            if (st->done)
+                continue;
+            struct xfer_msg m = recv_xfer_msg(st->from_peer);
+            if (m.type != XFER_MSG_DATA)
+                die(ECOMM, "unexpected message type %u",
+                    (unsigned) m.type);
+            size_t chunksz = m.u.data.payload_size;
+            if (chunksz == 0) {
+                if (st->pos != st->end)
+                    die(ECOMM, "range ended early");
+                st->done = true;
+                nr_done += 1;
+                continue;
+            }
+            if (chunksz > st->end - st->pos)
+                die(ECOMM, "range overflow");
+            stats_count_chunk(chunksz);
+            grow_buffer(&buf, chunksz);
+            peer_read_data(st->from_peer, buf.buf, chunksz);
+            double start = stats_clock();
+            pwrite_all(dest_fd, buf.buf, chunksz, st->pos);
+            stats_charge(start, XFER_TIME_DISK);
+            st->pos += chunksz;
+        }
+    }
 
-    assert(bufsz <= UINT32_MAX);
+    finish_streams(streams, nr_ranges);
+}
+#endif
 
-    do {
-        nr_read = read_all(source_fd, buf, bufsz);
-        send_data_header(to_peer, nr_read);
-        write_all(to_peer, buf, nr_read);
-    } while (nr_read > 0);
+// Receive the main connection's part of a --streams transfer into
+// DEST_FD, which is the file named FILENAME; SHARED_NAME is the name
+// to give the host for writing ranges, or "" if it can't.  Return the
+// size of the file once all ranges are in.
+static uint64_t
+recv_main_stream(const struct xfer_streams* xs,
+                 const char* filename,
+                 const char* shared_name,
+                 uint64_t size,
+                 int from_peer,
+                 int to_peer,
+                 int dest_fd)
+{
+    send_file_msg(to_peer, shared_name);
+
+#if FBADB_MAIN
+    if (xs->spi != NULL) {
+        uint64_t range_size;
+        unsigned nr_ranges = shared_name[0]
+            ? plan_ranges(size, xs->nr_streams, &range_size)
+            : 1;
+        if (nr_ranges == 1) {
+            send_range_msg(to_peer, 0, XFER_RANGE_ALL);
+            return copy_loop_posix_recv(from_peer, dest_fd, -1, 0, 0, NULL);
+        }
+        recv_streams(
+            start_streams(xs, "send-range", xs->remote->filename,
+                          size, nr_ranges, range_size,
+                          from_peer, to_peer),
+            nr_ranges,
+            dest_fd);
+        return size;
+    }
+#endif
+
+    (void) filename;
+    struct xfer_msg range = recv_range_msg(from_peer);
+    if (range.u.range.offset != 0)
+        die(ECOMM, "main stream must start at zero");
+    uint64_t total_written =
+        copy_loop_posix_recv(from_peer, dest_fd, -1, 0, 0, NULL);
+    recv_end_msg(from_peer); // Wait for the other ranges
+    if (range.u.range.length == XFER_RANGE_ALL)
+        return total_written;
+    if (total_written != range.u.range.length)
+        die(ECOMM, "main stream length mismatch");
+    return size;
 }
 
-static void
-do_xfer_recv(const struct xfer_opts xfer_opts,
-             const char* filename,
-             const char* desired_basename,
-             int from_peer)
+// A received file whose contents we've written but which we haven't
+// yet synced or moved into place.  DEST_FD is -1 if we skipped the
+// file because we already had it.
+struct xfer_pending {
+    struct reslist* rl;
+    int dest_fd;
+    const char* filename;
+    const char* rename_to;
+    const char* parent_directory;
+    struct cleanup* error_cl;
+};
+
+// Receive a file from FROM_PEER.  The pending file is owned by the
+// current reslist; pass it to xfer_recv_finish exactly once.
+static struct xfer_pending*
+xfer_recv_start(const struct xfer_opts xfer_opts,
+                const char* filename,
+                const char* desired_basename,
+                int from_peer,
+                int to_peer,
+                const struct xfer_streams* xs)
 {
+    struct xfer_pending* pending = xcalloc(sizeof (*pending));
+    pending->rl = reslist_create();
+    WITH_CURRENT_RESLIST(pending->rl);
+
     struct xfer_msg statm = recv_xfer_msg(from_peer);
     if (statm.type != XFER_MSG_STAT)
         die(ECOMM, "expected stat msg");
@@ -229,6 +1554,17 @@ do_xfer_recv(const struct xfer_opts xfer_opts,
     if (parent_directory == NULL)
         parent_directory = xdirname(filename);
 
+    if (xfer_opts.if_changed &&
+        recv_check_unchanged(from_peer, to_peer, filename, &statm))
+    {
+        dbg("\"%s\" is unchanged: skipping", filename);
+        pending->dest_fd = -1;
+        pending->filename = filename;
+        pending->parent_directory = parent_directory;
+        pending->error_cl = error_cl;
+        return pending;
+    }
+
     if (write_mode == NULL)
         write_mode = xfer_opts.write_mode;
 
@@ -267,16 +1603,22 @@ do_xfer_recv(const struct xfer_opts xfer_opts,
 
     mode_t creat_mode = (chmod_explicit_modes ? 0200 : 0666);
 
+    // A resumable transfer writes to a partial file with a
+    // predictable name so that the next attempt can find it.
+    bool resumable = xfer_opts.resume;
+
     if (atomic) {
         rename_to = filename;
         filename =
             xaprintf("%s/.%s.fb-adb-%s",
                      xdirname(filename),
                      xbasename(filename),
-                     gen_hex_random(ENOUGH_ENTROPY));
+                     (resumable
+                      ? "partial"
+                      : gen_hex_random(ENOUGH_ENTROPY)));
         dest_fd = try_xopen(
             filename,
-            O_CREAT | O_WRONLY | O_EXCL,
+            O_CREAT | O_WRONLY | (resumable ? 0 : O_EXCL),
             creat_mode);
         if (dest_fd == -1) {
             if (errno == EACCES && automatic_mode) {
@@ -289,21 +1631,67 @@ do_xfer_recv(const struct xfer_opts xfer_opts,
         }
     }
 
+    if (!atomic)
+        resumable = false;
+
     if (!atomic) {
         dest_fd = xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, creat_mode);
         if (!S_ISREG(xfstat(dest_fd).st_mode))
             regular_file = false;
     }
 
-    if (regular_file)
+    if (regular_file && !resumable)
         cleanup_commit(error_cl, unlink_cleanup, filename);
 
-    if (regular_file && statm.u.stat.size > 0)
+    struct xfer_checkpoint* checkpoint = NULL;
+    uint64_t resume_offset = 0;
+    if (resumable) {
+        xflock(dest_fd, LOCK_EX);
+        checkpoint = checkpoint_open(
+            xaprintf("%s/.%s.fb-adb-checkpoint",
+                     xdirname(rename_to),
+                     xbasename(rename_to)),
+            &statm);
+    }
+
+    if (xfer_opts.resume)
+        resume_offset = negotiate_resume_recv(
+            from_peer, to_peer, dest_fd, checkpoint);
+
+    // We can build on the old contents only if they're still there.
+    int basis_fd = -1;
+    uint32_t block_size = 0;
+    uint32_t nr_blocks = 0;
+    if (xfer_opts.delta) {
+        if (atomic) {
+            basis_fd = try_xopen(rename_to, O_RDONLY, 0);
+            if (basis_fd != -1 && !S_ISREG(xfstat(basis_fd).st_mode))
+                basis_fd = -1;
+        }
+        block_size = send_signature(to_peer, basis_fd, &nr_blocks);
+    }
+
+    // Preallocating would fill in the holes of a sparse file.
+    if (regular_file &&
+        statm.u.stat.size > 0 &&
+        !(statm.u.stat.flags & XFER_STAT_SPARSE))
+    {
         preallocated = fallocate_if_supported(
             dest_fd,
             statm.u.stat.size);
+    }
+
+    uint64_t total_written;
+    if (xs != NULL)
+        total_written = recv_main_stream(
+            xs, filename, regular_file ? filename : "",
+            statm.u.stat.size, from_peer, to_peer, dest_fd);
+    else
+        total_written = resume_offset + copy_loop_posix_recv(
+            from_peer, dest_fd, basis_fd, block_size, nr_blocks, checkpoint);
 
-    uint64_t total_written = copy_loop_posix_recv(from_peer, dest_fd);
+    if (checkpoint != NULL)
+        unlink(checkpoint->filename);
 
     if (preallocated && total_written < statm.u.stat.size)
         xftruncate(dest_fd, total_written);
@@ -326,21 +1714,211 @@ do_xfer_recv(const struct xfer_opts xfer_opts,
         if (fchmod(dest_fd, chmod_explicit_modes) == -1)
             die_errno("fchmod");
 
-    if (xfer_opts.sync)
-        xfsync(dest_fd);
+    pending->dest_fd = dest_fd;
+    pending->filename = filename;
+    pending->rename_to = rename_to;
+    pending->parent_directory = parent_directory;
+    pending->error_cl = error_cl;
+    return pending;
+}
+
+// Finish receiving PENDING, syncing file contents if SYNC_FILE and
+// the parent directory if SYNC_DIRECTORY.
+static void
+xfer_recv_finish(struct xfer_pending* pending,
+                 bool sync_file,
+                 bool sync_directory)
+{
+    if (sync_file && pending->dest_fd != -1)
+        stats_fsync(pending->dest_fd);
+
+    if (pending->rename_to)
+        xrename(pending->filename, pending->rename_to);
+
+    if (sync_directory)
+        stats_fsync(xopen(pending->parent_directory, O_DIRECTORY|O_RDONLY, 0));
+
+    cleanup_forget(pending->error_cl);
+    reslist_destroy(pending->rl);
+}
+
+static void
+do_xfer_recv(const struct xfer_opts xfer_opts,
+             const char* filename,
+             const char* desired_basename,
+             int from_peer,
+             int to_peer,
+             const struct xfer_streams* xs)
+{
+    SCOPED_RESLIST(rl);
+    xfer_recv_finish(
+        xfer_recv_start(xfer_opts,
+                        filename,
+                        desired_basename,
+                        from_peer,
+                        to_peer,
+                        xs),
+        xfer_opts.sync,
+        xfer_opts.sync);
+}
+
+// Receive files into DIRECTORY until the sender says it's done.  If
+// REQUEST is not NULL, first ask the sender for those files.
+//
+// When syncing, we'd rather not stop reading the connection while
+// each file reaches storage, so we ask the kernel to start writing
+// each file as soon as we have it and fsync and rename it only once
+// XFER_SYNC_WINDOW newer files have arrived.  The directory needs
+// only one fsync, at the end.
+static void
+do_xfer_recv_many(const struct xfer_opts xfer_opts,
+                  const char* directory,
+                  const char* const* request,
+                  int from_peer,
+                  int to_peer)
+{
+    SCOPED_RESLIST(rl);
 
-    if (rename_to)
-        xrename(filename, rename_to);
+    struct stat st;
+    if (stat(directory, &st) == -1)
+        die_errno("stat(\"%s\")", directory);
+    if (!S_ISDIR(st.st_mode))
+        die(ENOTDIR, "\"%s\" is not a directory", directory);
+
+    if (request != NULL) {
+        for (const char* const* namep = request; *namep; ++namep)
+            send_file_msg(to_peer, *namep);
+        send_end_msg(to_peer);
+    }
+
+    struct xfer_pending* window[XFER_SYNC_WINDOW];
+    size_t nr_pending = 0;
+    size_t oldest = 0;
+    char* name;
+
+    while ((name = recv_file_name(from_peer)) != NULL) {
+        if (name[0] == '\0' || strchr(name, '/') ||
+            !strcmp(name, ".") || !strcmp(name, ".."))
+        {
+            die(ECOMM, "invalid file name from peer: \"%s\"", name);
+        }
+
+        struct xfer_pending* pending =
+            xfer_recv_start(xfer_opts, directory, name,
+                            from_peer, to_peer, NULL);
+
+        if (!xfer_opts.sync || pending->dest_fd == -1) {
+            xfer_recv_finish(pending, false, false);
+            continue;
+        }
+
+        start_writeback(pending->dest_fd);
+        if (nr_pending < XFER_SYNC_WINDOW) {
+            window[nr_pending++] = pending;
+        } else {
+            xfer_recv_finish(window[oldest], true, false);
+            window[oldest] = pending;
+            oldest = (oldest + 1) % XFER_SYNC_WINDOW;
+        }
+    }
+
+    for (size_t i = 0; i < nr_pending; ++i)
+        xfer_recv_finish(window[(oldest + i) % XFER_SYNC_WINDOW],
+                         true, false);
 
     if (xfer_opts.sync)
-        xfsync(xopen(parent_directory, O_DIRECTORY|O_RDONLY, 0));
+        stats_fsync(xopen(directory, O_DIRECTORY|O_RDONLY, 0));
+}
+
+static void
+munmap_cleanup(void* data)
+{
+    struct iovec* mapping = data;
+    munmap(mapping->iov_base, mapping->iov_len);
+}
+
+// Map the regular file FD for reading, or return NULL if it's not a
+// regular file or we can't map it.
+static const uint8_t*
+map_source_file(int fd, size_t* size_out)
+{
+    struct stat st = xfstat(fd);
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (uint64_t) st.st_size > SIZE_MAX)
+    {
+        return NULL;
+    }
+
+    struct iovec* mapping = xcalloc(sizeof (*mapping));
+    struct cleanup* cl = cleanup_allocate();
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        dbg("mmap of source failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    mapping->iov_base = data;
+    mapping->iov_len = st.st_size;
+    cleanup_commit(cl, munmap_cleanup, mapping);
+    *size_out = st.st_size;
+    return data;
+}
+
+// Send SOURCE_FD on the main connection of a --streams transfer,
+// opening more connections if we're the host and it's worth it.
+static void
+send_main_stream(const struct xfer_streams* xs,
+                 int source_fd,
+                 int from_peer,
+                 int to_peer)
+{
+    char* shared_name = recv_file_name(from_peer);
+    if (shared_name == NULL)
+        die(ECOMM, "expected file name");
+
+#if FBADB_MAIN
+    if (xs->spi != NULL) {
+        struct stat st = xfstat(source_fd);
+        uint64_t range_size;
+        unsigned nr_ranges = (shared_name[0] && S_ISREG(st.st_mode))
+            ? plan_ranges(st.st_size, xs->nr_streams, &range_size)
+            : 1;
+        if (nr_ranges == 1) {
+            send_range_msg(to_peer, 0, XFER_RANGE_ALL);
+            hint_sequential_access(source_fd);
+            copy_loop_posix_send(to_peer, source_fd);
+        } else {
+            send_streams(
+                start_streams(xs, "recv-range", shared_name,
+                              st.st_size, nr_ranges, range_size,
+                              from_peer, to_peer),
+                nr_ranges,
+                source_fd);
+        }
+        send_end_msg(to_peer);
+        return;
+    }
+#endif
 
-    cleanup_forget(error_cl);
+    struct xfer_msg range = recv_range_msg(from_peer);
+    if (range.u.range.length == XFER_RANGE_ALL) {
+        hint_sequential_access(source_fd);
+        copy_loop_posix_send(to_peer, source_fd);
+    } else {
+        copy_range_send(to_peer, source_fd,
+                        range.u.range.offset,
+                        range.u.range.length);
+    }
 }
 
 static void
-do_xfer_send(int to_peer, const char* filename)
+do_xfer_send(const struct xfer_opts xfer_opts,
+             const char* filename,
+             int from_peer,
+             int to_peer,
+             const struct xfer_streams* xs)
 {
+    SCOPED_RESLIST(rl);
     int fd;
 
     if (!strcmp(filename, "-"))
@@ -349,11 +1927,96 @@ do_xfer_send(int to_peer, const char* filename)
         fd = xopen(filename, O_RDONLY, 0);
     dbg("opened %s as %d", filename, fd);
     send_stat_packet(to_peer, fd);
+    if (xfer_opts.if_changed &&
+        send_check_unchanged(from_peer, to_peer, fd))
+    {
+        dbg("peer already has %s", filename);
+        return;
+    }
+    if (xs != NULL) {
+        send_main_stream(xs, fd, from_peer, to_peer);
+        return;
+    }
+    if (xfer_opts.resume)
+        negotiate_resume_send(from_peer, to_peer, fd);
+    if (xfer_opts.delta) {
+        struct delta_signature* sig = recv_signature(from_peer);
+        size_t size;
+        const uint8_t* data;
+        if (sig->nr_blocks > 0 && (data = map_source_file(fd, &size))) {
+            dbg("sending delta against %u blocks of %u bytes",
+                (unsigned) sig->nr_blocks,
+                (unsigned) sig->block_size);
+            copy_loop_delta_send(to_peer, sig, data, size);
+            return;
+        }
+    }
     dbg("sent stat packet; entering copy loop");
     hint_sequential_access(fd);
     copy_loop_posix_send(to_peer, fd);
 }
 
+// Send the files named in FILENAMES, or if FILENAMES is NULL, the
+// ones our peer asks for.  Resolve relative names against DIRECTORY.
+static void
+do_xfer_send_many(const struct xfer_opts xfer_opts,
+                  const char* directory,
+                  const char* const* filenames,
+                  int from_peer,
+                  int to_peer)
+{
+    SCOPED_RESLIST(rl);
+
+    if (filenames == NULL) {
+        struct strlist* requested = strlist_new();
+        char* name;
+        while ((name = recv_file_name(from_peer)) != NULL)
+            strlist_append(requested, name);
+        filenames = strlist_to_argv(requested);
+    }
+
+    for (const char* const* namep = filenames; *namep; ++namep) {
+        SCOPED_RESLIST(rl_file);
+        const char* name = *namep;
+        if (!strcmp(name, "-"))
+            die(EINVAL, "cannot send standard input with other files");
+        if (name[0] != '/' && strcmp(directory, ".") != 0)
+            name = xaprintf("%s/%s", directory, name);
+        send_file_msg(to_peer, xbasename(name));
+        do_xfer_send(xfer_opts, name, from_peer, to_peer, NULL);
+    }
+
+    send_end_msg(to_peer);
+}
+
+// Write one range of a --streams transfer into FILENAME, which the
+// main connection's receiver has already created.
+static void
+do_xfer_recv_range(const char* filename, int from_peer, int to_peer)
+{
+    SCOPED_RESLIST(rl);
+    struct xfer_msg range = recv_range_msg(from_peer);
+    int dest_fd = xopen(filename, O_WRONLY, 0);
+    if (lseek(dest_fd, range.u.range.offset, SEEK_SET) == (off_t) -1)
+        die_errno("lseek");
+    uint64_t total_written =
+        copy_loop_posix_recv(from_peer, dest_fd, -1, 0, 0, NULL);
+    if (total_written != range.u.range.length)
+        die(ECOMM, "range length mismatch");
+    send_end_msg(to_peer);
+}
+
+static void
+do_xfer_send_range(const char* filename, int from_peer, int to_peer)
+{
+    SCOPED_RESLIST(rl);
+    struct xfer_msg range = recv_range_msg(from_peer);
+    int source_fd = xopen(filename, O_RDONLY, 0);
+    copy_range_send(to_peer, source_fd,
+                    range.u.range.offset,
+                    range.u.range.length);
+}
+
 static void
 do_xfer(struct xfer_ctx* ctx)
 {
@@ -362,18 +2025,80 @@ do_xfer(struct xfer_ctx* ctx)
     dbg("do_xfer in %s mode filename=[%s] desired_basename=[%s]",
         info->mode, info->filename, info->desired_basename);
 
+    if (info->xfer.delta && info->xfer.resume)
+        die(EINVAL, "--delta and --resume cannot be used together");
+
+    if (info->xfer.stats) {
+        xfer_stats_on = true;
+        xfer_stats.start = xclock_gettime(CLOCK_MONOTONIC);
+    }
+
+    struct xfer_streams xs_buf = {
+        .nr_streams = info->xfer.streams
+            ? parse_streams(info->xfer.streams)
+            : 1,
+        .spi = ctx->spi,
+        .remote = ctx->remote,
+    };
+
+    const struct xfer_streams* xs = NULL;
+    if (xs_buf.nr_streams > 1) {
+        if (info->xfer.delta || info->xfer.resume)
+            die(EINVAL, "--streams cannot be combined with "
+                "--delta or --resume");
+        xs = &xs_buf;
+    }
+
     if (strcmp(info->mode, "recv") == 0) {
         do_xfer_recv(info->xfer,
                      info->filename,
                      info->desired_basename,
-                     ctx->from_peer);
+                     ctx->from_peer,
+                     ctx->to_peer,
+                     xs);
     } else if (strcmp(info->mode, "send") == 0) {
-        do_xfer_send(ctx->to_peer, info->filename);
+        do_xfer_send(info->xfer,
+                     info->filename,
+                     ctx->from_peer,
+                     ctx->to_peer,
+                     xs);
+    } else if (strcmp(info->mode, "recv-range") == 0) {
+        do_xfer_recv_range(info->filename, ctx->from_peer, ctx->to_peer);
+    } else if (strcmp(info->mode, "send-range") == 0) {
+        do_xfer_send_range(info->filename, ctx->from_peer, ctx->to_peer);
+    } else if (strcmp(info->mode, "recv-many") == 0) {
+        do_xfer_recv_many(info->xfer,
+                          info->filename,
+                          ctx->filenames,
+                          ctx->from_peer,
+                          ctx->to_peer);
+    } else if (strcmp(info->mode, "send-many") == 0) {
+        do_xfer_send_many(info->xfer,
+                          info->filename,
+                          ctx->filenames,
+                          ctx->from_peer,
+                          ctx->to_peer);
     } else {
         die(EINVAL, "invalid xfer mode %s", info->mode);
     }
 }
 
+static struct xfer_msg
+make_stats_msg(void)
+{
+    struct xfer_msg m = {
+        .type = XFER_MSG_STATS,
+        .u.stats.bytes = xfer_stats.bytes,
+        .u.stats.chunks = xfer_stats.chunks,
+        .u.stats.wall_us = stats_us(
+            xclock_gettime(CLOCK_MONOTONIC) - xfer_stats.start),
+    };
+
+    for (unsigned i = 0; i < XFER_NR_TIME_KINDS; ++i)
+        m.u.stats.time_us[i] = stats_us(xfer_stats.time[i]);
+    return m;
+}
+
 int
 xfer_stub_main(const struct cmd_xfer_stub_info* info)
 {
@@ -385,14 +2110,66 @@ xfer_stub_main(const struct cmd_xfer_stub_info* info)
 
     set_prgname("");
     do_xfer(&ctx);
+
+    // Range connections' work is part of the host's report.
+    if (xfer_stats_on && strstr(info->mode, "-range") == NULL) {
+        struct xfer_msg m = make_stats_msg();
+        send_xfer_msg(ctx.to_peer, &m);
+    }
+
     return 0;
 }
 
 #if FBADB_MAIN
+static const char* const xfer_time_names[XFER_NR_TIME_KINDS] = {
+    "peer_us",
+    "disk_us",
+    "splice_us",
+    "fsync_us",
+};
+
+static void
+emit_stats(struct json_writer* writer, const struct xfer_msg* m)
+{
+    json_begin_object(writer);
+    json_begin_field(writer, "bytes");
+    json_emit_u64(writer, m->u.stats.bytes);
+    json_begin_field(writer, "chunks");
+    json_emit_u64(writer, m->u.stats.chunks);
+    json_begin_field(writer, "wall_us");
+    json_emit_u64(writer, m->u.stats.wall_us);
+    for (unsigned i = 0; i < XFER_NR_TIME_KINDS; ++i) {
+        json_begin_field(writer, xfer_time_names[i]);
+        json_emit_u64(writer, m->u.stats.time_us[i]);
+    }
+    json_begin_field(writer, "kb_per_s");
+    json_emit_u64(writer, m->u.stats.wall_us
+                  ? m->u.stats.bytes * 1000 / m->u.stats.wall_us
+                  : 0);
+    json_end_object(writer);
+}
+
+// Write what --stats measured on both ends to standard error.
+static void
+report_stats(const struct xfer_msg* local, const struct xfer_msg* remote)
+{
+    SCOPED_RESLIST(rl);
+    struct json_writer* writer = json_writer_create(xstderr);
+    json_begin_object(writer);
+    json_begin_field(writer, "host");
+    emit_stats(writer, local);
+    json_begin_field(writer, "device");
+    emit_stats(writer, remote);
+    json_end_object(writer);
+    xputc('\n', xstderr);
+    xflush(xstderr);
+}
+
 int
 xfer_handle_command(
     const struct start_peer_info* spi,
     const struct cmd_xfer_stub_info* local,
+    const char* const* local_filenames,
     const struct cmd_xfer_stub_info* remote)
 {
     struct child* peer = start_peer(
@@ -405,9 +2182,21 @@ xfer_handle_command(
         .from_peer = peer->fd[1]->fd,
         .to_peer = peer->fd[0]->fd,
         .info = local,
+        .filenames = local_filenames,
+        .spi = spi,
+        .remote = remote,
     };
 
     do_xfer(&ctx);
+    if (xfer_stats_on) {
+        struct xfer_msg local_stats = make_stats_msg();
+        struct xfer_msg remote_stats = recv_xfer_msg(ctx.from_peer);
+        if (remote_stats.type != XFER_MSG_STATS)
+            die(ECOMM, "unexpected message type %u",
+                (unsigned) remote_stats.type);
+        report_stats(&local_stats, &remote_stats);
+    }
+
     child_wait_die_on_error(peer);
     return 0;
 }
@@ -16,9 +16,13 @@
 struct child;
 struct start_peer_info;
 
+// Run the xfer-stub described by REMOTE on the device and talk to it
+// according to LOCAL.  In the multi-file modes, LOCAL_FILENAMES lists
+// the files to send (for send-many) or to ask for (for recv-many).
 int xfer_handle_command(
     const struct start_peer_info* spi,
     const struct cmd_xfer_stub_info* local,
+    const char* const* local_filenames,
     const struct cmd_xfer_stub_info* remote);
 
 #endif